@@ -6,11 +6,11 @@ class BuildExt(build_ext):
     """A custom build extension for adding compiler-specific options."""
     c_opts = {
         'msvc': ['/EHsc', '/O2', '/W4'],
-        'unix': ['-O3', '-Wextra', '-Wall', '-Wconversion', '-g0'],
+        'unix': ['-O3', '-Wextra', '-Wall', '-Wconversion', '-g0', '-pthread'],
     }
     l_opts = {
         'msvc': [],
-        'unix': [],
+        'unix': ['-pthread'],
     }
 
     def build_extensions(self):
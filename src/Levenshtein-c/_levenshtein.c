@@ -87,8 +87,26 @@
 /* for debugging */
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#ifdef _WIN32
+#  include <windows.h>
+#  include <io.h>
+#else
+#  include <pthread.h>
+#  include <unistd.h>
+#  include <fcntl.h>
+#  include <time.h>
+#  include <sys/mman.h>
+#endif
 
 #include <assert.h>
+#include <stddef.h>
+#if defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define LEV_HAVE_SSE2 1
+#endif
 #include "_levenshtein.h"
 
 #define LEV_UNUSED(x) ((void)x)
@@ -102,4205 +120,14933 @@ munkers_blackman(size_t n1,
                  size_t n2,
                  double *dists);
 
+static size_t
+lev_indel_distance(size_t len1, const lev_byte *string1,
+                   size_t len2, const lev_byte *string2,
+                   size_t max);
+
+static size_t
+lev_u_indel_distance(size_t len1, const lev_wchar *string1,
+                     size_t len2, const lev_wchar *string2,
+                     size_t max);
+
+static int
+small_edit_distance(size_t len1, const void *string1,
+                    size_t len2, const void *string2,
+                    int unicode, size_t *d);
+
+static int
+small_editops(size_t len1, const void *string1, size_t off1,
+              size_t len2, const void *string2, size_t off2,
+              int unicode, LevEditOp **ops, size_t *n);
+
+static double
+finish_udistance_computations(size_t len1, lev_wchar *string1,
+                              size_t n, const size_t *lengths,
+                              const lev_wchar **strings,
+                              const double *weights, size_t **rows,
+                              size_t *row);
+
 /****************************************************************************
  *
- * Basic stuff, Levenshtein distance
+ * Threads
  *
  ****************************************************************************/
 /* {{{ */
 
-/**
- * lev_edit_distance:
- * @len1: The length of @string1.
- * @string1: A sequence of bytes of length @len1, may contain NUL characters.
- * @len2: The length of @string2.
- * @string2: A sequence of bytes of length @len2, may contain NUL characters.
- * @xcost: If nonzero, the replace operation has weight 2, otherwise all
- *         edit operations have equal weights of 1.
- *
- * Computes Levenshtein edit distance of two strings.
- *
- * Returns: The edit distance.
- **/
-static size_t
-lev_edit_distance(size_t len1, const lev_byte *string1,
-                  size_t len2, const lev_byte *string2,
-                  int xcost)
+typedef void (*LevWorkFunc)(void *data, size_t ithread, size_t nthreads);
+
+typedef struct {
+  LevWorkFunc func;
+  void *data;
+  size_t ithread;
+  size_t nthreads;
+  LevPriority priority;
+} LevWorker;
+
+/* Priority lanes.  Parallel calls run in the priority class of the thread
+ * that makes them (interactive unless changed with lev_priority_set()), and
+ * their worker threads inherit it.  The workers pass through checkpoints
+ * between small pieces of work; there, while any interactive call is
+ * running, the workers of batch calls pause, all of them but the first
+ * one, so a batch still makes progress. */
+#if defined(_MSC_VER)
+#  define LEV_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#  define LEV_THREAD_LOCAL __thread
+#else
+#  define LEV_THREAD_LOCAL _Thread_local
+#endif
+
+/* items between checkpoints in loops over cheap items */
+#define LEV_SCHED_GRAIN 64
+
+static LEV_THREAD_LOCAL LevPriority lev_thread_priority;  /* 0 = interactive */
+
+static struct {
+#ifdef _WIN32
+  SRWLOCK lock;
+  CONDITION_VARIABLE resume;
+#else
+  pthread_mutex_t lock;
+  pthread_cond_t resume;
+#endif
+  volatile size_t interactive;  /* running interactive calls */
+  LevSchedStats stats[LEV_PRIORITY_LAST];
+} lev_sched = {
+#ifdef _WIN32
+  SRWLOCK_INIT, CONDITION_VARIABLE_INIT,
+#else
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+#endif
+  0, { { 0, 0, 0, 0, 0.0, 0.0 } }
+};
+
+static void
+lev_sched_lock(void)
 {
-  size_t i;
-  size_t *row;  /* we only need to keep one row of costs */
-  size_t *end;
-  size_t half;
+#ifdef _WIN32
+  AcquireSRWLockExclusive(&lev_sched.lock);
+#else
+  pthread_mutex_lock(&lev_sched.lock);
+#endif
+}
 
-  /* strip common prefix */
-  while (len1 > 0 && len2 > 0 && *string1 == *string2) {
-    len1--;
-    len2--;
-    string1++;
-    string2++;
-  }
+static void
+lev_sched_unlock(void)
+{
+#ifdef _WIN32
+  ReleaseSRWLockExclusive(&lev_sched.lock);
+#else
+  pthread_mutex_unlock(&lev_sched.lock);
+#endif
+}
 
-  /* strip common suffix */
-  while (len1 > 0 && len2 > 0 && string1[len1-1] == string2[len2-1]) {
-    len1--;
-    len2--;
-  }
+/* monotonic time in seconds */
+static double
+lev_sched_clock(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER t, f;
+
+  QueryPerformanceCounter(&t);
+  QueryPerformanceFrequency(&f);
+  return (double)t.QuadPart/(double)f.QuadPart;
+#else
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1e-9*(double)t.tv_nsec;
+#endif
+}
 
-  /* catch trivial cases */
-  if (len1 == 0)
-    return len2;
-  if (len2 == 0)
-    return len1;
+static void
+lev_sched_enter(LevPriority priority)
+{
+  lev_sched_lock();
+  lev_sched.stats[priority].calls++;
+  lev_sched.stats[priority].running++;
+  if (priority == LEV_PRIORITY_INTERACTIVE)
+    lev_sched.interactive++;
+  lev_sched_unlock();
+}
 
-  /* make the inner cycle (i.e. string2) the longer one */
-  if (len1 > len2) {
-    size_t nx = len1;
-    const lev_byte *sx = string1;
-    len1 = len2;
-    len2 = nx;
-    string1 = string2;
-    string2 = sx;
-  }
-  /* check len1 == 1 separately */
-  if (len1 == 1) {
-    if (xcost)
-      return len2 + 1 - 2 * (size_t)(memchr(string2, *string1, len2) != NULL);
-    else
-      return len2 - (memchr(string2, *string1, len2) != NULL);
-  }
-  len1++;
-  len2++;
-  half = len1 >> 1;
+static void
+lev_sched_leave(LevPriority priority)
+{
+  lev_sched_lock();
+  lev_sched.stats[priority].running--;
+  if (priority == LEV_PRIORITY_INTERACTIVE && !--lev_sched.interactive) {
+#ifdef _WIN32
+    WakeAllConditionVariable(&lev_sched.resume);
+#else
+    pthread_cond_broadcast(&lev_sched.resume);
+#endif
+  }
+  lev_sched_unlock();
+}
 
-  /* initalize first row */
-  row = (size_t*)safe_malloc(len2, sizeof(size_t));
-  if (!row)
-    return (size_t)(-1);
-  end = row + len2 - 1;
-  for (i = 0; i < len2 - (xcost ? 0 : half); i++)
-    row[i] = i;
+/* the checkpoint of worker @ithread, it pauses batch workers while
+ * interactive calls run */
+static void
+lev_sched_checkpoint(size_t ithread)
+{
+  LevSchedStats *stats = lev_sched.stats + LEV_PRIORITY_BATCH;
+  double start, wait;
+
+  if (lev_thread_priority != LEV_PRIORITY_BATCH || !ithread
+      || !lev_sched.interactive)
+    return;
+  lev_sched_lock();
+  if (!lev_sched.interactive) {
+    lev_sched_unlock();
+    return;
+  }
+  stats->waiting++;
+  start = lev_sched_clock();
+  while (lev_sched.interactive) {
+#ifdef _WIN32
+    SleepConditionVariableSRW(&lev_sched.resume, &lev_sched.lock,
+                              INFINITE, 0);
+#else
+    pthread_cond_wait(&lev_sched.resume, &lev_sched.lock);
+#endif
+  }
+  wait = lev_sched_clock() - start;
+  stats->waiting--;
+  stats->pauses++;
+  stats->wait += wait;
+  if (wait > stats->max_wait)
+    stats->max_wait = wait;
+  lev_sched_unlock();
+}
 
-  /* go through the matrix and compute the costs.  yes, this is an extremely
-   * obfuscated version, but also extremely memory-conservative and relatively
-   * fast.  */
-  if (xcost) {
-    for (i = 1; i < len1; i++) {
-      size_t *p = row + 1;
-      const lev_byte char1 = string1[i - 1];
-      const lev_byte *char2p = string2;
-      size_t D = i;
-      size_t x = i;
-      while (p <= end) {
-        if (char1 == *(char2p++))
-          x = --D;
-        else
-          x++;
-        D = *p;
-        D++;
-        if (x > D)
-          x = D;
-        *(p++) = x;
-      }
-    }
-  }
-  else {
-    /* in this case we don't have to scan two corner triangles (of size len1/2)
-     * in the matrix because no best path can go throught them. note this
-     * breaks when len1 == len2 == 2 so the memchr() special case above is
-     * necessary */
-    row[0] = len1 - half - 1;
-    for (i = 1; i < len1; i++) {
-      size_t *p;
-      const lev_byte char1 = string1[i - 1];
-      const lev_byte *char2p;
-      size_t D, x;
-      /* skip the upper triangle */
-      if (i >= len1 - half) {
-        size_t offset = i - (len1 - half);
-        size_t c3;
-
-        char2p = string2 + offset;
-        p = row + offset;
-        c3 = *(p++) + (char1 != *(char2p++));
-        x = *p;
-        x++;
-        D = x;
-        if (x > c3)
-          x = c3;
-        *(p++) = x;
-      }
-      else {
-        p = row + 1;
-        char2p = string2;
-        D = x = i;
-      }
-      /* skip the lower triangle */
-      if (i <= half + 1)
-        end = row + len2 + i - half - 2;
-      /* main */
-      while (p <= end) {
-        size_t c3 = --D + (char1 != *(char2p++));
-        x++;
-        if (x > c3)
-          x = c3;
-        D = *p;
-        D++;
-        if (x > D)
-          x = D;
-        *(p++) = x;
-      }
-      /* lower triangle sentinel */
-      if (i <= half) {
-        size_t c3 = --D + (char1 != *char2p);
-        x++;
-        if (x > c3)
-          x = c3;
-        *p = x;
-      }
-    }
-  }
+/**
+ * lev_priority_set:
+ * @priority: The new priority class.
+ *
+ * Sets the priority class of parallel calls made by the calling thread.
+ * Threads start with %LEV_PRIORITY_INTERACTIVE.
+ *
+ * Returns: The previous priority class.
+ **/
+LevPriority
+lev_priority_set(LevPriority priority)
+{
+  LevPriority old = lev_thread_priority;
 
-  i = *end;
-  free(row);
-  return i;
+  lev_thread_priority = priority;
+  return old;
 }
 
 /**
- * lev_u_edit_distance:
- * @len1: The length of @string1.
- * @string1: A sequence of Unicode characters of length @len1, may contain NUL
- *           characters.
- * @len2: The length of @string2.
- * @string2: A sequence of Unicode characters of length @len2, may contain NUL
- *           characters.
- * @xcost: If nonzero, the replace operation has weight 2, otherwise all
- *         edit operations have equal weights of 1.
+ * lev_sched_begin:
  *
- * Computes Levenshtein edit distance of two Unicode strings.
+ * Marks the start of a call that runs on the calling thread only, like
+ * an edit sequence or a median, so it counts in the priority class of the
+ * thread as a parallel call does: while interactive ones run, the workers
+ * of batch calls pause.  Every lev_sched_begin() must be followed by a
+ * lev_sched_end() with its result.
  *
- * Returns: The edit distance.
+ * Returns: The priority class the call counts in.
  **/
+LevPriority
+lev_sched_begin(void)
+{
+  LevPriority priority = lev_thread_priority;
+
+  lev_sched_enter(priority);
+  return priority;
+}
+
+/**
+ * lev_sched_end:
+ * @priority: What the matching lev_sched_begin() returned.
+ *
+ * Marks the end of a call started with lev_sched_begin().
+ **/
+void
+lev_sched_end(LevPriority priority)
+{
+  lev_sched_leave(priority);
+}
+
+/**
+ * lev_sched_stats:
+ * @priority: A priority class.
+ * @stats: Where the statistics of the class should be stored.
+ *
+ * Reads the statistics of the parallel calls of a priority class (and of
+ * the single thread calls marked with lev_sched_begin()): their number,
+ * how many run now, and how many worker threads wait now (the queue
+ * depth), how often and how long they have waited.
+ **/
+void
+lev_sched_stats(LevPriority priority, LevSchedStats *stats)
+{
+  lev_sched_lock();
+  *stats = lev_sched.stats[priority];
+  lev_sched_unlock();
+}
+
+#ifdef _WIN32
+static DWORD WINAPI
+lev_worker_main(LPVOID arg)
+{
+  LevWorker *w = (LevWorker*)arg;
+
+  lev_thread_priority = w->priority;
+  w->func(w->data, w->ithread, w->nthreads);
+  return 0;
+}
+#else
+static void*
+lev_worker_main(void *arg)
+{
+  LevWorker *w = (LevWorker*)arg;
+
+  lev_thread_priority = w->priority;
+  w->func(w->data, w->ithread, w->nthreads);
+  return NULL;
+}
+#endif
+
+/* the number of processors online, at least one */
 static size_t
-lev_u_edit_distance(size_t len1, const lev_wchar *string1,
-                    size_t len2, const lev_wchar *string2,
-                    int xcost)
+lev_cpu_count(void)
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (size_t)info.dwNumberOfProcessors : 1;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return n > 0 ? (size_t)n : 1;
+#endif
+}
+
+/* run @func(@data, ithread, @nthreads) for all ithread in 0..nthreads-1,
+ * each in its own thread (ithread 0 in the calling one) and wait for all
+ * of them to finish.
+ * when a thread cannot be started its share of the work is done in the
+ * calling thread, so this never fails, it just gets slower */
+static void
+lev_run_parallel(size_t nthreads, LevWorkFunc func, void *data)
 {
+  LevWorker *workers;
   size_t i;
-  size_t *row;  /* we only need to keep one row of costs */
-  size_t *end;
-  size_t half;
+#ifdef _WIN32
+  HANDLE *threads;
+#else
+  pthread_t *threads;
+#endif
+  char *started;
+  LevPriority priority = lev_thread_priority;
+
+  lev_sched_enter(priority);
+  if (nthreads <= 1) {
+    func(data, 0, 1);
+    lev_sched_leave(priority);
+    return;
+  }
+  workers = (LevWorker*)safe_malloc(nthreads, sizeof(LevWorker));
+#ifdef _WIN32
+  threads = (HANDLE*)safe_malloc(nthreads, sizeof(HANDLE));
+#else
+  threads = (pthread_t*)safe_malloc(nthreads, sizeof(pthread_t));
+#endif
+  started = (char*)calloc(nthreads, sizeof(char));
+  if (!workers || !threads || !started) {
+    free(workers);
+    free(threads);
+    free(started);
+    for (i = 0; i < nthreads; i++)
+      func(data, i, nthreads);
+    lev_sched_leave(priority);
+    return;
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    workers[i].func = func;
+    workers[i].data = data;
+    workers[i].ithread = i;
+    workers[i].nthreads = nthreads;
+    workers[i].priority = priority;
+  }
+  for (i = 1; i < nthreads; i++) {
+#ifdef _WIN32
+    threads[i] = CreateThread(NULL, 0, lev_worker_main, workers + i, 0, NULL);
+    started[i] = (threads[i] != NULL);
+#else
+    started[i] = !pthread_create(threads + i, NULL,
+                                 lev_worker_main, workers + i);
+#endif
+  }
+  func(data, 0, nthreads);
+  for (i = 1; i < nthreads; i++) {
+    if (!started[i]) {
+      func(data, i, nthreads);
+      continue;
+    }
+#ifdef _WIN32
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+#else
+    pthread_join(threads[i], NULL);
+#endif
+  }
+
+  free(workers);
+  free(threads);
+  free(started);
+  lev_sched_leave(priority);
+}
 
-  /* strip common prefix */
-  while (len1 > 0 && len2 > 0 && *string1 == *string2) {
-    len1--;
-    len2--;
-    string1++;
-    string2++;
-  }
+/* A team of worker threads for a sequence of parallel steps, so the
+ * threads are started once rather than for every step.  It counts as one
+ * parallel call from lev_team_init() to lev_team_free(), its threads are
+ * started on demand by the first step that needs them and wait for the
+ * next step in between. */
+typedef struct LevTeam LevTeam;
+
+typedef struct {
+  LevTeam *team;
+  size_t ithread;
+  size_t step;  /* the last step before the thread was started */
+} LevTeamWorker;
+
+struct LevTeam {
+  size_t maxthreads;  /* the most threads a step may use */
+  size_t nthreads;  /* threads running, including the calling one */
+  LevPriority priority;
+  LevTeamWorker *workers;
+#ifdef _WIN32
+  HANDLE *threads;
+  SRWLOCK lock;
+  CONDITION_VARIABLE start;
+  CONDITION_VARIABLE done;
+#else
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+#endif
+  /* the step */
+  LevWorkFunc func;
+  void *data;
+  size_t active;  /* threads taking part in it, the others just wait */
+  size_t step;  /* steps started */
+  size_t pending;  /* threads yet to finish it */
+  int stop;
+};
 
-  /* strip common suffix */
-  while (len1 > 0 && len2 > 0 && string1[len1-1] == string2[len2-1]) {
-    len1--;
-    len2--;
-  }
+static void
+lev_team_lock(LevTeam *team)
+{
+#ifdef _WIN32
+  AcquireSRWLockExclusive(&team->lock);
+#else
+  pthread_mutex_lock(&team->lock);
+#endif
+}
 
-  /* catch trivial cases */
-  if (len1 == 0)
-    return len2;
-  if (len2 == 0)
-    return len1;
+static void
+lev_team_unlock(LevTeam *team)
+{
+#ifdef _WIN32
+  ReleaseSRWLockExclusive(&team->lock);
+#else
+  pthread_mutex_unlock(&team->lock);
+#endif
+}
 
-  /* make the inner cycle (i.e. string2) the longer one */
-  if (len1 > len2) {
-    size_t nx = len1;
-    const lev_wchar *sx = string1;
-    len1 = len2;
-    len2 = nx;
-    string1 = string2;
-    string2 = sx;
-  }
-  /* check len1 == 1 separately */
-  if (len1 == 1) {
-    lev_wchar z = *string1;
-    const lev_wchar *p = string2;
-    for (i = len2; i; i--) {
-      if (*(p++) == z)
-        return len2 - 1;
+static void
+lev_team_wait(LevTeam *team, int done)
+{
+#ifdef _WIN32
+  SleepConditionVariableSRW(done ? &team->done : &team->start, &team->lock,
+                            INFINITE, 0);
+#else
+  pthread_cond_wait(done ? &team->done : &team->start, &team->lock);
+#endif
+}
+
+static void
+lev_team_loop(LevTeamWorker *w)
+{
+  LevTeam *team = w->team;
+  size_t step = w->step;
+
+  lev_thread_priority = team->priority;
+  lev_team_lock(team);
+  for (;;) {
+    LevWorkFunc func;
+    void *data;
+    size_t active;
+
+    while (team->step == step && !team->stop)
+      lev_team_wait(team, 0);
+    if (team->stop)
+      break;
+    step = team->step;
+    func = team->func;
+    data = team->data;
+    active = team->active;
+    lev_team_unlock(team);
+    if (w->ithread < active)
+      func(data, w->ithread, active);
+    lev_team_lock(team);
+    if (!--team->pending) {
+#ifdef _WIN32
+      WakeConditionVariable(&team->done);
+#else
+      pthread_cond_signal(&team->done);
+#endif
     }
-    return len2 + (xcost != 0);
   }
-  len1++;
-  len2++;
-  half = len1 >> 1;
+  lev_team_unlock(team);
+}
 
-  /* initalize first row */
-  row = (size_t*)safe_malloc(len2, sizeof(size_t));
-  if (!row)
-    return (size_t)(-1);
-  end = row + len2 - 1;
-  for (i = 0; i < len2 - (xcost ? 0 : half); i++)
-    row[i] = i;
+#ifdef _WIN32
+static DWORD WINAPI
+lev_team_main(LPVOID arg)
+{
+  lev_team_loop((LevTeamWorker*)arg);
+  return 0;
+}
+#else
+static void*
+lev_team_main(void *arg)
+{
+  lev_team_loop((LevTeamWorker*)arg);
+  return NULL;
+}
+#endif
 
-  /* go through the matrix and compute the costs.  yes, this is an extremely
-   * obfuscated version, but also extremely memory-conservative and relatively
-   * fast.  */
-  if (xcost) {
-    for (i = 1; i < len1; i++) {
-      size_t *p = row + 1;
-      const lev_wchar char1 = string1[i - 1];
-      const lev_wchar *char2p = string2;
-      size_t D = i - 1;
-      size_t x = i;
-      while (p <= end) {
-        if (char1 == *(char2p++))
-          x = D;
-        else
-          x++;
-        D = *p;
-        if (x > D + 1)
-          x = D + 1;
-        *(p++) = x;
-      }
-    }
-  }
-  else {
-    /* in this case we don't have to scan two corner triangles (of size len1/2)
-     * in the matrix because no best path can go throught them. note this
-     * breaks when len1 == len2 == 2 so the memchr() special case above is
-     * necessary */
-    row[0] = len1 - half - 1;
-    for (i = 1; i < len1; i++) {
-      size_t *p;
-      const lev_wchar char1 = string1[i - 1];
-      const lev_wchar *char2p;
-      size_t D, x;
-      /* skip the upper triangle */
-      if (i >= len1 - half) {
-        size_t offset = i - (len1 - half);
-        size_t c3;
-
-        char2p = string2 + offset;
-        p = row + offset;
-        c3 = *(p++) + (char1 != *(char2p++));
-        x = *p;
-        x++;
-        D = x;
-        if (x > c3)
-          x = c3;
-        *(p++) = x;
-      }
-      else {
-        p = row + 1;
-        char2p = string2;
-        D = x = i;
-      }
-      /* skip the lower triangle */
-      if (i <= half + 1)
-        end = row + len2 + i - half - 2;
-      /* main */
-      while (p <= end) {
-        size_t c3 = --D + (char1 != *(char2p++));
-        x++;
-        if (x > c3)
-          x = c3;
-        D = *p;
-        D++;
-        if (x > D)
-          x = D;
-        *(p++) = x;
-      }
-      /* lower triangle sentinel */
-      if (i <= half) {
-        size_t c3 = --D + (char1 != *char2p);
-        x++;
-        if (x > c3)
-          x = c3;
-        *p = x;
-      }
+/* set up a team of at most @maxthreads threads, it never fails, when
+ * there's no memory for the threads it has just the calling one */
+static void
+lev_team_init(LevTeam *team, size_t maxthreads)
+{
+  team->priority = lev_thread_priority;
+  team->maxthreads = maxthreads ? maxthreads : 1;
+  team->nthreads = 1;
+  team->workers = NULL;
+  team->threads = NULL;
+  team->step = team->pending = 0;
+  team->stop = 0;
+  if (team->maxthreads > 1) {
+    team->workers = (LevTeamWorker*)safe_malloc(team->maxthreads,
+                                                sizeof(LevTeamWorker));
+#ifdef _WIN32
+    team->threads = (HANDLE*)safe_malloc(team->maxthreads, sizeof(HANDLE));
+#else
+    team->threads = (pthread_t*)safe_malloc(team->maxthreads,
+                                            sizeof(pthread_t));
+#endif
+    if (!team->workers || !team->threads) {
+      free(team->workers);
+      free(team->threads);
+      team->workers = NULL;
+      team->threads = NULL;
+      team->maxthreads = 1;
     }
   }
+#ifdef _WIN32
+  InitializeSRWLock(&team->lock);
+  InitializeConditionVariable(&team->start);
+  InitializeConditionVariable(&team->done);
+#else
+  pthread_mutex_init(&team->lock, NULL);
+  pthread_cond_init(&team->start, NULL);
+  pthread_cond_init(&team->done, NULL);
+#endif
+  lev_sched_enter(team->priority);
+}
 
-  i = *end;
-  free(row);
-  return i;
+/* run @func(@data, ithread, @nthreads) for all ithread in 0..nthreads-1
+ * on the team (ithread 0 in the calling thread) and wait for all of them
+ * to finish; when not enough threads can be started, it uses fewer */
+static void
+lev_team_run(LevTeam *team, size_t nthreads, LevWorkFunc func, void *data)
+{
+  if (nthreads > team->maxthreads)
+    nthreads = team->maxthreads;
+  while (team->nthreads < nthreads) {
+    LevTeamWorker *w = team->workers + team->nthreads;
+
+    w->team = team;
+    w->ithread = team->nthreads;
+    w->step = team->step;
+#ifdef _WIN32
+    team->threads[team->nthreads] = CreateThread(NULL, 0, lev_team_main,
+                                                 w, 0, NULL);
+    if (!team->threads[team->nthreads])
+      break;
+#else
+    if (pthread_create(team->threads + team->nthreads, NULL,
+                       lev_team_main, w))
+      break;
+#endif
+    team->nthreads++;
+  }
+  if (nthreads > team->nthreads) {
+    nthreads = team->nthreads;
+    team->maxthreads = nthreads;
+  }
+  if (nthreads <= 1) {
+    func(data, 0, 1);
+    return;
+  }
+
+  lev_team_lock(team);
+  team->func = func;
+  team->data = data;
+  team->active = nthreads;
+  team->pending = team->nthreads - 1;
+  team->step++;
+#ifdef _WIN32
+  WakeAllConditionVariable(&team->start);
+#else
+  pthread_cond_broadcast(&team->start);
+#endif
+  lev_team_unlock(team);
+  func(data, 0, nthreads);
+  lev_team_lock(team);
+  while (team->pending)
+    lev_team_wait(team, 1);
+  lev_team_unlock(team);
+}
+
+/* stop the threads of @team and free it */
+static void
+lev_team_free(LevTeam *team)
+{
+  size_t i;
+
+  lev_team_lock(team);
+  team->stop = 1;
+#ifdef _WIN32
+  WakeAllConditionVariable(&team->start);
+#else
+  pthread_cond_broadcast(&team->start);
+#endif
+  lev_team_unlock(team);
+  for (i = 1; i < team->nthreads; i++) {
+#ifdef _WIN32
+    WaitForSingleObject(team->threads[i], INFINITE);
+    CloseHandle(team->threads[i]);
+#else
+    pthread_join(team->threads[i], NULL);
+#endif
+  }
+#ifndef _WIN32
+  pthread_mutex_destroy(&team->lock);
+  pthread_cond_destroy(&team->start);
+  pthread_cond_destroy(&team->done);
+#endif
+  free(team->workers);
+  free(team->threads);
+  lev_sched_leave(team->priority);
+}
+
+/* a mutex, never held while waiting for anything else but other mutexes */
+#ifdef _WIN32
+typedef CRITICAL_SECTION LevMutex;
+
+static void
+lev_mutex_init(LevMutex *m)
+{
+  InitializeCriticalSection(m);
+}
+
+static void
+lev_mutex_destroy(LevMutex *m)
+{
+  DeleteCriticalSection(m);
+}
+
+static void
+lev_mutex_lock(LevMutex *m)
+{
+  EnterCriticalSection(m);
+}
+
+static void
+lev_mutex_unlock(LevMutex *m)
+{
+  LeaveCriticalSection(m);
+}
+#else
+typedef pthread_mutex_t LevMutex;
+
+static void
+lev_mutex_init(LevMutex *m)
+{
+  pthread_mutex_init(m, NULL);
+}
+
+static void
+lev_mutex_destroy(LevMutex *m)
+{
+  pthread_mutex_destroy(m);
+}
+
+static void
+lev_mutex_lock(LevMutex *m)
+{
+  pthread_mutex_lock(m);
+}
+
+static void
+lev_mutex_unlock(LevMutex *m)
+{
+  pthread_mutex_unlock(m);
+}
+#endif
+
+typedef struct {
+  size_t n;
+  LevTaskFunc func;
+  void *data;
+} LevTasks;
+
+static void
+lev_tasks_worker(void *data, size_t ithread, size_t nthreads)
+{
+  LevTasks *tasks = (LevTasks*)data;
+  size_t i;
+
+  for (i = ithread; i < tasks->n; i += nthreads) {
+    lev_sched_checkpoint(ithread);
+    tasks->func(tasks->data, i);
+  }
 }
 
+/**
+ * lev_run_tasks:
+ * @n: The number of tasks.
+ * @func: The task function, called as @func(@data, i) for i < @n.
+ * @data: The data passed to @func.
+ * @nthreads: The number of threads to use, zero means one per processor.
+ *
+ * Runs @n independent tasks in parallel.  Tasks are dealt to the threads
+ * round robin, so neighbouring (usually similar) tasks run on different
+ * threads.
+ **/
+void
+lev_run_tasks(size_t n, LevTaskFunc func, void *data, size_t nthreads)
+{
+  LevTasks tasks;
+
+  if (!nthreads)
+    nthreads = lev_cpu_count();
+  if (nthreads > n)
+    nthreads = n;
+  tasks.n = n;
+  tasks.func = func;
+  tasks.data = data;
+  lev_run_parallel(nthreads, lev_tasks_worker, &tasks);
+}
 /* }}} */
 
 /****************************************************************************
  *
- * Generalized medians, the greedy algorithm, and greedy improvements
+ * Tuning
  *
  ****************************************************************************/
 /* {{{ */
 
-/* compute the sets of symbols each string contains, and the set of symbols
- * in any of them (symset).  meanwhile, count how many different symbols
- * there are (used below for symlist). */
-static lev_byte*
-make_symlist(size_t n, const size_t *lengths,
-             const lev_byte *strings[], size_t *symlistlen)
+/* Engine parameters whose best values depend on the machine rather than on
+ * the data.  The compiled-in defaults are reasonable everywhere, tuned ones
+ * can be loaded from a file written by python -m Levenshtein.tune. */
+static struct {
+  size_t lcs_cutoff_interval;  /* text symbols between cutoff checks */
+  size_t deleteindex_chunk;  /* least words per thread in DeleteIndex build */
+  size_t sketch_chunk;  /* least strings per thread in sketch batches */
+  size_t nearest_chunk;  /* least sketches per thread in sketch search */
+  size_t cluster_batch;  /* words looked up between union-find passes */
+  size_t paired_chunk;  /* rows of paired scores dealt to a thread at once */
+  size_t token_chunk;  /* least strings per thread in token batches */
+  size_t improve_cells;  /* least matrix cells per median_improve thread */
+  size_t tile_size;  /* rows and columns of a score matrix tile, only read
+                        by Levenshtein.matrix */
+} lev_tuning = { 64, 64, 256, 4096, 65536, 1024, 256, 1 << 18, 1024 };
+
+static const struct {
+  const char *name;
+  size_t *value;
+} lev_tuning_params[] = {
+  { "lcs_cutoff_interval", &lev_tuning.lcs_cutoff_interval },
+  { "deleteindex_chunk", &lev_tuning.deleteindex_chunk },
+  { "sketch_chunk", &lev_tuning.sketch_chunk },
+  { "nearest_chunk", &lev_tuning.nearest_chunk },
+  { "cluster_batch", &lev_tuning.cluster_batch },
+  { "paired_chunk", &lev_tuning.paired_chunk },
+  { "token_chunk", &lev_tuning.token_chunk },
+  { "improve_cells", &lev_tuning.improve_cells },
+  { "tile_size", &lev_tuning.tile_size },
+};
+
+#define LEV_TUNING_NPARAMS \
+  (sizeof(lev_tuning_params)/sizeof(lev_tuning_params[0]))
+
+/**
+ * lev_tuning_name:
+ * @i: The index of a tuning parameter.
+ *
+ * Enumerates the tuning parameters.
+ *
+ * Returns: The name of the @i-th parameter, %NULL if there are fewer.
+ **/
+const char*
+lev_tuning_name(size_t i)
 {
-  short int *symset;  /* indexed by ALL symbols, contains 1 for symbols
-                         present in the strings, zero for others */
-  size_t i, j;
-  lev_byte *symlist;
+  return i < LEV_TUNING_NPARAMS ? lev_tuning_params[i].name : NULL;
+}
 
-  symset = (short int*)calloc(0x100, sizeof(short int));
-  if (!symset) {
-    *symlistlen = (size_t)(-1);
-    return NULL;
+/**
+ * lev_tuning_get:
+ * @name: The name of a tuning parameter.
+ *
+ * Returns: The current value of the parameter, zero if there's no such one.
+ **/
+size_t
+lev_tuning_get(const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < LEV_TUNING_NPARAMS; i++) {
+    if (strcmp(name, lev_tuning_params[i].name) == 0)
+      return *lev_tuning_params[i].value;
   }
-  *symlistlen = 0;
-  for (i = 0; i < n; i++) {
-    const lev_byte *stri = strings[i];
-    for (j = 0; j < lengths[i]; j++) {
-      int c = stri[j];
-      if (!symset[c]) {
-        (*symlistlen)++;
-        symset[c] = 1;
-      }
+  return 0;
+}
+
+/**
+ * lev_tuning_set:
+ * @name: The name of a tuning parameter.
+ * @value: Its new value, it must be positive.
+ *
+ * Sets a tuning parameter.  This is not thread-safe, parameters should be
+ * set before any computation starts.
+ *
+ * Returns: Zero on success, -1 when there's no such parameter or @value is
+ *          zero.
+ **/
+int
+lev_tuning_set(const char *name, size_t value)
+{
+  size_t i;
+
+  if (!value)
+    return -1;
+  for (i = 0; i < LEV_TUNING_NPARAMS; i++) {
+    if (strcmp(name, lev_tuning_params[i].name) == 0) {
+      *lev_tuning_params[i].value = value;
+      return 0;
     }
   }
-  if (!*symlistlen) {
-    free(symset);
-    return NULL;
-  }
+  return -1;
+}
 
-  /* create dense symbol table, so we can easily iterate over only characters
-   * present in the strings */
-  {
-    size_t pos = 0;
-    symlist = (lev_byte*)safe_malloc((*symlistlen), sizeof(lev_byte));
-    if (!symlist) {
-      *symlistlen = (size_t)(-1);
-      free(symset);
-      return NULL;
-    }
-    for (j = 0; j < 0x100; j++) {
-      if (symset[j])
-        symlist[pos++] = (lev_byte)j;
+/**
+ * lev_tuning_load:
+ * @filename: The tuning file name.
+ *
+ * Loads tuning parameters from a file.  The file consists of lines
+ * `name = value', empty lines and lines starting with `#' are ignored.
+ * Parameters not mentioned in the file keep their values.
+ *
+ * Returns: Zero on success, -1 when the file cannot be read, or the number
+ *          of the first line that is not a valid parameter setting (the
+ *          following lines are still loaded).
+ **/
+int
+lev_tuning_load(const char *filename)
+{
+  FILE *fh;
+  char line[256], name[64];
+  unsigned long value;
+  int lineno = 0, bad = 0;
+
+  fh = fopen(filename, "r");
+  if (!fh)
+    return -1;
+  while (fgets(line, sizeof(line), fh)) {
+    char *p = line;
+
+    lineno++;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p == '#' || *p == '\n' || *p == '\r' || !*p)
+      continue;
+    if (sscanf(p, "%63[a-z_0-9] = %lu", name, &value) != 2
+        || lev_tuning_set(name, (size_t)value)) {
+      if (!bad)
+        bad = lineno;
     }
   }
-  free(symset);
+  fclose(fh);
 
-  return symlist;
+  return bad;
 }
+/* }}} */
 
-/**
- * lev_greedy_median:
- * @n: The size of @lengths, @strings, and @weights.
- * @lengths: The lengths of @strings.
- * @strings: An array of strings, that may contain NUL characters.
- * @weights: The string weights (they behave exactly as multiplicities, though
- *           any positive value is allowed, not just integers).
- * @medlength: Where the length of the median should be stored.
- *
- * Finds a generalized median string of @strings using the greedy algorithm.
+/****************************************************************************
  *
- * Note it's considerably more efficient to give a string with weight 2
- * than to store two identical strings in @strings (with weights 1).
+ * Common affixes
  *
- * Returns: The generalized median, as a newly allocated string; its length
- *          is stored in @medlength.
- **/
-lev_byte*
-lev_greedy_median(size_t n, const size_t *lengths,
-                  const lev_byte *strings[],
-                  const double *weights,
-                  size_t *medlength)
+ ****************************************************************************/
+/* {{{ */
+
+/* All engines strip the common prefix and suffix of their strings first;
+ * for long, nearly identical strings this is most of the work, so it's
+ * done here, for symbols of any width, comparing 16 bytes at a time with
+ * SSE2 or 8 with plain words, and only the block with the difference
+ * byte by byte.  A symbol is common when all its bytes are, so the byte
+ * counts are simply rounded down to whole symbols. */
+
+/* the number of leading bytes @s1 and @s2 have in common, up to @n */
+static size_t
+lev_common_prefix_bytes(const lev_byte *s1, const lev_byte *s2, size_t n)
 {
-  size_t i;  /* usually iterates over strings (n) */
-  size_t j;  /* usually iterates over characters */
-  size_t len;  /* usually iterates over the approximate median string */
-  lev_byte *symlist;  /* list of symbols present in the strings,
-                              we iterate over it insead of set of all
-                              existing symbols */
-  size_t symlistlen;  /* length of symlist */
-  size_t maxlen;  /* maximum input string length */
-  size_t stoplen;  /* maximum tried median string length -- this is slightly
-                      higher than maxlen, because the median string may be
-                      longer than any of the input strings */
-  size_t **rows;  /* Levenshtein matrix rows for each string, we need to keep
-                     only one previous row to construct the current one */
-  size_t *row;  /* a scratch buffer for new Levenshtein matrix row computation,
-                   shared among all strings */
-  lev_byte *median;  /* the resulting approximate median string */
-  double *mediandist;  /* the total distance of the best median string of
-                          given length.  warning!  mediandist[0] is total
-                          distance for empty string, while median[] itself
-                          is normally zero-based */
-  size_t bestlen;  /* the best approximate median string length */
+  size_t i = 0;
 
-  /* find all symbols */
-  symlist = make_symlist(n, lengths, strings, &symlistlen);
-  if (!symlist) {
-    *medlength = 0;
-    if (symlistlen != 0)
-      return NULL;
-    else
-      return (lev_byte*)calloc(1, sizeof(lev_byte));
-  }
+#ifdef LEV_HAVE_SSE2
+  while (i + 16 <= n) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(const void*)(s1 + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(const void*)(s2 + i));
 
-  /* allocate and initialize per-string matrix rows and a common work buffer */
-  rows = (size_t**)safe_malloc(n, sizeof(size_t*));
-  if (!rows) {
-    free(symlist);
-    return NULL;
-  }
-  maxlen = 0;
-  for (i = 0; i < n; i++) {
-    size_t *ri;
-    size_t leni = lengths[i];
-    if (leni > maxlen)
-      maxlen = leni;
-    ri = rows[i] = (size_t*)safe_malloc((leni + 1), sizeof(size_t));
-    if (!ri) {
-      for (j = 0; j < i; j++)
-        free(rows[j]);
-      free(rows);
-      free(symlist);
-      return NULL;
-    }
-    for (j = 0; j <= leni; j++)
-      ri[j] = j;
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff)
+      break;
+    i += 16;
   }
-  stoplen = 2*maxlen + 1;
-  row = (size_t*)safe_malloc((stoplen + 1), sizeof(size_t));
-  if (!row) {
-    for (j = 0; j < n; j++)
-      free(rows[j]);
-    free(rows);
-    free(symlist);
-    return NULL;
+#endif
+  while (i + 8 <= n) {
+    uint64_t a, b;
+
+    memcpy(&a, s1 + i, sizeof(uint64_t));
+    memcpy(&b, s2 + i, sizeof(uint64_t));
+    if (a != b)
+      break;
+    i += 8;
   }
+  while (i < n && s1[i] == s2[i])
+    i++;
+  return i;
+}
 
-  /* compute final cost of string of length 0 (empty string may be also
-   * a valid answer) */
-  median = (lev_byte*)safe_malloc(stoplen, sizeof(lev_byte));
+/* the number of trailing bytes the @n bytes before @e1 and @e2 have in
+ * common */
+static size_t
+lev_common_suffix_bytes(const lev_byte *e1, const lev_byte *e2, size_t n)
+{
+  size_t i = 0;
+
+#ifdef LEV_HAVE_SSE2
+  while (i + 16 <= n) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(const void*)(e1 - i - 16));
+    __m128i b = _mm_loadu_si128((const __m128i*)(const void*)(e2 - i - 16));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff)
+      break;
+    i += 16;
+  }
+#endif
+  while (i + 8 <= n) {
+    uint64_t a, b;
+
+    memcpy(&a, e1 - i - 8, sizeof(uint64_t));
+    memcpy(&b, e2 - i - 8, sizeof(uint64_t));
+    if (a != b)
+      break;
+    i += 8;
+  }
+  while (i < n && e1[-1 - (ptrdiff_t)i] == e2[-1 - (ptrdiff_t)i])
+    i++;
+  return i;
+}
+
+/* the length of the common prefix of @string1 and @string2, strings of
+ * symbols @width bytes wide */
+static size_t
+lev_common_prefix(size_t len1, const void *string1,
+                  size_t len2, const void *string2,
+                  size_t width)
+{
+  size_t len = len1 < len2 ? len1 : len2;
+
+  return lev_common_prefix_bytes((const lev_byte*)string1,
+                                 (const lev_byte*)string2, len*width)/width;
+}
+
+/* the length of the common suffix of @string1 and @string2, strings of
+ * symbols @width bytes wide */
+static size_t
+lev_common_suffix(size_t len1, const void *string1,
+                  size_t len2, const void *string2,
+                  size_t width)
+{
+  size_t len = len1 < len2 ? len1 : len2;
+
+  return lev_common_suffix_bytes((const lev_byte*)string1 + len1*width,
+                                 (const lev_byte*)string2 + len2*width,
+                                 len*width)/width;
+}
+
+/* strip the common prefix and suffix of @string1 and @string2, strings of
+ * symbols @width bytes wide, from @len1 and @len2; returns the length of
+ * the prefix, the strings are to be advanced by it */
+static size_t
+lev_strip_affixes(size_t *len1, const void *string1,
+                  size_t *len2, const void *string2,
+                  size_t width)
+{
+  size_t prefix = lev_common_prefix(*len1, string1, *len2, string2, width);
+  size_t suffix;
+
+  *len1 -= prefix;
+  *len2 -= prefix;
+  suffix = lev_common_suffix(*len1, (const lev_byte*)string1 + prefix*width,
+                             *len2, (const lev_byte*)string2 + prefix*width,
+                             width);
+  *len1 -= suffix;
+  *len2 -= suffix;
+  return prefix;
+}
+
+/* whether @string1 and @string2, strings of symbols @width bytes wide, are
+ * equal; memcmp() is vectorized by the C library already */
+static int
+lev_strings_equal(size_t len1, const void *string1,
+                  size_t len2, const void *string2,
+                  size_t width)
+{
+  return len1 == len2
+         && (len1 == 0 || memcmp(string1, string2, len1*width) == 0);
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Basic stuff, Levenshtein distance
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/**
+ * lev_edit_distance:
+ * @len1: The length of @string1.
+ * @string1: A sequence of bytes of length @len1, may contain NUL characters.
+ * @len2: The length of @string2.
+ * @string2: A sequence of bytes of length @len2, may contain NUL characters.
+ * @xcost: If nonzero, the replace operation has weight 2, otherwise all
+ *         edit operations have equal weights of 1.
+ *
+ * Computes Levenshtein edit distance of two strings.
+ *
+ * Returns: The edit distance.
+ **/
+size_t
+lev_edit_distance(size_t len1, const lev_byte *string1,
+                  size_t len2, const lev_byte *string2,
+                  int xcost)
+{
+  size_t i;
+  size_t *row;  /* we only need to keep one row of costs */
+  size_t *end;
+  size_t half;
+  size_t off;  /* stripped common prefix */
+
+  /* strip common prefix and suffix */
+  off = lev_strip_affixes(&len1, string1, &len2, string2, sizeof(*string1));
+  string1 += off;
+  string2 += off;
+
+  /* catch trivial cases */
+  if (len1 == 0)
+    return len2;
+  if (len2 == 0)
+    return len1;
+
+  /* the InDel variant has its own bit-parallel engine */
+  if (xcost)
+    return lev_indel_distance(len1, string1, len2, string2, (size_t)(-1));
+
+  /* make the inner cycle (i.e. string2) the longer one */
+  if (len1 > len2) {
+    size_t nx = len1;
+    const lev_byte *sx = string1;
+    len1 = len2;
+    len2 = nx;
+    string1 = string2;
+    string2 = sx;
+  }
+  /* check len1 == 1 separately */
+  if (len1 == 1)
+    return len2 - (memchr(string2, *string1, len2) != NULL);
+  /* small alphabets have a bit-parallel engine */
+  if (small_edit_distance(len1, string1, len2, string2, 0, &i))
+    return i;
+  len1++;
+  len2++;
+  half = len1 >> 1;
+
+  /* initalize first row */
+  row = (size_t*)safe_malloc(len2, sizeof(size_t));
+  if (!row)
+    return (size_t)(-1);
+  end = row + len2 - 1;
+  for (i = 0; i < len2 - half; i++)
+    row[i] = i;
+
+  /* go through the matrix and compute the costs.  yes, this is an extremely
+   * obfuscated version, but also extremely memory-conservative and relatively
+   * fast.
+   * we don't have to scan two corner triangles (of size len1/2) in the
+   * matrix because no best path can go throught them. note this breaks
+   * when len1 == len2 == 2 so the memchr() special case above is
+   * necessary */
+  row[0] = len1 - half - 1;
+  for (i = 1; i < len1; i++) {
+    size_t *p;
+    const lev_byte char1 = string1[i - 1];
+    const lev_byte *char2p;
+    size_t D, x;
+    /* skip the upper triangle */
+    if (i >= len1 - half) {
+      size_t offset = i - (len1 - half);
+      size_t c3;
+
+      char2p = string2 + offset;
+      p = row + offset;
+      c3 = *(p++) + (char1 != *(char2p++));
+      x = *p;
+      x++;
+      D = x;
+      if (x > c3)
+        x = c3;
+      *(p++) = x;
+    }
+    else {
+      p = row + 1;
+      char2p = string2;
+      D = x = i;
+    }
+    /* skip the lower triangle */
+    if (i <= half + 1)
+      end = row + len2 + i - half - 2;
+    /* main */
+    while (p <= end) {
+      size_t c3 = --D + (char1 != *(char2p++));
+      x++;
+      if (x > c3)
+        x = c3;
+      D = *p;
+      D++;
+      if (x > D)
+        x = D;
+      *(p++) = x;
+    }
+    /* lower triangle sentinel */
+    if (i <= half) {
+      size_t c3 = --D + (char1 != *char2p);
+      x++;
+      if (x > c3)
+        x = c3;
+      *p = x;
+    }
+  }
+
+  i = *end;
+  free(row);
+  return i;
+}
+
+/**
+ * lev_u_edit_distance:
+ * @len1: The length of @string1.
+ * @string1: A sequence of Unicode characters of length @len1, may contain NUL
+ *           characters.
+ * @len2: The length of @string2.
+ * @string2: A sequence of Unicode characters of length @len2, may contain NUL
+ *           characters.
+ * @xcost: If nonzero, the replace operation has weight 2, otherwise all
+ *         edit operations have equal weights of 1.
+ *
+ * Computes Levenshtein edit distance of two Unicode strings.
+ *
+ * Returns: The edit distance.
+ **/
+size_t
+lev_u_edit_distance(size_t len1, const lev_wchar *string1,
+                    size_t len2, const lev_wchar *string2,
+                    int xcost)
+{
+  size_t i;
+  size_t *row;  /* we only need to keep one row of costs */
+  size_t *end;
+  size_t half;
+  size_t off;  /* stripped common prefix */
+
+  /* strip common prefix and suffix */
+  off = lev_strip_affixes(&len1, string1, &len2, string2, sizeof(*string1));
+  string1 += off;
+  string2 += off;
+
+  /* catch trivial cases */
+  if (len1 == 0)
+    return len2;
+  if (len2 == 0)
+    return len1;
+
+  /* the InDel variant has its own bit-parallel engine */
+  if (xcost)
+    return lev_u_indel_distance(len1, string1, len2, string2, (size_t)(-1));
+
+  /* make the inner cycle (i.e. string2) the longer one */
+  if (len1 > len2) {
+    size_t nx = len1;
+    const lev_wchar *sx = string1;
+    len1 = len2;
+    len2 = nx;
+    string1 = string2;
+    string2 = sx;
+  }
+  /* check len1 == 1 separately */
+  if (len1 == 1) {
+    lev_wchar z = *string1;
+    const lev_wchar *p = string2;
+    for (i = len2; i; i--) {
+      if (*(p++) == z)
+        return len2 - 1;
+    }
+    return len2;
+  }
+  if (small_edit_distance(len1, string1, len2, string2, 1, &i))
+    return i;
+  len1++;
+  len2++;
+  half = len1 >> 1;
+
+  /* initalize first row */
+  row = (size_t*)safe_malloc(len2, sizeof(size_t));
+  if (!row)
+    return (size_t)(-1);
+  end = row + len2 - 1;
+  for (i = 0; i < len2 - half; i++)
+    row[i] = i;
+
+  /* go through the matrix and compute the costs.  yes, this is an extremely
+   * obfuscated version, but also extremely memory-conservative and relatively
+   * fast.
+   * we don't have to scan two corner triangles (of size len1/2) in the
+   * matrix because no best path can go throught them. note this breaks
+   * when len1 == len2 == 2 so the memchr() special case above is
+   * necessary */
+  row[0] = len1 - half - 1;
+  for (i = 1; i < len1; i++) {
+    size_t *p;
+    const lev_wchar char1 = string1[i - 1];
+    const lev_wchar *char2p;
+    size_t D, x;
+    /* skip the upper triangle */
+    if (i >= len1 - half) {
+      size_t offset = i - (len1 - half);
+      size_t c3;
+
+      char2p = string2 + offset;
+      p = row + offset;
+      c3 = *(p++) + (char1 != *(char2p++));
+      x = *p;
+      x++;
+      D = x;
+      if (x > c3)
+        x = c3;
+      *(p++) = x;
+    }
+    else {
+      p = row + 1;
+      char2p = string2;
+      D = x = i;
+    }
+    /* skip the lower triangle */
+    if (i <= half + 1)
+      end = row + len2 + i - half - 2;
+    /* main */
+    while (p <= end) {
+      size_t c3 = --D + (char1 != *(char2p++));
+      x++;
+      if (x > c3)
+        x = c3;
+      D = *p;
+      D++;
+      if (x > D)
+        x = D;
+      *(p++) = x;
+    }
+    /* lower triangle sentinel */
+    if (i <= half) {
+      size_t c3 = --D + (char1 != *char2p);
+      x++;
+      if (x > c3)
+        x = c3;
+      *p = x;
+    }
+  }
+
+  i = *end;
+  free(row);
+  return i;
+}
+
+/* }}} */
+
+/****************************************************************************
+ *
+ * Bit-parallel InDel distance (LCS)
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/* The InDel distance (replace has weight 2, i.e. xcost != 0) is
+ * len1 + len2 - 2*LCS and the longest common subsequence has a very simple
+ * bit-parallel formulation (Allison & Dix; Hyyro): for each symbol c of the
+ * text, one full row of the LCS matrix is updated 64 columns at a time with
+ *
+ *   U = V & PM[c];  V = (V + U) | (V - U)
+ *
+ * where PM[c] is the match mask of c in the pattern.  The zero bits of V
+ * then count the LCS.  Longer patterns simply use several words, the carry
+ * of the addition is propagated from one word to the next. */
+
+#define LEV_WORD_BITS 64
+
+/* slots in each per-word hash of LevULCSPattern; one word never holds more
+ * than 64 distinct symbols, so it's always at most half full */
+#define LEV_LCS_HSIZE 128
+
+/* match masks of a byte string */
+typedef struct {
+  size_t len;  /* pattern length */
+  size_t words;  /* number of words of each mask */
+  uint64_t *masks;  /* 0x100 masks, masks[c*words + w] */
+  uint64_t *V;  /* scratch row of the LCS matrix */
+} LevLCSPattern;
+
+/* match masks of a Unicode string, symbols above 0xff live in a small
+ * open addressing hash, one for each word */
+typedef struct {
+  size_t len;  /* pattern length */
+  size_t words;  /* number of words of each mask */
+  uint64_t *masks;  /* 0x100 masks, masks[c*words + w] */
+  lev_wchar *hkeys;  /* hash keys, hkeys[w*LEV_LCS_HSIZE + slot], 0 == empty */
+  uint64_t *hmasks;  /* masks corresponding to hkeys */
+  uint64_t *V;  /* scratch row of the LCS matrix */
+} LevULCSPattern;
+
+static size_t
+lev_popcount64(uint64_t x)
+{
+#if defined(__GNUC__)
+  return (size_t)__builtin_popcountll(x);
+#else
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return (size_t)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/* count the zero bits among the first len bits of V, i.e. the LCS */
+static size_t
+lcs_count(const uint64_t *V, size_t words, size_t len)
+{
+  size_t w, lcs = 0;
+
+  for (w = 0; w + 1 < words; w++)
+    lcs += lev_popcount64(~V[w]);
+  if (len % LEV_WORD_BITS)
+    lcs += lev_popcount64(~V[w] & (((uint64_t)1 << (len % LEV_WORD_BITS)) - 1));
+  else
+    lcs += lev_popcount64(~V[w]);
+
+  return lcs;
+}
+
+/* one step of the LCS row update over all words */
+static void
+lcs_advance(uint64_t *V, const uint64_t *M, size_t words)
+{
+  uint64_t carry = 0;
+  size_t w;
+
+  for (w = 0; w < words; w++) {
+    uint64_t Vw = V[w];
+    uint64_t U = Vw & M[w];
+    uint64_t x = Vw + carry;
+    uint64_t c1 = x < carry;
+    uint64_t sum = x + U;
+    carry = c1 | (sum < U);
+    V[w] = sum | (Vw - U);
+  }
+}
+
+/* whether the cutoff @max can still be met after @done of @len2 text
+ * symbols were processed */
+static int
+lcs_hopeless(const uint64_t *V, size_t words, size_t len1,
+             size_t done, size_t len2, size_t max)
+{
+  size_t lcs = lcs_count(V, words, len1);
+  size_t rest = len2 - done;
+
+  if (rest > len1 - lcs)
+    rest = len1 - lcs;
+  return len1 + len2 - 2*(lcs + rest) > max;
+}
+
+static int
+lcs_pattern_init(LevLCSPattern *pat, size_t maxlen)
+{
+  size_t maxwords = (maxlen + LEV_WORD_BITS - 1)/LEV_WORD_BITS;
+
+  if (!maxwords)
+    maxwords = 1;
+  pat->len = pat->words = 0;
+  pat->masks = (uint64_t*)safe_malloc_3(0x100, maxwords, sizeof(uint64_t));
+  if (!pat->masks)
+    return -1;
+  pat->V = (uint64_t*)safe_malloc(maxwords, sizeof(uint64_t));
+  if (!pat->V) {
+    free(pat->masks);
+    return -1;
+  }
+  return 0;
+}
+
+static void
+lcs_pattern_free(LevLCSPattern *pat)
+{
+  free(pat->masks);
+  free(pat->V);
+}
+
+/* the pattern must fit to the maxlen given to lcs_pattern_init() */
+static void
+lcs_pattern_set(LevLCSPattern *pat, size_t len, const lev_byte *string)
+{
+  size_t i;
+
+  pat->len = len;
+  pat->words = (len + LEV_WORD_BITS - 1)/LEV_WORD_BITS;
+  memset(pat->masks, 0, 0x100*pat->words*sizeof(uint64_t));
+  for (i = 0; i < len; i++)
+    pat->masks[string[i]*pat->words + i/LEV_WORD_BITS]
+      |= (uint64_t)1 << (i % LEV_WORD_BITS);
+}
+
+/*
+ * InDel distance of the pattern @pat and @string2.
+ *
+ * Returns: The distance, or @max + 1 if it's larger than @max.
+ */
+static size_t
+lcs_pattern_distance(LevLCSPattern *pat,
+                     size_t len2, const lev_byte *string2,
+                     size_t max)
+{
+  size_t len1 = pat->len;
+  size_t words = pat->words;
+  size_t i, lcs, dist;
+
+  /* the length difference alone is a lower bound */
+  if ((len1 > len2 ? len1 - len2 : len2 - len1) > max)
+    return max + 1;
+  if (len1 == 0)
+    return len2;
+  if (len2 == 0)
+    return len1;
+
+  if (words == 1) {
+    const uint64_t *masks = pat->masks;
+    uint64_t V = ~(uint64_t)0;
+
+    for (i = 0; i < len2; i++) {
+      uint64_t U = V & masks[string2[i]];
+      V = (V + U) | (V - U);
+    }
+    lcs = lcs_count(&V, 1, len1);
+  }
+  else {
+    uint64_t *V = pat->V;
+    size_t check = lev_tuning.lcs_cutoff_interval;
+
+    memset(V, 0xff, words*sizeof(uint64_t));
+    for (i = 0; i < len2; i++) {
+      lcs_advance(V, pat->masks + string2[i]*words, words);
+      if (!--check) {
+        if (lcs_hopeless(V, words, len1, i + 1, len2, max))
+          return max + 1;
+        check = lev_tuning.lcs_cutoff_interval;
+      }
+    }
+    lcs = lcs_count(V, words, len1);
+  }
+
+  dist = len1 + len2 - 2*lcs;
+  return dist > max ? max + 1 : dist;
+}
+
+static int
+ulcs_pattern_init(LevULCSPattern *pat, size_t maxlen)
+{
+  size_t maxwords = (maxlen + LEV_WORD_BITS - 1)/LEV_WORD_BITS;
+
+  if (!maxwords)
+    maxwords = 1;
+  pat->len = pat->words = 0;
+  pat->masks = (uint64_t*)safe_malloc_3(0x100, maxwords, sizeof(uint64_t));
+  pat->hkeys = (lev_wchar*)safe_malloc_3(LEV_LCS_HSIZE, maxwords,
+                                         sizeof(lev_wchar));
+  pat->hmasks = (uint64_t*)safe_malloc_3(LEV_LCS_HSIZE, maxwords,
+                                         sizeof(uint64_t));
+  pat->V = (uint64_t*)safe_malloc(maxwords, sizeof(uint64_t));
+  if (!pat->masks || !pat->hkeys || !pat->hmasks || !pat->V) {
+    free(pat->masks);
+    free(pat->hkeys);
+    free(pat->hmasks);
+    free(pat->V);
+    return -1;
+  }
+  return 0;
+}
+
+static void
+ulcs_pattern_free(LevULCSPattern *pat)
+{
+  free(pat->masks);
+  free(pat->hkeys);
+  free(pat->hmasks);
+  free(pat->V);
+}
+
+/* find the hash slot of @c in word @w, or the empty slot where it belongs */
+static size_t
+ulcs_pattern_slot(const LevULCSPattern *pat, size_t w, lev_wchar c)
+{
+  const lev_wchar *keys = pat->hkeys + w*LEV_LCS_HSIZE;
+  size_t i = (size_t)c % LEV_LCS_HSIZE;
+
+  while (keys[i] && keys[i] != c)
+    i = (i + 1) % LEV_LCS_HSIZE;
+  return w*LEV_LCS_HSIZE + i;
+}
+
+/* the pattern must fit to the maxlen given to ulcs_pattern_init() */
+static void
+ulcs_pattern_set(LevULCSPattern *pat, size_t len, const lev_wchar *string)
+{
+  size_t i;
+
+  pat->len = len;
+  pat->words = (len + LEV_WORD_BITS - 1)/LEV_WORD_BITS;
+  memset(pat->masks, 0, 0x100*pat->words*sizeof(uint64_t));
+  memset(pat->hkeys, 0, LEV_LCS_HSIZE*pat->words*sizeof(lev_wchar));
+  for (i = 0; i < len; i++) {
+    lev_wchar c = string[i];
+    uint64_t bit = (uint64_t)1 << (i % LEV_WORD_BITS);
+    size_t w = i/LEV_WORD_BITS;
+
+    if ((size_t)c < 0x100)
+      pat->masks[(size_t)c*pat->words + w] |= bit;
+    else {
+      size_t slot = ulcs_pattern_slot(pat, w, c);
+      if (!pat->hkeys[slot]) {
+        pat->hkeys[slot] = c;
+        pat->hmasks[slot] = 0;
+      }
+      pat->hmasks[slot] |= bit;
+    }
+  }
+}
+
+static uint64_t
+ulcs_pattern_mask(const LevULCSPattern *pat, size_t w, lev_wchar c)
+{
+  size_t slot;
+
+  if ((size_t)c < 0x100)
+    return pat->masks[(size_t)c*pat->words + w];
+  slot = ulcs_pattern_slot(pat, w, c);
+  return pat->hkeys[slot] ? pat->hmasks[slot] : 0;
+}
+
+/*
+ * InDel distance of the pattern @pat and @string2.
+ *
+ * Returns: The distance, or @max + 1 if it's larger than @max.
+ */
+static size_t
+ulcs_pattern_distance(LevULCSPattern *pat,
+                      size_t len2, const lev_wchar *string2,
+                      size_t max)
+{
+  size_t len1 = pat->len;
+  size_t words = pat->words;
+  size_t i, w, lcs, dist;
+
+  /* the length difference alone is a lower bound */
+  if ((len1 > len2 ? len1 - len2 : len2 - len1) > max)
+    return max + 1;
+  if (len1 == 0)
+    return len2;
+  if (len2 == 0)
+    return len1;
+
+  if (words == 1) {
+    uint64_t V = ~(uint64_t)0;
+
+    for (i = 0; i < len2; i++) {
+      uint64_t U = V & ulcs_pattern_mask(pat, 0, string2[i]);
+      V = (V + U) | (V - U);
+    }
+    lcs = lcs_count(&V, 1, len1);
+  }
+  else {
+    uint64_t *V = pat->V;
+    size_t check = lev_tuning.lcs_cutoff_interval;
+
+    memset(V, 0xff, words*sizeof(uint64_t));
+    for (i = 0; i < len2; i++) {
+      lev_wchar c = string2[i];
+      uint64_t carry = 0;
+
+      for (w = 0; w < words; w++) {
+        uint64_t Vw = V[w];
+        uint64_t U = Vw & ulcs_pattern_mask(pat, w, c);
+        uint64_t x = Vw + carry;
+        uint64_t c1 = x < carry;
+        uint64_t sum = x + U;
+        carry = c1 | (sum < U);
+        V[w] = sum | (Vw - U);
+      }
+      if (!--check) {
+        if (lcs_hopeless(V, words, len1, i + 1, len2, max))
+          return max + 1;
+        check = lev_tuning.lcs_cutoff_interval;
+      }
+    }
+    lcs = lcs_count(V, words, len1);
+  }
+
+  dist = len1 + len2 - 2*lcs;
+  return dist > max ? max + 1 : dist;
+}
+
+/**
+ * lev_indel_distance:
+ * @len1: The length of @string1.
+ * @string1: A sequence of bytes of length @len1, may contain NUL characters.
+ * @len2: The length of @string2.
+ * @string2: A sequence of bytes of length @len2, may contain NUL characters.
+ * @max: The score cutoff, (size_t)(-1) for none.
+ *
+ * Computes the InDel distance of two strings, that is the Levenshtein
+ * distance with replace operation of weight 2.
+ *
+ * Returns: The distance, @max + 1 if it's larger than @max, or (size_t)(-1)
+ *          on allocation failure.
+ **/
+static size_t
+lev_indel_distance(size_t len1, const lev_byte *string1,
+                   size_t len2, const lev_byte *string2,
+                   size_t max)
+{
+  LevLCSPattern pat;
+  size_t d, off;
+
+  /* strip common prefix and suffix */
+  off = lev_strip_affixes(&len1, string1, &len2, string2, sizeof(*string1));
+  string1 += off;
+  string2 += off;
+
+  /* catch trivial cases */
+  if (len1 == 0 || len2 == 0)
+    return len1 + len2 > max ? max + 1 : len1 + len2;
+
+  /* make the pattern (i.e. string1) the shorter one */
+  if (len1 > len2) {
+    size_t nx = len1;
+    const lev_byte *sx = string1;
+    len1 = len2;
+    len2 = nx;
+    string1 = string2;
+    string2 = sx;
+  }
+
+  if (lcs_pattern_init(&pat, len1))
+    return (size_t)(-1);
+  lcs_pattern_set(&pat, len1, string1);
+  d = lcs_pattern_distance(&pat, len2, string2, max);
+  lcs_pattern_free(&pat);
+
+  return d;
+}
+
+/**
+ * lev_u_indel_distance:
+ * @len1: The length of @string1.
+ * @string1: A sequence of Unicode characters of length @len1, may contain NUL
+ *           characters.
+ * @len2: The length of @string2.
+ * @string2: A sequence of Unicode characters of length @len2, may contain NUL
+ *           characters.
+ * @max: The score cutoff, (size_t)(-1) for none.
+ *
+ * Computes the InDel distance of two Unicode strings, that is the
+ * Levenshtein distance with replace operation of weight 2.
+ *
+ * Returns: The distance, @max + 1 if it's larger than @max, or (size_t)(-1)
+ *          on allocation failure.
+ **/
+static size_t
+lev_u_indel_distance(size_t len1, const lev_wchar *string1,
+                     size_t len2, const lev_wchar *string2,
+                     size_t max)
+{
+  LevULCSPattern pat;
+  size_t d, off;
+
+  /* strip common prefix and suffix */
+  off = lev_strip_affixes(&len1, string1, &len2, string2, sizeof(*string1));
+  string1 += off;
+  string2 += off;
+
+  /* catch trivial cases */
+  if (len1 == 0 || len2 == 0)
+    return len1 + len2 > max ? max + 1 : len1 + len2;
+
+  /* make the pattern (i.e. string1) the shorter one */
+  if (len1 > len2) {
+    size_t nx = len1;
+    const lev_wchar *sx = string1;
+    len1 = len2;
+    len2 = nx;
+    string1 = string2;
+    string2 = sx;
+  }
+
+  if (ulcs_pattern_init(&pat, len1))
+    return (size_t)(-1);
+  ulcs_pattern_set(&pat, len1, string1);
+  d = ulcs_pattern_distance(&pat, len2, string2, max);
+  ulcs_pattern_free(&pat);
+
+  return d;
+}
+
+/* }}} */
+
+/****************************************************************************
+ *
+ * Small alphabets
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/* Strings over at most LEV_SMALL_MAX different symbols (like DNA reads over
+ * ACGTN) are packed to 2 or 4 bits per symbol.  The match masks of a packed
+ * pattern are computed a whole word of symbols at a time with bitwise
+ * operations, and there's one mask row per present symbol instead of 0x100
+ * rows.  The distance and edit sequence engines on them are bit-parallel
+ * (Myers' algorithm in its multi-word form), the edit sequence one keeps
+ * just the two delta bits of each cell instead of the whole cost matrix.
+ * All of them give exactly the results of the generic engines. */
+
+#define LEV_SMALL_MAX 16
+#define LEV_SMALL_NONE 0xff
+
+typedef struct {
+  size_t size;  /* number of different symbols */
+  unsigned int bits;  /* bits per packed symbol, 2 or 4 */
+  lev_byte code[0x100];  /* symbol -> code, LEV_SMALL_NONE when not present */
+  lev_byte symbols[LEV_SMALL_MAX];  /* code -> symbol */
+} LevSmallAlphabet;
+
+static void
+small_alphabet_init(LevSmallAlphabet *a)
+{
+  a->size = 0;
+  a->bits = 2;
+  memset(a->code, LEV_SMALL_NONE, sizeof(a->code));
+}
+
+static int
+small_alphabet_symbol(LevSmallAlphabet *a, size_t c)
+{
+  if (a->code[c] != LEV_SMALL_NONE)
+    return 1;
+  if (a->size == LEV_SMALL_MAX)
+    return 0;
+  a->code[c] = (lev_byte)a->size;
+  a->symbols[a->size++] = (lev_byte)c;
+  if (a->size > 4)
+    a->bits = 4;
+  return 1;
+}
+
+/* adds the symbols of @string to @a.
+ * returns zero when the alphabet is no longer small (or @string contains
+ * a symbol above 0xff), @a is not usable then */
+static int
+small_alphabet_add(LevSmallAlphabet *a, size_t len, const void *string,
+                   int unicode)
+{
+  size_t i;
+
+  if (unicode) {
+    const lev_wchar *s = (const lev_wchar*)string;
+    for (i = 0; i < len; i++) {
+      if ((size_t)s[i] >= 0x100 || !small_alphabet_symbol(a, (size_t)s[i]))
+        return 0;
+    }
+  }
+  else {
+    const lev_byte *s = (const lev_byte*)string;
+    for (i = 0; i < len; i++) {
+      if (!small_alphabet_symbol(a, s[i]))
+        return 0;
+    }
+  }
+  return 1;
+}
+
+/* the alphabet of all @strings, returns zero if it's not small */
+static int
+small_alphabet_scan(LevSmallAlphabet *a, size_t n, const size_t *lengths,
+                    const lev_byte *strings[])
+{
+  size_t i;
+
+  small_alphabet_init(a);
+  for (i = 0; i < n; i++) {
+    if (!small_alphabet_add(a, lengths[i], strings[i], 0))
+      return 0;
+  }
+  return 1;
+}
+
+/* the present symbols in ascending order, the order make_symlist() gives */
+static void
+small_alphabet_sorted(const LevSmallAlphabet *a, lev_byte *symbols)
+{
+  size_t i, j;
+
+  for (i = 0; i < a->size; i++) {
+    lev_byte c = a->symbols[i];
+    for (j = i; j > 0 && symbols[j - 1] > c; j--)
+      symbols[j] = symbols[j - 1];
+    symbols[j] = c;
+  }
+}
+
+/* packs @string to codes of a->bits bits, LEV_WORD_BITS symbols take
+ * a->bits words.  returns the packed string, or NULL on allocation failure */
+static uint64_t*
+small_pack(const LevSmallAlphabet *a, size_t len, const void *string,
+           int unicode)
+{
+  size_t words = (len + LEV_WORD_BITS - 1)/LEV_WORD_BITS;
+  size_t per = LEV_WORD_BITS/a->bits;
+  uint64_t *packed;
+  size_t i;
+
+  packed = (uint64_t*)calloc(words ? words : 1, a->bits*sizeof(uint64_t));
+  if (!packed)
+    return NULL;
+  for (i = 0; i < len; i++) {
+    size_t c = unicode ? (size_t)((const lev_wchar*)string)[i]
+                       : ((const lev_byte*)string)[i];
+    packed[i/per] |= (uint64_t)a->code[c] << (i % per*a->bits);
+  }
+  return packed;
+}
+
+static size_t
+small_symbol(const uint64_t *packed, unsigned int bits, size_t i)
+{
+  if (bits == 2)
+    return (size_t)(packed[i >> 5] >> ((i & 31) << 1)) & 3;
+  return (size_t)(packed[i >> 4] >> ((i & 15) << 2)) & 15;
+}
+
+/* one bit for each zero field of packed word @x, compressed to the low
+ * LEV_WORD_BITS/bits bits */
+static uint64_t
+small_zero_fields(uint64_t x, unsigned int bits)
+{
+  uint64_t z;
+
+  if (bits == 2) {
+    z = ~(x | (x >> 1)) & 0x5555555555555555ULL;
+    z = (z | (z >> 1)) & 0x3333333333333333ULL;
+    z = (z | (z >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+    z = (z | (z >> 4)) & 0x00ff00ff00ff00ffULL;
+    z = (z | (z >> 8)) & 0x0000ffff0000ffffULL;
+    z = (z | (z >> 16)) & 0x00000000ffffffffULL;
+  }
+  else {
+    z = ~(x | (x >> 1) | (x >> 2) | (x >> 3)) & 0x1111111111111111ULL;
+    z = (z | (z >> 3)) & 0x0303030303030303ULL;
+    z = (z | (z >> 6)) & 0x000f000f000f000fULL;
+    z = (z | (z >> 12)) & 0x000000ff000000ffULL;
+    z = (z | (z >> 24)) & 0x000000000000ffffULL;
+  }
+  return z;
+}
+
+/* fills the match masks of the packed pattern @packed of length @len,
+ * masks[c*words + w] has bit k set when symbol w*LEV_WORD_BITS + k has
+ * code c */
+static void
+small_masks(const LevSmallAlphabet *a, size_t len, const uint64_t *packed,
+            size_t words, uint64_t *masks)
+{
+  const unsigned int bits = a->bits;
+  const uint64_t ones = bits == 2 ? 0x5555555555555555ULL
+                                  : 0x1111111111111111ULL;
+  size_t c, w, k;
+
+  for (c = 0; c < a->size; c++) {
+    uint64_t broadcast = ones*c;
+    uint64_t *m = masks + c*words;
+    for (w = 0; w < words; w++) {
+      const uint64_t *p = packed + w*bits;
+      uint64_t mask = 0;
+      for (k = 0; k < bits; k++)
+        mask |= small_zero_fields(p[k] ^ broadcast, bits)
+                << (k*(LEV_WORD_BITS/bits));
+      m[w] = mask;
+    }
+    /* the padding is zero, i.e. looks like code 0 */
+    if (len % LEV_WORD_BITS)
+      m[words - 1] &= ((uint64_t)1 << (len % LEV_WORD_BITS)) - 1;
+  }
+}
+
+/* one text symbol of the bit-parallel Levenshtein distance of a pattern of
+ * one word (Myers; Hyyro): @Eq is its match mask, @VP, @VN the vertical
+ * deltas of the column, @last the bit of the last row and @d is updated to
+ * the distance in the last row */
+#define LEV_MYERS_STEP(Eq, VP, VN, last, d) \
+  do { \
+    uint64_t Xv = (Eq) | VN; \
+    uint64_t Xh = ((((Eq) & VP) + VP) ^ VP) | (Eq); \
+    uint64_t Ph = VN | ~(Xh | VP); \
+    uint64_t Mh = VP & Xh; \
+    d += (Ph & last) != 0; \
+    d -= (Mh & last) != 0; \
+    Ph = (Ph << 1) | 1; \
+    Mh <<= 1; \
+    VP = Mh | ~(Xv | Ph); \
+    VN = Ph & Xv; \
+  } while (0)
+
+/* one block of one text symbol of the bit-parallel Levenshtein distance:
+ * @Eq is its match mask, @VP, @VN the vertical deltas of the block, updated
+ * in place, @hin the horizontal delta entering the block from above.
+ * the horizontal deltas in the block are stored to @Ph, @Mh */
+static void
+small_myers_block(uint64_t Eq, uint64_t *VP, uint64_t *VN, int hin,
+                  uint64_t *Ph, uint64_t *Mh)
+{
+  uint64_t Pv = *VP, Mv = *VN;
+  uint64_t Xv = Eq | Mv;
+  uint64_t Xh, P, M;
+
+  if (hin < 0)
+    Eq |= 1;
+  Xh = (((Eq & Pv) + Pv) ^ Pv) | Eq;
+  P = Mv | ~(Xh | Pv);
+  M = Pv & Xh;
+  *Ph = P;
+  *Mh = M;
+  P <<= 1;
+  M <<= 1;
+  if (hin < 0)
+    M |= 1;
+  else if (hin > 0)
+    P |= 1;
+  *VP = M | ~(Xv | P);
+  *VN = P & Xv;
+}
+
+/* advances the vertical deltas @VP, @VN of a pattern of length @len by one
+ * text symbol whose masks are @Eq, returns the change of the distance in
+ * the last row */
+static int
+small_myers_step(const uint64_t *Eq, uint64_t *VP, uint64_t *VN,
+                 size_t words, size_t len)
+{
+  uint64_t last = (uint64_t)1 << ((len - 1) % LEV_WORD_BITS);
+  uint64_t Ph = 0, Mh = 0;
+  int hin = 1;  /* the first row is 0, 1, 2, ... */
+  size_t w;
+
+  for (w = 0; w < words; w++) {
+    small_myers_block(Eq[w], VP + w, VN + w, hin, &Ph, &Mh);
+    hin = (int)(Ph >> (LEV_WORD_BITS - 1)) - (int)(Mh >> (LEV_WORD_BITS - 1));
+  }
+  return ((Ph & last) != 0) - ((Mh & last) != 0);
+}
+
+/*
+ * Packs @string1 and @string2 when their alphabet is small, and makes the
+ * match masks of @string1.
+ *
+ * Returns: 1 when the alphabet is small and everything is set up, 0 when
+ *          it isn't small, -1 on allocation failure.
+ */
+static int
+small_setup(LevSmallAlphabet *a, int unicode,
+            size_t len1, const void *string1, size_t len2, const void *string2,
+            uint64_t **packed1, uint64_t **packed2, uint64_t **masks)
+{
+  size_t words = (len1 + LEV_WORD_BITS - 1)/LEV_WORD_BITS;
+
+  small_alphabet_init(a);
+  if (!small_alphabet_add(a, len1, string1, unicode)
+      || !small_alphabet_add(a, len2, string2, unicode))
+    return 0;
+  *packed1 = small_pack(a, len1, string1, unicode);
+  *packed2 = small_pack(a, len2, string2, unicode);
+  *masks = (uint64_t*)safe_malloc_3(a->size, words, sizeof(uint64_t));
+  if (!*packed1 || !*packed2 || !*masks) {
+    free(*packed1);
+    free(*packed2);
+    free(*masks);
+    return -1;
+  }
+  small_masks(a, len1, *packed1, words, *masks);
+  return 1;
+}
+
+/*
+ * Levenshtein distance of two nonempty strings if their alphabet is small.
+ *
+ * Returns: Zero when the alphabet is not small, nonzero otherwise, the
+ *          distance, or (size_t)(-1) on allocation failure, is then stored
+ *          to @d.
+ */
+static int
+small_edit_distance(size_t len1, const void *string1,
+                    size_t len2, const void *string2,
+                    int unicode, size_t *d)
+{
+  LevSmallAlphabet a;
+  uint64_t *packed1, *packed2, *masks, *V;
+  size_t words = (len1 + LEV_WORD_BITS - 1)/LEV_WORD_BITS;
+  size_t i, w;
+  int r;
+
+  r = small_setup(&a, unicode, len1, string1, len2, string2,
+                  &packed1, &packed2, &masks);
+  if (r <= 0) {
+    *d = (size_t)(-1);
+    return r != 0;
+  }
+  V = (uint64_t*)safe_malloc_3(2, words, sizeof(uint64_t));
+  if (!V) {
+    free(packed1);
+    free(packed2);
+    free(masks);
+    *d = (size_t)(-1);
+    return 1;
+  }
+  for (w = 0; w < words; w++) {
+    V[w] = ~(uint64_t)0;
+    V[words + w] = 0;
+  }
+
+  *d = len1;
+  for (i = 0; i < len2; i++) {
+    const uint64_t *Eq = masks + small_symbol(packed2, a.bits, i)*words;
+    *d += (size_t)small_myers_step(Eq, V, V + words, words, len1);
+  }
+
+  free(V);
+  free(packed1);
+  free(packed2);
+  free(masks);
+  return 1;
+}
+
+/* D[i][j] of the cost matrix whose rows are stored as vertical deltas in
+ * @VP, @VN (row i at (i - 1)*words, bit j - 1 is D[i][j] - D[i][j - 1]) */
+static size_t
+small_cost(const uint64_t *VP, const uint64_t *VN, size_t words,
+           size_t i, size_t j)
+{
+  size_t d = i;
+  size_t w;
+
+  if (!i)
+    return j;
+  VP += (i - 1)*words;
+  VN += (i - 1)*words;
+  for (w = 0; w < j/LEV_WORD_BITS; w++) {
+    d += lev_popcount64(VP[w]);
+    d -= lev_popcount64(VN[w]);
+  }
+  if (j % LEV_WORD_BITS) {
+    uint64_t prefix = ((uint64_t)1 << (j % LEV_WORD_BITS)) - 1;
+    d += lev_popcount64(VP[w] & prefix);
+    d -= lev_popcount64(VN[w] & prefix);
+  }
+  return d;
+}
+
+/* D[i][j] - D[i][j - 1] */
+static size_t
+small_delta(const uint64_t *VP, const uint64_t *VN, size_t words,
+            size_t i, size_t j)
+{
+  size_t k = j - 1;
+  uint64_t bit = (uint64_t)1 << (k % LEV_WORD_BITS);
+
+  if (!i)
+    return 1;
+  k = (i - 1)*words + k/LEV_WORD_BITS;
+  if (VP[k] & bit)
+    return 1;
+  return (VN[k] & bit) ? (size_t)(-1) : 0;
+}
+
+/*
+ * Finds the edit sequence of two nonempty strings if their alphabet is
+ * small, taking exactly the path editops_from_cost_matrix() takes.
+ *
+ * Returns: Zero when the alphabet is not small, nonzero otherwise, the
+ *          edit sequence, or NULL on allocation failure, is then stored
+ *          to @ops, its length to @n.
+ */
+static int
+small_editops(size_t len1, const void *string1, size_t off1,
+              size_t len2, const void *string2, size_t off2,
+              int unicode, LevEditOp **ops, size_t *n)
+{
+  LevSmallAlphabet a;
+  uint64_t *packed1, *packed2, *masks, *VP, *VN;
+  size_t words = (len2 + LEV_WORD_BITS - 1)/LEV_WORD_BITS;
+  size_t i, j, w, pos, cost, up;
+  int r, dir = 0;
+
+  /* string2 is the pattern here, so rows of the cost matrix are bit
+   * vectors as in editops_from_cost_matrix() */
+  *ops = NULL;
+  r = small_setup(&a, unicode, len2, string2, len1, string1,
+                  &packed2, &packed1, &masks);
+  if (r <= 0) {
+    *n = (size_t)(-1);
+    return r != 0;
+  }
+  VP = (uint64_t*)safe_malloc_3(len1, 2*words, sizeof(uint64_t));
+  if (!VP) {
+    free(packed1);
+    free(packed2);
+    free(masks);
+    *n = (size_t)(-1);
+    return 1;
+  }
+  VN = VP + len1*words;
+
+  /* compute the rows */
+  cost = len2;
+  for (i = 0; i < len1; i++) {
+    uint64_t *P = VP + i*words, *N = VN + i*words;
+    const uint64_t *Eq = masks + small_symbol(packed1, a.bits, i)*words;
+    if (i) {
+      memcpy(P, P - words, words*sizeof(uint64_t));
+      memcpy(N, N - words, words*sizeof(uint64_t));
+    }
+    else {
+      for (w = 0; w < words; w++) {
+        P[w] = ~(uint64_t)0;
+        N[w] = 0;
+      }
+    }
+    cost += (size_t)small_myers_step(Eq, P, N, words, len2);
+  }
+  free(masks);
+
+  /* find the way back */
+  pos = *n = cost;
+  if (cost) {
+    *ops = (LevEditOp*)safe_malloc(cost, sizeof(LevEditOp));
+    if (!*ops)
+      *n = (size_t)(-1);
+  }
+  i = len1;
+  j = len2;
+  up = small_cost(VP, VN, words, i - 1, j);
+  while (*ops && (i || j)) {
+    size_t left = j ? cost - small_delta(VP, VN, words, i, j) : 0;
+    size_t diag = i && j ? up - small_delta(VP, VN, words, i - 1, j) : 0;
+    /* prefer contiuning in the same direction */
+    if (dir < 0 && j && cost == left + 1) {
+      pos--;
+      (*ops)[pos].type = LEV_EDIT_INSERT;
+      (*ops)[pos].spos = i + off1;
+      (*ops)[pos].dpos = --j + off2;
+      cost = left;
+      up = diag;
+      continue;
+    }
+    if (dir > 0 && i && cost == up + 1) {
+      pos--;
+      (*ops)[pos].type = LEV_EDIT_DELETE;
+      (*ops)[pos].spos = --i + off1;
+      (*ops)[pos].dpos = j + off2;
+      cost = up;
+      up = i ? small_cost(VP, VN, words, i - 1, j) : 0;
+      continue;
+    }
+    if (i && j && cost == diag
+        && small_symbol(packed1, a.bits, i - 1)
+           == small_symbol(packed2, a.bits, j - 1)) {
+      i--;
+      j--;
+      cost = diag;
+      up = i ? small_cost(VP, VN, words, i - 1, j) : 0;
+      dir = 0;
+      continue;
+    }
+    if (i && j && cost == diag + 1) {
+      pos--;
+      (*ops)[pos].type = LEV_EDIT_REPLACE;
+      (*ops)[pos].spos = --i + off1;
+      (*ops)[pos].dpos = --j + off2;
+      cost = diag;
+      up = i ? small_cost(VP, VN, words, i - 1, j) : 0;
+      dir = 0;
+      continue;
+    }
+    if (dir == 0 && j && cost == left + 1) {
+      pos--;
+      (*ops)[pos].type = LEV_EDIT_INSERT;
+      (*ops)[pos].spos = i + off1;
+      (*ops)[pos].dpos = --j + off2;
+      cost = left;
+      up = diag;
+      dir = -1;
+      continue;
+    }
+    if (dir == 0 && i && cost == up + 1) {
+      pos--;
+      (*ops)[pos].type = LEV_EDIT_DELETE;
+      (*ops)[pos].spos = --i + off1;
+      (*ops)[pos].dpos = j + off2;
+      cost = up;
+      up = i ? small_cost(VP, VN, words, i - 1, j) : 0;
+      dir = 1;
+      continue;
+    }
+    assert("lost in the cost matrix" == NULL);
+  }
+
+  free(VP);
+  free(packed1);
+  free(packed2);
+  return 1;
+}
+
+/* }}} */
+
+/****************************************************************************
+ *
+ * Distance cache
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/* A persistent cache of distances of long string pairs, shared by threads
+ * and processes through one memory mapped file.  It's an open addressing
+ * hash table of fixed size (the size cap), keyed by 128bit hashes of the
+ * string pairs and the metric.  The slots are grouped to buckets; a full
+ * bucket evicts a pseudo-randomly chosen slot, so the table never grows.
+ *
+ * There are no locks.  A slot is three 64bit words, the key and the value
+ * whose upper half repeats 32 bits of the key.  Readers check them all, so
+ * a slot read while it's being rewritten (by another thread or process)
+ * just looks like a miss.  Only distances of pairs whose DP matrix has at
+ * least LEV_DCACHE_MIN_CELLS cells are cached, shorter ones are computed
+ * faster than looked up. */
+
+#define LEV_DCACHE_MAGIC "LEVDCCH1"
+#define LEV_DCACHE_BYTEORDER 0x01020304U
+#define LEV_DCACHE_BUCKET 8
+#define LEV_DCACHE_MIN_CELLS 4096
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder;  /* LEV_DCACHE_BYTEORDER, as written */
+  uint64_t nslots;  /* a power of 2, at least LEV_DCACHE_BUCKET */
+  uint64_t reserved[5];
+} LevDistanceCacheHeader;
+
+/* a slot, empty when k0 is zero (keys always have the lowest bit set) */
+typedef struct {
+  uint64_t k0;
+  uint64_t k1;
+  uint64_t value;  /* 32 bits of the key, the distance */
+} LevDistanceSlot;
+
+struct _LevDistanceCache {
+  void *block;  /* the header followed by the slots, the file image */
+  size_t size;  /* size of block in bytes */
+  volatile LevDistanceSlot *slots;
+  size_t mask;  /* bucket mask */
+};
+
+typedef struct {
+  uint64_t k0;
+  uint64_t k1;
+} LevDistanceKey;
+
+static uint64_t
+dcache_mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* two independent 64bit hashes of the characters, the same for a byte
+ * string and the Unicode string of the same code points */
+static void
+dcache_hash(size_t len, const lev_byte *s, uint64_t *h)
+{
+  uint64_t a = 0xcbf29ce484222325ULL ^ len;
+  uint64_t b = 0x9e3779b97f4a7c15ULL + len;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    a = (a ^ s[i])*0x100000001b3ULL;
+    b = (b ^ s[i])*0xff51afd7ed558ccdULL;
+    b ^= b >> 29;
+  }
+  h[0] = dcache_mix(a);
+  h[1] = dcache_mix(b ^ h[0]);
+}
+
+static void
+dcache_u_hash(size_t len, const lev_wchar *s, uint64_t *h)
+{
+  uint64_t a = 0xcbf29ce484222325ULL ^ len;
+  uint64_t b = 0x9e3779b97f4a7c15ULL + len;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    uint32_t c = (uint32_t)s[i];
+    a = (a ^ c)*0x100000001b3ULL;
+    b = (b ^ c)*0xff51afd7ed558ccdULL;
+    b ^= b >> 29;
+  }
+  h[0] = dcache_mix(a);
+  h[1] = dcache_mix(b ^ h[0]);
+}
+
+/* the key of a pair, the distances are symmetric so the order of the
+ * strings doesn't matter */
+static LevDistanceKey
+dcache_key(LevMetric metric, const uint64_t *h1, const uint64_t *h2)
+{
+  LevDistanceKey key;
+  const uint64_t *hx;
+  uint64_t m = dcache_mix((uint64_t)metric + 1);
+
+  if (h1[0] > h2[0] || (h1[0] == h2[0] && h1[1] > h2[1])) {
+    hx = h1;
+    h1 = h2;
+    h2 = hx;
+  }
+  key.k0 = dcache_mix(h1[0] ^ dcache_mix(h2[0] ^ m)) | 1;
+  key.k1 = dcache_mix(h1[1] + dcache_mix(h2[1] + (m << 1)));
+  return key;
+}
+
+static size_t
+dcache_get(const LevDistanceCache *cache, LevDistanceKey key)
+{
+  volatile const LevDistanceSlot *slot
+    = cache->slots + ((key.k0 >> 8) & cache->mask)*LEV_DCACHE_BUCKET;
+  uint64_t check = key.k1 >> 32;
+  size_t i;
+
+  for (i = 0; i < LEV_DCACHE_BUCKET; i++, slot++) {
+    uint64_t k0 = slot->k0, k1 = slot->k1, value = slot->value;
+
+    if (k0 == key.k0 && k1 == key.k1 && (value >> 32) == check)
+      return (size_t)(value & 0xffffffffU);
+  }
+  return (size_t)(-1);
+}
+
+static void
+dcache_put(LevDistanceCache *cache, LevDistanceKey key, size_t d)
+{
+  volatile LevDistanceSlot *bucket
+    = cache->slots + ((key.k0 >> 8) & cache->mask)*LEV_DCACHE_BUCKET;
+  volatile LevDistanceSlot *slot = NULL;
+  size_t i;
+
+  if (d >= 0xffffffffU)
+    return;
+  for (i = 0; i < LEV_DCACHE_BUCKET; i++) {
+    uint64_t k0 = bucket[i].k0;
+
+    if (k0 == key.k0 && bucket[i].k1 == key.k1) {
+      slot = bucket + i;
+      break;
+    }
+    if (!k0 && !slot)
+      slot = bucket + i;
+  }
+  /* the bucket is full, evict the slot the key picks */
+  if (!slot)
+    slot = bucket + (key.k1 & (LEV_DCACHE_BUCKET - 1));
+  slot->value = 0;
+  slot->k0 = key.k0;
+  slot->k1 = key.k1;
+  slot->value = ((key.k1 >> 32) << 32) | (uint64_t)d;
+}
+
+/* the Levenshtein distance of two strings, through @cache (if any) */
+static size_t
+dcache_edit_distance(LevDistanceCache *cache,
+                     size_t len1, const lev_byte *string1,
+                     size_t len2, const lev_byte *string2)
+{
+  uint64_t h1[2], h2[2];
+  LevDistanceKey key;
+  size_t d;
+
+  if (!cache || (double)len1*(double)len2 < LEV_DCACHE_MIN_CELLS)
+    return lev_edit_distance(len1, string1, len2, string2, 0);
+  dcache_hash(len1, string1, h1);
+  dcache_hash(len2, string2, h2);
+  key = dcache_key(LEV_METRIC_LEVENSHTEIN, h1, h2);
+  d = dcache_get(cache, key);
+  if (d != (size_t)(-1))
+    return d;
+  d = lev_edit_distance(len1, string1, len2, string2, 0);
+  if (d != (size_t)(-1))
+    dcache_put(cache, key, d);
+  return d;
+}
+
+static size_t
+dcache_u_edit_distance(LevDistanceCache *cache,
+                       size_t len1, const lev_wchar *string1,
+                       size_t len2, const lev_wchar *string2)
+{
+  uint64_t h1[2], h2[2];
+  LevDistanceKey key;
+  size_t d;
+
+  if (!cache || (double)len1*(double)len2 < LEV_DCACHE_MIN_CELLS)
+    return lev_u_edit_distance(len1, string1, len2, string2, 0);
+  dcache_u_hash(len1, string1, h1);
+  dcache_u_hash(len2, string2, h2);
+  key = dcache_key(LEV_METRIC_LEVENSHTEIN, h1, h2);
+  d = dcache_get(cache, key);
+  if (d != (size_t)(-1))
+    return d;
+  d = lev_u_edit_distance(len1, string1, len2, string2, 0);
+  if (d != (size_t)(-1))
+    dcache_put(cache, key, d);
+  return d;
+}
+
+/* the InDel distance of two strings, through @cache (if any); distances
+ * cut off at @max are not exact, so they are not stored */
+static size_t
+dcache_indel_distance(LevDistanceCache *cache,
+                      size_t len1, const lev_byte *string1,
+                      size_t len2, const lev_byte *string2,
+                      size_t max)
+{
+  uint64_t h1[2], h2[2];
+  LevDistanceKey key;
+  size_t d;
+
+  if (!cache || (double)len1*(double)len2 < LEV_DCACHE_MIN_CELLS)
+    return lev_indel_distance(len1, string1, len2, string2, max);
+  dcache_hash(len1, string1, h1);
+  dcache_hash(len2, string2, h2);
+  key = dcache_key(LEV_METRIC_INDEL, h1, h2);
+  d = dcache_get(cache, key);
+  if (d != (size_t)(-1))
+    return d > max ? max + 1 : d;
+  d = lev_indel_distance(len1, string1, len2, string2, max);
+  if (d <= max)
+    dcache_put(cache, key, d);
+  return d;
+}
+
+static size_t
+dcache_u_indel_distance(LevDistanceCache *cache,
+                        size_t len1, const lev_wchar *string1,
+                        size_t len2, const lev_wchar *string2,
+                        size_t max)
+{
+  uint64_t h1[2], h2[2];
+  LevDistanceKey key;
+  size_t d;
+
+  if (!cache || (double)len1*(double)len2 < LEV_DCACHE_MIN_CELLS)
+    return lev_u_indel_distance(len1, string1, len2, string2, max);
+  dcache_u_hash(len1, string1, h1);
+  dcache_u_hash(len2, string2, h2);
+  key = dcache_key(LEV_METRIC_INDEL, h1, h2);
+  d = dcache_get(cache, key);
+  if (d != (size_t)(-1))
+    return d > max ? max + 1 : d;
+  d = lev_u_indel_distance(len1, string1, len2, string2, max);
+  if (d <= max)
+    dcache_put(cache, key, d);
+  return d;
+}
+
+static int
+dcache_create(const char *filename, size_t capacity)
+{
+  LevDistanceCacheHeader header;
+  FILE *fh;
+  uint64_t nslots = 4*LEV_DCACHE_BUCKET;
+  size_t size;
+  char *tmpname;
+  int r, err;
+#ifndef _WIN32
+  unsigned int i;
+#endif
+
+  /* the file size must fit in a long for fseek() */
+  while (nslots < capacity && nslots < (uint64_t)(LONG_MAX/64)
+         && nslots < (uint64_t)(SIZE_MAX/64))
+    nslots *= 2;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, LEV_DCACHE_MAGIC, 8);
+  header.version = 1;
+  header.byteorder = LEV_DCACHE_BYTEORDER;
+  header.nslots = nslots;
+  size = sizeof(header) + (size_t)nslots*sizeof(LevDistanceSlot);
+
+  /* the file is written under a temporary name and then linked to
+   * @filename only if that doesn't exist yet, so other processes never see
+   * a partial file, and never have one they mapped truncated */
+  tmpname = (char*)malloc(strlen(filename) + 48);
+  if (!tmpname)
+    return -1;
+#ifdef _WIN32
+  sprintf(tmpname, "%s.%lu.%lu.tmp", filename,
+          (unsigned long)GetCurrentProcessId(),
+          (unsigned long)GetCurrentThreadId());
+  fh = fopen(tmpname, "wb");
+#else
+  fh = NULL;
+  for (i = 0; i < 1000; i++) {
+    int fd;
+
+    sprintf(tmpname, "%s.%ld.%u.tmp", filename, (long)getpid(), i);
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) {
+      if (errno == EEXIST)
+        continue;
+      break;
+    }
+    fh = fdopen(fd, "wb");
+    if (!fh) {
+      close(fd);
+      remove(tmpname);
+    }
+    break;
+  }
+#endif
+  if (!fh) {
+    free(tmpname);
+    return -1;
+  }
+  /* the slots are zeroes, leave them as a hole where the filesystem can */
+  if (fwrite(&header, sizeof(header), 1, fh) != 1
+      || fseek(fh, (long)(size - 1), SEEK_SET)
+      || fputc(0, fh) == EOF) {
+    fclose(fh);
+    remove(tmpname);
+    free(tmpname);
+    return -1;
+  }
+  if (fclose(fh)) {
+    remove(tmpname);
+    free(tmpname);
+    return -1;
+  }
+  /* when another process has created the cache meanwhile, it's used */
+#ifdef _WIN32
+  r = rename(tmpname, filename);
+  err = errno;
+  if (r)
+    remove(tmpname);
+  if (r && (err == EEXIST || err == EACCES))
+    r = 0;
+#else
+  r = link(tmpname, filename);
+  err = errno;
+  unlink(tmpname);
+  if (r && err == EEXIST)
+    r = 0;
+#endif
+  free(tmpname);
+  errno = err;
+  return r ? -1 : 0;
+}
+
+/**
+ * lev_distance_cache_open:
+ * @filename: The cache file.
+ * @capacity: The number of distances the cache can hold, rounded up to a
+ *            power of 2.  Only used when the file is created.
+ *
+ * Opens a distance cache, creating the file if it doesn't exist.  The file
+ * is mapped to memory (with mmap(), or a file mapping on Windows), processes
+ * opening the same file share the cache, and it persists across runs.  Caches are used
+ * by the batch functions taking a #LevDistanceCache, concurrently by all
+ * their threads.  The file is in native byte order.
+ *
+ * Returns: The cache, %NULL on failure (errno is set, to EINVAL when the file
+ *          is not a valid cache).
+ **/
+LevDistanceCache*
+lev_distance_cache_open(const char *filename, size_t capacity)
+{
+  LevDistanceCache *cache;
+  LevDistanceCacheHeader header;
+  size_t size;
+  FILE *fh;
+  long fsize = 0;
+
+  fh = fopen(filename, "r+b");
+  if (!fh && errno == ENOENT) {
+    if (dcache_create(filename, capacity))
+      return NULL;
+    fh = fopen(filename, "r+b");
+  }
+  if (!fh)
+    return NULL;
+  if (fread(&header, sizeof(header), 1, fh) != 1
+      || memcmp(header.magic, LEV_DCACHE_MAGIC, 8)
+      || header.version != 1
+      || header.byteorder != LEV_DCACHE_BYTEORDER
+      || header.nslots < LEV_DCACHE_BUCKET
+      || (header.nslots & (header.nslots - 1))
+      || header.nslots > (uint64_t)(SIZE_MAX/64)
+      || fseek(fh, 0, SEEK_END)
+      || (fsize = ftell(fh)) < 0) {
+    fclose(fh);
+    errno = EINVAL;
+    return NULL;
+  }
+  size = sizeof(header) + (size_t)header.nslots*sizeof(LevDistanceSlot);
+  if ((size_t)fsize != size) {
+    fclose(fh);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  cache = (LevDistanceCache*)malloc(sizeof(LevDistanceCache));
+  if (!cache) {
+    fclose(fh);
+    return NULL;
+  }
+  cache->size = size;
+#ifdef _WIN32
+  {
+    /* the view keeps the mapping, and the mapping the file, open */
+    HANDLE mapping = CreateFileMappingA((HANDLE)_get_osfhandle(_fileno(fh)),
+                                        NULL, PAGE_READWRITE, 0, 0, NULL);
+
+    cache->block = NULL;
+    if (mapping) {
+      cache->block = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+      CloseHandle(mapping);
+    }
+  }
+  if (!cache->block) {
+    free(cache);
+    fclose(fh);
+    errno = EACCES;
+    return NULL;
+  }
+#else
+  cache->block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fileno(fh), 0);
+  if (cache->block == MAP_FAILED) {
+    free(cache);
+    fclose(fh);
+    return NULL;
+  }
+#endif
+  fclose(fh);
+  cache->slots = (volatile LevDistanceSlot*)((char*)cache->block
+                                             + sizeof(header));
+  cache->mask = (size_t)header.nslots/LEV_DCACHE_BUCKET - 1;
+
+  return cache;
+}
+
+/**
+ * lev_distance_cache_close:
+ * @cache: A distance cache.
+ *
+ * Closes a distance cache, it must not be in use by any thread.  The
+ * distances stay in the file, the system writes them back.
+ *
+ * Returns: Zero on success, -1 when unmapping the file failed (errno is set).
+ **/
+int
+lev_distance_cache_close(LevDistanceCache *cache)
+{
+  int result = 0;
+
+  if (!cache)
+    return 0;
+#ifdef _WIN32
+  if (!UnmapViewOfFile(cache->block)) {
+    errno = EIO;
+    result = -1;
+  }
+#else
+  if (munmap(cache->block, cache->size))
+    result = -1;
+#endif
+  free(cache);
+
+  return result;
+}
+
+/**
+ * lev_distance_cache_capacity:
+ * @cache: A distance cache.
+ *
+ * Returns: The number of distances @cache can hold.
+ **/
+size_t
+lev_distance_cache_capacity(const LevDistanceCache *cache)
+{
+  return (cache->mask + 1)*LEV_DCACHE_BUCKET;
+}
+
+/**
+ * lev_distance_cache_count:
+ * @cache: A distance cache.
+ *
+ * Counts the distances in the cache.  The whole table is scanned.
+ *
+ * Returns: The number of cached distances.
+ **/
+size_t
+lev_distance_cache_count(const LevDistanceCache *cache)
+{
+  size_t i, n = 0, nslots = lev_distance_cache_capacity(cache);
+
+  for (i = 0; i < nslots; i++)
+    n += cache->slots[i].k0 != 0;
+  return n;
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Generalized medians, the greedy algorithm, and greedy improvements
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/* compute the sets of symbols each string contains, and the set of symbols
+ * in any of them (symset).  meanwhile, count how many different symbols
+ * there are (used below for symlist). */
+static lev_byte*
+make_symlist(size_t n, const size_t *lengths,
+             const lev_byte *strings[], size_t *symlistlen)
+{
+  short int *symset;  /* indexed by ALL symbols, contains 1 for symbols
+                         present in the strings, zero for others */
+  size_t i, j;
+  lev_byte *symlist;
+  LevSmallAlphabet a;
+
+  /* small alphabets are listed without the 0x100 entry symset */
+  if (small_alphabet_scan(&a, n, lengths, strings)) {
+    *symlistlen = a.size;
+    if (!a.size)
+      return NULL;
+    symlist = (lev_byte*)safe_malloc(a.size, sizeof(lev_byte));
+    if (!symlist) {
+      *symlistlen = (size_t)(-1);
+      return NULL;
+    }
+    small_alphabet_sorted(&a, symlist);
+    return symlist;
+  }
+
+  symset = (short int*)calloc(0x100, sizeof(short int));
+  if (!symset) {
+    *symlistlen = (size_t)(-1);
+    return NULL;
+  }
+  *symlistlen = 0;
+  for (i = 0; i < n; i++) {
+    const lev_byte *stri = strings[i];
+    for (j = 0; j < lengths[i]; j++) {
+      int c = stri[j];
+      if (!symset[c]) {
+        (*symlistlen)++;
+        symset[c] = 1;
+      }
+    }
+  }
+  if (!*symlistlen) {
+    free(symset);
+    return NULL;
+  }
+
+  /* create dense symbol table, so we can easily iterate over only characters
+   * present in the strings */
+  {
+    size_t pos = 0;
+    symlist = (lev_byte*)safe_malloc((*symlistlen), sizeof(lev_byte));
+    if (!symlist) {
+      *symlistlen = (size_t)(-1);
+      free(symset);
+      return NULL;
+    }
+    for (j = 0; j < 0x100; j++) {
+      if (symset[j])
+        symlist[pos++] = (lev_byte)j;
+    }
+  }
+  free(symset);
+
+  return symlist;
+}
+
+/**
+ * lev_greedy_median:
+ * @n: The size of @lengths, @strings, and @weights.
+ * @lengths: The lengths of @strings.
+ * @strings: An array of strings, that may contain NUL characters.
+ * @weights: The string weights (they behave exactly as multiplicities, though
+ *           any positive value is allowed, not just integers).
+ * @medlength: Where the length of the median should be stored.
+ *
+ * Finds a generalized median string of @strings using the greedy algorithm.
+ *
+ * Note it's considerably more efficient to give a string with weight 2
+ * than to store two identical strings in @strings (with weights 1).
+ *
+ * Returns: The generalized median, as a newly allocated string; its length
+ *          is stored in @medlength.
+ **/
+lev_byte*
+lev_greedy_median(size_t n, const size_t *lengths,
+                  const lev_byte *strings[],
+                  const double *weights,
+                  size_t *medlength)
+{
+  size_t i;  /* usually iterates over strings (n) */
+  size_t j;  /* usually iterates over characters */
+  size_t len;  /* usually iterates over the approximate median string */
+  lev_byte *symlist;  /* list of symbols present in the strings,
+                              we iterate over it insead of set of all
+                              existing symbols */
+  size_t symlistlen;  /* length of symlist */
+  size_t maxlen;  /* maximum input string length */
+  size_t stoplen;  /* maximum tried median string length -- this is slightly
+                      higher than maxlen, because the median string may be
+                      longer than any of the input strings */
+  size_t **rows;  /* Levenshtein matrix rows for each string, we need to keep
+                     only one previous row to construct the current one */
+  size_t *row;  /* a scratch buffer for new Levenshtein matrix row computation,
+                   shared among all strings */
+  lev_byte *median;  /* the resulting approximate median string */
+  double *mediandist;  /* the total distance of the best median string of
+                          given length.  warning!  mediandist[0] is total
+                          distance for empty string, while median[] itself
+                          is normally zero-based */
+  size_t bestlen;  /* the best approximate median string length */
+
+  /* find all symbols */
+  symlist = make_symlist(n, lengths, strings, &symlistlen);
+  if (!symlist) {
+    *medlength = 0;
+    if (symlistlen != 0)
+      return NULL;
+    else
+      return (lev_byte*)calloc(1, sizeof(lev_byte));
+  }
+
+  /* allocate and initialize per-string matrix rows and a common work buffer */
+  rows = (size_t**)safe_malloc(n, sizeof(size_t*));
+  if (!rows) {
+    free(symlist);
+    return NULL;
+  }
+  maxlen = 0;
+  for (i = 0; i < n; i++) {
+    size_t *ri;
+    size_t leni = lengths[i];
+    if (leni > maxlen)
+      maxlen = leni;
+    ri = rows[i] = (size_t*)safe_malloc((leni + 1), sizeof(size_t));
+    if (!ri) {
+      for (j = 0; j < i; j++)
+        free(rows[j]);
+      free(rows);
+      free(symlist);
+      return NULL;
+    }
+    for (j = 0; j <= leni; j++)
+      ri[j] = j;
+  }
+  stoplen = 2*maxlen + 1;
+  row = (size_t*)safe_malloc((stoplen + 1), sizeof(size_t));
+  if (!row) {
+    for (j = 0; j < n; j++)
+      free(rows[j]);
+    free(rows);
+    free(symlist);
+    return NULL;
+  }
+
+  /* compute final cost of string of length 0 (empty string may be also
+   * a valid answer) */
+  median = (lev_byte*)safe_malloc(stoplen, sizeof(lev_byte));
+  if (!median) {
+    for (j = 0; j < n; j++)
+      free(rows[j]);
+    free(rows);
+    free(row);
+    free(symlist);
+    return NULL;
+  }
+  mediandist = (double*)safe_malloc((stoplen + 1), sizeof(double));
+  if (!mediandist) {
+    for (j = 0; j < n; j++)
+      free(rows[j]);
+    free(rows);
+    free(row);
+    free(symlist);
+    free(median);
+    return NULL;
+  }
+  mediandist[0] = 0.0;
+  for (i = 0; i < n; i++)
+    mediandist[0] += (double)lengths[i]*weights[i];
+
+  /* build up the approximate median string symbol by symbol
+   * XXX: we actually exit on break below, but on the same condition */
+  for (len = 1; len <= stoplen; len++) {
+    lev_byte symbol;
+    double minminsum = LEV_INFINITY;
+    row[0] = len;
+    /* iterate over all symbols we may want to add */
+    for (j = 0; j < symlistlen; j++) {
+      double totaldist = 0.0;
+      double minsum = 0.0;
+      symbol = symlist[j];
+      /* sum Levenshtein distances from all the strings, with given weights */
+      for (i = 0; i < n; i++) {
+        const lev_byte *stri = strings[i];
+        size_t *p = rows[i];
+        size_t leni = lengths[i];
+        size_t *end = rows[i] + leni;
+        size_t min = len;
+        size_t x = len; /* == row[0] */
+        /* compute how another row of Levenshtein matrix would look for median
+         * string with this symbol added */
+        while (p < end) {
+          size_t D = *(p++) + (symbol != *(stri++));
+          x++;
+          if (x > D)
+            x = D;
+          if (x > *p + 1)
+            x = *p + 1;
+          if (x < min)
+            min = x;
+        }
+        minsum += (double)min*weights[i];
+        totaldist += (double)x*weights[i];
+      }
+      /* is this symbol better than all the others? */
+      if (minsum < minminsum) {
+        minminsum = minsum;
+        mediandist[len] = totaldist;
+        median[len - 1] = symbol;
+      }
+    }
+    /* stop the iteration if we no longer need to recompute the matrix rows
+     * or when we are over maxlen and adding more characters doesn't seem
+     * useful */
+    if (len == stoplen
+        || (len > maxlen && mediandist[len] > mediandist[len - 1])) {
+      stoplen = len;
+      break;
+    }
+    /* now the best symbol is known, so recompute all matrix rows for this
+     * one */
+    symbol = median[len - 1];
+    for (i = 0; i < n; i++) {
+      const lev_byte *stri = strings[i];
+      size_t *oldrow = rows[i];
+      size_t leni = lengths[i];
+      size_t k;
+      /* compute a row of Levenshtein matrix */
+      for (k = 1; k <= leni; k++) {
+        size_t c1 = oldrow[k] + 1;
+        size_t c2 = row[k - 1] + 1;
+        size_t c3 = oldrow[k - 1] + (symbol != stri[k - 1]);
+        row[k] = c2 > c3 ? c3 : c2;
+        if (row[k] > c1)
+          row[k] = c1;
+      }
+      memcpy(oldrow, row, (leni + 1)*sizeof(size_t));
+    }
+  }
+
+  /* find the string with minimum total distance */
+  bestlen = 0;
+  for (len = 1; len <= stoplen; len++) {
+    if (mediandist[len] < mediandist[bestlen])
+      bestlen = len;
+  }
+
+  /* clean up */
+  for (i = 0; i < n; i++)
+    free(rows[i]);
+  free(rows);
+  free(row);
+  free(symlist);
+  free(mediandist);
+
+  /* return result */
+  {
+    lev_byte *result = (lev_byte*)safe_malloc(bestlen, sizeof(lev_byte));
+    if (!result) {
+      free(median);
+      return NULL;
+    }
+    memcpy(result, median, bestlen*sizeof(lev_byte));
+    free(median);
+    *medlength = bestlen;
+    return result;
+  }
+}
+
+/*
+ * Knowing the distance matrices up to some row, finish the distance
+ * computations.
+ *
+ * string1, len1 are already shortened.
+ */
+static double
+finish_distance_computations(size_t len1, lev_byte *string1,
+                             size_t n, const size_t *lengths,
+                             const lev_byte **strings,
+                             const double *weights, size_t **rows,
+                             size_t *row)
+{
+  size_t *end;
+  size_t i, j;
+  size_t offset;  /* row[0]; offset + len1 give together real len of string1 */
+  double distsum = 0.0;  /* sum of distances */
+
+  /* catch trivia case */
+  if (len1 == 0) {
+    for (j = 0; j < n; j++)
+      distsum += (double)rows[j][lengths[j]]*weights[j];
+    return distsum;
+  }
+
+  /* iterate through the strings and sum the distances */
+  for (j = 0; j < n; j++) {
+    size_t *rowi = rows[j];  /* current row */
+    size_t leni = lengths[j];  /* current length */
+    size_t len = len1;  /* temporary len1 for suffix stripping */
+    size_t suffix;
+    const lev_byte *stringi = strings[j];  /* current string */
+
+    /* strip common suffix (prefix CAN'T be stripped) */
+    suffix = lev_common_suffix(len, string1, leni, stringi, sizeof(*string1));
+    len -= suffix;
+    leni -= suffix;
+
+    /* catch trivial cases */
+    if (len == 0) {
+      distsum += (double)rowi[leni]*weights[j];
+      continue;
+    }
+    offset = rowi[0];
+    if (leni == 0) {
+      distsum += (double)(offset + len)*weights[j];
+      continue;
+    }
+
+    /* complete the matrix */
+    memcpy(row, rowi, (leni + 1)*sizeof(size_t));
+    end = row + leni;
+
+    for (i = 1; i <= len; i++) {
+      size_t *p = row + 1;
+      const lev_byte char1 = string1[i - 1];
+      const lev_byte *char2p = stringi;
+      size_t D, x;
+
+      D = x = i + offset;
+      while (p <= end) {
+        size_t c3 = --D + (char1 != *(char2p++));
+        x++;
+        if (x > c3)
+          x = c3;
+        D = *p;
+        D++;
+        if (x > D)
+          x = D;
+        *(p++) = x;
+      }
+    }
+    distsum += weights[j]*(double)(*end);
+  }
+
+  return distsum;
+}
+
+/* The perturbations of one median position tried by lev_median_refine():
+ * the replacements, the insertions and the deletion, in this order, each
+ * with the symbols in symlist order.  They are independent and evaluated
+ * in parallel, every thread with its own matrix row and perturbed median
+ * tail, into sums; the choice is then made in the same order as if they
+ * were tried one by one, so the result doesn't depend on the threads.
+ *
+ * The distance of a string to a perturbed median is the minimum over the
+ * string split points of the prefix matrix row plus the backward matrix
+ * row of the tail, the distances of the tail to the string suffixes.  The
+ * median tails after the position are never changed by the edits made
+ * before it, so the backward rows of all of them are computed at the
+ * start of a pass, in back; then a perturbation is just one backward row
+ * step per string instead of a whole matrix.  The next pass recomputes
+ * the rows of the tails the edits changed only, the shorter ones are
+ * kept.  When the rows don't fit, the perturbed tails are computed from
+ * scratch. */
+typedef struct {
+  int unicode;
+  size_t n;
+  const size_t *lengths;
+  const void *strings;
+  const double *weights;
+  size_t **rows;  /* matrix rows of the median prefix */
+  const void *symlist;
+  size_t symlistlen;
+  size_t stoplen;
+  size_t sumlen;  /* total length of the strings */
+  size_t maxthreads;
+  LevTeam team;  /* the threads evaluating the perturbations */
+  size_t *scratch;  /* a matrix row per thread */
+  void *tails;  /* a perturbed median tail per thread */
+  double *sums;  /* distance sums of the perturbations */
+  size_t *back;  /* backward matrix rows of the tails, by tail length */
+  size_t backcap;  /* the number of tails back has room for */
+  size_t backlen;  /* the number of tails whose rows are valid */
+  /* the position */
+  const void *median;
+  size_t medlen;
+  size_t pos;
+  size_t ncands;
+} LevImproveCands;
+
+/* the largest size of LevImproveCands backward rows, in distances */
+#define LEV_IMPROVE_BACK_MAX ((size_t)1 << 23)
+
+static int
+improve_cands_init(LevImproveCands *cands, int unicode,
+                   size_t n, const size_t *lengths, const void *strings,
+                   const double *weights, size_t **rows,
+                   const void *symlist, size_t symlistlen, size_t stoplen,
+                   size_t nthreads)
+{
+  size_t i, width = unicode ? sizeof(lev_wchar) : sizeof(lev_byte);
+
+  cands->unicode = unicode;
+  cands->n = n;
+  cands->lengths = lengths;
+  cands->strings = strings;
+  cands->weights = weights;
+  cands->rows = rows;
+  cands->symlist = symlist;
+  cands->symlistlen = symlistlen;
+  cands->stoplen = stoplen;
+  cands->sumlen = 0;
+  for (i = 0; i < n; i++)
+    cands->sumlen += lengths[i];
+  cands->maxthreads = nthreads ? nthreads : lev_cpu_count();
+  if (cands->maxthreads > 2*symlistlen + 1)
+    cands->maxthreads = 2*symlistlen + 1;
+  cands->scratch = (size_t*)safe_malloc_3(cands->maxthreads, stoplen + 2,
+                                          sizeof(size_t));
+  cands->tails = safe_malloc_3(cands->maxthreads, stoplen + 2, width);
+  cands->sums = (double*)safe_malloc(2*symlistlen + 1, sizeof(double));
+  cands->back = NULL;
+  cands->backcap = 0;
+  cands->backlen = 0;
+  if (!cands->scratch || !cands->tails || !cands->sums) {
+    free(cands->scratch);
+    free(cands->tails);
+    free(cands->sums);
+    return -1;
+  }
+  lev_team_init(&cands->team, cands->maxthreads);
+  return 0;
+}
+
+static void
+improve_cands_free(LevImproveCands *cands)
+{
+  free(cands->scratch);
+  free(cands->tails);
+  free(cands->sums);
+  free(cands->back);
+  lev_team_free(&cands->team);
+}
+
+/* compute the backward matrix rows of the tails of @median the edits of
+ * the previous pass changed, or free them all when they don't fit */
+static void
+improve_cands_back(LevImproveCands *cands, const void *median, size_t medlen)
+{
+  size_t rowsize = cands->sumlen + cands->n;
+  size_t t, i, k;
+
+  if (medlen + 1 > cands->backcap) {
+    size_t *back = NULL;
+
+    if (rowsize <= LEV_IMPROVE_BACK_MAX/(medlen + 1))
+      back = (size_t*)realloc(cands->back,
+                              (medlen + 1)*rowsize*sizeof(size_t));
+    if (!back) {
+      free(cands->back);
+      cands->back = NULL;
+      cands->backcap = cands->backlen = 0;
+      return;
+    }
+    cands->back = back;
+    cands->backcap = medlen + 1;
+  }
+  for (t = cands->backlen; t <= medlen; t++) {
+    size_t *row = cands->back + t*rowsize;
+    const size_t *next = t ? row - rowsize : row;
+
+    for (i = 0; i < cands->n; i++) {
+      size_t leni = cands->lengths[i];
+
+      row[leni] = t;
+      for (k = leni; k-- > 0; ) {
+        size_t c1, c2, c3;
+
+        if (t == 0) {
+          row[k] = leni - k;
+          continue;
+        }
+        c1 = next[k] + 1;
+        c2 = row[k + 1] + 1;
+        if (cands->unicode)
+          c3 = next[k + 1]
+               + (((const lev_wchar*)median)[medlen - t]
+                  != ((const lev_wchar**)cands->strings)[i][k]);
+        else
+          c3 = next[k + 1]
+               + (((const lev_byte*)median)[medlen - t]
+                  != ((const lev_byte**)cands->strings)[i][k]);
+        row[k] = c2 > c3 ? c3 : c2;
+        if (row[k] > c1)
+          row[k] = c1;
+      }
+      row += leni + 1;
+      next += leni + 1;
+    }
+  }
+  cands->backlen = medlen + 1;
+}
+
+/* the distance of a string to the median prefix with matrix row @row
+ * followed by the tail with backward row @next, or by @symbol and the
+ * tail if @step */
+static size_t
+improve_back_distance(size_t len, const lev_byte *string,
+                      const size_t *row, const size_t *next,
+                      int step, lev_byte symbol)
+{
+  size_t d, b, k;
+
+  if (!step) {
+    d = row[len] + next[len];
+    for (k = 0; k < len; k++) {
+      if (row[k] + next[k] < d)
+        d = row[k] + next[k];
+    }
+    return d;
+  }
+  b = next[len] + 1;
+  d = row[len] + b;
+  for (k = len; k-- > 0; ) {
+    size_t c1 = next[k] + 1;
+    size_t c2 = b + 1;
+    size_t c3 = next[k + 1] + (symbol != string[k]);
+
+    b = c2 > c3 ? c3 : c2;
+    if (b > c1)
+      b = c1;
+    if (row[k] + b < d)
+      d = row[k] + b;
+  }
+  return d;
+}
+
+static size_t
+improve_uback_distance(size_t len, const lev_wchar *string,
+                       const size_t *row, const size_t *next,
+                       int step, lev_wchar symbol)
+{
+  size_t d, b, k;
+
+  if (!step) {
+    d = row[len] + next[len];
+    for (k = 0; k < len; k++) {
+      if (row[k] + next[k] < d)
+        d = row[k] + next[k];
+    }
+    return d;
+  }
+  b = next[len] + 1;
+  d = row[len] + b;
+  for (k = len; k-- > 0; ) {
+    size_t c1 = next[k] + 1;
+    size_t c2 = b + 1;
+    size_t c3 = next[k + 1] + (symbol != string[k]);
+
+    b = c2 > c3 ? c3 : c2;
+    if (b > c1)
+      b = c1;
+    if (row[k] + b < d)
+      d = row[k] + b;
+  }
+  return d;
+}
+
+/* the distance sum of perturbation @k from the backward rows, @j is its
+ * symbol, symlistlen for the deletion */
+static double
+improve_cands_back_sum(const LevImproveCands *cands, size_t k, size_t j)
+{
+  size_t base = cands->pos < cands->medlen ? cands->symlistlen : 0;
+  /* the tail after the perturbed symbol */
+  size_t t = cands->medlen - cands->pos - (k < base || j == cands->symlistlen);
+  const size_t *next = cands->back + t*(cands->sumlen + cands->n);
+  int step = j < cands->symlistlen;
+  double distsum = 0.0;
+  size_t i;
+
+  for (i = 0; i < cands->n; i++) {
+    size_t leni = cands->lengths[i];
+    size_t d;
+
+    if (cands->unicode)
+      d = improve_uback_distance(leni, ((const lev_wchar**)cands->strings)[i],
+                                 cands->rows[i], next, step,
+                                 step ? ((const lev_wchar*)cands->symlist)[j]
+                                      : 0);
+    else
+      d = improve_back_distance(leni, ((const lev_byte**)cands->strings)[i],
+                                cands->rows[i], next, step,
+                                step ? ((const lev_byte*)cands->symlist)[j]
+                                     : 0);
+    distsum += cands->weights[i]*(double)d;
+    next += leni + 1;
+  }
+  return distsum;
+}
+
+static void
+improve_cands_worker(void *data, size_t ithread, size_t nthreads)
+{
+  LevImproveCands *cands = (LevImproveCands*)data;
+  size_t *row = cands->scratch + ithread*(cands->stoplen + 2);
+  size_t base = cands->pos < cands->medlen ? cands->symlistlen : 0;
+  size_t pos = cands->pos, k;
+
+  for (k = ithread; k < cands->ncands; k += nthreads) {
+    /* median symbols after pos the perturbation drops, and its symbol */
+    size_t skip = k < base || k == base + cands->symlistlen;
+    size_t j = k < base ? k : k - base;
+    size_t len = cands->medlen - pos - skip;
+
+    lev_sched_checkpoint(ithread);
+    if (cands->unicode) {
+      const lev_wchar *median = (const lev_wchar*)cands->median;
+      const lev_wchar *symlist = (const lev_wchar*)cands->symlist;
+      lev_wchar *tail = (lev_wchar*)cands->tails + ithread*(cands->stoplen + 2);
+
+      if (k < base && symlist[j] == median[pos])
+        continue;
+      if (cands->back) {
+        cands->sums[k] = improve_cands_back_sum(cands, k, j);
+        continue;
+      }
+      if (j < cands->symlistlen) {
+        tail[0] = symlist[j];
+        memcpy(tail + 1, median + pos + skip, len*sizeof(lev_wchar));
+        len++;
+      }
+      else
+        memcpy(tail, median + pos + 1, len*sizeof(lev_wchar));
+      cands->sums[k] = finish_udistance_computations(len, tail, cands->n,
+                                                     cands->lengths,
+                                                     (const lev_wchar**)
+                                                     cands->strings,
+                                                     cands->weights,
+                                                     cands->rows, row);
+    }
+    else {
+      const lev_byte *median = (const lev_byte*)cands->median;
+      const lev_byte *symlist = (const lev_byte*)cands->symlist;
+      lev_byte *tail = (lev_byte*)cands->tails + ithread*(cands->stoplen + 2);
+
+      if (k < base && symlist[j] == median[pos])
+        continue;
+      if (cands->back) {
+        cands->sums[k] = improve_cands_back_sum(cands, k, j);
+        continue;
+      }
+      if (j < cands->symlistlen) {
+        tail[0] = symlist[j];
+        memcpy(tail + 1, median + pos + skip, len*sizeof(lev_byte));
+        len++;
+      }
+      else
+        memcpy(tail, median + pos + 1, len*sizeof(lev_byte));
+      cands->sums[k] = finish_distance_computations(len, tail, cands->n,
+                                                    cands->lengths,
+                                                    (const lev_byte**)
+                                                    cands->strings,
+                                                    cands->weights,
+                                                    cands->rows, row);
+    }
+  }
+}
+
+/* evaluate all perturbations of @median at @pos into cands->sums, on as
+ * many threads as the amount of work pays for */
+static void
+improve_cands_eval(LevImproveCands *cands,
+                   const void *median, size_t medlen, size_t pos)
+{
+  size_t nthreads = cands->maxthreads;
+  double cells;
+
+  cands->median = median;
+  cands->medlen = medlen;
+  cands->pos = pos;
+  cands->ncands = pos < medlen ? 2*cands->symlistlen + 1 : cands->symlistlen;
+  cells = (double)cands->ncands*(double)cands->sumlen;
+  if (!cands->back)
+    cells *= (double)(medlen - pos + 1);
+  if ((double)nthreads > cells/(double)lev_tuning.improve_cells + 1.0)
+    nthreads = (size_t)(cells/(double)lev_tuning.improve_cells) + 1;
+  if (nthreads > cands->ncands)
+    nthreads = cands->ncands;
+  lev_team_run(&cands->team, nthreads, improve_cands_worker, cands);
+}
+
+/**
+ * lev_median_refine:
+ * @len: The length of @s.
+ * @s: The approximate generalized median string to be improved.
+ * @n: The size of @lengths, @strings, and @weights.
+ * @lengths: The lengths of @strings.
+ * @strings: An array of strings, that may contain NUL characters.
+ * @weights: The string weights (they behave exactly as multiplicities, though
+ *           any positive value is allowed, not just integers).
+ * @maxpasses: The largest number of passes over @s, 0 means as many as
+ *             needed.
+ * @nthreads: The largest number of threads to use, zero means one per
+ *            processor.
+ * @medlength: Where the new length of the median should be stored.
+ *
+ * Tries to make @s a better generalized median string of @strings with
+ * small perturbations, in passes over it until one changes nothing.
+ * The result is the same as of calling lev_median_improve() on its
+ * result again and again, only faster: a pass evaluates perturbations
+ * in time linear in the string lengths, reusing the matrix rows of the
+ * median tail the previous pass didn't change, and the last pass stops
+ * where the previous one made its last edit.
+ *
+ * It never returns a string with larger SOD than @s; in the worst case, a
+ * string identical to @s is returned.  The perturbations of a position are
+ * evaluated in parallel when there's enough work, the result is the same.
+ *
+ * Returns: The improved generalized median, as a newly allocated string; its
+ *          length is stored in @medlength.
+ **/
+lev_byte*
+lev_median_refine(size_t len, const lev_byte *s,
+                  size_t n, const size_t *lengths,
+                  const lev_byte *strings[],
+                  const double *weights,
+                  size_t maxpasses,
+                  size_t nthreads,
+                  size_t *medlength)
+{
+  size_t i;  /* usually iterates over strings (n) */
+  size_t j;  /* usually iterates over characters */
+  size_t pos;  /* the position in the approximate median string we are
+                  trying to change */
+  lev_byte *symlist;  /* list of symbols present in the strings,
+                              we iterate over it insead of set of all
+                              existing symbols */
+  size_t symlistlen;  /* length of symlist */
+  size_t maxlen;  /* maximum input string length */
+  size_t stoplen;  /* maximum tried median string length -- this is slightly
+                      higher than maxlen, because the median string may be
+                      longer than any of the input strings */
+  size_t **rows;  /* Levenshtein matrix rows for each string, we need to keep
+                     only one previous row to construct the current one */
+  size_t *row;  /* a scratch buffer for new Levenshtein matrix row computation,
+                   shared among all strings */
+  lev_byte *median;  /* the resulting approximate median string */
+  size_t medlen;  /* the current approximate median string length */
+  double minminsum;  /* the current total distance sum */
+  LevImproveCands cands;  /* the perturbations of a position */
+  size_t pass;  /* the number of passes made */
+  size_t nedits;  /* the number of edits in this pass */
+  size_t lastclean;  /* the median tail after the last edit */
+  size_t cleantail;  /* the median tail the previous pass didn't change */
+
+  /* find all symbols */
+  symlist = make_symlist(n, lengths, strings, &symlistlen);
+  if (!symlist) {
+    *medlength = 0;
+    if (symlistlen != 0)
+      return NULL;
+    else
+      return (lev_byte*)calloc(1, sizeof(lev_byte));
+  }
+
+  /* allocate and initialize per-string matrix rows and a common work buffer */
+  rows = (size_t**)safe_malloc(n, sizeof(size_t*));
+  if (!rows) {
+    free(symlist);
+    return NULL;
+  }
+  maxlen = 0;
+  for (i = 0; i < n; i++) {
+    size_t *ri;
+    size_t leni = lengths[i];
+    if (leni > maxlen)
+      maxlen = leni;
+    ri = rows[i] = (size_t*)safe_malloc((leni + 1), sizeof(size_t));
+    if (!ri) {
+      for (j = 0; j < i; j++)
+        free(rows[j]);
+      free(rows);
+      free(symlist);
+      return NULL;
+    }
+    for (j = 0; j <= leni; j++)
+      ri[j] = j;
+  }
+  stoplen = 2*maxlen + 1;
+  row = (size_t*)safe_malloc((stoplen + 2), sizeof(size_t));
+  if (!row) {
+    for (j = 0; j < n; j++)
+      free(rows[j]);
+    free(rows);
+    free(symlist);
+    return NULL;
+  }
+
+  /* initialize median to given string */
+  median = (lev_byte*)safe_malloc((stoplen+1), sizeof(lev_byte));
+  if (!median
+      || improve_cands_init(&cands, 0, n, lengths, strings, weights, rows,
+                            symlist, symlistlen, stoplen, nthreads) < 0) {
+    for (j = 0; j < n; j++)
+      free(rows[j]);
+    free(rows);
+    free(row);
+    free(median);
+    free(symlist);
+    return NULL;
+  }
+  medlen = len;
+  memcpy(median, s, (medlen)*sizeof(lev_byte));
+  minminsum = finish_distance_computations(medlen, median,
+                                           n, lengths, strings,
+                                           weights, rows, row);
+
+  /* sequentially try perturbations on all positions, pass after pass */
+  lastclean = cleantail = 0;
+  for (pass = 0; maxpasses == 0 || pass < maxpasses; pass++) {
+    if (pass > 0) {
+      for (i = 0; i < n; i++) {
+        for (j = 0; j <= lengths[i]; j++)
+          rows[i][j] = j;
+      }
+    }
+    improve_cands_back(&cands, median, medlen);
+    nedits = 0;
+    for (pos = 0; pos <= medlen; ) {
+      lev_byte symbol;
+      LevEditType operation;
+      size_t base;  /* where the insertions start in cands.sums */
+
+      /* the rest is as it was at the end of the previous pass, as is the
+       * total distance, so this pass wouldn't change anything either */
+      if (pass > 0 && nedits == 0 && medlen - pos <= cleantail)
+        break;
+      improve_cands_eval(&cands, median, medlen, pos);
+      symbol = median[pos];
+      operation = LEV_EDIT_KEEP;
+      /* IF pos < medlength: FOREACH symbol: try to replace the symbol
+       * at pos, if some lower the total distance, chooste the best */
+      base = 0;
+      if (pos < medlen) {
+        base = symlistlen;
+        for (j = 0; j < symlistlen; j++) {
+          if (symlist[j] == median[pos])
+            continue;
+          if (cands.sums[j] < minminsum) {
+            minminsum = cands.sums[j];
+            symbol = symlist[j];
+            operation = LEV_EDIT_REPLACE;
+          }
+        }
+      }
+      /* FOREACH symbol: try to add it at pos, if some lower the total
+       * distance, chooste the best (increase medlength) */
+      for (j = 0; j < symlistlen; j++) {
+        if (cands.sums[base + j] < minminsum) {
+          minminsum = cands.sums[base + j];
+          symbol = symlist[j];
+          operation = LEV_EDIT_INSERT;
+        }
+      }
+      /* IF pos < medlength: try to delete the symbol at pos, if it lowers
+       * the total distance remember it (decrease medlength) */
+      if (pos < medlen && cands.sums[base + symlistlen] < minminsum) {
+        minminsum = cands.sums[base + symlistlen];
+        operation = LEV_EDIT_DELETE;
+      }
+      if (operation != LEV_EDIT_KEEP) {
+        lastclean = medlen - pos - (operation != LEV_EDIT_INSERT);
+        nedits++;
+      }
+      /* actually perform the operation */
+      switch (operation) {
+        case LEV_EDIT_REPLACE:
+        median[pos] = symbol;
+        break;
+
+        case LEV_EDIT_INSERT:
+        memmove(median+pos+1, median+pos,
+                (medlen - pos)*sizeof(lev_byte));
+        median[pos] = symbol;
+        medlen++;
+        break;
+
+        case LEV_EDIT_DELETE:
+        memmove(median+pos, median + pos+1,
+                (medlen - pos-1)*sizeof(lev_byte));
+        medlen--;
+        break;
+
+        default:
+        break;
+      }
+      assert(medlen <= stoplen);
+      /* now the result is known, so recompute all matrix rows and move on */
+      if (operation != LEV_EDIT_DELETE) {
+        symbol = median[pos];
+        row[0] = pos + 1;
+        for (i = 0; i < n; i++) {
+          const lev_byte *stri = strings[i];
+          size_t *oldrow = rows[i];
+          size_t leni = lengths[i];
+          size_t k;
+          /* compute a row of Levenshtein matrix */
+          for (k = 1; k <= leni; k++) {
+            size_t c1 = oldrow[k] + 1;
+            size_t c2 = row[k - 1] + 1;
+            size_t c3 = oldrow[k - 1] + (symbol != stri[k - 1]);
+            row[k] = c2 > c3 ? c3 : c2;
+            if (row[k] > c1)
+              row[k] = c1;
+          }
+          memcpy(oldrow, row, (leni + 1)*sizeof(size_t));
+        }
+        pos++;
+      }
+    }
+    if (nedits == 0)
+      break;
+    /* the tail after the last edit is unchanged, and so are its rows */
+    cleantail = lastclean;
+    if (cands.backlen > cleantail + 1)
+      cands.backlen = cleantail + 1;
+  }
+
+  /* clean up */
+  for (i = 0; i < n; i++)
+    free(rows[i]);
+  free(rows);
+  free(row);
+  free(symlist);
+  improve_cands_free(&cands);
+
+  /* return result */
+  {
+    lev_byte *result = (lev_byte*)safe_malloc(medlen, sizeof(lev_byte));
+    if (!result) {
+      free(median);
+      return NULL;
+    }
+    *medlength = medlen;
+    memcpy(result, median, medlen*sizeof(lev_byte));
+    free(median);
+    return result;
+  }
+}
+
+/**
+ * lev_median_improve:
+ * @len: The length of @s.
+ * @s: The approximate generalized median string to be improved.
+ * @n: The size of @lengths, @strings, and @weights.
+ * @lengths: The lengths of @strings.
+ * @strings: An array of strings, that may contain NUL characters.
+ * @weights: The string weights (they behave exactly as multiplicities, though
+ *           any positive value is allowed, not just integers).
+ * @medlength: Where the new length of the median should be stored.
+ *
+ * Tries to make @s a better generalized median string of @strings with
+ * small perturbations.
+ *
+ * It never returns a string with larger SOD than @s; in the worst case, a
+ * string identical to @s is returned.  The perturbations of a position are
+ * evaluated in parallel when there's enough work, the result is the same.
+ *
+ * Returns: The improved generalized median, as a newly allocated string; its
+ *          length is stored in @medlength.
+ **/
+lev_byte*
+lev_median_improve(size_t len, const lev_byte *s,
+                   size_t n, const size_t *lengths,
+                   const lev_byte *strings[],
+                   const double *weights,
+                   size_t *medlength)
+{
+  return lev_median_refine(len, s, n, lengths, strings, weights, 1, 0,
+                           medlength);
+}
+
+/* used internally in make_usymlist */
+typedef struct _HItem HItem;
+struct _HItem {
+  lev_wchar c;
+  HItem *n;
+};
+
+/* free usmylist hash
+ * this is a separate function because we need it in more than one place */
+static void
+free_usymlist_hash(HItem *symmap)
+{
+  size_t j;
+
+  for (j = 0; j < 0x100; j++) {
+    HItem *p = symmap + j;
+    if (p->n == symmap || p->n == NULL)
+      continue;
+    p = p->n;
+    while (p) {
+      HItem *q = p;
+      p = p->n;
+      free(q);
+    }
+  }
+  free(symmap);
+}
+
+/* compute the sets of symbols each string contains, and the set of symbols
+ * in any of them (symset).  meanwhile, count how many different symbols
+ * there are (used below for symlist). */
+static lev_wchar*
+make_usymlist(size_t n, const size_t *lengths,
+              const lev_wchar *strings[], size_t *symlistlen)
+{
+  lev_wchar *symlist;
+  size_t i, j;
+  HItem *symmap;
+
+  j = 0;
+  for (i = 0; i < n; i++)
+    j += lengths[i];
+
+  *symlistlen = 0;
+  if (j == 0)
+    return NULL;
+
+  /* find all symbols, use a kind of hash for storage */
+  symmap = (HItem*)safe_malloc(0x100, sizeof(HItem));
+  if (!symmap) {
+    *symlistlen = (size_t)(-1);
+    return NULL;
+  }
+  /* this is an ugly memory allocation avoiding hack: most hash elements
+   * will probably contain none or one symbols only so, when p->n is equal
+   * to symmap, it means there're no symbols yet, afters insterting the
+   * first one, p->n becomes normally NULL and then it behaves like an
+   * usual singly linked list */
+  for (i = 0; i < 0x100; i++)
+    symmap[i].n = symmap;
+  for (i = 0; i < n; i++) {
+    const lev_wchar *stri = strings[i];
+    for (j = 0; j < lengths[i]; j++) {
+      lev_wchar c = stri[j];
+      int key = ((int)c + ((int)c >> 7)) & 0xff;
+      HItem *p = symmap + key;
+      if (p->n == symmap) {
+        p->c = c;
+        p->n = NULL;
+        (*symlistlen)++;
+        continue;
+      }
+      while (p->c != c && p->n != NULL)
+        p = p->n;
+      if (p->c != c) {
+        p->n = (HItem*)malloc(sizeof(HItem));
+        if (!p->n) {
+          free_usymlist_hash(symmap);
+          *symlistlen = (size_t)(-1);
+          return NULL;
+        }
+        p = p->n;
+        p->n = NULL;
+        p->c = c;
+        (*symlistlen)++;
+      }
+    }
+  }
+  /* create dense symbol table, so we can easily iterate over only characters
+   * present in the strings */
+  {
+    size_t pos = 0;
+    symlist = (lev_wchar*)safe_malloc((*symlistlen), sizeof(lev_wchar));
+    if (!symlist) {
+      free_usymlist_hash(symmap);
+      *symlistlen = (size_t)(-1);
+      return NULL;
+    }
+    for (j = 0; j < 0x100; j++) {
+      HItem *p = symmap + j;
+      while (p != NULL && p->n != symmap) {
+        symlist[pos++] = p->c;
+        p = p->n;
+      }
+    }
+  }
+
+  /* free memory */
+  free_usymlist_hash(symmap);
+
+  return symlist;
+}
+
+/* dense alphabet remapping
+ * when all the strings together contain at most 0x100 different symbols,
+ * they are translated to dense lev_byte symbol ids and the table-driven
+ * byte engines are run on them instead of the hash-based unicode ones.
+ * the ids are assigned in exactly the order make_usymlist() (and
+ * make_usymlistset()) would list the symbols, so the byte engines iterate
+ * over candidates in the same order and give bit-identical results */
+typedef struct {
+  size_t symlistlen;  /* number of different symbols */
+  lev_wchar symlist[0x100];  /* symbol id -> symbol */
+  const lev_byte **strings;  /* the remapped strings */
+  const lev_byte *s;  /* the remapped extra string, if any */
+  lev_byte *buffer;  /* storage of all the remapped strings */
+} LevDenseMap;
+
+#define LEV_DENSE_HSIZE 0x200
+
+/* the symbol lookup of udensemap_init(), linear probing in a table at most
+ * half full, @ids contains id + 1, zero means an empty slot */
+static size_t
+udensemap_slot(const lev_wchar *keys, const size_t *ids, lev_wchar c)
+{
+  size_t h = ((size_t)c ^ ((size_t)c >> 9)) & (LEV_DENSE_HSIZE - 1);
+
+  while (ids[h] && keys[h] != c)
+    h = (h + 1) & (LEV_DENSE_HSIZE - 1);
+  return h;
+}
+
+/* fills @map with remapped @strings (and @s of length @len, whose symbols
+ * must all occur in @strings).
+ * returns nonzero on success, zero when the remapping is not possible or
+ * not worth it (too many symbols, no symbols, allocation failure); the
+ * caller then just falls back to the unicode engine */
+static int
+udensemap_init(LevDenseMap *map,
+               size_t n, const size_t *lengths, const lev_wchar *strings[],
+               size_t len, const lev_wchar *s)
+{
+  lev_wchar keys[LEV_DENSE_HSIZE];
+  size_t ids[LEV_DENSE_HSIZE];
+  size_t count[0x100], perm[0x100];
+  lev_wchar seen[0x100];  /* symbols in the order of first appearance */
+  size_t i, j, total, nsyms;
+  lev_byte *p;
+
+  total = len;
+  for (i = 0; i < n; i++)
+    total += lengths[i];
+  if (!total)
+    return 0;
+  map->buffer = (lev_byte*)safe_malloc(total, sizeof(lev_byte));
+  if (!map->buffer)
+    return 0;
+  map->strings = (const lev_byte**)safe_malloc(n, sizeof(lev_byte*));
+  if (!map->strings) {
+    free(map->buffer);
+    return 0;
+  }
+
+  /* translate to provisional ids (the order of first appearance) */
+  memset(ids, 0, LEV_DENSE_HSIZE*sizeof(size_t));
+  nsyms = 0;
+  p = map->buffer;
+  for (i = 0; i < n; i++) {
+    const lev_wchar *stri = strings[i];
+    map->strings[i] = p;
+    for (j = 0; j < lengths[i]; j++) {
+      lev_wchar c = stri[j];
+      size_t h = udensemap_slot(keys, ids, c);
+      if (!ids[h]) {
+        if (nsyms == 0x100) {
+          free(map->strings);
+          free(map->buffer);
+          return 0;
+        }
+        keys[h] = c;
+        seen[nsyms] = c;
+        ids[h] = ++nsyms;
+      }
+      *(p++) = (lev_byte)(ids[h] - 1);
+    }
+  }
+  map->s = p;
+  for (j = 0; j < len; j++) {
+    size_t h = udensemap_slot(keys, ids, s[j]);
+    if (!ids[h]) {
+      free(map->strings);
+      free(map->buffer);
+      return 0;
+    }
+    *(p++) = (lev_byte)(ids[h] - 1);
+  }
+  if (!nsyms) {
+    free(map->strings);
+    free(map->buffer);
+    return 0;
+  }
+
+  /* sort the symbols the way make_usymlist() lists them: by hash key and
+   * then by the order of first appearance, a stable counting sort */
+  memset(count, 0, 0x100*sizeof(size_t));
+  for (i = 0; i < nsyms; i++) {
+    int c = (int)seen[i];
+    count[(c + (c >> 7)) & 0xff]++;
+  }
+  for (i = 0, j = 0; i < 0x100; i++) {
+    size_t k = count[i];
+    count[i] = j;
+    j += k;
+  }
+  for (i = 0; i < nsyms; i++) {
+    int c = (int)seen[i];
+    size_t pos = count[(c + (c >> 7)) & 0xff]++;
+    perm[i] = pos;
+    map->symlist[pos] = seen[i];
+  }
+  map->symlistlen = nsyms;
+
+  /* and translate the provisional ids to the final ones */
+  for (p = map->buffer; p < map->buffer + total; p++)
+    *p = (lev_byte)perm[*p];
+
+  return 1;
+}
+
+/* translates the byte engine result @bmedian of length @len back to symbols
+ * and frees everything in @map (and @bmedian) */
+static lev_wchar*
+udensemap_finish(LevDenseMap *map, lev_byte *bmedian, size_t len)
+{
+  lev_wchar *median = NULL;
+  size_t j;
+
+  free(map->strings);
+  free(map->buffer);
+  if (!bmedian)
+    return NULL;
+  median = (lev_wchar*)safe_malloc(len ? len : 1, sizeof(lev_wchar));
+  if (median) {
+    for (j = 0; j < len; j++)
+      median[j] = map->symlist[bmedian[j]];
+    if (!len)
+      median[0] = 0;
+  }
+  free(bmedian);
+
+  return median;
+}
+
+/**
+ * lev_u_greedy_median:
+ * @n: The size of @lengths, @strings, and @weights.
+ * @lengths: The lengths of @strings.
+ * @strings: An array of strings, that may contain NUL characters.
+ * @weights: The string weights (they behave exactly as multiplicities, though
+ *           any positive value is allowed, not just integers).
+ * @medlength: Where the length of the median should be stored.
+ *
+ * Finds a generalized median string of @strings using the greedy algorithm.
+ *
+ * Note it's considerably more efficient to give a string with weight 2
+ * than to store two identical strings in @strings (with weights 1).
+ *
+ * Returns: The generalized median, as a newly allocated string; its length
+ *          is stored in @medlength.
+ **/
+lev_wchar*
+lev_u_greedy_median(size_t n, const size_t *lengths,
+                    const lev_wchar *strings[],
+                    const double *weights,
+                    size_t *medlength)
+{
+  size_t i;  /* usually iterates over strings (n) */
+  size_t j;  /* usually iterates over characters */
+  size_t len;  /* usually iterates over the approximate median string */
+  lev_wchar *symlist;  /* list of symbols present in the strings,
+                              we iterate over it insead of set of all
+                              existing symbols */
+  size_t symlistlen;  /* length of symlistle */
+  size_t maxlen;  /* maximum input string length */
+  size_t stoplen;  /* maximum tried median string length -- this is slightly
+                      higher than maxlen, because the median string may be
+                      longer than any of the input strings */
+  size_t **rows;  /* Levenshtein matrix rows for each string, we need to keep
+                     only one previous row to construct the current one */
+  size_t *row;  /* a scratch buffer for new Levenshtein matrix row computation,
+                   shared among all strings */
+  lev_wchar *median;  /* the resulting approximate median string */
+  double *mediandist;  /* the total distance of the best median string of
+                          given length.  warning!  mediandist[0] is total
+                          distance for empty string, while median[] itself
+                          is normally zero-based */
+  size_t bestlen;  /* the best approximate median string length */
+  LevDenseMap map;  /* dense byte remapping of strings, if possible */
+
+  if (udensemap_init(&map, n, lengths, strings, 0, NULL)) {
+    lev_byte *bmedian = lev_greedy_median(n, lengths, map.strings, weights,
+                                          medlength);
+    return udensemap_finish(&map, bmedian, *medlength);
+  }
+
+  /* find all symbols */
+  symlist = make_usymlist(n, lengths, strings, &symlistlen);
+  if (!symlist) {
+    *medlength = 0;
+    if (symlistlen != 0)
+      return NULL;
+    else
+      return (lev_wchar*)calloc(1, sizeof(lev_wchar));
+  }
+
+  /* allocate and initialize per-string matrix rows and a common work buffer */
+  rows = (size_t**)safe_malloc(n, sizeof(size_t*));
+  if (!rows) {
+    free(symlist);
+    return NULL;
+  }
+  maxlen = 0;
+  for (i = 0; i < n; i++) {
+    size_t *ri;
+    size_t leni = lengths[i];
+    if (leni > maxlen)
+      maxlen = leni;
+    ri = rows[i] = (size_t*)safe_malloc((leni + 1), sizeof(size_t));
+    if (!ri) {
+      for (j = 0; j < i; j++)
+        free(rows[j]);
+      free(rows);
+      free(symlist);
+      return NULL;
+    }
+    for (j = 0; j <= leni; j++)
+      ri[j] = j;
+  }
+  stoplen = 2*maxlen + 1;
+  row = (size_t*)safe_malloc((stoplen + 1), sizeof(size_t));
+  if (!row) {
+    for (j = 0; j < n; j++)
+      free(rows[j]);
+    free(rows);
+    free(symlist);
+    return NULL;
+  }
+
+  /* compute final cost of string of length 0 (empty string may be also
+   * a valid answer) */
+  median = (lev_wchar*)safe_malloc(stoplen, sizeof(lev_wchar));
   if (!median) {
     for (j = 0; j < n; j++)
       free(rows[j]);
     free(rows);
     free(row);
-    free(symlist);
+    free(symlist);
+    return NULL;
+  }
+  mediandist = (double*)safe_malloc((stoplen + 1), sizeof(double));
+  if (!mediandist) {
+    for (j = 0; j < n; j++)
+      free(rows[j]);
+    free(rows);
+    free(row);
+    free(symlist);
+    free(median);
+    return NULL;
+  }
+  mediandist[0] = 0.0;
+  for (i = 0; i < n; i++)
+    mediandist[0] += (double)lengths[i] * weights[i];
+
+  /* build up the approximate median string symbol by symbol
+   * XXX: we actually exit on break below, but on the same condition */
+  for (len = 1; len <= stoplen; len++) {
+    lev_wchar symbol;
+    double minminsum = LEV_INFINITY;
+    row[0] = len;
+    /* iterate over all symbols we may want to add */
+    for (j = 0; j < symlistlen; j++) {
+      double totaldist = 0.0;
+      double minsum = 0.0;
+      symbol = symlist[j];
+      /* sum Levenshtein distances from all the strings, with given weights */
+      for (i = 0; i < n; i++) {
+        const lev_wchar *stri = strings[i];
+        size_t *p = rows[i];
+        size_t leni = lengths[i];
+        size_t *end = rows[i] + leni;
+        size_t min = len;
+        size_t x = len; /* == row[0] */
+        /* compute how another row of Levenshtein matrix would look for median
+         * string with this symbol added */
+        while (p < end) {
+          size_t D = *(p++) + (symbol != *(stri++));
+          x++;
+          if (x > D)
+            x = D;
+          if (x > *p + 1)
+            x = *p + 1;
+          if (x < min)
+            min = x;
+        }
+        minsum += (double)min * weights[i];
+        totaldist += (double)x * weights[i];
+      }
+      /* is this symbol better than all the others? */
+      if (minsum < minminsum) {
+        minminsum = minsum;
+        mediandist[len] = totaldist;
+        median[len - 1] = symbol;
+      }
+    }
+    /* stop the iteration if we no longer need to recompute the matrix rows
+     * or when we are over maxlen and adding more characters doesn't seem
+     * useful */
+    if (len == stoplen
+        || (len > maxlen && mediandist[len] > mediandist[len - 1])) {
+      stoplen = len;
+      break;
+    }
+    /* now the best symbol is known, so recompute all matrix rows for this
+     * one */
+    symbol = median[len - 1];
+    for (i = 0; i < n; i++) {
+      const lev_wchar *stri = strings[i];
+      size_t *oldrow = rows[i];
+      size_t leni = lengths[i];
+      size_t k;
+      /* compute a row of Levenshtein matrix */
+      for (k = 1; k <= leni; k++) {
+        size_t c1 = oldrow[k] + 1;
+        size_t c2 = row[k - 1] + 1;
+        size_t c3 = oldrow[k - 1] + (symbol != stri[k - 1]);
+        row[k] = c2 > c3 ? c3 : c2;
+        if (row[k] > c1)
+          row[k] = c1;
+      }
+      memcpy(oldrow, row, (leni + 1)*sizeof(size_t));
+    }
+  }
+
+  /* find the string with minimum total distance */
+  bestlen = 0;
+  for (len = 1; len <= stoplen; len++) {
+    if (mediandist[len] < mediandist[bestlen])
+      bestlen = len;
+  }
+
+  /* clean up */
+  for (i = 0; i < n; i++)
+    free(rows[i]);
+  free(rows);
+  free(row);
+  free(symlist);
+  free(mediandist);
+
+  /* return result */
+  {
+    lev_wchar *result = (lev_wchar*)safe_malloc(bestlen, sizeof(lev_wchar));
+    if (!result) {
+      free(median);
+      return NULL;
+    }
+    memcpy(result, median, bestlen*sizeof(lev_wchar));
+    free(median);
+    *medlength = bestlen;
+    return result;
+  }
+}
+
+/*
+ * Knowing the distance matrices up to some row, finish the distance
+ * computations.
+ *
+ * string1, len1 are already shortened.
+ */
+static double
+finish_udistance_computations(size_t len1, lev_wchar *string1,
+                             size_t n, const size_t *lengths,
+                             const lev_wchar **strings,
+                             const double *weights, size_t **rows,
+                             size_t *row)
+{
+  size_t *end;
+  size_t i, j;
+  size_t offset;  /* row[0]; offset + len1 give together real len of string1 */
+  double distsum = 0.0;  /* sum of distances */
+
+  /* catch trivia case */
+  if (len1 == 0) {
+    for (j = 0; j < n; j++)
+      distsum += (double)rows[j][lengths[j]] * weights[j];
+    return distsum;
+  }
+
+  /* iterate through the strings and sum the distances */
+  for (j = 0; j < n; j++) {
+    size_t *rowi = rows[j];  /* current row */
+    size_t leni = lengths[j];  /* current length */
+    size_t len = len1;  /* temporary len1 for suffix stripping */
+    size_t suffix;
+    const lev_wchar *stringi = strings[j];  /* current string */
+
+    /* strip common suffix (prefix CAN'T be stripped) */
+    suffix = lev_common_suffix(len, string1, leni, stringi, sizeof(*string1));
+    len -= suffix;
+    leni -= suffix;
+
+    /* catch trivial cases */
+    if (len == 0) {
+      distsum += (double)rowi[leni] * weights[j];
+      continue;
+    }
+    offset = rowi[0];
+    if (leni == 0) {
+      distsum += (double)(offset + len) * weights[j];
+      continue;
+    }
+
+    /* complete the matrix */
+    memcpy(row, rowi, (leni + 1) * sizeof(size_t));
+    end = row + leni;
+
+    for (i = 1; i <= len; i++) {
+      size_t *p = row + 1;
+      const lev_wchar char1 = string1[i - 1];
+      const lev_wchar *char2p = stringi;
+      size_t D, x;
+
+      D = x = i + offset;
+      while (p <= end) {
+        size_t c3 = --D + (char1 != *(char2p++));
+        x++;
+        if (x > c3)
+          x = c3;
+        D = *p;
+        D++;
+        if (x > D)
+          x = D;
+        *(p++) = x;
+      }
+    }
+    distsum += weights[j] * (double)(*end);
+  }
+
+  return distsum;
+}
+
+/**
+ * lev_u_median_refine:
+ * @len: The length of @s.
+ * @s: The approximate generalized median string to be improved.
+ * @n: The size of @lengths, @strings, and @weights.
+ * @lengths: The lengths of @strings.
+ * @strings: An array of strings, that may contain NUL characters.
+ * @weights: The string weights (they behave exactly as multiplicities, though
+ *           any positive value is allowed, not just integers).
+ * @maxpasses: The largest number of passes over @s, 0 means as many as
+ *             needed.
+ * @nthreads: The largest number of threads to use, zero means one per
+ *            processor.
+ * @medlength: Where the new length of the median should be stored.
+ *
+ * Tries to make @s a better generalized median string of @strings with
+ * small perturbations, in passes over it until one changes nothing.
+ * The result is the same as of calling lev_u_median_improve() on its
+ * result again and again, only faster: a pass evaluates perturbations
+ * in time linear in the string lengths, reusing the matrix rows of the
+ * median tail the previous pass didn't change, and the last pass stops
+ * where the previous one made its last edit.
+ *
+ * It never returns a string with larger SOD than @s; in the worst case, a
+ * string identical to @s is returned.  The perturbations of a position are
+ * evaluated in parallel when there's enough work, the result is the same.
+ *
+ * Returns: The improved generalized median, as a newly allocated string; its
+ *          length is stored in @medlength.
+ **/
+lev_wchar*
+lev_u_median_refine(size_t len, const lev_wchar *s,
+                    size_t n, const size_t *lengths,
+                    const lev_wchar *strings[],
+                    const double *weights,
+                    size_t maxpasses,
+                    size_t nthreads,
+                    size_t *medlength)
+{
+  size_t i;  /* usually iterates over strings (n) */
+  size_t j;  /* usually iterates over characters */
+  size_t pos;  /* the position in the approximate median string we are
+                  trying to change */
+  lev_wchar *symlist;  /* list of symbols present in the strings,
+                              we iterate over it insead of set of all
+                              existing symbols */
+  size_t symlistlen;  /* length of symlist */
+  size_t maxlen;  /* maximum input string length */
+  size_t stoplen;  /* maximum tried median string length -- this is slightly
+                      higher than maxlen, because the median string may be
+                      longer than any of the input strings */
+  size_t **rows;  /* Levenshtein matrix rows for each string, we need to keep
+                     only one previous row to construct the current one */
+  size_t *row;  /* a scratch buffer for new Levenshtein matrix row computation,
+                   shared among all strings */
+  lev_wchar *median;  /* the resulting approximate median string */
+  size_t medlen;  /* the current approximate median string length */
+  double minminsum;  /* the current total distance sum */
+  LevImproveCands cands;  /* the perturbations of a position */
+  size_t pass;  /* the number of passes made */
+  size_t nedits;  /* the number of edits in this pass */
+  size_t lastclean;  /* the median tail after the last edit */
+  size_t cleantail;  /* the median tail the previous pass didn't change */
+  LevDenseMap map;  /* dense byte remapping of strings, if possible */
+
+  if (udensemap_init(&map, n, lengths, strings, len, s)) {
+    lev_byte *bmedian = lev_median_refine(len, map.s, n, lengths, map.strings,
+                                          weights, maxpasses, nthreads,
+                                          medlength);
+    return udensemap_finish(&map, bmedian, *medlength);
+  }
+
+  /* find all symbols */
+  symlist = make_usymlist(n, lengths, strings, &symlistlen);
+  if (!symlist) {
+    *medlength = 0;
+    if (symlistlen != 0)
+      return NULL;
+    else
+      return (lev_wchar*)calloc(1, sizeof(lev_wchar));
+  }
+
+  /* allocate and initialize per-string matrix rows and a common work buffer */
+  rows = (size_t**)safe_malloc(n, sizeof(size_t*));
+  if (!rows) {
+    free(symlist);
+    return NULL;
+  }
+  maxlen = 0;
+  for (i = 0; i < n; i++) {
+    size_t *ri;
+    size_t leni = lengths[i];
+    if (leni > maxlen)
+      maxlen = leni;
+    ri = rows[i] = (size_t*)safe_malloc((leni + 1), sizeof(size_t));
+    if (!ri) {
+      for (j = 0; j < i; j++)
+        free(rows[j]);
+      free(rows);
+      free(symlist);
+      return NULL;
+    }
+    for (j = 0; j <= leni; j++)
+      ri[j] = j;
+  }
+  stoplen = 2*maxlen + 1;
+  row = (size_t*)safe_malloc((stoplen + 2), sizeof(size_t));
+  if (!row) {
+    for (j = 0; j < n; j++)
+      free(rows[j]);
+    free(rows);
+    free(symlist);
+    return NULL;
+  }
+
+  /* initialize median to given string */
+  median = (lev_wchar*)safe_malloc((stoplen+1), sizeof(lev_wchar));
+  if (!median
+      || improve_cands_init(&cands, 1, n, lengths, strings, weights, rows,
+                            symlist, symlistlen, stoplen, nthreads) < 0) {
+    for (j = 0; j < n; j++)
+      free(rows[j]);
+    free(rows);
+    free(row);
+    free(median);
+    free(symlist);
+    return NULL;
+  }
+  medlen = len;
+  memcpy(median, s, (medlen)*sizeof(lev_wchar));
+  minminsum = finish_udistance_computations(medlen, median,
+                                            n, lengths, strings,
+                                            weights, rows, row);
+
+  /* sequentially try perturbations on all positions, pass after pass */
+  lastclean = cleantail = 0;
+  for (pass = 0; maxpasses == 0 || pass < maxpasses; pass++) {
+    if (pass > 0) {
+      for (i = 0; i < n; i++) {
+        for (j = 0; j <= lengths[i]; j++)
+          rows[i][j] = j;
+      }
+    }
+    improve_cands_back(&cands, median, medlen);
+    nedits = 0;
+    for (pos = 0; pos <= medlen; ) {
+      lev_wchar symbol;
+      LevEditType operation;
+      size_t base;  /* where the insertions start in cands.sums */
+
+      /* the rest is as it was at the end of the previous pass, as is the
+       * total distance, so this pass wouldn't change anything either */
+      if (pass > 0 && nedits == 0 && medlen - pos <= cleantail)
+        break;
+      improve_cands_eval(&cands, median, medlen, pos);
+      symbol = median[pos];
+      operation = LEV_EDIT_KEEP;
+      /* IF pos < medlength: FOREACH symbol: try to replace the symbol
+       * at pos, if some lower the total distance, chooste the best */
+      base = 0;
+      if (pos < medlen) {
+        base = symlistlen;
+        for (j = 0; j < symlistlen; j++) {
+          if (symlist[j] == median[pos])
+            continue;
+          if (cands.sums[j] < minminsum) {
+            minminsum = cands.sums[j];
+            symbol = symlist[j];
+            operation = LEV_EDIT_REPLACE;
+          }
+        }
+      }
+      /* FOREACH symbol: try to add it at pos, if some lower the total
+       * distance, chooste the best (increase medlength) */
+      for (j = 0; j < symlistlen; j++) {
+        if (cands.sums[base + j] < minminsum) {
+          minminsum = cands.sums[base + j];
+          symbol = symlist[j];
+          operation = LEV_EDIT_INSERT;
+        }
+      }
+      /* IF pos < medlength: try to delete the symbol at pos, if it lowers
+       * the total distance remember it (decrease medlength) */
+      if (pos < medlen && cands.sums[base + symlistlen] < minminsum) {
+        minminsum = cands.sums[base + symlistlen];
+        operation = LEV_EDIT_DELETE;
+      }
+      if (operation != LEV_EDIT_KEEP) {
+        lastclean = medlen - pos - (operation != LEV_EDIT_INSERT);
+        nedits++;
+      }
+      /* actually perform the operation */
+      switch (operation) {
+        case LEV_EDIT_REPLACE:
+        median[pos] = symbol;
+        break;
+
+        case LEV_EDIT_INSERT:
+        memmove(median+pos+1, median+pos,
+                (medlen - pos)*sizeof(lev_wchar));
+        median[pos] = symbol;
+        medlen++;
+        break;
+
+        case LEV_EDIT_DELETE:
+        memmove(median+pos, median + pos+1,
+                (medlen - pos-1)*sizeof(lev_wchar));
+        medlen--;
+        break;
+
+        default:
+        break;
+      }
+      assert(medlen <= stoplen);
+      /* now the result is known, so recompute all matrix rows and move on */
+      if (operation != LEV_EDIT_DELETE) {
+        symbol = median[pos];
+        row[0] = pos + 1;
+        for (i = 0; i < n; i++) {
+          const lev_wchar *stri = strings[i];
+          size_t *oldrow = rows[i];
+          size_t leni = lengths[i];
+          size_t k;
+          /* compute a row of Levenshtein matrix */
+          for (k = 1; k <= leni; k++) {
+            size_t c1 = oldrow[k] + 1;
+            size_t c2 = row[k - 1] + 1;
+            size_t c3 = oldrow[k - 1] + (symbol != stri[k - 1]);
+            row[k] = c2 > c3 ? c3 : c2;
+            if (row[k] > c1)
+              row[k] = c1;
+          }
+          memcpy(oldrow, row, (leni + 1)*sizeof(size_t));
+        }
+        pos++;
+      }
+    }
+    if (nedits == 0)
+      break;
+    /* the tail after the last edit is unchanged, and so are its rows */
+    cleantail = lastclean;
+    if (cands.backlen > cleantail + 1)
+      cands.backlen = cleantail + 1;
+  }
+
+  /* clean up */
+  for (i = 0; i < n; i++)
+    free(rows[i]);
+  free(rows);
+  free(row);
+  free(symlist);
+  improve_cands_free(&cands);
+
+  /* return result */
+  {
+    lev_wchar *result = (lev_wchar*)safe_malloc(medlen, sizeof(lev_wchar));
+    if (!result) {
+      free(median);
+      return NULL;
+    }
+    *medlength = medlen;
+    memcpy(result, median, medlen*sizeof(lev_wchar));
+    free(median);
+    return result;
+  }
+}
+
+/**
+ * lev_u_median_improve:
+ * @len: The length of @s.
+ * @s: The approximate generalized median string to be improved.
+ * @n: The size of @lengths, @strings, and @weights.
+ * @lengths: The lengths of @strings.
+ * @strings: An array of strings, that may contain NUL characters.
+ * @weights: The string weights (they behave exactly as multiplicities, though
+ *           any positive value is allowed, not just integers).
+ * @medlength: Where the new length of the median should be stored.
+ *
+ * Tries to make @s a better generalized median string of @strings with
+ * small perturbations.
+ *
+ * It never returns a string with larger SOD than @s; in the worst case, a
+ * string identical to @s is returned.  The perturbations of a position are
+ * evaluated in parallel when there's enough work, the result is the same.
+ *
+ * Returns: The improved generalized median, as a newly allocated string; its
+ *          length is stored in @medlength.
+ **/
+lev_wchar*
+lev_u_median_improve(size_t len, const lev_wchar *s,
+                     size_t n, const size_t *lengths,
+                     const lev_wchar *strings[],
+                     const double *weights,
+                     size_t *medlength)
+{
+  return lev_u_median_refine(len, s, n, lengths, strings, weights, 1, 0,
+                             medlength);
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Quick (voting) medians
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/* compute the sets of symbols each string contains, and the set of symbols
+ * in any of them (symset).  meanwhile, count how many different symbols
+ * there are (used below for symlist).
+ * the symset is passed as an argument to avoid its allocation and
+ * deallocation when it's used in the caller too */
+static lev_byte*
+make_symlistset(size_t n, const size_t *lengths,
+                const lev_byte *strings[], size_t *symlistlen,
+                double *symset)
+{
+  size_t i, j;
+  lev_byte *symlist;
+
+  if (!symset) {
+    *symlistlen = (size_t)(-1);
+    return NULL;
+  }
+  memset(symset, 0, 0x100*sizeof(double));  /* XXX: needs IEEE doubles?! */
+  *symlistlen = 0;
+  for (i = 0; i < n; i++) {
+    const lev_byte *stri = strings[i];
+    for (j = 0; j < lengths[i]; j++) {
+      int c = stri[j];
+      if (!symset[c]) {
+        (*symlistlen)++;
+        symset[c] = 1.0;
+      }
+    }
+  }
+  if (!*symlistlen)
+    return NULL;
+
+  /* create dense symbol table, so we can easily iterate over only characters
+   * present in the strings */
+  {
+    size_t pos = 0;
+    symlist = (lev_byte*)safe_malloc((*symlistlen), sizeof(lev_byte));
+    if (!symlist) {
+      *symlistlen = (size_t)(-1);
+      return NULL;
+    }
+    for (j = 0; j < 0x100; j++) {
+      if (symset[j])
+        symlist[pos++] = (lev_byte)j;
+    }
+  }
+
+  return symlist;
+}
+
+/* the voting of lev_quick_median() over a small alphabet, with a slot per
+ * present symbol instead of 0x100; the votes are added in the same order,
+ * so the same symbols are elected */
+static void
+small_quick_median(const LevSmallAlphabet *a, size_t n,
+                   const size_t *lengths, const lev_byte *strings[],
+                   const double *weights, double ml,
+                   size_t len, lev_byte *median)
+{
+  double votes[LEV_SMALL_MAX];
+  lev_byte symlist[LEV_SMALL_MAX];  /* the symbols in ascending order */
+  lev_byte codes[LEV_SMALL_MAX];  /* and their codes */
+  size_t i, j, k;
+
+  small_alphabet_sorted(a, symlist);
+  for (i = 0; i < a->size; i++)
+    codes[i] = a->code[symlist[i]];
+
+  for (j = 0; j < len; j++) {
+    for (i = 0; i < a->size; i++)
+      votes[i] = 0.0;
+
+    /* let all strings vote */
+    for (i = 0; i < n; i++) {
+      const lev_byte *stri = strings[i];
+      double weighti = weights[i];
+      size_t lengthi = lengths[i];
+      double start = (double)lengthi / ml * (double)j;
+      double end = start + (double)lengthi / ml;
+      size_t istart = (size_t)floor(start);
+      size_t iend = (size_t)ceil(end);
+
+      if (!lengthi)
+        continue;
+      if (iend > lengthi)
+        iend = lengthi;
+
+      for (k = istart+1; k < iend; k++)
+        votes[a->code[stri[k]]] += weighti;
+      votes[a->code[stri[istart]]] += weighti * ((double)(1 + istart) - start);
+      votes[a->code[stri[iend-1]]] -= weighti * ((double)iend - end);
+    }
+
+    /* find the elected symbol */
+    k = 0;
+    for (i = 1; i < a->size; i++) {
+      if (votes[codes[i]] > votes[codes[k]])
+        k = i;
+    }
+    median[j] = symlist[k];
+  }
+}
+
+lev_byte*
+lev_quick_median(size_t n,
+                 const size_t *lengths,
+                 const lev_byte *strings[],
+                 const double *weights,
+                 size_t *medlength)
+{
+  size_t symlistlen, len, i, j, k;
+  lev_byte *symlist;
+  lev_byte *median;  /* the resulting string */
+  double *symset;
+  double ml, wl;
+  LevSmallAlphabet a;
+
+  /* first check whether the result would be an empty string 
+   * and compute resulting string length */
+  ml = wl = 0.0;
+  for (i = 0; i < n; i++) {
+    ml += (double)lengths[i] * weights[i];
+    wl += weights[i];
+  }
+  if (wl == 0.0) {
+    *medlength = 0;
+    return (lev_byte*)calloc(1, sizeof(lev_byte));
+  }
+  ml = floor(ml/wl + 0.499999);
+  *medlength = len = (size_t)ml;
+  if (!len)
+    return (lev_byte*)calloc(1, sizeof(lev_byte));
+  median = (lev_byte*)safe_malloc(len, sizeof(lev_byte));
+  if (!median)
+    return NULL;
+
+  /* small alphabets vote in a table with a slot per present symbol */
+  if (small_alphabet_scan(&a, n, lengths, strings) && a.size) {
+    small_quick_median(&a, n, lengths, strings, weights, ml, len, median);
+    return median;
+  }
+
+  /* find the symbol set;
+   * now an empty symbol set is really a failure */
+  symset = (double*)calloc(0x100, sizeof(double));
+  if (!symset) {
+    free(median);
+    return NULL;
+  }
+  symlist = make_symlistset(n, lengths, strings, &symlistlen, symset);
+  if (!symlist) {
+    free(median);
+    free(symset);
+    return NULL;
+  }
+
+  for (j = 0; j < len; j++) {
+    /* clear the symbol probabilities */
+    if (symlistlen < 32) {
+      for (i = 0; i < symlistlen; i++)
+        symset[symlist[i]] = 0.0;
+    }
+    else
+      memset(symset, 0, 0x100*sizeof(double));
+
+    /* let all strings vote */
+    for (i = 0; i < n; i++) {
+      const lev_byte *stri = strings[i];
+      double weighti = weights[i];
+      size_t lengthi = lengths[i];
+      double start = (double)lengthi / ml * (double)j;
+      double end = start + (double)lengthi / ml;
+      size_t istart = (size_t)floor(start);
+      size_t iend = (size_t)ceil(end);
+
+      /* empty strings have nothing to vote for */
+      if (!lengthi)
+        continue;
+      /* rounding errors can overflow the buffer */
+      if (iend > lengthi)
+        iend = lengthi;
+
+      for (k = istart+1; k < iend; k++)
+        symset[stri[k]] += weighti;
+      symset[stri[istart]] += weighti * ((double)(1 + istart) - start);
+      symset[stri[iend-1]] -= weighti * ((double)iend - end);
+    }
+
+    /* find the elected symbol */
+    k = symlist[0];
+    for (i = 1; i < symlistlen; i++) {
+      if (symset[symlist[i]] > symset[k])
+        k = symlist[i];
+    }
+    median[j] = (lev_byte)k;
+  }
+
+  free(symset);
+  free(symlist);
+
+  return median;
+}
+
+/* used internally in make_usymlistset */
+typedef struct _HQItem HQItem;
+struct _HQItem {
+  lev_wchar c;
+  double s;
+  HQItem *n;
+};
+
+/* free usmylistset hash
+ * this is a separate function because we need it in more than one place */
+static void
+free_usymlistset_hash(HQItem *symmap)
+{
+  size_t j;
+
+  for (j = 0; j < 0x100; j++) {
+    HQItem *p = symmap + j;
+    if (p->n == symmap || p->n == NULL)
+      continue;
+    p = p->n;
+    while (p) {
+      HQItem *q = p;
+      p = p->n;
+      free(q);
+    }
+  }
+  free(symmap);
+}
+
+/* compute the sets of symbols each string contains, and the set of symbols
+ * in any of them (symset).  meanwhile, count how many different symbols
+ * there are (used below for symlist).
+ * the symset is passed as an argument to avoid its allocation and
+ * deallocation when it's used in the caller too */
+static lev_wchar*
+make_usymlistset(size_t n, const size_t *lengths,
+                 const lev_wchar *strings[], size_t *symlistlen,
+                 HQItem *symmap)
+{
+  lev_wchar *symlist;
+  size_t i, j;
+
+  j = 0;
+  for (i = 0; i < n; i++)
+    j += lengths[i];
+
+  *symlistlen = 0;
+  if (j == 0)
+    return NULL;
+
+  /* this is an ugly memory allocation avoiding hack: most hash elements
+   * will probably contain none or one symbols only so, when p->n is equal
+   * to symmap, it means there're no symbols yet, afters insterting the
+   * first one, p->n becomes normally NULL and then it behaves like an
+   * usual singly linked list */
+  for (i = 0; i < 0x100; i++)
+    symmap[i].n = symmap;
+  for (i = 0; i < n; i++) {
+    const lev_wchar *stri = strings[i];
+    for (j = 0; j < lengths[i]; j++) {
+      lev_wchar c = stri[j];
+      int key = ((int)c + ((int)c >> 7)) & 0xff;
+      HQItem *p = symmap + key;
+      if (p->n == symmap) {
+        p->c = c;
+        p->n = NULL;
+        (*symlistlen)++;
+        continue;
+      }
+      while (p->c != c && p->n != NULL)
+        p = p->n;
+      if (p->c != c) {
+        p->n = (HQItem*)malloc(sizeof(HQItem));
+        if (!p->n) {
+          *symlistlen = (size_t)(-1);
+          return NULL;
+        }
+        p = p->n;
+        p->n = NULL;
+        p->c = c;
+        (*symlistlen)++;
+      }
+    }
+  }
+  /* create dense symbol table, so we can easily iterate over only characters
+   * present in the strings */
+  {
+    size_t pos = 0;
+    symlist = (lev_wchar*)safe_malloc((*symlistlen), sizeof(lev_wchar));
+    if (!symlist) {
+      *symlistlen = (size_t)(-1);
+      return NULL;
+    }
+    for (j = 0; j < 0x100; j++) {
+      HQItem *p = symmap + j;
+      while (p != NULL && p->n != symmap) {
+        symlist[pos++] = p->c;
+        p = p->n;
+      }
+    }
+  }
+
+  return symlist;
+}
+
+lev_wchar*
+lev_u_quick_median(size_t n,
+                   const size_t *lengths,
+                   const lev_wchar *strings[],
+                   const double *weights,
+                   size_t *medlength)
+{
+  size_t symlistlen, len, i, j, k;
+  lev_wchar *symlist;
+  lev_wchar *median;  /* the resulting string */
+  HQItem *symmap;
+  double ml, wl;
+  LevDenseMap map;  /* dense byte remapping of strings, if possible */
+
+  if (udensemap_init(&map, n, lengths, strings, 0, NULL)) {
+    lev_byte *bmedian = lev_quick_median(n, lengths, map.strings, weights,
+                                         medlength);
+    return udensemap_finish(&map, bmedian, *medlength);
+  }
+
+  /* first check whether the result would be an empty string 
+   * and compute resulting string length */
+  ml = wl = 0.0;
+  for (i = 0; i < n; i++) {
+    ml += (double)lengths[i] * weights[i];
+    wl += weights[i];
+  }
+  if (wl == 0.0) {
+    *medlength = 0;
+    return (lev_wchar*)calloc(1, sizeof(lev_wchar));
+  }
+  ml = floor(ml/wl + 0.499999);
+  *medlength = len = (size_t)ml;
+  if (!len)
+    return (lev_wchar*)calloc(1, sizeof(lev_wchar));
+  median = (lev_wchar*)safe_malloc(len, sizeof(lev_wchar));
+  if (!median)
+    return NULL;
+
+  /* find the symbol set;
+   * now an empty symbol set is really a failure */
+  symmap = (HQItem*)safe_malloc(0x100, sizeof(HQItem));
+  if (!symmap) {
+    free(median);
+    return NULL;
+  }
+  symlist = make_usymlistset(n, lengths, strings, &symlistlen, symmap);
+  if (!symlist) {
+    free(median);
+    free_usymlistset_hash(symmap);
+    return NULL;
+  }
+
+  for (j = 0; j < len; j++) {
+    /* clear the symbol probabilities */
+    for (i = 0; i < 0x100; i++) {
+      HQItem *p = symmap + i;
+      if (p->n == symmap)
+        continue;
+      while (p) {
+        p->s = 0.0;
+        p = p->n;
+      }
+    }
+
+    /* let all strings vote */
+    for (i = 0; i < n; i++) {
+      const lev_wchar *stri = strings[i];
+      double weighti = weights[i];
+      size_t lengthi = lengths[i];
+      double start = (double)lengthi / ml * (double)j;
+      double end = start + (double)lengthi / ml;
+      size_t istart = (size_t)floor(start);
+      size_t iend = (size_t)ceil(end);
+
+      /* empty strings have nothing to vote for */
+      if (!lengthi)
+        continue;
+      /* rounding errors can overflow the buffer */
+      if (iend > lengthi)
+        iend = lengthi;
+
+      /* the inner part, including the complete last character */
+      for (k = istart+1; k < iend; k++) {
+        int c = stri[k];
+        int key = (c + (c >> 7)) & 0xff;
+        HQItem *p = symmap + key;
+        while (p->c != c)
+          p = p->n;
+        p->s += weighti;
+      }
+      /* the initial fraction */
+      {
+        int c = stri[istart];
+        int key = (c + (c >> 7)) & 0xff;
+        HQItem *p = symmap + key;
+        while (p->c != c)
+          p = p->n;
+        p->s += weighti * ((double)(1 + istart) - start);
+      }
+      /* subtract what we counted from the last character but doesn't
+       * actually belong here.
+       * this strategy works also when istart+1 == iend (i.e., everything
+       * happens inside a one character) */
+      {
+        int c = stri[iend-1];
+        int key = (c + (c >> 7)) & 0xff;
+        HQItem *p = symmap + key;
+        while (p->c != c)
+          p = p->n;
+        p->s -= weighti * ((double)iend - end);
+      }
+    }
+
+    /* find the elected symbol */
+    {
+      HQItem *max = NULL;
+
+      for (i = 0; i < 0x100; i++) {
+        HQItem *p = symmap + i;
+        if (p->n == symmap)
+          continue;
+        while (p) {
+          if (!max || p->s > max->s)
+            max = p;
+          p = p->n;
+        }
+      }
+      median[j] = max->c;
+    }
+  }
+
+  free_usymlistset_hash(symmap);
+  free(symlist);
+
+  return median;
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Set medians
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/**
+ * lev_set_median_index:
+ * @n: The size of @lengths, @strings, and @weights.
+ * @lengths: The lengths of @strings.
+ * @strings: An array of strings, that may contain NUL characters.
+ * @weights: The string weights (they behave exactly as multiplicities, though
+ *           any positive value is allowed, not just integers).
+ *
+ * Finds the median string of a string set @strings.
+ *
+ * Returns: An index in @strings pointing to the set median, -1 in case of
+ *          failure.
+ **/
+size_t
+lev_set_median_index(size_t n, const size_t *lengths,
+                     const lev_byte *strings[],
+                     const double *weights)
+{
+  size_t minidx = 0;
+  double mindist = LEV_INFINITY;
+  size_t i;
+  long int *distances;
+
+  distances = (long int*)safe_malloc((n*(n - 1)/2), sizeof(long int));
+  if (!distances)
+    return (size_t)-1;
+
+  memset(distances, 0xff, (n*(n - 1)/2)*sizeof(long int)); /* XXX */
+  for (i = 0; i < n; i++) {
+    size_t j = 0;
+    double dist = 0.0;
+    const lev_byte *stri = strings[i];
+    size_t leni = lengths[i];
+    /* below diagonal */
+    while (j < i && dist < mindist) {
+      size_t dindex = (i - 1)*(i - 2)/2 + j;
+      long int d;
+      if (distances[dindex] >= 0)
+        d = distances[dindex];
+      else {
+        d = (long int)lev_edit_distance(lengths[j], strings[j], leni, stri, 0);
+        if (d < 0) {
+          free(distances);
+          return (size_t)-1;
+        }
+      }
+      dist += weights[j] * (double)d;
+      j++;
+    }
+    j++;  /* no need to compare item with itself */
+    /* above diagonal */
+    while (j < n && dist < mindist) {
+      size_t dindex = (j - 1)*(j - 2)/2 + i;
+      distances[dindex] = (long int)lev_edit_distance(lengths[j], strings[j],
+                                            leni, stri, 0);
+      if (distances[dindex] < 0) {
+        free(distances);
+        return (size_t)-1;
+      }
+      dist += weights[j] * (double)distances[dindex];
+      j++;
+    }
+
+    if (dist < mindist) {
+      mindist = dist;
+      minidx = i;
+    }
+  }
+
+  free(distances);
+  return minidx;
+}
+
+/**
+ * lev_u_set_median_index:
+ * @n: The size of @lengths, @strings, and @weights.
+ * @lengths: The lengths of @strings.
+ * @strings: An array of strings, that may contain NUL characters.
+ * @weights: The string weights (they behave exactly as multiplicities, though
+ *           any positive value is allowed, not just integers).
+ *
+ * Finds the median string of a string set @strings.
+ *
+ * Returns: An index in @strings pointing to the set median, -1 in case of
+ *          failure.
+ **/
+size_t
+lev_u_set_median_index(size_t n, const size_t *lengths,
+                       const lev_wchar *strings[],
+                       const double *weights)
+{
+  size_t minidx = 0;
+  double mindist = LEV_INFINITY;
+  size_t i;
+  long int *distances;
+
+  distances = (long int*)safe_malloc((n*(n - 1)/2), sizeof(long int));
+  if (!distances)
+    return (size_t)-1;
+
+  memset(distances, 0xff, (n*(n - 1)/2)*sizeof(long int)); /* XXX */
+  for (i = 0; i < n; i++) {
+    size_t j = 0;
+    double dist = 0.0;
+    const lev_wchar *stri = strings[i];
+    size_t leni = lengths[i];
+    /* below diagonal */
+    while (j < i && dist < mindist) {
+      size_t dindex = (i - 1)*(i - 2)/2 + j;
+      long int d;
+      if (distances[dindex] >= 0)
+        d = distances[dindex];
+      else {
+        d = (long int)lev_u_edit_distance(lengths[j], strings[j], leni, stri, 0);
+        if (d < 0) {
+          free(distances);
+          return (size_t)-1;
+        }
+      }
+      dist += weights[j] * (double)d;
+      j++;
+    }
+    j++;  /* no need to compare item with itself */
+    /* above diagonal */
+    while (j < n && dist < mindist) {
+      size_t dindex = (j - 1)*(j - 2)/2 + i;
+      distances[dindex] = (long int)lev_u_edit_distance(lengths[j], strings[j],
+                                              leni, stri, 0);
+      if (distances[dindex] < 0) {
+        free(distances);
+        return (size_t)-1;
+      }
+      dist += weights[j] * (double)distances[dindex];
+      j++;
+    }
+
+    if (dist < mindist) {
+      mindist = dist;
+      minidx = i;
+    }
+  }
+
+  free(distances);
+  return minidx;
+}
+
+/**
+ * lev_set_median:
+ * @n: The size of @lengths, @strings, and @weights.
+ * @lengths: The lengths of @strings.
+ * @strings: An array of strings, that may contain NUL characters.
+ * @weights: The string weights (they behave exactly as multiplicities, though
+ *           any positive value is allowed, not just integers).
+ * @medlength: Where the length of the median string should be stored.
+ *
+ * Finds the median string of a string set @strings.
+ *
+ * Returns: The set median as a newly allocate string, its length is stored
+ *          in @medlength.  %NULL in the case of failure.
+ **/
+lev_byte*
+lev_set_median(size_t n, const size_t *lengths,
+               const lev_byte *strings[],
+               const double *weights,
+               size_t *medlength)
+{
+  size_t minidx = lev_set_median_index(n, lengths, strings, weights);
+  lev_byte *result;
+
+  if (minidx == (size_t)-1)
+    return NULL;
+
+  *medlength = lengths[minidx];
+  if (!lengths[minidx])
+    return (lev_byte*)calloc(1, sizeof(lev_byte));
+
+  result = (lev_byte*)safe_malloc(lengths[minidx], sizeof(lev_byte));
+  if (!result)
+    return NULL;
+  return (lev_byte*)memcpy(result, strings[minidx], lengths[minidx]*sizeof(lev_byte));
+}
+
+/**
+ * lev_u_set_median:
+ * @n: The size of @lengths, @strings, and @weights.
+ * @lengths: The lengths of @strings.
+ * @strings: An array of strings, that may contain NUL characters.
+ * @weights: The string weights (they behave exactly as multiplicities, though
+ *           any positive value is allowed, not just integers).
+ * @medlength: Where the length of the median string should be stored.
+ *
+ * Finds the median string of a string set @strings.
+ *
+ * Returns: The set median as a newly allocate string, its length is stored
+ *          in @medlength.  %NULL in the case of failure.
+ **/
+lev_wchar*
+lev_u_set_median(size_t n, const size_t *lengths,
+                 const lev_wchar *strings[],
+                 const double *weights,
+                 size_t *medlength)
+{
+  size_t minidx = lev_u_set_median_index(n, lengths, strings, weights);
+  lev_wchar *result;
+
+  if (minidx == (size_t)-1)
+    return NULL;
+
+  *medlength = lengths[minidx];
+  if (!lengths[minidx])
+    return (lev_wchar*)calloc(1, sizeof(lev_wchar));
+
+  result = (lev_wchar*)safe_malloc(lengths[minidx], sizeof(lev_wchar));
+  if (!result)
+    return NULL;
+  return (lev_wchar*)memcpy(result, strings[minidx], lengths[minidx]*sizeof(lev_wchar));
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Set, sequence distances
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/**
+ * lev_edit_seq_distance:
+ * @n1: The length of @lengths1 and @strings1.
+ * @lengths1: The lengths of strings in @strings1.
+ * @strings1: An array of strings that may contain NUL characters.
+ * @n2: The length of @lengths2 and @strings2.
+ * @lengths2: The lengths of strings in @strings2.
+ * @strings2: An array of strings that may contain NUL characters.
+ *
+ * Finds the distance between string sequences @strings1 and @strings2.
+ *
+ * In other words, this is a double-Levenshtein algorithm.
+ *
+ * The cost of string replace operation is based on string similarity: it's
+ * zero for identical strings and 2 for completely unsimilar strings.
+ *
+ * Returns: The distance of the two sequences.
+ **/
+double
+lev_edit_seq_distance(size_t n1, const size_t *lengths1,
+                      const lev_byte *strings1[],
+                      size_t n2, const size_t *lengths2,
+                      const lev_byte *strings2[])
+{
+  size_t i;
+  double *row;  /* we only need to keep one row of costs */
+  double *end;
+  LevLCSPattern pat;  /* match masks of the current string in strings1 */
+  size_t maxlen1;
+
+  /* strip common prefix */
+  while (n1 > 0 && n2 > 0
+         && lev_strings_equal(*lengths1, *strings1, *lengths2, *strings2,
+                              sizeof(lev_byte))) {
+    n1--;
+    n2--;
+    strings1++;
+    strings2++;
+    lengths1++;
+    lengths2++;
+  }
+
+  /* strip common suffix */
+  while (n1 > 0 && n2 > 0
+         && lev_strings_equal(lengths1[n1-1], strings1[n1-1],
+                              lengths2[n2-1], strings2[n2-1],
+                              sizeof(lev_byte))) {
+    n1--;
+    n2--;
+  }
+
+  /* catch trivial cases */
+  if (n1 == 0)
+    return (double)n2;
+  if (n2 == 0)
+    return (double)n1;
+
+  /* make the inner cycle (i.e. strings2) the longer one */
+  if (n1 > n2) {
+    size_t nx = n1;
+    const size_t *lx = lengths1;
+    const lev_byte **sx = strings1;
+    n1 = n2;
+    n2 = nx;
+    lengths1 = lengths2;
+    lengths2 = lx;
+    strings1 = strings2;
+    strings2 = sx;
+  }
+  maxlen1 = 0;
+  for (i = 0; i < n1; i++) {
+    if (lengths1[i] > maxlen1)
+      maxlen1 = lengths1[i];
+  }
+  n1++;
+  n2++;
+
+  /* initalize first row */
+  row = (double*)safe_malloc(n2, sizeof(double));
+  if (!row)
+    return -1.0;
+  if (lcs_pattern_init(&pat, maxlen1)) {
+    free(row);
+    return -1.0;
+  }
+  end = row + n2 - 1;
+  for (i = 0; i < n2; i++)
+    row[i] = (double)i;
+
+  /* go through the matrix and compute the costs.  yes, this is an extremely
+   * obfuscated version, but also extremely memory-conservative and relatively
+   * fast.  */
+  for (i = 1; i < n1; i++) {
+    double *p = row + 1;
+    const lev_byte *str1 = strings1[i - 1];
+    const size_t len1 = lengths1[i - 1];
+    const lev_byte **str2p = strings2;
+    const size_t *len2p = lengths2;
+    double D = (double)i - 1.0;
+    double x = (double)i;
+    lcs_pattern_set(&pat, len1, str1);
+    while (p <= end) {
+      size_t len2 = *(len2p++);
+      const lev_byte *str2 = *(str2p++);
+      size_t l = len1 + len2;
+      x += 1.0;
+      if (x > *p + 1.0)
+        x = *p + 1.0;
+      /* the replace operation is worth computing only when it can beat x,
+       * the +1 guards against rounding errors */
+      if (l == 0) {
+        if (x > D)
+          x = D;
+      }
+      else if (x > D) {
+        size_t max = (size_t)((x - D) * (double)l / 2.0) + 1;
+        size_t d = lcs_pattern_distance(&pat, len2, str2, max);
+        if (d <= max) {
+          double q = D + 2.0 / (double)l * (double)d;
+          if (x > q)
+            x = q;
+        }
+      }
+      D = *p;
+      *(p++) = x;
+    }
+  }
+
+  lcs_pattern_free(&pat);
+  {
+    double q = *end;
+    free(row);
+    return q;
+  }
+}
+
+/**
+ * lev_u_edit_seq_distance:
+ * @n1: The length of @lengths1 and @strings1.
+ * @lengths1: The lengths of strings in @strings1.
+ * @strings1: An array of strings that may contain NUL characters.
+ * @n2: The length of @lengths2 and @strings2.
+ * @lengths2: The lengths of strings in @strings2.
+ * @strings2: An array of strings that may contain NUL characters.
+ *
+ * Finds the distance between string sequences @strings1 and @strings2.
+ *
+ * In other words, this is a double-Levenshtein algorithm.
+ *
+ * The cost of string replace operation is based on string similarity: it's
+ * zero for identical strings and 2 for completely unsimilar strings.
+ *
+ * Returns: The distance of the two sequences.
+ **/
+double
+lev_u_edit_seq_distance(size_t n1, const size_t *lengths1,
+                        const lev_wchar *strings1[],
+                        size_t n2, const size_t *lengths2,
+                        const lev_wchar *strings2[])
+{
+  size_t i;
+  double *row;  /* we only need to keep one row of costs */
+  double *end;
+  LevULCSPattern pat;  /* match masks of the current string in strings1 */
+  size_t maxlen1;
+
+  /* strip common prefix */
+  while (n1 > 0 && n2 > 0
+         && lev_strings_equal(*lengths1, *strings1, *lengths2, *strings2,
+                              sizeof(lev_wchar))) {
+    n1--;
+    n2--;
+    strings1++;
+    strings2++;
+    lengths1++;
+    lengths2++;
+  }
+
+  /* strip common suffix */
+  while (n1 > 0 && n2 > 0
+         && lev_strings_equal(lengths1[n1-1], strings1[n1-1],
+                              lengths2[n2-1], strings2[n2-1],
+                              sizeof(lev_wchar))) {
+    n1--;
+    n2--;
+  }
+
+  /* catch trivial cases */
+  if (n1 == 0)
+    return (double)n2;
+  if (n2 == 0)
+    return (double)n1;
+
+  /* make the inner cycle (i.e. strings2) the longer one */
+  if (n1 > n2) {
+    size_t nx = n1;
+    const size_t *lx = lengths1;
+    const lev_wchar **sx = strings1;
+    n1 = n2;
+    n2 = nx;
+    lengths1 = lengths2;
+    lengths2 = lx;
+    strings1 = strings2;
+    strings2 = sx;
+  }
+  maxlen1 = 0;
+  for (i = 0; i < n1; i++) {
+    if (lengths1[i] > maxlen1)
+      maxlen1 = lengths1[i];
+  }
+  n1++;
+  n2++;
+
+  /* initalize first row */
+  row = (double*)safe_malloc(n2, sizeof(double));
+  if (!row)
+    return -1.0;
+  if (ulcs_pattern_init(&pat, maxlen1)) {
+    free(row);
+    return -1.0;
+  }
+  end = row + n2 - 1;
+  for (i = 0; i < n2; i++)
+    row[i] = (double)i;
+
+  /* go through the matrix and compute the costs.  yes, this is an extremely
+   * obfuscated version, but also extremely memory-conservative and relatively
+   * fast.  */
+  for (i = 1; i < n1; i++) {
+    double *p = row + 1;
+    const lev_wchar *str1 = strings1[i - 1];
+    const size_t len1 = lengths1[i - 1];
+    const lev_wchar **str2p = strings2;
+    const size_t *len2p = lengths2;
+    double D = (double)i - 1.0;
+    double x = (double)i;
+    ulcs_pattern_set(&pat, len1, str1);
+    while (p <= end) {
+      size_t len2 = *(len2p++);
+      const lev_wchar *str2 = *(str2p++);
+      size_t l = len1 + len2;
+      x += 1.0;
+      if (x > *p + 1.0)
+        x = *p + 1.0;
+      /* the replace operation is worth computing only when it can beat x,
+       * the +1 guards against rounding errors */
+      if (l == 0) {
+        if (x > D)
+          x = D;
+      }
+      else if (x > D) {
+        size_t max = (size_t)((x - D) * (double)l / 2.0) + 1;
+        size_t d = ulcs_pattern_distance(&pat, len2, str2, max);
+        if (d <= max) {
+          double q = D + 2.0 / (double)l * (double)d;
+          if (x > q)
+            x = q;
+        }
+      }
+      D = *p;
+      *(p++) = x;
+    }
+  }
+
+  ulcs_pattern_free(&pat);
+  {
+    double q = *end;
+    free(row);
+    return q;
+  }
+}
+
+/* Alignment of string sequences.  The matrix of lev_edit_seq_distance() is
+ * traced back in linear memory with Hirschberg's divide and conquer: the
+ * forward costs of the upper half of a block and the backward costs of its
+ * lower half meet in the middle row, and the column where their sum is
+ * smallest splits the block into two smaller ones.  Each level recomputes
+ * item distances of the previous one, so recent ones are kept in a small
+ * direct mapped cache. */
+
+/* one item distance, computed with cutoff max */
+typedef struct {
+  size_t i, j;  /* item indices, i == (size_t)(-1) for empty slots */
+  size_t max;  /* the cutoff */
+  size_t d;  /* the distance, or max + 1 when it's larger */
+} LevSeqCacheItem;
+
+typedef struct {
+  size_t charsize;  /* of the item strings */
+  const size_t *lengths1;
+  const size_t *lengths2;
+  const lev_byte **strings1;  /* set for byte strings */
+  const lev_byte **strings2;
+  const lev_wchar **ustrings1;  /* set for Unicode strings */
+  const lev_wchar **ustrings2;
+  LevLCSPattern pat;
+  LevULCSPattern upat;
+  size_t patitem;  /* item of strings1 in the pattern */
+  size_t cachemask;
+  LevSeqCacheItem *cache;
+  size_t off;  /* stripped common prefix */
+  size_t nops;
+  LevEditOp *ops;  /* the edit operations found so far, without keeps */
+  double *row1;  /* forward costs */
+  double *row2;  /* backward costs */
+} LevSeqAlign;
+
+static int
+seqalign_same(const LevSeqAlign *sa, size_t i, size_t j)
+{
+  const void *s1 = sa->ustrings1 ? (const void*)sa->ustrings1[i]
+                                 : (const void*)sa->strings1[i];
+  const void *s2 = sa->ustrings2 ? (const void*)sa->ustrings2[j]
+                                 : (const void*)sa->strings2[j];
+
+  return lev_strings_equal(sa->lengths1[i], s1, sa->lengths2[j], s2,
+                           sa->charsize);
+}
+
+/* InDel distance of items @i and @j, or @max + 1 if it's larger than @max */
+static size_t
+seqalign_distance(LevSeqAlign *sa, size_t i, size_t j, size_t max)
+{
+  LevSeqCacheItem *item;
+  size_t d;
+
+  if (seqalign_same(sa, i, j))
+    return 0;
+  item = sa->cache + ((i*0x9e3779b9u ^ j) & sa->cachemask);
+  if (item->i == i && item->j == j) {
+    if (item->d <= item->max)
+      return item->d <= max ? item->d : max + 1;
+    if (max <= item->max)
+      return max + 1;
+  }
+  if (sa->patitem != i) {
+    if (sa->ustrings1)
+      ulcs_pattern_set(&sa->upat, sa->lengths1[i], sa->ustrings1[i]);
+    else
+      lcs_pattern_set(&sa->pat, sa->lengths1[i], sa->strings1[i]);
+    sa->patitem = i;
+  }
+  if (sa->ustrings1)
+    d = ulcs_pattern_distance(&sa->upat, sa->lengths2[j], sa->ustrings2[j],
+                              max);
+  else
+    d = lcs_pattern_distance(&sa->pat, sa->lengths2[j], sa->strings2[j], max);
+  item->i = i;
+  item->j = j;
+  item->max = max;
+  item->d = d;
+  return d;
+}
+
+/* improve @x with replacing item @i by item @j after cost @D, exactly as
+ * lev_edit_seq_distance() does */
+static double
+seqalign_replace(LevSeqAlign *sa, size_t i, size_t j, double D, double x)
+{
+  size_t l = sa->lengths1[i] + sa->lengths2[j];
+
+  if (l == 0) {
+    if (x > D)
+      x = D;
+  }
+  else if (x > D) {
+    size_t max = (size_t)((x - D) * (double)l / 2.0) + 1;
+    size_t d = seqalign_distance(sa, i, j, max);
+    if (d <= max) {
+      double q = D + 2.0 / (double)l * (double)d;
+      if (x > q)
+        x = q;
+    }
+  }
+  return x;
+}
+
+/* lower bound of the total cost of paths through @row, when @rows rows
+ * and @cols - k columns remain after its k-th cell (@cols + k columns for
+ * a backward row) */
+static double
+seqalign_bound(const double *row, size_t m, size_t rows, size_t cols,
+               int backward)
+{
+  double bound = HUGE_VAL;
+  size_t k;
+
+  for (k = 0; k <= m; k++) {
+    size_t c = backward ? cols + k : cols - k;
+    double q = row[k] + (double)(rows > c ? rows - c : c - rows);
+    if (q < bound)
+      bound = q;
+  }
+  return bound;
+}
+
+/* fill sa->row1[k] with the cost of aligning items [@i0, @i1) with items
+ * [@j0, @j0 + k), for k <= @m, giving up when it surely exceeds @max */
+static int
+seqalign_forward(LevSeqAlign *sa, size_t i0, size_t i1, size_t j0, size_t m,
+                 double max, size_t n1, size_t n2)
+{
+  double *row = sa->row1;
+  size_t i, k;
+
+  for (k = 0; k <= m; k++)
+    row[k] = (double)k;
+  for (i = i0; i < i1; i++) {
+    double D = row[0];
+    double x = row[0] + 1.0;
+    row[0] = x;
+    for (k = 1; k <= m; k++) {
+      x += 1.0;
+      if (x > row[k] + 1.0)
+        x = row[k] + 1.0;
+      x = seqalign_replace(sa, i, j0 + k - 1, D, x);
+      D = row[k];
+      row[k] = x;
+    }
+    if (max < HUGE_VAL
+        && seqalign_bound(row, m, n1 - i - 1, n2 - j0, 0) > max)
+      return -1;
+  }
+  return 0;
+}
+
+/* fill sa->row2[k] with the cost of aligning items [@i0, @i1) with items
+ * [@j0 + k, @j0 + @m), for k <= @m, giving up when it surely exceeds @max */
+static int
+seqalign_backward(LevSeqAlign *sa, size_t i0, size_t i1, size_t j0, size_t m,
+                  double max)
+{
+  double *row = sa->row2;
+  size_t i, k;
+
+  for (k = 0; k <= m; k++)
+    row[k] = (double)(m - k);
+  for (i = i1; i-- > i0; ) {
+    double D = row[m];
+    double x = row[m] + 1.0;
+    row[m] = x;
+    for (k = m; k-- > 0; ) {
+      x += 1.0;
+      if (x > row[k] + 1.0)
+        x = row[k] + 1.0;
+      x = seqalign_replace(sa, i, j0 + k, D, x);
+      D = row[k];
+      row[k] = x;
+    }
+    if (max < HUGE_VAL && seqalign_bound(row, m, i, j0, 1) > max)
+      return -1;
+  }
+  return 0;
+}
+
+/* find the column where the optimal path of the block crosses row @imid,
+ * returns the cost of the block, or HUGE_VAL when it exceeds @max */
+static double
+seqalign_split(LevSeqAlign *sa, size_t i0, size_t imid, size_t i1,
+               size_t j0, size_t j1, size_t *split,
+               double max, size_t n1, size_t n2)
+{
+  size_t m = j1 - j0;
+  double best = HUGE_VAL;
+  size_t k;
+
+  if (seqalign_forward(sa, i0, imid, j0, m, max, n1, n2)
+      || seqalign_backward(sa, imid, i1, j0, m, max))
+    return HUGE_VAL;
+  *split = 0;
+  for (k = 0; k <= m; k++) {
+    double q = sa->row1[k] + sa->row2[k];
+    if (q < best) {
+      best = q;
+      *split = k;
+    }
+  }
+  return best;
+}
+
+static void
+seqalign_push(LevSeqAlign *sa, LevEditType type, size_t spos, size_t dpos)
+{
+  LevEditOp *op = sa->ops + sa->nops++;
+
+  op->type = type;
+  op->spos = spos + sa->off;
+  op->dpos = dpos + sa->off;
+}
+
+/* align the single item @i with items [@j0, @j0 + @m), emitting the
+ * operations if @emit is nonzero; returns the cost */
+static double
+seqalign_row(LevSeqAlign *sa, size_t i, size_t j0, size_t m, int emit)
+{
+  double best = (double)m + 1.0;  /* delete it and insert everything */
+  size_t bestk = m;
+  size_t k;
+
+  for (k = 0; k < m; k++) {
+    double q = seqalign_replace(sa, i, j0 + k, (double)m - 1.0, best);
+    if (q < best) {
+      best = q;
+      bestk = k;
+    }
+  }
+  if (!emit)
+    return best;
+
+  if (bestk == m) {
+    seqalign_push(sa, LEV_EDIT_DELETE, i, j0);
+    for (k = 0; k < m; k++)
+      seqalign_push(sa, LEV_EDIT_INSERT, i + 1, j0 + k);
+    return best;
+  }
+  for (k = 0; k < bestk; k++)
+    seqalign_push(sa, LEV_EDIT_INSERT, i, j0 + k);
+  if (!seqalign_same(sa, i, j0 + bestk))
+    seqalign_push(sa, LEV_EDIT_REPLACE, i, j0 + bestk);
+  for (k = bestk + 1; k < m; k++)
+    seqalign_push(sa, LEV_EDIT_INSERT, i + 1, j0 + k);
+  return best;
+}
+
+static void
+seqalign_block(LevSeqAlign *sa, size_t i0, size_t i1, size_t j0, size_t j1)
+{
+  size_t imid, split, k;
+
+  if (i0 == i1) {
+    for (k = j0; k < j1; k++)
+      seqalign_push(sa, LEV_EDIT_INSERT, i0, k);
+    return;
+  }
+  if (j0 == j1) {
+    for (k = i0; k < i1; k++)
+      seqalign_push(sa, LEV_EDIT_DELETE, k, j0);
+    return;
+  }
+  if (i1 - i0 == 1) {
+    seqalign_row(sa, i0, j0, j1 - j0, 1);
+    return;
+  }
+  imid = i0 + (i1 - i0)/2;
+  seqalign_split(sa, i0, imid, i1, j0, j1, &split, HUGE_VAL, 0, 0);
+  seqalign_block(sa, i0, imid, j0, j0 + split);
+  seqalign_block(sa, imid, i1, j0 + split, j1);
+}
+
+static LevOpCode*
+seqalign_opcodes(LevSeqAlign *sa, size_t n1, size_t n2, double max,
+                 double *dist, size_t *nb)
+{
+  size_t len1 = n1, len2 = n2;
+  size_t i, maxlen1, split = 0;
+  LevOpCode *bops = NULL;
+  double d;
+
+  /* strip common prefix and suffix */
+  sa->off = 0;
+  while (n1 > 0 && n2 > 0 && seqalign_same(sa, 0, 0)) {
+    n1--;
+    n2--;
+    sa->lengths1++;
+    sa->lengths2++;
+    if (sa->ustrings1) {
+      sa->ustrings1++;
+      sa->ustrings2++;
+    }
+    else {
+      sa->strings1++;
+      sa->strings2++;
+    }
+    sa->off++;
+  }
+  while (n1 > 0 && n2 > 0 && seqalign_same(sa, n1 - 1, n2 - 1)) {
+    n1--;
+    n2--;
+  }
+
+  *nb = (size_t)(-1);
+  maxlen1 = 0;
+  for (i = 0; i < n1; i++) {
+    if (sa->lengths1[i] > maxlen1)
+      maxlen1 = sa->lengths1[i];
+  }
+  for (i = 1; i < 8*(n1 + n2); i <<= 1)
+    ;
+  sa->cachemask = i - 1;
+  sa->cache = (LevSeqCacheItem*)safe_malloc(i, sizeof(LevSeqCacheItem));
+  sa->ops = (LevEditOp*)safe_malloc(n1 + n2 + 1, sizeof(LevEditOp));
+  sa->row1 = (double*)safe_malloc(n2 + 1, sizeof(double));
+  sa->row2 = (double*)safe_malloc(n2 + 1, sizeof(double));
+  if (!sa->cache || !sa->ops || !sa->row1 || !sa->row2)
+    goto done;
+  if (sa->ustrings1 ? ulcs_pattern_init(&sa->upat, maxlen1)
+                    : lcs_pattern_init(&sa->pat, maxlen1))
+    goto done;
+  for (i = 0; i <= sa->cachemask; i++)
+    sa->cache[i].i = (size_t)(-1);
+  sa->patitem = (size_t)(-1);
+  sa->nops = 0;
+
+  if (n1 == 0 || n2 == 0)
+    d = (double)(n1 + n2);
+  else if (n1 == 1)
+    d = seqalign_row(sa, 0, 0, n2, 0);
+  else
+    d = seqalign_split(sa, 0, n1/2, n1, 0, n2, &split, max, n1, n2);
+  *dist = d;
+  if (d > max)
+    *nb = 0;
+  else {
+    if (n1 == 1)
+      seqalign_row(sa, 0, 0, n2, 1);
+    else if (n1 == 0 || n2 == 0)
+      seqalign_block(sa, 0, n1, 0, n2);
+    else {
+      seqalign_block(sa, 0, n1/2, 0, split);
+      seqalign_block(sa, n1/2, n1, split, n2);
+    }
+    bops = lev_editops_to_opcodes(sa->nops, sa->ops, nb, len1, len2);
+  }
+  if (sa->ustrings1)
+    ulcs_pattern_free(&sa->upat);
+  else
+    lcs_pattern_free(&sa->pat);
+
+done:
+  free(sa->cache);
+  free(sa->ops);
+  free(sa->row1);
+  free(sa->row2);
+  return bops;
+}
+
+/**
+ * lev_edit_seq_opcodes:
+ * @n1: The length of @lengths1 and @strings1.
+ * @lengths1: The lengths of strings in @strings1.
+ * @strings1: An array of strings that may contain NUL characters.
+ * @n2: The length of @lengths2 and @strings2.
+ * @lengths2: The lengths of strings in @strings2.
+ * @strings2: An array of strings that may contain NUL characters.
+ * @max: The largest distance of interest, HUGE_VAL for no cutoff.
+ * @dist: Where the distance of the sequences should be stored.
+ * @nb: Where the number of difflib block operation codes should be stored.
+ *
+ * Finds an optimal alignment of string sequences @strings1 and @strings2,
+ * that is the operations of lev_edit_seq_distance().
+ *
+ * The positions in the operation codes are item indices.  Identical items
+ * are kept, other aligned items are replaced.  Only linear memory is used.
+ *
+ * Returns: The block operation codes, as a newly allocated array; its
+ *          length is stored in @nb.  When the distance exceeds @max, %NULL
+ *          is returned and @nb is set to zero.  On failure, %NULL is
+ *          returned and @nb is set to (size_t)(-1).
+ **/
+LevOpCode*
+lev_edit_seq_opcodes(size_t n1, const size_t *lengths1,
+                     const lev_byte *strings1[],
+                     size_t n2, const size_t *lengths2,
+                     const lev_byte *strings2[],
+                     double max, double *dist, size_t *nb)
+{
+  LevSeqAlign sa;
+
+  memset(&sa, 0, sizeof(LevSeqAlign));
+  sa.charsize = sizeof(lev_byte);
+  sa.lengths1 = lengths1;
+  sa.lengths2 = lengths2;
+  sa.strings1 = strings1;
+  sa.strings2 = strings2;
+  return seqalign_opcodes(&sa, n1, n2, max, dist, nb);
+}
+
+/**
+ * lev_u_edit_seq_opcodes:
+ * @n1: The length of @lengths1 and @strings1.
+ * @lengths1: The lengths of strings in @strings1.
+ * @strings1: An array of strings that may contain NUL characters.
+ * @n2: The length of @lengths2 and @strings2.
+ * @lengths2: The lengths of strings in @strings2.
+ * @strings2: An array of strings that may contain NUL characters.
+ * @max: The largest distance of interest, HUGE_VAL for no cutoff.
+ * @dist: Where the distance of the sequences should be stored.
+ * @nb: Where the number of difflib block operation codes should be stored.
+ *
+ * Finds an optimal alignment of string sequences @strings1 and @strings2,
+ * that is the operations of lev_u_edit_seq_distance().
+ *
+ * The positions in the operation codes are item indices.  Identical items
+ * are kept, other aligned items are replaced.  Only linear memory is used.
+ *
+ * Returns: The block operation codes, as a newly allocated array; its
+ *          length is stored in @nb.  When the distance exceeds @max, %NULL
+ *          is returned and @nb is set to zero.  On failure, %NULL is
+ *          returned and @nb is set to (size_t)(-1).
+ **/
+LevOpCode*
+lev_u_edit_seq_opcodes(size_t n1, const size_t *lengths1,
+                       const lev_wchar *strings1[],
+                       size_t n2, const size_t *lengths2,
+                       const lev_wchar *strings2[],
+                       double max, double *dist, size_t *nb)
+{
+  LevSeqAlign sa;
+
+  memset(&sa, 0, sizeof(LevSeqAlign));
+  sa.charsize = sizeof(lev_wchar);
+  sa.lengths1 = lengths1;
+  sa.lengths2 = lengths2;
+  sa.ustrings1 = strings1;
+  sa.ustrings2 = strings2;
+  return seqalign_opcodes(&sa, n1, n2, max, dist, nb);
+}
+
+/* Sets of tokens often contain the same string many times.  Identical
+ * strings have identical rows (columns) in the distance matrix, so they are
+ * collapsed into classes and distances are computed only between the
+ * classes.  The assignment itself still runs on the full matrix, Munkers-
+ * Blackman breaks ties its own way and the sum must not change. */
+
+typedef struct {
+  const void *s;
+  size_t len;
+  size_t size;  /* character size */
+  size_t i;  /* index in the set */
+} LevSetItem;
+
+static int
+setitem_cmp(const void *p, const void *q)
+{
+  const LevSetItem *a = (const LevSetItem*)p;
+  const LevSetItem *b = (const LevSetItem*)q;
+  int c;
+
+  if (a->len != b->len)
+    return a->len < b->len ? -1 : 1;
+  c = memcmp(a->s, b->s, a->len*a->size);
+  if (c)
+    return c;
+  return a->i < b->i ? -1 : a->i > b->i;
+}
+
+/*
+ * Group identical strings.  cls[i] is the class of i-th string, classes
+ * are numbered in the order of first appearance, rep[k] is the first string
+ * of class k and count[k] its size.  All the arrays must have room for @n
+ * items.
+ *
+ * Returns: The number of classes, (size_t)(-1) on allocation failure.
+ */
+static size_t
+set_classes(size_t n, const size_t *lengths, const void **strings,
+            size_t charsize, size_t *cls, size_t *rep, size_t *count)
+{
+  LevSetItem *items;
+  size_t *first;
+  size_t i, k;
+
+  items = (LevSetItem*)safe_malloc(n, sizeof(LevSetItem));
+  if (!items)
+    return (size_t)(-1);
+  first = (size_t*)safe_malloc(n, sizeof(size_t));
+  if (!first) {
+    free(items);
+    return (size_t)(-1);
+  }
+  for (i = 0; i < n; i++) {
+    items[i].s = strings[i];
+    items[i].len = lengths[i];
+    items[i].size = charsize;
+    items[i].i = i;
+  }
+  qsort(items, n, sizeof(LevSetItem), setitem_cmp);
+  /* the first item of each group has the smallest index */
+  for (i = 0; i < n; i++) {
+    if (i && lev_strings_equal(items[i].len, items[i].s,
+                               items[i-1].len, items[i-1].s, charsize))
+      first[items[i].i] = first[items[i-1].i];
+    else
+      first[items[i].i] = items[i].i;
+  }
+  free(items);
+
+  k = 0;
+  for (i = 0; i < n; i++) {
+    if (first[i] == i) {
+      rep[k] = i;
+      count[k] = 0;
+      cls[i] = k++;
+    }
+    else
+      cls[i] = cls[first[i]];
+    count[cls[i]]++;
+  }
+  free(first);
+
+  return k;
+}
+
+/*
+ * Fills the distance matrices of lev_set_distance() from the distances of
+ * the classes of repeated strings, see set_classes().
+ *
+ * Returns: 0 on success, -1 on allocation failure, 1 when there are no
+ *          repeated strings.
+ */
+static int
+set_distances_multiset(size_t n1, const size_t *lengths1,
+                       const lev_byte *strings1[],
+                       size_t n2, const size_t *lengths2,
+                       const lev_byte *strings2[],
+                       double *dists, size_t *idists)
+{
+  size_t *cls1, *rep1, *count1, *cls2, *rep2, *count2;
+  size_t *cdists = NULL;
+  size_t u1, u2, a, b, i, j, maxlen2;
+  LevLCSPattern pat;
+  int r = -1;
+
+  cls1 = (size_t*)safe_malloc_3(3, n1, sizeof(size_t));
+  cls2 = (size_t*)safe_malloc_3(3, n2, sizeof(size_t));
+  if (!cls1 || !cls2)
+    goto end;
+  rep1 = cls1 + n1;
+  count1 = rep1 + n1;
+  rep2 = cls2 + n2;
+  count2 = rep2 + n2;
+  u1 = set_classes(n1, lengths1, (const void**)strings1, sizeof(lev_byte),
+                   cls1, rep1, count1);
+  u2 = set_classes(n2, lengths2, (const void**)strings2, sizeof(lev_byte),
+                   cls2, rep2, count2);
+  if (u1 == (size_t)(-1) || u2 == (size_t)(-1))
+    goto end;
+  if (u1 == n1 && u2 == n2) {
+    r = 1;
+    goto end;
+  }
+
+  /* compute distances from each class to each */
+  maxlen2 = 0;
+  for (b = 0; b < u2; b++) {
+    if (lengths2[rep2[b]] > maxlen2)
+      maxlen2 = lengths2[rep2[b]];
+  }
+  cdists = (size_t*)safe_malloc_3(u1, u2, sizeof(size_t));
+  if (!cdists || lcs_pattern_init(&pat, maxlen2))
+    goto end;
+  for (b = 0; b < u2; b++) {
+    lcs_pattern_set(&pat, lengths2[rep2[b]], strings2[rep2[b]]);
+    for (a = 0; a < u1; a++)
+      cdists[b*u1 + a] = lcs_pattern_distance(&pat, lengths1[rep1[a]],
+                                              strings1[rep1[a]],
+                                              (size_t)(-1));
+  }
+  lcs_pattern_free(&pat);
+
+  /* and spread them to the strings, the strings of a class have the same
+   * length */
+  for (i = 0; i < n2; i++) {
+    for (j = 0; j < n1; j++) {
+      size_t l = lengths2[i] + lengths1[j];
+      size_t d = cdists[cls2[i]*u1 + cls1[j]];
+      *(idists++) = d;
+      *(dists++) = l == 0 ? 0.0 : (double)d / (double)l;
+    }
+  }
+  r = 0;
+
+end:
+  free(cdists);
+  free(cls1);
+  free(cls2);
+  return r;
+}
+
+/*
+ * Fills the distance matrices of lev_u_set_distance() from the distances of
+ * the classes of repeated strings, see set_classes().
+ *
+ * Returns: 0 on success, -1 on allocation failure, 1 when there are no
+ *          repeated strings.
+ */
+static int
+u_set_distances_multiset(size_t n1, const size_t *lengths1,
+                         const lev_wchar *strings1[],
+                         size_t n2, const size_t *lengths2,
+                         const lev_wchar *strings2[],
+                         double *dists, size_t *idists)
+{
+  size_t *cls1, *rep1, *count1, *cls2, *rep2, *count2;
+  size_t *cdists = NULL;
+  size_t u1, u2, a, b, i, j, maxlen2;
+  LevULCSPattern pat;
+  int r = -1;
+
+  cls1 = (size_t*)safe_malloc_3(3, n1, sizeof(size_t));
+  cls2 = (size_t*)safe_malloc_3(3, n2, sizeof(size_t));
+  if (!cls1 || !cls2)
+    goto end;
+  rep1 = cls1 + n1;
+  count1 = rep1 + n1;
+  rep2 = cls2 + n2;
+  count2 = rep2 + n2;
+  u1 = set_classes(n1, lengths1, (const void**)strings1, sizeof(lev_wchar),
+                   cls1, rep1, count1);
+  u2 = set_classes(n2, lengths2, (const void**)strings2, sizeof(lev_wchar),
+                   cls2, rep2, count2);
+  if (u1 == (size_t)(-1) || u2 == (size_t)(-1))
+    goto end;
+  if (u1 == n1 && u2 == n2) {
+    r = 1;
+    goto end;
+  }
+
+  /* compute distances from each class to each */
+  maxlen2 = 0;
+  for (b = 0; b < u2; b++) {
+    if (lengths2[rep2[b]] > maxlen2)
+      maxlen2 = lengths2[rep2[b]];
+  }
+  cdists = (size_t*)safe_malloc_3(u1, u2, sizeof(size_t));
+  if (!cdists || ulcs_pattern_init(&pat, maxlen2))
+    goto end;
+  for (b = 0; b < u2; b++) {
+    ulcs_pattern_set(&pat, lengths2[rep2[b]], strings2[rep2[b]]);
+    for (a = 0; a < u1; a++)
+      cdists[b*u1 + a] = ulcs_pattern_distance(&pat, lengths1[rep1[a]],
+                                               strings1[rep1[a]],
+                                               (size_t)(-1));
+  }
+  ulcs_pattern_free(&pat);
+
+  /* and spread them to the strings, the strings of a class have the same
+   * length */
+  for (i = 0; i < n2; i++) {
+    for (j = 0; j < n1; j++) {
+      size_t l = lengths2[i] + lengths1[j];
+      size_t d = cdists[cls2[i]*u1 + cls1[j]];
+      *(idists++) = d;
+      *(dists++) = l == 0 ? 0.0 : (double)d / (double)l;
+    }
+  }
+  r = 0;
+
+end:
+  free(cdists);
+  free(cls1);
+  free(cls2);
+  return r;
+}
+
+/**
+ * lev_set_distance:
+ * @n1: The length of @lengths1 and @strings1.
+ * @lengths1: The lengths of strings in @strings1.
+ * @strings1: An array of strings that may contain NUL characters.
+ * @n2: The length of @lengths2 and @strings2.
+ * @lengths2: The lengths of strings in @strings2.
+ * @strings2: An array of strings that may contain NUL characters.
+ *
+ * Finds the distance between string sets @strings1 and @strings2.
+ *
+ * The difference from lev_edit_seq_distance() is that order doesn't matter.
+ * The optimal association of @strings1 and @strings2 is found first and
+ * the similarity is computed for that.
+ *
+ * Uses sequential Munkers-Blackman algorithm.  When some strings repeat,
+ * the distances are computed only once for each pair of distinct strings.
+ *
+ * Returns: The distance of the two sets.
+ **/
+double
+lev_set_distance(size_t n1, const size_t *lengths1,
+                 const lev_byte *strings1[],
+                 size_t n2, const size_t *lengths2,
+                 const lev_byte *strings2[])
+{
+  double *dists;  /* the (modified) distance matrix, indexed [row*n1 + col] */
+  size_t *idists;  /* the plain distances, indexed the same way */
+  double *r;
+  size_t *ir;
+  size_t i, j;
+  size_t *map;
+  double sum;
+  LevLCSPattern pat;  /* match masks of the current string in strings2 */
+  size_t maxlen2;
+  int k;
+
+  /* catch trivial cases */
+  if (n1 == 0)
+    return (double)n2;
+  if (n2 == 0)
+    return (double)n1;
+
+  /* make the number of columns (n1) smaller than the number of rows */
+  if (n1 > n2) {
+    size_t nx = n1;
+    const size_t *lx = lengths1;
+    const lev_byte **sx = strings1;
+    n1 = n2;
+    n2 = nx;
+    lengths1 = lengths2;
+    lengths2 = lx;
+    strings1 = strings2;
+    strings2 = sx;
+  }
+
+  /* compute distances from each to each, collapsing repeated strings */
+  r = dists = (double*)safe_malloc_3(n1, n2, sizeof(double));
+  if (!r)
+    return -1.0;
+  ir = idists = (size_t*)safe_malloc_3(n1, n2, sizeof(size_t));
+  if (!ir) {
+    free(dists);
+    return -1.0;
+  }
+  k = set_distances_multiset(n1, lengths1, strings1, n2, lengths2, strings2,
+                             dists, idists);
+  if (k < 0) {
+    free(idists);
+    free(dists);
+    return -1.0;
+  }
+  if (k > 0) {
+    maxlen2 = 0;
+    for (i = 0; i < n2; i++) {
+      if (lengths2[i] > maxlen2)
+        maxlen2 = lengths2[i];
+    }
+    if (lcs_pattern_init(&pat, maxlen2)) {
+      free(idists);
+      free(dists);
+      return -1.0;
+    }
+    for (i = 0; i < n2; i++) {
+      size_t len2 = lengths2[i];
+      const size_t *len1p = lengths1;
+      const lev_byte **str1p = strings1;
+      lcs_pattern_set(&pat, len2, strings2[i]);
+      for (j = 0; j < n1; j++) {
+        size_t l = len2 + *len1p;
+        size_t d = lcs_pattern_distance(&pat, *(len1p++), *(str1p++),
+                                        (size_t)(-1));
+        *(ir++) = d;
+        *(r++) = l == 0 ? 0.0 : (double)d / (double)l;
+      }
+    }
+    lcs_pattern_free(&pat);
+  }
+
+  /* find the optimal mapping between the two sets */
+  map = munkers_blackman(n1, n2, dists);
+  if (!map) {
+    free(idists);
+    return -1.0;
+  }
+
+  /* sum the set distance */
+  sum = (double)(n2 - n1);
+  for (j = 0; j < n1; j++) {
+    size_t l;
+    i = map[j];
+    l = lengths1[j] + lengths2[i];
+    if (l > 0)
+      sum += 2.0 * (double)idists[i*n1 + j] / (double)l;
+  }
+  free(map);
+  free(idists);
+
+  return sum;
+}
+
+/**
+ * lev_u_set_distance:
+ * @n1: The length of @lengths1 and @strings1.
+ * @lengths1: The lengths of strings in @strings1.
+ * @strings1: An array of strings that may contain NUL characters.
+ * @n2: The length of @lengths2 and @strings2.
+ * @lengths2: The lengths of strings in @strings2.
+ * @strings2: An array of strings that may contain NUL characters.
+ *
+ * Finds the distance between string sets @strings1 and @strings2.
+ *
+ * The difference from lev_u_edit_seq_distance() is that order doesn't matter.
+ * The optimal association of @strings1 and @strings2 is found first and
+ * the similarity is computed for that.
+ *
+ * Uses sequential Munkers-Blackman algorithm.  When some strings repeat,
+ * the distances are computed only once for each pair of distinct strings.
+ *
+ * Returns: The distance of the two sets.
+ **/
+double
+lev_u_set_distance(size_t n1, const size_t *lengths1,
+                   const lev_wchar *strings1[],
+                   size_t n2, const size_t *lengths2,
+                   const lev_wchar *strings2[])
+{
+  double *dists;  /* the (modified) distance matrix, indexed [row*n1 + col] */
+  size_t *idists;  /* the plain distances, indexed the same way */
+  double *r;
+  size_t *ir;
+  size_t i, j;
+  size_t *map;
+  double sum;
+  LevULCSPattern pat;  /* match masks of the current string in strings2 */
+  size_t maxlen2;
+  int k;
+
+  /* catch trivial cases */
+  if (n1 == 0)
+    return (double)n2;
+  if (n2 == 0)
+    return (double)n1;
+
+  /* make the number of columns (n1) smaller than the number of rows */
+  if (n1 > n2) {
+    size_t nx = n1;
+    const size_t *lx = lengths1;
+    const lev_wchar **sx = strings1;
+    n1 = n2;
+    n2 = nx;
+    lengths1 = lengths2;
+    lengths2 = lx;
+    strings1 = strings2;
+    strings2 = sx;
+  }
+
+  /* compute distances from each to each, collapsing repeated strings */
+  r = dists = (double*)safe_malloc_3(n1, n2, sizeof(double));
+  if (!r)
+    return -1.0;
+  ir = idists = (size_t*)safe_malloc_3(n1, n2, sizeof(size_t));
+  if (!ir) {
+    free(dists);
+    return -1.0;
+  }
+  k = u_set_distances_multiset(n1, lengths1, strings1, n2, lengths2, strings2,
+                               dists, idists);
+  if (k < 0) {
+    free(idists);
+    free(dists);
+    return -1.0;
+  }
+  if (k > 0) {
+    maxlen2 = 0;
+    for (i = 0; i < n2; i++) {
+      if (lengths2[i] > maxlen2)
+        maxlen2 = lengths2[i];
+    }
+    if (ulcs_pattern_init(&pat, maxlen2)) {
+      free(idists);
+      free(dists);
+      return -1.0;
+    }
+    for (i = 0; i < n2; i++) {
+      size_t len2 = lengths2[i];
+      const size_t *len1p = lengths1;
+      const lev_wchar **str1p = strings1;
+      ulcs_pattern_set(&pat, len2, strings2[i]);
+      for (j = 0; j < n1; j++) {
+        size_t l = len2 + *len1p;
+        size_t d = ulcs_pattern_distance(&pat, *(len1p++), *(str1p++),
+                                         (size_t)(-1));
+        *(ir++) = d;
+        *(r++) = l == 0 ? 0.0 : (double)d / (double)l;
+      }
+    }
+    ulcs_pattern_free(&pat);
+  }
+
+  /* find the optimal mapping between the two sets */
+  map = munkers_blackman(n1, n2, dists);
+  if (!map) {
+    free(idists);
+    return -1.0;
+  }
+
+  /* sum the set distance */
+  sum = (double)(n2 - n1);
+  for (j = 0; j < n1; j++) {
+    size_t l;
+    i = map[j];
+    l = lengths1[j] + lengths2[i];
+    if (l > 0)
+      sum += 2.0 * (double)idists[i*n1 + j] / (double)l;
+  }
+  free(map);
+  free(idists);
+
+  return sum;
+}
+
+/*
+ * Munkers-Blackman algorithm.
+ */
+static size_t*
+munkers_blackman(size_t n1, size_t n2, double *dists)
+{
+  size_t i, j;
+  size_t *covc, *covr;  /* 1 if column/row is covered */
+  /* these contain 1-based indices, so we can use zero as `none'
+   * zstarr: column of a z* in given row
+   * zstarc: row of a z* in given column
+   * zprimer: column of a z' in given row */
+  size_t *zstarr, *zstarc, *zprimer;
+
+  /* allocate memory */
+  covc = (size_t*)calloc(n1, sizeof(size_t));
+  if (!covc)
+    return NULL;
+  zstarc = (size_t*)calloc(n1, sizeof(size_t));
+  if (!zstarc) {
+    free(covc);
+    return NULL;
+  }
+  covr = (size_t*)calloc(n2, sizeof(size_t));
+  if (!covr) {
+    free(zstarc);
+    free(covc);
+    return NULL;
+  }
+  zstarr = (size_t*)calloc(n2, sizeof(size_t));
+  if (!zstarr) {
+    free(covr);
+    free(zstarc);
+    free(covc);
+    return NULL;
+  }
+  zprimer = (size_t*)calloc(n2, sizeof(size_t));
+  if (!zprimer) {
+    free(zstarr);
+    free(covr);
+    free(zstarc);
+    free(covc);
+    return NULL;
+  }
+
+  /* step 0 (subtract minimal distance) and step 1 (find zeroes) */
+  for (j = 0; j < n1; j++) {
+    size_t minidx = 0;
+    double *col = dists + j;
+    double min = *col;
+    double *p = col + n1;
+    for (i = 1; i < n2; i++) {
+      if (min > *p) {
+        minidx = i;
+        min = *p;
+      }
+      p += n1;
+    }
+    /* subtract */
+    p = col;
+    for (i = 0; i < n2; i++) {
+      *p -= min;
+      if (*p < LEV_EPSILON)
+        *p = 0.0;
+      p += n1;
+    }
+    /* star the zero, if possible */
+    if (!zstarc[j] && !zstarr[minidx]) {
+      zstarc[j] = minidx + 1;
+      zstarr[minidx] = j + 1;
+    }
+    else {
+      /* otherwise try to find some other */
+      p = col;
+      for (i = 0; i < n2; i++) {
+        if (i != minidx && *p == 0.0
+            && !zstarc[j] && !zstarr[i]) {
+          zstarc[j] = i + 1;
+          zstarr[i] = j + 1;
+          break;
+        }
+        p += n1;
+      }
+    }
+  }
+
+  /* main */
+  while (1) {
+    /* step 2 (cover columns containing z*) */
+    {
+      size_t nc = 0;
+      for (j = 0; j < n1; j++) {
+        if (zstarc[j]) {
+          covc[j] = 1;
+          nc++;
+        }
+      }
+      if (nc == n1)
+        break;
+    }
+
+    /* step 3 (find uncovered zeroes) */
+    while (1) {
+      step_3:
+      /* search uncovered matrix entries */
+      for (j = 0; j < n1; j++) {
+        double *p = dists + j;
+        if (covc[j])
+          continue;
+        for (i = 0; i < n2; i++) {
+          if (!covr[i] && *p == 0.0) {
+            /* when a zero is found, prime it */
+            zprimer[i] = j + 1;
+            if (zstarr[i]) {
+              /* if there's a z* in the same row,
+               * uncover the column, cover the row and redo */
+              covr[i] = 1;
+              covc[zstarr[i] - 1] = 0;
+              goto step_3;
+            }
+            /* if there's no z*,
+             * we are at the end of our path an can convert z'
+             * to z* */
+            goto step_4;
+          }
+          p += n1;
+        }
+      }
+
+      /* step 5 (new zero manufacturer)
+       * we can't get here, unless no zero is found at all */
+      {
+        /* find the smallest uncovered entry */
+        double min = LEV_INFINITY;
+        for (j = 0; j < n1; j++) {
+          double *p = dists + j;
+          if (covc[j])
+            continue;
+          for (i = 0; i < n2; i++) {
+            if (!covr[i] && min > *p) {
+              min = *p;
+            }
+            p += n1;
+          }
+        }
+        /* add it to all covered rows */
+        for (i = 0; i < n2; i++) {
+          double *p = dists + i*n1;
+          if (!covr[i])
+            continue;
+          for (j = 0; j < n1; j++)
+            *(p++) += min;
+        }
+        /* subtract if from all uncovered columns */
+        for (j = 0; j < n1; j++) {
+          double *p = dists + j;
+          if (covc[j])
+            continue;
+          for (i = 0; i < n2; i++) {
+            *p -= min;
+            if (*p < LEV_EPSILON)
+              *p = 0.0;
+            p += n1;
+          }
+        }
+      }
+    }
+
+    /* step 4 (increment the number of z*)
+     * i is the row number (we get it from step 3) */
+    step_4:
+    i++;
+    do {
+      size_t x = i;
+
+      i--;
+      j = zprimer[i] - 1;  /* move to z' in the same row */
+      zstarr[i] = j + 1;   /* mark it as z* in row buffer */
+      i = zstarc[j];       /* move to z* in the same column */
+      zstarc[j] = x;       /* mark the z' as being new z* */
+    } while (i);
+    memset(zprimer, 0, n2*sizeof(size_t));
+    memset(covr, 0, n2*sizeof(size_t));
+    memset(covc, 0, n1*sizeof(size_t));
+  }
+
+  free(dists);
+  free(covc);
+  free(covr);
+  /*free(zstarc);  this is the result */
+  free(zstarr);
+  free(zprimer);
+
+  for (j = 0; j < n1; j++)
+    zstarc[j]--;
+  return zstarc;
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Editops and other difflib-like stuff.
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/**
+ * lev_editops_check_errors:
+ * @len1: The length of an eventual @ops source string.
+ * @len2: The length of an eventual @ops destination string.
+ * @n: The length of @ops.
+ * @ops: An array of elementary edit operations.
+ *
+ * Checks whether @ops is consistent and applicable as a partial edit from a
+ * string of length @len1 to a string of length @len2.
+ *
+ * Returns: Zero if @ops seems OK, a nonzero error code otherwise.
+ **/
+int
+lev_editops_check_errors(size_t len1, size_t len2,
+                         size_t n, const LevEditOp *ops)
+{
+  const LevEditOp *o;
+  size_t i;
+
+  if (!n)
+    return LEV_EDIT_ERR_OK;
+
+  /* check bounds */
+  o = ops;
+  for (i = n; i; i--, o++) {
+    if (o->type >= LEV_EDIT_LAST)
+      return LEV_EDIT_ERR_TYPE;
+    if (o->spos > len1 || o->dpos > len2)
+      return LEV_EDIT_ERR_OUT;
+    if (o->spos == len1 && o->type != LEV_EDIT_INSERT)
+      return LEV_EDIT_ERR_OUT;
+    if (o->dpos == len2 && o->type != LEV_EDIT_DELETE)
+      return LEV_EDIT_ERR_OUT;
+  }
+
+  /* check ordering */
+  o = ops + 1;
+  for (i = n - 1; i; i--, o++, ops++) {
+    if (o->spos < ops->spos || o->dpos < ops->dpos)
+      return LEV_EDIT_ERR_ORDER;
+  }
+
+  return LEV_EDIT_ERR_OK;
+}
+
+/**
+ * lev_opcodes_check_errors:
+ * @len1: The length of an eventual @ops source string.
+ * @len2: The length of an eventual @ops destination string.
+ * @nb: The length of @bops.
+ * @bops: An array of difflib block edit operation codes.
+ *
+ * Checks whether @bops is consistent and applicable as an edit from a
+ * string of length @len1 to a string of length @len2.
+ *
+ * Returns: Zero if @bops seems OK, a nonzero error code otherwise.
+ **/
+int
+lev_opcodes_check_errors(size_t len1, size_t len2,
+                         size_t nb, const LevOpCode *bops)
+{
+  const LevOpCode *b;
+  size_t i;
+
+  if (!nb)
+    return 1;
+
+  /* check completenes */
+  if (bops->sbeg || bops->dbeg
+      || bops[nb - 1].send != len1 || bops[nb - 1].dend != len2)
+    return LEV_EDIT_ERR_SPAN;
+
+  /* check bounds and block consistency */
+  b = bops;
+  for (i = nb; i; i--, b++) {
+    if (b->send > len1 || b->dend > len2)
+      return LEV_EDIT_ERR_OUT;
+    switch (b->type) {
+      case LEV_EDIT_KEEP:
+      case LEV_EDIT_REPLACE:
+      if (b->dend - b->dbeg != b->send - b->sbeg || b->dend == b->dbeg)
+        return LEV_EDIT_ERR_BLOCK;
+      break;
+
+      case LEV_EDIT_INSERT:
+      if (b->dend - b->dbeg == 0 || b->send - b->sbeg != 0)
+        return LEV_EDIT_ERR_BLOCK;
+      break;
+
+      case LEV_EDIT_DELETE:
+      if (b->send - b->sbeg == 0 || b->dend - b->dbeg != 0)
+        return LEV_EDIT_ERR_BLOCK;
+      break;
+
+      default:
+      return LEV_EDIT_ERR_TYPE;
+      break;
+    }
+  }
+
+  /* check ordering */
+  b = bops + 1;
+  for (i = nb - 1; i; i--, b++, bops++) {
+    if (b->sbeg != bops->send || b->dbeg != bops->dend)
+      return LEV_EDIT_ERR_ORDER;
+  }
+
+  return LEV_EDIT_ERR_OK;
+}
+
+/**
+ * lev_editops_invert:
+ * @n: The length of @ops.
+ * @ops: An array of elementary edit operations.
+ *
+ * Inverts the sense of @ops.  It is modified in place.
+ *
+ * In other words, @ops becomes a valid partial edit for the original source
+ * and destination strings with their roles exchanged.
+ **/
+void
+lev_editops_invert(size_t n, LevEditOp *ops)
+{
+  size_t i;
+
+  for (i = n; i; i--, ops++) {
+    size_t z;
+
+    z = ops->dpos;
+    ops->dpos = ops->spos;
+    ops->spos = z;
+    if (ops->type & 2)
+      ops->type = (LevEditType)(ops->type ^ 1);
+  }
+}
+
+/**
+ * lev_editops_apply:
+ * @len1: The length of @string1.
+ * @string1: A string of length @len1, may contain NUL characters.
+ * @len2: The length of @string2.
+ * @string2: A string of length @len2, may contain NUL characters.
+ * @n: The size of @ops.
+ * @ops: An array of elementary edit operations.
+ * @len: Where the size of the resulting string should be stored.
+ *
+ * Applies a partial edit @ops from @string1 to @string2.
+ *
+ * NB: @ops is not checked for applicability.
+ *
+ * Returns: The result of the partial edit as a newly allocated string, its
+ *          length is stored in @len.
+ **/
+lev_byte*
+lev_editops_apply(size_t len1, const lev_byte *string1,
+                  size_t len2, const lev_byte *string2,
+                  size_t n, const LevEditOp *ops,
+                  size_t *len)
+{
+  lev_byte *dst, *dpos;  /* destination string */
+  const lev_byte *spos;  /* source string position */
+  size_t i, j;
+  LEV_UNUSED(len2);
+
+  /* this looks too complex for such a simple task, but note ops is not
+   * a complete edit sequence, we have to be able to apply anything anywhere */
+  dpos = dst = (lev_byte*)safe_malloc((n + len1), sizeof(lev_byte));
+  if (!dst) {
+    *len = (size_t)(-1);
+    return NULL;
+  }
+  spos = string1;
+  for (i = n; i; i--, ops++) {
+    /* XXX: this fine with gcc internal memcpy, but when memcpy is
+     * actually a function, it may be pretty slow */
+    j = ops->spos - (size_t)(spos - string1) + (ops->type == LEV_EDIT_KEEP);
+    if (j) {
+      memcpy(dpos, spos, j*sizeof(lev_byte));
+      spos += j;
+      dpos += j;
+    }
+    switch (ops->type) {
+    case LEV_EDIT_DELETE:
+      spos++;
+      break;
+
+    case LEV_EDIT_REPLACE:
+      spos++;
+      *(dpos++) = string2[ops->dpos];
+      break;
+    case LEV_EDIT_INSERT:
+      *(dpos++) = string2[ops->dpos];
+      break;
+
+    default:
+      break;
+    }
+  }
+  j = len1 - (size_t)(spos - string1);
+  if (j) {
+    memcpy(dpos, spos, j*sizeof(lev_byte));
+    spos += j;
+    dpos += j;
+  }
+
+  *len = (size_t)(dpos - dst);
+  /* possible realloc failure is detected with *len != 0 */
+  return (lev_byte*)realloc(dst, *len*sizeof(lev_byte));
+}
+
+/**
+ * lev_u_editops_apply:
+ * @len1: The length of @string1.
+ * @string1: A string of length @len1, may contain NUL characters.
+ * @len2: The length of @string2.
+ * @string2: A string of length @len2, may contain NUL characters.
+ * @n: The size of @ops.
+ * @ops: An array of elementary edit operations.
+ * @len: Where the size of the resulting string should be stored.
+ *
+ * Applies a partial edit @ops from @string1 to @string2.
+ *
+ * NB: @ops is not checked for applicability.
+ *
+ * Returns: The result of the partial edit as a newly allocated string, its
+ *          length is stored in @len.
+ **/
+lev_wchar*
+lev_u_editops_apply(size_t len1, const lev_wchar *string1,
+                    size_t len2, const lev_wchar *string2,
+                    size_t n, const LevEditOp *ops,
+                    size_t *len)
+{
+  lev_wchar *dst, *dpos;  /* destination string */
+  const lev_wchar *spos;  /* source string position */
+  size_t i, j;
+  LEV_UNUSED(len2);
+
+  /* this looks too complex for such a simple task, but note ops is not
+   * a complete edit sequence, we have to be able to apply anything anywhere */
+  dpos = dst = (lev_wchar*)safe_malloc((n + len1), sizeof(lev_wchar));
+  if (!dst) {
+    *len = (size_t)(-1);
+    return NULL;
+  }
+  spos = string1;
+  for (i = n; i; i--, ops++) {
+    /* XXX: this is fine with gcc internal memcpy, but when memcpy is
+     * actually a function, it may be pretty slow */
+    j = ops->spos - (size_t)(spos - string1) + (ops->type == LEV_EDIT_KEEP);
+    if (j) {
+      memcpy(dpos, spos, j*sizeof(lev_wchar));
+      spos += j;
+      dpos += j;
+    }
+    switch (ops->type) {
+    case LEV_EDIT_DELETE:
+      spos++;
+      break;
+
+    case LEV_EDIT_REPLACE:
+      spos++;
+      *(dpos++) = string2[ops->dpos];
+      break;
+    case LEV_EDIT_INSERT:
+      *(dpos++) = string2[ops->dpos];
+      break;
+
+    default:
+      break;
+    }
+  }
+  j = len1 - (size_t)(spos - string1);
+  if (j) {
+    memcpy(dpos, spos, j*sizeof(lev_wchar));
+    spos += j;
+    dpos += j;
+  }
+
+  *len = (size_t)(dpos - dst);
+  /* possible realloc failure is detected with *len != 0 */
+  return (lev_wchar*)realloc(dst, *len*sizeof(lev_wchar));
+}
+
+/**
+ * editops_from_cost_matrix:
+ * @len1: The length of @string1.
+ * @string1: A string of length @len1, may contain NUL characters.
+ * @o1: The offset where the matrix starts from the start of @string1.
+ * @len2: The length of @string2.
+ * @string2: A string of length @len2, may contain NUL characters.
+ * @o2: The offset where the matrix starts from the start of @string2.
+ * @matrix: The cost matrix.
+ * @n: Where the number of edit operations should be stored.
+ *
+ * Reconstructs the optimal edit sequence from the cost matrix @matrix.
+ *
+ * The matrix is freed.
+ *
+ * Returns: The optimal edit sequence, as a newly allocated array of
+ *          elementary edit operations, it length is stored in @n.
+ **/
+static LevEditOp*
+editops_from_cost_matrix(size_t len1, const lev_byte *string1, size_t off1,
+                         size_t len2, const lev_byte *string2, size_t off2,
+                         size_t *matrix, size_t *n)
+{
+  size_t *p;
+  size_t i, j, pos;
+  LevEditOp *ops;
+  int dir = 0;
+
+  pos = *n = matrix[len1*len2 - 1];
+  if (!*n) {
+    free(matrix);
+    return NULL;
+  }
+  ops = (LevEditOp*)safe_malloc((*n), sizeof(LevEditOp));
+  if (!ops) {
+    free(matrix);
+    *n = (size_t)(-1);
+    return NULL;
+  }
+  i = len1 - 1;
+  j = len2 - 1;
+  p = matrix + len1*len2 - 1;
+  while (i || j) {
+    /* prefer contiuning in the same direction */
+    if (dir < 0 && j && *p == *(p - 1) + 1) {
+      pos--;
+      ops[pos].type = LEV_EDIT_INSERT;
+      ops[pos].spos = i + off1;
+      ops[pos].dpos = --j + off2;
+      p--;
+      continue;
+    }
+    if (dir > 0 && i && *p == *(p - len2) + 1) {
+      pos--;
+      ops[pos].type = LEV_EDIT_DELETE;
+      ops[pos].spos = --i + off1;
+      ops[pos].dpos = j + off2;
+      p -= len2;
+      continue;
+    }
+    if (i && j && *p == *(p - len2 - 1)
+        && string1[i - 1] == string2[j - 1]) {
+      /* don't be stupid like difflib, don't store LEV_EDIT_KEEP */
+      i--;
+      j--;
+      p -= len2 + 1;
+      dir = 0;
+      continue;
+    }
+    if (i && j && *p == *(p - len2 - 1) + 1) {
+      pos--;
+      ops[pos].type = LEV_EDIT_REPLACE;
+      ops[pos].spos = --i + off1;
+      ops[pos].dpos = --j + off2;
+      p -= len2 + 1;
+      dir = 0;
+      continue;
+    }
+    /* we cant't turn directly from -1 to 1, in this case it would be better
+     * to go diagonally, but check it (dir == 0) */
+    if (dir == 0 && j && *p == *(p - 1) + 1) {
+      pos--;
+      ops[pos].type = LEV_EDIT_INSERT;
+      ops[pos].spos = i + off1;
+      ops[pos].dpos = --j + off2;
+      p--;
+      dir = -1;
+      continue;
+    }
+    if (dir == 0 && i && *p == *(p - len2) + 1) {
+      pos--;
+      ops[pos].type = LEV_EDIT_DELETE;
+      ops[pos].spos = --i + off1;
+      ops[pos].dpos = j + off2;
+      p -= len2;
+      dir = 1;
+      continue;
+    }
+    /* coredump right now, later might be too late ;-) */
+    assert("lost in the cost matrix" == NULL);
+  }
+  free(matrix);
+
+  return ops;
+}
+
+/**
+ * lev_editops_find:
+ * @len1: The length of @string1.
+ * @string1: A string of length @len1, may contain NUL characters.
+ * @len2: The length of @string2.
+ * @string2: A string of length @len2, may contain NUL characters.
+ * @n: Where the number of edit operations should be stored.
+ *
+ * Find an optimal edit sequence from @string1 to @string2.
+ *
+ * When there's more than one optimal sequence, a one is arbitrarily (though
+ * deterministically) chosen.
+ *
+ * Returns: The optimal edit sequence, as a newly allocated array of
+ *          elementary edit operations, it length is stored in @n.
+ *          It is normalized, i.e., keep operations are not included.
+ **/
+LevEditOp*
+lev_editops_find(size_t len1, const lev_byte *string1,
+                 size_t len2, const lev_byte *string2,
+                 size_t *n)
+{
+  size_t len1o, len2o;
+  size_t i;
+  size_t *matrix; /* cost matrix */
+
+  /* strip common prefix and suffix */
+  len1o = lev_strip_affixes(&len1, string1, &len2, string2, sizeof(*string1));
+  string1 += len1o;
+  string2 += len1o;
+  len2o = len1o;
+
+  /* small alphabets don't need the cost matrix */
+  if (len1 && len2) {
+    LevEditOp *ops;
+    if (small_editops(len1, string1, len1o, len2, string2, len2o, 0,
+                      &ops, n))
+      return ops;
+  }
+  len1++;
+  len2++;
+
+  /* initialize first row and column */
+  matrix = (size_t*)safe_malloc_3(len1, len2, sizeof(size_t));
+  if (!matrix) {
+    *n = (size_t)(-1);
+    return NULL;
+  }
+  for (i = 0; i < len2; i++)
+    matrix[i] = i;
+  for (i = 1; i < len1; i++)
+    matrix[len2*i] = i;
+
+  /* find the costs and fill the matrix */
+  for (i = 1; i < len1; i++) {
+    size_t *prev = matrix + (i - 1)*len2;
+    size_t *p = matrix + i*len2;
+    size_t *end = p + len2 - 1;
+    const lev_byte char1 = string1[i - 1];
+    const lev_byte *char2p = string2;
+    size_t x = i;
+    p++;
+    while (p <= end) {
+      size_t c3 = *(prev++) + (char1 != *(char2p++));
+      x++;
+      if (x > c3)
+        x = c3;
+      c3 = *prev + 1;
+      if (x > c3)
+        x = c3;
+      *(p++) = x;
+    }
+  }
+
+  /* find the way back */
+  return editops_from_cost_matrix(len1, string1, len1o,
+                                  len2, string2, len2o,
+                                  matrix, n);
+}
+
+/**
+ * ueditops_from_cost_matrix:
+ * @len1: The length of @string1.
+ * @string1: A string of length @len1, may contain NUL characters.
+ * @o1: The offset where the matrix starts from the start of @string1.
+ * @len2: The length of @string2.
+ * @string2: A string of length @len2, may contain NUL characters.
+ * @o2: The offset where the matrix starts from the start of @string2.
+ * @matrix: The cost matrix.
+ * @n: Where the number of edit operations should be stored.
+ *
+ * Reconstructs the optimal edit sequence from the cost matrix @matrix.
+ *
+ * The matrix is freed.
+ *
+ * Returns: The optimal edit sequence, as a newly allocated array of
+ *          elementary edit operations, it length is stored in @n.
+ **/
+static LevEditOp*
+ueditops_from_cost_matrix(size_t len1, const lev_wchar *string1, size_t o1,
+                          size_t len2, const lev_wchar *string2, size_t o2,
+                          size_t *matrix, size_t *n)
+{
+  size_t *p;
+  size_t i, j, pos;
+  LevEditOp *ops;
+  int dir = 0;
+
+  pos = *n = matrix[len1*len2 - 1];
+  if (!*n) {
+    free(matrix);
+    return NULL;
+  }
+  ops = (LevEditOp*)safe_malloc((*n), sizeof(LevEditOp));
+  if (!ops) {
+    free(matrix);
+    *n = (size_t)(-1);
+    return NULL;
+  }
+  i = len1 - 1;
+  j = len2 - 1;
+  p = matrix + len1*len2 - 1;
+  while (i || j) {
+    /* prefer contiuning in the same direction */
+    if (dir < 0 && j && *p == *(p - 1) + 1) {
+      pos--;
+      ops[pos].type = LEV_EDIT_INSERT;
+      ops[pos].spos = i + o1;
+      ops[pos].dpos = --j + o2;
+      p--;
+      continue;
+    }
+    if (dir > 0 && i && *p == *(p - len2) + 1) {
+      pos--;
+      ops[pos].type = LEV_EDIT_DELETE;
+      ops[pos].spos = --i + o1;
+      ops[pos].dpos = j + o2;
+      p -= len2;
+      continue;
+    }
+    if (i && j && *p == *(p - len2 - 1)
+        && string1[i - 1] == string2[j - 1]) {
+      /* don't be stupid like difflib, don't store LEV_EDIT_KEEP */
+      i--;
+      j--;
+      p -= len2 + 1;
+      dir = 0;
+      continue;
+    }
+    if (i && j && *p == *(p - len2 - 1) + 1) {
+      pos--;
+      ops[pos].type = LEV_EDIT_REPLACE;
+      ops[pos].spos = --i + o1;
+      ops[pos].dpos = --j + o2;
+      p -= len2 + 1;
+      dir = 0;
+      continue;
+    }
+    /* we cant't turn directly from -1 to 1, in this case it would be better
+     * to go diagonally, but check it (dir == 0) */
+    if (dir == 0 && j && *p == *(p - 1) + 1) {
+      pos--;
+      ops[pos].type = LEV_EDIT_INSERT;
+      ops[pos].spos = i + o1;
+      ops[pos].dpos = --j + o2;
+      p--;
+      dir = -1;
+      continue;
+    }
+    if (dir == 0 && i && *p == *(p - len2) + 1) {
+      pos--;
+      ops[pos].type = LEV_EDIT_DELETE;
+      ops[pos].spos = --i + o1;
+      ops[pos].dpos = j + o2;
+      p -= len2;
+      dir = 1;
+      continue;
+    }
+    /* coredump right now, later might be too late ;-) */
+    assert("lost in the cost matrix" == NULL);
+  }
+  free(matrix);
+
+  return ops;
+}
+
+/**
+ * lev_u_editops_find:
+ * @len1: The length of @string1.
+ * @string1: A string of length @len1, may contain NUL characters.
+ * @len2: The length of @string2.
+ * @string2: A string of length @len2, may contain NUL characters.
+ * @n: Where the number of edit operations should be stored.
+ *
+ * Find an optimal edit sequence from @string1 to @string2.
+ *
+ * When there's more than one optimal sequence, a one is arbitrarily (though
+ * deterministically) chosen.
+ *
+ * Returns: The optimal edit sequence, as a newly allocated array of
+ *          elementary edit operations, it length is stored in @n.
+ *          It is normalized, i.e., keep operations are not included.
+ **/
+LevEditOp*
+lev_u_editops_find(size_t len1, const lev_wchar *string1,
+                   size_t len2, const lev_wchar *string2,
+                   size_t *n)
+{
+  size_t len1o, len2o;
+  size_t i;
+  size_t *matrix; /* cost matrix */
+
+  /* strip common prefix and suffix */
+  len1o = lev_strip_affixes(&len1, string1, &len2, string2, sizeof(*string1));
+  string1 += len1o;
+  string2 += len1o;
+  len2o = len1o;
+
+  /* small alphabets don't need the cost matrix */
+  if (len1 && len2) {
+    LevEditOp *ops;
+    if (small_editops(len1, string1, len1o, len2, string2, len2o, 1,
+                      &ops, n))
+      return ops;
+  }
+  len1++;
+  len2++;
+
+  /* initalize first row and column */
+  matrix = (size_t*)safe_malloc_3(len1, len2, sizeof(size_t));
+  if (!matrix) {
+    *n = (size_t)(-1);
+    return NULL;
+  }
+  for (i = 0; i < len2; i++)
+    matrix[i] = i;
+  for (i = 1; i < len1; i++)
+    matrix[len2*i] = i;
+
+  /* find the costs and fill the matrix */
+  for (i = 1; i < len1; i++) {
+    size_t *prev = matrix + (i - 1)*len2;
+    size_t *p = matrix + i*len2;
+    size_t *end = p + len2 - 1;
+    const lev_wchar char1 = string1[i - 1];
+    const lev_wchar *char2p = string2;
+    size_t x = i;
+    p++;
+    while (p <= end) {
+      size_t c3 = *(prev++) + (char1 != *(char2p++));
+      x++;
+      if (x > c3)
+        x = c3;
+      c3 = *prev + 1;
+      if (x > c3)
+        x = c3;
+      *(p++) = x;
+    }
+  }
+
+  /* find the way back */
+  return ueditops_from_cost_matrix(len1, string1, len1o,
+                                   len2, string2, len2o,
+                                   matrix, n);
+}
+
+/**
+ * lev_opcodes_to_editops:
+ * @nb: The length of @bops.
+ * @bops: An array of difflib block edit operation codes.
+ * @n: Where the number of edit operations should be stored.
+ * @keepkeep: If nonzero, keep operations will be included.  Otherwise the
+ *            result will be normalized, i.e. without any keep operations.
+ *
+ * Converts difflib block operation codes to elementary edit operations.
+ *
+ * Returns: The converted edit operatiosn, as a newly allocated array; its
+ *          size is stored in @n.
+ **/
+LevEditOp*
+lev_opcodes_to_editops(size_t nb, const LevOpCode *bops,
+                       size_t *n, int keepkeep)
+{
+  size_t i;
+  const LevOpCode *b;
+  LevEditOp *ops, *o;
+
+  /* compute the number of atomic operations */
+  *n = 0;
+  if (!nb)
+    return NULL;
+
+  b = bops;
+  if (keepkeep) {
+    for (i = nb; i; i--, b++) {
+      size_t sd = b->send - b->sbeg;
+      size_t dd = b->dend - b->dbeg;
+      *n += (sd > dd ? sd : dd);
+    }
+  }
+  else {
+    for (i = nb; i; i--, b++) {
+      size_t sd = b->send - b->sbeg;
+      size_t dd = b->dend - b->dbeg;
+      *n += (b->type != LEV_EDIT_KEEP ? (sd > dd ? sd : dd) : 0);
+    }
+  }
+
+  /* convert */
+  o = ops = (LevEditOp*)safe_malloc((*n), sizeof(LevEditOp));
+  if (!ops) {
+    *n = (size_t)(-1);
+    return NULL;
+  }
+  b = bops;
+  for (i = nb; i; i--, b++) {
+    size_t j;
+
+    switch (b->type) {
+      case LEV_EDIT_KEEP:
+      if (keepkeep) {
+        for (j = 0; j < b->send - b->sbeg; j++, o++) {
+          o->type = LEV_EDIT_KEEP;
+          o->spos = b->sbeg + j;
+          o->dpos = b->dbeg + j;
+        }
+      }
+      break;
+
+      case LEV_EDIT_REPLACE:
+      for (j = 0; j < b->send - b->sbeg; j++, o++) {
+        o->type = LEV_EDIT_REPLACE;
+        o->spos = b->sbeg + j;
+        o->dpos = b->dbeg + j;
+      }
+      break;
+
+      case LEV_EDIT_DELETE:
+      for (j = 0; j < b->send - b->sbeg; j++, o++) {
+        o->type = LEV_EDIT_DELETE;
+        o->spos = b->sbeg + j;
+        o->dpos = b->dbeg;
+      }
+      break;
+
+      case LEV_EDIT_INSERT:
+      for (j = 0; j < b->dend - b->dbeg; j++, o++) {
+        o->type = LEV_EDIT_INSERT;
+        o->spos = b->sbeg;
+        o->dpos = b->dbeg + j;
+      }
+      break;
+
+      default:
+      break;
+    }
+  }
+  assert((size_t)(o - ops) == *n);
+
+  return ops;
+}
+
+/**
+ * lev_editops_to_opcodes:
+ * @n: The size of @ops.
+ * @ops: An array of elementary edit operations.
+ * @nb: Where the number of difflib block operation codes should be stored.
+ * @len1: The length of the source string.
+ * @len2: The length of the destination string.
+ *
+ * Converts elementary edit operations to difflib block operation codes.
+ *
+ * Note the string lengths are necessary since difflib doesn't allow omitting
+ * keep operations.
+ *
+ * Returns: The converted block operation codes, as a newly allocated array;
+ *          its length is stored in @nb.
+ **/
+LevOpCode*
+lev_editops_to_opcodes(size_t n, const LevEditOp *ops, size_t *nb,
+                       size_t len1, size_t len2)
+{
+  size_t nbl, i, spos, dpos;
+  const LevEditOp *o;
+  LevOpCode *bops, *b;
+  LevEditType type;
+
+  /* compute the number of blocks */
+  nbl = 0;
+  o = ops;
+  spos = dpos = 0;
+  type = LEV_EDIT_KEEP;
+  for (i = n; i; ) {
+    /* simply pretend there are no keep blocks */
+    while (o->type == LEV_EDIT_KEEP && --i)
+      o++;
+    if (!i)
+      break;
+    if (spos < o->spos || dpos < o->dpos) {
+      nbl++;
+      spos = o->spos;
+      dpos = o->dpos;
+    }
+    nbl++;
+    type = o->type;
+    switch (type) {
+      case LEV_EDIT_REPLACE:
+      do {
+        spos++;
+        dpos++;
+        i--;
+        o++;
+      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
+      break;
+
+      case LEV_EDIT_DELETE:
+      do {
+        spos++;
+        i--;
+        o++;
+      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
+      break;
+
+      case LEV_EDIT_INSERT:
+      do {
+        dpos++;
+        i--;
+        o++;
+      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
+      break;
+
+      default:
+      break;
+    }
+  }
+  if (spos < len1 || dpos < len2)
+    nbl++;
+
+  /* convert */
+  b = bops = (LevOpCode*)safe_malloc(nbl, sizeof(LevOpCode));
+  if (!bops) {
+    *nb = (size_t)(-1);
     return NULL;
   }
-  mediandist = (double*)safe_malloc((stoplen + 1), sizeof(double));
-  if (!mediandist) {
-    for (j = 0; j < n; j++)
-      free(rows[j]);
-    free(rows);
-    free(row);
-    free(symlist);
-    free(median);
+  o = ops;
+  spos = dpos = 0;
+  type = LEV_EDIT_KEEP;
+  for (i = n; i; ) {
+    /* simply pretend there are no keep blocks */
+    while (o->type == LEV_EDIT_KEEP && --i)
+      o++;
+    if (!i)
+      break;
+    b->sbeg = spos;
+    b->dbeg = dpos;
+    if (spos < o->spos || dpos < o->dpos) {
+      b->type = LEV_EDIT_KEEP;
+      spos = b->send = o->spos;
+      dpos = b->dend = o->dpos;
+      b++;
+      b->sbeg = spos;
+      b->dbeg = dpos;
+    }
+    type = o->type;
+    switch (type) {
+      case LEV_EDIT_REPLACE:
+      do {
+        spos++;
+        dpos++;
+        i--;
+        o++;
+      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
+      break;
+
+      case LEV_EDIT_DELETE:
+      do {
+        spos++;
+        i--;
+        o++;
+      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
+      break;
+
+      case LEV_EDIT_INSERT:
+      do {
+        dpos++;
+        i--;
+        o++;
+      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
+      break;
+
+      default:
+      break;
+    }
+    b->type = type;
+    b->send = spos;
+    b->dend = dpos;
+    b++;
+  }
+  if (spos < len1 || dpos < len2) {
+    assert(len1 - spos == len2 - dpos);
+    b->type = LEV_EDIT_KEEP;
+    b->sbeg = spos;
+    b->dbeg = dpos;
+    b->send = len1;
+    b->dend = len2;
+    b++;
+  }
+  assert((size_t)(b - bops) == nbl);
+
+  *nb = nbl;
+  return bops;
+}
+
+/**
+ * lev_opcodes_apply:
+ * @len1: The length of the source string.
+ * @string1: A string of length @len1, may contain NUL characters.
+ * @len2: The length of the destination string.
+ * @string2: A string of length @len2, may contain NUL characters.
+ * @nb: The length of @bops.
+ * @bops: An array of difflib block edit operation codes.
+ * @len: Where the size of the resulting string should be stored.
+ *
+ * Applies a sequence of difflib block operations to a string.
+ *
+ * NB: @bops is not checked for applicability.
+ *
+ * Returns: The result of the edit as a newly allocated string, its length
+ *          is stored in @len.
+ **/
+lev_byte*
+lev_opcodes_apply(size_t len1, const lev_byte *string1,
+                  size_t len2, const lev_byte *string2,
+                  size_t nb, const LevOpCode *bops,
+                  size_t *len)
+{
+  lev_byte *dst, *dpos;  /* destination string */
+  const lev_byte *spos;  /* source string position */
+  size_t i;
+
+  /* this looks too complex for such a simple task, but note ops is not
+   * a complete edit sequence, we have to be able to apply anything anywhere */
+  dpos = dst = (lev_byte*)safe_malloc((len1 + len2), sizeof(lev_byte));
+  if (!dst) {
+    *len = (size_t)(-1);
+    return NULL;
+  }
+  spos = string1;
+  for (i = nb; i; i--, bops++) {
+    switch (bops->type) {
+      case LEV_EDIT_INSERT:
+      case LEV_EDIT_REPLACE:
+      memcpy(dpos, string2 + bops->dbeg,
+             (bops->dend - bops->dbeg)*sizeof(lev_byte));
+      break;
+
+      case LEV_EDIT_KEEP:
+      memcpy(dpos, string1 + bops->sbeg,
+             (bops->send - bops->sbeg)*sizeof(lev_byte));
+      break;
+
+      default:
+      break;
+    }
+    spos += bops->send - bops->sbeg;
+    dpos += bops->dend - bops->dbeg;
+  }
+
+  *len = (size_t)(dpos - dst);
+  /* possible realloc failure is detected with *len != 0 */
+  return (lev_byte*)realloc(dst, *len*sizeof(lev_byte));
+}
+
+/**
+ * lev_u_opcodes_apply:
+ * @len1: The length of the source string.
+ * @string1: A string of length @len1, may contain NUL characters.
+ * @len2: The length of the destination string.
+ * @string2: A string of length @len2, may contain NUL characters.
+ * @nb: The length of @bops.
+ * @bops: An array of difflib block edit operation codes.
+ * @len: Where the size of the resulting string should be stored.
+ *
+ * Applies a sequence of difflib block operations to a string.
+ *
+ * NB: @bops is not checked for applicability.
+ *
+ * Returns: The result of the edit as a newly allocated string, its length
+ *          is stored in @len.
+ **/
+lev_wchar*
+lev_u_opcodes_apply(size_t len1, const lev_wchar *string1,
+                    size_t len2, const lev_wchar *string2,
+                    size_t nb, const LevOpCode *bops,
+                    size_t *len)
+{
+  lev_wchar *dst, *dpos;  /* destination string */
+  const lev_wchar *spos;  /* source string position */
+  size_t i;
+
+  /* this looks too complex for such a simple task, but note ops is not
+   * a complete edit sequence, we have to be able to apply anything anywhere */
+  dpos = dst = (lev_wchar*)safe_malloc((len1 + len2), sizeof(lev_wchar));
+  if (!dst) {
+    *len = (size_t)(-1);
     return NULL;
   }
-  mediandist[0] = 0.0;
-  for (i = 0; i < n; i++)
-    mediandist[0] += (double)lengths[i]*weights[i];
+  spos = string1;
+  for (i = nb; i; i--, bops++) {
+    switch (bops->type) {
+      case LEV_EDIT_INSERT:
+      case LEV_EDIT_REPLACE:
+      memcpy(dpos, string2 + bops->dbeg,
+             (bops->dend - bops->dbeg)*sizeof(lev_wchar));
+      break;
 
-  /* build up the approximate median string symbol by symbol
-   * XXX: we actually exit on break below, but on the same condition */
-  for (len = 1; len <= stoplen; len++) {
-    lev_byte symbol;
-    double minminsum = LEV_INFINITY;
-    row[0] = len;
-    /* iterate over all symbols we may want to add */
-    for (j = 0; j < symlistlen; j++) {
-      double totaldist = 0.0;
-      double minsum = 0.0;
-      symbol = symlist[j];
-      /* sum Levenshtein distances from all the strings, with given weights */
-      for (i = 0; i < n; i++) {
-        const lev_byte *stri = strings[i];
-        size_t *p = rows[i];
-        size_t leni = lengths[i];
-        size_t *end = rows[i] + leni;
-        size_t min = len;
-        size_t x = len; /* == row[0] */
-        /* compute how another row of Levenshtein matrix would look for median
-         * string with this symbol added */
-        while (p < end) {
-          size_t D = *(p++) + (symbol != *(stri++));
-          x++;
-          if (x > D)
-            x = D;
-          if (x > *p + 1)
-            x = *p + 1;
-          if (x < min)
-            min = x;
-        }
-        minsum += (double)min*weights[i];
-        totaldist += (double)x*weights[i];
-      }
-      /* is this symbol better than all the others? */
-      if (minsum < minminsum) {
-        minminsum = minsum;
-        mediandist[len] = totaldist;
-        median[len - 1] = symbol;
-      }
+      case LEV_EDIT_KEEP:
+      memcpy(dpos, string1 + bops->sbeg,
+             (bops->send - bops->sbeg)*sizeof(lev_wchar));
+      break;
+
+      default:
+      break;
     }
-    /* stop the iteration if we no longer need to recompute the matrix rows
-     * or when we are over maxlen and adding more characters doesn't seem
-     * useful */
-    if (len == stoplen
-        || (len > maxlen && mediandist[len] > mediandist[len - 1])) {
-      stoplen = len;
+    spos += bops->send - bops->sbeg;
+    dpos += bops->dend - bops->dbeg;
+  }
+
+  *len = (size_t)(dpos - dst);
+  /* possible realloc failure is detected with *len != 0 */
+  return (lev_wchar*)realloc(dst, *len*sizeof(lev_wchar));
+}
+
+/**
+ * lev_opcodes_invert:
+ * @nb: The length of @ops.
+ * @bops: An array of difflib block edit operation codes.
+ *
+ * Inverts the sense of @ops.  It is modified in place.
+ *
+ * In other words, @ops becomes a partial edit for the original source
+ * and destination strings with their roles exchanged.
+ **/
+void
+lev_opcodes_invert(size_t nb, LevOpCode *bops)
+{
+  size_t i;
+
+  for (i = nb; i; i--, bops++) {
+    size_t z;
+
+    z = bops->dbeg;
+    bops->dbeg = bops->sbeg;
+    bops->sbeg = z;
+    z = bops->dend;
+    bops->dend = bops->send;
+    bops->send = z;
+    if (bops->type & 2)
+      bops->type = (LevEditType)(bops->type ^ 1);
+  }
+}
+
+/**
+ * lev_editops_matching_blocks:
+ * @len1: The length of the source string.
+ * @len2: The length of the destination string.
+ * @n: The size of @ops.
+ * @ops: An array of elementary edit operations.
+ * @nmblocks: Where the number of matching block should be stored.
+ *
+ * Computes the matching block corresponding to an optimal edit @ops.
+ *
+ * Returns: The matching blocks as a newly allocated array, it length is
+ *          stored in @nmblocks.
+ **/
+LevMatchingBlock*
+lev_editops_matching_blocks(size_t len1,
+                            size_t len2,
+                            size_t n,
+                            const LevEditOp *ops,
+                            size_t *nmblocks)
+{
+  size_t nmb, i, spos, dpos;
+  LevEditType type;
+  const LevEditOp *o;
+  LevMatchingBlock *mblocks, *mb;
+
+  /* compute the number of matching blocks */
+  nmb = 0;
+  o = ops;
+  spos = dpos = 0;
+  type = LEV_EDIT_KEEP;
+  for (i = n; i; ) {
+    /* simply pretend there are no keep blocks */
+    while (o->type == LEV_EDIT_KEEP && --i)
+      o++;
+    if (!i)
       break;
+    if (spos < o->spos || dpos < o->dpos) {
+      nmb++;
+      spos = o->spos;
+      dpos = o->dpos;
     }
-    /* now the best symbol is known, so recompute all matrix rows for this
-     * one */
-    symbol = median[len - 1];
-    for (i = 0; i < n; i++) {
-      const lev_byte *stri = strings[i];
-      size_t *oldrow = rows[i];
-      size_t leni = lengths[i];
-      size_t k;
-      /* compute a row of Levenshtein matrix */
-      for (k = 1; k <= leni; k++) {
-        size_t c1 = oldrow[k] + 1;
-        size_t c2 = row[k - 1] + 1;
-        size_t c3 = oldrow[k - 1] + (symbol != stri[k - 1]);
-        row[k] = c2 > c3 ? c3 : c2;
-        if (row[k] > c1)
-          row[k] = c1;
-      }
-      memcpy(oldrow, row, (leni + 1)*sizeof(size_t));
+    type = o->type;
+    switch (type) {
+      case LEV_EDIT_REPLACE:
+      do {
+        spos++;
+        dpos++;
+        i--;
+        o++;
+      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
+      break;
+
+      case LEV_EDIT_DELETE:
+      do {
+        spos++;
+        i--;
+        o++;
+      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
+      break;
+
+      case LEV_EDIT_INSERT:
+      do {
+        dpos++;
+        i--;
+        o++;
+      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
+      break;
+
+      default:
+      break;
     }
   }
+  if (spos < len1 || dpos < len2)
+    nmb++;
 
-  /* find the string with minimum total distance */
-  bestlen = 0;
-  for (len = 1; len <= stoplen; len++) {
-    if (mediandist[len] < mediandist[bestlen])
-      bestlen = len;
+  /* fill the info */
+  mb = mblocks = (LevMatchingBlock*)safe_malloc(nmb, sizeof(LevMatchingBlock));
+  if (!mblocks) {
+    *nmblocks = (size_t)(-1);
+    return NULL;
   }
+  o = ops;
+  spos = dpos = 0;
+  type = LEV_EDIT_KEEP;
+  for (i = n; i; ) {
+    /* simply pretend there are no keep blocks */
+    while (o->type == LEV_EDIT_KEEP && --i)
+      o++;
+    if (!i)
+      break;
+    if (spos < o->spos || dpos < o->dpos) {
+      mb->spos = spos;
+      mb->dpos = dpos;
+      mb->len = o->spos - spos;
+      spos = o->spos;
+      dpos = o->dpos;
+      mb++;
+    }
+    type = o->type;
+    switch (type) {
+      case LEV_EDIT_REPLACE:
+      do {
+        spos++;
+        dpos++;
+        i--;
+        o++;
+      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
+      break;
 
-  /* clean up */
-  for (i = 0; i < n; i++)
-    free(rows[i]);
-  free(rows);
-  free(row);
-  free(symlist);
-  free(mediandist);
+      case LEV_EDIT_DELETE:
+      do {
+        spos++;
+        i--;
+        o++;
+      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
+      break;
+
+      case LEV_EDIT_INSERT:
+      do {
+        dpos++;
+        i--;
+        o++;
+      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
+      break;
 
-  /* return result */
-  {
-    lev_byte *result = (lev_byte*)safe_malloc(bestlen, sizeof(lev_byte));
-    if (!result) {
-      free(median);
-      return NULL;
+      default:
+      break;
     }
-    memcpy(result, median, bestlen*sizeof(lev_byte));
-    free(median);
-    *medlength = bestlen;
-    return result;
   }
+  if (spos < len1 || dpos < len2) {
+    assert(len1 - spos == len2 - dpos);
+    mb->spos = spos;
+    mb->dpos = dpos;
+    mb->len = len1 - spos;
+    mb++;
+  }
+  assert((size_t)(mb - mblocks) == nmb);
+
+  *nmblocks = nmb;
+  return mblocks;
 }
 
-/*
- * Knowing the distance matrices up to some row, finish the distance
- * computations.
+/**
+ * lev_opcodes_matching_blocks:
+ * @len1: The length of the source string.
+ * @len2: The length of the destination string.
+ * @nb: The size of @bops.
+ * @bops: An array of difflib block edit operation codes.
+ * @nmblocks: Where the number of matching block should be stored.
  *
- * string1, len1 are already shortened.
- */
-static double
-finish_distance_computations(size_t len1, lev_byte *string1,
-                             size_t n, const size_t *lengths,
-                             const lev_byte **strings,
-                             const double *weights, size_t **rows,
-                             size_t *row)
+ * Computes the matching block corresponding to an optimal edit @bops.
+ *
+ * Returns: The matching blocks as a newly allocated array, it length is
+ *          stored in @nmblocks.
+ **/
+LevMatchingBlock*
+lev_opcodes_matching_blocks(size_t len1,
+                            size_t len2,
+                            size_t nb,
+                            const LevOpCode *bops,
+                            size_t *nmblocks)
 {
-  size_t *end;
-  size_t i, j;
-  size_t offset;  /* row[0]; offset + len1 give together real len of string1 */
-  double distsum = 0.0;  /* sum of distances */
-
-  /* catch trivia case */
-  if (len1 == 0) {
-    for (j = 0; j < n; j++)
-      distsum += (double)rows[j][lengths[j]]*weights[j];
-    return distsum;
-  }
-
-  /* iterate through the strings and sum the distances */
-  for (j = 0; j < n; j++) {
-    size_t *rowi = rows[j];  /* current row */
-    size_t leni = lengths[j];  /* current length */
-    size_t len = len1;  /* temporary len1 for suffix stripping */
-    const lev_byte *stringi = strings[j];  /* current string */
-
-    /* strip common suffix (prefix CAN'T be stripped) */
-    while (len && leni && stringi[leni-1] == string1[len-1]) {
-      len--;
-      leni--;
-    }
+  size_t nmb, i;
+  const LevOpCode *b;
+  LevMatchingBlock *mblocks, *mb;
+  LEV_UNUSED(len2);
 
-    /* catch trivial cases */
-    if (len == 0) {
-      distsum += (double)rowi[leni]*weights[j];
-      continue;
-    }
-    offset = rowi[0];
-    if (leni == 0) {
-      distsum += (double)(offset + len)*weights[j];
-      continue;
+  /* compute the number of matching blocks */
+  nmb = 0;
+  b = bops;
+  for (i = nb; i; i--, b++) {
+    if (b->type == LEV_EDIT_KEEP) {
+      nmb++;
+      /* adjacent KEEP blocks -- we never produce it, but... */
+      while (i && b->type == LEV_EDIT_KEEP) {
+        i--;
+        b++;
+      }
+      if (!i)
+        break;
     }
+  }
 
-    /* complete the matrix */
-    memcpy(row, rowi, (leni + 1)*sizeof(size_t));
-    end = row + leni;
-
-    for (i = 1; i <= len; i++) {
-      size_t *p = row + 1;
-      const lev_byte char1 = string1[i - 1];
-      const lev_byte *char2p = stringi;
-      size_t D, x;
-
-      D = x = i + offset;
-      while (p <= end) {
-        size_t c3 = --D + (char1 != *(char2p++));
-        x++;
-        if (x > c3)
-          x = c3;
-        D = *p;
-        D++;
-        if (x > D)
-          x = D;
-        *(p++) = x;
+  /* convert */
+  mb = mblocks = (LevMatchingBlock*)safe_malloc(nmb, sizeof(LevMatchingBlock));
+  if (!mblocks) {
+    *nmblocks = (size_t)(-1);
+    return NULL;
+  }
+  b = bops;
+  for (i = nb; i; i--, b++) {
+    if (b->type == LEV_EDIT_KEEP) {
+      mb->spos = b->sbeg;
+      mb->dpos = b->dbeg;
+      /* adjacent KEEP blocks -- we never produce it, but... */
+      while (i && b->type == LEV_EDIT_KEEP) {
+        i--;
+        b++;
+      }
+      if (!i) {
+        mb->len = len1 - mb->spos;
+        mb++;
+        break;
       }
+      mb->len = b->sbeg - mb->spos;
+      mb++;
     }
-    distsum += weights[j]*(double)(*end);
   }
+  assert((size_t)(mb - mblocks) == nmb);
 
-  return distsum;
+  *nmblocks = nmb;
+  return mblocks;
 }
 
 /**
- * lev_median_improve:
- * @len: The length of @s.
- * @s: The approximate generalized median string to be improved.
- * @n: The size of @lengths, @strings, and @weights.
- * @lengths: The lengths of @strings.
- * @strings: An array of strings, that may contain NUL characters.
- * @weights: The string weights (they behave exactly as multiplicities, though
- *           any positive value is allowed, not just integers).
- * @medlength: Where the new length of the median should be stored.
+ * lev_editops_normalize:
+ * @n: The size of @ops.
+ * @ops: An array of elementary edit operations.
+ * @nnorm: Where to store then length of the normalized array.
  *
- * Tries to make @s a better generalized median string of @strings with
- * small perturbations.
+ * Normalizes a list of edit operations to contain no keep operations.
  *
- * It never returns a string with larger SOD than @s; in the worst case, a
- * string identical to @s is returned.
+ * Note it returns %NULL for an empty array.
  *
- * Returns: The improved generalized median, as a newly allocated string; its
- *          length is stored in @medlength.
+ * Returns: A newly allocated array of normalized edit operations, its length
+ *          is stored to @nnorm.
  **/
-lev_byte*
-lev_median_improve(size_t len, const lev_byte *s,
-                   size_t n, const size_t *lengths,
-                   const lev_byte *strings[],
-                   const double *weights,
-                   size_t *medlength)
+LevEditOp*
+lev_editops_normalize(size_t n,
+                      const LevEditOp *ops,
+                      size_t *nnorm)
 {
-  size_t i;  /* usually iterates over strings (n) */
-  size_t j;  /* usually iterates over characters */
-  size_t pos;  /* the position in the approximate median string we are
-                  trying to change */
-  lev_byte *symlist;  /* list of symbols present in the strings,
-                              we iterate over it insead of set of all
-                              existing symbols */
-  size_t symlistlen;  /* length of symlist */
-  size_t maxlen;  /* maximum input string length */
-  size_t stoplen;  /* maximum tried median string length -- this is slightly
-                      higher than maxlen, because the median string may be
-                      longer than any of the input strings */
-  size_t **rows;  /* Levenshtein matrix rows for each string, we need to keep
-                     only one previous row to construct the current one */
-  size_t *row;  /* a scratch buffer for new Levenshtein matrix row computation,
-                   shared among all strings */
-  lev_byte *median;  /* the resulting approximate median string */
-  size_t medlen;  /* the current approximate median string length */
-  double minminsum;  /* the current total distance sum */
-
-  /* find all symbols */
-  symlist = make_symlist(n, lengths, strings, &symlistlen);
-  if (!symlist) {
-    *medlength = 0;
-    if (symlistlen != 0)
-      return NULL;
-    else
-      return (lev_byte*)calloc(1, sizeof(lev_byte));
-  }
+  size_t nx, i;
+  const LevEditOp *o;
+  LevEditOp *opsnorm, *on;
 
-  /* allocate and initialize per-string matrix rows and a common work buffer */
-  rows = (size_t**)safe_malloc(n, sizeof(size_t*));
-  if (!rows) {
-    free(symlist);
-    return NULL;
-  }
-  maxlen = 0;
-  for (i = 0; i < n; i++) {
-    size_t *ri;
-    size_t leni = lengths[i];
-    if (leni > maxlen)
-      maxlen = leni;
-    ri = rows[i] = (size_t*)safe_malloc((leni + 1), sizeof(size_t));
-    if (!ri) {
-      for (j = 0; j < i; j++)
-        free(rows[j]);
-      free(rows);
-      free(symlist);
-      return NULL;
-    }
-    for (j = 0; j <= leni; j++)
-      ri[j] = j;
-  }
-  stoplen = 2*maxlen + 1;
-  row = (size_t*)safe_malloc((stoplen + 2), sizeof(size_t));
-  if (!row) {
-    for (j = 0; j < n; j++)
-      free(rows[j]);
-    free(rows);
-    free(symlist);
+  if (!n || !ops) {
+    *nnorm = 0;
     return NULL;
   }
 
-  /* initialize median to given string */
-  median = (lev_byte*)safe_malloc((stoplen+1), sizeof(lev_byte));
-  if (!median) {
-    for (j = 0; j < n; j++)
-      free(rows[j]);
-    free(rows);
-    free(row);
-    free(symlist);
+  nx = 0;
+  o = ops;
+  for (i = n; i; i--, o++)
+    nx += (o->type == LEV_EDIT_KEEP);
+
+  *nnorm = n - nx;
+  if (!*nnorm)
     return NULL;
+
+  opsnorm = on = (LevEditOp*)safe_malloc((n - nx), sizeof(LevEditOp));
+  o = ops;
+  for (i = n; i; i--, o++) {
+    if (o->type == LEV_EDIT_KEEP)
+      continue;
+    memcpy(on++, o, sizeof(LevEditOp));
   }
-  median++;  /* we need -1st element for insertions a pos 0 */
-  medlen = len;
-  memcpy(median, s, (medlen)*sizeof(lev_byte));
-  minminsum = finish_distance_computations(medlen, median,
-                                           n, lengths, strings,
-                                           weights, rows, row);
 
-  /* sequentially try perturbations on all positions */
-  for (pos = 0; pos <= medlen; ) {
-    lev_byte orig_symbol, symbol;
-    LevEditType operation;
-    double sum;
-
-    symbol = median[pos];
-    operation = LEV_EDIT_KEEP;
-    /* IF pos < medlength: FOREACH symbol: try to replace the symbol
-     * at pos, if some lower the total distance, chooste the best */
-    if (pos < medlen) {
-      orig_symbol = median[pos];
-      for (j = 0; j < symlistlen; j++) {
-        if (symlist[j] == orig_symbol)
-          continue;
-        median[pos] = symlist[j];
-        sum = finish_distance_computations(medlen - pos, median + pos,
-                                           n, lengths, strings,
-                                           weights, rows, row);
-        if (sum < minminsum) {
-          minminsum = sum;
-          symbol = symlist[j];
-          operation = LEV_EDIT_REPLACE;
-        }
-      }
-      median[pos] = orig_symbol;
-    }
-    /* FOREACH symbol: try to add it at pos, if some lower the total
-     * distance, chooste the best (increase medlength)
-     * We simulate insertion by replacing the character at pos-1 */
-    orig_symbol = *(median + pos - 1);
-    for (j = 0; j < symlistlen; j++) {
-      *(median + pos - 1) = symlist[j];
-      sum = finish_distance_computations(medlen - pos + 1, median + pos - 1,
-                                          n, lengths, strings,
-                                         weights, rows, row);
-      if (sum < minminsum) {
-        minminsum = sum;
-        symbol = symlist[j];
-        operation = LEV_EDIT_INSERT;
-      }
+  return opsnorm;
+}
+
+/**
+ * lev_editops_subtract:
+ * @n: The size of @ops.
+ * @ops: An array of elementary edit operations.
+ * @ns: The size of @sub.
+ * @sub: A subsequence (ordered subset) of @ops
+ * @nrem: Where to store then length of the remainder array.
+ *
+ * Subtracts a subsequence of elementary edit operations from a sequence.
+ *
+ * The remainder is a sequence that, applied to result of application of @sub,
+ * gives the same final result as application of @ops to original string.
+ *
+ * Returns: A newly allocated array of normalized edit operations, its length
+ *          is stored to @nrem.  It is always normalized, i.e, without any
+ *          keep operations.  On failure, %NULL is returned.
+ **/
+LevEditOp*
+lev_editops_subtract(size_t n,
+                     const LevEditOp *ops,
+                     size_t ns,
+                     const LevEditOp *sub,
+                     size_t *nrem)
+{
+    static const int shifts[] = { 0, 0, 1, -1 };
+    LevEditOp *rem;
+    size_t i, j, nr, nn;
+    int shift;
+
+    /* compute remainder size */
+    *nrem = (size_t)-1;
+    nr = nn = 0;
+    for (i = 0; i < n; i++) {
+        if (ops[i].type != LEV_EDIT_KEEP)
+            nr++;
     }
-    *(median + pos - 1) = orig_symbol;
-    /* IF pos < medlength: try to delete the symbol at pos, if it lowers
-     * the total distance remember it (decrease medlength) */
-    if (pos < medlen) {
-      sum = finish_distance_computations(medlen - pos - 1, median + pos + 1,
-                                         n, lengths, strings,
-                                         weights, rows, row);
-      if (sum < minminsum) {
-        minminsum = sum;
-        operation = LEV_EDIT_DELETE;
-      }
+    for (i = 0; i < ns; i++) {
+        if (sub[i].type != LEV_EDIT_KEEP)
+            nn++;
     }
-    /* actually perform the operation */
-    switch (operation) {
-      case LEV_EDIT_REPLACE:
-      median[pos] = symbol;
-      break;
-
-      case LEV_EDIT_INSERT:
-      memmove(median+pos+1, median+pos,
-              (medlen - pos)*sizeof(lev_byte));
-      median[pos] = symbol;
-      medlen++;
-      break;
+    if (nn > nr)
+        return NULL;
+    nr -= nn;
 
-      case LEV_EDIT_DELETE:
-      memmove(median+pos, median + pos+1,
-              (medlen - pos-1)*sizeof(lev_byte));
-      medlen--;
-      break;
+    /* subtract */
+    /* we could simply return NULL when nr == 0, but then it would be possible
+     * to subtract *any* sequence of the right length to get an empty sequence
+     * -- clrealy incorrectly; so we have to scan the list to check */
+    rem = nr ? (LevEditOp*)safe_malloc(nr, sizeof(LevEditOp)) : NULL;
+    j = nn = 0;
+    shift = 0;
+    for (i = 0; i < ns; i++) {
+        while ((ops[j].spos != sub[i].spos
+                || ops[j].dpos != sub[i].dpos
+                || ops[j].type != sub[i].type)
+               && j < n) {
+            if (ops[j].type != LEV_EDIT_KEEP) {
+                rem[nn] = ops[j];
+                rem[nn].spos = (size_t)((int)rem[nn].spos + shift);
+                nn++;
+            }
+            j++;
+        }
+        if (j == n) {
+            free(rem);
+            return NULL;
+        }
 
-      default:
-      break;
+        shift += shifts[sub[i].type];
+        j++;
     }
-    assert(medlen <= stoplen);
-    /* now the result is known, so recompute all matrix rows and move on */
-    if (operation != LEV_EDIT_DELETE) {
-      symbol = median[pos];
-      row[0] = pos + 1;
-      for (i = 0; i < n; i++) {
-        const lev_byte *stri = strings[i];
-        size_t *oldrow = rows[i];
-        size_t leni = lengths[i];
-        size_t k;
-        /* compute a row of Levenshtein matrix */
-        for (k = 1; k <= leni; k++) {
-          size_t c1 = oldrow[k] + 1;
-          size_t c2 = row[k - 1] + 1;
-          size_t c3 = oldrow[k - 1] + (symbol != stri[k - 1]);
-          row[k] = c2 > c3 ? c3 : c2;
-          if (row[k] > c1)
-            row[k] = c1;
+
+    while (j < n) {
+        if (ops[j].type != LEV_EDIT_KEEP) {
+            rem[nn] = ops[j];
+            rem[nn].spos = (size_t)((int)rem[nn].spos + shift);
+            nn++;
         }
-        memcpy(oldrow, row, (leni + 1)*sizeof(size_t));
-      }
-      pos++;
+        j++;
     }
-  }
+    assert(nn == nr);
 
-  /* clean up */
-  for (i = 0; i < n; i++)
-    free(rows[i]);
-  free(rows);
-  free(row);
-  free(symlist);
+    *nrem = nr;
+    return rem;
+}
+/* }}} */
 
-  /* return result */
-  {
-    lev_byte *result = (lev_byte*)safe_malloc(medlen, sizeof(lev_byte));
-    if (!result) {
-      median--;
-      free(median);
-      return NULL;
+/****************************************************************************
+ *
+ * Edit runs
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/* A run stands for count consecutive elementary edit operations of the same
+ * type, each one character further along the strings than the previous.
+ * Replace and keep runs advance in both strings, insert runs only in the
+ * destination and delete runs only in the source.  So long blocks cost one
+ * record instead of one per character and the functions below work on them
+ * directly, without ever expanding them. */
+
+#define RUN_SSTEP(type) ((size_t)((type) != LEV_EDIT_INSERT))
+#define RUN_DSTEP(type) ((size_t)((type) != LEV_EDIT_DELETE))
+
+/* append count operations of given type at given position to runs, tail
+ * points after the last run; it's merged with the last run if it continues
+ * it.  Returns the new tail. */
+static LevEditRun*
+run_append(LevEditRun *runs, LevEditRun *tail,
+           LevEditType type, size_t spos, size_t dpos, size_t count)
+{
+  if (!count)
+    return tail;
+  if (tail > runs) {
+    LevEditRun *r = tail - 1;
+    if (r->type == type
+        && r->spos + RUN_SSTEP(type)*r->count == spos
+        && r->dpos + RUN_DSTEP(type)*r->count == dpos) {
+      r->count += count;
+      return tail;
     }
-    *medlength = medlen;
-    memcpy(result, median, medlen*sizeof(lev_byte));
-    median--;
-    free(median);
-    return result;
   }
+  tail->type = type;
+  tail->spos = spos;
+  tail->dpos = dpos;
+  tail->count = count;
+  return tail + 1;
 }
 
-/* used internally in make_usymlist */
-typedef struct _HItem HItem;
-struct _HItem {
-  lev_wchar c;
-  HItem *n;
-};
-
-/* free usmylist hash
- * this is a separate function because we need it in more than one place */
-static void
-free_usymlist_hash(HItem *symmap)
+/* shrink a run array allocated for more runs, an empty array is freed */
+static LevEditRun*
+run_shrink(LevEditRun *runs, LevEditRun *tail, size_t *nr)
 {
-  size_t j;
+  LevEditRun *shrunk;
 
-  for (j = 0; j < 0x100; j++) {
-    HItem *p = symmap + j;
-    if (p->n == symmap || p->n == NULL)
-      continue;
-    p = p->n;
-    while (p) {
-      HItem *q = p;
-      p = p->n;
-      free(q);
-    }
+  *nr = (size_t)(tail - runs);
+  if (!*nr) {
+    free(runs);
+    return NULL;
   }
-  free(symmap);
+  shrunk = (LevEditRun*)realloc(runs, *nr*sizeof(LevEditRun));
+  return shrunk ? shrunk : runs;
 }
 
-/* compute the sets of symbols each string contains, and the set of symbols
- * in any of them (symset).  meanwhile, count how many different symbols
- * there are (used below for symlist). */
-static lev_wchar*
-make_usymlist(size_t n, const size_t *lengths,
-              const lev_wchar *strings[], size_t *symlistlen)
+/**
+ * lev_editops_to_runs:
+ * @n: The size of @ops.
+ * @ops: An array of elementary edit operations.
+ * @nr: Where the number of edit runs should be stored.
+ *
+ * Compresses elementary edit operations to edit runs.
+ *
+ * Keep operations are preserved as keep runs.
+ *
+ * Returns: The edit runs, as a newly allocated array; its length is stored
+ *          in @nr.  On failure, %NULL is returned and @nr set to -1.
+ **/
+LevEditRun*
+lev_editops_to_runs(size_t n, const LevEditOp *ops, size_t *nr)
 {
-  lev_wchar *symlist;
-  size_t i, j;
-  HItem *symmap;
-
-  j = 0;
-  for (i = 0; i < n; i++)
-    j += lengths[i];
+  LevEditRun *runs, *r;
+  size_t i;
 
-  *symlistlen = 0;
-  if (j == 0)
+  *nr = 0;
+  if (!n)
     return NULL;
 
-  /* find all symbols, use a kind of hash for storage */
-  symmap = (HItem*)safe_malloc(0x100, sizeof(HItem));
-  if (!symmap) {
-    *symlistlen = (size_t)(-1);
+  r = runs = (LevEditRun*)safe_malloc(n, sizeof(LevEditRun));
+  if (!runs) {
+    *nr = (size_t)(-1);
     return NULL;
-  }
-  /* this is an ugly memory allocation avoiding hack: most hash elements
-   * will probably contain none or one symbols only so, when p->n is equal
-   * to symmap, it means there're no symbols yet, afters insterting the
-   * first one, p->n becomes normally NULL and then it behaves like an
-   * usual singly linked list */
-  for (i = 0; i < 0x100; i++)
-    symmap[i].n = symmap;
-  for (i = 0; i < n; i++) {
-    const lev_wchar *stri = strings[i];
-    for (j = 0; j < lengths[i]; j++) {
-      lev_wchar c = stri[j];
-      int key = ((int)c + ((int)c >> 7)) & 0xff;
-      HItem *p = symmap + key;
-      if (p->n == symmap) {
-        p->c = c;
-        p->n = NULL;
-        (*symlistlen)++;
-        continue;
-      }
-      while (p->c != c && p->n != NULL)
-        p = p->n;
-      if (p->c != c) {
-        p->n = (HItem*)malloc(sizeof(HItem));
-        if (!p->n) {
-          free_usymlist_hash(symmap);
-          *symlistlen = (size_t)(-1);
-          return NULL;
-        }
-        p = p->n;
-        p->n = NULL;
-        p->c = c;
-        (*symlistlen)++;
-      }
-    }
-  }
-  /* create dense symbol table, so we can easily iterate over only characters
-   * present in the strings */
-  {
-    size_t pos = 0;
-    symlist = (lev_wchar*)safe_malloc((*symlistlen), sizeof(lev_wchar));
-    if (!symlist) {
-      free_usymlist_hash(symmap);
-      *symlistlen = (size_t)(-1);
-      return NULL;
-    }
-    for (j = 0; j < 0x100; j++) {
-      HItem *p = symmap + j;
-      while (p != NULL && p->n != symmap) {
-        symlist[pos++] = p->c;
-        p = p->n;
-      }
-    }
-  }
-
-  /* free memory */
-  free_usymlist_hash(symmap);
+  }
+  for (i = n; i; i--, ops++)
+    r = run_append(runs, r, ops->type, ops->spos, ops->dpos, 1);
 
-  return symlist;
+  return run_shrink(runs, r, nr);
 }
 
 /**
- * lev_u_greedy_median:
- * @n: The size of @lengths, @strings, and @weights.
- * @lengths: The lengths of @strings.
- * @strings: An array of strings, that may contain NUL characters.
- * @weights: The string weights (they behave exactly as multiplicities, though
- *           any positive value is allowed, not just integers).
- * @medlength: Where the length of the median should be stored.
- *
- * Finds a generalized median string of @strings using the greedy algorithm.
+ * lev_runs_to_editops:
+ * @nr: The size of @runs.
+ * @runs: An array of edit runs.
+ * @n: Where the number of edit operations should be stored.
+ * @keepkeep: If nonzero, keep operations will be included.  Otherwise the
+ *            result will be normalized, i.e. without any keep operations.
  *
- * Note it's considerably more efficient to give a string with weight 2
- * than to store two identical strings in @strings (with weights 1).
+ * Expands edit runs to elementary edit operations.
  *
- * Returns: The generalized median, as a newly allocated string; its length
- *          is stored in @medlength.
+ * Returns: The edit operations, as a newly allocated array; its size is
+ *          stored in @n.  On failure, %NULL is returned and @n set to -1.
  **/
-lev_wchar*
-lev_u_greedy_median(size_t n, const size_t *lengths,
-                    const lev_wchar *strings[],
-                    const double *weights,
-                    size_t *medlength)
+LevEditOp*
+lev_runs_to_editops(size_t nr, const LevEditRun *runs,
+                    size_t *n, int keepkeep)
 {
-  size_t i;  /* usually iterates over strings (n) */
-  size_t j;  /* usually iterates over characters */
-  size_t len;  /* usually iterates over the approximate median string */
-  lev_wchar *symlist;  /* list of symbols present in the strings,
-                              we iterate over it insead of set of all
-                              existing symbols */
-  size_t symlistlen;  /* length of symlistle */
-  size_t maxlen;  /* maximum input string length */
-  size_t stoplen;  /* maximum tried median string length -- this is slightly
-                      higher than maxlen, because the median string may be
-                      longer than any of the input strings */
-  size_t **rows;  /* Levenshtein matrix rows for each string, we need to keep
-                     only one previous row to construct the current one */
-  size_t *row;  /* a scratch buffer for new Levenshtein matrix row computation,
-                   shared among all strings */
-  lev_wchar *median;  /* the resulting approximate median string */
-  double *mediandist;  /* the total distance of the best median string of
-                          given length.  warning!  mediandist[0] is total
-                          distance for empty string, while median[] itself
-                          is normally zero-based */
-  size_t bestlen;  /* the best approximate median string length */
+  LevEditOp *ops, *o;
+  const LevEditRun *r;
+  size_t i, j;
 
-  /* find all symbols */
-  symlist = make_usymlist(n, lengths, strings, &symlistlen);
-  if (!symlist) {
-    *medlength = 0;
-    if (symlistlen != 0)
-      return NULL;
-    else
-      return (lev_wchar*)calloc(1, sizeof(lev_wchar));
+  *n = 0;
+  r = runs;
+  for (i = nr; i; i--, r++) {
+    if (keepkeep || r->type != LEV_EDIT_KEEP)
+      *n += r->count;
   }
+  if (!*n)
+    return NULL;
 
-  /* allocate and initialize per-string matrix rows and a common work buffer */
-  rows = (size_t**)safe_malloc(n, sizeof(size_t*));
-  if (!rows) {
-    free(symlist);
+  o = ops = (LevEditOp*)safe_malloc(*n, sizeof(LevEditOp));
+  if (!ops) {
+    *n = (size_t)(-1);
     return NULL;
   }
-  maxlen = 0;
-  for (i = 0; i < n; i++) {
-    size_t *ri;
-    size_t leni = lengths[i];
-    if (leni > maxlen)
-      maxlen = leni;
-    ri = rows[i] = (size_t*)safe_malloc((leni + 1), sizeof(size_t));
-    if (!ri) {
-      for (j = 0; j < i; j++)
-        free(rows[j]);
-      free(rows);
-      free(symlist);
-      return NULL;
+  r = runs;
+  for (i = nr; i; i--, r++) {
+    size_t ss = RUN_SSTEP(r->type), ds = RUN_DSTEP(r->type);
+
+    if (!keepkeep && r->type == LEV_EDIT_KEEP)
+      continue;
+    for (j = 0; j < r->count; j++, o++) {
+      o->type = r->type;
+      o->spos = r->spos + ss*j;
+      o->dpos = r->dpos + ds*j;
     }
-    for (j = 0; j <= leni; j++)
-      ri[j] = j;
-  }
-  stoplen = 2*maxlen + 1;
-  row = (size_t*)safe_malloc((stoplen + 1), sizeof(size_t));
-  if (!row) {
-    for (j = 0; j < n; j++)
-      free(rows[j]);
-    free(rows);
-    free(symlist);
-    return NULL;
   }
+  assert((size_t)(o - ops) == *n);
 
-  /* compute final cost of string of length 0 (empty string may be also
-   * a valid answer) */
-  median = (lev_wchar*)safe_malloc(stoplen, sizeof(lev_wchar));
-  if (!median) {
-    for (j = 0; j < n; j++)
-      free(rows[j]);
-    free(rows);
-    free(row);
-    free(symlist);
+  return ops;
+}
+
+/**
+ * lev_opcodes_to_runs:
+ * @nb: The length of @bops.
+ * @bops: An array of difflib block edit operation codes.
+ * @nr: Where the number of edit runs should be stored.
+ * @keepkeep: If nonzero, keep runs will be included.  Otherwise the
+ *            result will be normalized, i.e. without any keep runs.
+ *
+ * Converts difflib block operation codes to edit runs.
+ *
+ * The result is the same as lev_editops_to_runs() of
+ * lev_opcodes_to_editops() output, but each block is converted at once.
+ *
+ * Returns: The edit runs, as a newly allocated array; its length is stored
+ *          in @nr.  On failure, %NULL is returned and @nr set to -1.
+ **/
+LevEditRun*
+lev_opcodes_to_runs(size_t nb, const LevOpCode *bops,
+                    size_t *nr, int keepkeep)
+{
+  LevEditRun *runs, *r;
+  size_t i;
+
+  *nr = 0;
+  if (!nb)
     return NULL;
-  }
-  mediandist = (double*)safe_malloc((stoplen + 1), sizeof(double));
-  if (!mediandist) {
-    for (j = 0; j < n; j++)
-      free(rows[j]);
-    free(rows);
-    free(row);
-    free(symlist);
-    free(median);
+
+  r = runs = (LevEditRun*)safe_malloc(nb, sizeof(LevEditRun));
+  if (!runs) {
+    *nr = (size_t)(-1);
     return NULL;
   }
-  mediandist[0] = 0.0;
-  for (i = 0; i < n; i++)
-    mediandist[0] += (double)lengths[i] * weights[i];
+  for (i = nb; i; i--, bops++) {
+    size_t sd = bops->send - bops->sbeg;
+    size_t dd = bops->dend - bops->dbeg;
 
-  /* build up the approximate median string symbol by symbol
-   * XXX: we actually exit on break below, but on the same condition */
-  for (len = 1; len <= stoplen; len++) {
-    lev_wchar symbol;
-    double minminsum = LEV_INFINITY;
-    row[0] = len;
-    /* iterate over all symbols we may want to add */
-    for (j = 0; j < symlistlen; j++) {
-      double totaldist = 0.0;
-      double minsum = 0.0;
-      symbol = symlist[j];
-      /* sum Levenshtein distances from all the strings, with given weights */
-      for (i = 0; i < n; i++) {
-        const lev_wchar *stri = strings[i];
-        size_t *p = rows[i];
-        size_t leni = lengths[i];
-        size_t *end = rows[i] + leni;
-        size_t min = len;
-        size_t x = len; /* == row[0] */
-        /* compute how another row of Levenshtein matrix would look for median
-         * string with this symbol added */
-        while (p < end) {
-          size_t D = *(p++) + (symbol != *(stri++));
-          x++;
-          if (x > D)
-            x = D;
-          if (x > *p + 1)
-            x = *p + 1;
-          if (x < min)
-            min = x;
-        }
-        minsum += (double)min * weights[i];
-        totaldist += (double)x * weights[i];
-      }
-      /* is this symbol better than all the others? */
-      if (minsum < minminsum) {
-        minminsum = minsum;
-        mediandist[len] = totaldist;
-        median[len - 1] = symbol;
-      }
-    }
-    /* stop the iteration if we no longer need to recompute the matrix rows
-     * or when we are over maxlen and adding more characters doesn't seem
-     * useful */
-    if (len == stoplen
-        || (len > maxlen && mediandist[len] > mediandist[len - 1])) {
-      stoplen = len;
+    switch (bops->type) {
+      case LEV_EDIT_KEEP:
+      if (keepkeep)
+        r = run_append(runs, r, LEV_EDIT_KEEP, bops->sbeg, bops->dbeg, sd);
+      break;
+
+      case LEV_EDIT_REPLACE:
+      case LEV_EDIT_DELETE:
+      r = run_append(runs, r, bops->type, bops->sbeg, bops->dbeg, sd);
+      break;
+
+      case LEV_EDIT_INSERT:
+      r = run_append(runs, r, LEV_EDIT_INSERT, bops->sbeg, bops->dbeg, dd);
+      break;
+
+      default:
       break;
-    }
-    /* now the best symbol is known, so recompute all matrix rows for this
-     * one */
-    symbol = median[len - 1];
-    for (i = 0; i < n; i++) {
-      const lev_wchar *stri = strings[i];
-      size_t *oldrow = rows[i];
-      size_t leni = lengths[i];
-      size_t k;
-      /* compute a row of Levenshtein matrix */
-      for (k = 1; k <= leni; k++) {
-        size_t c1 = oldrow[k] + 1;
-        size_t c2 = row[k - 1] + 1;
-        size_t c3 = oldrow[k - 1] + (symbol != stri[k - 1]);
-        row[k] = c2 > c3 ? c3 : c2;
-        if (row[k] > c1)
-          row[k] = c1;
-      }
-      memcpy(oldrow, row, (leni + 1)*sizeof(size_t));
     }
   }
 
-  /* find the string with minimum total distance */
-  bestlen = 0;
-  for (len = 1; len <= stoplen; len++) {
-    if (mediandist[len] < mediandist[bestlen])
-      bestlen = len;
-  }
+  return run_shrink(runs, r, nr);
+}
 
-  /* clean up */
-  for (i = 0; i < n; i++)
-    free(rows[i]);
-  free(rows);
-  free(row);
-  free(symlist);
-  free(mediandist);
+/**
+ * lev_runs_to_opcodes:
+ * @nr: The size of @runs.
+ * @runs: An array of edit runs.
+ * @nb: Where the number of difflib block operation codes should be stored.
+ * @len1: The length of the source string.
+ * @len2: The length of the destination string.
+ *
+ * Converts edit runs to difflib block operation codes.
+ *
+ * The result is the same as lev_editops_to_opcodes() of the expanded runs.
+ *
+ * Returns: The converted block operation codes, as a newly allocated array;
+ *          its length is stored in @nb.  On failure, %NULL is returned and
+ *          @nb set to -1.
+ **/
+LevOpCode*
+lev_runs_to_opcodes(size_t nr, const LevEditRun *runs, size_t *nb,
+                    size_t len1, size_t len2)
+{
+  size_t i, spos, dpos;
+  const LevEditRun *r;
+  LevOpCode *bops, *b;
+  LevEditType type;
 
-  /* return result */
-  {
-    lev_wchar *result = (lev_wchar*)safe_malloc(bestlen, sizeof(lev_wchar));
-    if (!result) {
-      free(median);
-      return NULL;
-    }
-    memcpy(result, median, bestlen*sizeof(lev_wchar));
-    free(median);
-    *medlength = bestlen;
-    return result;
+  /* each run gives at most one block plus a keep block before it */
+  b = bops = (LevOpCode*)safe_malloc(2*nr + 1, sizeof(LevOpCode));
+  if (!bops) {
+    *nb = (size_t)(-1);
+    return NULL;
+  }
+  r = runs;
+  spos = dpos = 0;
+  for (i = nr; i; ) {
+    /* simply pretend there are no keep runs */
+    while (r->type == LEV_EDIT_KEEP && --i)
+      r++;
+    if (!i)
+      break;
+    b->sbeg = spos;
+    b->dbeg = dpos;
+    if (spos < r->spos || dpos < r->dpos) {
+      b->type = LEV_EDIT_KEEP;
+      spos = b->send = r->spos;
+      dpos = b->dend = r->dpos;
+      b++;
+      b->sbeg = spos;
+      b->dbeg = dpos;
+    }
+    type = r->type;
+    do {
+      spos += RUN_SSTEP(type)*r->count;
+      dpos += RUN_DSTEP(type)*r->count;
+      i--;
+      r++;
+    } while (i && r->type == type && spos == r->spos && dpos == r->dpos);
+    b->type = type;
+    b->send = spos;
+    b->dend = dpos;
+    b++;
+  }
+  if (spos < len1 || dpos < len2) {
+    assert(len1 - spos == len2 - dpos);
+    b->type = LEV_EDIT_KEEP;
+    b->sbeg = spos;
+    b->dbeg = dpos;
+    b->send = len1;
+    b->dend = len2;
+    b++;
   }
+
+  *nb = (size_t)(b - bops);
+  /* possible realloc failure is detected with *nb != 0 */
+  return (LevOpCode*)realloc(bops, *nb*sizeof(LevOpCode));
 }
 
-/*
- * Knowing the distance matrices up to some row, finish the distance
- * computations.
+/**
+ * lev_runs_check_errors:
+ * @len1: The length of an eventual @runs source string.
+ * @len2: The length of an eventual @runs destination string.
+ * @nr: The length of @runs.
+ * @runs: An array of edit runs.
  *
- * string1, len1 are already shortened.
- */
-static double
-finish_udistance_computations(size_t len1, lev_wchar *string1,
-                             size_t n, const size_t *lengths,
-                             const lev_wchar **strings,
-                             const double *weights, size_t **rows,
-                             size_t *row)
+ * Checks whether @runs is consistent and applicable as a partial edit from a
+ * string of length @len1 to a string of length @len2.
+ *
+ * It accepts exactly the runs whose expansion lev_editops_check_errors()
+ * would accept, and empty runs are an error.
+ *
+ * Returns: Zero if @runs seems OK, a nonzero error code otherwise.
+ **/
+int
+lev_runs_check_errors(size_t len1, size_t len2,
+                      size_t nr, const LevEditRun *runs)
 {
-  size_t *end;
-  size_t i, j;
-  size_t offset;  /* row[0]; offset + len1 give together real len of string1 */
-  double distsum = 0.0;  /* sum of distances */
+  const LevEditRun *r;
+  size_t i;
 
-  /* catch trivia case */
-  if (len1 == 0) {
-    for (j = 0; j < n; j++)
-      distsum += (double)rows[j][lengths[j]] * weights[j];
-    return distsum;
-  }
+  if (!nr)
+    return LEV_EDIT_ERR_OK;
 
-  /* iterate through the strings and sum the distances */
-  for (j = 0; j < n; j++) {
-    size_t *rowi = rows[j];  /* current row */
-    size_t leni = lengths[j];  /* current length */
-    size_t len = len1;  /* temporary len1 for suffix stripping */
-    const lev_wchar *stringi = strings[j];  /* current string */
+  /* check bounds, the last operation of a run is the farthest one */
+  r = runs;
+  for (i = nr; i; i--, r++) {
+    if (r->type >= LEV_EDIT_LAST)
+      return LEV_EDIT_ERR_TYPE;
+    if (!r->count)
+      return LEV_EDIT_ERR_BLOCK;
+    if (r->spos > len1 || r->dpos > len2)
+      return LEV_EDIT_ERR_OUT;
+    if (r->type != LEV_EDIT_INSERT && r->count > len1 - r->spos)
+      return LEV_EDIT_ERR_OUT;
+    if (r->type != LEV_EDIT_DELETE && r->count > len2 - r->dpos)
+      return LEV_EDIT_ERR_OUT;
+  }
 
-    /* strip common suffix (prefix CAN'T be stripped) */
-    while (len && leni && stringi[leni-1] == string1[len-1]) {
-      len--;
-      leni--;
-    }
+  /* check ordering */
+  r = runs + 1;
+  for (i = nr - 1; i; i--, r++, runs++) {
+    if (r->spos < runs->spos + RUN_SSTEP(runs->type)*(runs->count - 1)
+        || r->dpos < runs->dpos + RUN_DSTEP(runs->type)*(runs->count - 1))
+      return LEV_EDIT_ERR_ORDER;
+  }
 
-    /* catch trivial cases */
-    if (len == 0) {
-      distsum += (double)rowi[leni] * weights[j];
-      continue;
-    }
-    offset = rowi[0];
-    if (leni == 0) {
-      distsum += (double)(offset + len) * weights[j];
-      continue;
-    }
+  return LEV_EDIT_ERR_OK;
+}
 
-    /* complete the matrix */
-    memcpy(row, rowi, (leni + 1) * sizeof(size_t));
-    end = row + leni;
+/**
+ * lev_runs_invert:
+ * @nr: The length of @runs.
+ * @runs: An array of edit runs.
+ *
+ * Inverts the sense of @runs.  It is modified in place.
+ *
+ * In other words, @runs becomes a valid partial edit for the original source
+ * and destination strings with their roles exchanged.
+ **/
+void
+lev_runs_invert(size_t nr, LevEditRun *runs)
+{
+  size_t i;
 
-    for (i = 1; i <= len; i++) {
-      size_t *p = row + 1;
-      const lev_wchar char1 = string1[i - 1];
-      const lev_wchar *char2p = stringi;
-      size_t D, x;
+  for (i = nr; i; i--, runs++) {
+    size_t z;
 
-      D = x = i + offset;
-      while (p <= end) {
-        size_t c3 = --D + (char1 != *(char2p++));
-        x++;
-        if (x > c3)
-          x = c3;
-        D = *p;
-        D++;
-        if (x > D)
-          x = D;
-        *(p++) = x;
-      }
-    }
-    distsum += weights[j] * (double)(*end);
+    z = runs->dpos;
+    runs->dpos = runs->spos;
+    runs->spos = z;
+    if (runs->type & 2)
+      runs->type = (LevEditType)(runs->type ^ 1);
   }
-
-  return distsum;
 }
 
 /**
- * lev_u_median_improve:
- * @len: The length of @s.
- * @s: The approximate generalized median string to be improved.
- * @n: The size of @lengths, @strings, and @weights.
- * @lengths: The lengths of @strings.
- * @strings: An array of strings, that may contain NUL characters.
- * @weights: The string weights (they behave exactly as multiplicities, though
- *           any positive value is allowed, not just integers).
- * @medlength: Where the new length of the median should be stored.
+ * lev_runs_apply:
+ * @len1: The length of @string1.
+ * @string1: A string of length @len1, may contain NUL characters.
+ * @len2: The length of @string2.
+ * @string2: A string of length @len2, may contain NUL characters.
+ * @nr: The size of @runs.
+ * @runs: An array of edit runs.
+ * @len: Where the size of the resulting string should be stored.
  *
- * Tries to make @s a better generalized median string of @strings with
- * small perturbations.
+ * Applies a partial edit @runs from @string1 to @string2.
  *
- * It never returns a string with larger SOD than @s; in the worst case, a
- * string identical to @s is returned.
+ * NB: @runs is not checked for applicability.
  *
- * Returns: The improved generalized median, as a newly allocated string; its
- *          length is stored in @medlength.
+ * Returns: The result of the partial edit as a newly allocated string, its
+ *          length is stored in @len.
  **/
-lev_wchar*
-lev_u_median_improve(size_t len, const lev_wchar *s,
-                     size_t n, const size_t *lengths,
-                     const lev_wchar *strings[],
-                     const double *weights,
-                     size_t *medlength)
+lev_byte*
+lev_runs_apply(size_t len1, const lev_byte *string1,
+               size_t len2, const lev_byte *string2,
+               size_t nr, const LevEditRun *runs,
+               size_t *len)
 {
-  size_t i;  /* usually iterates over strings (n) */
-  size_t j;  /* usually iterates over characters */
-  size_t pos;  /* the position in the approximate median string we are
-                  trying to change */
-  lev_wchar *symlist;  /* list of symbols present in the strings,
-                              we iterate over it insead of set of all
-                              existing symbols */
-  size_t symlistlen;  /* length of symlist */
-  size_t maxlen;  /* maximum input string length */
-  size_t stoplen;  /* maximum tried median string length -- this is slightly
-                      higher than maxlen, because the median string may be
-                      longer than any of the input strings */
-  size_t **rows;  /* Levenshtein matrix rows for each string, we need to keep
-                     only one previous row to construct the current one */
-  size_t *row;  /* a scratch buffer for new Levenshtein matrix row computation,
-                   shared among all strings */
-  lev_wchar *median;  /* the resulting approximate median string */
-  size_t medlen;  /* the current approximate median string length */
-  double minminsum;  /* the current total distance sum */
+  lev_byte *dst, *dpos;  /* destination string */
+  const lev_byte *spos;  /* source string position */
+  const LevEditRun *r;
+  size_t i, j, n;
+  LEV_UNUSED(len2);
 
-  /* find all symbols */
-  symlist = make_usymlist(n, lengths, strings, &symlistlen);
-  if (!symlist) {
-    *medlength = 0;
-    if (symlistlen != 0)
-      return NULL;
-    else
-      return (lev_wchar*)calloc(1, sizeof(lev_wchar));
+  n = len1;
+  for (i = nr, r = runs; i; i--, r++) {
+    if (r->type == LEV_EDIT_INSERT || r->type == LEV_EDIT_REPLACE)
+      n += r->count;
   }
-
-  /* allocate and initialize per-string matrix rows and a common work buffer */
-  rows = (size_t**)safe_malloc(n, sizeof(size_t*));
-  if (!rows) {
-    free(symlist);
+  dpos = dst = (lev_byte*)safe_malloc(n, sizeof(lev_byte));
+  if (!dst) {
+    *len = (size_t)(-1);
     return NULL;
   }
-  maxlen = 0;
-  for (i = 0; i < n; i++) {
-    size_t *ri;
-    size_t leni = lengths[i];
-    if (leni > maxlen)
-      maxlen = leni;
-    ri = rows[i] = (size_t*)safe_malloc((leni + 1), sizeof(size_t));
-    if (!ri) {
-      for (j = 0; j < i; j++)
-        free(rows[j]);
-      free(rows);
-      free(symlist);
-      return NULL;
+  spos = string1;
+  for (i = nr; i; i--, runs++) {
+    j = runs->spos - (size_t)(spos - string1)
+        + (runs->type == LEV_EDIT_KEEP ? runs->count : 0);
+    if (j) {
+      memcpy(dpos, spos, j*sizeof(lev_byte));
+      spos += j;
+      dpos += j;
+    }
+    switch (runs->type) {
+    case LEV_EDIT_DELETE:
+      spos += runs->count;
+      break;
+
+    case LEV_EDIT_REPLACE:
+      spos += runs->count;
+      memcpy(dpos, string2 + runs->dpos, runs->count*sizeof(lev_byte));
+      dpos += runs->count;
+      break;
+
+    case LEV_EDIT_INSERT:
+      memcpy(dpos, string2 + runs->dpos, runs->count*sizeof(lev_byte));
+      dpos += runs->count;
+      break;
+
+    default:
+      break;
     }
-    for (j = 0; j <= leni; j++)
-      ri[j] = j;
   }
-  stoplen = 2*maxlen + 1;
-  row = (size_t*)safe_malloc((stoplen + 2), sizeof(size_t));
-  if (!row) {
-    for (j = 0; j < n; j++)
-      free(rows[j]);
-    free(rows);
-    free(symlist);
-    return NULL;
+  j = len1 - (size_t)(spos - string1);
+  if (j) {
+    memcpy(dpos, spos, j*sizeof(lev_byte));
+    spos += j;
+    dpos += j;
   }
 
-  /* initialize median to given string */
-  median = (lev_wchar*)safe_malloc((stoplen+1), sizeof(lev_wchar));
-  if (!median) {
-    for (j = 0; j < n; j++)
-      free(rows[j]);
-    free(rows);
-    free(row);
-    free(symlist);
-    return NULL;
-  }
-  median++;  /* we need -1st element for insertions a pos 0 */
-  medlen = len;
-  memcpy(median, s, (medlen)*sizeof(lev_wchar));
-  minminsum = finish_udistance_computations(medlen, median,
-                                            n, lengths, strings,
-                                            weights, rows, row);
+  *len = (size_t)(dpos - dst);
+  /* possible realloc failure is detected with *len != 0 */
+  return (lev_byte*)realloc(dst, *len*sizeof(lev_byte));
+}
 
-  /* sequentially try perturbations on all positions */
-  for (pos = 0; pos <= medlen; ) {
-    lev_wchar orig_symbol, symbol;
-    LevEditType operation;
-    double sum;
-
-    symbol = median[pos];
-    operation = LEV_EDIT_KEEP;
-    /* IF pos < medlength: FOREACH symbol: try to replace the symbol
-     * at pos, if some lower the total distance, chooste the best */
-    if (pos < medlen) {
-      orig_symbol = median[pos];
-      for (j = 0; j < symlistlen; j++) {
-        if (symlist[j] == orig_symbol)
-          continue;
-        median[pos] = symlist[j];
-        sum = finish_udistance_computations(medlen - pos, median + pos,
-                                            n, lengths, strings,
-                                            weights, rows, row);
-        if (sum < minminsum) {
-          minminsum = sum;
-          symbol = symlist[j];
-          operation = LEV_EDIT_REPLACE;
-        }
-      }
-      median[pos] = orig_symbol;
-    }
-    /* FOREACH symbol: try to add it at pos, if some lower the total
-     * distance, chooste the best (increase medlength)
-     * We simulate insertion by replacing the character at pos-1 */
-    orig_symbol = *(median + pos - 1);
-    for (j = 0; j < symlistlen; j++) {
-      *(median + pos - 1) = symlist[j];
-      sum = finish_udistance_computations(medlen - pos + 1, median + pos - 1,
-                                          n, lengths, strings,
-                                          weights, rows, row);
-      if (sum < minminsum) {
-        minminsum = sum;
-        symbol = symlist[j];
-        operation = LEV_EDIT_INSERT;
-      }
-    }
-    *(median + pos - 1) = orig_symbol;
-    /* IF pos < medlength: try to delete the symbol at pos, if it lowers
-     * the total distance remember it (decrease medlength) */
-    if (pos < medlen) {
-      sum = finish_udistance_computations(medlen - pos - 1, median + pos + 1,
-                                          n, lengths, strings,
-                                          weights, rows, row);
-      if (sum < minminsum) {
-        minminsum = sum;
-        operation = LEV_EDIT_DELETE;
-      }
+/**
+ * lev_u_runs_apply:
+ * @len1: The length of @string1.
+ * @string1: A string of length @len1, may contain NUL characters.
+ * @len2: The length of @string2.
+ * @string2: A string of length @len2, may contain NUL characters.
+ * @nr: The size of @runs.
+ * @runs: An array of edit runs.
+ * @len: Where the size of the resulting string should be stored.
+ *
+ * Applies a partial edit @runs from @string1 to @string2.
+ *
+ * NB: @runs is not checked for applicability.
+ *
+ * Returns: The result of the partial edit as a newly allocated string, its
+ *          length is stored in @len.
+ **/
+lev_wchar*
+lev_u_runs_apply(size_t len1, const lev_wchar *string1,
+                 size_t len2, const lev_wchar *string2,
+                 size_t nr, const LevEditRun *runs,
+                 size_t *len)
+{
+  lev_wchar *dst, *dpos;  /* destination string */
+  const lev_wchar *spos;  /* source string position */
+  const LevEditRun *r;
+  size_t i, j, n;
+  LEV_UNUSED(len2);
+
+  n = len1;
+  for (i = nr, r = runs; i; i--, r++) {
+    if (r->type == LEV_EDIT_INSERT || r->type == LEV_EDIT_REPLACE)
+      n += r->count;
+  }
+  dpos = dst = (lev_wchar*)safe_malloc(n, sizeof(lev_wchar));
+  if (!dst) {
+    *len = (size_t)(-1);
+    return NULL;
+  }
+  spos = string1;
+  for (i = nr; i; i--, runs++) {
+    j = runs->spos - (size_t)(spos - string1)
+        + (runs->type == LEV_EDIT_KEEP ? runs->count : 0);
+    if (j) {
+      memcpy(dpos, spos, j*sizeof(lev_wchar));
+      spos += j;
+      dpos += j;
     }
-    /* actually perform the operation */
-    switch (operation) {
-      case LEV_EDIT_REPLACE:
-      median[pos] = symbol;
+    switch (runs->type) {
+    case LEV_EDIT_DELETE:
+      spos += runs->count;
       break;
 
-      case LEV_EDIT_INSERT:
-      memmove(median+pos+1, median+pos,
-              (medlen - pos)*sizeof(lev_wchar));
-      median[pos] = symbol;
-      medlen++;
+    case LEV_EDIT_REPLACE:
+      spos += runs->count;
+      memcpy(dpos, string2 + runs->dpos, runs->count*sizeof(lev_wchar));
+      dpos += runs->count;
       break;
 
-      case LEV_EDIT_DELETE:
-      memmove(median+pos, median + pos+1,
-              (medlen - pos-1)*sizeof(lev_wchar));
-      medlen--;
+    case LEV_EDIT_INSERT:
+      memcpy(dpos, string2 + runs->dpos, runs->count*sizeof(lev_wchar));
+      dpos += runs->count;
       break;
 
-      default:
+    default:
       break;
     }
-    assert(medlen <= stoplen);
-    /* now the result is known, so recompute all matrix rows and move on */
-    if (operation != LEV_EDIT_DELETE) {
-      symbol = median[pos];
-      row[0] = pos + 1;
-      for (i = 0; i < n; i++) {
-        const lev_wchar *stri = strings[i];
-        size_t *oldrow = rows[i];
-        size_t leni = lengths[i];
-        size_t k;
-        /* compute a row of Levenshtein matrix */
-        for (k = 1; k <= leni; k++) {
-          size_t c1 = oldrow[k] + 1;
-          size_t c2 = row[k - 1] + 1;
-          size_t c3 = oldrow[k - 1] + (symbol != stri[k - 1]);
-          row[k] = c2 > c3 ? c3 : c2;
-          if (row[k] > c1)
-            row[k] = c1;
-        }
-        memcpy(oldrow, row, (leni + 1)*sizeof(size_t));
-      }
-      pos++;
-    }
   }
-
-  /* clean up */
-  for (i = 0; i < n; i++)
-    free(rows[i]);
-  free(rows);
-  free(row);
-  free(symlist);
-
-  /* return result */
-  {
-    lev_wchar *result = (lev_wchar*)safe_malloc(medlen, sizeof(lev_wchar));
-    if (!result) {
-      median--;
-      free(median);
-      return NULL;
-    }
-    *medlength = medlen;
-    memcpy(result, median, medlen*sizeof(lev_wchar));
-    median--;
-    free(median);
-    return result;
+  j = len1 - (size_t)(spos - string1);
+  if (j) {
+    memcpy(dpos, spos, j*sizeof(lev_wchar));
+    spos += j;
+    dpos += j;
   }
+
+  *len = (size_t)(dpos - dst);
+  /* possible realloc failure is detected with *len != 0 */
+  return (lev_wchar*)realloc(dst, *len*sizeof(lev_wchar));
 }
-/* }}} */
 
-/****************************************************************************
+/**
+ * lev_runs_matching_blocks:
+ * @len1: The length of the source string.
+ * @len2: The length of the destination string.
+ * @nr: The size of @runs.
+ * @runs: An array of edit runs.
+ * @nmblocks: Where the number of matching block should be stored.
  *
- * Quick (voting) medians
+ * Computes the matching block corresponding to an optimal edit @runs.
  *
- ****************************************************************************/
-/* {{{ */
-
-/* compute the sets of symbols each string contains, and the set of symbols
- * in any of them (symset).  meanwhile, count how many different symbols
- * there are (used below for symlist).
- * the symset is passed as an argument to avoid its allocation and
- * deallocation when it's used in the caller too */
-static lev_byte*
-make_symlistset(size_t n, const size_t *lengths,
-                const lev_byte *strings[], size_t *symlistlen,
-                double *symset)
+ * Returns: The matching blocks as a newly allocated array, it length is
+ *          stored in @nmblocks.
+ **/
+LevMatchingBlock*
+lev_runs_matching_blocks(size_t len1,
+                         size_t len2,
+                         size_t nr,
+                         const LevEditRun *runs,
+                         size_t *nmblocks)
 {
-  size_t i, j;
-  lev_byte *symlist;
+  size_t i, spos, dpos;
+  LevMatchingBlock *mblocks, *mb;
 
-  if (!symset) {
-    *symlistlen = (size_t)(-1);
+  mb = mblocks = (LevMatchingBlock*)safe_malloc(nr + 1,
+                                                sizeof(LevMatchingBlock));
+  if (!mblocks) {
+    *nmblocks = (size_t)(-1);
     return NULL;
   }
-  memset(symset, 0, 0x100*sizeof(double));  /* XXX: needs IEEE doubles?! */
-  *symlistlen = 0;
-  for (i = 0; i < n; i++) {
-    const lev_byte *stri = strings[i];
-    for (j = 0; j < lengths[i]; j++) {
-      int c = stri[j];
-      if (!symset[c]) {
-        (*symlistlen)++;
-        symset[c] = 1.0;
-      }
+  spos = dpos = 0;
+  for (i = nr; i; i--, runs++) {
+    /* simply pretend there are no keep runs */
+    if (runs->type == LEV_EDIT_KEEP)
+      continue;
+    if (spos < runs->spos || dpos < runs->dpos) {
+      mb->spos = spos;
+      mb->dpos = dpos;
+      mb->len = runs->spos - spos;
+      spos = runs->spos;
+      dpos = runs->dpos;
+      mb++;
     }
+    spos += RUN_SSTEP(runs->type)*runs->count;
+    dpos += RUN_DSTEP(runs->type)*runs->count;
   }
-  if (!*symlistlen)
-    return NULL;
-
-  /* create dense symbol table, so we can easily iterate over only characters
-   * present in the strings */
-  {
-    size_t pos = 0;
-    symlist = (lev_byte*)safe_malloc((*symlistlen), sizeof(lev_byte));
-    if (!symlist) {
-      *symlistlen = (size_t)(-1);
-      return NULL;
-    }
-    for (j = 0; j < 0x100; j++) {
-      if (symset[j])
-        symlist[pos++] = (lev_byte)j;
-    }
+  if (spos < len1 || dpos < len2) {
+    assert(len1 - spos == len2 - dpos);
+    mb->spos = spos;
+    mb->dpos = dpos;
+    mb->len = len1 - spos;
+    mb++;
   }
 
-  return symlist;
+  *nmblocks = (size_t)(mb - mblocks);
+  if (!*nmblocks) {
+    free(mblocks);
+    return NULL;
+  }
+  return mblocks;
 }
 
-lev_byte*
-lev_quick_median(size_t n,
-                 const size_t *lengths,
-                 const lev_byte *strings[],
-                 const double *weights,
-                 size_t *medlength)
+/* find the offset of an operation in a run, i.e. k such that the k-th
+ * operation of run is the given one, or return run->count when there's
+ * no such operation */
+static size_t
+run_find(const LevEditRun *run,
+         LevEditType type, size_t spos, size_t dpos)
 {
-  size_t symlistlen, len, i, j, k;
-  lev_byte *symlist;
-  lev_byte *median;  /* the resulting string */
-  double *symset;
-  double ml, wl;
+  size_t k;
 
-  /* first check whether the result would be an empty string 
-   * and compute resulting string length */
-  ml = wl = 0.0;
-  for (i = 0; i < n; i++) {
-    ml += (double)lengths[i] * weights[i];
-    wl += weights[i];
+  if (run->type != type || spos < run->spos || dpos < run->dpos)
+    return run->count;
+  switch (type) {
+    case LEV_EDIT_INSERT:
+    if (spos != run->spos)
+      return run->count;
+    k = dpos - run->dpos;
+    break;
+
+    case LEV_EDIT_DELETE:
+    if (dpos != run->dpos)
+      return run->count;
+    k = spos - run->spos;
+    break;
+
+    default:
+    if (spos - run->spos != dpos - run->dpos)
+      return run->count;
+    k = spos - run->spos;
+    break;
   }
-  if (wl == 0.0)
-    return (lev_byte*)calloc(1, sizeof(lev_byte));
-  ml = floor(ml/wl + 0.499999);
-  *medlength = len = (size_t)ml;
-  if (!len)
-    return (lev_byte*)calloc(1, sizeof(lev_byte));
-  median = (lev_byte*)safe_malloc(len, sizeof(lev_byte));
-  if (!median)
-    return NULL;
+  return k < run->count ? k : run->count;
+}
 
-  /* find the symbol set;
-   * now an empty symbol set is really a failure */
-  symset = (double*)calloc(0x100, sizeof(double));
-  if (!symset) {
-    free(median);
+/**
+ * lev_runs_subtract:
+ * @nr: The size of @runs.
+ * @runs: An array of edit runs.
+ * @ns: The size of @sub.
+ * @sub: A subsequence (ordered subset) of @runs, as edit runs.
+ * @nrem: Where to store then length of the remainder array.
+ *
+ * Subtracts a subsequence of edit runs from a sequence.
+ *
+ * The result is the same as lev_editops_subtract() of the expanded runs,
+ * but whole runs, or their parts, are subtracted at once.
+ *
+ * Returns: A newly allocated array of normalized edit runs, its length
+ *          is stored to @nrem.  It is always normalized, i.e, without any
+ *          keep runs.  On failure, %NULL is returned and @nrem set to -1.
+ **/
+LevEditRun*
+lev_runs_subtract(size_t nr,
+                  const LevEditRun *runs,
+                  size_t ns,
+                  const LevEditRun *sub,
+                  size_t *nrem)
+{
+  static const int shifts[] = { 0, 0, 1, -1 };
+  LevEditRun *rem, *r;
+  size_t i, j, k, t;
+  size_t shift;  /* modulo arithmetic handles negative shifts */
+
+  /* every run of runs is split at most at each start and end of a matched
+   * part, there are at most nr + ns of them */
+  *nrem = (size_t)(-1);
+  r = rem = (LevEditRun*)safe_malloc(2*nr + ns + 1, sizeof(LevEditRun));
+  if (!rem)
     return NULL;
+
+  j = k = 0;
+  shift = 0;
+  for (i = 0; i < ns; i++) {
+    LevEditType type = sub[i].type;
+    size_t ss = RUN_SSTEP(type), ds = RUN_DSTEP(type);
+
+    for (t = 0; t < sub[i].count; ) {
+      size_t spos = sub[i].spos + ss*t, dpos = sub[i].dpos + ds*t;
+      size_t m, len;
+
+      /* skip to the next occurrence of the t-th operation of sub[i],
+       * moving the skipped non-keep operations to the remainder */
+      while (j < nr) {
+        const LevEditRun *o = runs + j;
+        size_t os = RUN_SSTEP(o->type), od = RUN_DSTEP(o->type);
+
+        m = run_find(o, type, spos, dpos);
+        if (m < k)
+          m = o->count;
+        if (o->type != LEV_EDIT_KEEP)
+          r = run_append(rem, r, o->type, o->spos + os*k + shift,
+                         o->dpos + od*k, m - k);
+        if (m < o->count) {
+          k = m;
+          break;
+        }
+        j++;
+        k = 0;
+      }
+      if (j == nr) {
+        free(rem);
+        return NULL;
+      }
+
+      /* the following operations of both runs match as long as both last */
+      len = sub[i].count - t;
+      if (len > runs[j].count - k)
+        len = runs[j].count - k;
+      shift += (size_t)shifts[type]*len;
+      t += len;
+      k += len;
+      if (k == runs[j].count) {
+        j++;
+        k = 0;
+      }
+    }
   }
-  symlist = make_symlistset(n, lengths, strings, &symlistlen, symset);
-  if (!symlist) {
-    free(median);
-    free(symset);
-    return NULL;
+
+  for (; j < nr; j++, k = 0) {
+    const LevEditRun *o = runs + j;
+
+    if (o->type != LEV_EDIT_KEEP)
+      r = run_append(rem, r, o->type,
+                     o->spos + RUN_SSTEP(o->type)*k + shift,
+                     o->dpos + RUN_DSTEP(o->type)*k, o->count - k);
   }
 
-  for (j = 0; j < len; j++) {
-    /* clear the symbol probabilities */
-    if (symlistlen < 32) {
-      for (i = 0; i < symlistlen; i++)
-        symset[symlist[i]] = 0.0;
-    }
-    else
-      memset(symset, 0, 0x100*sizeof(double));
+  return run_shrink(rem, r, nrem);
+}
+/* }}} */
 
-    /* let all strings vote */
-    for (i = 0; i < n; i++) {
-      const lev_byte *stri = strings[i];
-      double weighti = weights[i];
-      size_t lengthi = lengths[i];
-      double start = (double)lengthi / ml * (double)j;
-      double end = start + (double)lengthi / ml;
-      size_t istart = (size_t)floor(start);
-      size_t iend = (size_t)ceil(end);
+/****************************************************************************
+ *
+ * Incremental opcodes
+ *
+ ****************************************************************************/
+/* {{{ */
 
-      /* rounding errors can overflow the buffer */
-      if (iend > lengthi)
-        iend = lengthi;
+/* The iterator finds exactly the operations of lev_editops_find(), but
+ * without its quadratic cost matrix.  A forward pass keeps only every
+ * it->rows-th row of the matrix (checkpoints).  The matrix blocks between
+ * them are then recomputed from right to left and the path of
+ * editops_from_cost_matrix() traced through each, remembering just where it
+ * enters the block.  These entry points divide the alignment into
+ * independent blocks that are recomputed and traced again, from left to
+ * right, as the operation codes are consumed.  The leftmost block is left
+ * over from the backward pass, so the first codes come right after it.
+ *
+ * When the strings are bytes, or Unicode strings with at most 0x100
+ * different symbols (remapped to bytes), the rows are not kept as numbers
+ * but as bit vectors of their deltas, computed a word at a time like the
+ * small alphabet engine does, and the path is traced through them the
+ * same way; this makes all the passes cheaper by a factor of about the
+ * word size. */
+
+/* cells of a block below which it has more rows than a square root */
+#define LEV_OPITER_CELLS (1 << 16)
+
+struct _LevOpcodeIter {
+  const lev_byte *string1;  /* set for byte strings */
+  const lev_byte *string2;
+  const lev_wchar *ustring1;  /* set for Unicode strings */
+  const lev_wchar *ustring2;
+  size_t len1, len2;  /* the whole strings */
+  size_t off;  /* stripped common prefix */
+  size_t n1, n2;  /* stripped lengths */
+  size_t rows;  /* rows per block */
+  size_t nblocks;
+  size_t block;  /* whose operations are in ops, (size_t)(-1) before any */
+  size_t *checkpoints;  /* the first row of each block */
+  size_t *entries;  /* the column where the path enters each block */
+  int *dirs;  /* and its direction there */
+  size_t *matrix;  /* rows of the current block */
+  lev_byte *mapped;  /* remapped Unicode strings, string1 and string2 then
+                        point into it */
+  size_t words;  /* words of a bit vector row half, zero for numeric rows */
+  uint64_t *masks;  /* match masks of string2, by symbol */
+  uint64_t *vcheckpoints;  /* bit vector rows: VP, then VN */
+  uint64_t *vmatrix;
+  size_t cap;  /* the size of ops */
+  LevEditOp *ops;  /* operations of the current block, at the end of ops */
+  size_t pos;  /* the next one */
+  int finished;  /* all operations were consumed */
+  size_t spos, dpos;  /* where the codes found so far end */
+  LevOpCode pending;  /* the last code, may still grow; type KEEP if none */
+  size_t nready;  /* complete codes to return, at most two */
+  LevOpCode ready[2];
+};
 
-      for (k = istart+1; k < iend; k++)
-        symset[stri[k]] += weighti;
-      symset[stri[istart]] += weighti * ((double)(1 + istart) - start);
-      symset[stri[iend-1]] -= weighti * ((double)iend - end);
-    }
+static LevOpcodeIter*
+opiter_new(size_t len1, size_t len2)
+{
+  LevOpcodeIter *it = (LevOpcodeIter*)calloc(1, sizeof(LevOpcodeIter));
 
-    /* find the elected symbol */
-    k = symlist[0];
-    for (i = 1; i < symlistlen; i++) {
-      if (symset[symlist[i]] > symset[k])
-        k = symlist[i];
-    }
-    median[j] = (lev_byte)k;
+  if (!it)
+    return NULL;
+  it->len1 = len1;
+  it->len2 = len2;
+  it->block = (size_t)(-1);
+  it->pending.type = LEV_EDIT_KEEP;
+  return it;
+}
+
+/* common prefix and suffix are stripped like in lev_editops_find(), the
+ * prefix is a code of its own unless the strings are identical */
+static void
+opiter_strip(LevOpcodeIter *it, size_t off, size_t n1, size_t n2)
+{
+  it->off = off;
+  it->n1 = n1;
+  it->n2 = n2;
+  if (off && (n1 || n2)) {
+    LevOpCode *b = it->ready + it->nready++;
+    it->spos = it->dpos = off;
+    b->type = LEV_EDIT_KEEP;
+    b->sbeg = b->dbeg = 0;
+    b->send = b->dend = off;
   }
+}
 
-  free(symset);
-  free(symlist);
+/**
+ * lev_opcode_iter_new:
+ * @len1: The length of @string1.
+ * @string1: A string of length @len1, may contain NUL characters.
+ * @len2: The length of @string2.
+ * @string2: A string of length @len2, may contain NUL characters.
+ *
+ * Creates an iterator over the difflib block operation codes from @string1
+ * to @string2, they are the same as lev_editops_to_opcodes() of
+ * lev_editops_find(), see lev_opcode_iter_next().
+ *
+ * The strings are not copied, they must exist as long as the iterator.
+ *
+ * Returns: The iterator, or %NULL on failure.
+ **/
+LevOpcodeIter*
+lev_opcode_iter_new(size_t len1, const lev_byte *string1,
+                    size_t len2, const lev_byte *string2)
+{
+  LevOpcodeIter *it = opiter_new(len1, len2);
+  size_t off;
 
-  return median;
+  if (!it)
+    return NULL;
+  off = lev_strip_affixes(&len1, string1, &len2, string2, sizeof(*string1));
+  string1 += off;
+  string2 += off;
+  it->string1 = string1;
+  it->string2 = string2;
+  opiter_strip(it, off, len1, len2);
+  return it;
 }
 
-/* used internally in make_usymlistset */
-typedef struct _HQItem HQItem;
-struct _HQItem {
-  lev_wchar c;
-  double s;
-  HQItem *n;
-};
-
-/* free usmylistset hash
- * this is a separate function because we need it in more than one place */
-static void
-free_usymlistset_hash(HQItem *symmap)
+/**
+ * lev_u_opcode_iter_new:
+ * @len1: The length of @string1.
+ * @string1: A string of length @len1, may contain NUL characters.
+ * @len2: The length of @string2.
+ * @string2: A string of length @len2, may contain NUL characters.
+ *
+ * Creates an iterator over the difflib block operation codes from @string1
+ * to @string2, they are the same as lev_editops_to_opcodes() of
+ * lev_u_editops_find(), see lev_opcode_iter_next().
+ *
+ * The strings are not copied, they must exist as long as the iterator.
+ *
+ * Returns: The iterator, or %NULL on failure.
+ **/
+LevOpcodeIter*
+lev_u_opcode_iter_new(size_t len1, const lev_wchar *string1,
+                      size_t len2, const lev_wchar *string2)
 {
-  size_t j;
+  LevOpcodeIter *it = opiter_new(len1, len2);
+  LevDenseMap map;
+  size_t off;
 
-  for (j = 0; j < 0x100; j++) {
-    HQItem *p = symmap + j;
-    if (p->n == symmap || p->n == NULL)
-      continue;
-    p = p->n;
-    while (p) {
-      HQItem *q = p;
-      p = p->n;
-      free(q);
+  if (!it)
+    return NULL;
+  off = lev_strip_affixes(&len1, string1, &len2, string2, sizeof(*string1));
+  string1 += off;
+  string2 += off;
+  opiter_strip(it, off, len1, len2);
+  if (len1 && len2) {
+    const lev_wchar *strings[2];
+    size_t lengths[2];
+
+    strings[0] = string1;
+    strings[1] = string2;
+    lengths[0] = len1;
+    lengths[1] = len2;
+    if (udensemap_init(&map, 2, lengths, strings, 0, NULL)) {
+      it->mapped = map.buffer;
+      it->string1 = map.strings[0];
+      it->string2 = map.strings[1];
+      free(map.strings);
+      return it;
     }
   }
-  free(symmap);
+  it->ustring1 = string1;
+  it->ustring2 = string2;
+  return it;
 }
 
-/* compute the sets of symbols each string contains, and the set of symbols
- * in any of them (symset).  meanwhile, count how many different symbols
- * there are (used below for symlist).
- * the symset is passed as an argument to avoid its allocation and
- * deallocation when it's used in the caller too */
-static lev_wchar*
-make_usymlistset(size_t n, const size_t *lengths,
-                 const lev_wchar *strings[], size_t *symlistlen,
-                 HQItem *symmap)
+/**
+ * lev_opcode_iter_free:
+ * @it: An iterator created by lev_opcode_iter_new() or
+ *      lev_u_opcode_iter_new(), may be %NULL.
+ *
+ * Frees an iterator.
+ **/
+void
+lev_opcode_iter_free(LevOpcodeIter *it)
 {
-  lev_wchar *symlist;
-  size_t i, j;
+  if (!it)
+    return;
+  free(it->checkpoints);
+  free(it->entries);
+  free(it->dirs);
+  free(it->matrix);
+  free(it->mapped);
+  free(it->masks);
+  free(it->vcheckpoints);
+  free(it->vmatrix);
+  free(it->ops);
+  free(it);
+}
 
-  j = 0;
-  for (i = 0; i < n; i++)
-    j += lengths[i];
+static size_t
+opiter_block_end(const LevOpcodeIter *it, size_t k)
+{
+  size_t r1 = (k + 1)*it->rows;
 
-  *symlistlen = 0;
-  if (j == 0)
-    return NULL;
+  return r1 < it->n1 ? r1 : it->n1;
+}
 
-  /* this is an ugly memory allocation avoiding hack: most hash elements
-   * will probably contain none or one symbols only so, when p->n is equal
-   * to symmap, it means there're no symbols yet, afters insterting the
-   * first one, p->n becomes normally NULL and then it behaves like an
-   * usual singly linked list */
-  for (i = 0; i < 0x100; i++)
-    symmap[i].n = symmap;
-  for (i = 0; i < n; i++) {
-    const lev_wchar *stri = strings[i];
-    for (j = 0; j < lengths[i]; j++) {
-      lev_wchar c = stri[j];
-      int key = ((int)c + ((int)c >> 7)) & 0xff;
-      HQItem *p = symmap + key;
-      if (p->n == symmap) {
-        p->c = c;
-        p->n = NULL;
-        (*symlistlen)++;
-        continue;
+/* compute the rows of block @k from its checkpoint, like lev_editops_find()
+ * does */
+static void
+opiter_fill(LevOpcodeIter *it, size_t k)
+{
+  size_t w = it->n2 + 1;
+  size_t r0 = k*it->rows, r1 = opiter_block_end(it, k);
+  size_t i;
+
+  memcpy(it->matrix, it->checkpoints + k*w, w*sizeof(size_t));
+  for (i = r0 + 1; i <= r1; i++) {
+    size_t *prev = it->matrix + (i - r0 - 1)*w;
+    size_t *p = prev + w;
+    size_t *end = p + w - 1;
+    size_t x = i;
+
+    *(p++) = i;
+    if (it->ustring1) {
+      const lev_wchar char1 = it->ustring1[i - 1];
+      const lev_wchar *char2p = it->ustring2;
+      while (p <= end) {
+        size_t c3 = *(prev++) + (char1 != *(char2p++));
+        x++;
+        if (x > c3)
+          x = c3;
+        c3 = *prev + 1;
+        if (x > c3)
+          x = c3;
+        *(p++) = x;
       }
-      while (p->c != c && p->n != NULL)
-        p = p->n;
-      if (p->c != c) {
-        p->n = (HQItem*)malloc(sizeof(HQItem));
-        if (!p->n) {
-          *symlistlen = (size_t)(-1);
-          return NULL;
-        }
-        p = p->n;
-        p->n = NULL;
-        p->c = c;
-        (*symlistlen)++;
+    }
+    else {
+      const lev_byte char1 = it->string1[i - 1];
+      const lev_byte *char2p = it->string2;
+      while (p <= end) {
+        size_t c3 = *(prev++) + (char1 != *(char2p++));
+        x++;
+        if (x > c3)
+          x = c3;
+        c3 = *prev + 1;
+        if (x > c3)
+          x = c3;
+        *(p++) = x;
       }
     }
   }
-  /* create dense symbol table, so we can easily iterate over only characters
-   * present in the strings */
-  {
-    size_t pos = 0;
-    symlist = (lev_wchar*)safe_malloc((*symlistlen), sizeof(lev_wchar));
-    if (!symlist) {
-      *symlistlen = (size_t)(-1);
-      return NULL;
+}
+
+static int
+opiter_same(const LevOpcodeIter *it, size_t i, size_t j)
+{
+  if (it->ustring1)
+    return it->ustring1[i] == it->ustring2[j];
+  return it->string1[i] == it->string2[j];
+}
+
+/* trace the path of editops_from_cost_matrix() through the filled block @k
+ * from where it enters it, storing the operations at the end of it->ops;
+ * the column and direction where it leaves the block are stored to @j0 and
+ * @dir0 */
+static void
+opiter_trace(LevOpcodeIter *it, size_t k, size_t *j0, int *dir0)
+{
+  size_t w = it->n2 + 1;
+  size_t r0 = k*it->rows;
+  size_t i = opiter_block_end(it, k), j = it->entries[k];
+  size_t *p = it->matrix + (i - r0)*w + j;
+  LevEditOp *o = it->ops + it->cap;
+  int dir = it->dirs[k];
+
+  while (i > r0 || (k == 0 && j)) {
+    /* prefer contiuning in the same direction */
+    if (dir < 0 && j && *p == *(p - 1) + 1) {
+      o--;
+      o->type = LEV_EDIT_INSERT;
+      o->spos = i + it->off;
+      o->dpos = --j + it->off;
+      p--;
+      continue;
     }
-    for (j = 0; j < 0x100; j++) {
-      HQItem *p = symmap + j;
-      while (p != NULL && p->n != symmap) {
-        symlist[pos++] = p->c;
-        p = p->n;
-      }
+    if (dir > 0 && i > r0 && *p == *(p - w) + 1) {
+      o--;
+      o->type = LEV_EDIT_DELETE;
+      o->spos = --i + it->off;
+      o->dpos = j + it->off;
+      p -= w;
+      continue;
+    }
+    if (i > r0 && j && *p == *(p - w - 1) && opiter_same(it, i - 1, j - 1)) {
+      i--;
+      j--;
+      p -= w + 1;
+      dir = 0;
+      continue;
+    }
+    if (i > r0 && j && *p == *(p - w - 1) + 1) {
+      o--;
+      o->type = LEV_EDIT_REPLACE;
+      o->spos = --i + it->off;
+      o->dpos = --j + it->off;
+      p -= w + 1;
+      dir = 0;
+      continue;
+    }
+    if (dir == 0 && j && *p == *(p - 1) + 1) {
+      o--;
+      o->type = LEV_EDIT_INSERT;
+      o->spos = i + it->off;
+      o->dpos = --j + it->off;
+      p--;
+      dir = -1;
+      continue;
+    }
+    if (dir == 0 && i > r0 && *p == *(p - w) + 1) {
+      o--;
+      o->type = LEV_EDIT_DELETE;
+      o->spos = --i + it->off;
+      o->dpos = j + it->off;
+      p -= w;
+      dir = 1;
+      continue;
     }
+    assert("lost in the cost matrix" == NULL);
   }
-
-  return symlist;
+  it->pos = (size_t)(o - it->ops);
+  *j0 = j;
+  *dir0 = dir;
 }
 
-lev_wchar*
-lev_u_quick_median(size_t n,
-                   const size_t *lengths,
-                   const lev_wchar *strings[],
-                   const double *weights,
-                   size_t *medlength)
+/* compute the bit vector rows of block @k from its checkpoint */
+static void
+opiter_vfill(LevOpcodeIter *it, size_t k)
 {
-  size_t symlistlen, len, i, j, k;
-  lev_wchar *symlist;
-  lev_wchar *median;  /* the resulting string */
-  HQItem *symmap;
-  double ml, wl;
+  size_t words = it->words;
+  size_t r0 = k*it->rows, r1 = opiter_block_end(it, k);
+  uint64_t *row = it->vmatrix;
+  size_t i;
 
-  /* first check whether the result would be an empty string 
-   * and compute resulting string length */
-  ml = wl = 0.0;
-  for (i = 0; i < n; i++) {
-    ml += (double)lengths[i] * weights[i];
-    wl += weights[i];
+  memcpy(row, it->vcheckpoints + k*2*words, 2*words*sizeof(uint64_t));
+  for (i = r0 + 1; i <= r1; i++) {
+    memcpy(row + 2*words, row, 2*words*sizeof(uint64_t));
+    row += 2*words;
+    small_myers_step(it->masks + it->string1[i - 1]*words,
+                     row, row + words, words, it->n2);
   }
-  if (wl == 0.0)
-    return (lev_wchar*)calloc(1, sizeof(lev_wchar));
-  ml = floor(ml/wl + 0.499999);
-  *medlength = len = (size_t)ml;
-  if (!len)
-    return (lev_wchar*)calloc(1, sizeof(lev_wchar));
-  median = (lev_wchar*)safe_malloc(len, sizeof(lev_wchar));
-  if (!median)
-    return NULL;
+}
 
-  /* find the symbol set;
-   * now an empty symbol set is really a failure */
-  symmap = (HQItem*)safe_malloc(0x100, sizeof(HQItem));
-  if (!symmap) {
-    free(median);
-    return NULL;
-  }
-  symlist = make_usymlistset(n, lengths, strings, &symlistlen, symmap);
-  if (!symlist) {
-    free(median);
-    free_usymlistset_hash(symmap);
-    return NULL;
-  }
+/* D[i][j] of the filled bit vector block starting at row @r0 */
+static size_t
+opiter_vcost(const LevOpcodeIter *it, size_t r0, size_t i, size_t j)
+{
+  const uint64_t *row = it->vmatrix + (i - r0)*2*it->words;
 
-  for (j = 0; j < len; j++) {
-    /* clear the symbol probabilities */
-    for (i = 0; i < 0x100; i++) {
-      HQItem *p = symmap + i;
-      if (p->n == symmap)
-        continue;
-      while (p) {
-        p->s = 0.0;
-        p = p->n;
-      }
+  return i + small_cost(row, row + it->words, it->words, 1, j) - 1;
+}
+
+/* D[i][j] - D[i][j - 1] of the filled bit vector block starting at @r0 */
+static size_t
+opiter_vdelta(const LevOpcodeIter *it, size_t r0, size_t i, size_t j)
+{
+  const uint64_t *row = it->vmatrix + (i - r0)*2*it->words;
+
+  return small_delta(row, row + it->words, it->words, 1, j);
+}
+
+/* opiter_trace() on the bit vector rows */
+static void
+opiter_vtrace(LevOpcodeIter *it, size_t k, size_t *j0, int *dir0)
+{
+  size_t r0 = k*it->rows;
+  size_t i = opiter_block_end(it, k), j = it->entries[k];
+  size_t cost = opiter_vcost(it, r0, i, j);
+  size_t up = i > r0 ? opiter_vcost(it, r0, i - 1, j) : 0;
+  LevEditOp *o = it->ops + it->cap;
+  int dir = it->dirs[k];
+
+  while (i > r0 || (k == 0 && j)) {
+    size_t left = j ? cost - opiter_vdelta(it, r0, i, j) : 0;
+    size_t diag = i > r0 && j ? up - opiter_vdelta(it, r0, i - 1, j) : 0;
+    /* prefer contiuning in the same direction */
+    if (dir < 0 && j && cost == left + 1) {
+      o--;
+      o->type = LEV_EDIT_INSERT;
+      o->spos = i + it->off;
+      o->dpos = --j + it->off;
+      cost = left;
+      up = diag;
+      continue;
+    }
+    if (dir > 0 && i > r0 && cost == up + 1) {
+      o--;
+      o->type = LEV_EDIT_DELETE;
+      o->spos = --i + it->off;
+      o->dpos = j + it->off;
+      cost = up;
+      up = i > r0 ? opiter_vcost(it, r0, i - 1, j) : 0;
+      continue;
+    }
+    if (i > r0 && j && cost == diag && opiter_same(it, i - 1, j - 1)) {
+      i--;
+      j--;
+      cost = diag;
+      up = i > r0 ? opiter_vcost(it, r0, i - 1, j) : 0;
+      dir = 0;
+      continue;
+    }
+    if (i > r0 && j && cost == diag + 1) {
+      o--;
+      o->type = LEV_EDIT_REPLACE;
+      o->spos = --i + it->off;
+      o->dpos = --j + it->off;
+      cost = diag;
+      up = i > r0 ? opiter_vcost(it, r0, i - 1, j) : 0;
+      dir = 0;
+      continue;
+    }
+    if (dir == 0 && j && cost == left + 1) {
+      o--;
+      o->type = LEV_EDIT_INSERT;
+      o->spos = i + it->off;
+      o->dpos = --j + it->off;
+      cost = left;
+      up = diag;
+      dir = -1;
+      continue;
+    }
+    if (dir == 0 && i > r0 && cost == up + 1) {
+      o--;
+      o->type = LEV_EDIT_DELETE;
+      o->spos = --i + it->off;
+      o->dpos = j + it->off;
+      cost = up;
+      up = i > r0 ? opiter_vcost(it, r0, i - 1, j) : 0;
+      dir = 1;
+      continue;
     }
+    assert("lost in the cost matrix" == NULL);
+  }
+  it->pos = (size_t)(o - it->ops);
+  *j0 = j;
+  *dir0 = dir;
+}
 
-    /* let all strings vote */
-    for (i = 0; i < n; i++) {
-      const lev_wchar *stri = strings[i];
-      double weighti = weights[i];
-      size_t lengthi = lengths[i];
-      double start = (double)lengthi / ml * (double)j;
-      double end = start + (double)lengthi / ml;
-      size_t istart = (size_t)floor(start);
-      size_t iend = (size_t)ceil(end);
+/* fill and trace block @k */
+static void
+opiter_block(LevOpcodeIter *it, size_t k, size_t *j0, int *dir0)
+{
+  if (it->words) {
+    opiter_vfill(it, k);
+    opiter_vtrace(it, k, j0, dir0);
+  }
+  else {
+    opiter_fill(it, k);
+    opiter_trace(it, k, j0, dir0);
+  }
+}
 
-      /* rounding errors can overflow the buffer */
-      if (iend > lengthi)
-        iend = lengthi;
+/* allocate the bit vector rows and masks, returns -1 on failure */
+static int
+opiter_vsetup(LevOpcodeIter *it)
+{
+  size_t words = it->words;
+  size_t j;
 
-      /* the inner part, including the complete last character */
-      for (k = istart+1; k < iend; k++) {
-        int c = stri[k];
-        int key = (c + (c >> 7)) & 0xff;
-        HQItem *p = symmap + key;
-        while (p->c != c)
-          p = p->n;
-        p->s += weighti;
-      }
-      /* the initial fraction */
-      {
-        int c = stri[istart];
-        int key = (c + (c >> 7)) & 0xff;
-        HQItem *p = symmap + key;
-        while (p->c != c)
-          p = p->n;
-        p->s += weighti * ((double)(1 + istart) - start);
-      }
-      /* subtract what we counted from the last character but doesn't
-       * actually belong here.
-       * this strategy works also when istart+1 == iend (i.e., everything
-       * happens inside a one character) */
-      {
-        int c = stri[iend-1];
-        int key = (c + (c >> 7)) & 0xff;
-        HQItem *p = symmap + key;
-        while (p->c != c)
-          p = p->n;
-        p->s -= weighti * ((double)iend - end);
-      }
+  it->vcheckpoints = (uint64_t*)safe_malloc_3(it->nblocks, 2*words,
+                                              sizeof(uint64_t));
+  it->vmatrix = (uint64_t*)safe_malloc_3(it->rows + 1, 2*words,
+                                         sizeof(uint64_t));
+  it->masks = (uint64_t*)calloc(0x100*words, sizeof(uint64_t));
+  if (!it->vcheckpoints || !it->vmatrix || !it->masks)
+    return -1;
+  for (j = 0; j < it->n2; j++)
+    it->masks[it->string2[j]*words + j/LEV_WORD_BITS]
+      |= (uint64_t)1 << (j % LEV_WORD_BITS);
+  for (j = 0; j < words; j++) {
+    it->vcheckpoints[j] = ~(uint64_t)0;
+    it->vcheckpoints[words + j] = 0;
+  }
+  return 0;
+}
+
+/* the forward and backward passes, ending with block 0 traced */
+static int
+opiter_prepare(LevOpcodeIter *it)
+{
+  size_t w = it->n2 + 1;
+  size_t rowsize, k, j;
+  int dir;
+
+  /* bit vectors need a nonempty string2 and byte symbols */
+  if (it->string1 && it->n1 && it->n2)
+    it->words = (it->n2 + LEV_WORD_BITS - 1)/LEV_WORD_BITS;
+  rowsize = it->words ? 2*it->words : w;
+  it->rows = (size_t)sqrt((double)it->n1) + 1;
+  if (it->rows < LEV_OPITER_CELLS/rowsize)
+    it->rows = LEV_OPITER_CELLS/rowsize;
+  it->nblocks = it->n1 ? (it->n1 + it->rows - 1)/it->rows : 1;
+  it->cap = it->rows + it->n2;
+  it->entries = (size_t*)safe_malloc(it->nblocks, sizeof(size_t));
+  it->dirs = (int*)safe_malloc(it->nblocks, sizeof(int));
+  it->ops = (LevEditOp*)safe_malloc(it->cap, sizeof(LevEditOp));
+  if (!it->entries || !it->dirs || !it->ops)
+    return -1;
+
+  if (it->words) {
+    if (opiter_vsetup(it))
+      return -1;
+    for (k = 0; k + 1 < it->nblocks; k++) {
+      opiter_vfill(it, k);
+      memcpy(it->vcheckpoints + (k + 1)*rowsize,
+             it->vmatrix + it->rows*rowsize, rowsize*sizeof(uint64_t));
+    }
+  }
+  else {
+    it->checkpoints = (size_t*)safe_malloc_3(it->nblocks, w, sizeof(size_t));
+    it->matrix = (size_t*)safe_malloc_3(it->rows + 1, w, sizeof(size_t));
+    if (!it->checkpoints || !it->matrix)
+      return -1;
+    for (j = 0; j < w; j++)
+      it->checkpoints[j] = j;
+    for (k = 0; k + 1 < it->nblocks; k++) {
+      opiter_fill(it, k);
+      memcpy(it->checkpoints + (k + 1)*w, it->matrix + it->rows*w,
+             w*sizeof(size_t));
     }
+  }
 
-    /* find the elected symbol */
-    {
-      HQItem *max = NULL;
+  it->entries[it->nblocks - 1] = it->n2;
+  it->dirs[it->nblocks - 1] = 0;
+  for (k = it->nblocks; k-- > 0; ) {
+    opiter_block(it, k, &j, &dir);
+    if (k) {
+      it->entries[k - 1] = j;
+      it->dirs[k - 1] = dir;
+    }
+  }
+  it->block = 0;
+  return 0;
+}
 
-      for (i = 0; i < 0x100; i++) {
-        HQItem *p = symmap + i;
-        if (p->n == symmap)
-          continue;
-        while (p) {
-          if (!max || p->s > max->s)
-            max = p;
-          p = p->n;
-        }
-      }
-      median[j] = max->c;
+/* the next operation, or NULL when there are no more (@err is set to -1 on
+ * failure) */
+static const LevEditOp*
+opiter_op(LevOpcodeIter *it, int *err)
+{
+  size_t j;
+  int dir;
+
+  *err = 0;
+  if (it->block == (size_t)(-1)) {
+    if (!it->n1 && !it->n2)
+      return NULL;
+    if (opiter_prepare(it)) {
+      *err = -1;
+      return NULL;
     }
   }
+  while (it->pos == it->cap) {
+    if (it->block + 1 >= it->nblocks)
+      return NULL;
+    it->block++;
+    opiter_block(it, it->block, &j, &dir);
+  }
+  return it->ops + it->pos++;
+}
 
-  free_usymlistset_hash(symmap);
-  free(symlist);
+static void
+opiter_flush(LevOpcodeIter *it)
+{
+  if (it->pending.type != LEV_EDIT_KEEP) {
+    it->ready[it->nready++] = it->pending;
+    it->pending.type = LEV_EDIT_KEEP;
+  }
+}
 
-  return median;
+/**
+ * lev_opcode_iter_next:
+ * @it: An iterator created by lev_opcode_iter_new() or
+ *      lev_u_opcode_iter_new().
+ * @bop: Where the next difflib block operation code should be stored.
+ *
+ * Finds the next operation code.
+ *
+ * The codes are produced as soon as they are final.  The alignment is
+ * resolved in blocks of rows, each needing a recomputation of its part of
+ * the cost matrix, except the first call which computes the matrix twice.
+ * For byte strings and Unicode strings of at most 0x100 different symbols
+ * the matrix is computed bit-parallel, so even the first call takes less
+ * time than lev_editops_find().  Memory is about the square root of the
+ * number of its cells.
+ *
+ * Returns: 1 if @bop was set, 0 at the end, -1 on failure.
+ **/
+int
+lev_opcode_iter_next(LevOpcodeIter *it, LevOpCode *bop)
+{
+  const LevEditOp *o;
+  LevOpCode *b = &it->pending;
+  int err;
+
+  while (!it->nready) {
+    if (it->finished)
+      return 0;
+    o = opiter_op(it, &err);
+    if (err)
+      return -1;
+    if (!o) {
+      opiter_flush(it);
+      if (it->spos < it->len1 || it->dpos < it->len2) {
+        LevOpCode *k = it->ready + it->nready++;
+        k->type = LEV_EDIT_KEEP;
+        k->sbeg = it->spos;
+        k->dbeg = it->dpos;
+        k->send = it->len1;
+        k->dend = it->len2;
+      }
+      it->finished = 1;
+      continue;
+    }
+    /* merge exactly like lev_editops_to_opcodes() */
+    if (b->type != o->type || it->spos != o->spos || it->dpos != o->dpos) {
+      opiter_flush(it);
+      if (it->spos < o->spos || it->dpos < o->dpos) {
+        LevOpCode *k = it->ready + it->nready++;
+        k->type = LEV_EDIT_KEEP;
+        k->sbeg = it->spos;
+        k->dbeg = it->dpos;
+        k->send = it->spos = o->spos;
+        k->dend = it->dpos = o->dpos;
+      }
+      b->type = o->type;
+      b->sbeg = it->spos;
+      b->dbeg = it->dpos;
+    }
+    if (o->type != LEV_EDIT_INSERT)
+      it->spos++;
+    if (o->type != LEV_EDIT_DELETE)
+      it->dpos++;
+    b->send = it->spos;
+    b->dend = it->dpos;
+  }
+  *bop = it->ready[0];
+  it->ready[0] = it->ready[1];
+  it->nready--;
+  return 1;
 }
 /* }}} */
 
 /****************************************************************************
  *
- * Set medians
+ * Symmetric delete index
  *
  ****************************************************************************/
 /* {{{ */
 
-/**
- * lev_set_median_index:
- * @n: The size of @lengths, @strings, and @weights.
- * @lengths: The lengths of @strings.
- * @strings: An array of strings, that may contain NUL characters.
- * @weights: The string weights (they behave exactly as multiplicities, though
- *           any positive value is allowed, not just integers).
- *
- * Finds the median string of a string set @strings.
+/* The index maps each string obtainable by deleting at most max_k symbols
+ * from a word (a delete variant) to the words it was obtained from.  Two
+ * strings within Levenshtein distance k always share a delete variant with
+ * at most k deletions on either side, so a lookup only needs to generate the
+ * delete variants of the query and verify the words found under them.
  *
- * Returns: An index in @strings pointing to the set median, -1 in case of
- *          failure.
- **/
-size_t
-lev_set_median_index(size_t n, const size_t *lengths,
-                     const lev_byte *strings[],
-                     const double *weights)
+ * Only 64bit hashes of the variants are stored, collisions just add a few
+ * more candidates to verify.  Everything lives in a single memory block that
+ * is also the file image, so save() is one write and load() one mmap(). */
+
+#define LEV_DIDX_MAGIC "LEVDIDX1"
+#define LEV_DIDX_BYTEORDER 0x01020304U
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder;  /* LEV_DIDX_BYTEORDER, as written */
+  uint64_t max_k;  /* maximum number of deletions indexed */
+  uint64_t nwords;
+  uint64_t nchars;  /* total length of all words */
+  uint64_t maxlen;  /* the longest word length */
+  uint64_t nslots;  /* size of the hash table, a power of 2 */
+  uint64_t npostings;
+  uint64_t tag;  /* opaque value stored for the caller */
+  uint64_t reserved;
+} LevDeleteIndexHeader;
+
+/* a hash table slot, empty when count is zero */
+typedef struct {
+  uint64_t hash;  /* delete variant hash */
+  uint32_t start;  /* its word ids in postings[] */
+  uint32_t count;
+} LevDeleteSlot;
+
+struct _LevDeleteIndex {
+  void *block;  /* the header followed by all the arrays */
+  size_t size;  /* size of block in bytes */
+  int mapped;  /* whether block is mmap()ed (or malloc()ed) */
+  const LevDeleteIndexHeader *header;
+  const uint64_t *offsets;  /* word i is chars[offsets[i]..offsets[i+1]] */
+  const double *freqs;
+  const LevDeleteSlot *slots;
+  const uint32_t *chars;
+  const uint32_t *postings;  /* word ids */
+};
+
+/* a delete variant of a word, used during construction */
+typedef struct {
+  uint64_t hash;
+  uint64_t id;
+} LevDeletePair;
+
+/* the word arrays and sizes of all the parts of the block */
+static size_t
+didx_layout(const LevDeleteIndexHeader *h, size_t *offsets, size_t *freqs,
+            size_t *slots, size_t *chars, size_t *postings)
 {
-  size_t minidx = 0;
-  double mindist = LEV_INFINITY;
+  size_t size = sizeof(LevDeleteIndexHeader);
+
+  *offsets = size;
+  size += (size_t)(h->nwords + 1)*sizeof(uint64_t);
+  *freqs = size;
+  size += (size_t)h->nwords*sizeof(double);
+  *slots = size;
+  size += (size_t)h->nslots*sizeof(LevDeleteSlot);
+  *chars = size;
+  size += (size_t)h->nchars*sizeof(uint32_t);
+  *postings = size;
+  size += (size_t)h->npostings*sizeof(uint32_t);
+  /* keep the size a multiple of 8 */
+  size = (size + 7) & ~(size_t)7;
+
+  return size;
+}
+
+/* points all index arrays to their places in index->block */
+static void
+didx_setup(LevDeleteIndex *index)
+{
+  size_t offsets, freqs, slots, chars, postings;
+  char *block = (char*)index->block;
+
+  index->header = (const LevDeleteIndexHeader*)block;
+  didx_layout(index->header, &offsets, &freqs, &slots, &chars, &postings);
+  index->offsets = (const uint64_t*)(block + offsets);
+  index->freqs = (const double*)(block + freqs);
+  index->slots = (const LevDeleteSlot*)(block + slots);
+  index->chars = (const uint32_t*)(block + chars);
+  index->postings = (const uint32_t*)(block + postings);
+}
+
+/* FNV-1a of a symbol string */
+static uint64_t
+didx_hash(size_t len, const uint32_t *s)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
   size_t i;
-  long int *distances;
 
-  distances = (long int*)safe_malloc((n*(n - 1)/2), sizeof(long int));
-  if (!distances)
-    return (size_t)-1;
+  for (i = 0; i < len; i++) {
+    uint32_t c = s[i];
+    h = (h ^ (c & 0xff)) * 0x100000001b3ULL;
+    h = (h ^ (c >> 8)) * 0x100000001b3ULL;
+  }
+  return h;
+}
 
-  memset(distances, 0xff, (n*(n - 1)/2)*sizeof(long int)); /* XXX */
-  for (i = 0; i < n; i++) {
-    size_t j = 0;
-    double dist = 0.0;
-    const lev_byte *stri = strings[i];
-    size_t leni = lengths[i];
-    /* below diagonal */
-    while (j < i && dist < mindist) {
-      size_t dindex = (i - 1)*(i - 2)/2 + j;
-      long int d;
-      if (distances[dindex] >= 0)
-        d = distances[dindex];
-      else {
-        d = (long int)lev_edit_distance(lengths[j], strings[j], leni, stri, 0);
-        if (d < 0) {
-          free(distances);
-          return (size_t)-1;
-        }
-      }
-      dist += weights[j] * (double)d;
-      j++;
-    }
-    j++;  /* no need to compare item with itself */
-    /* above diagonal */
-    while (j < n && dist < mindist) {
-      size_t dindex = (j - 1)*(j - 2)/2 + i;
-      distances[dindex] = (long int)lev_edit_distance(lengths[j], strings[j],
-                                            leni, stri, 0);
-      if (distances[dindex] < 0) {
-        free(distances);
-        return (size_t)-1;
-      }
-      dist += weights[j] * (double)distances[dindex];
-      j++;
-    }
+/* a growing array of variant hashes */
+typedef struct {
+  uint64_t *hashes;
+  size_t n;
+  size_t alloc;
+  int failed;
+} LevHashList;
 
-    if (dist < mindist) {
-      mindist = dist;
-      minidx = i;
+static void
+hashlist_push(LevHashList *list, uint64_t h)
+{
+  if (list->failed)
+    return;
+  if (list->n == list->alloc) {
+    size_t alloc = list->alloc ? 2*list->alloc : 64;
+    uint64_t *hashes = (uint64_t*)safe_malloc(alloc, sizeof(uint64_t));
+    if (!hashes) {
+      list->failed = 1;
+      return;
     }
+    if (list->n)
+      memcpy(hashes, list->hashes, list->n*sizeof(uint64_t));
+    free(list->hashes);
+    list->hashes = hashes;
+    list->alloc = alloc;
   }
+  list->hashes[list->n++] = h;
+}
 
-  free(distances);
-  return minidx;
+static int
+uint64_cmp(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
 }
 
-/**
- * lev_u_set_median_index:
- * @n: The size of @lengths, @strings, and @weights.
- * @lengths: The lengths of @strings.
- * @strings: An array of strings, that may contain NUL characters.
- * @weights: The string weights (they behave exactly as multiplicities, though
- *           any positive value is allowed, not just integers).
- *
- * Finds the median string of a string set @strings.
- *
- * Returns: An index in @strings pointing to the set median, -1 in case of
- *          failure.
- **/
-size_t
-lev_u_set_median_index(size_t n, const size_t *lengths,
-                       const lev_wchar *strings[],
-                       const double *weights)
+/* add hashes of all delete variants of @s with at most @k deletions to
+ * @list.  @buf must have room for (k+1)*len symbols.  deletions are done at
+ * nondecreasing positions only; the duplicates that remain (from runs of
+ * identical symbols) are removed by didx_variants() */
+static void
+didx_delete(size_t len, const uint32_t *s, size_t from, size_t k,
+            uint32_t *buf, LevHashList *list)
 {
-  size_t minidx = 0;
-  double mindist = LEV_INFINITY;
   size_t i;
-  long int *distances;
 
-  distances = (long int*)safe_malloc((n*(n - 1)/2), sizeof(long int));
-  if (!distances)
-    return (size_t)-1;
+  hashlist_push(list, didx_hash(len, s));
+  if (!k)
+    return;
+  for (i = from; i < len; i++) {
+    memcpy(buf, s, i*sizeof(uint32_t));
+    memcpy(buf + i, s + i + 1, (len - i - 1)*sizeof(uint32_t));
+    didx_delete(len - 1, buf, i, k - 1, buf + len, list);
+  }
+}
 
-  memset(distances, 0xff, (n*(n - 1)/2)*sizeof(long int)); /* XXX */
-  for (i = 0; i < n; i++) {
-    size_t j = 0;
-    double dist = 0.0;
-    const lev_wchar *stri = strings[i];
-    size_t leni = lengths[i];
-    /* below diagonal */
-    while (j < i && dist < mindist) {
-      size_t dindex = (i - 1)*(i - 2)/2 + j;
-      long int d;
-      if (distances[dindex] >= 0)
-        d = distances[dindex];
-      else {
-        d = (long int)lev_u_edit_distance(lengths[j], strings[j], leni, stri, 0);
-        if (d < 0) {
-          free(distances);
-          return (size_t)-1;
-        }
-      }
-      dist += weights[j] * (double)d;
-      j++;
+/* replace @list contents with the sorted unique hashes of all delete
+ * variants of @s, returns zero on allocation failure */
+static int
+didx_variants(size_t len, const uint32_t *s, size_t k, LevHashList *list)
+{
+  uint32_t *buf;
+  size_t i, j;
+
+  list->n = 0;
+  list->failed = 0;
+  if (k > len)
+    k = len;
+  buf = (uint32_t*)safe_malloc(len*(k + 1) + 1, sizeof(uint32_t));
+  if (!buf)
+    return 0;
+  didx_delete(len, s, 0, k, buf, list);
+  free(buf);
+  if (list->failed)
+    return 0;
+
+  qsort(list->hashes, list->n, sizeof(uint64_t), uint64_cmp);
+  for (i = j = 1; i < list->n; i++) {
+    if (list->hashes[i] != list->hashes[j-1])
+      list->hashes[j++] = list->hashes[i];
+  }
+  if (list->n)
+    list->n = j;
+  return 1;
+}
+
+/* the query of a lookup, verified against the candidate words: a query of
+ * at most LEV_WORD_BITS symbols by the single word bit-parallel kernel
+ * with a cutoff, a longer one by a DP restricted to the 2k + 1 diagonals
+ * that can stay within distance k */
+typedef struct {
+  size_t len;
+  const uint32_t *s;
+  uint64_t masks[0x100];  /* match masks of the symbols below 0x100 */
+  uint32_t hkeys[LEV_LCS_HSIZE];  /* the others, open addressing */
+  uint64_t hmasks[LEV_LCS_HSIZE];  /* zero for free slots */
+  size_t *row;  /* the DP row, for long queries */
+} LevDeleteQuery;
+
+static size_t
+didx_query_slot(const LevDeleteQuery *q, uint32_t c)
+{
+  size_t i = (size_t)c % LEV_LCS_HSIZE;
+
+  while (q->hmasks[i] && q->hkeys[i] != c)
+    i = (i + 1) % LEV_LCS_HSIZE;
+  return i;
+}
+
+/* prepare query @s of length @len for words of at most @maxlen symbols;
+ * returns -1 on allocation failure */
+static int
+didx_query_init(LevDeleteQuery *q, size_t len, const uint32_t *s,
+                size_t maxlen)
+{
+  size_t i;
+
+  q->len = len;
+  q->s = s;
+  q->row = NULL;
+  if (len > LEV_WORD_BITS) {
+    q->row = (size_t*)safe_malloc(maxlen + 1, sizeof(size_t));
+    return q->row ? 0 : -1;
+  }
+  memset(q->masks, 0, sizeof(q->masks));
+  memset(q->hmasks, 0, sizeof(q->hmasks));
+  for (i = 0; i < len; i++) {
+    uint64_t bit = (uint64_t)1 << i;
+
+    if (s[i] < 0x100)
+      q->masks[s[i]] |= bit;
+    else {
+      size_t slot = didx_query_slot(q, s[i]);
+      q->hkeys[slot] = s[i];
+      q->hmasks[slot] |= bit;
     }
-    j++;  /* no need to compare item with itself */
-    /* above diagonal */
-    while (j < n && dist < mindist) {
-      size_t dindex = (j - 1)*(j - 2)/2 + i;
-      distances[dindex] = (long int)lev_u_edit_distance(lengths[j], strings[j],
-                                              leni, stri, 0);
-      if (distances[dindex] < 0) {
-        free(distances);
-        return (size_t)-1;
-      }
-      dist += weights[j] * (double)distances[dindex];
-      j++;
+  }
+  return 0;
+}
+
+static void
+didx_query_free(LevDeleteQuery *q)
+{
+  free(q->row);
+  q->row = NULL;
+}
+
+/* Levenshtein distance of @s1 and @s2 by the DP in the band of diagonals
+ * -@max to @max, or @max + 1 when it's larger than @max.  @row must have
+ * room for @len2 + 1 items. */
+static size_t
+didx_banded(size_t len1, const uint32_t *s1,
+            size_t len2, const uint32_t *s2,
+            size_t max, size_t *row)
+{
+  const size_t big = max + 1;  /* anything outside the band */
+  size_t i, j, off;
+
+  /* strip common prefix and suffix */
+  off = lev_strip_affixes(&len1, s1, &len2, s2, sizeof(*s1));
+  s1 += off;
+  s2 += off;
+  if ((len1 > len2 ? len1 - len2 : len2 - len1) > max)
+    return big;
+  if (!len1 || !len2)
+    return len1 + len2;
+
+  for (j = 0; j <= len2 && j <= max; j++)
+    row[j] = j;
+  if (max < len2)
+    row[max + 1] = big;
+  for (i = 1; i <= len1; i++) {
+    uint32_t c1 = s1[i-1];
+    size_t lo = i > max ? i - max : 0;
+    size_t hi = i + max < len2 ? i + max : len2;
+    size_t D, left, rowmin = big;
+
+    if (lo == 0) {
+      D = row[0];
+      rowmin = left = row[0] = i;
+      lo = 1;
     }
+    else {
+      D = row[lo-1];
+      left = big;
+    }
+    for (j = lo; j <= hi; j++) {
+      size_t x = D + (c1 != s2[j-1]);
+      size_t y = row[j] + 1;
+      size_t z = left + 1;
+
+      D = row[j];
+      if (y < x)
+        x = y;
+      if (z < x)
+        x = z;
+      row[j] = left = x;
+      if (x < rowmin)
+        rowmin = x;
+    }
+    if (hi < len2)
+      row[hi + 1] = big;
+    if (rowmin > max)
+      return big;
+  }
 
-    if (dist < mindist) {
-      mindist = dist;
-      minidx = i;
+  return row[len2] > max ? big : row[len2];
+}
+
+/* Levenshtein distance of the query and word @w of length @wlen, or @max +
+ * 1 when it's larger than @max */
+static size_t
+didx_query_distance(const LevDeleteQuery *q, size_t wlen, const uint32_t *w,
+                    size_t max)
+{
+  uint64_t VP = ~(uint64_t)0, VN = 0, last;
+  size_t d = q->len;
+  size_t i;
+
+  if ((q->len > wlen ? q->len - wlen : wlen - q->len) > max)
+    return max + 1;
+  if (q->row)
+    return didx_banded(q->len, q->s, wlen, w, max, q->row);
+  if (!q->len)
+    return wlen;
+
+  last = (uint64_t)1 << (q->len - 1);
+  for (i = 0; i < wlen; i++) {
+    uint32_t c = w[i];
+    uint64_t Eq;
+
+    if (c < 0x100)
+      Eq = q->masks[c];
+    else {
+      size_t slot = didx_query_slot(q, c);
+      Eq = q->hmasks[slot];
     }
+    LEV_MYERS_STEP(Eq, VP, VN, last, d);
+    /* each remaining symbol lowers the distance by one at most */
+    if (d > max + (wlen - i - 1))
+      return max + 1;
   }
+  return d > max ? max + 1 : d;
+}
 
-  free(distances);
-  return minidx;
+/* construction, the parallel part: every thread makes sorted variant lists
+ * of a contiguous range of words */
+typedef struct {
+  const LevDeleteIndex *index;
+  size_t k;
+  LevDeletePair **runs;  /* per-thread sorted pairs */
+  size_t *nruns;  /* their lengths */
+  int failed;
+} LevDeleteBuild;
+
+static int
+pair_cmp(const void *a, const void *b)
+{
+  const LevDeletePair *x = (const LevDeletePair*)a;
+  const LevDeletePair *y = (const LevDeletePair*)b;
+
+  if (x->hash != y->hash)
+    return (x->hash > y->hash) - (x->hash < y->hash);
+  return (x->id > y->id) - (x->id < y->id);
 }
 
-/**
- * lev_set_median:
- * @n: The size of @lengths, @strings, and @weights.
- * @lengths: The lengths of @strings.
- * @strings: An array of strings, that may contain NUL characters.
- * @weights: The string weights (they behave exactly as multiplicities, though
- *           any positive value is allowed, not just integers).
- * @medlength: Where the length of the median string should be stored.
- *
- * Finds the median string of a string set @strings.
- *
- * Returns: The set median as a newly allocate string, its length is stored
- *          in @medlength.  %NULL in the case of failure.
- **/
-lev_byte*
-lev_set_median(size_t n, const size_t *lengths,
-               const lev_byte *strings[],
-               const double *weights,
-               size_t *medlength)
+static void
+didx_build_worker(void *data, size_t ithread, size_t nthreads)
 {
-  size_t minidx = lev_set_median_index(n, lengths, strings, weights);
-  lev_byte *result;
+  LevDeleteBuild *build = (LevDeleteBuild*)data;
+  const LevDeleteIndex *index = build->index;
+  size_t nwords = (size_t)index->header->nwords;
+  size_t from = nwords*ithread/nthreads;
+  size_t to = nwords*(ithread + 1)/nthreads;
+  LevHashList list = { NULL, 0, 0, 0 };
+  LevDeletePair *pairs = NULL;
+  size_t n = 0, alloc = 0;
+  size_t i, j;
 
-  if (minidx == (size_t)-1)
-    return NULL;
+  for (i = from; i < to; i++) {
+    size_t off = (size_t)index->offsets[i];
+    size_t len = (size_t)index->offsets[i+1] - off;
+
+    if (!((i - from) % LEV_SCHED_GRAIN))
+      lev_sched_checkpoint(ithread);
+    if (!didx_variants(len, index->chars + off, build->k, &list))
+      goto fail;
+    if (n + list.n > alloc) {
+      LevDeletePair *p;
+      alloc = 2*(n + list.n);
+      p = (LevDeletePair*)safe_malloc(alloc, sizeof(LevDeletePair));
+      if (!p)
+        goto fail;
+      if (n)
+        memcpy(p, pairs, n*sizeof(LevDeletePair));
+      free(pairs);
+      pairs = p;
+    }
+    for (j = 0; j < list.n; j++) {
+      pairs[n].hash = list.hashes[j];
+      pairs[n].id = i;
+      n++;
+    }
+  }
+  free(list.hashes);
+  if (n)
+    qsort(pairs, n, sizeof(LevDeletePair), pair_cmp);
+  build->runs[ithread] = pairs;
+  build->nruns[ithread] = n;
+  return;
+
+fail:
+  free(list.hashes);
+  free(pairs);
+  build->runs[ithread] = NULL;
+  build->nruns[ithread] = 0;
+  build->failed = 1;
+}
 
-  *medlength = lengths[minidx];
-  if (!lengths[minidx])
-    return (lev_byte*)calloc(1, sizeof(lev_byte));
+/* the smallest head of the sorted runs, or (size_t)(-1) when all are
+ * exhausted */
+static size_t
+didx_merge_min(LevDeleteBuild *build, size_t nthreads, size_t *pos)
+{
+  size_t t, best = (size_t)(-1);
 
-  result = (lev_byte*)safe_malloc(lengths[minidx], sizeof(lev_byte));
-  if (!result)
-    return NULL;
-  return (lev_byte*)memcpy(result, strings[minidx], lengths[minidx]*sizeof(lev_byte));
+  for (t = 0; t < nthreads; t++) {
+    if (pos[t] == build->nruns[t])
+      continue;
+    if (best == (size_t)(-1)
+        || pair_cmp(build->runs[t] + pos[t], build->runs[best] + pos[best]) < 0)
+      best = t;
+  }
+  return best;
 }
 
 /**
- * lev_u_set_median:
- * @n: The size of @lengths, @strings, and @weights.
- * @lengths: The lengths of @strings.
- * @strings: An array of strings, that may contain NUL characters.
- * @weights: The string weights (they behave exactly as multiplicities, though
- *           any positive value is allowed, not just integers).
- * @medlength: Where the length of the median string should be stored.
+ * lev_delete_index_new:
+ * @n: The number of words.
+ * @lengths: The lengths of @words.
+ * @words: The words to index.
+ * @freqs: The word frequencies, used to rank words at the same distance,
+ *         may be %NULL (all frequencies are then 1).
+ * @max_k: The maximum edit distance the index can be queried for.
+ * @nthreads: The number of threads to build the index with, zero means one
+ *            per processor.
+ * @tag: An opaque value stored with the index, see lev_delete_index_tag().
  *
- * Finds the median string of a string set @strings.
+ * Builds a symmetric delete (SymSpell-like) index of @words.
  *
- * Returns: The set median as a newly allocate string, its length is stored
- *          in @medlength.  %NULL in the case of failure.
+ * The index size grows roughly as the number of words times their length
+ * to the power of @max_k, so it's practical for small @max_k only.
+ *
+ * Returns: The new index, %NULL on failure (memory, or more than 2^32 words
+ *          or postings).
  **/
-lev_wchar*
-lev_u_set_median(size_t n, const size_t *lengths,
-                 const lev_wchar *strings[],
-                 const double *weights,
-                 size_t *medlength)
+LevDeleteIndex*
+lev_delete_index_new(size_t n, const size_t *lengths, const lev_wchar *words[],
+                     const double *freqs, size_t max_k, size_t nthreads,
+                     uint64_t tag)
 {
-  size_t minidx = lev_u_set_median_index(n, lengths, strings, weights);
-  lev_wchar *result;
+  LevDeleteIndex *index;
+  LevDeleteIndexHeader header, *h;
+  LevDeleteBuild build;
+  size_t i, j, t, npairs, nhashes, size;
+  size_t o_offsets, o_freqs, o_slots, o_chars, o_postings;
+  size_t *pos;
+  uint64_t lasthash;
+  LevDeleteSlot *slots;
+  uint32_t *postings;
+
+  if (n >= 0xffffffffU)
+    return NULL;
+  if (!nthreads)
+    nthreads = lev_cpu_count();
+  if (nthreads > n/lev_tuning.deleteindex_chunk + 1)
+    nthreads = n/lev_tuning.deleteindex_chunk + 1;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, LEV_DIDX_MAGIC, 8);
+  header.version = 1;
+  header.byteorder = LEV_DIDX_BYTEORDER;
+  header.max_k = max_k;
+  header.nwords = n;
+  header.tag = tag;
+  for (i = 0; i < n; i++) {
+    header.nchars += lengths[i];
+    if (lengths[i] > header.maxlen)
+      header.maxlen = lengths[i];
+  }
 
-  if (minidx == (size_t)-1)
+  /* words first, the variants are generated from the index itself */
+  index = (LevDeleteIndex*)malloc(sizeof(LevDeleteIndex));
+  if (!index)
+    return NULL;
+  index->mapped = 0;
+  index->size = didx_layout(&header, &o_offsets, &o_freqs, &o_slots,
+                            &o_chars, &o_postings);
+  index->block = calloc(index->size, 1);
+  if (!index->block) {
+    free(index);
     return NULL;
+  }
+  memcpy(index->block, &header, sizeof(header));
+  didx_setup(index);
+  {
+    uint64_t *offsets = (uint64_t*)index->offsets;
+    uint32_t *chars = (uint32_t*)index->chars;
+    double *f = (double*)index->freqs;
+    size_t off = 0;
 
-  *medlength = lengths[minidx];
-  if (!lengths[minidx])
-    return (lev_wchar*)calloc(1, sizeof(lev_wchar));
+    for (i = 0; i < n; i++) {
+      offsets[i] = off;
+      f[i] = freqs ? freqs[i] : 1.0;
+      for (j = 0; j < lengths[i]; j++)
+        chars[off++] = (uint32_t)words[i][j];
+    }
+    offsets[n] = off;
+  }
+
+  build.index = index;
+  build.k = max_k;
+  build.failed = 0;
+  build.runs = (LevDeletePair**)calloc(nthreads, sizeof(LevDeletePair*));
+  build.nruns = (size_t*)calloc(nthreads, sizeof(size_t));
+  pos = (size_t*)calloc(nthreads, sizeof(size_t));
+  if (!build.runs || !build.nruns || !pos) {
+    free(build.runs);
+    free(build.nruns);
+    free(pos);
+    lev_delete_index_free(index);
+    return NULL;
+  }
+  lev_run_parallel(nthreads, didx_build_worker, &build);
+
+  /* count distinct hashes */
+  npairs = nhashes = 0;
+  lasthash = 0;
+  while (!build.failed && (t = didx_merge_min(&build, nthreads, pos))
+                          != (size_t)(-1)) {
+    uint64_t hash = build.runs[t][pos[t]++].hash;
+    if (!npairs++ || hash != lasthash)
+      nhashes++;
+    lasthash = hash;
+  }
+  if (build.failed || npairs >= 0xffffffffU) {
+    for (t = 0; t < nthreads; t++)
+      free(build.runs[t]);
+    free(build.runs);
+    free(build.nruns);
+    free(pos);
+    lev_delete_index_free(index);
+    return NULL;
+  }
 
-  result = (lev_wchar*)safe_malloc(lengths[minidx], sizeof(lev_wchar));
-  if (!result)
+  /* now we know the sizes, so reallocate the block to its final size */
+  header.nslots = 16;
+  while (header.nslots < 2*nhashes)
+    header.nslots *= 2;
+  header.npostings = npairs;
+  size = didx_layout(&header, &o_offsets, &o_freqs, &o_slots,
+                     &o_chars, &o_postings);
+  h = (LevDeleteIndexHeader*)calloc(size, 1);
+  if (!h) {
+    for (t = 0; t < nthreads; t++)
+      free(build.runs[t]);
+    free(build.runs);
+    free(build.nruns);
+    free(pos);
+    lev_delete_index_free(index);
     return NULL;
-  return (lev_wchar*)memcpy(result, strings[minidx], lengths[minidx]*sizeof(lev_wchar));
+  }
+  memcpy(h, &header, sizeof(header));
+  memcpy((char*)h + o_offsets, index->offsets, (n + 1)*sizeof(uint64_t));
+  memcpy((char*)h + o_freqs, index->freqs, n*sizeof(double));
+  memcpy((char*)h + o_chars, index->chars,
+         (size_t)header.nchars*sizeof(uint32_t));
+  free(index->block);
+  index->block = h;
+  index->size = size;
+  didx_setup(index);
+
+  /* fill the hash table */
+  slots = (LevDeleteSlot*)index->slots;
+  postings = (uint32_t*)index->postings;
+  memset(pos, 0, nthreads*sizeof(size_t));
+  i = 0;
+  j = (size_t)(-1);
+  while ((t = didx_merge_min(&build, nthreads, pos)) != (size_t)(-1)) {
+    const LevDeletePair *pair = build.runs[t] + pos[t]++;
+    if (j == (size_t)(-1) || slots[j].hash != pair->hash) {
+      size_t mask = (size_t)header.nslots - 1;
+      j = (size_t)pair->hash & mask;
+      while (slots[j].count)
+        j = (j + 1) & mask;
+      slots[j].hash = pair->hash;
+      slots[j].start = (uint32_t)i;
+    }
+    slots[j].count++;
+    postings[i++] = (uint32_t)pair->id;
+  }
+
+  for (t = 0; t < nthreads; t++)
+    free(build.runs[t]);
+  free(build.runs);
+  free(build.nruns);
+  free(pos);
+
+  return index;
 }
-/* }}} */
 
-/****************************************************************************
- *
- * Set, sequence distances
+/**
+ * lev_delete_index_free:
+ * @index: A delete index.
  *
- ****************************************************************************/
-/* {{{ */
+ * Frees (or unmaps) a delete index.
+ **/
+void
+lev_delete_index_free(LevDeleteIndex *index)
+{
+  if (!index)
+    return;
+#ifndef _WIN32
+  if (index->mapped) {
+    munmap(index->block, index->size);
+    free(index);
+    return;
+  }
+#endif
+  free(index->block);
+  free(index);
+}
 
 /**
- * lev_edit_seq_distance:
- * @n1: The length of @lengths1 and @strings1.
- * @lengths1: The lengths of strings in @strings1.
- * @strings1: An array of strings that may contain NUL characters.
- * @n2: The length of @lengths2 and @strings2.
- * @lengths2: The lengths of strings in @strings2.
- * @strings2: An array of strings that may contain NUL characters.
- *
- * Finds the distance between string sequences @strings1 and @strings2.
- *
- * In other words, this is a double-Levenshtein algorithm.
- *
- * The cost of string replace operation is based on string similarity: it's
- * zero for identical strings and 2 for completely unsimilar strings.
+ * lev_delete_index_size:
+ * @index: A delete index.
  *
- * Returns: The distance of the two sequences.
+ * Returns: The number of words in @index.
  **/
-double
-lev_edit_seq_distance(size_t n1, const size_t *lengths1,
-                      const lev_byte *strings1[],
-                      size_t n2, const size_t *lengths2,
-                      const lev_byte *strings2[])
+size_t
+lev_delete_index_size(const LevDeleteIndex *index)
 {
-  size_t i;
-  double *row;  /* we only need to keep one row of costs */
-  double *end;
+  return (size_t)index->header->nwords;
+}
 
-  /* strip common prefix */
-  while (n1 > 0 && n2 > 0
-         && *lengths1 == *lengths2
-         && memcmp(*strings1, *strings2,
-                   *lengths1*sizeof(lev_byte)) == 0) {
-    n1--;
-    n2--;
-    strings1++;
-    strings2++;
-    lengths1++;
-    lengths2++;
-  }
+/**
+ * lev_delete_index_max_k:
+ * @index: A delete index.
+ *
+ * Returns: The maximum edit distance @index can be queried for.
+ **/
+size_t
+lev_delete_index_max_k(const LevDeleteIndex *index)
+{
+  return (size_t)index->header->max_k;
+}
 
-  /* strip common suffix */
-  while (n1 > 0 && n2 > 0
-         && lengths1[n1-1] == lengths2[n2-1]
-         && memcmp(strings1[n1-1], strings2[n2-1],
-                   lengths1[n1-1]*sizeof(lev_byte)) == 0) {
-    n1--;
-    n2--;
-  }
+/**
+ * lev_delete_index_tag:
+ * @index: A delete index.
+ *
+ * Returns: The tag given to lev_delete_index_new().
+ **/
+uint64_t
+lev_delete_index_tag(const LevDeleteIndex *index)
+{
+  return index->header->tag;
+}
 
-  /* catch trivial cases */
-  if (n1 == 0)
-    return (double)n2;
-  if (n2 == 0)
-    return (double)n1;
+/**
+ * lev_delete_index_word:
+ * @index: A delete index.
+ * @id: A word index.
+ * @len: Where the word length should be stored.
+ * @freq: Where the word frequency should be stored.
+ *
+ * Returns: The symbols of word @id, they are owned by @index.
+ **/
+const uint32_t*
+lev_delete_index_word(const LevDeleteIndex *index, size_t id,
+                      size_t *len, double *freq)
+{
+  size_t off = (size_t)index->offsets[id];
 
-  /* make the inner cycle (i.e. strings2) the longer one */
-  if (n1 > n2) {
-    size_t nx = n1;
-    const size_t *lx = lengths1;
-    const lev_byte **sx = strings1;
-    n1 = n2;
-    n2 = nx;
-    lengths1 = lengths2;
-    lengths2 = lx;
-    strings1 = strings2;
-    strings2 = sx;
-  }
-  n1++;
-  n2++;
+  *len = (size_t)index->offsets[id + 1] - off;
+  *freq = index->freqs[id];
+  return index->chars + off;
+}
 
-  /* initalize first row */
-  row = (double*)safe_malloc(n2, sizeof(double));
-  if (!row)
-    return -1.0;
-  end = row + n2 - 1;
-  for (i = 0; i < n2; i++)
-    row[i] = (double)i;
+/* sorting of lookup results: distance, then frequency (descending) and
+ * finally word id */
+typedef struct {
+  size_t id;
+  size_t distance;
+  double freq;
+} LevDeleteRanked;
 
-  /* go through the matrix and compute the costs.  yes, this is an extremely
-   * obfuscated version, but also extremely memory-conservative and relatively
-   * fast.  */
-  for (i = 1; i < n1; i++) {
-    double *p = row + 1;
-    const lev_byte *str1 = strings1[i - 1];
-    const size_t len1 = lengths1[i - 1];
-    const lev_byte **str2p = strings2;
-    const size_t *len2p = lengths2;
-    double D = (double)i - 1.0;
-    double x = (double)i;
-    while (p <= end) {
-      size_t l = len1 + *len2p;
-      double q;
-      if (l == 0)
-        q = D;
-      else {
-        size_t d = lev_edit_distance(len1, str1, *(len2p++), *(str2p++), 1);
-        if (d == (size_t)(-1)) {
-          free(row);
-          return -1.0;
-        }
-        q = D + 2.0 / (double)l * (double)d;
-      }
-      x += 1.0;
-      if (x > q)
-        x = q;
-      D = *p;
-      if (x > D + 1.0)
-        x = D + 1.0;
-      *(p++) = x;
-    }
-  }
+static int
+ranked_cmp(const void *a, const void *b)
+{
+  const LevDeleteRanked *x = (const LevDeleteRanked*)a;
+  const LevDeleteRanked *y = (const LevDeleteRanked*)b;
+
+  if (x->distance != y->distance)
+    return x->distance < y->distance ? -1 : 1;
+  if (x->freq != y->freq)
+    return x->freq > y->freq ? -1 : 1;
+  return (x->id > y->id) - (x->id < y->id);
+}
 
-  {
-    double q = *end;
-    free(row);
-    return q;
-  }
+static int
+uint32_cmp(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
 }
 
 /**
- * lev_u_edit_seq_distance:
- * @n1: The length of @lengths1 and @strings1.
- * @lengths1: The lengths of strings in @strings1.
- * @strings1: An array of strings that may contain NUL characters.
- * @n2: The length of @lengths2 and @strings2.
- * @lengths2: The lengths of strings in @strings2.
- * @strings2: An array of strings that may contain NUL characters.
+ * lev_delete_index_lookup:
+ * @index: A delete index.
+ * @len: The length of @query.
+ * @query: The string to look up.
+ * @max_k: The maximum edit distance of the returned words, it must not be
+ *         larger than lev_delete_index_max_k().
+ * @nmatches: Where the number of matches should be stored.
  *
- * Finds the distance between string sequences @strings1 and @strings2.
+ * Finds all words of @index within Levenshtein distance @max_k from @query.
  *
- * In other words, this is a double-Levenshtein algorithm.
+ * Returns: The matches sorted by distance, then by frequency (descending),
+ *          as a newly allocated array; %NULL when there are no matches or
+ *          on failure, in that case @nmatches is set to (size_t)(-1).
+ **/
+LevDeleteMatch*
+lev_delete_index_lookup(const LevDeleteIndex *index,
+                        size_t len, const lev_wchar *query,
+                        size_t max_k, size_t *nmatches)
+{
+  const LevDeleteIndexHeader *header = index->header;
+  size_t mask = (size_t)header->nslots - 1;
+  LevHashList list = { NULL, 0, 0, 0 };
+  uint32_t *s, *cands;
+  LevDeleteQuery q;
+  size_t i, j, ncands, n;
+  LevDeleteRanked *ranked;
+  LevDeleteMatch *matches;
+
+  *nmatches = (size_t)(-1);
+  if (max_k > header->max_k)
+    max_k = (size_t)header->max_k;
+  s = (uint32_t*)safe_malloc(len + 1, sizeof(uint32_t));
+  if (!s)
+    return NULL;
+  for (i = 0; i < len; i++)
+    s[i] = (uint32_t)query[i];
+  if (!didx_variants(len, s, max_k, &list)) {
+    free(s);
+    free(list.hashes);
+    return NULL;
+  }
+
+  /* collect candidate word ids */
+  ncands = 0;
+  for (i = 0; i < list.n; i++) {
+    j = (size_t)list.hashes[i] & mask;
+    while (index->slots[j].count && index->slots[j].hash != list.hashes[i])
+      j = (j + 1) & mask;
+    ncands += index->slots[j].count;
+  }
+  cands = (uint32_t*)safe_malloc(ncands + 1, sizeof(uint32_t));
+  if (!cands) {
+    free(s);
+    free(list.hashes);
+    return NULL;
+  }
+  ncands = 0;
+  for (i = 0; i < list.n; i++) {
+    const LevDeleteSlot *slot;
+    j = (size_t)list.hashes[i] & mask;
+    while (index->slots[j].count && index->slots[j].hash != list.hashes[i])
+      j = (j + 1) & mask;
+    slot = index->slots + j;
+    if ((uint64_t)slot->start + slot->count > header->npostings)
+      continue;
+    memcpy(cands + ncands, index->postings + slot->start,
+           slot->count*sizeof(uint32_t));
+    ncands += slot->count;
+  }
+  free(list.hashes);
+  qsort(cands, ncands, sizeof(uint32_t), uint32_cmp);
+
+  /* verify them */
+  ranked = (LevDeleteRanked*)safe_malloc(ncands + 1, sizeof(LevDeleteRanked));
+  if (!ranked || didx_query_init(&q, len, s, (size_t)header->maxlen)) {
+    free(ranked);
+    free(cands);
+    free(s);
+    return NULL;
+  }
+  n = 0;
+  for (i = 0; i < ncands; i++) {
+    size_t id = cands[i], wlen, d;
+    const uint32_t *w;
+    double freq;
+
+    if ((i && cands[i] == cands[i-1]) || id >= header->nwords)
+      continue;
+    /* don't trust a mapped file too much */
+    if (index->offsets[id] > index->offsets[id + 1]
+        || index->offsets[id + 1] > header->nchars
+        || index->offsets[id + 1] - index->offsets[id] > header->maxlen)
+      continue;
+    w = lev_delete_index_word(index, id, &wlen, &freq);
+    d = didx_query_distance(&q, wlen, w, max_k);
+    if (d > max_k)
+      continue;
+    ranked[n].id = id;
+    ranked[n].distance = d;
+    ranked[n].freq = freq;
+    n++;
+  }
+  didx_query_free(&q);
+  free(cands);
+  free(s);
+
+  *nmatches = n;
+  if (!n) {
+    free(ranked);
+    return NULL;
+  }
+  qsort(ranked, n, sizeof(LevDeleteRanked), ranked_cmp);
+  matches = (LevDeleteMatch*)safe_malloc(n, sizeof(LevDeleteMatch));
+  if (!matches) {
+    *nmatches = (size_t)(-1);
+    free(ranked);
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    matches[i].id = ranked[i].id;
+    matches[i].distance = ranked[i].distance;
+  }
+  free(ranked);
+
+  return matches;
+}
+
+/**
+ * lev_delete_index_save:
+ * @index: A delete index.
+ * @filename: The file to save @index to.
  *
- * The cost of string replace operation is based on string similarity: it's
- * zero for identical strings and 2 for completely unsimilar strings.
+ * Saves @index to a file that can be mapped back with lev_delete_index_load().
+ * The file is in native byte order.
  *
- * Returns: The distance of the two sequences.
+ * Returns: Zero on success, -1 on failure (errno is set).
  **/
-double
-lev_u_edit_seq_distance(size_t n1, const size_t *lengths1,
-                        const lev_wchar *strings1[],
-                        size_t n2, const size_t *lengths2,
-                        const lev_wchar *strings2[])
+int
+lev_delete_index_save(const LevDeleteIndex *index, const char *filename)
 {
-  size_t i;
-  double *row;  /* we only need to keep one row of costs */
-  double *end;
+  FILE *fh = fopen(filename, "wb");
 
-  /* strip common prefix */
-  while (n1 > 0 && n2 > 0
-         && *lengths1 == *lengths2
-         && memcmp(*strings1, *strings2,
-                   *lengths1*sizeof(lev_wchar)) == 0) {
-    n1--;
-    n2--;
-    strings1++;
-    strings2++;
-    lengths1++;
-    lengths2++;
+  if (!fh)
+    return -1;
+  if (fwrite(index->block, 1, index->size, fh) != index->size) {
+    fclose(fh);
+    return -1;
   }
+  return fclose(fh) ? -1 : 0;
+}
 
-  /* strip common suffix */
-  while (n1 > 0 && n2 > 0
-         && lengths1[n1-1] == lengths2[n2-1]
-         && memcmp(strings1[n1-1], strings2[n2-1],
-                   lengths1[n1-1]*sizeof(lev_wchar)) == 0) {
-    n1--;
-    n2--;
+/**
+ * lev_delete_index_load:
+ * @filename: A file created by lev_delete_index_save().
+ *
+ * Loads a saved delete index.  The file is mapped to memory (where mmap() is
+ * available), so it's cheap and the pages are shared among processes using
+ * the same index.
+ *
+ * Returns: The index, %NULL on failure (errno is set, to EINVAL when the file
+ *          is not a valid index).
+ **/
+LevDeleteIndex*
+lev_delete_index_load(const char *filename)
+{
+  LevDeleteIndex *index;
+  LevDeleteIndexHeader header;
+  size_t size, o_offsets, o_freqs, o_slots, o_chars, o_postings;
+  FILE *fh;
+  long fsize = 0;
+
+  fh = fopen(filename, "rb");
+  if (!fh)
+    return NULL;
+  if (fread(&header, sizeof(header), 1, fh) != 1
+      || memcmp(header.magic, LEV_DIDX_MAGIC, 8)
+      || header.version != 1
+      || header.byteorder != LEV_DIDX_BYTEORDER
+      || !header.nslots || (header.nslots & (header.nslots - 1))
+      || header.nwords >= 0xffffffffU
+      || header.npostings >= 0xffffffffU
+      || header.nchars > (uint64_t)(SIZE_MAX/8)
+      || header.nslots > (uint64_t)(SIZE_MAX/64)
+      || fseek(fh, 0, SEEK_END)
+      || (fsize = ftell(fh)) < 0) {
+    fclose(fh);
+    errno = EINVAL;
+    return NULL;
+  }
+  size = didx_layout(&header, &o_offsets, &o_freqs, &o_slots,
+                     &o_chars, &o_postings);
+  if ((size_t)fsize != size) {
+    fclose(fh);
+    errno = EINVAL;
+    return NULL;
   }
 
-  /* catch trivial cases */
-  if (n1 == 0)
-    return (double)n2;
-  if (n2 == 0)
-    return (double)n1;
-
-  /* make the inner cycle (i.e. strings2) the longer one */
-  if (n1 > n2) {
-    size_t nx = n1;
-    const size_t *lx = lengths1;
-    const lev_wchar **sx = strings1;
-    n1 = n2;
-    n2 = nx;
-    lengths1 = lengths2;
-    lengths2 = lx;
-    strings1 = strings2;
-    strings2 = sx;
+  index = (LevDeleteIndex*)malloc(sizeof(LevDeleteIndex));
+  if (!index) {
+    fclose(fh);
+    return NULL;
+  }
+  index->size = size;
+#ifdef _WIN32
+  index->mapped = 0;
+  index->block = malloc(size);
+  if (!index->block
+      || fseek(fh, 0, SEEK_SET)
+      || fread(index->block, 1, size, fh) != size) {
+    free(index->block);
+    free(index);
+    fclose(fh);
+    return NULL;
+  }
+#else
+  index->mapped = 1;
+  index->block = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(fh), 0);
+  if (index->block == MAP_FAILED) {
+    free(index);
+    fclose(fh);
+    return NULL;
+  }
+#endif
+  fclose(fh);
+  didx_setup(index);
+  if (index->offsets[header.nwords] != header.nchars) {
+    lev_delete_index_free(index);
+    errno = EINVAL;
+    return NULL;
   }
-  n1++;
-  n2++;
 
-  /* initalize first row */
-  row = (double*)safe_malloc(n2, sizeof(double));
-  if (!row)
-    return -1.0;
-  end = row + n2 - 1;
-  for (i = 0; i < n2; i++)
-    row[i] = (double)i;
+  return index;
+}
 
-  /* go through the matrix and compute the costs.  yes, this is an extremely
-   * obfuscated version, but also extremely memory-conservative and relatively
-   * fast.  */
-  for (i = 1; i < n1; i++) {
-    double *p = row + 1;
-    const lev_wchar *str1 = strings1[i - 1];
-    const size_t len1 = lengths1[i - 1];
-    const lev_wchar **str2p = strings2;
-    const size_t *len2p = lengths2;
-    double D = (double)i - 1.0;
-    double x = (double)i;
-    while (p <= end) {
-      size_t l = len1 + *len2p;
-      double q;
-      if (l == 0)
-        q = D;
-      else {
-        size_t d = lev_u_edit_distance(len1, str1, *(len2p++), *(str2p++), 1);
-        if (d == (size_t)(-1)) {
-          free(row);
-          return -1.0;
+/* word pairs within the distance, found by one thread in a batch */
+typedef struct {
+  size_t n;
+  size_t size;
+  size_t *pairs;  /* word, smaller matching word */
+  int failed;
+} LevDeletePairList;
+
+typedef struct {
+  const LevDeleteIndex *index;
+  size_t max_k;
+  size_t begin;  /* the batch of words being looked up */
+  size_t end;
+  LevDeletePairList *lists;  /* one for each thread */
+} LevDeleteClusters;
+
+static void
+didx_clusters_worker(void *data, size_t ithread, size_t nthreads)
+{
+  LevDeleteClusters *clusters = (LevDeleteClusters*)data;
+  LevDeletePairList *list = clusters->lists + ithread;
+  size_t maxlen = (size_t)clusters->index->header->maxlen;
+  size_t n = clusters->end - clusters->begin;
+  lev_wchar *word;
+  size_t id, i;
+
+  list->n = 0;
+  word = (lev_wchar*)safe_malloc(maxlen + 1, sizeof(lev_wchar));
+  if (!word) {
+    list->failed = 1;
+    return;
+  }
+  for (id = clusters->begin + n*ithread/nthreads;
+       id < clusters->begin + n*(ithread + 1)/nthreads;
+       id++) {
+    const uint32_t *w;
+    LevDeleteMatch *matches;
+    size_t len, nmatches;
+    double freq;
+
+    if (!(id % LEV_SCHED_GRAIN))
+      lev_sched_checkpoint(ithread);
+    w = lev_delete_index_word(clusters->index, id, &len, &freq);
+    for (i = 0; i < len; i++)
+      word[i] = (lev_wchar)w[i];
+    matches = lev_delete_index_lookup(clusters->index, len, word,
+                                      clusters->max_k, &nmatches);
+    if (nmatches == (size_t)(-1)) {
+      list->failed = 1;
+      break;
+    }
+    /* the relation is symmetric, the larger word records it */
+    for (i = 0; i < nmatches; i++) {
+      if (matches[i].id >= id)
+        continue;
+      if (list->n + 2 > list->size) {
+        size_t size = 2*list->size + 64;
+        size_t *p = (size_t*)realloc(list->pairs, size*sizeof(size_t));
+        if (!p) {
+          list->failed = 1;
+          break;
         }
-        q = D + 2.0 / (double)l * (double)d;
+        list->pairs = p;
+        list->size = size;
       }
-      x += 1.0;
-      if (x > q)
-        x = q;
-      D = *p;
-      if (x > D + 1.0)
-        x = D + 1.0;
-      *(p++) = x;
+      list->pairs[list->n++] = id;
+      list->pairs[list->n++] = matches[i].id;
     }
+    free(matches);
+    if (list->failed)
+      break;
   }
+  free(word);
+}
 
-  {
-    double q = *end;
-    free(row);
-    return q;
+/* union-find root, with path halving; roots are the smallest ids */
+static size_t
+didx_find(size_t *parent, size_t i)
+{
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
   }
+  return i;
 }
 
 /**
- * lev_set_distance:
- * @n1: The length of @lengths1 and @strings1.
- * @lengths1: The lengths of strings in @strings1.
- * @strings1: An array of strings that may contain NUL characters.
- * @n2: The length of @lengths2 and @strings2.
- * @lengths2: The lengths of strings in @strings2.
- * @strings2: An array of strings that may contain NUL characters.
- *
- * Finds the distance between string sets @strings1 and @strings2.
+ * lev_delete_index_clusters:
+ * @index: A delete index.
+ * @max_k: The maximum edit distance of words in the same cluster, it must
+ *         not be larger than lev_delete_index_max_k().
+ * @nthreads: The number of threads to use, zero means one per processor.
+ * @clusters: Where the cluster of each word should be stored, it must have
+ *            room for lev_delete_index_size() items.
  *
- * The difference from lev_edit_seq_distance() is that order doesn't matter.
- * The optimal association of @strings1 and @strings2 is found first and
- * the similarity is computed for that.
+ * Clusters the indexed words: two words are in the same cluster when they
+ * are connected by a chain of words, each within Levenshtein distance
+ * @max_k from the next.  Each word is looked up in the index and the
+ * matches are joined with union-find, in batches so the memory needed for
+ * the matching pairs stays bounded.
  *
- * Uses sequential Munkers-Blackman algorithm.
+ * The cluster of a word is identified by its smallest word index.
  *
- * Returns: The distance of the two sets.
+ * Returns: Zero on success, -1 on failure.
  **/
-double
-lev_set_distance(size_t n1, const size_t *lengths1,
-                 const lev_byte *strings1[],
-                 size_t n2, const size_t *lengths2,
-                 const lev_byte *strings2[])
+int
+lev_delete_index_clusters(const LevDeleteIndex *index, size_t max_k,
+                          size_t nthreads, size_t *clusters)
 {
-  double *dists;  /* the (modified) distance matrix, indexed [row*n1 + col] */
-  double *r;
-  size_t i, j;
-  size_t *map;
-  double sum;
-
-  /* catch trivial cases */
-  if (n1 == 0)
-    return (double)n2;
-  if (n2 == 0)
-    return (double)n1;
-
-  /* make the number of columns (n1) smaller than the number of rows */
-  if (n1 > n2) {
-    size_t nx = n1;
-    const size_t *lx = lengths1;
-    const lev_byte **sx = strings1;
-    n1 = n2;
-    n2 = nx;
-    lengths1 = lengths2;
-    lengths2 = lx;
-    strings1 = strings2;
-    strings2 = sx;
-  }
-
-  /* compute distances from each to each */
-  r = dists = (double*)safe_malloc_3(n1, n2, sizeof(double));
-  if (!r)
-    return -1.0;
-  for (i = 0; i < n2; i++) {
-    size_t len2 = lengths2[i];
-    const lev_byte *str2 = strings2[i];
-    const size_t *len1p = lengths1;
-    const lev_byte **str1p = strings1;
-    for (j = 0; j < n1; j++) {
-      size_t l = len2 + *len1p;
-      if (l == 0)
-        *(r++) = 0.0;
-      else {
-        size_t d = lev_edit_distance(len2, str2, *(len1p++), *(str1p)++, 1);
-        if (d == (size_t)(-1)) {
-          free(r);
-          return -1.0;
-        }
-        *(r++) = (double)d / (double)l;
-      }
-    }
-  }
+  LevDeleteClusters data;
+  size_t n = lev_delete_index_size(index);
+  size_t i, t;
+  int failed = 0;
+
+  if (!nthreads)
+    nthreads = lev_cpu_count();
+  if (nthreads > n/lev_tuning.deleteindex_chunk + 1)
+    nthreads = n/lev_tuning.deleteindex_chunk + 1;
+  data.index = index;
+  data.max_k = max_k;
+  data.lists = (LevDeletePairList*)calloc(nthreads, sizeof(LevDeletePairList));
+  if (!data.lists)
+    return -1;
 
-  /* find the optimal mapping between the two sets */
-  map = munkers_blackman(n1, n2, dists);
-  if (!map)
-    return -1.0;
-
-  /* sum the set distance */
-  sum = (double)(n2 - n1);
-  for (j = 0; j < n1; j++) {
-    size_t l;
-    i = map[j];
-    l = lengths1[j] + lengths2[i];
-    if (l > 0) {
-      size_t d = lev_edit_distance(lengths1[j], strings1[j],
-                                   lengths2[i], strings2[i], 1);
-      if (d == (size_t)(-1)) {
-        free(map);
-        return -1.0;
+  for (i = 0; i < n; i++)
+    clusters[i] = i;
+  for (data.begin = 0; data.begin < n && !failed; data.begin = data.end) {
+    data.end = data.begin + lev_tuning.cluster_batch;
+    if (data.end > n)
+      data.end = n;
+    lev_run_parallel(nthreads, didx_clusters_worker, &data);
+    for (t = 0; t < nthreads; t++) {
+      const LevDeletePairList *list = data.lists + t;
+
+      failed |= list->failed;
+      for (i = 0; i < list->n; i += 2) {
+        size_t a = didx_find(clusters, list->pairs[i]);
+        size_t b = didx_find(clusters, list->pairs[i + 1]);
+        if (a < b)
+          clusters[b] = a;
+        else if (b < a)
+          clusters[a] = b;
       }
-      sum += 2.0 * (double)d / (double)l;
     }
   }
-  free(map);
+  for (i = 0; i < n; i++)
+    clusters[i] = clusters[clusters[i]];
 
-  return sum;
+  for (t = 0; t < nthreads; t++)
+    free(data.lists[t].pairs);
+  free(data.lists);
+  return failed ? -1 : 0;
 }
+/* }}} */
 
-/**
- * lev_u_set_distance:
- * @n1: The length of @lengths1 and @strings1.
- * @lengths1: The lengths of strings in @strings1.
- * @strings1: An array of strings that may contain NUL characters.
- * @n2: The length of @lengths2 and @strings2.
- * @lengths2: The lengths of strings in @strings2.
- * @strings2: An array of strings that may contain NUL characters.
- *
- * Finds the distance between string sets @strings1 and @strings2.
+/****************************************************************************
  *
- * The difference from lev_u_edit_seq_distance() is that order doesn't matter.
- * The optimal association of @strings1 and @strings2 is found first and
- * the similarity is computed for that.
+ * Dynamic delete index
  *
- * Uses sequential Munkers-Blackman algorithm.
+ ****************************************************************************/
+/* {{{ */
+
+/* A delete index taking inserts and deletes while it's being queried.  The
+ * words live in segments: immutable delete indexes and one small flat
+ * segment of the latest words that lookups simply scan.  A full flat
+ * segment is turned into a delete index.  Deleted words of the indexed
+ * segments are kept as tombstones until a compaction merges segments and
+ * drops them, which keeps the posting lists dense and the number of
+ * segments logarithmic.
  *
- * Returns: The distance of the two sets.
- **/
-double
-lev_u_set_distance(size_t n1, const size_t *lengths1,
-                   const lev_wchar *strings1[],
-                   size_t n2, const size_t *lengths2,
-                   const lev_wchar *strings2[])
+ * Readers never see a change in progress: the segments and tombstones form
+ * an immutable snapshot, writers make a new one (sharing the unchanged
+ * segments) and swap it in.  Snapshots and segments are reference counted,
+ * the last reader of an old snapshot frees it.  Writers are serialized by
+ * a mutex, readers only hold the other one while taking a reference. */
+
+#define LEV_DYN_FLAT_MAX 64
+
+typedef struct {
+  size_t refs;  /* protected by the index lock */
+  size_t n;
+  size_t *ids;  /* word ids, ascending */
+  LevDeleteIndex *index;  /* NULL for the flat segment */
+  uint64_t *offsets;  /* flat word i is chars[offsets[i]..offsets[i+1]] */
+  uint32_t *chars;
+  size_t maxlen;  /* the longest flat word */
+} LevDynSegment;
+
+struct _LevDynamicSnapshot {
+  LevDynamicIndex *owner;
+  size_t refs;  /* protected by the index lock */
+  size_t nsegments;
+  LevDynSegment **segments;  /* the flat one, if any, last */
+  size_t ndeleted;
+  size_t *deleted;  /* tombstones, ascending */
+  size_t size;  /* the number of live words */
+};
+
+struct _LevDynamicIndex {
+  size_t max_k;
+  size_t next_id;
+  LevDynamicSnapshot *current;
+  LevMutex lock;  /* current and all reference counts */
+  LevMutex write;  /* serializes writers */
+  LevMutex compact;  /* serializes compactions */
+};
+
+/* a word to make a segment of */
+typedef struct {
+  size_t id;
+  size_t len;
+  const uint32_t *word;
+} LevDynWord;
+
+static int
+dyn_word_cmp(const void *a, const void *b)
 {
-  double *dists;  /* the (modified) distance matrix, indexed [row*n1 + col] */
-  double *r;
-  size_t i, j;
-  size_t *map;
-  double sum;
+  const LevDynWord *x = (const LevDynWord*)a;
+  const LevDynWord *y = (const LevDynWord*)b;
 
-  /* catch trivial cases */
-  if (n1 == 0)
-    return (double)n2;
-  if (n2 == 0)
-    return (double)n1;
+  return (x->id > y->id) - (x->id < y->id);
+}
 
-  /* make the number of columns (n1) smaller than the number of rows */
-  if (n1 > n2) {
-    size_t nx = n1;
-    const size_t *lx = lengths1;
-    const lev_wchar **sx = strings1;
-    n1 = n2;
-    n2 = nx;
-    lengths1 = lengths2;
-    lengths2 = lx;
-    strings1 = strings2;
-    strings2 = sx;
+static int
+dyn_match_cmp(const void *a, const void *b)
+{
+  const LevDeleteMatch *x = (const LevDeleteMatch*)a;
+  const LevDeleteMatch *y = (const LevDeleteMatch*)b;
+
+  if (x->distance != y->distance)
+    return (x->distance > y->distance) - (x->distance < y->distance);
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+static int
+size_t_cmp(const void *a, const void *b)
+{
+  size_t x = *(const size_t*)a;
+  size_t y = *(const size_t*)b;
+
+  return (x > y) - (x < y);
+}
+
+static void
+dyn_segment_free(LevDynSegment *seg)
+{
+  lev_delete_index_free(seg->index);
+  free(seg->ids);
+  free(seg->offsets);
+  free(seg->chars);
+  free(seg);
+}
+
+static const uint32_t*
+dyn_segment_word(const LevDynSegment *seg, size_t i, size_t *len)
+{
+  double freq;
+
+  if (seg->index)
+    return lev_delete_index_word(seg->index, i, len, &freq);
+  *len = (size_t)(seg->offsets[i + 1] - seg->offsets[i]);
+  return seg->chars + seg->offsets[i];
+}
+
+/* the position of @id in a sorted array, (size_t)(-1) if it isn't there */
+static size_t
+dyn_find(size_t n, const size_t *ids, size_t id)
+{
+  size_t lo = 0, hi = n;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+
+    if (ids[mid] < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < n && ids[lo] == id ? lo : (size_t)(-1);
+}
+
+/* a new segment of the @n words @w (sorted by id), a delete index unless
+ * @flat */
+static LevDynSegment*
+dyn_segment_new(size_t n, const LevDynWord *w, int flat,
+                size_t max_k, size_t nthreads)
+{
+  LevDynSegment *seg;
+  size_t i, j, nchars = 0;
+
+  seg = (LevDynSegment*)calloc(1, sizeof(LevDynSegment));
+  if (!seg)
+    return NULL;
+  seg->n = n;
+  seg->ids = (size_t*)safe_malloc(n + 1, sizeof(size_t));
+  if (!seg->ids) {
+    free(seg);
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    seg->ids[i] = w[i].id;
+    nchars += w[i].len;
+    if (w[i].len > seg->maxlen)
+      seg->maxlen = w[i].len;
   }
 
-  /* compute distances from each to each */
-  r = dists = (double*)safe_malloc_3(n1, n2, sizeof(double));
-  if (!r)
-    return -1.0;
-  for (i = 0; i < n2; i++) {
-    size_t len2 = lengths2[i];
-    const lev_wchar *str2 = strings2[i];
-    const size_t *len1p = lengths1;
-    const lev_wchar **str1p = strings1;
-    for (j = 0; j < n1; j++) {
-      size_t l = len2 + *len1p;
-      if (l == 0)
-        *(r++) = 0.0;
-      else {
-        size_t d = lev_u_edit_distance(len2, str2, *(len1p++), *(str1p)++, 1);
-        if (d == (size_t)(-1)) {
-          free(r);
-          return -1.0;
-        }
-        *(r++) = (double)d / (double)l;
-      }
+  if (flat) {
+    seg->offsets = (uint64_t*)safe_malloc(n + 1, sizeof(uint64_t));
+    seg->chars = (uint32_t*)safe_malloc(nchars + 1, sizeof(uint32_t));
+    if (!seg->offsets || !seg->chars) {
+      dyn_segment_free(seg);
+      return NULL;
+    }
+    seg->offsets[0] = 0;
+    for (i = 0; i < n; i++) {
+      memcpy(seg->chars + seg->offsets[i], w[i].word,
+             w[i].len*sizeof(uint32_t));
+      seg->offsets[i + 1] = seg->offsets[i] + w[i].len;
     }
   }
+  else {
+    lev_wchar *chars = (lev_wchar*)safe_malloc(nchars + 1, sizeof(lev_wchar));
+    const lev_wchar **words = (const lev_wchar**)safe_malloc(n + 1,
+                                                 sizeof(lev_wchar*));
+    size_t *lengths = (size_t*)safe_malloc(n + 1, sizeof(size_t));
+    size_t pos = 0;
 
-  /* find the optimal mapping between the two sets */
-  map = munkers_blackman(n1, n2, dists);
-  if (!map)
-    return -1.0;
-
-  /* sum the set distance */
-  sum = (double)(n2 - n1);
-  for (j = 0; j < n1; j++) {
-    size_t l;
-    i = map[j];
-    l = lengths1[j] + lengths2[i];
-    if (l > 0) {
-      size_t d = lev_u_edit_distance(lengths1[j], strings1[j],
-                                     lengths2[i], strings2[i], 1);
-      if (d == (size_t)(-1)) {
-        free(map);
-        return -1.0;
+    if (chars && words && lengths) {
+      for (i = 0; i < n; i++) {
+        words[i] = chars + pos;
+        lengths[i] = w[i].len;
+        for (j = 0; j < w[i].len; j++)
+          chars[pos++] = (lev_wchar)w[i].word[j];
       }
-      sum += 2.0 * (double)d / (double)l;
+      seg->index = lev_delete_index_new(n, lengths, words, NULL,
+                                        max_k, nthreads, 0);
+    }
+    free(chars);
+    free(words);
+    free(lengths);
+    if (!seg->index) {
+      dyn_segment_free(seg);
+      return NULL;
     }
   }
-  free(map);
 
-  return sum;
+  return seg;
 }
 
-/*
- * Munkers-Blackman algorithm.
- */
-static size_t*
-munkers_blackman(size_t n1, size_t n2, double *dists)
+/* a new snapshot with room for @nsegments segments and @ndeleted
+ * tombstones, owned by the caller */
+static LevDynamicSnapshot*
+dyn_snapshot_alloc(LevDynamicIndex *index, size_t nsegments, size_t ndeleted)
 {
-  size_t i, j;
-  size_t *covc, *covr;  /* 1 if column/row is covered */
-  /* these contain 1-based indices, so we can use zero as `none'
-   * zstarr: column of a z* in given row
-   * zstarc: row of a z* in given column
-   * zprimer: column of a z' in given row */
-  size_t *zstarr, *zstarc, *zprimer;
+  LevDynamicSnapshot *snap;
 
-  /* allocate memory */
-  covc = (size_t*)calloc(n1, sizeof(size_t));
-  if (!covc)
+  snap = (LevDynamicSnapshot*)malloc(sizeof(LevDynamicSnapshot));
+  if (!snap)
     return NULL;
-  zstarc = (size_t*)calloc(n1, sizeof(size_t));
-  if (!zstarc) {
-    free(covc);
+  snap->segments = (LevDynSegment**)safe_malloc(nsegments + 1,
+                                                sizeof(LevDynSegment*));
+  snap->deleted = (size_t*)safe_malloc(ndeleted + 1, sizeof(size_t));
+  if (!snap->segments || !snap->deleted) {
+    free(snap->segments);
+    free(snap->deleted);
+    free(snap);
     return NULL;
   }
-  covr = (size_t*)calloc(n2, sizeof(size_t));
-  if (!covr) {
-    free(zstarc);
-    free(covc);
+  snap->owner = index;
+  snap->refs = 1;
+  snap->nsegments = 0;
+  snap->ndeleted = 0;
+  snap->size = 0;
+  return snap;
+}
+
+/* make @snap the current snapshot, called with the write lock held */
+static void
+dyn_publish(LevDynamicIndex *index, LevDynamicSnapshot *snap)
+{
+  LevDynamicSnapshot *old = index->current;
+  size_t i;
+
+  lev_mutex_lock(&index->lock);
+  for (i = 0; i < snap->nsegments; i++)
+    snap->segments[i]->refs++;
+  index->current = snap;
+  lev_mutex_unlock(&index->lock);
+  if (old)
+    lev_dynamic_snapshot_release(old);
+}
+
+/* is @id a live word of @snap, and where */
+static LevDynSegment*
+dyn_locate(const LevDynamicSnapshot *snap, size_t id, size_t *pos)
+{
+  size_t i;
+
+  if (dyn_find(snap->ndeleted, snap->deleted, id) != (size_t)(-1))
     return NULL;
+  for (i = 0; i < snap->nsegments; i++) {
+    *pos = dyn_find(snap->segments[i]->n, snap->segments[i]->ids, id);
+    if (*pos != (size_t)(-1))
+      return snap->segments[i];
   }
-  zstarr = (size_t*)calloc(n2, sizeof(size_t));
-  if (!zstarr) {
-    free(covr);
-    free(zstarc);
-    free(covc);
+  return NULL;
+}
+
+/**
+ * lev_dynamic_index_new:
+ * @max_k: The maximum edit distance the index can be queried for.
+ *
+ * Creates an empty dynamic delete index.  Unlike #LevDeleteIndex, words can
+ * be inserted and deleted by any number of threads while other threads
+ * query snapshots of it.
+ *
+ * Returns: The new index, %NULL on failure.
+ **/
+LevDynamicIndex*
+lev_dynamic_index_new(size_t max_k)
+{
+  LevDynamicIndex *index;
+
+  index = (LevDynamicIndex*)malloc(sizeof(LevDynamicIndex));
+  if (!index)
     return NULL;
-  }
-  zprimer = (size_t*)calloc(n2, sizeof(size_t));
-  if (!zprimer) {
-    free(zstarr);
-    free(covr);
-    free(zstarc);
-    free(covc);
+  index->max_k = max_k;
+  index->next_id = 0;
+  index->current = dyn_snapshot_alloc(index, 0, 0);
+  if (!index->current) {
+    free(index);
     return NULL;
   }
+  lev_mutex_init(&index->lock);
+  lev_mutex_init(&index->write);
+  lev_mutex_init(&index->compact);
+  return index;
+}
 
-  /* step 0 (subtract minimal distance) and step 1 (find zeroes) */
-  for (j = 0; j < n1; j++) {
-    size_t minidx = 0;
-    double *col = dists + j;
-    double min = *col;
-    double *p = col + n1;
-    for (i = 1; i < n2; i++) {
-      if (min > *p) {
-        minidx = i;
-        min = *p;
-      }
-      p += n1;
-    }
-    /* subtract */
-    p = col;
-    for (i = 0; i < n2; i++) {
-      *p -= min;
-      if (*p < LEV_EPSILON)
-        *p = 0.0;
-      p += n1;
+/**
+ * lev_dynamic_index_free:
+ * @index: A dynamic delete index.
+ *
+ * Frees a dynamic index.  All its snapshots must have been released.
+ **/
+void
+lev_dynamic_index_free(LevDynamicIndex *index)
+{
+  if (!index)
+    return;
+  lev_dynamic_snapshot_release(index->current);
+  lev_mutex_destroy(&index->lock);
+  lev_mutex_destroy(&index->write);
+  lev_mutex_destroy(&index->compact);
+  free(index);
+}
+
+/**
+ * lev_dynamic_index_max_k:
+ * @index: A dynamic delete index.
+ *
+ * Returns: The maximum edit distance @index can be queried for.
+ **/
+size_t
+lev_dynamic_index_max_k(const LevDynamicIndex *index)
+{
+  return index->max_k;
+}
+
+/**
+ * lev_dynamic_index_insert:
+ * @index: A dynamic delete index.
+ * @len: The length of @word.
+ * @word: The word to insert.
+ * @id: Where the id of the word should be stored.
+ *
+ * Inserts a word, it's visible in the snapshots taken afterwards.  Word ids
+ * are never reused.
+ *
+ * Returns: Zero on success, -1 on failure.
+ **/
+int
+lev_dynamic_index_insert(LevDynamicIndex *index,
+                         size_t len, const lev_wchar *word, size_t *id)
+{
+  LevDynamicSnapshot *cur, *snap;
+  LevDynSegment *flat, *seg;
+  LevDynWord *w;
+  uint32_t *s;
+  size_t i, m;
+
+  s = (uint32_t*)safe_malloc(len + 1, sizeof(uint32_t));
+  if (!s)
+    return -1;
+  for (i = 0; i < len; i++)
+    s[i] = (uint32_t)word[i];
+
+  lev_mutex_lock(&index->write);
+  cur = index->current;
+  flat = cur->nsegments && !cur->segments[cur->nsegments - 1]->index
+         ? cur->segments[cur->nsegments - 1] : NULL;
+  m = flat ? flat->n : 0;
+  w = (LevDynWord*)safe_malloc(m + 1, sizeof(LevDynWord));
+  if (!w) {
+    lev_mutex_unlock(&index->write);
+    free(s);
+    return -1;
+  }
+  for (i = 0; i < m; i++) {
+    w[i].id = flat->ids[i];
+    w[i].word = dyn_segment_word(flat, i, &w[i].len);
+  }
+  w[m].id = index->next_id;
+  w[m].len = len;
+  w[m].word = s;
+  /* a full flat segment becomes a delete index */
+  seg = dyn_segment_new(m + 1, w, m + 1 < LEV_DYN_FLAT_MAX, index->max_k, 1);
+  free(w);
+  free(s);
+  snap = seg ? dyn_snapshot_alloc(index, cur->nsegments + 1, cur->ndeleted)
+             : NULL;
+  if (!snap) {
+    if (seg)
+      dyn_segment_free(seg);
+    lev_mutex_unlock(&index->write);
+    return -1;
+  }
+
+  for (i = 0; i < cur->nsegments; i++) {
+    if (cur->segments[i] != flat)
+      snap->segments[snap->nsegments++] = cur->segments[i];
+  }
+  snap->segments[snap->nsegments++] = seg;
+  memcpy(snap->deleted, cur->deleted, cur->ndeleted*sizeof(size_t));
+  snap->ndeleted = cur->ndeleted;
+  snap->size = cur->size + 1;
+  *id = index->next_id++;
+  dyn_publish(index, snap);
+  lev_mutex_unlock(&index->write);
+
+  return 0;
+}
+
+/**
+ * lev_dynamic_index_delete:
+ * @index: A dynamic delete index.
+ * @id: The id of the word to delete.
+ *
+ * Deletes a word, it's absent from the snapshots taken afterwards.
+ *
+ * Returns: Zero on success, 1 when there's no such word, -1 on failure.
+ **/
+int
+lev_dynamic_index_delete(LevDynamicIndex *index, size_t id)
+{
+  LevDynamicSnapshot *cur, *snap;
+  LevDynSegment *seg, *flat = NULL;
+  size_t i, pos;
+
+  lev_mutex_lock(&index->write);
+  cur = index->current;
+  seg = dyn_locate(cur, id, &pos);
+  if (!seg) {
+    lev_mutex_unlock(&index->write);
+    return 1;
+  }
+
+  /* flat segments are rewritten, indexed ones get a tombstone */
+  if (!seg->index && seg->n > 1) {
+    LevDynWord *w = (LevDynWord*)safe_malloc(seg->n, sizeof(LevDynWord));
+    size_t m = 0;
+
+    if (!w) {
+      lev_mutex_unlock(&index->write);
+      return -1;
     }
-    /* star the zero, if possible */
-    if (!zstarc[j] && !zstarr[minidx]) {
-      zstarc[j] = minidx + 1;
-      zstarr[minidx] = j + 1;
+    for (i = 0; i < seg->n; i++) {
+      if (i == pos)
+        continue;
+      w[m].id = seg->ids[i];
+      w[m].word = dyn_segment_word(seg, i, &w[m].len);
+      m++;
     }
-    else {
-      /* otherwise try to find some other */
-      p = col;
-      for (i = 0; i < n2; i++) {
-        if (i != minidx && *p == 0.0
-            && !zstarc[j] && !zstarr[i]) {
-          zstarc[j] = i + 1;
-          zstarr[i] = j + 1;
-          break;
-        }
-        p += n1;
-      }
+    flat = dyn_segment_new(m, w, 1, index->max_k, 1);
+    free(w);
+    if (!flat) {
+      lev_mutex_unlock(&index->write);
+      return -1;
     }
   }
+  snap = dyn_snapshot_alloc(index, cur->nsegments, cur->ndeleted + 1);
+  if (!snap) {
+    if (flat)
+      dyn_segment_free(flat);
+    lev_mutex_unlock(&index->write);
+    return -1;
+  }
+
+  for (i = 0; i < cur->nsegments; i++) {
+    if (cur->segments[i] != seg)
+      snap->segments[snap->nsegments++] = cur->segments[i];
+    else if (seg->index || flat)
+      snap->segments[snap->nsegments++] = flat ? flat : seg;
+  }
+  for (i = 0; i < cur->ndeleted && cur->deleted[i] < id; i++)
+    snap->deleted[snap->ndeleted++] = cur->deleted[i];
+  if (seg->index)
+    snap->deleted[snap->ndeleted++] = id;
+  for (; i < cur->ndeleted; i++)
+    snap->deleted[snap->ndeleted++] = cur->deleted[i];
+  snap->size = cur->size - 1;
+  dyn_publish(index, snap);
+  lev_mutex_unlock(&index->write);
+
+  return 0;
+}
 
-  /* main */
-  while (1) {
-    /* step 2 (cover columns containing z*) */
-    {
-      size_t nc = 0;
-      for (j = 0; j < n1; j++) {
-        if (zstarc[j]) {
-          covc[j] = 1;
-          nc++;
-        }
-      }
-      if (nc == n1)
+/**
+ * lev_dynamic_index_compact:
+ * @index: A dynamic delete index.
+ * @full: Whether all indexed segments should be merged into one.
+ * @nthreads: The number of threads to use, zero means one per processor.
+ *
+ * Merges segments of @index, dropping deleted words.  Without @full, the
+ * newest segments are merged while they are not much smaller than the
+ * merged ones (so every word is merged a logarithmic number of times),
+ * together with segments having many deleted words.  Inserts, deletes and
+ * lookups can go on meanwhile, compaction is meant to run periodically in
+ * a background thread.
+ *
+ * Returns: Zero on success, -1 on failure (the index is unchanged).
+ **/
+int
+lev_dynamic_index_compact(LevDynamicIndex *index, int full, size_t nthreads)
+{
+  LevDynamicSnapshot *base, *cur, *snap;
+  LevDynSegment *merged = NULL;
+  char *selected;
+  size_t *ndead, *gone;
+  size_t nindexed, nsel, nseldead, ngone, nw, live, acc, i, j, t;
+  LevDynWord *w;
+
+  lev_mutex_lock(&index->compact);
+  base = lev_dynamic_index_snapshot(index);
+  nindexed = base->nsegments;
+  if (nindexed && !base->segments[nindexed - 1]->index)
+    nindexed--;
+  selected = (char*)calloc(nindexed + 1, sizeof(char));
+  ndead = (size_t*)calloc(nindexed + 1, sizeof(size_t));
+  gone = (size_t*)safe_malloc(base->ndeleted + 1, sizeof(size_t));
+  if (!selected || !ndead || !gone) {
+    free(selected);
+    free(ndead);
+    free(gone);
+    lev_dynamic_snapshot_release(base);
+    lev_mutex_unlock(&index->compact);
+    return -1;
+  }
+
+  /* choose the segments */
+  for (t = 0; t < base->ndeleted; t++) {
+    for (i = 0; i < nindexed; i++) {
+      if (dyn_find(base->segments[i]->n, base->segments[i]->ids,
+                   base->deleted[t]) != (size_t)(-1)) {
+        ndead[i]++;
         break;
-    }
-
-    /* step 3 (find uncovered zeroes) */
-    while (1) {
-      step_3:
-      /* search uncovered matrix entries */
-      for (j = 0; j < n1; j++) {
-        double *p = dists + j;
-        if (covc[j])
-          continue;
-        for (i = 0; i < n2; i++) {
-          if (!covr[i] && *p == 0.0) {
-            /* when a zero is found, prime it */
-            zprimer[i] = j + 1;
-            if (zstarr[i]) {
-              /* if there's a z* in the same row,
-               * uncover the column, cover the row and redo */
-              covr[i] = 1;
-              covc[zstarr[i] - 1] = 0;
-              goto step_3;
-            }
-            /* if there's no z*,
-             * we are at the end of our path an can convert z'
-             * to z* */
-            goto step_4;
-          }
-          p += n1;
-        }
-      }
-
-      /* step 5 (new zero manufacturer)
-       * we can't get here, unless no zero is found at all */
-      {
-        /* find the smallest uncovered entry */
-        double min = LEV_INFINITY;
-        for (j = 0; j < n1; j++) {
-          double *p = dists + j;
-          if (covc[j])
-            continue;
-          for (i = 0; i < n2; i++) {
-            if (!covr[i] && min > *p) {
-              min = *p;
-            }
-            p += n1;
-          }
-        }
-        /* add it to all covered rows */
-        for (i = 0; i < n2; i++) {
-          double *p = dists + i*n1;
-          if (!covr[i])
-            continue;
-          for (j = 0; j < n1; j++)
-            *(p++) += min;
-        }
-        /* subtract if from all uncovered columns */
-        for (j = 0; j < n1; j++) {
-          double *p = dists + j;
-          if (covc[j])
-            continue;
-          for (i = 0; i < n2; i++) {
-            *p -= min;
-            if (*p < LEV_EPSILON)
-              *p = 0.0;
-            p += n1;
-          }
-        }
       }
     }
-
-    /* step 4 (increment the number of z*)
-     * i is the row number (we get it from step 3) */
-    step_4:
-    i++;
-    do {
-      size_t x = i;
-
-      i--;
-      j = zprimer[i] - 1;  /* move to z' in the same row */
-      zstarr[i] = j + 1;   /* mark it as z* in row buffer */
-      i = zstarc[j];       /* move to z* in the same column */
-      zstarc[j] = x;       /* mark the z' as being new z* */
-    } while (i);
-    memset(zprimer, 0, n2*sizeof(size_t));
-    memset(covr, 0, n2*sizeof(size_t));
-    memset(covc, 0, n1*sizeof(size_t));
   }
+  live = acc = 0;
+  for (i = nindexed; i > 0; i--) {
+    size_t n = base->segments[i - 1]->n - ndead[i - 1];
+
+    if (!full && acc && n > 2*acc)
+      break;
+    selected[i - 1] = 1;
+    acc += n;
+  }
+  nsel = nseldead = 0;
+  for (i = 0; i < nindexed; i++) {
+    if (4*ndead[i] > base->segments[i]->n)
+      selected[i] = 1;
+    if (selected[i]) {
+      nsel++;
+      nseldead += ndead[i];
+      live += base->segments[i]->n - ndead[i];
+    }
+  }
+  if (nsel == 0 || (nsel == 1 && !nseldead)) {
+    free(selected);
+    free(ndead);
+    free(gone);
+    lev_dynamic_snapshot_release(base);
+    lev_mutex_unlock(&index->compact);
+    return 0;
+  }
+
+  /* merge them, unlocked */
+  w = (LevDynWord*)safe_malloc(live + 1, sizeof(LevDynWord));
+  if (!w) {
+    free(selected);
+    free(ndead);
+    free(gone);
+    lev_dynamic_snapshot_release(base);
+    lev_mutex_unlock(&index->compact);
+    return -1;
+  }
+  ngone = nw = 0;
+  for (i = 0; i < nindexed; i++) {
+    LevDynSegment *seg = base->segments[i];
+
+    if (!selected[i])
+      continue;
+    for (j = 0; j < seg->n; j++) {
+      if (dyn_find(base->ndeleted, base->deleted, seg->ids[j])
+          != (size_t)(-1)) {
+        gone[ngone++] = seg->ids[j];
+        continue;
+      }
+      w[nw].id = seg->ids[j];
+      w[nw].word = dyn_segment_word(seg, j, &w[nw].len);
+      nw++;
+    }
+  }
+  qsort(gone, ngone, sizeof(size_t), size_t_cmp);
+  qsort(w, nw, sizeof(LevDynWord), dyn_word_cmp);
+  if (nw) {
+    merged = dyn_segment_new(nw, w, 0, index->max_k, nthreads);
+    if (!merged) {
+      free(w);
+      free(selected);
+      free(ndead);
+      free(gone);
+      lev_dynamic_snapshot_release(base);
+      lev_mutex_unlock(&index->compact);
+      return -1;
+    }
+  }
+  free(w);
+
+  /* replace them in the current snapshot; only compactions remove indexed
+   * segments, so they are all still there */
+  lev_mutex_lock(&index->write);
+  cur = index->current;
+  snap = dyn_snapshot_alloc(index, cur->nsegments + 1, cur->ndeleted);
+  if (!snap) {
+    lev_mutex_unlock(&index->write);
+    if (merged)
+      dyn_segment_free(merged);
+    free(selected);
+    free(ndead);
+    free(gone);
+    lev_dynamic_snapshot_release(base);
+    lev_mutex_unlock(&index->compact);
+    return -1;
+  }
+  for (i = 0; i < cur->nsegments; i++) {
+    LevDynSegment *seg = cur->segments[i];
+
+    for (j = 0; j < nindexed; j++) {
+      if (selected[j] && base->segments[j] == seg)
+        break;
+    }
+    if (j < nindexed)
+      continue;
+    if (!seg->index && merged) {
+      snap->segments[snap->nsegments++] = merged;
+      merged = NULL;
+    }
+    snap->segments[snap->nsegments++] = seg;
+  }
+  if (merged)
+    snap->segments[snap->nsegments++] = merged;
+  for (i = 0; i < cur->ndeleted; i++) {
+    if (dyn_find(ngone, gone, cur->deleted[i]) == (size_t)(-1))
+      snap->deleted[snap->ndeleted++] = cur->deleted[i];
+  }
+  snap->size = cur->size;
+  dyn_publish(index, snap);
+  lev_mutex_unlock(&index->write);
 
-  free(dists);
-  free(covc);
-  free(covr);
-  /*free(zstarc);  this is the result */
-  free(zstarr);
-  free(zprimer);
+  free(selected);
+  free(ndead);
+  free(gone);
+  lev_dynamic_snapshot_release(base);
+  lev_mutex_unlock(&index->compact);
 
-  for (j = 0; j < n1; j++)
-    zstarc[j]--;
-  return zstarc;
+  return 0;
 }
-/* }}} */
 
-/****************************************************************************
+/**
+ * lev_dynamic_index_snapshot:
+ * @index: A dynamic delete index.
  *
- * Editops and other difflib-like stuff.
+ * Takes a snapshot of @index: the words it had at this moment, unaffected
+ * by later inserts and deletes.  It's cheap, nothing is copied.
  *
- ****************************************************************************/
-/* {{{ */
+ * Returns: The snapshot, to be released with lev_dynamic_snapshot_release().
+ **/
+LevDynamicSnapshot*
+lev_dynamic_index_snapshot(LevDynamicIndex *index)
+{
+  LevDynamicSnapshot *snap;
+
+  lev_mutex_lock(&index->lock);
+  snap = index->current;
+  snap->refs++;
+  lev_mutex_unlock(&index->lock);
+  return snap;
+}
 
 /**
- * lev_editops_check_errors:
- * @len1: The length of an eventual @ops source string.
- * @len2: The length of an eventual @ops destination string.
- * @n: The length of @ops.
- * @ops: An array of elementary edit operations.
+ * lev_dynamic_snapshot_release:
+ * @snap: A snapshot.
  *
- * Checks whether @ops is consistent and applicable as a partial edit from a
- * string of length @len1 to a string of length @len2.
- *
- * Returns: Zero if @ops seems OK, a nonzero error code otherwise.
+ * Releases a snapshot taken with lev_dynamic_index_snapshot().
  **/
-int
-lev_editops_check_errors(size_t len1, size_t len2,
-                         size_t n, const LevEditOp *ops)
+void
+lev_dynamic_snapshot_release(LevDynamicSnapshot *snap)
 {
-  const LevEditOp *o;
+  LevDynamicIndex *index = snap->owner;
   size_t i;
-
-  if (!n)
-    return LEV_EDIT_ERR_OK;
-
-  /* check bounds */
-  o = ops;
-  for (i = n; i; i--, o++) {
-    if (o->type >= LEV_EDIT_LAST)
-      return LEV_EDIT_ERR_TYPE;
-    if (o->spos > len1 || o->dpos > len2)
-      return LEV_EDIT_ERR_OUT;
-    if (o->spos == len1 && o->type != LEV_EDIT_INSERT)
-      return LEV_EDIT_ERR_OUT;
-    if (o->dpos == len2 && o->type != LEV_EDIT_DELETE)
-      return LEV_EDIT_ERR_OUT;
+  int last;
+
+  /* segments still used elsewhere are forgotten, the rest freed unlocked */
+  lev_mutex_lock(&index->lock);
+  last = !--snap->refs;
+  if (last) {
+    for (i = 0; i < snap->nsegments; i++) {
+      if (--snap->segments[i]->refs)
+        snap->segments[i] = NULL;
+    }
   }
-
-  /* check ordering */
-  o = ops + 1;
-  for (i = n - 1; i; i--, o++, ops++) {
-    if (o->spos < ops->spos || o->dpos < ops->dpos)
-      return LEV_EDIT_ERR_ORDER;
+  lev_mutex_unlock(&index->lock);
+  if (!last)
+    return;
+  for (i = 0; i < snap->nsegments; i++) {
+    if (snap->segments[i])
+      dyn_segment_free(snap->segments[i]);
   }
+  free(snap->segments);
+  free(snap->deleted);
+  free(snap);
+}
 
-  return LEV_EDIT_ERR_OK;
+/**
+ * lev_dynamic_snapshot_size:
+ * @snap: A snapshot.
+ *
+ * Returns: The number of words in @snap.
+ **/
+size_t
+lev_dynamic_snapshot_size(const LevDynamicSnapshot *snap)
+{
+  return snap->size;
 }
 
 /**
- * lev_opcodes_check_errors:
- * @len1: The length of an eventual @ops source string.
- * @len2: The length of an eventual @ops destination string.
- * @nb: The length of @bops.
- * @bops: An array of difflib block edit operation codes.
+ * lev_dynamic_snapshot_segments:
+ * @snap: A snapshot.
  *
- * Checks whether @bops is consistent and applicable as an edit from a
- * string of length @len1 to a string of length @len2.
+ * Returns: The number of segments @snap consists of.
+ **/
+size_t
+lev_dynamic_snapshot_segments(const LevDynamicSnapshot *snap)
+{
+  return snap->nsegments;
+}
+
+/**
+ * lev_dynamic_snapshot_word:
+ * @snap: A snapshot.
+ * @id: A word id.
+ * @len: Where the word length should be stored.
  *
- * Returns: Zero if @bops seems OK, a nonzero error code otherwise.
+ * Returns: The symbols of word @id, owned by @snap; %NULL if @snap doesn't
+ *          contain such word.
  **/
-int
-lev_opcodes_check_errors(size_t len1, size_t len2,
-                         size_t nb, const LevOpCode *bops)
+const uint32_t*
+lev_dynamic_snapshot_word(const LevDynamicSnapshot *snap, size_t id,
+                          size_t *len)
 {
-  const LevOpCode *b;
-  size_t i;
+  LevDynSegment *seg;
+  size_t pos;
 
-  if (!nb)
-    return 1;
+  seg = dyn_locate(snap, id, &pos);
+  return seg ? dyn_segment_word(seg, pos, len) : NULL;
+}
 
-  /* check completenes */
-  if (bops->sbeg || bops->dbeg
-      || bops[nb - 1].send != len1 || bops[nb - 1].dend != len2)
-    return LEV_EDIT_ERR_SPAN;
+/**
+ * lev_dynamic_snapshot_lookup:
+ * @snap: A snapshot.
+ * @len: The length of @query.
+ * @query: The word to look up.
+ * @max_k: The maximum distance, at most the max_k of the index.
+ * @nmatches: Where the number of matches should be stored.
+ *
+ * Finds the words of @snap within Levenshtein distance @max_k of @query.
+ * Any number of threads can look up concurrently.
+ *
+ * Returns: The matches (word ids and distances) sorted by the distance and
+ *          id, as a newly allocated array; %NULL on failure, in that case
+ *          @nmatches is set to (size_t)(-1).
+ **/
+LevDeleteMatch*
+lev_dynamic_snapshot_lookup(const LevDynamicSnapshot *snap,
+                            size_t len, const lev_wchar *query,
+                            size_t max_k, size_t *nmatches)
+{
+  LevDeleteMatch *matches = NULL;
+  size_t n = 0, i, j;
+  uint32_t *s = NULL;
+  LevDeleteQuery q;
+
+  q.row = NULL;
+  *nmatches = (size_t)(-1);
+  if (max_k > snap->owner->max_k)
+    max_k = snap->owner->max_k;
+  matches = (LevDeleteMatch*)safe_malloc(snap->size + 1,
+                                         sizeof(LevDeleteMatch));
+  s = (uint32_t*)safe_malloc(len + 1, sizeof(uint32_t));
+  if (!matches || !s) {
+    free(matches);
+    free(s);
+    return NULL;
+  }
+  for (j = 0; j < len; j++)
+    s[j] = (uint32_t)query[j];
 
-  /* check bounds and block consistency */
-  b = bops;
-  for (i = nb; i; i--, b++) {
-    if (b->send > len1 || b->dend > len2)
-      return LEV_EDIT_ERR_OUT;
-    switch (b->type) {
-      case LEV_EDIT_KEEP:
-      case LEV_EDIT_REPLACE:
-      if (b->dend - b->dbeg != b->send - b->sbeg || b->dend == b->dbeg)
-        return LEV_EDIT_ERR_BLOCK;
-      break;
+  for (i = 0; i < snap->nsegments; i++) {
+    const LevDynSegment *seg = snap->segments[i];
+    LevDeleteMatch *found;
+    size_t nfound;
 
-      case LEV_EDIT_INSERT:
-      if (b->dend - b->dbeg == 0 || b->send - b->sbeg != 0)
-        return LEV_EDIT_ERR_BLOCK;
-      break;
+    if (seg->index) {
+      found = lev_delete_index_lookup(seg->index, len, query, max_k, &nfound);
+      if (nfound == (size_t)(-1))
+        goto fail;
+      for (j = 0; j < nfound; j++) {
+        size_t id = seg->ids[found[j].id];
 
-      case LEV_EDIT_DELETE:
-      if (b->send - b->sbeg == 0 || b->dend - b->dbeg != 0)
-        return LEV_EDIT_ERR_BLOCK;
-      break;
+        if (dyn_find(snap->ndeleted, snap->deleted, id) != (size_t)(-1))
+          continue;
+        matches[n].id = id;
+        matches[n].distance = found[j].distance;
+        n++;
+      }
+      free(found);
+      continue;
+    }
 
-      default:
-      return LEV_EDIT_ERR_TYPE;
-      break;
+    /* the flat segment, verified by the bounded kernel */
+    if (didx_query_init(&q, len, s, seg->maxlen))
+      goto fail;
+    for (j = 0; j < seg->n; j++) {
+      size_t wlen, d;
+      const uint32_t *word = dyn_segment_word(seg, j, &wlen);
+
+      d = didx_query_distance(&q, wlen, word, max_k);
+      if (d <= max_k) {
+        matches[n].id = seg->ids[j];
+        matches[n].distance = d;
+        n++;
+      }
     }
+    didx_query_free(&q);
   }
+  free(s);
+  qsort(matches, n, sizeof(LevDeleteMatch), dyn_match_cmp);
+  *nmatches = n;
 
-  /* check ordering */
-  b = bops + 1;
-  for (i = nb - 1; i; i--, b++, bops++) {
-    if (b->sbeg != bops->send || b->dbeg != bops->dend)
-      return LEV_EDIT_ERR_ORDER;
-  }
+  return matches;
 
-  return LEV_EDIT_ERR_OK;
+fail:
+  free(matches);
+  free(s);
+  didx_query_free(&q);
+  return NULL;
 }
+/* }}} */
 
-/**
- * lev_editops_invert:
- * @n: The length of @ops.
- * @ops: An array of elementary edit operations.
+/****************************************************************************
  *
- * Inverts the sense of @ops.  It is modified in place.
+ * Edit distance sketches
  *
- * In other words, @ops becomes a valid partial edit for the original source
- * and destination strings with their roles exchanged.
+ ****************************************************************************/
+/* {{{ */
+
+/* CGK randomized embedding (Chakraborty, Goldenberg, Koucky: Streaming
+ * algorithms for embedding and computing edit distance in the low distance
+ * regime, STOC 2016).  A pointer walks the string; at each output position
+ * the current symbol is written and the pointer advances or not, depending
+ * on a random bit for the (position, symbol) pair.  Two strings at edit
+ * distance k then have embeddings at Hamming distance between k/2 and
+ * O(k^2) with good probability, and usually much closer to the former.
+ * Several independent embeddings (repetitions) are concatenated to reduce
+ * the variance.
+ *
+ * Sketch symbols are bytes, Unicode symbols are hashed to them. */
+
+/* the random bit for output position @j and symbol @c */
+static int
+cgk_bit(uint64_t seed, size_t j, uint64_t c)
+{
+  uint64_t x = seed + 0x9e3779b97f4a7c15ULL*((uint64_t)j + 1)
+               + 0xc2b2ae3d27d4eb4fULL*c;
+
+  x = (x ^ (x >> 31))*0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 29))*0x94d049bb133111ebULL;
+  return (int)((x >> 32) & 1);
+}
+
+static lev_byte
+cgk_symbol(lev_wchar c)
+{
+  uint64_t x = (uint64_t)c*(uint64_t)0x9e3779b97f4a7c15ULL;
+
+  return (lev_byte)(x >> 56);
+}
+
+/**
+ * lev_cgk_sketch:
+ * @len: The length of @string.
+ * @string: A string.
+ * @length: The length of one embedding.
+ * @reps: The number of independent embeddings.
+ * @seed: The random seed, sketches are comparable only when made with
+ *        the same @length, @reps and @seed.
+ * @sketch: Where the sketch should be stored, it must have room for
+ *          @length * @reps bytes.
+ *
+ * Computes a CGK edit distance sketch of @string.  The Hamming distance of
+ * two sketches (see lev_sketch_hamming()) approximates the edit distance of
+ * the strings.  @length should be about three times the typical string
+ * length, longer strings are only partially represented.
  **/
 void
-lev_editops_invert(size_t n, LevEditOp *ops)
+lev_cgk_sketch(size_t len, const lev_byte *string,
+               size_t length, size_t reps, uint64_t seed,
+               lev_byte *sketch)
 {
-  size_t i;
+  size_t r, i, j;
 
-  for (i = n; i; i--, ops++) {
-    size_t z;
+  for (r = 0; r < reps; r++) {
+    uint64_t rseed = seed + 0x632be59bd9b4e019ULL*r;
 
-    z = ops->dpos;
-    ops->dpos = ops->spos;
-    ops->spos = z;
-    if (ops->type & 2)
-      ops->type = (LevEditType)(ops->type ^ 1);
+    for (i = j = 0; j < length && i < len; j++) {
+      lev_byte c = string[i];
+      *(sketch++) = c;
+      i += (size_t)cgk_bit(rseed, j, c);
+    }
+    memset(sketch, 0, length - j);
+    sketch += length - j;
   }
 }
 
 /**
- * lev_editops_apply:
- * @len1: The length of @string1.
- * @string1: A string of length @len1, may contain NUL characters.
- * @len2: The length of @string2.
- * @string2: A string of length @len2, may contain NUL characters.
- * @n: The size of @ops.
- * @ops: An array of elementary edit operations.
- * @len: Where the size of the resulting string should be stored.
+ * lev_u_cgk_sketch:
+ * @len: The length of @string.
+ * @string: A string.
+ * @length: The length of one embedding.
+ * @reps: The number of independent embeddings.
+ * @seed: The random seed, sketches are comparable only when made with
+ *        the same @length, @reps and @seed.
+ * @sketch: Where the sketch should be stored, it must have room for
+ *          @length * @reps bytes.
  *
- * Applies a partial edit @ops from @string1 to @string2.
+ * Computes a CGK edit distance sketch of @string.
  *
- * NB: @ops is not checked for applicability.
+ * See lev_cgk_sketch() for details.  Sketches of strings consisting only of
+ * symbols below 0x100 differ from the byte ones, don't mix them.
+ **/
+void
+lev_u_cgk_sketch(size_t len, const lev_wchar *string,
+                 size_t length, size_t reps, uint64_t seed,
+                 lev_byte *sketch)
+{
+  size_t r, i, j;
+
+  for (r = 0; r < reps; r++) {
+    uint64_t rseed = seed + 0x632be59bd9b4e019ULL*r;
+
+    for (i = j = 0; j < length && i < len; j++) {
+      lev_wchar c = string[i];
+      *(sketch++) = cgk_symbol(c);
+      i += (size_t)cgk_bit(rseed, j, (uint64_t)c);
+    }
+    memset(sketch, 0, length - j);
+    sketch += length - j;
+  }
+}
+
+/**
+ * lev_sketch_hamming:
+ * @size: The size of the sketches.
+ * @sketch1: A sketch.
+ * @sketch2: Another sketch.
  *
- * Returns: The result of the partial edit as a newly allocated string, its
- *          length is stored in @len.
+ * Returns: The Hamming distance of the sketches.
  **/
-lev_byte*
-lev_editops_apply(size_t len1, const lev_byte *string1,
-                  size_t len2, const lev_byte *string2,
-                  size_t n, const LevEditOp *ops,
-                  size_t *len)
+size_t
+lev_sketch_hamming(size_t size, const lev_byte *sketch1,
+                   const lev_byte *sketch2)
 {
-  lev_byte *dst, *dpos;  /* destination string */
-  const lev_byte *spos;  /* source string position */
-  size_t i, j;
-  LEV_UNUSED(len2);
+  size_t i, d = 0;
 
-  /* this looks too complex for such a simple task, but note ops is not
-   * a complete edit sequence, we have to be able to apply anything anywhere */
-  dpos = dst = (lev_byte*)safe_malloc((n + len1), sizeof(lev_byte));
-  if (!dst) {
-    *len = (size_t)(-1);
-    return NULL;
+  /* blocks with a narrow counter are what the compilers vectorize best */
+  while (size) {
+    size_t block = size < 0xff ? size : 0xff;
+    lev_byte bd = 0;
+
+    for (i = 0; i < block; i++)
+      bd = (lev_byte)(bd + (sketch1[i] != sketch2[i]));
+    d += bd;
+    sketch1 += block;
+    sketch2 += block;
+    size -= block;
   }
-  spos = string1;
-  for (i = n; i; i--, ops++) {
-    /* XXX: this fine with gcc internal memcpy, but when memcpy is
-     * actually a function, it may be pretty slow */
-    j = ops->spos - (size_t)(spos - string1) + (ops->type == LEV_EDIT_KEEP);
-    if (j) {
-      memcpy(dpos, spos, j*sizeof(lev_byte));
-      spos += j;
-      dpos += j;
-    }
-    switch (ops->type) {
-    case LEV_EDIT_DELETE:
-      spos++;
-      break;
+  return d;
+}
+
+typedef struct {
+  size_t n;
+  const size_t *lengths;
+  const void *strings;
+  int unicode;
+  size_t length;
+  size_t reps;
+  uint64_t seed;
+  lev_byte *sketches;
+} LevSketchBatch;
+
+static void
+sketch_batch_worker(void *data, size_t ithread, size_t nthreads)
+{
+  LevSketchBatch *batch = (LevSketchBatch*)data;
+  size_t size = batch->length*batch->reps;
+  size_t i;
+
+  for (i = batch->n*ithread/nthreads; i < batch->n*(ithread + 1)/nthreads; i++) {
+    if (!(i % LEV_SCHED_GRAIN))
+      lev_sched_checkpoint(ithread);
+    if (batch->unicode)
+      lev_u_cgk_sketch(batch->lengths[i],
+                       ((const lev_wchar**)batch->strings)[i],
+                       batch->length, batch->reps, batch->seed,
+                       batch->sketches + i*size);
+    else
+      lev_cgk_sketch(batch->lengths[i],
+                     ((const lev_byte**)batch->strings)[i],
+                     batch->length, batch->reps, batch->seed,
+                     batch->sketches + i*size);
+  }
+}
+
+/**
+ * lev_cgk_sketch_batch:
+ * @n: The number of strings.
+ * @lengths: The lengths of @strings.
+ * @strings: The strings.
+ * @length: The length of one embedding.
+ * @reps: The number of independent embeddings.
+ * @seed: The random seed.
+ * @nthreads: The number of threads to use, zero means one per processor.
+ * @sketches: Where the sketches should be stored, it must have room for
+ *            @n * @length * @reps bytes.
+ *
+ * Computes sketches of many strings at once, see lev_cgk_sketch().
+ **/
+void
+lev_cgk_sketch_batch(size_t n, const size_t *lengths,
+                     const lev_byte *strings[],
+                     size_t length, size_t reps, uint64_t seed,
+                     size_t nthreads, lev_byte *sketches)
+{
+  LevSketchBatch batch = { n, lengths, strings, 0, length, reps, seed,
+                           sketches };
+
+  if (!nthreads)
+    nthreads = lev_cpu_count();
+  if (nthreads > n/lev_tuning.sketch_chunk + 1)
+    nthreads = n/lev_tuning.sketch_chunk + 1;
+  lev_run_parallel(nthreads, sketch_batch_worker, &batch);
+}
+
+/**
+ * lev_u_cgk_sketch_batch:
+ * @n: The number of strings.
+ * @lengths: The lengths of @strings.
+ * @strings: The strings.
+ * @length: The length of one embedding.
+ * @reps: The number of independent embeddings.
+ * @seed: The random seed.
+ * @nthreads: The number of threads to use, zero means one per processor.
+ * @sketches: Where the sketches should be stored, it must have room for
+ *            @n * @length * @reps bytes.
+ *
+ * Computes sketches of many strings at once, see lev_u_cgk_sketch().
+ **/
+void
+lev_u_cgk_sketch_batch(size_t n, const size_t *lengths,
+                       const lev_wchar *strings[],
+                       size_t length, size_t reps, uint64_t seed,
+                       size_t nthreads, lev_byte *sketches)
+{
+  LevSketchBatch batch = { n, lengths, strings, 1, length, reps, seed,
+                           sketches };
+
+  if (!nthreads)
+    nthreads = lev_cpu_count();
+  if (nthreads > n/lev_tuning.sketch_chunk + 1)
+    nthreads = n/lev_tuning.sketch_chunk + 1;
+  lev_run_parallel(nthreads, sketch_batch_worker, &batch);
+}
 
-    case LEV_EDIT_REPLACE:
-      spos++;
-      *(dpos++) = string2[ops->dpos];
-      break;
-    case LEV_EDIT_INSERT:
-      *(dpos++) = string2[ops->dpos];
-      break;
+/* the nearest sketches search, every thread keeps a max-heap of the best
+ * matches in its range */
+typedef struct {
+  size_t size;
+  const lev_byte *query;
+  size_t n;
+  const lev_byte *sketches;
+  size_t count;
+  LevSketchMatch *heaps;  /* count items per thread */
+  size_t *nheaps;
+} LevSketchNearest;
+
+/* whether match @a is worse than match @b */
+static int
+sketch_match_worse(const LevSketchMatch *a, const LevSketchMatch *b)
+{
+  return a->distance > b->distance
+         || (a->distance == b->distance && a->id > b->id);
+}
 
-    default:
-      break;
+static void
+sketch_heap_push(LevSketchMatch *heap, size_t *n, size_t count,
+                 LevSketchMatch m)
+{
+  size_t i;
+
+  if (*n == count) {
+    /* replace the worst one, if m is better, and sift down */
+    if (!sketch_match_worse(heap, &m))
+      return;
+    i = 0;
+    while (2*i + 1 < count) {
+      size_t c = 2*i + 1;
+      if (c + 1 < count && sketch_match_worse(heap + c + 1, heap + c))
+        c++;
+      if (!sketch_match_worse(heap + c, &m))
+        break;
+      heap[i] = heap[c];
+      i = c;
     }
+    heap[i] = m;
+    return;
   }
-  j = len1 - (size_t)(spos - string1);
-  if (j) {
-    memcpy(dpos, spos, j*sizeof(lev_byte));
-    spos += j;
-    dpos += j;
+  /* sift up */
+  i = (*n)++;
+  while (i && sketch_match_worse(&m, heap + (i - 1)/2)) {
+    heap[i] = heap[(i - 1)/2];
+    i = (i - 1)/2;
   }
+  heap[i] = m;
+}
 
-  *len = (size_t)(dpos - dst);
-  /* possible realloc failure is detected with *len != 0 */
-  return (lev_byte*)realloc(dst, *len*sizeof(lev_byte));
+static void
+sketch_nearest_worker(void *data, size_t ithread, size_t nthreads)
+{
+  LevSketchNearest *nearest = (LevSketchNearest*)data;
+  LevSketchMatch *heap = nearest->heaps + ithread*nearest->count;
+  size_t n = 0;
+  size_t i;
+
+  for (i = nearest->n*ithread/nthreads;
+       i < nearest->n*(ithread + 1)/nthreads;
+       i++) {
+    LevSketchMatch m;
+
+    if (!(i % LEV_SCHED_GRAIN))
+      lev_sched_checkpoint(ithread);
+    m.id = i;
+    m.distance = lev_sketch_hamming(nearest->size, nearest->query,
+                                    nearest->sketches + i*nearest->size);
+    sketch_heap_push(heap, &n, nearest->count, m);
+  }
+  nearest->nheaps[ithread] = n;
+}
+
+static int
+sketch_match_cmp(const void *a, const void *b)
+{
+  const LevSketchMatch *x = (const LevSketchMatch*)a;
+  const LevSketchMatch *y = (const LevSketchMatch*)b;
+
+  if (x->distance != y->distance)
+    return x->distance < y->distance ? -1 : 1;
+  return (x->id > y->id) - (x->id < y->id);
 }
 
 /**
- * lev_u_editops_apply:
- * @len1: The length of @string1.
- * @string1: A string of length @len1, may contain NUL characters.
- * @len2: The length of @string2.
- * @string2: A string of length @len2, may contain NUL characters.
- * @n: The size of @ops.
- * @ops: An array of elementary edit operations.
- * @len: Where the size of the resulting string should be stored.
+ * lev_sketch_nearest:
+ * @size: The size of one sketch.
+ * @query: The query sketch.
+ * @n: The number of sketches in @sketches.
+ * @sketches: The sketches to search, stored contiguously.
+ * @count: The number of nearest sketches to find.
+ * @nthreads: The number of threads to use, zero means one per processor.
+ * @nmatches: Where the number of found sketches should be stored.
  *
- * Applies a partial edit @ops from @string1 to @string2.
+ * Finds the @count sketches nearest to @query in Hamming distance.
  *
- * NB: @ops is not checked for applicability.
+ * Returns: The matches (with the Hamming distances), sorted by distance and
+ *          index, as a newly allocated array; %NULL on failure, in that case
+ *          @nmatches is set to (size_t)(-1).
+ **/
+LevSketchMatch*
+lev_sketch_nearest(size_t size, const lev_byte *query,
+                   size_t n, const lev_byte *sketches,
+                   size_t count, size_t nthreads, size_t *nmatches)
+{
+  LevSketchNearest nearest;
+  LevSketchMatch *matches;
+  size_t t, m;
+
+  *nmatches = (size_t)(-1);
+  if (count > n)
+    count = n;
+  if (!nthreads)
+    nthreads = lev_cpu_count();
+  if (nthreads > n/lev_tuning.nearest_chunk + 1)
+    nthreads = n/lev_tuning.nearest_chunk + 1;
+
+  nearest.size = size;
+  nearest.query = query;
+  nearest.n = n;
+  nearest.sketches = sketches;
+  nearest.count = count;
+  nearest.heaps = (LevSketchMatch*)safe_malloc_3(nthreads, count + 1,
+                                                 sizeof(LevSketchMatch));
+  nearest.nheaps = (size_t*)safe_malloc(nthreads, sizeof(size_t));
+  if (!nearest.heaps || !nearest.nheaps) {
+    free(nearest.heaps);
+    free(nearest.nheaps);
+    return NULL;
+  }
+  lev_run_parallel(nthreads, sketch_nearest_worker, &nearest);
+
+  /* merge the per-thread heaps */
+  m = 0;
+  for (t = 0; t < nthreads; t++) {
+    memmove(nearest.heaps + m, nearest.heaps + t*count,
+            nearest.nheaps[t]*sizeof(LevSketchMatch));
+    m += nearest.nheaps[t];
+  }
+  free(nearest.nheaps);
+  qsort(nearest.heaps, m, sizeof(LevSketchMatch), sketch_match_cmp);
+  if (m > count)
+    m = count;
+  matches = (LevSketchMatch*)realloc(nearest.heaps,
+                                     (m + 1)*sizeof(LevSketchMatch));
+  if (!matches)
+    matches = nearest.heaps;
+  *nmatches = m;
+
+  return matches;
+}
+
+/**
+ * lev_sketch_rerank:
+ * @len: The length of @string.
+ * @string: The query string.
+ * @lengths: The lengths of @strings.
+ * @strings: The candidate strings.
+ * @n: The number of matches in @matches.
+ * @cache: A distance cache to use, or %NULL.
+ * @matches: The candidates, e.g. found by lev_sketch_nearest().
  *
- * Returns: The result of the partial edit as a newly allocated string, its
- *          length is stored in @len.
+ * Replaces the distances in @matches with the exact Levenshtein distances
+ * of @string and the candidate strings and sorts @matches by them.
  **/
-lev_wchar*
-lev_u_editops_apply(size_t len1, const lev_wchar *string1,
-                    size_t len2, const lev_wchar *string2,
-                    size_t n, const LevEditOp *ops,
-                    size_t *len)
+void
+lev_sketch_rerank(size_t len, const lev_byte *string,
+                  const size_t *lengths, const lev_byte *strings[],
+                  size_t n, LevDistanceCache *cache,
+                  LevSketchMatch *matches)
 {
-  lev_wchar *dst, *dpos;  /* destination string */
-  const lev_wchar *spos;  /* source string position */
-  size_t i, j;
-  LEV_UNUSED(len2);
+  size_t i;
 
-  /* this looks too complex for such a simple task, but note ops is not
-   * a complete edit sequence, we have to be able to apply anything anywhere */
-  dpos = dst = (lev_wchar*)safe_malloc((n + len1), sizeof(lev_wchar));
-  if (!dst) {
-    *len = (size_t)(-1);
-    return NULL;
+  for (i = 0; i < n; i++) {
+    size_t id = matches[i].id;
+    matches[i].distance = dcache_edit_distance(cache, len, string,
+                                               lengths[id], strings[id]);
   }
-  spos = string1;
-  for (i = n; i; i--, ops++) {
-    /* XXX: this is fine with gcc internal memcpy, but when memcpy is
-     * actually a function, it may be pretty slow */
-    j = ops->spos - (size_t)(spos - string1) + (ops->type == LEV_EDIT_KEEP);
-    if (j) {
-      memcpy(dpos, spos, j*sizeof(lev_wchar));
-      spos += j;
-      dpos += j;
-    }
-    switch (ops->type) {
-    case LEV_EDIT_DELETE:
-      spos++;
-      break;
+  qsort(matches, n, sizeof(LevSketchMatch), sketch_match_cmp);
+}
 
-    case LEV_EDIT_REPLACE:
-      spos++;
-      *(dpos++) = string2[ops->dpos];
-      break;
-    case LEV_EDIT_INSERT:
-      *(dpos++) = string2[ops->dpos];
-      break;
+/**
+ * lev_u_sketch_rerank:
+ * @len: The length of @string.
+ * @string: The query string.
+ * @lengths: The lengths of @strings.
+ * @strings: The candidate strings.
+ * @n: The number of matches in @matches.
+ * @cache: A distance cache to use, or %NULL.
+ * @matches: The candidates, e.g. found by lev_sketch_nearest().
+ *
+ * Replaces the distances in @matches with the exact Levenshtein distances
+ * of @string and the candidate strings and sorts @matches by them.
+ **/
+void
+lev_u_sketch_rerank(size_t len, const lev_wchar *string,
+                    const size_t *lengths, const lev_wchar *strings[],
+                    size_t n, LevDistanceCache *cache,
+                    LevSketchMatch *matches)
+{
+  size_t i;
 
-    default:
-      break;
-    }
+  for (i = 0; i < n; i++) {
+    size_t id = matches[i].id;
+    matches[i].distance = dcache_u_edit_distance(cache, len, string,
+                                                 lengths[id], strings[id]);
   }
-  j = len1 - (size_t)(spos - string1);
-  if (j) {
-    memcpy(dpos, spos, j*sizeof(lev_wchar));
-    spos += j;
-    dpos += j;
+  qsort(matches, n, sizeof(LevSketchMatch), sketch_match_cmp);
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Quick ratios
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/* difflib's quick_ratio(): the ratio computed from the number of symbols
+ * the strings have in common regardless of order, i.e. the size of the
+ * intersection of the symbol multisets.  It's an upper bound of the
+ * ratio() of the strings. */
+
+static double
+quick_ratio_value(size_t matches, size_t len1, size_t len2)
+{
+  if (!len1 && !len2)
+    return 1.0;
+  return 2.0*(double)matches/(double)(len1 + len2);
+}
+
+/* count matches of @string against byte symbol counts @avail, which is
+ * restored from @hist afterwards */
+static size_t
+quick_ratio_matches(size_t *avail, const size_t *hist,
+                    size_t len, const lev_byte *string)
+{
+  size_t i, matches = 0;
+
+  for (i = 0; i < len; i++) {
+    lev_byte c = string[i];
+    if (avail[c]) {
+      avail[c]--;
+      matches++;
+    }
   }
+  for (i = 0; i < len; i++)
+    avail[string[i]] = hist[string[i]];
 
-  *len = (size_t)(dpos - dst);
-  /* possible realloc failure is detected with *len != 0 */
-  return (lev_wchar*)realloc(dst, *len*sizeof(lev_wchar));
+  return matches;
 }
 
 /**
- * editops_from_cost_matrix:
+ * lev_quick_ratio:
  * @len1: The length of @string1.
- * @string1: A string of length @len1, may contain NUL characters.
- * @o1: The offset where the matrix starts from the start of @string1.
+ * @string1: A sequence of bytes of length @len1, may contain NUL characters.
  * @len2: The length of @string2.
- * @string2: A string of length @len2, may contain NUL characters.
- * @o2: The offset where the matrix starts from the start of @string2.
- * @matrix: The cost matrix.
- * @n: Where the number of edit operations should be stored.
+ * @string2: A sequence of bytes of length @len2, may contain NUL characters.
  *
- * Reconstructs the optimal edit sequence from the cost matrix @matrix.
+ * Computes an upper bound of the similarity ratio of two strings from their
+ * symbol histograms only (difflib's quick_ratio()).
  *
- * The matrix is freed.
+ * Returns: The upper bound, a number between 0 and 1.
+ **/
+double
+lev_quick_ratio(size_t len1, const lev_byte *string1,
+                size_t len2, const lev_byte *string2)
+{
+  size_t hist[0x100], avail[0x100];
+  size_t i;
+
+  memset(hist, 0, 0x100*sizeof(size_t));
+  for (i = 0; i < len1; i++)
+    hist[string1[i]]++;
+  memcpy(avail, hist, 0x100*sizeof(size_t));
+
+  return quick_ratio_value(quick_ratio_matches(avail, hist, len2, string2),
+                           len1, len2);
+}
+
+/**
+ * lev_quick_ratio_batch:
+ * @len: The length of @string.
+ * @string: A sequence of bytes of length @len, may contain NUL characters.
+ * @n: The number of strings in @strings.
+ * @lengths: The lengths of @strings.
+ * @strings: The strings to compare @string with.
+ * @ratios: Where the @n quick ratios should be stored.
  *
- * Returns: The optimal edit sequence, as a newly allocated array of
- *          elementary edit operations, it length is stored in @n.
+ * Computes lev_quick_ratio() of @string and each of @strings, the histogram
+ * of @string is made only once.
  **/
-static LevEditOp*
-editops_from_cost_matrix(size_t len1, const lev_byte *string1, size_t off1,
-                         size_t len2, const lev_byte *string2, size_t off2,
-                         size_t *matrix, size_t *n)
+void
+lev_quick_ratio_batch(size_t len, const lev_byte *string,
+                      size_t n, const size_t *lengths,
+                      const lev_byte *strings[], double *ratios)
 {
-  size_t *p;
-  size_t i, j, pos;
-  LevEditOp *ops;
-  int dir = 0;
+  size_t hist[0x100], avail[0x100];
+  size_t i;
 
-  pos = *n = matrix[len1*len2 - 1];
-  if (!*n) {
-    free(matrix);
-    return NULL;
-  }
-  ops = (LevEditOp*)safe_malloc((*n), sizeof(LevEditOp));
-  if (!ops) {
-    free(matrix);
-    *n = (size_t)(-1);
-    return NULL;
-  }
-  i = len1 - 1;
-  j = len2 - 1;
-  p = matrix + len1*len2 - 1;
-  while (i || j) {
-    /* prefer contiuning in the same direction */
-    if (dir < 0 && j && *p == *(p - 1) + 1) {
-      pos--;
-      ops[pos].type = LEV_EDIT_INSERT;
-      ops[pos].spos = i + off1;
-      ops[pos].dpos = --j + off2;
-      p--;
-      continue;
-    }
-    if (dir > 0 && i && *p == *(p - len2) + 1) {
-      pos--;
-      ops[pos].type = LEV_EDIT_DELETE;
-      ops[pos].spos = --i + off1;
-      ops[pos].dpos = j + off2;
-      p -= len2;
-      continue;
-    }
-    if (i && j && *p == *(p - len2 - 1)
-        && string1[i - 1] == string2[j - 1]) {
-      /* don't be stupid like difflib, don't store LEV_EDIT_KEEP */
-      i--;
-      j--;
-      p -= len2 + 1;
-      dir = 0;
-      continue;
-    }
-    if (i && j && *p == *(p - len2 - 1) + 1) {
-      pos--;
-      ops[pos].type = LEV_EDIT_REPLACE;
-      ops[pos].spos = --i + off1;
-      ops[pos].dpos = --j + off2;
-      p -= len2 + 1;
-      dir = 0;
-      continue;
-    }
-    /* we cant't turn directly from -1 to 1, in this case it would be better
-     * to go diagonally, but check it (dir == 0) */
-    if (dir == 0 && j && *p == *(p - 1) + 1) {
-      pos--;
-      ops[pos].type = LEV_EDIT_INSERT;
-      ops[pos].spos = i + off1;
-      ops[pos].dpos = --j + off2;
-      p--;
-      dir = -1;
-      continue;
-    }
-    if (dir == 0 && i && *p == *(p - len2) + 1) {
-      pos--;
-      ops[pos].type = LEV_EDIT_DELETE;
-      ops[pos].spos = --i + off1;
-      ops[pos].dpos = j + off2;
-      p -= len2;
-      dir = 1;
-      continue;
+  memset(hist, 0, 0x100*sizeof(size_t));
+  for (i = 0; i < len; i++)
+    hist[string[i]]++;
+  memcpy(avail, hist, 0x100*sizeof(size_t));
+
+  for (i = 0; i < n; i++)
+    ratios[i] = quick_ratio_value(quick_ratio_matches(avail, hist, lengths[i],
+                                                      strings[i]),
+                                  len, lengths[i]);
+}
+
+/* sparse histogram of a Unicode string, an open addressing hash table at
+ * most half full; slots with zero hist are empty */
+typedef struct {
+  size_t mask;
+  lev_wchar *keys;
+  size_t *hist;
+  size_t *avail;
+} LevUHistogram;
+
+static size_t
+uhist_slot(const LevUHistogram *h, lev_wchar c)
+{
+  size_t i = ((size_t)c*0x9e3779b1U) & h->mask;
+
+  while (h->hist[i] && h->keys[i] != c)
+    i = (i + 1) & h->mask;
+  return i;
+}
+
+/* returns zero on failure */
+static int
+uhist_init(LevUHistogram *h, size_t len, const lev_wchar *string)
+{
+  size_t size = 16, i;
+
+  while (size < 2*len)
+    size *= 2;
+  h->mask = size - 1;
+  h->keys = (lev_wchar*)safe_malloc(size, sizeof(lev_wchar));
+  h->hist = (size_t*)calloc(size, sizeof(size_t));
+  h->avail = (size_t*)safe_malloc(size, sizeof(size_t));
+  if (!h->keys || !h->hist || !h->avail) {
+    free(h->keys);
+    free(h->hist);
+    free(h->avail);
+    return 0;
+  }
+  for (i = 0; i < len; i++) {
+    size_t j = uhist_slot(h, string[i]);
+    h->keys[j] = string[i];
+    h->hist[j]++;
+  }
+  memcpy(h->avail, h->hist, size*sizeof(size_t));
+  return 1;
+}
+
+static void
+uhist_free(LevUHistogram *h)
+{
+  free(h->keys);
+  free(h->hist);
+  free(h->avail);
+}
+
+/* the Unicode counterpart of quick_ratio_matches() */
+static size_t
+uhist_matches(LevUHistogram *h, size_t len, const lev_wchar *string)
+{
+  size_t i, matches = 0;
+
+  for (i = 0; i < len; i++) {
+    size_t j = uhist_slot(h, string[i]);
+    if (h->avail[j]) {
+      h->avail[j]--;
+      matches++;
     }
-    /* coredump right now, later might be too late ;-) */
-    assert("lost in the cost matrix" == NULL);
   }
-  free(matrix);
+  for (i = 0; i < len; i++) {
+    size_t j = uhist_slot(h, string[i]);
+    h->avail[j] = h->hist[j];
+  }
 
-  return ops;
+  return matches;
 }
 
 /**
- * lev_editops_find:
+ * lev_u_quick_ratio:
  * @len1: The length of @string1.
- * @string1: A string of length @len1, may contain NUL characters.
+ * @string1: A sequence of Unicode characters of length @len1, may contain NUL
+ *           characters.
  * @len2: The length of @string2.
- * @string2: A string of length @len2, may contain NUL characters.
- * @n: Where the number of edit operations should be stored.
+ * @string2: A sequence of Unicode characters of length @len2, may contain NUL
+ *           characters.
  *
- * Find an optimal edit sequence from @string1 to @string2.
+ * Computes an upper bound of the similarity ratio of two strings from their
+ * symbol histograms only (difflib's quick_ratio()).
  *
- * When there's more than one optimal sequence, a one is arbitrarily (though
- * deterministically) chosen.
+ * Returns: The upper bound, a number between 0 and 1; -1.0 on failure.
+ **/
+double
+lev_u_quick_ratio(size_t len1, const lev_wchar *string1,
+                  size_t len2, const lev_wchar *string2)
+{
+  LevUHistogram h;
+  double r;
+
+  /* hash the shorter one */
+  if (len1 > len2) {
+    const lev_wchar *s = string1;
+    size_t l = len1;
+    string1 = string2;
+    len1 = len2;
+    string2 = s;
+    len2 = l;
+  }
+  if (!uhist_init(&h, len1, string1))
+    return -1.0;
+  r = quick_ratio_value(uhist_matches(&h, len2, string2), len1, len2);
+  uhist_free(&h);
+
+  return r;
+}
+
+/**
+ * lev_u_quick_ratio_batch:
+ * @len: The length of @string.
+ * @string: A sequence of Unicode characters of length @len, may contain NUL
+ *          characters.
+ * @n: The number of strings in @strings.
+ * @lengths: The lengths of @strings.
+ * @strings: The strings to compare @string with.
+ * @ratios: Where the @n quick ratios should be stored.
  *
- * Returns: The optimal edit sequence, as a newly allocated array of
- *          elementary edit operations, it length is stored in @n.
- *          It is normalized, i.e., keep operations are not included.
+ * Computes lev_u_quick_ratio() of @string and each of @strings, the
+ * histogram of @string is made only once.
+ *
+ * Returns: Zero on success, -1 on failure.
  **/
-LevEditOp*
-lev_editops_find(size_t len1, const lev_byte *string1,
-                 size_t len2, const lev_byte *string2,
-                 size_t *n)
+int
+lev_u_quick_ratio_batch(size_t len, const lev_wchar *string,
+                        size_t n, const size_t *lengths,
+                        const lev_wchar *strings[], double *ratios)
 {
-  size_t len1o, len2o;
+  LevUHistogram h;
   size_t i;
-  size_t *matrix; /* cost matrix */
 
-  /* strip common prefix */
-  len1o = 0;
-  while (len1 > 0 && len2 > 0 && *string1 == *string2) {
-    len1--;
-    len2--;
-    string1++;
-    string2++;
-    len1o++;
+  if (!uhist_init(&h, len, string))
+    return -1;
+  for (i = 0; i < n; i++)
+    ratios[i] = quick_ratio_value(uhist_matches(&h, lengths[i], strings[i]),
+                                  len, lengths[i]);
+  uhist_free(&h);
+
+  return 0;
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Paired scoring
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/* Scores of aligned rows, string i of one column against string i of the
+ * other.  Rows are mostly short and each one is scored only once, so the
+ * per-row overhead matters more than for other batches: short patterns get
+ * their single word match masks in a table owned by the thread, which is
+ * cleared after each row (that costs as much as setting them) instead of
+ * being wiped or allocated.  Longer rows go to the general engines. */
+
+/* single word match masks of a pattern of at most LEV_WORD_BITS symbols,
+ * symbols above 0xff live in a small open addressing hash */
+typedef struct {
+  uint64_t masks[0x100];
+  lev_wchar hkeys[LEV_LCS_HSIZE];  /* 0 == empty */
+  uint64_t hmasks[LEV_LCS_HSIZE];
+} LevPairedMasks;
+
+/* what a thread owns */
+typedef struct {
+  LevPairedMasks *pm;
+  lev_wchar *buf1;  /* decoded or widened strings */
+  lev_wchar *buf2;
+  size_t size1;
+  size_t size2;
+} LevPairedScratch;
+
+typedef struct {
+  size_t n;
+  const LevColumn *column1;
+  const LevColumn *column2;
+  LevScorer scorer;
+  double cutoff;
+  LevDistanceCache *cache;
+  void *scores;
+  size_t chunk;
+  int *failed;  /* one flag per thread */
+  int *mismatched;
+} LevPaired;
+
+/* one row of a column, either bytes or Unicode characters */
+typedef struct {
+  int unicode;
+  size_t len;
+  const void *string;
+} LevPairedRow;
+
+static void
+paired_masks_set(LevPairedMasks *pm, size_t len, const lev_byte *string)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    pm->masks[string[i]] |= (uint64_t)1 << i;
+}
+
+static void
+paired_masks_clear(LevPairedMasks *pm, size_t len, const lev_byte *string)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    pm->masks[string[i]] = 0;
+}
+
+static size_t
+paired_umasks_slot(const LevPairedMasks *pm, lev_wchar c)
+{
+  size_t i = (size_t)c % LEV_LCS_HSIZE;
+
+  while (pm->hkeys[i] && pm->hkeys[i] != c)
+    i = (i + 1) % LEV_LCS_HSIZE;
+  return i;
+}
+
+static void
+paired_umasks_set(LevPairedMasks *pm, size_t len, const lev_wchar *string)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    lev_wchar c = string[i];
+    uint64_t bit = (uint64_t)1 << i;
+
+    if ((size_t)c < 0x100)
+      pm->masks[(size_t)c] |= bit;
+    else {
+      size_t slot = paired_umasks_slot(pm, c);
+      if (!pm->hkeys[slot]) {
+        pm->hkeys[slot] = c;
+        pm->hmasks[slot] = 0;
+      }
+      pm->hmasks[slot] |= bit;
+    }
   }
-  len2o = len1o;
+}
 
-  /* strip common suffix */
-  while (len1 > 0 && len2 > 0 && string1[len1-1] == string2[len2-1]) {
-    len1--;
-    len2--;
+/* the hash slots are emptied all at once, emptying them one by one could
+ * break the probe sequences of the remaining ones */
+static void
+paired_umasks_clear(LevPairedMasks *pm, size_t len, const lev_wchar *string)
+{
+  size_t i;
+  int hashed = 0;
+
+  for (i = 0; i < len; i++) {
+    if ((size_t)string[i] < 0x100)
+      pm->masks[(size_t)string[i]] = 0;
+    else
+      hashed = 1;
   }
-  len1++;
-  len2++;
+  if (hashed)
+    memset(pm->hkeys, 0, LEV_LCS_HSIZE*sizeof(lev_wchar));
+}
 
-  /* initialize first row and column */
-  matrix = (size_t*)safe_malloc_3(len1, len2, sizeof(size_t));
-  if (!matrix) {
-    *n = (size_t)(-1);
-    return NULL;
+static uint64_t
+paired_umask(const LevPairedMasks *pm, lev_wchar c)
+{
+  size_t slot;
+
+  if ((size_t)c < 0x100)
+    return pm->masks[(size_t)c];
+  slot = paired_umasks_slot(pm, c);
+  return pm->hkeys[slot] ? pm->hmasks[slot] : 0;
+}
+
+/*
+ * Levenshtein distance of a pattern of 1 to LEV_WORD_BITS symbols, whose
+ * masks are set in @pm, and @string2.
+ *
+ * Returns: The distance, or @max + 1 if it's larger than @max.
+ */
+static size_t
+paired_myers(const LevPairedMasks *pm, size_t len1,
+             size_t len2, const lev_byte *string2, size_t max)
+{
+  uint64_t VP = ~(uint64_t)0, VN = 0;
+  uint64_t last = (uint64_t)1 << (len1 - 1);
+  size_t d = len1;
+  size_t i;
+
+  for (i = 0; i < len2; i++) {
+    LEV_MYERS_STEP(pm->masks[string2[i]], VP, VN, last, d);
+    /* each remaining symbol lowers the distance by one at most */
+    if (d > max + (len2 - i - 1))
+      return max + 1;
   }
-  for (i = 0; i < len2; i++)
-    matrix[i] = i;
-  for (i = 1; i < len1; i++)
-    matrix[len2*i] = i;
+  return d > max ? max + 1 : d;
+}
 
-  /* find the costs and fill the matrix */
-  for (i = 1; i < len1; i++) {
-    size_t *prev = matrix + (i - 1)*len2;
-    size_t *p = matrix + i*len2;
-    size_t *end = p + len2 - 1;
-    const lev_byte char1 = string1[i - 1];
-    const lev_byte *char2p = string2;
-    size_t x = i;
-    p++;
-    while (p <= end) {
-      size_t c3 = *(prev++) + (char1 != *(char2p++));
-      x++;
-      if (x > c3)
-        x = c3;
-      c3 = *prev + 1;
-      if (x > c3)
-        x = c3;
-      *(p++) = x;
+static size_t
+paired_u_myers(const LevPairedMasks *pm, size_t len1,
+               size_t len2, const lev_wchar *string2, size_t max)
+{
+  uint64_t VP = ~(uint64_t)0, VN = 0;
+  uint64_t last = (uint64_t)1 << (len1 - 1);
+  size_t d = len1;
+  size_t i;
+
+  for (i = 0; i < len2; i++) {
+    LEV_MYERS_STEP(paired_umask(pm, string2[i]), VP, VN, last, d);
+    if (d > max + (len2 - i - 1))
+      return max + 1;
+  }
+  return d > max ? max + 1 : d;
+}
+
+/* InDel distance of a pattern of 1 to LEV_WORD_BITS symbols, whose masks
+ * are set in @pm, and @string2 */
+static size_t
+paired_indel(const LevPairedMasks *pm, size_t len1,
+             size_t len2, const lev_byte *string2)
+{
+  uint64_t V = ~(uint64_t)0;
+  size_t i;
+
+  for (i = 0; i < len2; i++) {
+    uint64_t U = V & pm->masks[string2[i]];
+    V = (V + U) | (V - U);
+  }
+  return len1 + len2 - 2*lcs_count(&V, 1, len1);
+}
+
+static size_t
+paired_u_indel(const LevPairedMasks *pm, size_t len1,
+               size_t len2, const lev_wchar *string2)
+{
+  uint64_t V = ~(uint64_t)0;
+  size_t i;
+
+  for (i = 0; i < len2; i++) {
+    uint64_t U = V & paired_umask(pm, string2[i]);
+    V = (V + U) | (V - U);
+  }
+  return len1 + len2 - 2*lcs_count(&V, 1, len1);
+}
+
+/*
+ * Score one row of bytes.  The distance scorers store (size_t)(-1) for
+ * failures, including Hamming distances of strings of different lengths.
+ */
+static void
+paired_score(LevPairedMasks *pm, LevDistanceCache *cache,
+             LevScorer scorer, double cutoff,
+             size_t len1, const lev_byte *string1,
+             size_t len2, const lev_byte *string2,
+             void *scores, size_t row)
+{
+  size_t lensum = len1 + len2;
+  size_t max, d, i, off;
+
+  if (scorer == LEV_SCORER_HAMMING) {
+    if (len1 != len2)
+      d = (size_t)(-1);
+    else {
+      for (i = d = 0; i < len1; i++)
+        d += string1[i] != string2[i];
+      if ((double)d > cutoff)
+        d = (size_t)cutoff + 1;
     }
+    ((size_t*)scores)[row] = d;
+    return;
+  }
+
+  /* the largest distance that can meet the cutoff, for ratios rounded up,
+   * the ratio itself is compared below */
+  if (scorer == LEV_SCORER_RATIO)
+    max = (size_t)((1.0 - cutoff)*(double)lensum) + 1;
+  else
+    max = cutoff >= (double)lensum ? lensum : (size_t)cutoff;
+
+  /* strip common prefix and suffix */
+  off = lev_strip_affixes(&len1, string1, &len2, string2, sizeof(*string1));
+  string1 += off;
+  string2 += off;
+  /* make the pattern (i.e. string1) the shorter one */
+  if (len1 > len2) {
+    size_t nx = len1;
+    const lev_byte *sx = string1;
+    len1 = len2;
+    len2 = nx;
+    string1 = string2;
+    string2 = sx;
   }
 
-  /* find the way back */
-  return editops_from_cost_matrix(len1, string1, len1o,
-                                  len2, string2, len2o,
-                                  matrix, n);
+  /* the length difference alone is a lower bound */
+  if (len2 - len1 > max)
+    d = max + 1;
+  else if (len1 == 0)
+    d = len2;
+  else if (len1 <= LEV_WORD_BITS) {
+    paired_masks_set(pm, len1, string1);
+    if (scorer == LEV_SCORER_RATIO)
+      d = paired_indel(pm, len1, len2, string2);
+    else
+      d = paired_myers(pm, len1, len2, string2, max);
+    paired_masks_clear(pm, len1, string1);
+  }
+  else if (scorer == LEV_SCORER_RATIO)
+    d = dcache_indel_distance(cache, len1, string1, len2, string2, max);
+  else
+    d = dcache_edit_distance(cache, len1, string1, len2, string2);
+
+  if (scorer == LEV_SCORER_RATIO) {
+    double r;
+
+    if (d == (size_t)(-1))
+      r = -1.0;
+    else {
+      r = lensum ? (double)(lensum - (d > lensum ? lensum : d))/(double)lensum
+                 : 1.0;
+      if (r < cutoff)
+        r = 0.0;
+    }
+    ((double*)scores)[row] = r;
+  }
+  else {
+    if (d != (size_t)(-1) && d > max)
+      d = max + 1;
+    ((size_t*)scores)[row] = d;
+  }
 }
 
-/**
- * ueditops_from_cost_matrix:
- * @len1: The length of @string1.
- * @string1: A string of length @len1, may contain NUL characters.
- * @o1: The offset where the matrix starts from the start of @string1.
- * @len2: The length of @string2.
- * @string2: A string of length @len2, may contain NUL characters.
- * @o2: The offset where the matrix starts from the start of @string2.
- * @matrix: The cost matrix.
- * @n: Where the number of edit operations should be stored.
- *
- * Reconstructs the optimal edit sequence from the cost matrix @matrix.
- *
- * The matrix is freed.
- *
- * Returns: The optimal edit sequence, as a newly allocated array of
- *          elementary edit operations, it length is stored in @n.
- **/
-static LevEditOp*
-ueditops_from_cost_matrix(size_t len1, const lev_wchar *string1, size_t o1,
-                          size_t len2, const lev_wchar *string2, size_t o2,
-                          size_t *matrix, size_t *n)
+/* the Unicode counterpart of paired_score() */
+static void
+paired_u_score(LevPairedMasks *pm, LevDistanceCache *cache,
+               LevScorer scorer, double cutoff,
+               size_t len1, const lev_wchar *string1,
+               size_t len2, const lev_wchar *string2,
+               void *scores, size_t row)
 {
-  size_t *p;
-  size_t i, j, pos;
-  LevEditOp *ops;
-  int dir = 0;
+  size_t lensum = len1 + len2;
+  size_t max, d, i, off;
 
-  pos = *n = matrix[len1*len2 - 1];
-  if (!*n) {
-    free(matrix);
-    return NULL;
+  if (scorer == LEV_SCORER_HAMMING) {
+    if (len1 != len2)
+      d = (size_t)(-1);
+    else {
+      for (i = d = 0; i < len1; i++)
+        d += string1[i] != string2[i];
+      if ((double)d > cutoff)
+        d = (size_t)cutoff + 1;
+    }
+    ((size_t*)scores)[row] = d;
+    return;
   }
-  ops = (LevEditOp*)safe_malloc((*n), sizeof(LevEditOp));
-  if (!ops) {
-    free(matrix);
-    *n = (size_t)(-1);
-    return NULL;
+
+  if (scorer == LEV_SCORER_RATIO)
+    max = (size_t)((1.0 - cutoff)*(double)lensum) + 1;
+  else
+    max = cutoff >= (double)lensum ? lensum : (size_t)cutoff;
+
+  off = lev_strip_affixes(&len1, string1, &len2, string2, sizeof(*string1));
+  string1 += off;
+  string2 += off;
+  if (len1 > len2) {
+    size_t nx = len1;
+    const lev_wchar *sx = string1;
+    len1 = len2;
+    len2 = nx;
+    string1 = string2;
+    string2 = sx;
   }
-  i = len1 - 1;
-  j = len2 - 1;
-  p = matrix + len1*len2 - 1;
-  while (i || j) {
-    /* prefer contiuning in the same direction */
-    if (dir < 0 && j && *p == *(p - 1) + 1) {
-      pos--;
-      ops[pos].type = LEV_EDIT_INSERT;
-      ops[pos].spos = i + o1;
-      ops[pos].dpos = --j + o2;
-      p--;
-      continue;
+
+  if (len2 - len1 > max)
+    d = max + 1;
+  else if (len1 == 0)
+    d = len2;
+  else if (len1 <= LEV_WORD_BITS) {
+    paired_umasks_set(pm, len1, string1);
+    if (scorer == LEV_SCORER_RATIO)
+      d = paired_u_indel(pm, len1, len2, string2);
+    else
+      d = paired_u_myers(pm, len1, len2, string2, max);
+    paired_umasks_clear(pm, len1, string1);
+  }
+  else if (scorer == LEV_SCORER_RATIO)
+    d = dcache_u_indel_distance(cache, len1, string1, len2, string2, max);
+  else
+    d = dcache_u_edit_distance(cache, len1, string1, len2, string2);
+
+  if (scorer == LEV_SCORER_RATIO) {
+    double r;
+
+    if (d == (size_t)(-1))
+      r = -1.0;
+    else {
+      r = lensum ? (double)(lensum - (d > lensum ? lensum : d))/(double)lensum
+                 : 1.0;
+      if (r < cutoff)
+        r = 0.0;
     }
-    if (dir > 0 && i && *p == *(p - len2) + 1) {
-      pos--;
-      ops[pos].type = LEV_EDIT_DELETE;
-      ops[pos].spos = --i + o1;
-      ops[pos].dpos = j + o2;
-      p -= len2;
+    ((double*)scores)[row] = r;
+  }
+  else {
+    if (d != (size_t)(-1) && d > max)
+      d = max + 1;
+    ((size_t*)scores)[row] = d;
+  }
+}
+
+/* decode UTF-8, invalid bytes become lone surrogates 0xdc00 + byte like
+ * Python's surrogateescape, so that they still compare byte by byte.
+ * @out must have room for @len characters. */
+static size_t
+paired_utf8_decode(size_t len, const lev_byte *s, lev_wchar *out)
+{
+  size_t i = 0, n = 0;
+
+  while (i < len) {
+    unsigned long c = s[i];
+    size_t k, need;
+
+    if (c < 0x80) {
+      out[n++] = (lev_wchar)c;
+      i++;
       continue;
     }
-    if (i && j && *p == *(p - len2 - 1)
-        && string1[i - 1] == string2[j - 1]) {
-      /* don't be stupid like difflib, don't store LEV_EDIT_KEEP */
-      i--;
-      j--;
-      p -= len2 + 1;
-      dir = 0;
-      continue;
+    if (c >= 0xc2 && c < 0xe0) {
+      need = 1;
+      c &= 0x1f;
     }
-    if (i && j && *p == *(p - len2 - 1) + 1) {
-      pos--;
-      ops[pos].type = LEV_EDIT_REPLACE;
-      ops[pos].spos = --i + o1;
-      ops[pos].dpos = --j + o2;
-      p -= len2 + 1;
-      dir = 0;
-      continue;
+    else if (c >= 0xe0 && c < 0xf0) {
+      need = 2;
+      c &= 0x0f;
     }
-    /* we cant't turn directly from -1 to 1, in this case it would be better
-     * to go diagonally, but check it (dir == 0) */
-    if (dir == 0 && j && *p == *(p - 1) + 1) {
-      pos--;
-      ops[pos].type = LEV_EDIT_INSERT;
-      ops[pos].spos = i + o1;
-      ops[pos].dpos = --j + o2;
-      p--;
-      dir = -1;
-      continue;
+    else if (c >= 0xf0 && c < 0xf5) {
+      need = 3;
+      c &= 0x07;
     }
-    if (dir == 0 && i && *p == *(p - len2) + 1) {
-      pos--;
-      ops[pos].type = LEV_EDIT_DELETE;
-      ops[pos].spos = --i + o1;
-      ops[pos].dpos = j + o2;
-      p -= len2;
-      dir = 1;
+    else
+      need = 0;
+    for (k = 1; need && k <= need; k++) {
+      if (i + k >= len || (s[i + k] & 0xc0) != 0x80) {
+        need = 0;
+        break;
+      }
+      c = (c << 6) | (s[i + k] & 0x3f);
+    }
+    /* reject overlong forms, surrogates and too large values */
+    if (need && ((need == 2 && c < 0x800) || (need == 3 && c < 0x10000)
+                 || (c >= 0xd800 && c < 0xe000) || c > 0x10ffff))
+      need = 0;
+    if (!need) {
+      out[n++] = (lev_wchar)(0xdc00 + s[i]);
+      i++;
       continue;
     }
-    /* coredump right now, later might be too late ;-) */
-    assert("lost in the cost matrix" == NULL);
+    if (sizeof(lev_wchar) == 2 && c >= 0x10000) {
+      /* room is not a problem, four bytes make two characters */
+      c -= 0x10000;
+      out[n++] = (lev_wchar)(0xd800 + (c >> 10));
+      out[n++] = (lev_wchar)(0xdc00 + (c & 0x3ff));
+    }
+    else
+      out[n++] = (lev_wchar)c;
+    i += need + 1;
   }
-  free(matrix);
+  return n;
+}
 
-  return ops;
+/* make sure *@buf has room for @len characters */
+static int
+paired_reserve(lev_wchar **buf, size_t *size, size_t len)
+{
+  lev_wchar *p;
+
+  if (len <= *size)
+    return 0;
+  if (len < 2*(*size))
+    len = 2*(*size);
+  p = (lev_wchar*)safe_malloc(len, sizeof(lev_wchar));
+  if (!p)
+    return -1;
+  free(*buf);
+  *buf = p;
+  *size = len;
+  return 0;
+}
+
+static void
+paired_get_row(const LevColumn *column, size_t i, LevPairedRow *row)
+{
+  size_t beg, end, j;
+  const lev_byte *s;
+
+  if (column->type == LEV_COLUMN_BYTES || column->type == LEV_COLUMN_WCHAR) {
+    row->unicode = (column->type == LEV_COLUMN_WCHAR);
+    row->len = column->lengths[i];
+    row->string = column->strings[i];
+    return;
+  }
+  if (column->offset_size == 4) {
+    beg = (size_t)((const int32_t*)column->offsets)[i];
+    end = (size_t)((const int32_t*)column->offsets)[i + 1];
+  }
+  else {
+    beg = (size_t)((const int64_t*)column->offsets)[i];
+    end = (size_t)((const int64_t*)column->offsets)[i + 1];
+  }
+  s = column->data + beg;
+  row->unicode = 0;
+  row->len = end - beg;
+  row->string = s;
+  /* ASCII text is just bytes */
+  if (column->type == LEV_COLUMN_UTF8) {
+    for (j = 0; j < row->len; j++) {
+      if (s[j] >= 0x80) {
+        row->unicode = -1;  /* to be decoded */
+        break;
+      }
+    }
+  }
+}
+
+/* turn a byte or UTF-8 row into Unicode characters in @buf */
+static int
+paired_widen_row(LevPairedRow *row, lev_wchar **buf, size_t *size)
+{
+  const lev_byte *s = (const lev_byte*)row->string;
+  size_t j;
+
+  if (paired_reserve(buf, size, row->len))
+    return -1;
+  if (row->unicode < 0)
+    row->len = paired_utf8_decode(row->len, s, *buf);
+  else {
+    for (j = 0; j < row->len; j++)
+      (*buf)[j] = (lev_wchar)s[j];
+  }
+  row->unicode = 1;
+  row->string = *buf;
+  return 0;
+}
+
+static void
+paired_worker(void *data, size_t ithread, size_t nthreads)
+{
+  LevPaired *paired = (LevPaired*)data;
+  LevPairedScratch scratch;
+  size_t c, i;
+
+  scratch.pm = (LevPairedMasks*)calloc(1, sizeof(LevPairedMasks));
+  scratch.buf1 = scratch.buf2 = NULL;
+  scratch.size1 = scratch.size2 = 0;
+  if (!scratch.pm) {
+    paired->failed[ithread] = 1;
+    return;
+  }
+
+  /* chunks are dealt round robin */
+  for (c = ithread*paired->chunk; c < paired->n; c += nthreads*paired->chunk) {
+    size_t end = paired->n - c > paired->chunk ? c + paired->chunk : paired->n;
+
+    lev_sched_checkpoint(ithread);
+    for (i = c; i < end; i++) {
+      LevPairedRow row1, row2;
+
+      paired_get_row(paired->column1, i, &row1);
+      paired_get_row(paired->column2, i, &row2);
+      if (row1.unicode || row2.unicode) {
+        if ((row1.unicode != 1
+             && paired_widen_row(&row1, &scratch.buf1, &scratch.size1))
+            || (row2.unicode != 1
+                && paired_widen_row(&row2, &scratch.buf2, &scratch.size2))) {
+          paired->failed[ithread] = 1;
+          goto done;
+        }
+        paired_u_score(scratch.pm, paired->cache,
+                       paired->scorer, paired->cutoff,
+                       row1.len, (const lev_wchar*)row1.string,
+                       row2.len, (const lev_wchar*)row2.string,
+                       paired->scores, i);
+      }
+      else
+        paired_score(scratch.pm, paired->cache,
+                     paired->scorer, paired->cutoff,
+                     row1.len, (const lev_byte*)row1.string,
+                     row2.len, (const lev_byte*)row2.string,
+                     paired->scores, i);
+
+      if (paired->scorer == LEV_SCORER_RATIO) {
+        if (((double*)paired->scores)[i] < 0.0) {
+          paired->failed[ithread] = 1;
+          goto done;
+        }
+      }
+      else if (((size_t*)paired->scores)[i] == (size_t)(-1)) {
+        if (paired->scorer != LEV_SCORER_HAMMING) {
+          paired->failed[ithread] = 1;
+          goto done;
+        }
+        paired->mismatched[ithread] = 1;
+      }
+    }
+  }
+
+done:
+  free(scratch.pm);
+  free(scratch.buf1);
+  free(scratch.buf2);
 }
 
 /**
- * lev_u_editops_find:
- * @len1: The length of @string1.
- * @string1: A string of length @len1, may contain NUL characters.
- * @len2: The length of @string2.
- * @string2: A string of length @len2, may contain NUL characters.
- * @n: Where the number of edit operations should be stored.
- *
- * Find an optimal edit sequence from @string1 to @string2.
+ * lev_paired_scores:
+ * @n: The number of rows, i.e. of strings in each column.
+ * @column1: The first strings.
+ * @column2: The second strings.
+ * @scorer: What to compute.
+ * @cutoff: The score cutoff.  Distances larger than @cutoff are stored as
+ *          floor(@cutoff) + 1, ratios smaller than @cutoff as 0.
+ *          Use %HUGE_VAL, resp. 0, for none.
+ * @cache: A distance cache to use, or %NULL.  It's only consulted for
+ *         rows too long for the bit-parallel kernels.
+ * @nthreads: The number of threads to use, zero means one per processor.
+ * @scores: Where the @n scores should be stored, size_t distances for
+ *          %LEV_SCORER_DISTANCE and %LEV_SCORER_HAMMING, double ratios for
+ *          %LEV_SCORER_RATIO.
  *
- * When there's more than one optimal sequence, a one is arbitrarily (though
- * deterministically) chosen.
+ * Scores each string of @column1 against the string of @column2 in the
+ * same row.  Both columns have to hold the same kind of strings, byte
+ * and UTF-8 columns can be scored against each other though, UTF-8 rows
+ * being decoded (invalid bytes become lone surrogates, see Python's
+ * surrogateescape).
  *
- * Returns: The optimal edit sequence, as a newly allocated array of
- *          elementary edit operations, it length is stored in @n.
- *          It is normalized, i.e., keep operations are not included.
+ * Returns: Zero on success, 1 if there were Hamming distances of strings
+ *          of different lengths (stored as (size_t)(-1)), -1 on failure.
  **/
-LevEditOp*
-lev_u_editops_find(size_t len1, const lev_wchar *string1,
-                   size_t len2, const lev_wchar *string2,
-                   size_t *n)
+int
+lev_paired_scores(size_t n, const LevColumn *column1, const LevColumn *column2,
+                  LevScorer scorer, double cutoff, LevDistanceCache *cache,
+                  size_t nthreads, void *scores)
 {
-  size_t len1o, len2o;
-  size_t i;
-  size_t *matrix; /* cost matrix */
+  LevPaired paired;
+  size_t chunk = lev_tuning.paired_chunk ? lev_tuning.paired_chunk : 1;
+  size_t t;
+  int result = 0;
 
-  /* strip common prefix */
-  len1o = 0;
-  while (len1 > 0 && len2 > 0 && *string1 == *string2) {
-    len1--;
-    len2--;
-    string1++;
-    string2++;
-    len1o++;
-  }
-  len2o = len1o;
+  if (!n)
+    return 0;
+  if (!nthreads)
+    nthreads = lev_cpu_count();
+  if (nthreads > (n - 1)/chunk + 1)
+    nthreads = (n - 1)/chunk + 1;
+
+  paired.n = n;
+  paired.column1 = column1;
+  paired.column2 = column2;
+  paired.scorer = scorer;
+  paired.cutoff = cutoff;
+  paired.cache = cache;
+  paired.scores = scores;
+  paired.chunk = chunk;
+  paired.failed = (int*)calloc(nthreads, sizeof(int));
+  paired.mismatched = (int*)calloc(nthreads, sizeof(int));
+  if (!paired.failed || !paired.mismatched) {
+    free(paired.failed);
+    free(paired.mismatched);
+    return -1;
+  }
+  lev_run_parallel(nthreads, paired_worker, &paired);
+
+  for (t = 0; t < nthreads; t++) {
+    if (paired.failed[t])
+      result = -1;
+    else if (paired.mismatched[t] && !result)
+      result = 1;
+  }
+  free(paired.failed);
+  free(paired.mismatched);
+
+  return result;
+}
+/* }}} */
 
-  /* strip common suffix */
-  while (len1 > 0 && len2 > 0 && string1[len1-1] == string2[len2-1]) {
-    len1--;
-    len2--;
-  }
-  len1++;
-  len2++;
+/****************************************************************************
+ *
+ * Score matrices
+ *
+ ****************************************************************************/
+/* {{{ */
 
-  /* initalize first row and column */
-  matrix = (size_t*)safe_malloc_3(len1, len2, sizeof(size_t));
-  if (!matrix) {
-    *n = (size_t)(-1);
-    return NULL;
-  }
-  for (i = 0; i < len2; i++)
-    matrix[i] = i;
-  for (i = 1; i < len1; i++)
-    matrix[len2*i] = i;
+/* Tiles of the score matrix of two columns, computed with the paired
+ * scoring kernels.  The match masks of a row string are set once for the
+ * whole row of the tile, so the column strings are not stripped of common
+ * affixes.  Matrices of a million squared strings don't fit in memory,
+ * the caller iterates over tiles, possibly writing them directly to their
+ * place in a memory mapped matrix (using @stride). */
+
+typedef struct {
+  const LevColumn *rows;
+  const LevColumn *cols;
+  size_t r0, r1;
+  size_t c0, c1;
+  LevScorer scorer;
+  LevTileFormat format;
+  LevDistanceCache *cache;
+  void *tile;
+  size_t stride;
+  int *failed;  /* one flag per thread */
+} LevTile;
 
-  /* find the costs and fill the matrix */
-  for (i = 1; i < len1; i++) {
-    size_t *prev = matrix + (i - 1)*len2;
-    size_t *p = matrix + i*len2;
-    size_t *end = p + len2 - 1;
-    const lev_wchar char1 = string1[i - 1];
-    const lev_wchar *char2p = string2;
-    size_t x = i;
-    p++;
-    while (p <= end) {
-      size_t c3 = *(prev++) + (char1 != *(char2p++));
-      x++;
-      if (x > c3)
-        x = c3;
-      c3 = *prev + 1;
-      if (x > c3)
-        x = c3;
-      *(p++) = x;
+static void
+tile_store(const LevTile *t, size_t i, size_t j, size_t d, size_t lensum)
+{
+  size_t k = (i - t->r0)*t->stride + (j - t->c0);
+  double r;
+
+  if (t->format == LEV_TILE_SIZE) {
+    ((size_t*)t->tile)[k] = d;
+    return;
+  }
+  if (t->format == LEV_TILE_UINT16) {
+    ((uint16_t*)t->tile)[k] = (uint16_t)(d > 0xffff ? 0xffff : d);
+    return;
+  }
+  if (t->format == LEV_TILE_UINT8) {
+    /* rounded in integers, 255*ratio often ends in exactly a half */
+    ((uint8_t*)t->tile)[k] = (uint8_t)(lensum ? (510*(lensum - d) + lensum)
+                                                /(2*lensum)
+                                              : 255);
+    return;
+  }
+  r = lensum ? (double)(lensum - d)/(double)lensum : 1.0;
+  ((double*)t->tile)[k] = r;
+}
+
+/* the distance of two rows of any types, using the general engines */
+static size_t
+tile_distance(const LevTile *t, const LevPairedRow *row1,
+              const LevPairedRow *row2)
+{
+  if (row1->unicode) {
+    if (t->scorer == LEV_SCORER_RATIO)
+      return dcache_u_indel_distance(t->cache,
+                                     row1->len,
+                                     (const lev_wchar*)row1->string,
+                                     row2->len,
+                                     (const lev_wchar*)row2->string,
+                                     (size_t)(-1));
+    return dcache_u_edit_distance(t->cache,
+                                  row1->len, (const lev_wchar*)row1->string,
+                                  row2->len, (const lev_wchar*)row2->string);
+  }
+  if (t->scorer == LEV_SCORER_RATIO)
+    return dcache_indel_distance(t->cache,
+                                 row1->len, (const lev_byte*)row1->string,
+                                 row2->len, (const lev_byte*)row2->string,
+                                 (size_t)(-1));
+  return dcache_edit_distance(t->cache,
+                              row1->len, (const lev_byte*)row1->string,
+                              row2->len, (const lev_byte*)row2->string);
+}
+
+static void
+tile_worker(void *data, size_t ithread, size_t nthreads)
+{
+  LevTile *t = (LevTile*)data;
+  LevPairedScratch scratch;
+  lev_wchar *wbuf = NULL;  /* the row widened for Unicode columns */
+  size_t wsize = 0;
+  size_t i, j;
+
+  scratch.pm = (LevPairedMasks*)calloc(1, sizeof(LevPairedMasks));
+  scratch.buf1 = scratch.buf2 = NULL;
+  scratch.size1 = scratch.size2 = 0;
+  if (!scratch.pm) {
+    t->failed[ithread] = 1;
+    return;
+  }
+
+  /* the masks work for either kind of text, bytes and Unicode characters
+   * below 0x100 share the table */
+  for (i = t->r0 + ithread; i < t->r1; i += nthreads) {
+    LevPairedRow row, wrow;
+    int wide = 0;
+    int masked;
+
+    lev_sched_checkpoint(ithread);
+    paired_get_row(t->rows, i, &row);
+    if (row.unicode < 0
+        && paired_widen_row(&row, &scratch.buf1, &scratch.size1)) {
+      t->failed[ithread] = 1;
+      goto done;
+    }
+    masked = row.len > 0 && row.len <= LEV_WORD_BITS;
+    if (masked) {
+      if (row.unicode)
+        paired_umasks_set(scratch.pm, row.len, (const lev_wchar*)row.string);
+      else
+        paired_masks_set(scratch.pm, row.len, (const lev_byte*)row.string);
+    }
+
+    for (j = t->c0; j < t->c1; j++) {
+      LevPairedRow col;
+      size_t lensum, d;
+
+      paired_get_row(t->cols, j, &col);
+      if (col.unicode < 0
+          && paired_widen_row(&col, &scratch.buf2, &scratch.size2)) {
+        t->failed[ithread] = 1;
+        goto done;
+      }
+      lensum = row.len + col.len;
+      if (!row.len)
+        d = col.len;
+      else if (masked && col.unicode) {
+        if (t->scorer == LEV_SCORER_RATIO)
+          d = paired_u_indel(scratch.pm, row.len,
+                             col.len, (const lev_wchar*)col.string);
+        else
+          d = paired_u_myers(scratch.pm, row.len,
+                             col.len, (const lev_wchar*)col.string, lensum);
+      }
+      else if (masked) {
+        if (t->scorer == LEV_SCORER_RATIO)
+          d = paired_indel(scratch.pm, row.len,
+                           col.len, (const lev_byte*)col.string);
+        else
+          d = paired_myers(scratch.pm, row.len,
+                           col.len, (const lev_byte*)col.string, lensum);
+      }
+      else if (row.unicode == col.unicode)
+        d = tile_distance(t, &row, &col);
+      else if (row.unicode) {
+        if (paired_widen_row(&col, &scratch.buf2, &scratch.size2)) {
+          t->failed[ithread] = 1;
+          goto done;
+        }
+        d = tile_distance(t, &row, &col);
+      }
+      else {
+        if (!wide) {
+          wrow = row;
+          if (paired_widen_row(&wrow, &wbuf, &wsize)) {
+            t->failed[ithread] = 1;
+            goto done;
+          }
+          wide = 1;
+        }
+        d = tile_distance(t, &wrow, &col);
+      }
+      if (d == (size_t)(-1)) {
+        t->failed[ithread] = 1;
+        goto done;
+      }
+      tile_store(t, i, j, d, lensum);
+    }
+
+    if (masked) {
+      if (row.unicode)
+        paired_umasks_clear(scratch.pm, row.len,
+                            (const lev_wchar*)row.string);
+      else
+        paired_masks_clear(scratch.pm, row.len, (const lev_byte*)row.string);
     }
   }
 
-  /* find the way back */
-  return ueditops_from_cost_matrix(len1, string1, len1o,
-                                   len2, string2, len2o,
-                                   matrix, n);
+done:
+  free(scratch.pm);
+  free(scratch.buf1);
+  free(scratch.buf2);
+  free(wbuf);
 }
 
 /**
- * lev_opcodes_to_editops:
- * @nb: The length of @bops.
- * @bops: An array of difflib block edit operation codes.
- * @n: Where the number of edit operations should be stored.
- * @keepkeep: If nonzero, keep operations will be included.  Otherwise the
- *            result will be normalized, i.e. without any keep operations.
+ * lev_score_tile:
+ * @rows: The strings of the matrix rows.
+ * @r0: The first row of the tile.
+ * @r1: The row after the last one of the tile.
+ * @cols: The strings of the matrix columns.
+ * @c0: The first column of the tile.
+ * @c1: The column after the last one of the tile.
+ * @scorer: What to compute, %LEV_SCORER_DISTANCE or %LEV_SCORER_RATIO.
+ * @format: How to store the scores, %LEV_TILE_SIZE or %LEV_TILE_UINT16
+ *          for distances, %LEV_TILE_DOUBLE or %LEV_TILE_UINT8 for ratios.
+ * @cache: A distance cache to use, or %NULL.  It's only consulted for
+ *         strings too long for the bit-parallel kernels.
+ * @nthreads: The number of threads to use, zero means one per processor.
+ * @tile: Where the scores should be stored, the score of row i and column
+ *        j goes to item (i - @r0)*@stride + j - @c0.
+ * @stride: The distance of the tile rows, in items, at least @c1 - @c0.
  *
- * Converts difflib block operation codes to elementary edit operations.
+ * Computes a tile of the score matrix of two columns (see
+ * lev_paired_scores() for the columns).  %LEV_TILE_UINT16 distances
+ * saturate at 0xffff, %LEV_TILE_UINT8 ratios are quantized to
+ * floor(255*ratio + 0.5).
  *
- * Returns: The converted edit operatiosn, as a newly allocated array; its
- *          size is stored in @n.
+ * Returns: Zero on success, -1 on failure.
  **/
-LevEditOp*
-lev_opcodes_to_editops(size_t nb, const LevOpCode *bops,
-                       size_t *n, int keepkeep)
+int
+lev_score_tile(const LevColumn *rows, size_t r0, size_t r1,
+               const LevColumn *cols, size_t c0, size_t c1,
+               LevScorer scorer, LevTileFormat format,
+               LevDistanceCache *cache, size_t nthreads,
+               void *tile, size_t stride)
 {
+  LevTile t;
   size_t i;
-  const LevOpCode *b;
-  LevEditOp *ops, *o;
+  int result = 0;
+
+  if (r1 <= r0 || c1 <= c0)
+    return 0;
+  if (!nthreads)
+    nthreads = lev_cpu_count();
+  if (nthreads > r1 - r0)
+    nthreads = r1 - r0;
+
+  t.rows = rows;
+  t.cols = cols;
+  t.r0 = r0;
+  t.r1 = r1;
+  t.c0 = c0;
+  t.c1 = c1;
+  t.scorer = scorer;
+  t.format = format;
+  t.cache = cache;
+  t.tile = tile;
+  t.stride = stride;
+  t.failed = (int*)calloc(nthreads, sizeof(int));
+  if (!t.failed)
+    return -1;
+  lev_run_parallel(nthreads, tile_worker, &t);
+
+  for (i = 0; i < nthreads; i++) {
+    if (t.failed[i])
+      result = -1;
+  }
+  free(t.failed);
+
+  return result;
+}
+/* }}} */
 
-  /* compute the number of atomic operations */
-  *n = 0;
-  if (!nb)
-    return NULL;
+/****************************************************************************
+ *
+ * Token similarities
+ *
+ ****************************************************************************/
+/* {{{ */
 
-  b = bops;
-  if (keepkeep) {
-    for (i = nb; i; i--, b++) {
-      size_t sd = b->send - b->sbeg;
-      size_t dd = b->dend - b->dbeg;
-      *n += (sd > dd ? sd : dd);
+/* Strings are split to whitespace separated tokens, kept as views into the
+ * string, never as copies.  token_sort compares the sorted tokens joined by
+ * single spaces by the InDel ratio, token_set the distinct tokens by
+ * lev_set_distance() and token_seq the tokens in order by
+ * lev_edit_seq_distance().  A query is tokenized once for a whole batch,
+ * and for token_sort each thread turns it to a bit-parallel pattern once. */
+
+/* a token, or any string view */
+typedef struct {
+  const void *s;
+  size_t len;
+} LevTokenView;
+
+struct _LevTokenQuery {
+  LevTokenScorer scorer;
+  int unicode;
+  void *copy;  /* the query string, tokens point into it */
+  size_t n;  /* tokens */
+  size_t *lengths;
+  const void **strings;
+  size_t len;  /* the length of joined */
+  void *joined;  /* the sorted tokens joined, for LEV_TOKEN_SORT */
+};
+
+/* scratch space of one thread */
+typedef struct {
+  LevLCSPattern pat;  /* the joined query, LEV_TOKEN_SORT only */
+  LevULCSPattern upat;
+  size_t size;  /* the longest string that fits */
+  LevTokenView *views;
+  size_t *lengths;
+  const void **strings;
+  void *joined;
+} LevTokenWork;
+
+/* whitespace of bytes.split() */
+static int
+token_isspace(lev_byte c)
+{
+  return c == ' ' || (c >= 0x09 && c <= 0x0d);
+}
+
+/* whitespace of str.split() */
+static int
+token_u_isspace(lev_wchar c)
+{
+  if (c < 0x80)
+    return c == ' ' || (c >= 0x09 && c <= 0x0d) || (c >= 0x1c && c <= 0x1f);
+  return c == 0x85 || c == 0xa0 || c == 0x1680
+         || (c >= 0x2000 && c <= 0x200a) || c == 0x2028 || c == 0x2029
+         || c == 0x202f || c == 0x205f || c == 0x3000;
+}
+
+/* split @string to @views, that must have room for (@len + 1)/2 tokens;
+ * returns the number of tokens */
+static size_t
+token_split(size_t len, const void *string, int unicode, LevTokenView *views)
+{
+  size_t i = 0, n = 0;
+
+  if (unicode) {
+    const lev_wchar *s = (const lev_wchar*)string;
+    while (i < len) {
+      size_t start;
+      while (i < len && token_u_isspace(s[i]))
+        i++;
+      if (i == len)
+        break;
+      start = i;
+      while (i < len && !token_u_isspace(s[i]))
+        i++;
+      views[n].s = s + start;
+      views[n++].len = i - start;
     }
   }
   else {
-    for (i = nb; i; i--, b++) {
-      size_t sd = b->send - b->sbeg;
-      size_t dd = b->dend - b->dbeg;
-      *n += (b->type != LEV_EDIT_KEEP ? (sd > dd ? sd : dd) : 0);
+    const lev_byte *s = (const lev_byte*)string;
+    while (i < len) {
+      size_t start;
+      while (i < len && token_isspace(s[i]))
+        i++;
+      if (i == len)
+        break;
+      start = i;
+      while (i < len && !token_isspace(s[i]))
+        i++;
+      views[n].s = s + start;
+      views[n++].len = i - start;
     }
   }
+  return n;
+}
 
-  /* convert */
-  o = ops = (LevEditOp*)safe_malloc((*n), sizeof(LevEditOp));
-  if (!ops) {
-    *n = (size_t)(-1);
-    return NULL;
-  }
-  b = bops;
-  for (i = nb; i; i--, b++) {
-    size_t j;
+static int
+token_cmp(const void *a, const void *b)
+{
+  const LevTokenView *x = (const LevTokenView*)a;
+  const LevTokenView *y = (const LevTokenView*)b;
+  int c = memcmp(x->s, y->s, x->len < y->len ? x->len : y->len);
 
-    switch (b->type) {
-      case LEV_EDIT_KEEP:
-      if (keepkeep) {
-        for (j = 0; j < b->send - b->sbeg; j++, o++) {
-          o->type = LEV_EDIT_KEEP;
-          o->spos = b->sbeg + j;
-          o->dpos = b->dbeg + j;
-        }
-      }
-      break;
+  if (c)
+    return c;
+  return (x->len > y->len) - (x->len < y->len);
+}
+
+/* code point order, like Python sorts str */
+static int
+token_u_cmp(const void *a, const void *b)
+{
+  const LevTokenView *x = (const LevTokenView*)a;
+  const LevTokenView *y = (const LevTokenView*)b;
+  const lev_wchar *s = (const lev_wchar*)x->s;
+  const lev_wchar *t = (const lev_wchar*)y->s;
+  size_t l = x->len < y->len ? x->len : y->len;
+  size_t i;
+
+  for (i = 0; i < l; i++) {
+    if (s[i] != t[i])
+      return s[i] < t[i] ? -1 : 1;
+  }
+  return (x->len > y->len) - (x->len < y->len);
+}
 
-      case LEV_EDIT_REPLACE:
-      for (j = 0; j < b->send - b->sbeg; j++, o++) {
-        o->type = LEV_EDIT_REPLACE;
-        o->spos = b->sbeg + j;
-        o->dpos = b->dbeg + j;
-      }
-      break;
+/* bring the @n tokens in @views to the form @scorer compares: sorted for
+ * token_sort, sorted and distinct for token_set; returns their number */
+static size_t
+token_arrange(LevTokenView *views, size_t n, int unicode,
+              LevTokenScorer scorer)
+{
+  int (*cmp)(const void*, const void*) = unicode ? token_u_cmp : token_cmp;
+  size_t i, m;
+
+  if (scorer == LEV_TOKEN_SEQ || n < 2)
+    return n;
+  qsort(views, n, sizeof(LevTokenView), cmp);
+  if (scorer == LEV_TOKEN_SORT)
+    return n;
+  for (i = m = 1; i < n; i++) {
+    if (cmp(views + i, views + m - 1))
+      views[m++] = views[i];
+  }
+  return m;
+}
 
-      case LEV_EDIT_DELETE:
-      for (j = 0; j < b->send - b->sbeg; j++, o++) {
-        o->type = LEV_EDIT_DELETE;
-        o->spos = b->sbeg + j;
-        o->dpos = b->dbeg;
-      }
-      break;
+/* join the tokens by single spaces to @joined; returns its length */
+static size_t
+token_join(const LevTokenView *views, size_t n, int unicode, void *joined)
+{
+  size_t charsize = unicode ? sizeof(lev_wchar) : sizeof(lev_byte);
+  char *p = (char*)joined;
+  size_t i, len = 0;
 
-      case LEV_EDIT_INSERT:
-      for (j = 0; j < b->dend - b->dbeg; j++, o++) {
-        o->type = LEV_EDIT_INSERT;
-        o->spos = b->sbeg;
-        o->dpos = b->dbeg + j;
-      }
-      break;
+  for (i = 0; i < n; i++) {
+    if (i) {
+      if (unicode)
+        *(lev_wchar*)(void*)p = ' ';
+      else
+        *p = ' ';
+      p += charsize;
+      len++;
+    }
+    memcpy(p, views[i].s, views[i].len*charsize);
+    p += views[i].len*charsize;
+    len += views[i].len;
+  }
+  return len;
+}
 
-      default:
-      break;
+static LevTokenQuery*
+token_query_new(size_t len, const void *string, int unicode,
+                LevTokenScorer scorer)
+{
+  size_t charsize = unicode ? sizeof(lev_wchar) : sizeof(lev_byte);
+  LevTokenQuery *q = (LevTokenQuery*)calloc(1, sizeof(LevTokenQuery));
+  LevTokenView *views = NULL;
+  size_t i;
+
+  if (!q)
+    return NULL;
+  q->scorer = scorer;
+  q->unicode = unicode;
+  q->copy = safe_malloc(len + 1, charsize);
+  views = (LevTokenView*)safe_malloc(len/2 + 1, sizeof(LevTokenView));
+  if (!q->copy || !views)
+    goto fail;
+  memcpy(q->copy, string, len*charsize);
+  q->n = token_split(len, q->copy, unicode, views);
+  q->n = token_arrange(views, q->n, unicode, scorer);
+  if (scorer == LEV_TOKEN_SORT) {
+    q->joined = safe_malloc(len + 1, charsize);
+    if (!q->joined)
+      goto fail;
+    q->len = token_join(views, q->n, unicode, q->joined);
+  }
+  else {
+    q->lengths = (size_t*)safe_malloc(q->n + 1, sizeof(size_t));
+    q->strings = (const void**)safe_malloc(q->n + 1, sizeof(void*));
+    if (!q->lengths || !q->strings)
+      goto fail;
+    for (i = 0; i < q->n; i++) {
+      q->lengths[i] = views[i].len;
+      q->strings[i] = views[i].s;
     }
   }
-  assert((size_t)(o - ops) == *n);
+  free(views);
+  return q;
 
-  return ops;
+fail:
+  free(views);
+  lev_token_query_free(q);
+  return NULL;
 }
 
 /**
- * lev_editops_to_opcodes:
- * @n: The size of @ops.
- * @ops: An array of elementary edit operations.
- * @nb: Where the number of difflib block operation codes should be stored.
- * @len1: The length of the source string.
- * @len2: The length of the destination string.
- *
- * Converts elementary edit operations to difflib block operation codes.
+ * lev_token_query_new:
+ * @len: The length of @string.
+ * @string: A string of length @len, may contain NUL characters.
+ * @scorer: The token similarity to compute.
  *
- * Note the string lengths are necessary since difflib doesn't allow omitting
- * keep operations.
+ * Prepares @string to be compared with other strings by a token similarity,
+ * see lev_token_ratio_batch().  The string is copied.
  *
- * Returns: The converted block operation codes, as a newly allocated array;
- *          its length is stored in @nb.
+ * Returns: The prepared query, %NULL on failure.
  **/
-LevOpCode*
-lev_editops_to_opcodes(size_t n, const LevEditOp *ops, size_t *nb,
-                       size_t len1, size_t len2)
+LevTokenQuery*
+lev_token_query_new(size_t len, const lev_byte *string,
+                    LevTokenScorer scorer)
 {
-  size_t nbl, i, spos, dpos;
-  const LevEditOp *o;
-  LevOpCode *bops, *b;
-  LevEditType type;
-
-  /* compute the number of blocks */
-  nbl = 0;
-  o = ops;
-  spos = dpos = 0;
-  type = LEV_EDIT_KEEP;
-  for (i = n; i; ) {
-    /* simply pretend there are no keep blocks */
-    while (o->type == LEV_EDIT_KEEP && --i)
-      o++;
-    if (!i)
-      break;
-    if (spos < o->spos || dpos < o->dpos) {
-      nbl++;
-      spos = o->spos;
-      dpos = o->dpos;
-    }
-    nbl++;
-    type = o->type;
-    switch (type) {
-      case LEV_EDIT_REPLACE:
-      do {
-        spos++;
-        dpos++;
-        i--;
-        o++;
-      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
-      break;
+  return token_query_new(len, string, 0, scorer);
+}
 
-      case LEV_EDIT_DELETE:
-      do {
-        spos++;
-        i--;
-        o++;
-      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
-      break;
+/**
+ * lev_u_token_query_new:
+ * @len: The length of @string.
+ * @string: A string of length @len, may contain NUL characters.
+ * @scorer: The token similarity to compute.
+ *
+ * Prepares @string to be compared with other strings by a token similarity,
+ * see lev_u_token_ratio_batch().  The string is copied.
+ *
+ * Returns: The prepared query, %NULL on failure.
+ **/
+LevTokenQuery*
+lev_u_token_query_new(size_t len, const lev_wchar *string,
+                      LevTokenScorer scorer)
+{
+  return token_query_new(len, string, 1, scorer);
+}
 
-      case LEV_EDIT_INSERT:
-      do {
-        dpos++;
-        i--;
-        o++;
-      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
-      break;
+/**
+ * lev_token_query_free:
+ * @query: A query created by lev_token_query_new() or
+ *         lev_u_token_query_new(), may be %NULL.
+ *
+ * Frees a query.
+ **/
+void
+lev_token_query_free(LevTokenQuery *query)
+{
+  if (!query)
+    return;
+  free(query->copy);
+  free(query->lengths);
+  free(query->strings);
+  free(query->joined);
+  free(query);
+}
 
-      default:
-      break;
-    }
+static int
+token_work_init(LevTokenWork *w, const LevTokenQuery *q)
+{
+  memset(w, 0, sizeof(LevTokenWork));
+  if (q->scorer != LEV_TOKEN_SORT)
+    return 0;
+  if (q->unicode) {
+    if (ulcs_pattern_init(&w->upat, q->len))
+      return -1;
+    ulcs_pattern_set(&w->upat, q->len, (const lev_wchar*)q->joined);
   }
-  if (spos < len1 || dpos < len2)
-    nbl++;
+  else {
+    if (lcs_pattern_init(&w->pat, q->len))
+      return -1;
+    lcs_pattern_set(&w->pat, q->len, (const lev_byte*)q->joined);
+  }
+  return 0;
+}
 
-  /* convert */
-  b = bops = (LevOpCode*)safe_malloc(nbl, sizeof(LevOpCode));
-  if (!bops) {
-    *nb = (size_t)(-1);
-    return NULL;
+static void
+token_work_free(LevTokenWork *w, const LevTokenQuery *q)
+{
+  if (q->scorer == LEV_TOKEN_SORT) {
+    if (q->unicode)
+      ulcs_pattern_free(&w->upat);
+    else
+      lcs_pattern_free(&w->pat);
   }
-  o = ops;
-  spos = dpos = 0;
-  type = LEV_EDIT_KEEP;
-  for (i = n; i; ) {
-    /* simply pretend there are no keep blocks */
-    while (o->type == LEV_EDIT_KEEP && --i)
-      o++;
-    if (!i)
-      break;
-    b->sbeg = spos;
-    b->dbeg = dpos;
-    if (spos < o->spos || dpos < o->dpos) {
-      b->type = LEV_EDIT_KEEP;
-      spos = b->send = o->spos;
-      dpos = b->dend = o->dpos;
-      b++;
-      b->sbeg = spos;
-      b->dbeg = dpos;
-    }
-    type = o->type;
-    switch (type) {
-      case LEV_EDIT_REPLACE:
-      do {
-        spos++;
-        dpos++;
-        i--;
-        o++;
-      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
-      break;
+  free(w->views);
+  free(w->lengths);
+  free(w->strings);
+  free(w->joined);
+}
 
-      case LEV_EDIT_DELETE:
-      do {
-        spos++;
-        i--;
-        o++;
-      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
-      break;
+/* make room for the tokens of a string of length @len */
+static int
+token_work_reserve(LevTokenWork *w, const LevTokenQuery *q, size_t len)
+{
+  size_t charsize = q->unicode ? sizeof(lev_wchar) : sizeof(lev_byte);
+  size_t size = w->size ? w->size : 64;
+
+  if (len <= w->size)
+    return 0;
+  while (size < len)
+    size *= 2;
+  free(w->views);
+  free(w->lengths);
+  free(w->strings);
+  free(w->joined);
+  w->lengths = NULL;
+  w->strings = NULL;
+  w->joined = NULL;
+  w->size = 0;
+  w->views = (LevTokenView*)safe_malloc(size/2 + 1, sizeof(LevTokenView));
+  if (!w->views)
+    return -1;
+  if (q->scorer == LEV_TOKEN_SORT) {
+    w->joined = safe_malloc(size + 1, charsize);
+    if (!w->joined)
+      return -1;
+  }
+  else {
+    w->lengths = (size_t*)safe_malloc(size/2 + 1, sizeof(size_t));
+    w->strings = (const void**)safe_malloc(size/2 + 1, sizeof(void*));
+    if (!w->lengths || !w->strings)
+      return -1;
+  }
+  w->size = size;
+  return 0;
+}
 
-      case LEV_EDIT_INSERT:
-      do {
-        dpos++;
-        i--;
-        o++;
-      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
-      break;
+/* the ratio of the query and @string, 0.0 when it's below @cutoff, -1.0 on
+ * failure */
+static double
+token_ratio(LevTokenWork *w, const LevTokenQuery *q, double cutoff,
+            size_t len, const void *string)
+{
+  size_t n, i, lensum;
+  double d, r;
 
-      default:
-      break;
-    }
-    b->type = type;
-    b->send = spos;
-    b->dend = dpos;
-    b++;
+  if (token_work_reserve(w, q, len))
+    return -1.0;
+  n = token_split(len, string, q->unicode, w->views);
+  n = token_arrange(w->views, n, q->unicode, q->scorer);
+
+  if (q->scorer == LEV_TOKEN_SORT) {
+    size_t len2 = token_join(w->views, n, q->unicode, w->joined);
+    size_t max;
+
+    lensum = q->len + len2;
+    /* the largest distance that can meet the cutoff, rounded up */
+    max = (size_t)((1.0 - cutoff)*(double)lensum) + 1;
+    if (q->unicode)
+      d = (double)ulcs_pattern_distance(&w->upat, len2,
+                                        (const lev_wchar*)w->joined, max);
+    else
+      d = (double)lcs_pattern_distance(&w->pat, len2,
+                                       (const lev_byte*)w->joined, max);
+    if (d > (double)lensum)
+      d = (double)lensum;
   }
-  if (spos < len1 || dpos < len2) {
-    assert(len1 - spos == len2 - dpos);
-    b->type = LEV_EDIT_KEEP;
-    b->sbeg = spos;
-    b->dbeg = dpos;
-    b->send = len1;
-    b->dend = len2;
-    b++;
+  else {
+    for (i = 0; i < n; i++) {
+      w->lengths[i] = w->views[i].len;
+      w->strings[i] = w->views[i].s;
+    }
+    lensum = q->n + n;
+    if (q->scorer == LEV_TOKEN_SET && q->unicode)
+      d = lev_u_set_distance(q->n, q->lengths, (const lev_wchar**)q->strings,
+                             n, w->lengths, (const lev_wchar**)w->strings);
+    else if (q->scorer == LEV_TOKEN_SET)
+      d = lev_set_distance(q->n, q->lengths, (const lev_byte**)q->strings,
+                           n, w->lengths, (const lev_byte**)w->strings);
+    else if (q->unicode)
+      d = lev_u_edit_seq_distance(q->n, q->lengths,
+                                  (const lev_wchar**)q->strings,
+                                  n, w->lengths,
+                                  (const lev_wchar**)w->strings);
+    else
+      d = lev_edit_seq_distance(q->n, q->lengths,
+                                (const lev_byte**)q->strings,
+                                n, w->lengths, (const lev_byte**)w->strings);
+    if (d < 0.0)
+      return -1.0;
   }
-  assert((size_t)(b - bops) == nbl);
 
-  *nb = nbl;
-  return bops;
+  r = lensum ? ((double)lensum - d)/(double)lensum : 1.0;
+  return r < cutoff ? 0.0 : r;
 }
 
-/**
- * lev_opcodes_apply:
- * @len1: The length of the source string.
- * @string1: A string of length @len1, may contain NUL characters.
- * @len2: The length of the destination string.
- * @string2: A string of length @len2, may contain NUL characters.
- * @nb: The length of @bops.
- * @bops: An array of difflib block edit operation codes.
- * @len: Where the size of the resulting string should be stored.
- *
- * Applies a sequence of difflib block operations to a string.
- *
- * NB: @bops is not checked for applicability.
- *
- * Returns: The result of the edit as a newly allocated string, its length
- *          is stored in @len.
- **/
-lev_byte*
-lev_opcodes_apply(size_t len1, const lev_byte *string1,
-                  size_t len2, const lev_byte *string2,
-                  size_t nb, const LevOpCode *bops,
-                  size_t *len)
+typedef struct {
+  const LevTokenQuery *query;
+  size_t n;
+  const size_t *lengths;
+  const void **strings;
+  double cutoff;
+  double *ratios;  /* for batches */
+  size_t count;  /* for the best matches */
+  LevTokenMatch *heaps;  /* count items per thread */
+  size_t *nheaps;
+  char *failed;  /* per thread */
+} LevTokenBatch;
+
+/* whether match @a is worse than match @b */
+static int
+token_match_worse(const LevTokenMatch *a, const LevTokenMatch *b)
+{
+  return a->ratio < b->ratio || (a->ratio == b->ratio && a->id > b->id);
+}
+
+static void
+token_heap_push(LevTokenMatch *heap, size_t *n, size_t count, LevTokenMatch m)
 {
-  lev_byte *dst, *dpos;  /* destination string */
-  const lev_byte *spos;  /* source string position */
   size_t i;
 
-  /* this looks too complex for such a simple task, but note ops is not
-   * a complete edit sequence, we have to be able to apply anything anywhere */
-  dpos = dst = (lev_byte*)safe_malloc((len1 + len2), sizeof(lev_byte));
-  if (!dst) {
-    *len = (size_t)(-1);
-    return NULL;
+  if (*n == count) {
+    /* replace the worst one, if m is better, and sift down */
+    if (!token_match_worse(heap, &m))
+      return;
+    i = 0;
+    while (2*i + 1 < count) {
+      size_t c = 2*i + 1;
+      if (c + 1 < count && token_match_worse(heap + c + 1, heap + c))
+        c++;
+      if (!token_match_worse(heap + c, &m))
+        break;
+      heap[i] = heap[c];
+      i = c;
+    }
+    heap[i] = m;
+    return;
   }
-  spos = string1;
-  for (i = nb; i; i--, bops++) {
-    switch (bops->type) {
-      case LEV_EDIT_INSERT:
-      case LEV_EDIT_REPLACE:
-      memcpy(dpos, string2 + bops->dbeg,
-             (bops->dend - bops->dbeg)*sizeof(lev_byte));
-      break;
+  /* sift up */
+  i = (*n)++;
+  while (i && token_match_worse(&m, heap + (i - 1)/2)) {
+    heap[i] = heap[(i - 1)/2];
+    i = (i - 1)/2;
+  }
+  heap[i] = m;
+}
 
-      case LEV_EDIT_KEEP:
-      memcpy(dpos, string1 + bops->sbeg,
-             (bops->send - bops->sbeg)*sizeof(lev_byte));
+static void
+token_batch_worker(void *data, size_t ithread, size_t nthreads)
+{
+  LevTokenBatch *batch = (LevTokenBatch*)data;
+  LevTokenWork work;
+  size_t i, nheap = 0;
+
+  batch->failed[ithread] = 0;
+  if (batch->count)
+    batch->nheaps[ithread] = 0;
+  if (token_work_init(&work, batch->query)) {
+    batch->failed[ithread] = 1;
+    return;
+  }
+  for (i = batch->n*ithread/nthreads;
+       i < batch->n*(ithread + 1)/nthreads;
+       i++) {
+    double r;
+
+    if (!(i % LEV_SCHED_GRAIN))
+      lev_sched_checkpoint(ithread);
+    r = token_ratio(&work, batch->query, batch->cutoff,
+                    batch->lengths[i], batch->strings[i]);
+    if (r < 0.0) {
+      batch->failed[ithread] = 1;
       break;
+    }
+    if (!batch->count)
+      batch->ratios[i] = r;
+    else if (r > 0.0 || batch->cutoff <= 0.0) {
+      LevTokenMatch m;
+
+      m.id = i;
+      m.ratio = r;
+      token_heap_push(batch->heaps + ithread*batch->count, &nheap,
+                      batch->count, m);
+    }
+  }
+  if (batch->count)
+    batch->nheaps[ithread] = nheap;
+  token_work_free(&work, batch->query);
+}
 
-      default:
-      break;
+static int
+token_run(LevTokenBatch *batch, size_t nthreads)
+{
+  size_t t;
+  int failed = 0;
+
+  if (!nthreads)
+    nthreads = lev_cpu_count();
+  if (nthreads > batch->n/lev_tuning.token_chunk + 1)
+    nthreads = batch->n/lev_tuning.token_chunk + 1;
+  batch->failed = (char*)safe_malloc(nthreads, sizeof(char));
+  if (!batch->failed)
+    return -1;
+  if (batch->count) {
+    batch->heaps = (LevTokenMatch*)safe_malloc_3(nthreads, batch->count + 1,
+                                                 sizeof(LevTokenMatch));
+    batch->nheaps = (size_t*)safe_malloc(nthreads, sizeof(size_t));
+    if (!batch->heaps || !batch->nheaps) {
+      free(batch->heaps);
+      free(batch->nheaps);
+      free(batch->failed);
+      return -1;
     }
-    spos += bops->send - bops->sbeg;
-    dpos += bops->dend - bops->dbeg;
   }
+  lev_run_parallel(nthreads, token_batch_worker, batch);
+  for (t = 0; t < nthreads; t++)
+    failed |= batch->failed[t];
+  free(batch->failed);
+  if (failed) {
+    if (batch->count) {
+      free(batch->heaps);
+      free(batch->nheaps);
+    }
+    return -1;
+  }
+  return (int)nthreads;
+}
 
-  *len = (size_t)(dpos - dst);
-  /* possible realloc failure is detected with *len != 0 */
-  return (lev_byte*)realloc(dst, *len*sizeof(lev_byte));
+static int
+token_match_cmp(const void *a, const void *b)
+{
+  const LevTokenMatch *x = (const LevTokenMatch*)a;
+  const LevTokenMatch *y = (const LevTokenMatch*)b;
+
+  if (x->ratio != y->ratio)
+    return x->ratio > y->ratio ? -1 : 1;
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+static int
+token_ratio_batch(const LevTokenQuery *query,
+                  size_t n, const size_t *lengths, const void **strings,
+                  double cutoff, size_t nthreads, double *ratios)
+{
+  LevTokenBatch batch;
+
+  memset(&batch, 0, sizeof(LevTokenBatch));
+  batch.query = query;
+  batch.n = n;
+  batch.lengths = lengths;
+  batch.strings = strings;
+  batch.cutoff = cutoff;
+  batch.ratios = ratios;
+  return token_run(&batch, nthreads) < 0 ? -1 : 0;
+}
+
+static LevTokenMatch*
+token_ratio_best(const LevTokenQuery *query,
+                 size_t n, const size_t *lengths, const void **strings,
+                 double cutoff, size_t count, size_t nthreads,
+                 size_t *nmatches)
+{
+  LevTokenBatch batch;
+  LevTokenMatch *matches;
+  size_t t, m;
+  int nt;
+
+  *nmatches = (size_t)(-1);
+  if (count > n)
+    count = n;
+  if (!count) {
+    *nmatches = 0;
+    return (LevTokenMatch*)malloc(sizeof(LevTokenMatch));
+  }
+  memset(&batch, 0, sizeof(LevTokenBatch));
+  batch.query = query;
+  batch.n = n;
+  batch.lengths = lengths;
+  batch.strings = strings;
+  batch.cutoff = cutoff;
+  batch.count = count;
+  nt = token_run(&batch, nthreads);
+  if (nt < 0)
+    return NULL;
+
+  /* merge the per-thread heaps */
+  m = 0;
+  for (t = 0; t < (size_t)nt; t++) {
+    memmove(batch.heaps + m, batch.heaps + t*count,
+            batch.nheaps[t]*sizeof(LevTokenMatch));
+    m += batch.nheaps[t];
+  }
+  free(batch.nheaps);
+  qsort(batch.heaps, m, sizeof(LevTokenMatch), token_match_cmp);
+  if (m > count)
+    m = count;
+  matches = (LevTokenMatch*)realloc(batch.heaps,
+                                    (m + 1)*sizeof(LevTokenMatch));
+  if (!matches)
+    matches = batch.heaps;
+  *nmatches = m;
+
+  return matches;
 }
 
 /**
- * lev_u_opcodes_apply:
- * @len1: The length of the source string.
- * @string1: A string of length @len1, may contain NUL characters.
- * @len2: The length of the destination string.
- * @string2: A string of length @len2, may contain NUL characters.
- * @nb: The length of @bops.
- * @bops: An array of difflib block edit operation codes.
- * @len: Where the size of the resulting string should be stored.
+ * lev_token_ratio_batch:
+ * @query: A query made by lev_token_query_new().
+ * @n: The number of strings.
+ * @lengths: The lengths of @strings.
+ * @strings: The strings to compare with @query.
+ * @cutoff: Ratios smaller than @cutoff are stored as zero, possibly
+ *          computed faster.
+ * @nthreads: The number of threads to use, zero means one per processor.
+ * @ratios: Where the ratios should be stored, @n of them.
  *
- * Applies a sequence of difflib block operations to a string.
+ * Computes the token similarity of @query with each string of @strings,
+ * a ratio between 0 and 1 (1 for two strings without tokens).
  *
- * NB: @bops is not checked for applicability.
+ * %LEV_TOKEN_SORT is the InDel ratio of the tokens sorted and joined by
+ * single spaces, %LEV_TOKEN_SET the ratio of lev_set_distance() of the
+ * distinct tokens and %LEV_TOKEN_SEQ the ratio of lev_edit_seq_distance()
+ * of the tokens.  Tokens are separated by ASCII whitespace.
  *
- * Returns: The result of the edit as a newly allocated string, its length
- *          is stored in @len.
+ * Returns: Zero on success, -1 on failure.
  **/
-lev_wchar*
-lev_u_opcodes_apply(size_t len1, const lev_wchar *string1,
-                    size_t len2, const lev_wchar *string2,
-                    size_t nb, const LevOpCode *bops,
-                    size_t *len)
+int
+lev_token_ratio_batch(const LevTokenQuery *query,
+                      size_t n, const size_t *lengths,
+                      const lev_byte *strings[],
+                      double cutoff, size_t nthreads, double *ratios)
 {
-  lev_wchar *dst, *dpos;  /* destination string */
-  const lev_wchar *spos;  /* source string position */
-  size_t i;
-
-  /* this looks too complex for such a simple task, but note ops is not
-   * a complete edit sequence, we have to be able to apply anything anywhere */
-  dpos = dst = (lev_wchar*)safe_malloc((len1 + len2), sizeof(lev_wchar));
-  if (!dst) {
-    *len = (size_t)(-1);
-    return NULL;
-  }
-  spos = string1;
-  for (i = nb; i; i--, bops++) {
-    switch (bops->type) {
-      case LEV_EDIT_INSERT:
-      case LEV_EDIT_REPLACE:
-      memcpy(dpos, string2 + bops->dbeg,
-             (bops->dend - bops->dbeg)*sizeof(lev_wchar));
-      break;
-
-      case LEV_EDIT_KEEP:
-      memcpy(dpos, string1 + bops->sbeg,
-             (bops->send - bops->sbeg)*sizeof(lev_wchar));
-      break;
-
-      default:
-      break;
-    }
-    spos += bops->send - bops->sbeg;
-    dpos += bops->dend - bops->dbeg;
-  }
-
-  *len = (size_t)(dpos - dst);
-  /* possible realloc failure is detected with *len != 0 */
-  return (lev_wchar*)realloc(dst, *len*sizeof(lev_wchar));
+  return token_ratio_batch(query, n, lengths, (const void**)strings,
+                           cutoff, nthreads, ratios);
 }
 
 /**
- * lev_opcodes_invert:
- * @nb: The length of @ops.
- * @bops: An array of difflib block edit operation codes.
+ * lev_u_token_ratio_batch:
+ * @query: A query made by lev_u_token_query_new().
+ * @n: The number of strings.
+ * @lengths: The lengths of @strings.
+ * @strings: The strings to compare with @query.
+ * @cutoff: Ratios smaller than @cutoff are stored as zero, possibly
+ *          computed faster.
+ * @nthreads: The number of threads to use, zero means one per processor.
+ * @ratios: Where the ratios should be stored, @n of them.
  *
- * Inverts the sense of @ops.  It is modified in place.
+ * Computes the token similarity of @query with each string of @strings,
+ * see lev_token_ratio_batch().  Tokens are separated by whitespace as in
+ * Python's str.split().
  *
- * In other words, @ops becomes a partial edit for the original source
- * and destination strings with their roles exchanged.
+ * Returns: Zero on success, -1 on failure.
  **/
-void
-lev_opcodes_invert(size_t nb, LevOpCode *bops)
+int
+lev_u_token_ratio_batch(const LevTokenQuery *query,
+                        size_t n, const size_t *lengths,
+                        const lev_wchar *strings[],
+                        double cutoff, size_t nthreads, double *ratios)
 {
-  size_t i;
-
-  for (i = nb; i; i--, bops++) {
-    size_t z;
-
-    z = bops->dbeg;
-    bops->dbeg = bops->sbeg;
-    bops->sbeg = z;
-    z = bops->dend;
-    bops->dend = bops->send;
-    bops->send = z;
-    if (bops->type & 2)
-      bops->type = (LevEditType)(bops->type ^ 1);
-  }
+  return token_ratio_batch(query, n, lengths, (const void**)strings,
+                           cutoff, nthreads, ratios);
 }
 
 /**
- * lev_editops_matching_blocks:
- * @len1: The length of the source string.
- * @len2: The length of the destination string.
- * @n: The size of @ops.
- * @ops: An array of elementary edit operations.
- * @nmblocks: Where the number of matching block should be stored.
+ * lev_token_ratio_best:
+ * @query: A query made by lev_token_query_new().
+ * @n: The number of strings.
+ * @lengths: The lengths of @strings.
+ * @strings: The strings to compare with @query.
+ * @cutoff: Strings with ratios smaller than @cutoff are never returned.
+ * @count: The number of best matching strings to find.
+ * @nthreads: The number of threads to use, zero means one per processor.
+ * @nmatches: Where the number of found strings should be stored.
  *
- * Computes the matching block corresponding to an optimal edit @ops.
+ * Finds the @count strings most similar to @query by the token similarity,
+ * see lev_token_ratio_batch().
  *
- * Returns: The matching blocks as a newly allocated array, it length is
- *          stored in @nmblocks.
+ * Returns: The matches sorted by decreasing ratio and index, as a newly
+ *          allocated array; %NULL on failure, in that case @nmatches is
+ *          set to (size_t)(-1).
  **/
-LevMatchingBlock*
-lev_editops_matching_blocks(size_t len1,
-                            size_t len2,
-                            size_t n,
-                            const LevEditOp *ops,
-                            size_t *nmblocks)
+LevTokenMatch*
+lev_token_ratio_best(const LevTokenQuery *query,
+                     size_t n, const size_t *lengths,
+                     const lev_byte *strings[],
+                     double cutoff, size_t count, size_t nthreads,
+                     size_t *nmatches)
 {
-  size_t nmb, i, spos, dpos;
-  LevEditType type;
-  const LevEditOp *o;
-  LevMatchingBlock *mblocks, *mb;
+  return token_ratio_best(query, n, lengths, (const void**)strings,
+                          cutoff, count, nthreads, nmatches);
+}
 
-  /* compute the number of matching blocks */
-  nmb = 0;
-  o = ops;
-  spos = dpos = 0;
-  type = LEV_EDIT_KEEP;
-  for (i = n; i; ) {
-    /* simply pretend there are no keep blocks */
-    while (o->type == LEV_EDIT_KEEP && --i)
-      o++;
-    if (!i)
-      break;
-    if (spos < o->spos || dpos < o->dpos) {
-      nmb++;
-      spos = o->spos;
-      dpos = o->dpos;
-    }
-    type = o->type;
-    switch (type) {
-      case LEV_EDIT_REPLACE:
-      do {
-        spos++;
-        dpos++;
-        i--;
-        o++;
-      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
-      break;
+/**
+ * lev_u_token_ratio_best:
+ * @query: A query made by lev_u_token_query_new().
+ * @n: The number of strings.
+ * @lengths: The lengths of @strings.
+ * @strings: The strings to compare with @query.
+ * @cutoff: Strings with ratios smaller than @cutoff are never returned.
+ * @count: The number of best matching strings to find.
+ * @nthreads: The number of threads to use, zero means one per processor.
+ * @nmatches: Where the number of found strings should be stored.
+ *
+ * Finds the @count strings most similar to @query by the token similarity,
+ * see lev_u_token_ratio_batch().
+ *
+ * Returns: The matches sorted by decreasing ratio and index, as a newly
+ *          allocated array; %NULL on failure, in that case @nmatches is
+ *          set to (size_t)(-1).
+ **/
+LevTokenMatch*
+lev_u_token_ratio_best(const LevTokenQuery *query,
+                       size_t n, const size_t *lengths,
+                       const lev_wchar *strings[],
+                       double cutoff, size_t count, size_t nthreads,
+                       size_t *nmatches)
+{
+  return token_ratio_best(query, n, lengths, (const void**)strings,
+                          cutoff, count, nthreads, nmatches);
+}
+/* }}} */
 
-      case LEV_EDIT_DELETE:
-      do {
-        spos++;
-        i--;
-        o++;
-      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
-      break;
+/****************************************************************************
+ *
+ * Line sets
+ *
+ ****************************************************************************/
+/* {{{ */
 
-      case LEV_EDIT_INSERT:
-      do {
-        dpos++;
-        i--;
-        o++;
-      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
-      break;
+/* A UTF-8 text is split to lines at LF, each line is normalized like
+ * ' '.join(line.split()) of its decoded text and identical normalized
+ * lines are collapsed.  Whitespace is found on the bytes: the encodings of
+ * the whitespace code points start with ASCII or lead bytes, so they
+ * decode the same in any context, also next to invalid sequences. */
 
-      default:
-      break;
-    }
-  }
-  if (spos < len1 || dpos < len2)
-    nmb++;
+/* the length of the whitespace code point at @s, 0 if there is none */
+static size_t
+lines_space(size_t len, const lev_byte *s)
+{
+  if (s[0] < 0x80)
+    return token_u_isspace(s[0]) ? 1 : 0;
+  if (s[0] == 0xc2 && len >= 2)
+    return s[1] == 0x85 || s[1] == 0xa0 ? 2 : 0;
+  /* no whitespace needs E0, which could be overlong */
+  if (s[0] >= 0xe1 && s[0] <= 0xef && len >= 3
+      && (s[1] & 0xc0) == 0x80 && (s[2] & 0xc0) == 0x80) {
+    lev_wchar c = (lev_wchar)(((s[0] & 0x0f) << 12) | ((s[1] & 0x3f) << 6)
+                              | (s[2] & 0x3f));
+    return token_u_isspace(c) ? 3 : 0;
+  }
+  return 0;
+}
 
-  /* fill the info */
-  mb = mblocks = (LevMatchingBlock*)safe_malloc(nmb, sizeof(LevMatchingBlock));
-  if (!mblocks) {
-    *nmblocks = (size_t)(-1);
-    return NULL;
-  }
-  o = ops;
-  spos = dpos = 0;
-  type = LEV_EDIT_KEEP;
-  for (i = n; i; ) {
-    /* simply pretend there are no keep blocks */
-    while (o->type == LEV_EDIT_KEEP && --i)
-      o++;
-    if (!i)
-      break;
-    if (spos < o->spos || dpos < o->dpos) {
-      mb->spos = spos;
-      mb->dpos = dpos;
-      mb->len = o->spos - spos;
-      spos = o->spos;
-      dpos = o->dpos;
-      mb++;
-    }
-    type = o->type;
-    switch (type) {
-      case LEV_EDIT_REPLACE:
-      do {
-        spos++;
-        dpos++;
-        i--;
-        o++;
-      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
-      break;
+/* normalize line @s of length @len into @buf, of room for @len bytes;
+ * returns the normalized length */
+static size_t
+lines_normalize(size_t len, const lev_byte *s, lev_byte *buf)
+{
+  size_t i = 0, n = 0, k;
 
-      case LEV_EDIT_DELETE:
-      do {
-        spos++;
-        i--;
-        o++;
-      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
+  while (i < len) {
+    while (i < len && (k = lines_space(len - i, s + i)) > 0)
+      i += k;
+    if (i == len)
       break;
+    if (n)
+      buf[n++] = ' ';
+    while (i < len && lines_space(len - i, s + i) == 0)
+      buf[n++] = s[i++];
+  }
+  return n;
+}
 
-      case LEV_EDIT_INSERT:
-      do {
-        dpos++;
-        i--;
-        o++;
-      } while (i && o->type == type && spos == o->spos && dpos == o->dpos);
-      break;
+static size_t
+lines_hash(size_t len, const lev_byte *s)
+{
+  size_t h = len;
+  size_t i;
 
-      default:
-      break;
-    }
-  }
-  if (spos < len1 || dpos < len2) {
-    assert(len1 - spos == len2 - dpos);
-    mb->spos = spos;
-    mb->dpos = dpos;
-    mb->len = len1 - spos;
-    mb++;
-  }
-  assert((size_t)(mb - mblocks) == nmb);
+  for (i = 0; i < len; i++)
+    h = (h ^ (size_t)s[i])*0x9e3779b1u;
+  return h ^ (h >> 15);
+}
 
-  *nmblocks = nmb;
-  return mblocks;
+/* reallocate array @p to @n items of @itemsize bytes; returns -1 on
+ * failure, @p is kept then */
+static int
+lines_resize(void **p, size_t n, size_t itemsize)
+{
+  void *q;
+
+  if (n > SIZE_MAX/itemsize)
+    return -1;
+  q = realloc(*p, n*itemsize);
+  if (!q)
+    return -1;
+  *p = q;
+  return 0;
+}
+
+/* grow array @p of @size items of @itemsize bytes to at least @need
+ * items; returns -1 on failure */
+static int
+lines_grow(void **p, size_t *size, size_t need, size_t itemsize)
+{
+  size_t size2 = *size ? *size : 64;
+
+  if (need <= *size)
+    return 0;
+  while (size2 < need) {
+    if (size2 > SIZE_MAX/2)
+      return -1;
+    size2 *= 2;
+  }
+  if (lines_resize(p, size2, itemsize))
+    return -1;
+  *size = size2;
+  return 0;
 }
 
 /**
- * lev_opcodes_matching_blocks:
- * @len1: The length of the source string.
- * @len2: The length of the destination string.
- * @nb: The size of @bops.
- * @bops: An array of difflib block edit operation codes.
- * @nmblocks: Where the number of matching block should be stored.
+ * lev_line_set_scan:
+ * @size: The size of @text.
+ * @text: A UTF-8 encoded text, invalid sequences are allowed.
+ * @set: Where the lines should be stored.
  *
- * Computes the matching block corresponding to an optimal edit @bops.
+ * Splits @text to lines at LF (a final line without one counts too),
+ * normalizes them like ' '.join(line.split()) normalizes their decoded
+ * text, and collapses the identical normalized lines.  Only the distinct
+ * lines are stored, and for each line the number of its distinct line.
+ * Distinct lines are numbered in the order of their first lines.
  *
- * Returns: The matching blocks as a newly allocated array, it length is
- *          stored in @nmblocks.
+ * Returns: Zero on success, -1 on allocation failure.
  **/
-LevMatchingBlock*
-lev_opcodes_matching_blocks(size_t len1,
-                            size_t len2,
-                            size_t nb,
-                            const LevOpCode *bops,
-                            size_t *nmblocks)
+int
+lev_line_set_scan(size_t size, const char *text, LevLineSet *set)
 {
-  size_t nmb, i;
-  const LevOpCode *b;
-  LevMatchingBlock *mblocks, *mb;
-  LEV_UNUSED(len2);
-
-  /* compute the number of matching blocks */
-  nmb = 0;
-  b = bops;
-  for (i = nb; i; i--, b++) {
-    if (b->type == LEV_EDIT_KEEP) {
-      nmb++;
-      /* adjacent KEEP blocks -- we never produce it, but... */
-      while (i && b->type == LEV_EDIT_KEEP) {
-        i--;
-        b++;
+  const lev_byte *s = (const lev_byte*)text;
+  size_t *table = NULL;  /* distinct line + 1 of each slot, 0 when free */
+  size_t *hashes = NULL;  /* the hash of each distinct line */
+  size_t tsize = 0, lsize = 0, nsize = 0, ksize = 0, msize = 0;
+  size_t pos = 0;
+  lev_byte *buf = NULL;
+
+  memset(set, 0, sizeof(LevLineSet));
+  while (pos < size) {
+    const lev_byte *nl = (const lev_byte*)memchr(s + pos, '\n', size - pos);
+    size_t end = nl ? (size_t)(nl - s) : size;
+    size_t len, h, slot, key;
+
+    /* normalize the line */
+    if (lines_grow((void**)&buf, &msize, end - pos + 1, 1))
+      goto fail;
+    len = lines_normalize(end - pos, s + pos, buf);
+
+    /* and look it up */
+    if (2*(set->n + 1) > tsize) {
+      size_t tsize2 = tsize ? 2*tsize : 64;
+      size_t *table2 = (size_t*)calloc(tsize2, sizeof(size_t));
+      size_t i;
+
+      if (!table2)
+        goto fail;
+      for (i = 0; i < set->n; i++) {
+        slot = hashes[i] & (tsize2 - 1);
+        while (table2[slot])
+          slot = (slot + 1) & (tsize2 - 1);
+        table2[slot] = i + 1;
       }
-      if (!i)
-        break;
+      free(table);
+      table = table2;
+      tsize = tsize2;
     }
-  }
-
-  /* convert */
-  mb = mblocks = (LevMatchingBlock*)safe_malloc(nmb, sizeof(LevMatchingBlock));
-  if (!mblocks) {
-    *nmblocks = (size_t)(-1);
-    return NULL;
-  }
-  b = bops;
-  for (i = nb; i; i--, b++) {
-    if (b->type == LEV_EDIT_KEEP) {
-      mb->spos = b->sbeg;
-      mb->dpos = b->dbeg;
-      /* adjacent KEEP blocks -- we never produce it, but... */
-      while (i && b->type == LEV_EDIT_KEEP) {
-        i--;
-        b++;
-      }
-      if (!i) {
-        mb->len = len1 - mb->spos;
-        mb++;
+    h = lines_hash(len, buf);
+    slot = h & (tsize - 1);
+    while ((key = table[slot]) != 0) {
+      key--;
+      if (hashes[key] == h
+          && set->bounds[key + 1] - set->bounds[key] == len
+          && memcmp(set->lines + set->bounds[key], buf, len) == 0)
         break;
+      slot = (slot + 1) & (tsize - 1);
+    }
+    if (!table[slot]) {
+      /* a new distinct line */
+      key = set->n;
+      if (key + 2 > nsize) {
+        size_t nsize2 = nsize ? 2*nsize : 64;
+
+        if (nsize2 <= nsize
+            || lines_resize((void**)&hashes, nsize2, sizeof(size_t))
+            || lines_resize((void**)&set->counts, nsize2, sizeof(size_t))
+            || lines_resize((void**)&set->first, nsize2, sizeof(size_t))
+            || lines_resize((void**)&set->offsets, nsize2, sizeof(size_t))
+            || lines_resize((void**)&set->bounds, nsize2, sizeof(size_t)))
+          goto fail;
+        nsize = nsize2;
       }
-      mb->len = b->sbeg - mb->spos;
-      mb++;
+      if (!key)
+        set->bounds[0] = 0;
+      if (lines_grow((void**)&set->lines, &lsize,
+                     set->bounds[key] + len + 1, 1))
+        goto fail;
+      memcpy(set->lines + set->bounds[key], buf, len);
+      set->bounds[key + 1] = set->bounds[key] + len;
+      hashes[key] = h;
+      set->counts[key] = 0;
+      set->first[key] = set->nlines;
+      set->offsets[key] = pos;
+      table[slot] = key + 1;
+      set->n++;
     }
-  }
-  assert((size_t)(mb - mblocks) == nmb);
-
-  *nmblocks = nmb;
-  return mblocks;
+    set->counts[key]++;
+    if (lines_grow((void**)&set->keys, &ksize, set->nlines + 1,
+                   sizeof(size_t)))
+      goto fail;
+    set->keys[set->nlines++] = key;
+    pos = end + 1;
+  }
+
+  free(buf);
+  free(table);
+  free(hashes);
+  return 0;
+
+fail:
+  free(buf);
+  free(table);
+  free(hashes);
+  lev_line_set_free(set);
+  return -1;
 }
 
 /**
- * lev_editops_normalize:
- * @n: The size of @ops.
- * @ops: An array of elementary edit operations.
- * @nnorm: Where to store then length of the normalized array.
+ * lev_line_set_free:
+ * @set: Lines found by lev_line_set_scan().
  *
- * Normalizes a list of edit operations to contain no keep operations.
+ * Frees the lines, but not @set itself.
+ **/
+void
+lev_line_set_free(LevLineSet *set)
+{
+  free(set->keys);
+  free(set->counts);
+  free(set->first);
+  free(set->offsets);
+  free(set->bounds);
+  free(set->lines);
+  memset(set, 0, sizeof(LevLineSet));
+}
+/* }}} */
+
+/****************************************************************************
  *
- * Note it returns %NULL for an empty array.
+ * Grapheme clusters
  *
- * Returns: A newly allocated array of normalized edit operations, its length
- *          is stored to @nnorm.
- **/
-LevEditOp*
-lev_editops_normalize(size_t n,
-                      const LevEditOp *ops,
-                      size_t *nnorm)
+ ****************************************************************************/
+/* {{{ */
+
+/* Strings are split to extended grapheme clusters by the rules of UAX #29
+ * (Unicode 16.0), so that a base character with its combining marks, an
+ * emoji ZWJ sequence, a flag, a Hangul syllable made of jamo or CR LF each
+ * count as one symbol.  Clusters are interned in a table shared by all
+ * strings of one lev_grapheme_split() call and the strings are turned to
+ * sequences of cluster ids, which the lev_u_* engines compare like any
+ * other symbols. */
+
+/* Grapheme_Cluster_Break classes; GCB_HANGUL is only used in the table
+ * and stands for LV or LVT, the syllables alternate regularly */
+enum {
+  GCB_OTHER,
+  GCB_CR,
+  GCB_LF,
+  GCB_CONTROL,
+  GCB_EXTEND,
+  GCB_ZWJ,
+  GCB_RI,
+  GCB_PREPEND,
+  GCB_SPACINGMARK,
+  GCB_L,
+  GCB_V,
+  GCB_T,
+  GCB_LV,
+  GCB_LVT,
+  GCB_PICT,  /* Extended_Pictographic */
+  GCB_CONSONANT,  /* Indic_Conjunct_Break=Consonant */
+  GCB_HANGUL,
+  GCB_CLASS = 0x1f,
+  GCB_INCB = 0x20,  /* Indic_Conjunct_Break=Extend */
+  GCB_LINKER = 0x40  /* Indic_Conjunct_Break=Linker */
+};
+
+typedef struct {
+  uint32_t first;
+  uint32_t last;
+  unsigned char cls;
+} LevGraphemeRange;
+
+/* code points that aren't GCB_OTHER, generated from the Unicode 16.0
+ * GraphemeBreakProperty.txt, emoji-data.txt and the InCB property of
+ * DerivedCoreProperties.txt */
+static const LevGraphemeRange grapheme_ranges[] = {
+  { 0x0000, 0x0009, GCB_CONTROL }, { 0x000A, 0x000A, GCB_LF },
+  { 0x000B, 0x000C, GCB_CONTROL }, { 0x000D, 0x000D, GCB_CR },
+  { 0x000E, 0x001F, GCB_CONTROL }, { 0x007F, 0x009F, GCB_CONTROL },
+  { 0x00A9, 0x00A9, GCB_PICT }, { 0x00AD, 0x00AD, GCB_CONTROL },
+  { 0x00AE, 0x00AE, GCB_PICT }, { 0x0300, 0x036F, GCB_EXTEND | GCB_INCB },
+  { 0x0483, 0x0489, GCB_EXTEND | GCB_INCB },
+  { 0x0591, 0x05BD, GCB_EXTEND | GCB_INCB },
+  { 0x05BF, 0x05BF, GCB_EXTEND | GCB_INCB },
+  { 0x05C1, 0x05C2, GCB_EXTEND | GCB_INCB },
+  { 0x05C4, 0x05C5, GCB_EXTEND | GCB_INCB },
+  { 0x05C7, 0x05C7, GCB_EXTEND | GCB_INCB }, { 0x0600, 0x0605, GCB_PREPEND },
+  { 0x0610, 0x061A, GCB_EXTEND | GCB_INCB }, { 0x061C, 0x061C, GCB_CONTROL },
+  { 0x064B, 0x065F, GCB_EXTEND | GCB_INCB },
+  { 0x0670, 0x0670, GCB_EXTEND | GCB_INCB },
+  { 0x06D6, 0x06DC, GCB_EXTEND | GCB_INCB }, { 0x06DD, 0x06DD, GCB_PREPEND },
+  { 0x06DF, 0x06E4, GCB_EXTEND | GCB_INCB },
+  { 0x06E7, 0x06E8, GCB_EXTEND | GCB_INCB },
+  { 0x06EA, 0x06ED, GCB_EXTEND | GCB_INCB }, { 0x070F, 0x070F, GCB_PREPEND },
+  { 0x0711, 0x0711, GCB_EXTEND | GCB_INCB },
+  { 0x0730, 0x074A, GCB_EXTEND | GCB_INCB },
+  { 0x07A6, 0x07B0, GCB_EXTEND | GCB_INCB },
+  { 0x07EB, 0x07F3, GCB_EXTEND | GCB_INCB },
+  { 0x07FD, 0x07FD, GCB_EXTEND | GCB_INCB },
+  { 0x0816, 0x0819, GCB_EXTEND | GCB_INCB },
+  { 0x081B, 0x0823, GCB_EXTEND | GCB_INCB },
+  { 0x0825, 0x0827, GCB_EXTEND | GCB_INCB },
+  { 0x0829, 0x082D, GCB_EXTEND | GCB_INCB },
+  { 0x0859, 0x085B, GCB_EXTEND | GCB_INCB }, { 0x0890, 0x0891, GCB_PREPEND },
+  { 0x0897, 0x089F, GCB_EXTEND | GCB_INCB },
+  { 0x08CA, 0x08E1, GCB_EXTEND | GCB_INCB }, { 0x08E2, 0x08E2, GCB_PREPEND },
+  { 0x08E3, 0x0902, GCB_EXTEND | GCB_INCB },
+  { 0x0903, 0x0903, GCB_SPACINGMARK }, { 0x0915, 0x0939, GCB_CONSONANT },
+  { 0x093A, 0x093A, GCB_EXTEND | GCB_INCB },
+  { 0x093B, 0x093B, GCB_SPACINGMARK },
+  { 0x093C, 0x093C, GCB_EXTEND | GCB_INCB },
+  { 0x093E, 0x0940, GCB_SPACINGMARK },
+  { 0x0941, 0x0948, GCB_EXTEND | GCB_INCB },
+  { 0x0949, 0x094C, GCB_SPACINGMARK },
+  { 0x094D, 0x094D, GCB_EXTEND | GCB_LINKER },
+  { 0x094E, 0x094F, GCB_SPACINGMARK },
+  { 0x0951, 0x0957, GCB_EXTEND | GCB_INCB }, { 0x0958, 0x095F, GCB_CONSONANT },
+  { 0x0962, 0x0963, GCB_EXTEND | GCB_INCB }, { 0x0978, 0x097F, GCB_CONSONANT },
+  { 0x0981, 0x0981, GCB_EXTEND | GCB_INCB },
+  { 0x0982, 0x0983, GCB_SPACINGMARK }, { 0x0995, 0x09A8, GCB_CONSONANT },
+  { 0x09AA, 0x09B0, GCB_CONSONANT }, { 0x09B2, 0x09B2, GCB_CONSONANT },
+  { 0x09B6, 0x09B9, GCB_CONSONANT }, { 0x09BC, 0x09BC, GCB_EXTEND | GCB_INCB },
+  { 0x09BE, 0x09BE, GCB_EXTEND | GCB_INCB },
+  { 0x09BF, 0x09C0, GCB_SPACINGMARK },
+  { 0x09C1, 0x09C4, GCB_EXTEND | GCB_INCB },
+  { 0x09C7, 0x09C8, GCB_SPACINGMARK }, { 0x09CB, 0x09CC, GCB_SPACINGMARK },
+  { 0x09CD, 0x09CD, GCB_EXTEND | GCB_LINKER },
+  { 0x09D7, 0x09D7, GCB_EXTEND | GCB_INCB }, { 0x09DC, 0x09DD, GCB_CONSONANT },
+  { 0x09DF, 0x09DF, GCB_CONSONANT }, { 0x09E2, 0x09E3, GCB_EXTEND | GCB_INCB },
+  { 0x09F0, 0x09F1, GCB_CONSONANT }, { 0x09FE, 0x09FE, GCB_EXTEND | GCB_INCB },
+  { 0x0A01, 0x0A02, GCB_EXTEND | GCB_INCB },
+  { 0x0A03, 0x0A03, GCB_SPACINGMARK },
+  { 0x0A3C, 0x0A3C, GCB_EXTEND | GCB_INCB },
+  { 0x0A3E, 0x0A40, GCB_SPACINGMARK },
+  { 0x0A41, 0x0A42, GCB_EXTEND | GCB_INCB },
+  { 0x0A47, 0x0A48, GCB_EXTEND | GCB_INCB },
+  { 0x0A4B, 0x0A4D, GCB_EXTEND | GCB_INCB },
+  { 0x0A51, 0x0A51, GCB_EXTEND | GCB_INCB },
+  { 0x0A70, 0x0A71, GCB_EXTEND | GCB_INCB },
+  { 0x0A75, 0x0A75, GCB_EXTEND | GCB_INCB },
+  { 0x0A81, 0x0A82, GCB_EXTEND | GCB_INCB },
+  { 0x0A83, 0x0A83, GCB_SPACINGMARK }, { 0x0A95, 0x0AA8, GCB_CONSONANT },
+  { 0x0AAA, 0x0AB0, GCB_CONSONANT }, { 0x0AB2, 0x0AB3, GCB_CONSONANT },
+  { 0x0AB5, 0x0AB9, GCB_CONSONANT }, { 0x0ABC, 0x0ABC, GCB_EXTEND | GCB_INCB },
+  { 0x0ABE, 0x0AC0, GCB_SPACINGMARK },
+  { 0x0AC1, 0x0AC5, GCB_EXTEND | GCB_INCB },
+  { 0x0AC7, 0x0AC8, GCB_EXTEND | GCB_INCB },
+  { 0x0AC9, 0x0AC9, GCB_SPACINGMARK }, { 0x0ACB, 0x0ACC, GCB_SPACINGMARK },
+  { 0x0ACD, 0x0ACD, GCB_EXTEND | GCB_LINKER },
+  { 0x0AE2, 0x0AE3, GCB_EXTEND | GCB_INCB }, { 0x0AF9, 0x0AF9, GCB_CONSONANT },
+  { 0x0AFA, 0x0AFF, GCB_EXTEND | GCB_INCB },
+  { 0x0B01, 0x0B01, GCB_EXTEND | GCB_INCB },
+  { 0x0B02, 0x0B03, GCB_SPACINGMARK }, { 0x0B15, 0x0B28, GCB_CONSONANT },
+  { 0x0B2A, 0x0B30, GCB_CONSONANT }, { 0x0B32, 0x0B33, GCB_CONSONANT },
+  { 0x0B35, 0x0B39, GCB_CONSONANT }, { 0x0B3C, 0x0B3C, GCB_EXTEND | GCB_INCB },
+  { 0x0B3E, 0x0B3F, GCB_EXTEND | GCB_INCB },
+  { 0x0B40, 0x0B40, GCB_SPACINGMARK },
+  { 0x0B41, 0x0B44, GCB_EXTEND | GCB_INCB },
+  { 0x0B47, 0x0B48, GCB_SPACINGMARK }, { 0x0B4B, 0x0B4C, GCB_SPACINGMARK },
+  { 0x0B4D, 0x0B4D, GCB_EXTEND | GCB_LINKER },
+  { 0x0B55, 0x0B57, GCB_EXTEND | GCB_INCB }, { 0x0B5C, 0x0B5D, GCB_CONSONANT },
+  { 0x0B5F, 0x0B5F, GCB_CONSONANT }, { 0x0B62, 0x0B63, GCB_EXTEND | GCB_INCB },
+  { 0x0B71, 0x0B71, GCB_CONSONANT }, { 0x0B82, 0x0B82, GCB_EXTEND | GCB_INCB },
+  { 0x0BBE, 0x0BBE, GCB_EXTEND | GCB_INCB },
+  { 0x0BBF, 0x0BBF, GCB_SPACINGMARK },
+  { 0x0BC0, 0x0BC0, GCB_EXTEND | GCB_INCB },
+  { 0x0BC1, 0x0BC2, GCB_SPACINGMARK }, { 0x0BC6, 0x0BC8, GCB_SPACINGMARK },
+  { 0x0BCA, 0x0BCC, GCB_SPACINGMARK },
+  { 0x0BCD, 0x0BCD, GCB_EXTEND | GCB_INCB },
+  { 0x0BD7, 0x0BD7, GCB_EXTEND | GCB_INCB },
+  { 0x0C00, 0x0C00, GCB_EXTEND | GCB_INCB },
+  { 0x0C01, 0x0C03, GCB_SPACINGMARK },
+  { 0x0C04, 0x0C04, GCB_EXTEND | GCB_INCB }, { 0x0C15, 0x0C28, GCB_CONSONANT },
+  { 0x0C2A, 0x0C39, GCB_CONSONANT }, { 0x0C3C, 0x0C3C, GCB_EXTEND | GCB_INCB },
+  { 0x0C3E, 0x0C40, GCB_EXTEND | GCB_INCB },
+  { 0x0C41, 0x0C44, GCB_SPACINGMARK },
+  { 0x0C46, 0x0C48, GCB_EXTEND | GCB_INCB },
+  { 0x0C4A, 0x0C4C, GCB_EXTEND | GCB_INCB },
+  { 0x0C4D, 0x0C4D, GCB_EXTEND | GCB_LINKER },
+  { 0x0C55, 0x0C56, GCB_EXTEND | GCB_INCB }, { 0x0C58, 0x0C5A, GCB_CONSONANT },
+  { 0x0C62, 0x0C63, GCB_EXTEND | GCB_INCB },
+  { 0x0C81, 0x0C81, GCB_EXTEND | GCB_INCB },
+  { 0x0C82, 0x0C83, GCB_SPACINGMARK },
+  { 0x0CBC, 0x0CBC, GCB_EXTEND | GCB_INCB },
+  { 0x0CBE, 0x0CBE, GCB_SPACINGMARK },
+  { 0x0CBF, 0x0CC0, GCB_EXTEND | GCB_INCB },
+  { 0x0CC1, 0x0CC1, GCB_SPACINGMARK },
+  { 0x0CC2, 0x0CC2, GCB_EXTEND | GCB_INCB },
+  { 0x0CC3, 0x0CC4, GCB_SPACINGMARK },
+  { 0x0CC6, 0x0CC8, GCB_EXTEND | GCB_INCB },
+  { 0x0CCA, 0x0CCD, GCB_EXTEND | GCB_INCB },
+  { 0x0CD5, 0x0CD6, GCB_EXTEND | GCB_INCB },
+  { 0x0CE2, 0x0CE3, GCB_EXTEND | GCB_INCB },
+  { 0x0CF3, 0x0CF3, GCB_SPACINGMARK },
+  { 0x0D00, 0x0D01, GCB_EXTEND | GCB_INCB },
+  { 0x0D02, 0x0D03, GCB_SPACINGMARK }, { 0x0D15, 0x0D3A, GCB_CONSONANT },
+  { 0x0D3B, 0x0D3C, GCB_EXTEND | GCB_INCB },
+  { 0x0D3E, 0x0D3E, GCB_EXTEND | GCB_INCB },
+  { 0x0D3F, 0x0D40, GCB_SPACINGMARK },
+  { 0x0D41, 0x0D44, GCB_EXTEND | GCB_INCB },
+  { 0x0D46, 0x0D48, GCB_SPACINGMARK }, { 0x0D4A, 0x0D4C, GCB_SPACINGMARK },
+  { 0x0D4D, 0x0D4D, GCB_EXTEND | GCB_LINKER }, { 0x0D4E, 0x0D4E, GCB_PREPEND },
+  { 0x0D57, 0x0D57, GCB_EXTEND | GCB_INCB },
+  { 0x0D62, 0x0D63, GCB_EXTEND | GCB_INCB },
+  { 0x0D81, 0x0D81, GCB_EXTEND | GCB_INCB },
+  { 0x0D82, 0x0D83, GCB_SPACINGMARK },
+  { 0x0DCA, 0x0DCA, GCB_EXTEND | GCB_INCB },
+  { 0x0DCF, 0x0DCF, GCB_EXTEND | GCB_INCB },
+  { 0x0DD0, 0x0DD1, GCB_SPACINGMARK },
+  { 0x0DD2, 0x0DD4, GCB_EXTEND | GCB_INCB },
+  { 0x0DD6, 0x0DD6, GCB_EXTEND | GCB_INCB },
+  { 0x0DD8, 0x0DDE, GCB_SPACINGMARK },
+  { 0x0DDF, 0x0DDF, GCB_EXTEND | GCB_INCB },
+  { 0x0DF2, 0x0DF3, GCB_SPACINGMARK },
+  { 0x0E31, 0x0E31, GCB_EXTEND | GCB_INCB },
+  { 0x0E33, 0x0E33, GCB_SPACINGMARK },
+  { 0x0E34, 0x0E3A, GCB_EXTEND | GCB_INCB },
+  { 0x0E47, 0x0E4E, GCB_EXTEND | GCB_INCB },
+  { 0x0EB1, 0x0EB1, GCB_EXTEND | GCB_INCB },
+  { 0x0EB3, 0x0EB3, GCB_SPACINGMARK },
+  { 0x0EB4, 0x0EBC, GCB_EXTEND | GCB_INCB },
+  { 0x0EC8, 0x0ECE, GCB_EXTEND | GCB_INCB },
+  { 0x0F18, 0x0F19, GCB_EXTEND | GCB_INCB },
+  { 0x0F35, 0x0F35, GCB_EXTEND | GCB_INCB },
+  { 0x0F37, 0x0F37, GCB_EXTEND | GCB_INCB },
+  { 0x0F39, 0x0F39, GCB_EXTEND | GCB_INCB },
+  { 0x0F3E, 0x0F3F, GCB_SPACINGMARK },
+  { 0x0F71, 0x0F7E, GCB_EXTEND | GCB_INCB },
+  { 0x0F7F, 0x0F7F, GCB_SPACINGMARK },
+  { 0x0F80, 0x0F84, GCB_EXTEND | GCB_INCB },
+  { 0x0F86, 0x0F87, GCB_EXTEND | GCB_INCB },
+  { 0x0F8D, 0x0F97, GCB_EXTEND | GCB_INCB },
+  { 0x0F99, 0x0FBC, GCB_EXTEND | GCB_INCB },
+  { 0x0FC6, 0x0FC6, GCB_EXTEND | GCB_INCB },
+  { 0x102D, 0x1030, GCB_EXTEND | GCB_INCB },
+  { 0x1031, 0x1031, GCB_SPACINGMARK },
+  { 0x1032, 0x1037, GCB_EXTEND | GCB_INCB },
+  { 0x1039, 0x103A, GCB_EXTEND | GCB_INCB },
+  { 0x103B, 0x103C, GCB_SPACINGMARK },
+  { 0x103D, 0x103E, GCB_EXTEND | GCB_INCB },
+  { 0x1056, 0x1057, GCB_SPACINGMARK },
+  { 0x1058, 0x1059, GCB_EXTEND | GCB_INCB },
+  { 0x105E, 0x1060, GCB_EXTEND | GCB_INCB },
+  { 0x1071, 0x1074, GCB_EXTEND | GCB_INCB },
+  { 0x1082, 0x1082, GCB_EXTEND | GCB_INCB },
+  { 0x1084, 0x1084, GCB_SPACINGMARK },
+  { 0x1085, 0x1086, GCB_EXTEND | GCB_INCB },
+  { 0x108D, 0x108D, GCB_EXTEND | GCB_INCB },
+  { 0x109D, 0x109D, GCB_EXTEND | GCB_INCB }, { 0x1100, 0x115F, GCB_L },
+  { 0x1160, 0x11A7, GCB_V }, { 0x11A8, 0x11FF, GCB_T },
+  { 0x135D, 0x135F, GCB_EXTEND | GCB_INCB },
+  { 0x1712, 0x1715, GCB_EXTEND | GCB_INCB },
+  { 0x1732, 0x1734, GCB_EXTEND | GCB_INCB },
+  { 0x1752, 0x1753, GCB_EXTEND | GCB_INCB },
+  { 0x1772, 0x1773, GCB_EXTEND | GCB_INCB },
+  { 0x17B4, 0x17B5, GCB_EXTEND | GCB_INCB },
+  { 0x17B6, 0x17B6, GCB_SPACINGMARK },
+  { 0x17B7, 0x17BD, GCB_EXTEND | GCB_INCB },
+  { 0x17BE, 0x17C5, GCB_SPACINGMARK },
+  { 0x17C6, 0x17C6, GCB_EXTEND | GCB_INCB },
+  { 0x17C7, 0x17C8, GCB_SPACINGMARK },
+  { 0x17C9, 0x17D3, GCB_EXTEND | GCB_INCB },
+  { 0x17DD, 0x17DD, GCB_EXTEND | GCB_INCB },
+  { 0x180B, 0x180D, GCB_EXTEND | GCB_INCB }, { 0x180E, 0x180E, GCB_CONTROL },
+  { 0x180F, 0x180F, GCB_EXTEND | GCB_INCB },
+  { 0x1885, 0x1886, GCB_EXTEND | GCB_INCB },
+  { 0x18A9, 0x18A9, GCB_EXTEND | GCB_INCB },
+  { 0x1920, 0x1922, GCB_EXTEND | GCB_INCB },
+  { 0x1923, 0x1926, GCB_SPACINGMARK },
+  { 0x1927, 0x1928, GCB_EXTEND | GCB_INCB },
+  { 0x1929, 0x192B, GCB_SPACINGMARK }, { 0x1930, 0x1931, GCB_SPACINGMARK },
+  { 0x1932, 0x1932, GCB_EXTEND | GCB_INCB },
+  { 0x1933, 0x1938, GCB_SPACINGMARK },
+  { 0x1939, 0x193B, GCB_EXTEND | GCB_INCB },
+  { 0x1A17, 0x1A18, GCB_EXTEND | GCB_INCB },
+  { 0x1A19, 0x1A1A, GCB_SPACINGMARK },
+  { 0x1A1B, 0x1A1B, GCB_EXTEND | GCB_INCB },
+  { 0x1A55, 0x1A55, GCB_SPACINGMARK },
+  { 0x1A56, 0x1A56, GCB_EXTEND | GCB_INCB },
+  { 0x1A57, 0x1A57, GCB_SPACINGMARK },
+  { 0x1A58, 0x1A5E, GCB_EXTEND | GCB_INCB },
+  { 0x1A60, 0x1A60, GCB_EXTEND | GCB_INCB },
+  { 0x1A62, 0x1A62, GCB_EXTEND | GCB_INCB },
+  { 0x1A65, 0x1A6C, GCB_EXTEND | GCB_INCB },
+  { 0x1A6D, 0x1A72, GCB_SPACINGMARK },
+  { 0x1A73, 0x1A7C, GCB_EXTEND | GCB_INCB },
+  { 0x1A7F, 0x1A7F, GCB_EXTEND | GCB_INCB },
+  { 0x1AB0, 0x1ACE, GCB_EXTEND | GCB_INCB },
+  { 0x1B00, 0x1B03, GCB_EXTEND | GCB_INCB },
+  { 0x1B04, 0x1B04, GCB_SPACINGMARK },
+  { 0x1B34, 0x1B3D, GCB_EXTEND | GCB_INCB },
+  { 0x1B3E, 0x1B41, GCB_SPACINGMARK },
+  { 0x1B42, 0x1B44, GCB_EXTEND | GCB_INCB },
+  { 0x1B6B, 0x1B73, GCB_EXTEND | GCB_INCB },
+  { 0x1B80, 0x1B81, GCB_EXTEND | GCB_INCB },
+  { 0x1B82, 0x1B82, GCB_SPACINGMARK }, { 0x1BA1, 0x1BA1, GCB_SPACINGMARK },
+  { 0x1BA2, 0x1BA5, GCB_EXTEND | GCB_INCB },
+  { 0x1BA6, 0x1BA7, GCB_SPACINGMARK },
+  { 0x1BA8, 0x1BAD, GCB_EXTEND | GCB_INCB },
+  { 0x1BE6, 0x1BE6, GCB_EXTEND | GCB_INCB },
+  { 0x1BE7, 0x1BE7, GCB_SPACINGMARK },
+  { 0x1BE8, 0x1BE9, GCB_EXTEND | GCB_INCB },
+  { 0x1BEA, 0x1BEC, GCB_SPACINGMARK },
+  { 0x1BED, 0x1BED, GCB_EXTEND | GCB_INCB },
+  { 0x1BEE, 0x1BEE, GCB_SPACINGMARK },
+  { 0x1BEF, 0x1BF3, GCB_EXTEND | GCB_INCB },
+  { 0x1C24, 0x1C2B, GCB_SPACINGMARK },
+  { 0x1C2C, 0x1C33, GCB_EXTEND | GCB_INCB },
+  { 0x1C34, 0x1C35, GCB_SPACINGMARK },
+  { 0x1C36, 0x1C37, GCB_EXTEND | GCB_INCB },
+  { 0x1CD0, 0x1CD2, GCB_EXTEND | GCB_INCB },
+  { 0x1CD4, 0x1CE0, GCB_EXTEND | GCB_INCB },
+  { 0x1CE1, 0x1CE1, GCB_SPACINGMARK },
+  { 0x1CE2, 0x1CE8, GCB_EXTEND | GCB_INCB },
+  { 0x1CED, 0x1CED, GCB_EXTEND | GCB_INCB },
+  { 0x1CF4, 0x1CF4, GCB_EXTEND | GCB_INCB },
+  { 0x1CF7, 0x1CF7, GCB_SPACINGMARK },
+  { 0x1CF8, 0x1CF9, GCB_EXTEND | GCB_INCB },
+  { 0x1DC0, 0x1DFF, GCB_EXTEND | GCB_INCB }, { 0x200B, 0x200B, GCB_CONTROL },
+  { 0x200C, 0x200C, GCB_EXTEND }, { 0x200D, 0x200D, GCB_ZWJ | GCB_INCB },
+  { 0x200E, 0x200F, GCB_CONTROL }, { 0x2028, 0x202E, GCB_CONTROL },
+  { 0x203C, 0x203C, GCB_PICT }, { 0x2049, 0x2049, GCB_PICT },
+  { 0x2060, 0x206F, GCB_CONTROL }, { 0x20D0, 0x20F0, GCB_EXTEND | GCB_INCB },
+  { 0x2122, 0x2122, GCB_PICT }, { 0x2139, 0x2139, GCB_PICT },
+  { 0x2194, 0x2199, GCB_PICT }, { 0x21A9, 0x21AA, GCB_PICT },
+  { 0x231A, 0x231B, GCB_PICT }, { 0x2328, 0x2328, GCB_PICT },
+  { 0x2388, 0x2388, GCB_PICT }, { 0x23CF, 0x23CF, GCB_PICT },
+  { 0x23E9, 0x23F3, GCB_PICT }, { 0x23F8, 0x23FA, GCB_PICT },
+  { 0x24C2, 0x24C2, GCB_PICT }, { 0x25AA, 0x25AB, GCB_PICT },
+  { 0x25B6, 0x25B6, GCB_PICT }, { 0x25C0, 0x25C0, GCB_PICT },
+  { 0x25FB, 0x25FE, GCB_PICT }, { 0x2600, 0x2605, GCB_PICT },
+  { 0x2607, 0x2612, GCB_PICT }, { 0x2614, 0x2685, GCB_PICT },
+  { 0x2690, 0x2705, GCB_PICT }, { 0x2708, 0x2712, GCB_PICT },
+  { 0x2714, 0x2714, GCB_PICT }, { 0x2716, 0x2716, GCB_PICT },
+  { 0x271D, 0x271D, GCB_PICT }, { 0x2721, 0x2721, GCB_PICT },
+  { 0x2728, 0x2728, GCB_PICT }, { 0x2733, 0x2734, GCB_PICT },
+  { 0x2744, 0x2744, GCB_PICT }, { 0x2747, 0x2747, GCB_PICT },
+  { 0x274C, 0x274C, GCB_PICT }, { 0x274E, 0x274E, GCB_PICT },
+  { 0x2753, 0x2755, GCB_PICT }, { 0x2757, 0x2757, GCB_PICT },
+  { 0x2763, 0x2767, GCB_PICT }, { 0x2795, 0x2797, GCB_PICT },
+  { 0x27A1, 0x27A1, GCB_PICT }, { 0x27B0, 0x27B0, GCB_PICT },
+  { 0x27BF, 0x27BF, GCB_PICT }, { 0x2934, 0x2935, GCB_PICT },
+  { 0x2B05, 0x2B07, GCB_PICT }, { 0x2B1B, 0x2B1C, GCB_PICT },
+  { 0x2B50, 0x2B50, GCB_PICT }, { 0x2B55, 0x2B55, GCB_PICT },
+  { 0x2CEF, 0x2CF1, GCB_EXTEND | GCB_INCB },
+  { 0x2D7F, 0x2D7F, GCB_EXTEND | GCB_INCB },
+  { 0x2DE0, 0x2DFF, GCB_EXTEND | GCB_INCB },
+  { 0x302A, 0x302F, GCB_EXTEND | GCB_INCB }, { 0x3030, 0x3030, GCB_PICT },
+  { 0x303D, 0x303D, GCB_PICT }, { 0x3099, 0x309A, GCB_EXTEND | GCB_INCB },
+  { 0x3297, 0x3297, GCB_PICT }, { 0x3299, 0x3299, GCB_PICT },
+  { 0xA66F, 0xA672, GCB_EXTEND | GCB_INCB },
+  { 0xA674, 0xA67D, GCB_EXTEND | GCB_INCB },
+  { 0xA69E, 0xA69F, GCB_EXTEND | GCB_INCB },
+  { 0xA6F0, 0xA6F1, GCB_EXTEND | GCB_INCB },
+  { 0xA802, 0xA802, GCB_EXTEND | GCB_INCB },
+  { 0xA806, 0xA806, GCB_EXTEND | GCB_INCB },
+  { 0xA80B, 0xA80B, GCB_EXTEND | GCB_INCB },
+  { 0xA823, 0xA824, GCB_SPACINGMARK },
+  { 0xA825, 0xA826, GCB_EXTEND | GCB_INCB },
+  { 0xA827, 0xA827, GCB_SPACINGMARK },
+  { 0xA82C, 0xA82C, GCB_EXTEND | GCB_INCB },
+  { 0xA880, 0xA881, GCB_SPACINGMARK }, { 0xA8B4, 0xA8C3, GCB_SPACINGMARK },
+  { 0xA8C4, 0xA8C5, GCB_EXTEND | GCB_INCB },
+  { 0xA8E0, 0xA8F1, GCB_EXTEND | GCB_INCB },
+  { 0xA8FF, 0xA8FF, GCB_EXTEND | GCB_INCB },
+  { 0xA926, 0xA92D, GCB_EXTEND | GCB_INCB },
+  { 0xA947, 0xA951, GCB_EXTEND | GCB_INCB },
+  { 0xA952, 0xA952, GCB_SPACINGMARK },
+  { 0xA953, 0xA953, GCB_EXTEND | GCB_INCB }, { 0xA960, 0xA97C, GCB_L },
+  { 0xA980, 0xA982, GCB_EXTEND | GCB_INCB },
+  { 0xA983, 0xA983, GCB_SPACINGMARK },
+  { 0xA9B3, 0xA9B3, GCB_EXTEND | GCB_INCB },
+  { 0xA9B4, 0xA9B5, GCB_SPACINGMARK },
+  { 0xA9B6, 0xA9B9, GCB_EXTEND | GCB_INCB },
+  { 0xA9BA, 0xA9BB, GCB_SPACINGMARK },
+  { 0xA9BC, 0xA9BD, GCB_EXTEND | GCB_INCB },
+  { 0xA9BE, 0xA9BF, GCB_SPACINGMARK },
+  { 0xA9C0, 0xA9C0, GCB_EXTEND | GCB_INCB },
+  { 0xA9E5, 0xA9E5, GCB_EXTEND | GCB_INCB },
+  { 0xAA29, 0xAA2E, GCB_EXTEND | GCB_INCB },
+  { 0xAA2F, 0xAA30, GCB_SPACINGMARK },
+  { 0xAA31, 0xAA32, GCB_EXTEND | GCB_INCB },
+  { 0xAA33, 0xAA34, GCB_SPACINGMARK },
+  { 0xAA35, 0xAA36, GCB_EXTEND | GCB_INCB },
+  { 0xAA43, 0xAA43, GCB_EXTEND | GCB_INCB },
+  { 0xAA4C, 0xAA4C, GCB_EXTEND | GCB_INCB },
+  { 0xAA4D, 0xAA4D, GCB_SPACINGMARK },
+  { 0xAA7C, 0xAA7C, GCB_EXTEND | GCB_INCB },
+  { 0xAAB0, 0xAAB0, GCB_EXTEND | GCB_INCB },
+  { 0xAAB2, 0xAAB4, GCB_EXTEND | GCB_INCB },
+  { 0xAAB7, 0xAAB8, GCB_EXTEND | GCB_INCB },
+  { 0xAABE, 0xAABF, GCB_EXTEND | GCB_INCB },
+  { 0xAAC1, 0xAAC1, GCB_EXTEND | GCB_INCB },
+  { 0xAAEB, 0xAAEB, GCB_SPACINGMARK },
+  { 0xAAEC, 0xAAED, GCB_EXTEND | GCB_INCB },
+  { 0xAAEE, 0xAAEF, GCB_SPACINGMARK }, { 0xAAF5, 0xAAF5, GCB_SPACINGMARK },
+  { 0xAAF6, 0xAAF6, GCB_EXTEND | GCB_INCB },
+  { 0xABE3, 0xABE4, GCB_SPACINGMARK },
+  { 0xABE5, 0xABE5, GCB_EXTEND | GCB_INCB },
+  { 0xABE6, 0xABE7, GCB_SPACINGMARK },
+  { 0xABE8, 0xABE8, GCB_EXTEND | GCB_INCB },
+  { 0xABE9, 0xABEA, GCB_SPACINGMARK }, { 0xABEC, 0xABEC, GCB_SPACINGMARK },
+  { 0xABED, 0xABED, GCB_EXTEND | GCB_INCB }, { 0xAC00, 0xD7A3, GCB_HANGUL },
+  { 0xD7B0, 0xD7C6, GCB_V }, { 0xD7CB, 0xD7FB, GCB_T },
+  { 0xFB1E, 0xFB1E, GCB_EXTEND | GCB_INCB },
+  { 0xFE00, 0xFE0F, GCB_EXTEND | GCB_INCB },
+  { 0xFE20, 0xFE2F, GCB_EXTEND | GCB_INCB }, { 0xFEFF, 0xFEFF, GCB_CONTROL },
+  { 0xFF9E, 0xFF9F, GCB_EXTEND | GCB_INCB }, { 0xFFF0, 0xFFFB, GCB_CONTROL },
+  { 0x101FD, 0x101FD, GCB_EXTEND | GCB_INCB },
+  { 0x102E0, 0x102E0, GCB_EXTEND | GCB_INCB },
+  { 0x10376, 0x1037A, GCB_EXTEND | GCB_INCB },
+  { 0x10A01, 0x10A03, GCB_EXTEND | GCB_INCB },
+  { 0x10A05, 0x10A06, GCB_EXTEND | GCB_INCB },
+  { 0x10A0C, 0x10A0F, GCB_EXTEND | GCB_INCB },
+  { 0x10A38, 0x10A3A, GCB_EXTEND | GCB_INCB },
+  { 0x10A3F, 0x10A3F, GCB_EXTEND | GCB_INCB },
+  { 0x10AE5, 0x10AE6, GCB_EXTEND | GCB_INCB },
+  { 0x10D24, 0x10D27, GCB_EXTEND | GCB_INCB },
+  { 0x10D69, 0x10D6D, GCB_EXTEND | GCB_INCB },
+  { 0x10EAB, 0x10EAC, GCB_EXTEND | GCB_INCB },
+  { 0x10EFC, 0x10EFF, GCB_EXTEND | GCB_INCB },
+  { 0x10F46, 0x10F50, GCB_EXTEND | GCB_INCB },
+  { 0x10F82, 0x10F85, GCB_EXTEND | GCB_INCB },
+  { 0x11000, 0x11000, GCB_SPACINGMARK },
+  { 0x11001, 0x11001, GCB_EXTEND | GCB_INCB },
+  { 0x11002, 0x11002, GCB_SPACINGMARK },
+  { 0x11038, 0x11046, GCB_EXTEND | GCB_INCB },
+  { 0x11070, 0x11070, GCB_EXTEND | GCB_INCB },
+  { 0x11073, 0x11074, GCB_EXTEND | GCB_INCB },
+  { 0x1107F, 0x11081, GCB_EXTEND | GCB_INCB },
+  { 0x11082, 0x11082, GCB_SPACINGMARK }, { 0x110B0, 0x110B2, GCB_SPACINGMARK },
+  { 0x110B3, 0x110B6, GCB_EXTEND | GCB_INCB },
+  { 0x110B7, 0x110B8, GCB_SPACINGMARK },
+  { 0x110B9, 0x110BA, GCB_EXTEND | GCB_INCB },
+  { 0x110BD, 0x110BD, GCB_PREPEND },
+  { 0x110C2, 0x110C2, GCB_EXTEND | GCB_INCB },
+  { 0x110CD, 0x110CD, GCB_PREPEND },
+  { 0x11100, 0x11102, GCB_EXTEND | GCB_INCB },
+  { 0x11127, 0x1112B, GCB_EXTEND | GCB_INCB },
+  { 0x1112C, 0x1112C, GCB_SPACINGMARK },
+  { 0x1112D, 0x11134, GCB_EXTEND | GCB_INCB },
+  { 0x11145, 0x11146, GCB_SPACINGMARK },
+  { 0x11173, 0x11173, GCB_EXTEND | GCB_INCB },
+  { 0x11180, 0x11181, GCB_EXTEND | GCB_INCB },
+  { 0x11182, 0x11182, GCB_SPACINGMARK }, { 0x111B3, 0x111B5, GCB_SPACINGMARK },
+  { 0x111B6, 0x111BE, GCB_EXTEND | GCB_INCB },
+  { 0x111BF, 0x111BF, GCB_SPACINGMARK },
+  { 0x111C0, 0x111C0, GCB_EXTEND | GCB_INCB },
+  { 0x111C2, 0x111C3, GCB_PREPEND },
+  { 0x111C9, 0x111CC, GCB_EXTEND | GCB_INCB },
+  { 0x111CE, 0x111CE, GCB_SPACINGMARK },
+  { 0x111CF, 0x111CF, GCB_EXTEND | GCB_INCB },
+  { 0x1122C, 0x1122E, GCB_SPACINGMARK },
+  { 0x1122F, 0x11231, GCB_EXTEND | GCB_INCB },
+  { 0x11232, 0x11233, GCB_SPACINGMARK },
+  { 0x11234, 0x11237, GCB_EXTEND | GCB_INCB },
+  { 0x1123E, 0x1123E, GCB_EXTEND | GCB_INCB },
+  { 0x11241, 0x11241, GCB_EXTEND | GCB_INCB },
+  { 0x112DF, 0x112DF, GCB_EXTEND | GCB_INCB },
+  { 0x112E0, 0x112E2, GCB_SPACINGMARK },
+  { 0x112E3, 0x112EA, GCB_EXTEND | GCB_INCB },
+  { 0x11300, 0x11301, GCB_EXTEND | GCB_INCB },
+  { 0x11302, 0x11303, GCB_SPACINGMARK },
+  { 0x1133B, 0x1133C, GCB_EXTEND | GCB_INCB },
+  { 0x1133E, 0x1133E, GCB_EXTEND | GCB_INCB },
+  { 0x1133F, 0x1133F, GCB_SPACINGMARK },
+  { 0x11340, 0x11340, GCB_EXTEND | GCB_INCB },
+  { 0x11341, 0x11344, GCB_SPACINGMARK }, { 0x11347, 0x11348, GCB_SPACINGMARK },
+  { 0x1134B, 0x1134C, GCB_SPACINGMARK },
+  { 0x1134D, 0x1134D, GCB_EXTEND | GCB_INCB },
+  { 0x11357, 0x11357, GCB_EXTEND | GCB_INCB },
+  { 0x11362, 0x11363, GCB_SPACINGMARK },
+  { 0x11366, 0x1136C, GCB_EXTEND | GCB_INCB },
+  { 0x11370, 0x11374, GCB_EXTEND | GCB_INCB },
+  { 0x113B8, 0x113B8, GCB_EXTEND | GCB_INCB },
+  { 0x113B9, 0x113BA, GCB_SPACINGMARK },
+  { 0x113BB, 0x113C0, GCB_EXTEND | GCB_INCB },
+  { 0x113C2, 0x113C2, GCB_EXTEND | GCB_INCB },
+  { 0x113C5, 0x113C5, GCB_EXTEND | GCB_INCB },
+  { 0x113C7, 0x113C9, GCB_EXTEND | GCB_INCB },
+  { 0x113CA, 0x113CA, GCB_SPACINGMARK }, { 0x113CC, 0x113CD, GCB_SPACINGMARK },
+  { 0x113CE, 0x113D0, GCB_EXTEND | GCB_INCB },
+  { 0x113D1, 0x113D1, GCB_PREPEND },
+  { 0x113D2, 0x113D2, GCB_EXTEND | GCB_INCB },
+  { 0x113E1, 0x113E2, GCB_EXTEND | GCB_INCB },
+  { 0x11435, 0x11437, GCB_SPACINGMARK },
+  { 0x11438, 0x1143F, GCB_EXTEND | GCB_INCB },
+  { 0x11440, 0x11441, GCB_SPACINGMARK },
+  { 0x11442, 0x11444, GCB_EXTEND | GCB_INCB },
+  { 0x11445, 0x11445, GCB_SPACINGMARK },
+  { 0x11446, 0x11446, GCB_EXTEND | GCB_INCB },
+  { 0x1145E, 0x1145E, GCB_EXTEND | GCB_INCB },
+  { 0x114B0, 0x114B0, GCB_EXTEND | GCB_INCB },
+  { 0x114B1, 0x114B2, GCB_SPACINGMARK },
+  { 0x114B3, 0x114B8, GCB_EXTEND | GCB_INCB },
+  { 0x114B9, 0x114B9, GCB_SPACINGMARK },
+  { 0x114BA, 0x114BA, GCB_EXTEND | GCB_INCB },
+  { 0x114BB, 0x114BC, GCB_SPACINGMARK },
+  { 0x114BD, 0x114BD, GCB_EXTEND | GCB_INCB },
+  { 0x114BE, 0x114BE, GCB_SPACINGMARK },
+  { 0x114BF, 0x114C0, GCB_EXTEND | GCB_INCB },
+  { 0x114C1, 0x114C1, GCB_SPACINGMARK },
+  { 0x114C2, 0x114C3, GCB_EXTEND | GCB_INCB },
+  { 0x115AF, 0x115AF, GCB_EXTEND | GCB_INCB },
+  { 0x115B0, 0x115B1, GCB_SPACINGMARK },
+  { 0x115B2, 0x115B5, GCB_EXTEND | GCB_INCB },
+  { 0x115B8, 0x115BB, GCB_SPACINGMARK },
+  { 0x115BC, 0x115BD, GCB_EXTEND | GCB_INCB },
+  { 0x115BE, 0x115BE, GCB_SPACINGMARK },
+  { 0x115BF, 0x115C0, GCB_EXTEND | GCB_INCB },
+  { 0x115DC, 0x115DD, GCB_EXTEND | GCB_INCB },
+  { 0x11630, 0x11632, GCB_SPACINGMARK },
+  { 0x11633, 0x1163A, GCB_EXTEND | GCB_INCB },
+  { 0x1163B, 0x1163C, GCB_SPACINGMARK },
+  { 0x1163D, 0x1163D, GCB_EXTEND | GCB_INCB },
+  { 0x1163E, 0x1163E, GCB_SPACINGMARK },
+  { 0x1163F, 0x11640, GCB_EXTEND | GCB_INCB },
+  { 0x116AB, 0x116AB, GCB_EXTEND | GCB_INCB },
+  { 0x116AC, 0x116AC, GCB_SPACINGMARK },
+  { 0x116AD, 0x116AD, GCB_EXTEND | GCB_INCB },
+  { 0x116AE, 0x116AF, GCB_SPACINGMARK },
+  { 0x116B0, 0x116B7, GCB_EXTEND | GCB_INCB },
+  { 0x1171D, 0x1171D, GCB_EXTEND | GCB_INCB },
+  { 0x1171E, 0x1171E, GCB_SPACINGMARK },
+  { 0x1171F, 0x1171F, GCB_EXTEND | GCB_INCB },
+  { 0x11722, 0x11725, GCB_EXTEND | GCB_INCB },
+  { 0x11726, 0x11726, GCB_SPACINGMARK },
+  { 0x11727, 0x1172B, GCB_EXTEND | GCB_INCB },
+  { 0x1182C, 0x1182E, GCB_SPACINGMARK },
+  { 0x1182F, 0x11837, GCB_EXTEND | GCB_INCB },
+  { 0x11838, 0x11838, GCB_SPACINGMARK },
+  { 0x11839, 0x1183A, GCB_EXTEND | GCB_INCB },
+  { 0x11930, 0x11930, GCB_EXTEND | GCB_INCB },
+  { 0x11931, 0x11935, GCB_SPACINGMARK }, { 0x11937, 0x11938, GCB_SPACINGMARK },
+  { 0x1193B, 0x1193E, GCB_EXTEND | GCB_INCB },
+  { 0x1193F, 0x1193F, GCB_PREPEND }, { 0x11940, 0x11940, GCB_SPACINGMARK },
+  { 0x11941, 0x11941, GCB_PREPEND }, { 0x11942, 0x11942, GCB_SPACINGMARK },
+  { 0x11943, 0x11943, GCB_EXTEND | GCB_INCB },
+  { 0x119D1, 0x119D3, GCB_SPACINGMARK },
+  { 0x119D4, 0x119D7, GCB_EXTEND | GCB_INCB },
+  { 0x119DA, 0x119DB, GCB_EXTEND | GCB_INCB },
+  { 0x119DC, 0x119DF, GCB_SPACINGMARK },
+  { 0x119E0, 0x119E0, GCB_EXTEND | GCB_INCB },
+  { 0x119E4, 0x119E4, GCB_SPACINGMARK },
+  { 0x11A01, 0x11A0A, GCB_EXTEND | GCB_INCB },
+  { 0x11A33, 0x11A38, GCB_EXTEND | GCB_INCB },
+  { 0x11A39, 0x11A39, GCB_SPACINGMARK }, { 0x11A3A, 0x11A3A, GCB_PREPEND },
+  { 0x11A3B, 0x11A3E, GCB_EXTEND | GCB_INCB },
+  { 0x11A47, 0x11A47, GCB_EXTEND | GCB_INCB },
+  { 0x11A51, 0x11A56, GCB_EXTEND | GCB_INCB },
+  { 0x11A57, 0x11A58, GCB_SPACINGMARK },
+  { 0x11A59, 0x11A5B, GCB_EXTEND | GCB_INCB },
+  { 0x11A84, 0x11A89, GCB_PREPEND },
+  { 0x11A8A, 0x11A96, GCB_EXTEND | GCB_INCB },
+  { 0x11A97, 0x11A97, GCB_SPACINGMARK },
+  { 0x11A98, 0x11A99, GCB_EXTEND | GCB_INCB },
+  { 0x11C2F, 0x11C2F, GCB_SPACINGMARK },
+  { 0x11C30, 0x11C36, GCB_EXTEND | GCB_INCB },
+  { 0x11C38, 0x11C3D, GCB_EXTEND | GCB_INCB },
+  { 0x11C3E, 0x11C3E, GCB_SPACINGMARK },
+  { 0x11C3F, 0x11C3F, GCB_EXTEND | GCB_INCB },
+  { 0x11C92, 0x11CA7, GCB_EXTEND | GCB_INCB },
+  { 0x11CA9, 0x11CA9, GCB_SPACINGMARK },
+  { 0x11CAA, 0x11CB0, GCB_EXTEND | GCB_INCB },
+  { 0x11CB1, 0x11CB1, GCB_SPACINGMARK },
+  { 0x11CB2, 0x11CB3, GCB_EXTEND | GCB_INCB },
+  { 0x11CB4, 0x11CB4, GCB_SPACINGMARK },
+  { 0x11CB5, 0x11CB6, GCB_EXTEND | GCB_INCB },
+  { 0x11D31, 0x11D36, GCB_EXTEND | GCB_INCB },
+  { 0x11D3A, 0x11D3A, GCB_EXTEND | GCB_INCB },
+  { 0x11D3C, 0x11D3D, GCB_EXTEND | GCB_INCB },
+  { 0x11D3F, 0x11D45, GCB_EXTEND | GCB_INCB },
+  { 0x11D46, 0x11D46, GCB_PREPEND },
+  { 0x11D47, 0x11D47, GCB_EXTEND | GCB_INCB },
+  { 0x11D8A, 0x11D8E, GCB_SPACINGMARK },
+  { 0x11D90, 0x11D91, GCB_EXTEND | GCB_INCB },
+  { 0x11D93, 0x11D94, GCB_SPACINGMARK },
+  { 0x11D95, 0x11D95, GCB_EXTEND | GCB_INCB },
+  { 0x11D96, 0x11D96, GCB_SPACINGMARK },
+  { 0x11D97, 0x11D97, GCB_EXTEND | GCB_INCB },
+  { 0x11EF3, 0x11EF4, GCB_EXTEND | GCB_INCB },
+  { 0x11EF5, 0x11EF6, GCB_SPACINGMARK },
+  { 0x11F00, 0x11F01, GCB_EXTEND | GCB_INCB },
+  { 0x11F02, 0x11F02, GCB_PREPEND }, { 0x11F03, 0x11F03, GCB_SPACINGMARK },
+  { 0x11F34, 0x11F35, GCB_SPACINGMARK },
+  { 0x11F36, 0x11F3A, GCB_EXTEND | GCB_INCB },
+  { 0x11F3E, 0x11F3F, GCB_SPACINGMARK },
+  { 0x11F40, 0x11F42, GCB_EXTEND | GCB_INCB },
+  { 0x11F5A, 0x11F5A, GCB_EXTEND | GCB_INCB },
+  { 0x13430, 0x1343F, GCB_CONTROL },
+  { 0x13440, 0x13440, GCB_EXTEND | GCB_INCB },
+  { 0x13447, 0x13455, GCB_EXTEND | GCB_INCB },
+  { 0x1611E, 0x16129, GCB_EXTEND | GCB_INCB },
+  { 0x1612A, 0x1612C, GCB_SPACINGMARK },
+  { 0x1612D, 0x1612F, GCB_EXTEND | GCB_INCB },
+  { 0x16AF0, 0x16AF4, GCB_EXTEND | GCB_INCB },
+  { 0x16B30, 0x16B36, GCB_EXTEND | GCB_INCB }, { 0x16D63, 0x16D63, GCB_V },
+  { 0x16D67, 0x16D6A, GCB_V }, { 0x16F4F, 0x16F4F, GCB_EXTEND | GCB_INCB },
+  { 0x16F51, 0x16F87, GCB_SPACINGMARK },
+  { 0x16F8F, 0x16F92, GCB_EXTEND | GCB_INCB },
+  { 0x16FE4, 0x16FE4, GCB_EXTEND | GCB_INCB },
+  { 0x16FF0, 0x16FF1, GCB_EXTEND | GCB_INCB },
+  { 0x1BC9D, 0x1BC9E, GCB_EXTEND | GCB_INCB },
+  { 0x1BCA0, 0x1BCA3, GCB_CONTROL },
+  { 0x1CF00, 0x1CF2D, GCB_EXTEND | GCB_INCB },
+  { 0x1CF30, 0x1CF46, GCB_EXTEND | GCB_INCB },
+  { 0x1D165, 0x1D169, GCB_EXTEND | GCB_INCB },
+  { 0x1D16D, 0x1D172, GCB_EXTEND | GCB_INCB },
+  { 0x1D173, 0x1D17A, GCB_CONTROL },
+  { 0x1D17B, 0x1D182, GCB_EXTEND | GCB_INCB },
+  { 0x1D185, 0x1D18B, GCB_EXTEND | GCB_INCB },
+  { 0x1D1AA, 0x1D1AD, GCB_EXTEND | GCB_INCB },
+  { 0x1D242, 0x1D244, GCB_EXTEND | GCB_INCB },
+  { 0x1DA00, 0x1DA36, GCB_EXTEND | GCB_INCB },
+  { 0x1DA3B, 0x1DA6C, GCB_EXTEND | GCB_INCB },
+  { 0x1DA75, 0x1DA75, GCB_EXTEND | GCB_INCB },
+  { 0x1DA84, 0x1DA84, GCB_EXTEND | GCB_INCB },
+  { 0x1DA9B, 0x1DA9F, GCB_EXTEND | GCB_INCB },
+  { 0x1DAA1, 0x1DAAF, GCB_EXTEND | GCB_INCB },
+  { 0x1E000, 0x1E006, GCB_EXTEND | GCB_INCB },
+  { 0x1E008, 0x1E018, GCB_EXTEND | GCB_INCB },
+  { 0x1E01B, 0x1E021, GCB_EXTEND | GCB_INCB },
+  { 0x1E023, 0x1E024, GCB_EXTEND | GCB_INCB },
+  { 0x1E026, 0x1E02A, GCB_EXTEND | GCB_INCB },
+  { 0x1E08F, 0x1E08F, GCB_EXTEND | GCB_INCB },
+  { 0x1E130, 0x1E136, GCB_EXTEND | GCB_INCB },
+  { 0x1E2AE, 0x1E2AE, GCB_EXTEND | GCB_INCB },
+  { 0x1E2EC, 0x1E2EF, GCB_EXTEND | GCB_INCB },
+  { 0x1E4EC, 0x1E4EF, GCB_EXTEND | GCB_INCB },
+  { 0x1E5EE, 0x1E5EF, GCB_EXTEND | GCB_INCB },
+  { 0x1E8D0, 0x1E8D6, GCB_EXTEND | GCB_INCB },
+  { 0x1E944, 0x1E94A, GCB_EXTEND | GCB_INCB }, { 0x1F000, 0x1F0FF, GCB_PICT },
+  { 0x1F10D, 0x1F10F, GCB_PICT }, { 0x1F12F, 0x1F12F, GCB_PICT },
+  { 0x1F16C, 0x1F171, GCB_PICT }, { 0x1F17E, 0x1F17F, GCB_PICT },
+  { 0x1F18E, 0x1F18E, GCB_PICT }, { 0x1F191, 0x1F19A, GCB_PICT },
+  { 0x1F1AD, 0x1F1E5, GCB_PICT }, { 0x1F1E6, 0x1F1FF, GCB_RI },
+  { 0x1F201, 0x1F20F, GCB_PICT }, { 0x1F21A, 0x1F21A, GCB_PICT },
+  { 0x1F22F, 0x1F22F, GCB_PICT }, { 0x1F232, 0x1F23A, GCB_PICT },
+  { 0x1F23C, 0x1F23F, GCB_PICT }, { 0x1F249, 0x1F3FA, GCB_PICT },
+  { 0x1F3FB, 0x1F3FF, GCB_EXTEND | GCB_INCB }, { 0x1F400, 0x1F53D, GCB_PICT },
+  { 0x1F546, 0x1F64F, GCB_PICT }, { 0x1F680, 0x1F6FF, GCB_PICT },
+  { 0x1F774, 0x1F77F, GCB_PICT }, { 0x1F7D5, 0x1F7FF, GCB_PICT },
+  { 0x1F80C, 0x1F80F, GCB_PICT }, { 0x1F848, 0x1F84F, GCB_PICT },
+  { 0x1F85A, 0x1F85F, GCB_PICT }, { 0x1F888, 0x1F88F, GCB_PICT },
+  { 0x1F8AE, 0x1F8FF, GCB_PICT }, { 0x1F90C, 0x1F93A, GCB_PICT },
+  { 0x1F93C, 0x1F945, GCB_PICT }, { 0x1F947, 0x1FAFF, GCB_PICT },
+  { 0x1FC00, 0x1FFFD, GCB_PICT }, { 0xE0000, 0xE001F, GCB_CONTROL },
+  { 0xE0020, 0xE007F, GCB_EXTEND | GCB_INCB },
+  { 0xE0080, 0xE00FF, GCB_CONTROL },
+  { 0xE0100, 0xE01EF, GCB_EXTEND | GCB_INCB },
+  { 0xE01F0, 0xE0FFF, GCB_CONTROL }
+};
+
+#define LEV_GRAPHEME_RANGES \
+  (sizeof(grapheme_ranges)/sizeof(grapheme_ranges[0]))
+
+/* the class of code point @c, with its InCB flags */
+static unsigned int
+grapheme_class(uint32_t c)
 {
-  size_t nx, i;
-  const LevEditOp *o;
-  LevEditOp *opsnorm, *on;
+  size_t lo = 0, hi = LEV_GRAPHEME_RANGES;
+
+  if (c < 0x7f) {
+    if (c >= 0x20)
+      return GCB_OTHER;
+    return c == '\r' ? GCB_CR : c == '\n' ? GCB_LF : GCB_CONTROL;
+  }
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+    if (c > grapheme_ranges[mid].last)
+      lo = mid + 1;
+    else if (c < grapheme_ranges[mid].first)
+      hi = mid;
+    else {
+      unsigned int cls = grapheme_ranges[mid].cls;
+      if (cls == GCB_HANGUL)
+        cls = (c - 0xac00) % 28 ? GCB_LVT : GCB_LV;
+      return cls;
+    }
+  }
+  return GCB_OTHER;
+}
 
-  if (!n || !ops) {
-    *nnorm = 0;
-    return NULL;
+/* the code point at *@i of @s, moving *@i past it; surrogate pairs are
+ * decoded when lev_wchar is 16 bit */
+static uint32_t
+grapheme_decode(size_t len, const lev_wchar *s, size_t *i)
+{
+  uint32_t c = (uint32_t)s[(*i)++];
+
+  if (sizeof(lev_wchar) == 2 && (c & 0xfc00) == 0xd800 && *i < len
+      && ((uint32_t)s[*i] & 0xfc00) == 0xdc00)
+    c = 0x10000 + ((c - 0xd800) << 10) + ((uint32_t)s[(*i)++] - 0xdc00);
+  return c;
+}
+
+/* whether there's a cluster boundary between classes @prev and @cur;
+ * @pict is 2 after ExtPict Extend* ZWJ, @incb 2 after an InCB consonant
+ * followed by extends and linkers, at least one linker, and @ri the
+ * number of regional indicators just before @cur */
+static int
+grapheme_break(unsigned int prev, unsigned int cur,
+               int pict, int incb, size_t ri)
+{
+  unsigned int p = prev & GCB_CLASS, c = cur & GCB_CLASS;
+
+  if (p == GCB_CR && c == GCB_LF)  /* GB3 */
+    return 0;
+  if (p == GCB_CR || p == GCB_LF || p == GCB_CONTROL)  /* GB4 */
+    return 1;
+  if (c == GCB_CR || c == GCB_LF || c == GCB_CONTROL)  /* GB5 */
+    return 1;
+  if (p == GCB_L
+      && (c == GCB_L || c == GCB_V || c == GCB_LV || c == GCB_LVT))  /* GB6 */
+    return 0;
+  if ((p == GCB_LV || p == GCB_V) && (c == GCB_V || c == GCB_T))  /* GB7 */
+    return 0;
+  if ((p == GCB_LVT || p == GCB_T) && c == GCB_T)  /* GB8 */
+    return 0;
+  if (c == GCB_EXTEND || c == GCB_ZWJ || c == GCB_SPACINGMARK)  /* GB9 */
+    return 0;
+  if (p == GCB_PREPEND)  /* GB9b */
+    return 0;
+  if (c == GCB_CONSONANT && incb == 2)  /* GB9c */
+    return 0;
+  if (c == GCB_PICT && pict == 2)  /* GB11 */
+    return 0;
+  if (p == GCB_RI && c == GCB_RI)  /* GB12, GB13 */
+    return ri % 2 == 0;
+  return 1;  /* GB999 */
+}
+
+/* the end of the cluster starting at @i of @s */
+static size_t
+grapheme_end(size_t len, const lev_wchar *s, size_t i)
+{
+  unsigned int prev = grapheme_class(grapheme_decode(len, s, &i));
+  int pict = (prev & GCB_CLASS) == GCB_PICT;
+  int incb = (prev & GCB_CLASS) == GCB_CONSONANT;
+  size_t ri = (prev & GCB_CLASS) == GCB_RI;
+
+  while (i < len) {
+    size_t j = i;
+    unsigned int cur = grapheme_class(grapheme_decode(len, s, &j));
+    unsigned int c = cur & GCB_CLASS;
+
+    if (grapheme_break(prev, cur, pict, incb, ri))
+      break;
+    if (c == GCB_PICT)
+      pict = 1;
+    else if (c == GCB_ZWJ)
+      pict = pict == 1 ? 2 : 0;
+    else if (c != GCB_EXTEND || pict != 1)
+      pict = 0;
+    if (c == GCB_CONSONANT)
+      incb = 1;
+    else if (incb && (cur & GCB_LINKER))
+      incb = 2;
+    else if (!(cur & GCB_INCB))
+      incb = 0;
+    ri = c == GCB_RI ? ri + 1 : 0;
+    prev = cur;
+    i = j;
   }
+  return i;
+}
 
-  nx = 0;
-  o = ops;
-  for (i = n; i; i--, o++)
-    nx += (o->type == LEV_EDIT_KEEP);
+/* the intern table of clusters, open addressing with linear probing */
+typedef struct {
+  size_t size;  /* a power of two */
+  size_t n;
+  const lev_wchar **keys;
+  size_t *lengths;
+  lev_wchar *ids;
+} LevGraphemeTable;
 
-  *nnorm = n - nx;
-  if (!*nnorm)
-    return NULL;
+static size_t
+grapheme_hash(size_t len, const lev_wchar *s)
+{
+  size_t h = len;
+  size_t i;
 
-  opsnorm = on = (LevEditOp*)safe_malloc((n - nx), sizeof(LevEditOp));
-  o = ops;
-  for (i = n; i; i--, o++) {
-    if (o->type == LEV_EDIT_KEEP)
-      continue;
-    memcpy(on++, o, sizeof(LevEditOp));
+  for (i = 0; i < len; i++)
+    h = (h ^ (size_t)(uint32_t)s[i])*0x9e3779b1u;
+  return h ^ (h >> 15);
+}
+
+static int
+grapheme_table_resize(LevGraphemeTable *table, size_t size)
+{
+  const lev_wchar **keys = (const lev_wchar**)calloc(size, sizeof(lev_wchar*));
+  size_t *lengths = (size_t*)safe_malloc(size, sizeof(size_t));
+  lev_wchar *ids = (lev_wchar*)safe_malloc(size, sizeof(lev_wchar));
+  size_t i;
+
+  if (!keys || !lengths || !ids) {
+    free(keys);
+    free(lengths);
+    free(ids);
+    return -1;
   }
+  for (i = 0; i < table->size; i++) {
+    size_t h;
+    if (!table->keys[i])
+      continue;
+    h = grapheme_hash(table->lengths[i], table->keys[i]) & (size - 1);
+    while (keys[h])
+      h = (h + 1) & (size - 1);
+    keys[h] = table->keys[i];
+    lengths[h] = table->lengths[i];
+    ids[h] = table->ids[i];
+  }
+  free(table->keys);
+  free(table->lengths);
+  free(table->ids);
+  table->keys = keys;
+  table->lengths = lengths;
+  table->ids = ids;
+  table->size = size;
+  return 0;
+}
 
-  return opsnorm;
+/* the id of cluster @s of length @len, a new one if it isn't in @table
+ * yet; returns -1 on failure */
+static int
+grapheme_intern(LevGraphemeTable *table, size_t len, const lev_wchar *s,
+                lev_wchar *id)
+{
+  /* with 32 bit symbols, single code points are their own ids and the
+   * other clusters are numbered above them; with 16 bit ones all
+   * clusters are numbered */
+  const size_t first = sizeof(lev_wchar) >= 4 ? 0x110000 : 0;
+  const size_t last = sizeof(lev_wchar) >= 4 ? 0x7fffffff : 0xffff;
+  size_t h;
+
+  if (first && len == 1) {
+    *id = s[0];
+    return 0;
+  }
+  if (2*(table->n + 1) > table->size
+      && grapheme_table_resize(table, table->size ? 2*table->size : 64) < 0)
+    return -1;
+  h = grapheme_hash(len, s) & (table->size - 1);
+  while (table->keys[h]) {
+    if (table->lengths[h] == len
+        && memcmp(table->keys[h], s, len*sizeof(lev_wchar)) == 0) {
+      *id = table->ids[h];
+      return 0;
+    }
+    h = (h + 1) & (table->size - 1);
+  }
+  if (table->n > last - first)
+    return -1;
+  table->keys[h] = s;
+  table->lengths[h] = len;
+  table->ids[h] = *id = (lev_wchar)(first + table->n);
+  table->n++;
+  return 0;
 }
 
 /**
- * lev_editops_subtract:
- * @n: The size of @ops.
- * @ops: An array of elementary edit operations.
- * @ns: The size of @sub.
- * @sub: A subsequence (ordered subset) of @ops
- * @nrem: Where to store then length of the remainder array.
+ * lev_grapheme_split:
+ * @n: The number of strings.
+ * @lengths: The lengths of @strings.
+ * @strings: The strings to split.
+ * @clusters: Where the @n split strings should be stored.
  *
- * Subtracts a subsequence of elementary edit operations from a sequence.
+ * Splits strings to extended grapheme clusters (UAX #29) and turns them
+ * to sequences of cluster ids, equal clusters of all @strings getting
+ * equal ids.  The ids can be passed to any lev_u_* function in place of
+ * the strings, and positions in them mapped back to @strings with the
+ * cluster bounds, see lev_grapheme_map_opcodes().
  *
- * The remainder is a sequence that, applied to result of application of @sub,
- * gives the same final result as application of @ops to original string.
+ * The split strings must be freed with lev_grapheme_free().
  *
- * Returns: A newly allocated array of normalized edit operations, its length
- *          is stored to @nrem.  It is always normalized, i.e, without any
- *          keep operations.  On failure, %NULL is returned.
+ * Returns: Zero on success, -1 on failure (out of memory, or too many
+ *          distinct clusters for 16 bit lev_wchar).
  **/
-LevEditOp*
-lev_editops_subtract(size_t n,
-                     const LevEditOp *ops,
-                     size_t ns,
-                     const LevEditOp *sub,
-                     size_t *nrem)
+int
+lev_grapheme_split(size_t n, const size_t *lengths,
+                   const lev_wchar *strings[], LevGraphemes *clusters)
 {
-    static const int shifts[] = { 0, 0, 1, -1 };
-    LevEditOp *rem;
-    size_t i, j, nr, nn;
-    int shift;
+  LevGraphemeTable table;
+  size_t i;
 
-    /* compute remainder size */
-    *nrem = (size_t)-1;
-    nr = nn = 0;
-    for (i = 0; i < n; i++) {
-        if (ops[i].type != LEV_EDIT_KEEP)
-            nr++;
-    }
-    for (i = 0; i < ns; i++) {
-        if (sub[i].type != LEV_EDIT_KEEP)
-            nn++;
+  memset(&table, 0, sizeof(table));
+  memset(clusters, 0, n*sizeof(LevGraphemes));
+  for (i = 0; i < n; i++) {
+    const lev_wchar *s = strings[i];
+    LevGraphemes *g = clusters + i;
+    size_t len = lengths[i];
+    size_t j = 0;
+
+    g->ids = (lev_wchar*)safe_malloc(len + 1, sizeof(lev_wchar));
+    g->bounds = (size_t*)safe_malloc(len + 1, sizeof(size_t));
+    if (!g->ids || !g->bounds)
+      goto fail;
+    while (j < len) {
+      size_t end = grapheme_end(len, s, j);
+      if (grapheme_intern(&table, end - j, s + j, g->ids + g->n) < 0)
+        goto fail;
+      g->bounds[g->n++] = j;
+      j = end;
     }
-    if (nn > nr)
-        return NULL;
-    nr -= nn;
+    g->bounds[g->n] = len;
+  }
+  free(table.keys);
+  free(table.lengths);
+  free(table.ids);
+  return 0;
+
+fail:
+  free(table.keys);
+  free(table.lengths);
+  free(table.ids);
+  lev_grapheme_free(n, clusters);
+  return -1;
+}
 
-    /* subtract */
-    /* we could simply return NULL when nr == 0, but then it would be possible
-     * to subtract *any* sequence of the right length to get an empty sequence
-     * -- clrealy incorrectly; so we have to scan the list to check */
-    rem = nr ? (LevEditOp*)safe_malloc(nr, sizeof(LevEditOp)) : NULL;
-    j = nn = 0;
-    shift = 0;
-    for (i = 0; i < ns; i++) {
-        while ((ops[j].spos != sub[i].spos
-                || ops[j].dpos != sub[i].dpos
-                || ops[j].type != sub[i].type)
-               && j < n) {
-            if (ops[j].type != LEV_EDIT_KEEP) {
-                rem[nn] = ops[j];
-                rem[nn].spos = (size_t)((int)rem[nn].spos + shift);
-                nn++;
-            }
-            j++;
-        }
-        if (j == n) {
-            free(rem);
-            return NULL;
-        }
+/**
+ * lev_grapheme_free:
+ * @n: The number of split strings.
+ * @clusters: Strings split by lev_grapheme_split().
+ *
+ * Frees the cluster ids and bounds of split strings, but not @clusters
+ * itself.
+ **/
+void
+lev_grapheme_free(size_t n, LevGraphemes *clusters)
+{
+  size_t i;
 
-        shift += shifts[sub[i].type];
-        j++;
-    }
+  for (i = 0; i < n; i++) {
+    free(clusters[i].ids);
+    free(clusters[i].bounds);
+    clusters[i].ids = NULL;
+    clusters[i].bounds = NULL;
+    clusters[i].n = 0;
+  }
+}
 
-    while (j < n) {
-        if (ops[j].type != LEV_EDIT_KEEP) {
-            rem[nn] = ops[j];
-            rem[nn].spos = (size_t)((int)rem[nn].spos + shift);
-            nn++;
-        }
-        j++;
-    }
-    assert(nn == nr);
+/* append a block to @bops, merging it with the last one of the same type */
+static void
+grapheme_push_block(LevOpCode *bops, size_t *nb, LevEditType type,
+                    size_t sbeg, size_t send, size_t dbeg, size_t dend)
+{
+  if (*nb && bops[*nb - 1].type == type) {
+    bops[*nb - 1].send = send;
+    bops[*nb - 1].dend = dend;
+    return;
+  }
+  bops[*nb].type = type;
+  bops[*nb].sbeg = sbeg;
+  bops[*nb].send = send;
+  bops[*nb].dbeg = dbeg;
+  bops[*nb].dend = dend;
+  (*nb)++;
+}
 
-    *nrem = nr;
-    return rem;
+/**
+ * lev_grapheme_map_opcodes:
+ * @nb: The length of @bops.
+ * @bops: Difflib-like blocks between the cluster ids of two strings.
+ * @clusters1: The split source string.
+ * @clusters2: The split destination string.
+ * @nmapped: Where the number of mapped blocks should be stored.
+ *
+ * Maps blocks found between split strings back to the strings themselves.
+ * A replaced run of clusters may have a different number of characters
+ * than its replacement, the extra characters become a separate insert or
+ * delete block, so the result is valid for the strings.
+ *
+ * Returns: The mapped blocks, as a newly allocated array.
+ **/
+LevOpCode*
+lev_grapheme_map_opcodes(size_t nb, const LevOpCode *bops,
+                         const LevGraphemes *clusters1,
+                         const LevGraphemes *clusters2,
+                         size_t *nmapped)
+{
+  LevOpCode *mapped;
+  size_t i;
+
+  *nmapped = 0;
+  if (!nb)
+    return NULL;
+  mapped = (LevOpCode*)safe_malloc_3(2, nb, sizeof(LevOpCode));
+  if (!mapped) {
+    *nmapped = (size_t)(-1);
+    return NULL;
+  }
+  for (i = 0; i < nb; i++) {
+    size_t sbeg = clusters1->bounds[bops[i].sbeg];
+    size_t send = clusters1->bounds[bops[i].send];
+    size_t dbeg = clusters2->bounds[bops[i].dbeg];
+    size_t dend = clusters2->bounds[bops[i].dend];
+
+    if (bops[i].type == LEV_EDIT_REPLACE) {
+      size_t m = send - sbeg < dend - dbeg ? send - sbeg : dend - dbeg;
+      grapheme_push_block(mapped, nmapped, LEV_EDIT_REPLACE,
+                          sbeg, sbeg + m, dbeg, dbeg + m);
+      if (sbeg + m < send)
+        grapheme_push_block(mapped, nmapped, LEV_EDIT_DELETE,
+                            sbeg + m, send, dend, dend);
+      else if (dbeg + m < dend)
+        grapheme_push_block(mapped, nmapped, LEV_EDIT_INSERT,
+                            send, send, dbeg + m, dend);
+    }
+    else
+      grapheme_push_block(mapped, nmapped, bops[i].type,
+                          sbeg, send, dbeg, dend);
+  }
+  return mapped;
 }
 /* }}} */
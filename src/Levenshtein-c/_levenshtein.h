@@ -5,6 +5,7 @@
 #ifndef size_t
 #  include <stdlib.h>
 #endif
+#include <stdint.h>
 
 /* In C, this is just wchar_t and unsigned char, in Python, lev_wchar can
  * be anything.  If you really want to cheat, define wchar_t to any integer
@@ -68,6 +69,149 @@ typedef struct {
   size_t len;
 } LevMatchingBlock;
 
+/* Edit run.
+ * A compressed form of count consecutive atomic edit operations of the same
+ * type, the first one at spos, dpos.  Each next operation is one character
+ * further in the strings it advances in: both for LEV_EDIT_KEEP and
+ * LEV_EDIT_REPLACE, only the destination for LEV_EDIT_INSERT and only the
+ * source for LEV_EDIT_DELETE.
+ */
+typedef struct {
+  LevEditType type;  /* editing operation type */
+  size_t spos;  /* source position of the first operation */
+  size_t dpos;  /* destination position of the first operation */
+  size_t count;  /* number of operations */
+} LevEditRun;
+
+/* Independent task for lev_run_tasks(). */
+typedef void (*LevTaskFunc)(void *data, size_t i);
+
+/* Priority class of parallel calls, see lev_priority_set(). */
+typedef enum {
+  LEV_PRIORITY_INTERACTIVE,  /* never paused */
+  LEV_PRIORITY_BATCH,  /* paused while interactive calls run */
+  LEV_PRIORITY_LAST
+} LevPriority;
+
+/* Statistics of the parallel calls of a priority class. */
+typedef struct {
+  size_t calls;  /* calls made */
+  size_t running;  /* calls running now */
+  size_t waiting;  /* worker threads paused now */
+  size_t pauses;  /* times worker threads paused */
+  double wait;  /* total seconds worker threads were paused */
+  double max_wait;  /* the longest pause, in seconds */
+} LevSchedStats;
+
+/* The lev_sched_begin()/lev_sched_end() pair of one copy of the library,
+ * for modules linking their own copy that must count in the same scheduler. */
+typedef struct {
+  LevPriority (*begin)(void);
+  void (*end)(LevPriority priority);
+} LevSchedApi;
+
+/* Scorer of lev_paired_scores(). */
+typedef enum {
+  LEV_SCORER_DISTANCE,  /* Levenshtein distance */
+  LEV_SCORER_RATIO,  /* similarity ratio, from the InDel distance */
+  LEV_SCORER_HAMMING  /* Hamming distance */
+} LevScorer;
+
+/* Kind of strings in a LevColumn. */
+typedef enum {
+  LEV_COLUMN_BYTES,  /* lengths and lev_byte strings */
+  LEV_COLUMN_WCHAR,  /* lengths and lev_wchar strings */
+  LEV_COLUMN_OFFSETS,  /* string i is data[offsets[i]:offsets[i+1]] */
+  LEV_COLUMN_UTF8  /* the same, but the data is UTF-8 text */
+} LevColumnType;
+
+/* Column of strings, given either as arrays of lengths and pointers or,
+ * like Arrow string arrays, as offsets into one buffer. */
+typedef struct {
+  LevColumnType type;
+  const size_t *lengths;  /* LEV_COLUMN_BYTES and LEV_COLUMN_WCHAR */
+  const void **strings;
+  const void *offsets;  /* LEV_COLUMN_OFFSETS and LEV_COLUMN_UTF8 */
+  size_t offset_size;  /* 4 (int32_t offsets) or 8 (int64_t) */
+  const lev_byte *data;
+} LevColumn;
+
+/* Item type of lev_score_tile() tiles. */
+typedef enum {
+  LEV_TILE_SIZE,  /* size_t distances */
+  LEV_TILE_UINT16,  /* uint16_t distances, saturated */
+  LEV_TILE_DOUBLE,  /* double ratios */
+  LEV_TILE_UINT8  /* uint8_t ratios, quantized to floor(255*ratio + 0.5) */
+} LevTileFormat;
+
+/* Persistent distance cache (opaque). */
+typedef struct _LevDistanceCache LevDistanceCache;
+
+/* Metric of cached distances. */
+typedef enum {
+  LEV_METRIC_LEVENSHTEIN,
+  LEV_METRIC_INDEL  /* Levenshtein with replace operation of weight 2 */
+} LevMetric;
+
+/* Incremental difflib block operation codes (opaque). */
+typedef struct _LevOpcodeIter LevOpcodeIter;
+
+/* Symmetric delete index (opaque). */
+typedef struct _LevDeleteIndex LevDeleteIndex;
+
+/* Dynamic delete index (opaque). */
+typedef struct _LevDynamicIndex LevDynamicIndex;
+
+/* Immutable view of a dynamic delete index (opaque). */
+typedef struct _LevDynamicSnapshot LevDynamicSnapshot;
+
+/* Delete index lookup result. */
+typedef struct {
+  size_t id;  /* index of the word in the indexed words */
+  size_t distance;  /* its Levenshtein distance from the query */
+} LevDeleteMatch;
+
+/* Token similarity, see lev_token_ratio_batch(). */
+typedef enum {
+  LEV_TOKEN_SORT,  /* InDel ratio of the sorted tokens */
+  LEV_TOKEN_SET,  /* set ratio of the distinct tokens */
+  LEV_TOKEN_SEQ  /* sequence ratio of the tokens */
+} LevTokenScorer;
+
+/* Query string prepared for token similarities (opaque). */
+typedef struct _LevTokenQuery LevTokenQuery;
+
+/* Token similarity search result. */
+typedef struct {
+  size_t id;  /* index of the string */
+  double ratio;  /* its token similarity with the query */
+} LevTokenMatch;
+
+/* Sketch search result. */
+typedef struct {
+  size_t id;  /* index of the sketch (string) */
+  size_t distance;  /* Hamming distance of sketches, or edit distance */
+} LevSketchMatch;
+
+/* String split to grapheme clusters, see lev_grapheme_split(). */
+typedef struct {
+  size_t n;  /* the number of clusters */
+  lev_wchar *ids;  /* the clusters, as ids usable as lev_wchar symbols */
+  size_t *bounds;  /* n + 1 offsets of the clusters in the string */
+} LevGraphemes;
+
+/* Distinct normalized lines of a text, see lev_line_set_scan(). */
+typedef struct {
+  size_t nlines;  /* the number of lines */
+  size_t *keys;  /* the distinct line of each line */
+  size_t n;  /* the number of distinct lines */
+  size_t *counts;  /* the number of lines of each distinct line */
+  size_t *first;  /* the number of its first line */
+  size_t *offsets;  /* the offset of its first line in the text */
+  size_t *bounds;  /* n + 1 offsets of the distinct lines in lines */
+  char *lines;  /* the distinct lines, normalized, one after another */
+} LevLineSet;
+
 static void *
 safe_malloc(size_t nmemb, size_t size) {
   /* extra-conservative overflow check */
@@ -86,6 +230,20 @@ safe_malloc_3(size_t nmemb1, size_t nmemb2, size_t size) {
   return safe_malloc(nmemb1, nmemb2 * size);
 }
 
+size_t
+lev_edit_distance(size_t len1,
+                  const lev_byte *string1,
+                  size_t len2,
+                  const lev_byte *string2,
+                  int xcost);
+
+size_t
+lev_u_edit_distance(size_t len1,
+                    const lev_wchar *string1,
+                    size_t len2,
+                    const lev_wchar *string2,
+                    int xcost);
+
 lev_byte*
 lev_greedy_median(size_t n,
                   const size_t *lengths,
@@ -114,6 +272,24 @@ lev_u_median_improve(size_t len, const lev_wchar *s,
                      const double *weights,
                      size_t *medlength);
 
+lev_byte*
+lev_median_refine(size_t len, const lev_byte *s,
+                  size_t n, const size_t *lengths,
+                  const lev_byte *strings[],
+                  const double *weights,
+                  size_t maxpasses,
+                  size_t nthreads,
+                  size_t *medlength);
+
+lev_wchar*
+lev_u_median_refine(size_t len, const lev_wchar *s,
+                    size_t n, const size_t *lengths,
+                    const lev_wchar *strings[],
+                    const double *weights,
+                    size_t maxpasses,
+                    size_t nthreads,
+                    size_t *medlength);
+
 lev_byte*
 lev_quick_median(size_t n,
                  const size_t *lengths,
@@ -168,6 +344,28 @@ lev_u_edit_seq_distance(size_t n1,
                         const size_t *lengths2,
                         const lev_wchar *strings2[]);
 
+LevOpCode*
+lev_edit_seq_opcodes(size_t n1,
+                     const size_t *lengths1,
+                     const lev_byte *strings1[],
+                     size_t n2,
+                     const size_t *lengths2,
+                     const lev_byte *strings2[],
+                     double max,
+                     double *dist,
+                     size_t *nb);
+
+LevOpCode*
+lev_u_edit_seq_opcodes(size_t n1,
+                       const size_t *lengths1,
+                       const lev_wchar *strings1[],
+                       size_t n2,
+                       const size_t *lengths2,
+                       const lev_wchar *strings2[],
+                       double max,
+                       double *dist,
+                       size_t *nb);
+
 double
 lev_set_distance(size_t n1,
                  const size_t *lengths1,
@@ -293,4 +491,425 @@ lev_editops_subtract(size_t n,
                      const LevEditOp *sub,
                      size_t *nrem);
 
+LevEditRun*
+lev_editops_to_runs(size_t n,
+                    const LevEditOp *ops,
+                    size_t *nr);
+
+LevEditOp*
+lev_runs_to_editops(size_t nr,
+                    const LevEditRun *runs,
+                    size_t *n,
+                    int keepkeep);
+
+LevEditRun*
+lev_opcodes_to_runs(size_t nb,
+                    const LevOpCode *bops,
+                    size_t *nr,
+                    int keepkeep);
+
+LevOpCode*
+lev_runs_to_opcodes(size_t nr,
+                    const LevEditRun *runs,
+                    size_t *nb,
+                    size_t len1,
+                    size_t len2);
+
+int
+lev_runs_check_errors(size_t len1,
+                      size_t len2,
+                      size_t nr,
+                      const LevEditRun *runs);
+
+void
+lev_runs_invert(size_t nr,
+                LevEditRun *runs);
+
+lev_byte*
+lev_runs_apply(size_t len1,
+               const lev_byte* string1,
+               size_t len2,
+               const lev_byte* string2,
+               size_t nr,
+               const LevEditRun *runs,
+               size_t *len);
+
+lev_wchar*
+lev_u_runs_apply(size_t len1,
+                 const lev_wchar* string1,
+                 size_t len2,
+                 const lev_wchar* string2,
+                 size_t nr,
+                 const LevEditRun *runs,
+                 size_t *len);
+
+LevMatchingBlock*
+lev_runs_matching_blocks(size_t len1,
+                         size_t len2,
+                         size_t nr,
+                         const LevEditRun *runs,
+                         size_t *nmblocks);
+
+LevEditRun*
+lev_runs_subtract(size_t nr,
+                  const LevEditRun *runs,
+                  size_t ns,
+                  const LevEditRun *sub,
+                  size_t *nrem);
+
+LevOpcodeIter*
+lev_opcode_iter_new(size_t len1,
+                    const lev_byte *string1,
+                    size_t len2,
+                    const lev_byte *string2);
+
+LevOpcodeIter*
+lev_u_opcode_iter_new(size_t len1,
+                      const lev_wchar *string1,
+                      size_t len2,
+                      const lev_wchar *string2);
+
+int
+lev_opcode_iter_next(LevOpcodeIter *it,
+                     LevOpCode *bop);
+
+void
+lev_opcode_iter_free(LevOpcodeIter *it);
+
+LevDistanceCache*
+lev_distance_cache_open(const char *filename,
+                        size_t capacity);
+
+int
+lev_distance_cache_close(LevDistanceCache *cache);
+
+size_t
+lev_distance_cache_capacity(const LevDistanceCache *cache);
+
+size_t
+lev_distance_cache_count(const LevDistanceCache *cache);
+
+LevDeleteIndex*
+lev_delete_index_new(size_t n,
+                     const size_t *lengths,
+                     const lev_wchar *words[],
+                     const double *freqs,
+                     size_t max_k,
+                     size_t nthreads,
+                     uint64_t tag);
+
+void
+lev_delete_index_free(LevDeleteIndex *index);
+
+size_t
+lev_delete_index_size(const LevDeleteIndex *index);
+
+size_t
+lev_delete_index_max_k(const LevDeleteIndex *index);
+
+uint64_t
+lev_delete_index_tag(const LevDeleteIndex *index);
+
+const uint32_t*
+lev_delete_index_word(const LevDeleteIndex *index,
+                      size_t id,
+                      size_t *len,
+                      double *freq);
+
+LevDeleteMatch*
+lev_delete_index_lookup(const LevDeleteIndex *index,
+                        size_t len,
+                        const lev_wchar *query,
+                        size_t max_k,
+                        size_t *nmatches);
+
+int
+lev_delete_index_save(const LevDeleteIndex *index,
+                      const char *filename);
+
+LevDeleteIndex*
+lev_delete_index_load(const char *filename);
+
+int
+lev_delete_index_clusters(const LevDeleteIndex *index,
+                          size_t max_k,
+                          size_t nthreads,
+                          size_t *clusters);
+
+LevDynamicIndex*
+lev_dynamic_index_new(size_t max_k);
+
+void
+lev_dynamic_index_free(LevDynamicIndex *index);
+
+size_t
+lev_dynamic_index_max_k(const LevDynamicIndex *index);
+
+int
+lev_dynamic_index_insert(LevDynamicIndex *index,
+                         size_t len,
+                         const lev_wchar *word,
+                         size_t *id);
+
+int
+lev_dynamic_index_delete(LevDynamicIndex *index,
+                         size_t id);
+
+int
+lev_dynamic_index_compact(LevDynamicIndex *index,
+                          int full,
+                          size_t nthreads);
+
+LevDynamicSnapshot*
+lev_dynamic_index_snapshot(LevDynamicIndex *index);
+
+void
+lev_dynamic_snapshot_release(LevDynamicSnapshot *snap);
+
+size_t
+lev_dynamic_snapshot_size(const LevDynamicSnapshot *snap);
+
+size_t
+lev_dynamic_snapshot_segments(const LevDynamicSnapshot *snap);
+
+const uint32_t*
+lev_dynamic_snapshot_word(const LevDynamicSnapshot *snap,
+                          size_t id,
+                          size_t *len);
+
+LevDeleteMatch*
+lev_dynamic_snapshot_lookup(const LevDynamicSnapshot *snap,
+                            size_t len,
+                            const lev_wchar *query,
+                            size_t max_k,
+                            size_t *nmatches);
+
+void
+lev_cgk_sketch(size_t len,
+               const lev_byte *string,
+               size_t length,
+               size_t reps,
+               uint64_t seed,
+               lev_byte *sketch);
+
+void
+lev_u_cgk_sketch(size_t len,
+                 const lev_wchar *string,
+                 size_t length,
+                 size_t reps,
+                 uint64_t seed,
+                 lev_byte *sketch);
+
+size_t
+lev_sketch_hamming(size_t size,
+                   const lev_byte *sketch1,
+                   const lev_byte *sketch2);
+
+void
+lev_cgk_sketch_batch(size_t n,
+                     const size_t *lengths,
+                     const lev_byte *strings[],
+                     size_t length,
+                     size_t reps,
+                     uint64_t seed,
+                     size_t nthreads,
+                     lev_byte *sketches);
+
+void
+lev_u_cgk_sketch_batch(size_t n,
+                       const size_t *lengths,
+                       const lev_wchar *strings[],
+                       size_t length,
+                       size_t reps,
+                       uint64_t seed,
+                       size_t nthreads,
+                       lev_byte *sketches);
+
+LevSketchMatch*
+lev_sketch_nearest(size_t size,
+                   const lev_byte *query,
+                   size_t n,
+                   const lev_byte *sketches,
+                   size_t count,
+                   size_t nthreads,
+                   size_t *nmatches);
+
+void
+lev_sketch_rerank(size_t len,
+                  const lev_byte *string,
+                  const size_t *lengths,
+                  const lev_byte *strings[],
+                  size_t n,
+                  LevDistanceCache *cache,
+                  LevSketchMatch *matches);
+
+void
+lev_u_sketch_rerank(size_t len,
+                    const lev_wchar *string,
+                    const size_t *lengths,
+                    const lev_wchar *strings[],
+                    size_t n,
+                    LevDistanceCache *cache,
+                    LevSketchMatch *matches);
+
+double
+lev_quick_ratio(size_t len1,
+                const lev_byte *string1,
+                size_t len2,
+                const lev_byte *string2);
+
+double
+lev_u_quick_ratio(size_t len1,
+                  const lev_wchar *string1,
+                  size_t len2,
+                  const lev_wchar *string2);
+
+void
+lev_quick_ratio_batch(size_t len,
+                      const lev_byte *string,
+                      size_t n,
+                      const size_t *lengths,
+                      const lev_byte *strings[],
+                      double *ratios);
+
+int
+lev_u_quick_ratio_batch(size_t len,
+                        const lev_wchar *string,
+                        size_t n,
+                        const size_t *lengths,
+                        const lev_wchar *strings[],
+                        double *ratios);
+
+int
+lev_paired_scores(size_t n,
+                  const LevColumn *column1,
+                  const LevColumn *column2,
+                  LevScorer scorer,
+                  double cutoff,
+                  LevDistanceCache *cache,
+                  size_t nthreads,
+                  void *scores);
+
+int
+lev_score_tile(const LevColumn *rows,
+               size_t r0,
+               size_t r1,
+               const LevColumn *cols,
+               size_t c0,
+               size_t c1,
+               LevScorer scorer,
+               LevTileFormat format,
+               LevDistanceCache *cache,
+               size_t nthreads,
+               void *tile,
+               size_t stride);
+
+LevTokenQuery*
+lev_token_query_new(size_t len,
+                    const lev_byte *string,
+                    LevTokenScorer scorer);
+
+LevTokenQuery*
+lev_u_token_query_new(size_t len,
+                      const lev_wchar *string,
+                      LevTokenScorer scorer);
+
+void
+lev_token_query_free(LevTokenQuery *query);
+
+int
+lev_token_ratio_batch(const LevTokenQuery *query,
+                      size_t n,
+                      const size_t *lengths,
+                      const lev_byte *strings[],
+                      double cutoff,
+                      size_t nthreads,
+                      double *ratios);
+
+int
+lev_u_token_ratio_batch(const LevTokenQuery *query,
+                        size_t n,
+                        const size_t *lengths,
+                        const lev_wchar *strings[],
+                        double cutoff,
+                        size_t nthreads,
+                        double *ratios);
+
+LevTokenMatch*
+lev_token_ratio_best(const LevTokenQuery *query,
+                     size_t n,
+                     const size_t *lengths,
+                     const lev_byte *strings[],
+                     double cutoff,
+                     size_t count,
+                     size_t nthreads,
+                     size_t *nmatches);
+
+LevTokenMatch*
+lev_u_token_ratio_best(const LevTokenQuery *query,
+                       size_t n,
+                       const size_t *lengths,
+                       const lev_wchar *strings[],
+                       double cutoff,
+                       size_t count,
+                       size_t nthreads,
+                       size_t *nmatches);
+
+void
+lev_run_tasks(size_t n,
+              LevTaskFunc func,
+              void *data,
+              size_t nthreads);
+
+LevPriority
+lev_priority_set(LevPriority priority);
+
+void
+lev_sched_stats(LevPriority priority,
+                LevSchedStats *stats);
+
+LevPriority
+lev_sched_begin(void);
+
+void
+lev_sched_end(LevPriority priority);
+
+const char*
+lev_tuning_name(size_t i);
+
+size_t
+lev_tuning_get(const char *name);
+
+int
+lev_tuning_set(const char *name,
+               size_t value);
+
+int
+lev_tuning_load(const char *filename);
+
+int
+lev_grapheme_split(size_t n,
+                   const size_t *lengths,
+                   const lev_wchar *strings[],
+                   LevGraphemes *clusters);
+
+void
+lev_grapheme_free(size_t n,
+                  LevGraphemes *clusters);
+
+LevOpCode*
+lev_grapheme_map_opcodes(size_t nb,
+                         const LevOpCode *bops,
+                         const LevGraphemes *clusters1,
+                         const LevGraphemes *clusters2,
+                         size_t *nmapped);
+
+int
+lev_line_set_scan(size_t size,
+                  const char *text,
+                  LevLineSet *set);
+
+void
+lev_line_set_free(LevLineSet *set);
+
 #endif /* not LEVENSHTEIN_H */
@@ -56,14 +56,13 @@ class StringMatcher:
         return self._ratio
 
     def quick_ratio(self):
-        # This is usually quick enough :o)
-        if not self._ratio:
-            self._ratio = ratio(self._str1, self._str2)
-        return self._ratio
+        # an upper bound of ratio(), unless we already know the real thing
+        if self._ratio is not None:
+            return self._ratio
+        return quick_ratio(self._str1, self._str2)
 
     def real_quick_ratio(self):
-        len1, len2 = len(self._str1), len(self._str2)
-        return 2.0 * min(len1, len2) / (len1 + len2)
+        return real_quick_ratio(self._str1, self._str2)
 
     def distance(self):
         if not self._distance:
@@ -12,6 +12,13 @@ other hand it's much faster.
 It supports both normal and Unicode strings, but can't mix them, all
 arguments to a function (method) have to be of the same type (or its
 subclasses).
+
+Strings can also be given as contiguous buffers (bytearray, memoryview,
+mmap, array.array, ...): 1 byte characters count as a normal string, 2 and
+4 byte characters as a Unicode string.  Lists of strings can also be NumPy
+style fixed width string arrays ('S' or 'U' dtype, or 2d buffers of
+characters) whose rows are NUL padded strings.  Buffers are used in place,
+without copying, where the C functions take them.
 """
 
 __author__ = "Max Bachmann"
@@ -26,7 +33,36 @@ from Levenshtein._levenshtein import (
     quickmedian,
     setmedian,
     seqratio,
-    setratio
+    setratio,
+    seq_opcodes,
+    iter_opcodes,
+    quick_ratio,
+    real_quick_ratio,
+    quick_ratio_batch,
+    real_quick_ratio_batch,
+    token_sort_ratio,
+    token_set_ratio,
+    token_seqratio,
+    token_ratio_batch,
+    token_ratio_best,
+    paired as _paired,
+    editop_runs,
+    runs_to_editops,
+    runs_to_opcodes,
+    apply_runs,
+    inverse_runs,
+    runs_matching_blocks,
+    subtract_runs,
+    get_tuning,
+    set_tuning,
+    scheduler_stats,
+    graphemes,
+    grapheme_distance as _grapheme_distance,
+    grapheme_ratio as _grapheme_ratio,
+    TUNING_FILE,
+    DeleteIndex,
+    DynamicIndex,
+    DistanceCache
 )
 
 from Levenshtein.c_levenshtein import (
@@ -38,7 +74,14 @@ from Levenshtein.c_levenshtein import (
     apply_edit
 )
 
-def distance(string1, string2):
+def _grapheme_unit(unit, name):
+    if unit == 'codepoint':
+        return False
+    if unit == 'grapheme':
+        return True
+    raise ValueError("%s unit must be 'codepoint' or 'grapheme'" % name)
+
+def distance(string1, string2, unit='codepoint'):
     """
     Compute absolute Levenshtein distance of two strings.
 
@@ -48,6 +91,11 @@ def distance(string1, string2):
         First string to compare.
     string2 : str
         Second string to compare.
+    unit : str, optional
+        'codepoint' (the default) compares the strings character by
+        character, 'grapheme' by extended grapheme clusters (see
+        graphemes()), so e.g. a letter with its accents or an emoji
+        sequence counts as a single symbol.
 
     Returns
     -------
@@ -68,10 +116,20 @@ def distance(string1, string2):
     0
     
     Yeah, we've managed it at last.
+
+    A family emoji is one grapheme cluster of five code points:
+
+    >>> family = '\U0001F468\u200D\U0001F469\u200D\U0001F467'
+    >>> distance(family, '\U0001F468')
+    4
+    >>> distance(family, '\U0001F468', unit='grapheme')
+    1
     """
+    if _grapheme_unit(unit, 'distance'):
+        return _grapheme_distance(string1, string2)
     return _string_metric.levenshtein(string1, string2)
 
-def ratio(string1, string2):
+def ratio(string1, string2, unit='codepoint'):
     """
     Compute similarity of two strings using the InDel distance.
     The InDel distance is similar to the Levenshtein distance with the following
@@ -86,6 +144,8 @@ def ratio(string1, string2):
         First string to compare.
     string2 : str
         Second string to compare.
+    unit : str, optional
+        'codepoint' (the default) or 'grapheme', see distance().
 
     Returns
     -------
@@ -107,6 +167,8 @@ def ratio(string1, string2):
     
     Really?  I thought there was some similarity.
     """
+    if _grapheme_unit(unit, 'ratio'):
+        return _grapheme_ratio(string1, string2)
     return _string_metric.normalized_levenshtein(string1, string2, weights=(1,1,2)) / 100
 
 def hamming(string1, string2):
@@ -218,3 +280,81 @@ def jaro_winkler(string1, string2, prefix_weight=0.1):
     1.0
     """
     return _string_metric.jaro_winkler_similarity(string1, string2, prefix_weight=prefix_weight) / 100
+
+_ARROW_TEXT = ('string', 'large_string')
+_ARROW_BINARY = ('binary', 'large_binary')
+
+def _arrow_column(strings):
+    """
+    Turn an Arrow string or binary array into the (offsets, data, encoding)
+    tuple _paired() takes, other objects are returned unchanged.  pyarrow
+    itself is never imported.
+    """
+    if not hasattr(strings, 'buffers') or not hasattr(strings, 'type'):
+        return strings
+    if hasattr(strings, 'combine_chunks'):
+        strings = strings.combine_chunks()
+    typename = str(strings.type)
+    if typename not in _ARROW_TEXT + _ARROW_BINARY:
+        raise TypeError("paired expected Arrow string or binary arrays, not %s"
+                        % typename)
+    if strings.null_count:
+        raise ValueError("paired strings must not be null")
+    offsets, data = strings.buffers()[1:3]
+    offsets = memoryview(offsets).cast('q' if typename.startswith('large')
+                                       else 'i')
+    offsets = offsets[strings.offset:strings.offset + len(strings) + 1]
+    if data is None:
+        data = b''
+    return (offsets, data, 'utf-8' if typename in _ARROW_TEXT else None)
+
+def paired(strings1, strings2, scorer='distance', workers=0, score_cutoff=None,
+           cache=None, priority='interactive'):
+    """
+    Compute a score of the strings of two columns row by row.
+
+    Parameters
+    ----------
+    strings1 : sequence, Arrow array or tuple
+        First strings, a sequence of str (or of bytes), an Arrow string or
+        binary array, or an (offsets, data[, encoding]) tuple: string i is
+        data[offsets[i]:offsets[i+1]], the offsets are a buffer of 32 or
+        64 bit integers and the encoding is None for bytes or 'utf-8' for
+        text.
+    strings2 : sequence, Arrow array or tuple
+        Second strings, as many as strings1.
+    scorer : str, optional
+        'distance' (the default), 'ratio' or 'hamming'.
+    workers : int, optional
+        Number of threads to use, zero means one per processor.
+    score_cutoff : int or float, optional
+        Distances larger than score_cutoff are returned as score_cutoff + 1,
+        ratios smaller than score_cutoff as 0.
+    cache : DistanceCache, optional
+        Cache of the distances of long strings, consulted before computing
+        them.
+    priority : str, optional
+        'interactive' (the default) or 'batch'.  The threads of batch calls
+        pause while interactive calls run, see scheduler_stats().
+
+    Returns
+    -------
+    scores : array.array
+        The score of strings1[i] and strings2[i] for each i, integers for
+        distances and floats for ratios.
+
+    Raises
+    ------
+    ValueError
+        If the columns have different lengths, or the hamming strings of
+        a row do.
+
+    Examples
+    --------
+    >>> list(paired(['spam', 'park'], ['spa', 'spam']))
+    [1, 3]
+    >>> list(paired(['spam', 'park'], ['spa', 'spam'], 'ratio'))
+    [0.8571428571428571, 0.5]
+    """
+    return _paired(_arrow_column(strings1), _arrow_column(strings2),
+                   scorer, workers, score_cutoff, cache, priority)
@@ -0,0 +1,29 @@
+"""
+Command line tools.
+
+    python -m Levenshtein dedupe ...    remove near-duplicate lines
+    python -m Levenshtein serve ...     run a local matching server
+    python -m Levenshtein tune ...      tune the engines for this machine
+
+Run a command with --help for its options.
+"""
+
+import sys
+
+def main(argv=None):
+    if argv is None:
+        argv = sys.argv[1:]
+    if not argv or argv[0] not in ("dedupe", "serve", "tune"):
+        sys.stderr.write(__doc__.lstrip())
+        return 2
+    if argv[0] == "dedupe":
+        from Levenshtein.dedupe import main as command
+    elif argv[0] == "serve":
+        from Levenshtein.server import main as command
+    else:
+        from Levenshtein.tune import main as command
+    command(argv[1:])
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,163 @@
+"""
+Asyncio coroutines computing on native threads.
+
+    from Levenshtein import aio
+
+    async def handler(a, b):
+        return await aio.setratio(a, b)
+
+A median, setratio or editops of long strings called directly blocks the
+event loop for its whole duration.  The coroutines of this module hand the
+computation to a native thread instead: the arguments are converted (and
+kept alive) in C, the engines run without the GIL, and the finished work
+is signalled through a pipe the event loop watches, so no Python thread is
+involved.  Requests made during one iteration of the event loop are
+coalesced into one batch: its distances and ratios are scored together
+like the rows of paired(), its other computations run in parallel on the
+engine threads, so many small concurrent requests cost a single handoff.
+At most max_batches batches of an event loop run at a time, requests
+made meanwhile wait and form the next batch when one finishes, so the
+threads are bounded however many requests come in.
+
+On event loops without add_reader() (the Windows proactor loop) a batch is
+waited for in the default executor instead.
+"""
+
+import asyncio
+import os
+import weakref
+
+from Levenshtein._levenshtein import AioBatch
+
+# threads running the computations of one batch, zero means one per
+# processor
+threads = 0
+
+# priority of the batches, 'interactive' or 'batch'
+priority = 'interactive'
+
+# batches of an event loop running at a time, each on up to threads
+# threads (plus its own)
+max_batches = 2
+
+class _Dispatcher:
+    """
+    Coalesces the requests of an event loop into batches and completes
+    their futures.
+    """
+
+    def __init__(self, loop):
+        # the loop keeps its dispatcher, not the other way round
+        self.loop = weakref.ref(loop)
+        self.pending = []
+        self.running = {}
+        self.rfd = self.wfd = None
+        try:
+            rfd, wfd = os.pipe()
+        except OSError:
+            return
+        try:
+            os.set_blocking(rfd, False)
+            os.set_blocking(wfd, False)
+            loop.add_reader(rfd, self._wakeup)
+        except (NotImplementedError, OSError):
+            os.close(rfd)
+            os.close(wfd)
+            return
+        self.rfd, self.wfd = rfd, wfd
+        weakref.finalize(self, _close_pipe, rfd, wfd)
+
+    def submit(self, loop, task):
+        future = loop.create_future()
+        if not self.pending and len(self.running) < max(max_batches, 1):
+            loop.call_soon(self._flush)
+        self.pending.append((task, future))
+        return future
+
+    def _flush(self):
+        if not self.pending or len(self.running) >= max(max_batches, 1):
+            return
+        pending, self.pending = self.pending, []
+        futures = [future for task, future in pending]
+        batch = AioBatch([task for task, future in pending],
+                         -1 if self.wfd is None else self.wfd, threads,
+                         priority)
+        self.running[batch] = futures
+        if self.wfd is None:
+            waiter = self.loop().run_in_executor(None, batch.wait)
+            waiter.add_done_callback(lambda _: self._done(batch))
+
+    def _wakeup(self):
+        try:
+            while os.read(self.rfd, 4096):
+                pass
+        except BlockingIOError:
+            pass
+        for batch in [b for b in self.running if b.done()]:
+            self._done(batch)
+
+    def _done(self, batch):
+        self._finish(batch, self.running.pop(batch))
+        # the requests that waited for a free batch
+        self._flush()
+
+    @staticmethod
+    def _finish(batch, futures):
+        for future, result in zip(futures, batch.results()):
+            if future.cancelled():
+                continue
+            if isinstance(result, BaseException):
+                future.set_exception(result)
+            else:
+                future.set_result(result)
+
+def _close_pipe(rfd, wfd):
+    os.close(rfd)
+    os.close(wfd)
+
+_dispatchers = weakref.WeakKeyDictionary()
+
+def _submit(*task):
+    loop = asyncio.get_running_loop()
+    dispatcher = _dispatchers.get(loop)
+    if dispatcher is None:
+        dispatcher = _dispatchers[loop] = _Dispatcher(loop)
+    return dispatcher.submit(loop, task)
+
+async def distance(string1, string2):
+    """
+    Levenshtein distance of two strings, see Levenshtein.distance().
+    """
+    return await _submit('distance', string1, string2)
+
+async def ratio(string1, string2):
+    """
+    Similarity ratio of two strings, see Levenshtein.ratio().
+    """
+    return await _submit('ratio', string1, string2)
+
+async def editops(string1, string2):
+    """
+    Edit operations turning string1 into string2, see Levenshtein.editops().
+    """
+    return await _submit('editops', string1, string2)
+
+async def setratio(strings1, strings2):
+    """
+    Similarity ratio of two string sets, see Levenshtein.setratio().
+    """
+    return await _submit('setratio', strings1, strings2)
+
+async def seqratio(strings1, strings2):
+    """
+    Similarity ratio of two string sequences, see Levenshtein.seqratio().
+    """
+    return await _submit('seqratio', strings1, strings2)
+
+async def median(strings, weights=None):
+    """
+    Approximate median string, see Levenshtein.median().
+    """
+    if weights is None:
+        return await _submit('median', strings)
+    return await _submit('median', strings, weights)
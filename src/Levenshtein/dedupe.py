@@ -0,0 +1,291 @@
+"""
+Near-duplicate removal for large line oriented files.
+
+    python -m Levenshtein dedupe INPUT --max-distance K [--workers N]
+        [--output representatives|ids] [--median] [--casefold] [-o FILE]
+
+The input is memory mapped and scanned by scan_lines(), which normalizes
+the lines (runs of whitespace collapsed) and collapses identical ones
+without creating a Python object per line; with --casefold only the
+distinct lines are case folded and merged.  The distinct ones are indexed
+with a
+DeleteIndex, whose clusters() method looks every one of them up (with
+distances bounded by K) and joins the matches with union-find: lines
+connected by a chain of lines within distance K form a cluster.
+
+The output is either the representative of each cluster, in the order
+of their first lines, or the cluster of every input line, i.e. the
+(0-based) number of the first line of the cluster.  Representatives are
+the first lines themselves, read from the mapping again, or with --median
+the weighted median string of the cluster.
+
+Memory use is proportional to the distinct normalized lines and the delete
+index, plus 8 bytes per input line for the distinct line of each: the
+input itself is never read into memory as a whole.
+"""
+
+import mmap
+import sys
+from array import array
+
+from Levenshtein._levenshtein import (
+    DeleteIndex,
+    median,
+    scan_lines
+)
+
+def normalize(line, casefold=False):
+    """
+    Collapse runs of whitespace in a line and optionally case fold it.
+    """
+    line = ' '.join(line.split())
+    return line.casefold() if casefold else line
+
+class Clusters:
+    """
+    Clustering of lines by edit distance.
+
+    Parameters
+    ----------
+    lines : iterable of str
+        The lines, they are consumed once and not kept.
+    max_distance : int
+        The largest Levenshtein distance of (normalized) lines joined
+        into one cluster.
+    workers : int, optional
+        Number of threads to use, zero means one per processor.
+    casefold : bool, optional
+        Whether to case fold the lines when normalizing them.
+    keep_lines : bool, optional
+        Whether to store the word of each line for line_cluster(), 8 bytes
+        per line.  Without it clusters are found from the line text by
+        cluster().
+
+    Attributes
+    ----------
+    words : list of str
+        The distinct normalized lines, in the order of their first lines.
+    ids : dict
+        The index of each word in words.
+    counts : array
+        The number of lines of each word.
+    first : array
+        The number of the first line of each word.
+    line_words : array or None
+        The word of each line, None unless keep_lines is true.
+    line_keys : array or None
+        The distinct line of each line, with from_buffer() only.
+    key_words : array or None
+        The word of each distinct line, with from_buffer() only.
+    offsets : array or None
+        The offset of the first line of each word in the buffer, with
+        from_buffer() only.
+    word_clusters : list of int
+        The cluster of each word, identified by its first word.
+    """
+
+    def __init__(self, lines, max_distance, workers=0, casefold=False,
+                 keep_lines=True):
+        self.casefold = casefold
+        self.ids = {}
+        self.words = []
+        self.counts = array('q')
+        self.first = array('q')
+        self.line_words = array('q') if keep_lines else None
+        self.line_keys = self.key_words = self.offsets = None
+        self.nlines = 0
+        for i, line in enumerate(lines):
+            word = normalize(line, casefold)
+            wid = self.ids.setdefault(word, len(self.words))
+            if wid == len(self.words):
+                self.words.append(word)
+                self.counts.append(0)
+                self.first.append(i)
+            self.counts[wid] += 1
+            if keep_lines:
+                self.line_words.append(wid)
+            self.nlines = i + 1
+        self._cluster(max_distance, workers)
+
+    @classmethod
+    def from_buffer(cls, buffer, max_distance, workers=0, casefold=False):
+        """
+        Clustering of the lines of a UTF-8 text, e.g. a memory mapped file.
+
+        The lines are split, normalized and collapsed by scan_lines(), the
+        Python code only sees the distinct lines.  The other parameters
+        are the same as of Clusters().
+        """
+        lines, counts, first, offsets, keys = scan_lines(buffer)
+        counts = array('q', counts)
+        first = array('q', first)
+        offsets = array('q', offsets)
+        self = cls.__new__(cls)
+        self.casefold = casefold
+        self.ids = {}
+        self.words = []
+        self.counts = array('q')
+        self.first = array('q')
+        self.offsets = array('q')
+        self.line_words = None
+        self.line_keys = array('q', keys)
+        self.key_words = array('q')
+        self.nlines = len(self.line_keys)
+        # the lines are in the order of their first lines, so the first line
+        # of a word is the one of its first line
+        for key, line in enumerate(lines):
+            word = line.casefold() if casefold else line
+            wid = self.ids.setdefault(word, len(self.words))
+            if wid == len(self.words):
+                self.words.append(word)
+                self.counts.append(0)
+                self.first.append(first[key])
+                self.offsets.append(offsets[key])
+            self.counts[wid] += counts[key]
+            self.key_words.append(wid)
+        self._cluster(max_distance, workers)
+        return self
+
+    def _cluster(self, max_distance, workers):
+        if max_distance > 0 and self.words:
+            index = DeleteIndex(self.words, max_distance, self.counts,
+                                threads=workers)
+            self.word_clusters = index.clusters(max_distance, workers)
+        else:
+            self.word_clusters = list(range(len(self.words)))
+
+    def __len__(self):
+        return self.nlines
+
+    def line_cluster(self, i):
+        """
+        The cluster of line i, the number of its first line; needs
+        keep_lines or from_buffer().
+        """
+        if self.line_words is None:
+            return self.first[self.word_clusters[
+                self.key_words[self.line_keys[i]]]]
+        return self.first[self.word_clusters[self.line_words[i]]]
+
+    def cluster(self, line):
+        """
+        The cluster of a line given by its text, the number of its first
+        line, and its word.
+        """
+        wid = self.ids[normalize(line, self.casefold)]
+        return self.first[self.word_clusters[wid]], wid
+
+    def medians(self):
+        """
+        Compute the weighted median string of each cluster of several
+        distinct words.
+
+        Returns
+        -------
+        medians : dict
+            The median of each such cluster, keyed by its first word.
+        """
+        members = {}
+        for wid, cid in enumerate(self.word_clusters):
+            if wid != cid:
+                members.setdefault(cid, [cid]).append(wid)
+        return {cid: median([self.words[w] for w in wids],
+                            [self.counts[w] for w in wids])
+                for cid, wids in members.items()}
+
+# lines written at once with output='ids'
+_CHUNK = 65536
+
+def dedupe(filename, out, max_distance, workers=0, output='representatives',
+           use_median=False, casefold=False):
+    """
+    Remove near-duplicate lines of a file.
+
+    Parameters
+    ----------
+    filename : str
+        The input file, UTF-8 encoded lines.
+    out : file
+        A text file the result is written to.
+    max_distance : int
+        The largest Levenshtein distance of (normalized) lines considered
+        duplicates.
+    workers : int, optional
+        Number of threads to use, zero means one per processor.
+    output : str, optional
+        'representatives' to write one line of each cluster, 'ids' to
+        write the cluster of each line.
+    use_median : bool, optional
+        Whether the representatives are the cluster medians instead of the
+        first lines.
+    casefold : bool, optional
+        Whether to case fold the lines when normalizing them.
+    """
+    with open(filename, 'rb') as fh:
+        try:
+            mm = mmap.mmap(fh.fileno(), 0, access=mmap.ACCESS_READ)
+        except ValueError:
+            # empty files can't be mapped
+            return
+        with mm:
+            clusters = Clusters.from_buffer(mm, max_distance, workers,
+                                            casefold)
+            if output == 'ids':
+                # the label of each distinct line, then of each line
+                labels = ["%d\n" % clusters.first[clusters.word_clusters[w]]
+                          for w in clusters.key_words]
+                keys = clusters.line_keys
+                for i in range(0, len(keys), _CHUNK):
+                    out.write(''.join(map(labels.__getitem__,
+                                          keys[i:i + _CHUNK])))
+                return
+            medians = clusters.medians() if use_median else {}
+            for wid, cid in enumerate(clusters.word_clusters):
+                if wid != cid:
+                    continue
+                if wid in medians:
+                    out.write(medians[wid] + "\n")
+                    continue
+                start = clusters.offsets[wid]
+                end = mm.find(b'\n', start)
+                line = mm[start:end if end >= 0 else len(mm)]
+                out.write(line.rstrip(b'\r\n').decode('utf-8',
+                                                       'surrogateescape')
+                          + "\n")
+
+def main(argv=None):
+    import argparse
+
+    parser = argparse.ArgumentParser(prog="python -m Levenshtein dedupe",
+                                     description=__doc__.split("\n\n")[0])
+    parser.add_argument("input", help="input file, one item per line")
+    parser.add_argument("--max-distance", "-k", type=int, required=True,
+                        help="largest edit distance of duplicates")
+    parser.add_argument("--workers", "-j", type=int, default=0,
+                        help="threads to use (default one per processor)")
+    parser.add_argument("--output", choices=("representatives", "ids"),
+                        default="representatives",
+                        help="write cluster representatives (default) or "
+                             "the cluster of each line")
+    parser.add_argument("--median", action="store_true",
+                        help="represent clusters by their median string")
+    parser.add_argument("--casefold", action="store_true",
+                        help="ignore case differences")
+    parser.add_argument("-o", dest="outfile", default="-",
+                        help="output file (default standard output)")
+    args = parser.parse_args(argv)
+    if args.max_distance < 0:
+        parser.error("--max-distance must be nonnegative")
+
+    if args.outfile == "-":
+        out = open(sys.stdout.fileno(), 'w', encoding='utf-8',
+                   errors='surrogateescape', closefd=False)
+    else:
+        out = open(args.outfile, 'w', encoding='utf-8',
+                   errors='surrogateescape')
+    with out:
+        dedupe(args.input, out, args.max_distance, args.workers, args.output,
+               args.median, args.casefold)
+
+if __name__ == "__main__":
+    main()
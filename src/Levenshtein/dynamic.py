@@ -0,0 +1,70 @@
+"""
+Background compaction of dynamic fuzzy indexes.
+
+    from Levenshtein import DynamicIndex
+    from Levenshtein.dynamic import Compactor
+
+    index = DynamicIndex(max_k=2)
+    with Compactor(index, interval=1.0):
+        ...  # insert, delete and look up words from any thread
+
+A DynamicIndex collects inserted words in small segments and keeps deleted
+words until they are compacted away.  Lookups get slower as segments and
+deleted words accumulate, so compact() should run from time to time; it
+works on a snapshot, without blocking the writers or readers, which makes
+a background thread the natural place for it.
+"""
+
+import threading
+
+class Compactor:
+    """
+    Thread compacting a DynamicIndex periodically.
+
+    Parameters
+    ----------
+    index : DynamicIndex
+        The index to compact.
+    interval : float, optional
+        Seconds between compactions.
+    threads : int, optional
+        Number of threads of one compaction, zero means one per processor.
+    priority : str, optional
+        Priority of the compactions, 'batch' by default so they yield to
+        interactive parallel calls (see Levenshtein.scheduler_stats()).
+
+    The thread is a daemon thread, started on construction and stopped by
+    stop() or at the end of a with block.
+    """
+
+    def __init__(self, index, interval=1.0, threads=0, priority='batch'):
+        if interval <= 0:
+            raise ValueError("interval must be positive")
+        self.index = index
+        self.interval = interval
+        self.threads = threads
+        self.priority = priority
+        self.compactions = 0
+        self._stop = threading.Event()
+        self._thread = threading.Thread(target=self._run,
+                                        name="Levenshtein compactor",
+                                        daemon=True)
+        self._thread.start()
+
+    def _run(self):
+        while not self._stop.wait(self.interval):
+            self.index.compact(threads=self.threads, priority=self.priority)
+            self.compactions += 1
+
+    def stop(self):
+        """
+        Stop the thread and wait for a running compaction to finish.
+        """
+        self._stop.set()
+        self._thread.join()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.stop()
@@ -0,0 +1,146 @@
+"""
+Score matrices too large for memory.
+
+    from Levenshtein.matrix import tiles, write_matrix
+
+    for rows, cols, tile in tiles(strings1, strings2):
+        # tile[i*len(cols) + j] is the ratio of strings1[rows[i]]
+        # and strings2[cols[j]]
+        ...
+
+    write_matrix('ratios.u8', strings1, strings2, dtype='B')
+
+A matrix of a million squared scores needs terabytes, it's computed by
+square tiles instead, each one in parallel and without any Python
+overhead per cell.  Tiles are made row band after row band, so the
+strings of a tile stay in the processor cache and a matrix written to a
+file is written mostly sequentially.  The default tile size is the
+'tile_size' tuning parameter, python -m Levenshtein.tune finds the best
+one for the machine.
+
+Compact dtypes help to keep such files manageable: 'B' stores ratios
+quantized to floor(255*ratio + 0.5), 'H' distances saturated at 65535.
+Recomputing matrices of long strings can be avoided with a DistanceCache,
+that keeps their distances across runs.
+
+The file written by write_matrix() is the raw matrix, by rows, in the
+native byte order; numpy.memmap() or mmap and memoryview.cast() read it.
+"""
+
+import mmap
+import os
+from array import array
+
+from Levenshtein._levenshtein import ScoreMatrix, get_tuning
+
+def _tile_ranges(shape, tile_size):
+    n1, n2 = shape
+    for r0 in range(0, n1, tile_size):
+        for c0 in range(0, n2, tile_size):
+            yield (range(r0, min(r0 + tile_size, n1)),
+                   range(c0, min(c0 + tile_size, n2)))
+
+def tiles(strings1, strings2=None, scorer='ratio', dtype=None,
+          tile_size=None, workers=0, cache=None, priority='interactive'):
+    """
+    Iterate over the tiles of a score matrix.
+
+    Parameters
+    ----------
+    strings1 : sequence, Arrow array or tuple
+        The strings of the matrix rows, anything Levenshtein.paired()
+        takes.
+    strings2 : sequence, Arrow array or tuple, optional
+        The strings of the matrix columns, strings1 by default.
+    scorer : str, optional
+        'ratio' (the default) or 'distance'.
+    dtype : str, optional
+        The array typecode of the scores: 'd' (default) or 'B' for ratios,
+        'l' or 'q' (default, size_t sized) or 'H' for distances.
+    tile_size : int, optional
+        The number of rows and columns of a tile, the 'tile_size' tuning
+        parameter by default (see Levenshtein.tune).
+    workers : int, optional
+        Number of threads to use, zero means one per processor.
+    cache : DistanceCache, optional
+        Cache of the distances of long strings.
+    priority : str, optional
+        'interactive' (the default) or 'batch', see Levenshtein.paired().
+
+    Yields
+    ------
+    rows : range
+        The rows of the tile.
+    cols : range
+        The columns of the tile.
+    tile : array.array
+        The scores, by rows.
+    """
+    from Levenshtein import _arrow_column
+
+    if tile_size is None:
+        tile_size = get_tuning()['tile_size']
+    if tile_size < 1:
+        raise ValueError("tile_size must be positive")
+    matrix = ScoreMatrix(_arrow_column(strings1),
+                         None if strings2 is None
+                         else _arrow_column(strings2),
+                         scorer, dtype, cache)
+    for rows, cols in _tile_ranges(matrix.shape, tile_size):
+        yield rows, cols, matrix.tile(rows.start, rows.stop,
+                                      cols.start, cols.stop, threads=workers,
+                                      priority=priority)
+
+def _fill(matrix, out, tile_size, workers, priority):
+    n2 = matrix.shape[1]
+    itemsize = array(matrix.dtype).itemsize
+    with memoryview(out) as base, base.cast('B') as view:
+        if len(view) < matrix.shape[0] * n2 * itemsize:
+            raise ValueError("write_matrix out is too small for the matrix")
+        for rows, cols in _tile_ranges(matrix.shape, tile_size):
+            start = (rows.start * n2 + cols.start) * itemsize
+            with view[start:] as dest:
+                matrix.tile(rows.start, rows.stop, cols.start, cols.stop,
+                            dest, n2, workers, priority)
+
+def write_matrix(out, strings1, strings2=None, scorer='ratio', dtype=None,
+                 tile_size=None, workers=0, cache=None,
+                 priority='interactive'):
+    """
+    Compute a whole score matrix into a file or a buffer.
+
+    Parameters
+    ----------
+    out : str, path or buffer
+        A file name, the file is created (or truncated) and memory mapped,
+        or a writable buffer with room for the matrix, e.g. an mmap.
+    strings1, strings2, scorer, dtype, tile_size, workers, cache, priority
+        See tiles().
+
+    Returns
+    -------
+    shape : tuple
+        The numbers of rows and columns of the matrix.
+    """
+    from Levenshtein import _arrow_column
+
+    if tile_size is None:
+        tile_size = get_tuning()['tile_size']
+    if tile_size < 1:
+        raise ValueError("tile_size must be positive")
+    matrix = ScoreMatrix(_arrow_column(strings1),
+                         None if strings2 is None
+                         else _arrow_column(strings2),
+                         scorer, dtype, cache)
+    if not isinstance(out, (str, bytes, os.PathLike)):
+        _fill(matrix, out, tile_size, workers, priority)
+        return matrix.shape
+
+    size = matrix.shape[0] * matrix.shape[1] * array(matrix.dtype).itemsize
+    with open(out, 'w+b') as fh:
+        fh.truncate(size)
+        if size:
+            with mmap.mmap(fh.fileno(), size) as mm:
+                _fill(matrix, mm, tile_size, workers, priority)
+                mm.flush()
+    return matrix.shape
@@ -0,0 +1,579 @@
+"""
+A local matching server sharing corpora and engine threads between processes.
+
+    python -m Levenshtein serve SOCKET --corpus NAME=FILE [--max-k K]
+        [--threads N] [--max-inflight N]
+
+    from Levenshtein.server import Client
+
+    client = Client(SOCKET)
+    client.extract('names', ['Jon Smith', 'Jane Doe'], limit=5)
+    client.distance(['spam', 'eggs'], ['park', 'legs'])
+    client.median(['spam', 'spa', 'sam'])
+
+Many worker processes on one host (say a preforking web server) would each
+load their own copy of the reference corpora and their indexes, and each
+run their own engine threads.  The server holds them once: every corpus (a
+file of lines) is indexed with a DeleteIndex and workers send requests over
+a Unix domain socket, never over the network.
+
+Messages are length prefixed frames of a compact tagged binary encoding,
+lists of strings are sent as one block of lengths and one of UTF-8 data.
+Requests of one kind arriving during one iteration of the server's event
+loop are coalesced: distances and ratios of all of them are computed by one
+multithreaded paired() call, extract queries are spread over the engine
+threads and medians go through Levenshtein.aio.  When max_inflight requests
+are being computed a connection with a new request waits for a slot before
+reading any further ones, so busy clients block in their sends instead of
+piling work up in the server.  Idle connections take no slots.
+"""
+
+import asyncio
+import builtins
+import os
+import socket
+import stat
+import struct
+import threading
+from concurrent.futures import ThreadPoolExecutor
+
+from Levenshtein._levenshtein import (
+    DeleteIndex,
+    paired,
+    token_ratio_best
+)
+from Levenshtein import aio
+
+_FRAME = struct.Struct('<I')
+_INT = struct.Struct('<q')
+_FLOAT = struct.Struct('<d')
+
+MAX_FRAME = 1 << 30
+
+_TOKEN_SCORERS = {'token_sort': 'sort', 'token_set': 'set',
+                  'token_seq': 'seq'}
+
+class ServerError(RuntimeError):
+    """
+    An error raised by the server that has no builtin exception type.
+    """
+
+def _utf8(s):
+    return s.encode('utf-8', 'surrogatepass')
+
+def _encode(obj, out):
+    """
+    Append the tagged encoding of obj to the bytearray out.
+    """
+    if obj is None:
+        out += b'N'
+    elif obj is True or obj is False:
+        out += b'T' if obj else b'F'
+    elif isinstance(obj, int):
+        out += b'i'
+        out += _INT.pack(obj)
+    elif isinstance(obj, float):
+        out += b'd'
+        out += _FLOAT.pack(obj)
+    elif isinstance(obj, str):
+        data = _utf8(obj)
+        out += b's'
+        out += _FRAME.pack(len(data))
+        out += data
+    elif isinstance(obj, (bytes, bytearray, memoryview)):
+        data = bytes(obj)
+        out += b'b'
+        out += _FRAME.pack(len(data))
+        out += data
+    elif isinstance(obj, (list, tuple)):
+        if isinstance(obj, list) and obj:
+            # string lists as a block of lengths and a block of data
+            if all(type(x) is str for x in obj):
+                items = [_utf8(x) for x in obj]
+                tag = b'S'
+            elif all(type(x) is bytes for x in obj):
+                items = obj
+                tag = b'B'
+            else:
+                items = None
+            if items is not None:
+                out += tag
+                out += _FRAME.pack(len(items))
+                out += struct.pack('<%dI' % len(items),
+                                   *[len(x) for x in items])
+                out += b''.join(items)
+                return
+        out += b't' if isinstance(obj, tuple) else b'l'
+        out += _FRAME.pack(len(obj))
+        for x in obj:
+            _encode(x, out)
+    else:
+        raise TypeError("cannot send %s to the server" % type(obj).__name__)
+
+def _decode(data, pos=0):
+    """
+    Decode one value of data at pos, return it and the position after it.
+    """
+    tag = data[pos:pos + 1]
+    pos += 1
+    if tag == b'N':
+        return None, pos
+    if tag in (b'T', b'F'):
+        return tag == b'T', pos
+    if tag == b'i':
+        return _INT.unpack_from(data, pos)[0], pos + 8
+    if tag == b'd':
+        return _FLOAT.unpack_from(data, pos)[0], pos + 8
+    (n,) = _FRAME.unpack_from(data, pos)
+    pos += 4
+    if tag in (b's', b'b'):
+        if pos + n > len(data):
+            raise ValueError("truncated message")
+        chunk = bytes(data[pos:pos + n])
+        return (chunk.decode('utf-8', 'surrogatepass') if tag == b's'
+                else chunk), pos + n
+    if tag in (b'S', b'B'):
+        lengths = struct.unpack_from('<%dI' % n, data, pos)
+        pos += 4 * n
+        items = []
+        for length in lengths:
+            if pos + length > len(data):
+                raise ValueError("truncated message")
+            chunk = bytes(data[pos:pos + length])
+            items.append(chunk.decode('utf-8', 'surrogatepass')
+                         if tag == b'S' else chunk)
+            pos += length
+        return items, pos
+    if tag in (b'l', b't'):
+        items = []
+        for _ in range(n):
+            x, pos = _decode(data, pos)
+            items.append(x)
+        return (tuple(items) if tag == b't' else items), pos
+    raise ValueError("invalid message")
+
+def _frame(obj):
+    out = bytearray(4)
+    _encode(obj, out)
+    _FRAME.pack_into(out, 0, len(out) - 4)
+    return out
+
+class _Batcher:
+    """
+    Coalesces the requests of one kind made during one event loop iteration
+    and runs them on the executor, in up to parts jobs.  run() gets a list
+    of argument tuples and returns the result of each, exceptions are
+    results too.
+    """
+
+    def __init__(self, executor, run, parts=1):
+        self.executor = executor
+        self.run = run
+        self.parts = parts
+        self.pending = []
+
+    def submit(self, loop, args):
+        future = loop.create_future()
+        if not self.pending:
+            loop.call_soon(self._flush, loop)
+        self.pending.append((args, future))
+        return future
+
+    def _flush(self, loop):
+        pending, self.pending = self.pending, []
+        parts = min(self.parts, len(pending))
+        size = -(-len(pending) // parts)
+        for start in range(0, len(pending), size):
+            chunk = pending[start:start + size]
+            job = loop.run_in_executor(self.executor, self.run,
+                                       [args for args, future in chunk])
+            job.add_done_callback(
+                lambda job, chunk=chunk: self._finish(job, chunk))
+
+    @staticmethod
+    def _finish(job, chunk):
+        if job.exception() is not None:
+            results = [job.exception()] * len(chunk)
+        else:
+            results = job.result()
+        for (args, future), result in zip(chunk, results):
+            if future.cancelled():
+                continue
+            if isinstance(result, BaseException):
+                future.set_exception(result)
+            else:
+                future.set_result(result)
+
+class Server:
+    """
+    Matching server on a Unix domain socket.
+
+    Parameters
+    ----------
+    path : str
+        The socket file, an existing socket file is replaced.
+    corpora : dict, optional
+        Corpora to serve, lists of strings (or bytes) keyed by name.
+    max_k : int, optional
+        The max_k of the corpus indexes, the largest distance extract()
+        can find.
+    threads : int, optional
+        Number of engine threads, zero means one per processor.
+    max_inflight : int, optional
+        Number of requests computed at once, further requests wait (one
+        per connection, the rest unread) while there are so many.
+    """
+
+    def __init__(self, path, corpora=None, max_k=2, threads=0,
+                 max_inflight=256):
+        self.path = path
+        self.threads = threads or os.cpu_count() or 1
+        self.max_inflight = max_inflight
+        self.corpora = {}
+        self.indexes = {}
+        for name, strings in (corpora or {}).items():
+            self.add_corpus(name, strings, max_k)
+        self.ready = threading.Event()
+        self._loop = None
+        self._stop = None
+
+    def add_corpus(self, name, strings, max_k=2):
+        """
+        Index a corpus for extract(), replacing one of the same name.
+        """
+        strings = list(strings)
+        self.indexes[name] = DeleteIndex(strings, max_k, threads=self.threads)
+        self.corpora[name] = strings
+
+    def serve_forever(self):
+        """
+        Serve until shutdown() is called.
+        """
+        asyncio.run(self._main())
+
+    def shutdown(self):
+        """
+        Stop a server running serve_forever(), from any thread.
+        """
+        if self._loop is not None:
+            self._loop.call_soon_threadsafe(self._stop.set)
+
+    async def _main(self):
+        self._loop = asyncio.get_running_loop()
+        self._stop = asyncio.Event()
+        self._slots = asyncio.Semaphore(self.max_inflight)
+        with ThreadPoolExecutor(self.threads) as executor:
+            self._batchers = {
+                'distance': _Batcher(executor,
+                                     lambda r: self._paired(r, 'distance')),
+                'ratio': _Batcher(executor,
+                                  lambda r: self._paired(r, 'ratio')),
+                'extract': _Batcher(executor, self._extract, self.threads),
+            }
+            try:
+                if stat.S_ISSOCK(os.stat(self.path).st_mode):
+                    os.unlink(self.path)
+            except FileNotFoundError:
+                pass
+            server = await asyncio.start_unix_server(self._connection,
+                                                     path=self.path)
+            try:
+                self.ready.set()
+                await self._stop.wait()
+            finally:
+                server.close()
+                await server.wait_closed()
+                self.ready.clear()
+                try:
+                    os.unlink(self.path)
+                except OSError:
+                    pass
+
+    async def _connection(self, reader, writer):
+        lock = asyncio.Lock()
+        tasks = set()
+        try:
+            while True:
+                try:
+                    (size,) = _FRAME.unpack(await reader.readexactly(4))
+                    if size > MAX_FRAME:
+                        raise ValueError("message too large")
+                    data = await reader.readexactly(size)
+                except (asyncio.IncompleteReadError, ConnectionError,
+                        ValueError):
+                    break
+                # back-pressure: while the server is full, hold the request
+                # and don't read the next one; idle connections hold nothing
+                await self._slots.acquire()
+                task = asyncio.ensure_future(self._request(data, writer, lock))
+                tasks.add(task)
+                task.add_done_callback(tasks.discard)
+        finally:
+            if tasks:
+                await asyncio.gather(*tasks, return_exceptions=True)
+            writer.close()
+
+    async def _request(self, data, writer, lock):
+        rid = 0
+        try:
+            try:
+                message, _ = _decode(data)
+                rid, op, args = message[0], message[1], message[2:]
+                result = await self._dispatch(op, args)
+                reply = [rid, True, result]
+            except Exception as e:
+                reply = [rid, False, [type(e).__name__, str(e)]]
+            frame = _frame(reply)
+            async with lock:
+                writer.write(frame)
+                await writer.drain()
+        except ConnectionError:
+            pass
+        finally:
+            self._slots.release()
+
+    async def _dispatch(self, op, args):
+        loop = asyncio.get_running_loop()
+        if op in self._batchers:
+            return await self._batchers[op].submit(loop, tuple(args))
+        if op == 'median':
+            return await aio.median(*args)
+        if op == 'corpora':
+            return [(name, len(strings))
+                    for name, strings in sorted(self.corpora.items())]
+        if op == 'ping':
+            return None
+        raise ValueError("unknown request %r" % (op,))
+
+    def _paired(self, requests, scorer):
+        strings1, strings2 = [], []
+        try:
+            for s1, s2 in requests:
+                if len(s1) != len(s2):
+                    raise ValueError("both lists must have the same length")
+                strings1.extend(s1)
+                strings2.extend(s2)
+            scores = list(paired(strings1, strings2, scorer, self.threads))
+        except Exception:
+            # find out whose request failed
+            if len(requests) == 1:
+                raise
+            return [self._single(lambda: self._paired([r], scorer)[0])
+                    for r in requests]
+        results, start = [], 0
+        for s1, s2 in requests:
+            results.append(scores[start:start + len(s1)])
+            start += len(s1)
+        return results
+
+    def _extract(self, requests):
+        return [self._single(lambda: self._extract_one(*r)) for r in requests]
+
+    def _extract_one(self, corpus, queries, max_k=None, limit=None,
+                     scorer='distance'):
+        if corpus not in self.corpora:
+            raise KeyError("unknown corpus %r" % (corpus,))
+        if scorer in _TOKEN_SCORERS:
+            strings = self.corpora[corpus]
+            count = len(strings) if limit is None else limit
+            return [[(strings[i], score) for i, score in
+                     token_ratio_best(q, strings, count,
+                                      _TOKEN_SCORERS[scorer], 1)]
+                    for q in queries]
+        if scorer != 'distance':
+            raise ValueError("unknown scorer %r" % (scorer,))
+        index = self.indexes[corpus]
+        return [index.lookup(q, max_k)[:limit] for q in queries]
+
+    @staticmethod
+    def _single(func):
+        try:
+            return func()
+        except Exception as e:
+            return e
+
+class Client:
+    """
+    Client of a matching server, a blocking connection safe to share by
+    threads.  It reconnects by itself in forked processes.
+
+    Parameters
+    ----------
+    path : str
+        The server socket file.
+    timeout : float, optional
+        Socket timeout in seconds, None blocks.
+    """
+
+    def __init__(self, path, timeout=None):
+        self.path = path
+        self.timeout = timeout
+        self._lock = threading.Lock()
+        self._sock = None
+        self._pid = None
+        self._rid = 0
+
+    def close(self):
+        with self._lock:
+            if self._sock is not None:
+                self._sock.close()
+                self._sock = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def _connect(self):
+        if self._sock is not None and self._pid == os.getpid():
+            return
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.settimeout(self.timeout)
+        try:
+            sock.connect(self.path)
+        except OSError:
+            sock.close()
+            raise
+        # a forked child must not talk over its parent's connection
+        self._sock, self._pid = sock, os.getpid()
+
+    def _recv(self, size):
+        buf = bytearray(size)
+        view = memoryview(buf)
+        pos = 0
+        while pos < size:
+            n = self._sock.recv_into(view[pos:])
+            if not n:
+                raise ConnectionError("server closed the connection")
+            pos += n
+        return buf
+
+    def call(self, op, *args):
+        """
+        Send a request and wait for its result.
+        """
+        with self._lock:
+            self._connect()
+            self._rid += 1
+            try:
+                self._sock.sendall(_frame([self._rid, op] + list(args)))
+                (size,) = _FRAME.unpack(self._recv(4))
+                (rid, ok, result), _ = _decode(self._recv(size))
+            except BaseException:
+                # the connection is out of step now
+                self._sock.close()
+                self._sock = None
+                raise
+        if rid != self._rid:
+            raise ServerError("reply to an unexpected request")
+        if ok:
+            return result
+        name, message = result
+        cls = getattr(builtins, name, None)
+        if not (isinstance(cls, type) and issubclass(cls, Exception)):
+            cls = ServerError
+        raise cls(message)
+
+    def ping(self):
+        """
+        Check the server is alive.
+        """
+        self.call('ping')
+
+    def corpora(self):
+        """
+        The served corpora, a dict of their sizes keyed by name.
+        """
+        return dict(self.call('corpora'))
+
+    def distance(self, strings1, strings2):
+        """
+        Levenshtein distances of corresponding strings of two lists, see
+        Levenshtein.paired().
+        """
+        return self.call('distance', list(strings1), list(strings2))
+
+    def ratio(self, strings1, strings2):
+        """
+        Similarity ratios of corresponding strings of two lists, see
+        Levenshtein.paired().
+        """
+        return self.call('ratio', list(strings1), list(strings2))
+
+    def extract(self, corpus, queries, max_k=None, limit=None,
+                scorer='distance'):
+        """
+        Find the best matches of queries in a served corpus.
+
+        Parameters
+        ----------
+        corpus : str
+            The corpus name.
+        queries : list of str
+            The strings to match, of the corpus string type.
+        max_k : int, optional
+            The largest distance of matches, by default the max_k of the
+            server.  Only for the 'distance' scorer.
+        limit : int, optional
+            Return at most limit best matches of each query.
+        scorer : str, optional
+            'distance' (the default) finds the corpus strings within
+            Levenshtein distance max_k as (string, distance, frequency)
+            tuples, see DeleteIndex.lookup(); 'token_sort', 'token_set'
+            or 'token_seq' rank all of them by the token ratio as
+            (string, ratio) tuples, see token_ratio_best().
+
+        Returns
+        -------
+        matches : list of list
+            The matches of each query, best first.
+        """
+        return self.call('extract', corpus, list(queries), max_k, limit,
+                         scorer)
+
+    def median(self, strings, weights=None):
+        """
+        Approximate median string, see Levenshtein.median().
+        """
+        if weights is None:
+            return self.call('median', list(strings))
+        return self.call('median', list(strings), list(weights))
+
+def _read_corpus(filename):
+    with open(filename, encoding='utf-8', errors='surrogateescape') as fh:
+        return [line.rstrip('\r\n') for line in fh]
+
+def main(argv=None):
+    import argparse
+
+    parser = argparse.ArgumentParser(prog="python -m Levenshtein serve",
+                                     description=__doc__.split("\n\n")[0])
+    parser.add_argument("socket", help="Unix domain socket file to serve on")
+    parser.add_argument("--corpus", action="append", default=[],
+                        metavar="NAME=FILE",
+                        help="serve the lines of FILE as corpus NAME")
+    parser.add_argument("--max-k", "-k", type=int, default=2,
+                        help="largest extract distance (default %(default)s)")
+    parser.add_argument("--threads", "-j", type=int, default=0,
+                        help="engine threads (default one per processor)")
+    parser.add_argument("--max-inflight", type=int, default=256,
+                        help="requests computed at once "
+                             "(default %(default)s)")
+    args = parser.parse_args(argv)
+    corpora = {}
+    for spec in args.corpus:
+        name, sep, filename = spec.partition('=')
+        if not sep or not name:
+            parser.error("--corpus must be NAME=FILE")
+        corpora[name] = _read_corpus(filename)
+
+    server = Server(args.socket, corpora, args.max_k, args.threads,
+                    args.max_inflight)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,154 @@
+"""
+Approximate nearest neighbour search using edit distance sketches.
+
+Every string is mapped to a fixed size sketch (a randomized CGK embedding,
+see cgk_sketch()), whose Hamming distance approximates the edit distance.
+A search scans the sketches, which is much faster than computing edit
+distances, and only the best candidates are re-ranked by their exact
+Levenshtein distance.  The search is approximate: a string close to the
+query may be missed when its sketch happens to be far.  Running this
+module prints the recall on random data:
+
+    python -m Levenshtein.sketch [number of strings]
+"""
+
+from Levenshtein._levenshtein import (
+    cgk_sketch,
+    cgk_sketches,
+    sketch_nearest,
+    sketch_rerank
+)
+
+class SketchIndex:
+    """
+    Index of strings for approximate edit distance search.
+
+    Parameters
+    ----------
+    strings : list of str or bytes
+        Strings to index.
+    length : int, optional
+        Length of one embedding, three times the length of the longest
+        string by default (longer strings are only partially represented).
+    repetitions : int, optional
+        Number of independent embeddings in a sketch, more is slower but
+        gives better recall.
+    seed : int, optional
+        Random seed of the embeddings.
+    threads : int, optional
+        Number of threads to use, zero means one per processor.
+    priority : str, optional
+        'interactive' (the default) or 'batch', see Levenshtein.paired().
+    cache : DistanceCache, optional
+        Cache of the exact distances of long strings, shared by searches
+        (and processes) repeating the same queries.
+    """
+
+    def __init__(self, strings, length=None, repetitions=4, seed=0, threads=0,
+                 cache=None, priority='interactive'):
+        self.strings = list(strings)
+        if length is None:
+            length = 3 * max((len(s) for s in self.strings), default=1)
+        self.length = max(length, 1)
+        self.repetitions = repetitions
+        self.seed = seed
+        self.threads = threads
+        self.priority = priority
+        self.cache = cache
+        self.sketches = cgk_sketches(self.strings, self.length,
+                                     repetitions, seed, threads, priority)
+
+    def __len__(self):
+        return len(self.strings)
+
+    def sketch(self, string):
+        """
+        Compute the sketch of a string compatible with the index.
+        """
+        return cgk_sketch(string, self.length, self.repetitions, self.seed)
+
+    def search(self, string, k=10, candidates=None):
+        """
+        Find (approximately) the k strings nearest to a string.
+
+        Parameters
+        ----------
+        string : str or bytes
+            The query string.
+        k : int, optional
+            Number of strings to return.
+        candidates : int, optional
+            Number of strings with the nearest sketches re-ranked by the
+            exact distance, 10 * k by default.
+
+        Returns
+        -------
+        matches : list of (string, distance)
+            At most k strings sorted by their Levenshtein distance.
+        """
+        if candidates is None:
+            candidates = 10 * k
+        nearest = sketch_nearest(self.sketch(string), self.sketches,
+                                 max(candidates, k), self.threads,
+                                 self.priority)
+        ranked = sketch_rerank(string, self.strings, [i for i, d in nearest],
+                               self.cache)
+        return [(self.strings[i], d) for i, d in ranked[:k]]
+
+def benchmark(n=20000, queries=200, k=10, seed=1):
+    """
+    Measure recall@k and speed of SketchIndex search against exact search
+    on random strings with a planted near neighbourhood.
+    """
+    import random
+    import time
+    from Levenshtein import distance
+
+    rnd = random.Random(seed)
+    alphabet = 'abcdefghijklmnopqrstuvwxyz'
+
+    def mutate(s, edits):
+        s = list(s)
+        for _ in range(edits):
+            op = rnd.randrange(3)
+            pos = rnd.randrange(len(s) + 1)
+            if op == 0 or not s:
+                s.insert(pos, rnd.choice(alphabet))
+            elif op == 1:
+                del s[min(pos, len(s) - 1)]
+            else:
+                s[min(pos, len(s) - 1)] = rnd.choice(alphabet)
+        return ''.join(s)
+
+    bases = [''.join(rnd.choice(alphabet) for _ in range(rnd.randint(20, 40)))
+             for _ in range(n // 20)]
+    strings = [mutate(rnd.choice(bases), rnd.randint(0, 8)) for _ in range(n)]
+    qs = [mutate(rnd.choice(bases), rnd.randint(0, 4)) for _ in range(queries)]
+
+    start = time.perf_counter()
+    index = SketchIndex(strings)
+    build = time.perf_counter() - start
+
+    start = time.perf_counter()
+    exact = []
+    for q in qs:
+        dists = sorted(distance(q, s) for s in strings)
+        exact.append(dists[k - 1])
+    texact = (time.perf_counter() - start) / queries
+
+    for candidates in (k, 5 * k, 20 * k, 100 * k):
+        start = time.perf_counter()
+        hits = 0
+        for q, kth in zip(qs, exact):
+            found = index.search(q, k, candidates)
+            hits += sum(1 for s, d in found if d <= kth)
+        tsketch = (time.perf_counter() - start) / queries
+        print("candidates %5d: recall@%d %.3f, %.2f ms/query "
+              "(exact %.2f ms/query)"
+              % (candidates, k, hits / (k * queries), tsketch * 1e3,
+                 texact * 1e3))
+    print("index of %d strings built in %.2f s" % (n, build))
+
+if __name__ == "__main__":
+    import sys
+    benchmark(*[int(x) for x in sys.argv[1:2]])
@@ -0,0 +1,170 @@
+"""
+Tune the engine parameters for this machine.
+
+The C engines have a few parameters (thread work chunk sizes, how often
+the bit-parallel LCS checks its cutoff, ...) whose best values depend on
+the hardware rather than on the data.  Running
+
+    python -m Levenshtein.tune [--output FILE] [--dry-run]
+
+benchmarks each of them on synthetic inputs and writes the fastest values
+to the tuning file, Levenshtein.TUNING_FILE by default, that is loaded at
+import.  Without the file compiled-in defaults are used.  The parameters
+never change results, only speed.
+"""
+
+import os
+import random
+import time
+
+from Levenshtein._levenshtein import (
+    TUNING_FILE,
+    get_tuning,
+    set_tuning,
+    median_improve,
+    cgk_sketches,
+    sketch_nearest,
+    paired,
+    token_ratio_batch,
+    DeleteIndex
+)
+from Levenshtein.matrix import write_matrix
+
+def _random_strings(rnd, n, lo, hi, alphabet='abcdefghijklmnopqrstuvwxyz'):
+    return [''.join(rnd.choice(alphabet) for _ in range(rnd.randint(lo, hi)))
+            for _ in range(n)]
+
+def _kernels(scale, seed=1):
+    """
+    Make the benchmark for each parameter: a list of candidate values and
+    a function running the kernel the parameter affects.
+    """
+    rnd = random.Random(seed)
+    # the cutoff is only checked when there's a finite bound, here the
+    # score_cutoff of paired ratios, which most of the pairs miss
+    long1 = _random_strings(rnd, 2000 * scale, 200, 400, 'abcd')
+    long2 = _random_strings(rnd, 2000 * scale, 200, 400, 'abcd')
+    words = _random_strings(rnd, 5000 * scale, 4, 10)
+    strings = _random_strings(rnd, 20000 * scale, 20, 40)
+    sketches = cgk_sketches(strings, 96, 4)
+    query = sketches[:96 * 4]
+    index = DeleteIndex(words, 1)
+    rows1 = _random_strings(rnd, 100000 * scale, 4, 30)
+    rows2 = _random_strings(rnd, 100000 * scale, 4, 30)
+    phrases = [' '.join(_random_strings(rnd, rnd.randint(2, 6), 2, 8))
+               for _ in range(20000 * scale)]
+    reads = _random_strings(rnd, 12 * scale, 30, 50, 'abcdefgh')
+    columns = _random_strings(rnd, 3000 * scale, 4, 30)
+    scores = bytearray(len(columns) ** 2)
+
+    return {
+        'lcs_cutoff_interval': ([16, 32, 64, 128, 256, 512],
+                                lambda: paired(long1, long2, 'ratio', 1,
+                                               score_cutoff=0.8)),
+        'deleteindex_chunk': ([16, 64, 256, 1024],
+                              lambda: DeleteIndex(words, 1)),
+        'sketch_chunk': ([64, 256, 1024, 4096],
+                         lambda: cgk_sketches(strings, 96, 4)),
+        'nearest_chunk': ([1024, 4096, 16384, 65536],
+                          lambda: sketch_nearest(query, sketches, 10)),
+        'cluster_batch': ([1024, 4096, 16384, 65536],
+                          lambda: index.clusters()),
+        'paired_chunk': ([256, 1024, 4096, 16384],
+                         lambda: paired(rows1, rows2)),
+        'token_chunk': ([64, 256, 1024, 4096],
+                        lambda: token_ratio_batch(phrases[0], phrases)),
+        'improve_cells': ([1 << 14, 1 << 16, 1 << 18, 1 << 20],
+                          lambda: median_improve(reads[0], reads)),
+        'tile_size': ([256, 512, 1024, 2048],
+                      lambda: write_matrix(scores, columns, dtype='B')),
+    }
+
+def _measure(func, repeat):
+    best = None
+    for _ in range(repeat):
+        start = time.perf_counter()
+        func()
+        t = time.perf_counter() - start
+        if best is None or t < best:
+            best = t
+    return best
+
+def tune(repeat=5, scale=1, verbose=True):
+    """
+    Benchmark the candidate values of all tuning parameters.
+
+    Parameters
+    ----------
+    repeat : int, optional
+        Number of runs of each benchmark, the fastest one counts.
+    scale : int, optional
+        Size of the synthetic inputs, relative to the default.
+
+    Returns
+    -------
+    tuning : dict
+        The fastest value of each parameter.  The current parameters are
+        left unchanged.
+    """
+    saved = get_tuning()
+    result = {}
+    try:
+        for name, (candidates, func) in _kernels(scale).items():
+            timings = []
+            for value in candidates:
+                set_tuning(name, value)
+                timings.append((_measure(func, repeat), value))
+            set_tuning(name, saved[name])
+            result[name] = min(timings)[1]
+            if verbose:
+                print("%-20s %8d  (%s)"
+                      % (name, result[name],
+                         ", ".join("%d: %.2f ms" % (v, t * 1e3)
+                                   for t, v in timings)))
+    finally:
+        for name, value in saved.items():
+            set_tuning(name, value)
+    return result
+
+def write_tuning(tuning, filename=None):
+    """
+    Write tuning parameters to the tuning file (TUNING_FILE by default).
+    """
+    if filename is None:
+        filename = TUNING_FILE
+    if filename is None:
+        raise ValueError("no tuning file name, set LEVENSHTEIN_TUNING")
+    directory = os.path.dirname(filename)
+    if directory:
+        os.makedirs(directory, exist_ok=True)
+    with open(filename, 'w') as fh:
+        fh.write("# Levenshtein engine tuning, written by "
+                 "python -m Levenshtein.tune\n")
+        for name, value in sorted(tuning.items()):
+            fh.write("%s = %d\n" % (name, value))
+
+def main(argv=None):
+    import argparse
+
+    parser = argparse.ArgumentParser(prog="python -m Levenshtein.tune",
+                                     description=__doc__.split("\n\n")[0])
+    parser.add_argument("--output", default=TUNING_FILE,
+                        help="tuning file to write (default %(default)s)")
+    parser.add_argument("--repeat", type=int, default=5,
+                        help="runs of each benchmark (default %(default)s)")
+    parser.add_argument("--scale", type=int, default=1,
+                        help="relative benchmark input size")
+    parser.add_argument("--dry-run", action="store_true",
+                        help="only print the results")
+    args = parser.parse_args(argv)
+
+    tuning = tune(args.repeat, args.scale)
+    if args.dry_run:
+        return
+    write_tuning(tuning, args.output)
+    for name, value in tuning.items():
+        set_tuning(name, value)
+    print("written to %s" % args.output)
+
+if __name__ == "__main__":
+    main()
@@ -22,6 +22,10 @@
  **/
 #define lev_wchar Py_UNICODE
 #include <Python.h>
+#ifndef _WIN32
+#  include <unistd.h>
+#  include <fcntl.h>
+#endif
 #include "_levenshtein.h"
 
 #define LEV_UNUSED(x) ((void)x)
@@ -34,11 +38,47 @@
 /* python interface and wrappers */
 /* declarations and docstrings {{{ */
 static PyObject* median_py(PyObject *self, PyObject *args);
-static PyObject* median_improve_py(PyObject *self, PyObject *args);
+static PyObject* median_improve_py(PyObject *self, PyObject *args,
+                                   PyObject *kwargs);
 static PyObject* quickmedian_py(PyObject *self, PyObject *args);
 static PyObject* setmedian_py(PyObject *self, PyObject *args);
 static PyObject* seqratio_py(PyObject *self, PyObject *args);
 static PyObject* setratio_py(PyObject *self, PyObject *args);
+static PyObject* seq_opcodes_py(PyObject *self, PyObject *args);
+static PyObject* iter_opcodes_py(PyObject *self, PyObject *args);
+static PyObject* quick_ratio_py(PyObject *self, PyObject *args);
+static PyObject* real_quick_ratio_py(PyObject *self, PyObject *args);
+static PyObject* quick_ratio_batch_py(PyObject *self, PyObject *args);
+static PyObject* real_quick_ratio_batch_py(PyObject *self, PyObject *args);
+static PyObject* token_sort_ratio_py(PyObject *self, PyObject *args);
+static PyObject* token_set_ratio_py(PyObject *self, PyObject *args);
+static PyObject* token_seqratio_py(PyObject *self, PyObject *args);
+static PyObject* token_ratio_batch_py(PyObject *self, PyObject *args,
+                                      PyObject *kwargs);
+static PyObject* token_ratio_best_py(PyObject *self, PyObject *args,
+                                     PyObject *kwargs);
+static PyObject* cgk_sketch_py(PyObject *self, PyObject *args);
+static PyObject* cgk_sketches_py(PyObject *self, PyObject *args,
+                                 PyObject *kwargs);
+static PyObject* sketch_nearest_py(PyObject *self, PyObject *args,
+                                   PyObject *kwargs);
+static PyObject* sketch_rerank_py(PyObject *self, PyObject *args);
+static PyObject* paired_py(PyObject *self, PyObject *args,
+                           PyObject *kwargs);
+static PyObject* editop_runs_py(PyObject *self, PyObject *args);
+static PyObject* runs_to_editops_py(PyObject *self, PyObject *args);
+static PyObject* runs_to_opcodes_py(PyObject *self, PyObject *args);
+static PyObject* apply_runs_py(PyObject *self, PyObject *args);
+static PyObject* inverse_runs_py(PyObject *self, PyObject *args);
+static PyObject* runs_matching_blocks_py(PyObject *self, PyObject *args);
+static PyObject* subtract_runs_py(PyObject *self, PyObject *args);
+static PyObject* get_tuning_py(PyObject *self, PyObject *args);
+static PyObject* set_tuning_py(PyObject *self, PyObject *args);
+static PyObject* scheduler_stats_py(PyObject *self, PyObject *args);
+static PyObject* graphemes_py(PyObject *self, PyObject *args);
+static PyObject* grapheme_distance_py(PyObject *self, PyObject *args);
+static PyObject* grapheme_ratio_py(PyObject *self, PyObject *args);
+static PyObject* scan_lines_py(PyObject *self, PyObject *args);
 
 #define Levenshtein_DESC \
   "A C extension module for fast computation of:\n" \
@@ -81,16 +121,26 @@ static PyObject* setratio_py(PyObject *self, PyObject *args);
 #define median_improve_DESC \
   "Improve an approximate generalized median string by perturbations.\n" \
   "\n" \
-  "median_improve(string, string_sequence[, weight_sequence])\n" \
+  "median_improve(string, string_sequence[, weight_sequence, passes,\n" \
+  "               threads, priority])\n" \
   "\n" \
   "The first argument is the estimated generalized median string you\n" \
   "want to improve, the others are the same as in median().  It returns\n" \
   "a string with total distance less or equal to that of the given string.\n" \
   "\n" \
   "Note this is much slower than median().  Also note it performs only\n" \
-  "one improvement step, calling median_improve() again on the result\n" \
-  "may improve it further, though this is unlikely to happen unless the\n" \
-  "given string was not very similar to the actual generalized median.\n" \
+  "one improvement step by default, calling median_improve() again on the\n" \
+  "result may improve it further, though this is unlikely to happen unless\n" \
+  "the given string was not very similar to the actual generalized median.\n" \
+  "The optional passes argument makes it take up to that many steps, or\n" \
+  "as many as needed when it's 0, which gives the same result as calling\n" \
+  "it again and again but faster, as the work on the end of the string\n" \
+  "the previous step didn't change is kept.  Weights may be None.\n" \
+  "The perturbations are evaluated in parallel when there's enough work,\n" \
+  "with the same result, on at most the given number of threads (zero,\n" \
+  "the default, means one per processor), started once for the whole\n" \
+  "call.  The priority is 'interactive' (default) or 'batch', see\n" \
+  "token_ratio_batch().\n" \
   "\n" \
   "Examples:\n" \
   "\n" \
@@ -101,6 +151,8 @@ static PyObject* setratio_py(PyObject *self, PyObject *args);
   "'enhtein'\n" \
   ">>> median_improve(median_improve('spam', fixme), fixme)\n" \
   "'Levenshtein'\n" \
+  ">>> median_improve('spam', fixme, None, 0)\n" \
+  "'Levenshtein'\n" \
   "\n" \
   "It takes some work to change spam to Levenshtein.\n"
 
@@ -172,14 +224,424 @@ static PyObject* setratio_py(PyObject *self, PyObject *args);
   "No, even reordering doesn't help the tinny words to match the\n" \
   "woody ones.\n"
 
+#define seq_opcodes_DESC \
+  "Find the alignment of two sequences of strings behind seqratio().\n" \
+  "\n" \
+  "seq_opcodes(string_sequence1, string_sequence2[, score_cutoff])\n" \
+  "\n" \
+  "The result is a list of opcodes like the ones of opcodes(), but the\n" \
+  "positions are indices of the sequence items.  Identical items are\n" \
+  "'equal', other aligned items are 'replace'd.  Memory use is linear\n" \
+  "in the sequence lengths.\n" \
+  "\n" \
+  "When score_cutoff is given and seqratio() would be smaller, None\n" \
+  "is returned, usually faster than the full alignment.\n" \
+  "\n" \
+  "Examples:\n" \
+  "\n" \
+  ">>> seq_opcodes(['the', 'quick', 'brown', 'fox'],\n" \
+  "...             ['the', 'quack', 'fox', 'jumps'])\n" \
+  "[('equal', 0, 1, 0, 1), ('replace', 1, 2, 1, 2), ('delete', 2, 3, 2, 2), " \
+  "('equal', 3, 4, 2, 3), ('insert', 4, 4, 3, 4)]\n"
+
+#define iter_opcodes_DESC \
+  "Iterate over the opcodes() of two strings as they are found.\n" \
+  "\n" \
+  "iter_opcodes(string1, string2)\n" \
+  "\n" \
+  "The opcodes are exactly the ones opcodes() returns, but the iterator\n" \
+  "resolves the alignment in blocks, from left to right, so the first\n" \
+  "ones come before the rest is known and the cost matrix is never kept\n" \
+  "whole: memory grows with the square root of its size.  The first\n" \
+  "opcode takes about two distance computations (the common prefix is\n" \
+  "immediate), all of them about three.  The strings must not change\n" \
+  "during the iteration.\n" \
+  "\n" \
+  "Examples:\n" \
+  "\n" \
+  ">>> list(iter_opcodes('spam', 'park'))\n" \
+  "[('delete', 0, 1, 0, 0), ('equal', 1, 3, 0, 2), ('insert', 3, 3, 2, 3), " \
+  "('replace', 3, 4, 3, 4)]\n"
+
+#define quick_ratio_DESC \
+  "Compute an upper bound of ratio() of two strings, fast.\n" \
+  "\n" \
+  "quick_ratio(string1, string2)\n" \
+  "\n" \
+  "Like difflib's quick_ratio(), it counts the characters the strings\n" \
+  "have in common regardless of their order.  It is never smaller than\n" \
+  "ratio(), so it can be used to skip expensive comparisons.\n" \
+  "\n" \
+  "Examples:\n" \
+  "\n" \
+  ">>> quick_ratio('Brian', 'Jesus')\n" \
+  "0.0\n" \
+  ">>> quick_ratio('Thorkel', 'Thorgier')\n" \
+  "0.6666666666666666\n"
+
+#define real_quick_ratio_DESC \
+  "Compute an upper bound of ratio() of two strings, very fast.\n" \
+  "\n" \
+  "real_quick_ratio(string1, string2)\n" \
+  "\n" \
+  "Like difflib's real_quick_ratio(), it's computed from the string\n" \
+  "lengths only.  It is never smaller than quick_ratio().\n" \
+  "\n" \
+  "Examples:\n" \
+  "\n" \
+  ">>> real_quick_ratio('Brian', 'Jesus')\n" \
+  "1.0\n"
+
+#define quick_ratio_batch_DESC \
+  "Compute quick_ratio() of a string and each string of a sequence.\n" \
+  "\n" \
+  "quick_ratio_batch(string, string_sequence)\n" \
+  "\n" \
+  "Returns a list of the ratios, the character histogram of the first\n" \
+  "string is made only once.\n"
+
+#define real_quick_ratio_batch_DESC \
+  "Compute real_quick_ratio() of a string and each string of a sequence.\n" \
+  "\n" \
+  "real_quick_ratio_batch(string, string_sequence)\n" \
+  "\n" \
+  "Returns a list of the ratios.\n"
+
+#define token_sort_ratio_DESC \
+  "Compute ratio() of two strings with their tokens sorted.\n" \
+  "\n" \
+  "token_sort_ratio(string1, string2)\n" \
+  "\n" \
+  "Tokens are separated by whitespace as by str.split() (bytes.split()\n" \
+  "for byte strings).  The result is the ratio of the tokens sorted and\n" \
+  "joined by single spaces, so word order doesn't matter.  It's all done\n" \
+  "in C, without making Python strings.\n" \
+  "\n" \
+  "Examples:\n" \
+  "\n" \
+  ">>> token_sort_ratio('new york mets', 'mets new york')\n" \
+  "1.0\n"
+
+#define token_set_ratio_DESC \
+  "Compute setratio() of the distinct tokens of two strings.\n" \
+  "\n" \
+  "token_set_ratio(string1, string2)\n" \
+  "\n" \
+  "It's the same as setratio(sorted(set(string1.split())),\n" \
+  "sorted(set(string2.split()))), so repeated tokens don't count.\n" \
+  "\n" \
+  "Examples:\n" \
+  "\n" \
+  ">>> token_set_ratio('new york new york', 'york new')\n" \
+  "1.0\n"
+
+#define token_seqratio_DESC \
+  "Compute seqratio() of the tokens of two strings.\n" \
+  "\n" \
+  "token_seqratio(string1, string2)\n" \
+  "\n" \
+  "It's the same as seqratio(string1.split(), string2.split()).\n"
+
+#define token_ratio_batch_DESC \
+  "Compute a token similarity of a string and each string of a sequence.\n" \
+  "\n" \
+  "token_ratio_batch(string, string_sequence[, scorer, threads,\n" \
+  "                  score_cutoff, priority])\n" \
+  "\n" \
+  "The scorer is 'sort' (default), 'set' or 'seq' for token_sort_ratio(),\n" \
+  "token_set_ratio() or token_seqratio().  The first string is tokenized\n" \
+  "(and for 'sort' turned to a bit-parallel pattern) only once, the\n" \
+  "others are compared in parallel on the given number of threads (zero\n" \
+  "means one per processor).  Returns a list of the ratios, those\n" \
+  "smaller than score_cutoff are 0.\n" \
+  "\n" \
+  "The priority is 'interactive' (default) or 'batch'.  Batch calls\n" \
+  "yield their threads to interactive ones, see scheduler_stats().\n"
+
+#define token_ratio_best_DESC \
+  "Find the strings of a sequence most similar to a string by tokens.\n" \
+  "\n" \
+  "token_ratio_best(string, string_sequence, count[, scorer, threads,\n" \
+  "                 score_cutoff, priority])\n" \
+  "\n" \
+  "Like token_ratio_batch(), but returns a list of at most count\n" \
+  "(index, ratio) tuples sorted by decreasing ratio, without the strings\n" \
+  "whose ratio is smaller than score_cutoff.\n" \
+  "\n" \
+  "Examples:\n" \
+  "\n" \
+  ">>> token_ratio_best('york new', ['new jersey', 'new york', 'york'], 2)\n" \
+  "[(1, 1.0), (2, 0.6666666666666666)]\n"
+
+#define cgk_sketch_DESC \
+  "Compute an edit distance sketch of a string.\n" \
+  "\n" \
+  "cgk_sketch(string, length[, repetitions, seed])\n" \
+  "\n" \
+  "The sketch is a randomized (CGK) embedding of the string into bytes\n" \
+  "such that the Hamming distance of two sketches approximates the edit\n" \
+  "distance of the strings.  It consists of repetitions independent\n" \
+  "embeddings of given length each, the length should be about three\n" \
+  "times the typical string length.  Only sketches made with the same\n" \
+  "length, repetitions and seed (and of the same string type) are\n" \
+  "comparable.\n" \
+  "\n" \
+  "See Levenshtein.sketch for a more convenient interface.\n"
+
+#define cgk_sketches_DESC \
+  "Compute edit distance sketches of many strings.\n" \
+  "\n" \
+  "cgk_sketches(string_sequence, length[, repetitions, seed, threads,\n" \
+  "             priority])\n" \
+  "\n" \
+  "Returns all sketches (see cgk_sketch()) concatenated in one bytes\n" \
+  "object.  Zero threads means one per processor.  The priority is\n" \
+  "'interactive' (default) or 'batch', see token_ratio_batch().\n"
+
+#define sketch_nearest_DESC \
+  "Find the sketches nearest to a sketch in Hamming distance.\n" \
+  "\n" \
+  "sketch_nearest(sketch, sketches, count[, threads, priority])\n" \
+  "\n" \
+  "The sketches are concatenated, as returned by cgk_sketches(), any\n" \
+  "buffer works.  Returns a list of at most count (index, distance)\n" \
+  "tuples sorted by the distance.  The priority is as in\n" \
+  "token_ratio_batch().\n"
+
+#define sketch_rerank_DESC \
+  "Sort candidate strings by their exact Levenshtein distance.\n" \
+  "\n" \
+  "sketch_rerank(string, string_sequence, indices[, cache])\n" \
+  "\n" \
+  "Returns a list of (index, distance) tuples for the given indices\n" \
+  "into string_sequence, sorted by the distance from string.  The\n" \
+  "distances of long strings are looked up in the DistanceCache cache\n" \
+  "first, if given.\n"
+
+#define paired_DESC \
+  "Score the strings of two columns row by row.\n" \
+  "\n" \
+  "paired(strings1, strings2[, scorer, threads, score_cutoff, cache,\n" \
+  "       priority])\n" \
+  "\n" \
+  "Computes the scorer ('distance', 'ratio' or 'hamming') of strings1[i]\n" \
+  "and strings2[i] for each i, in parallel on the given number of\n" \
+  "threads (zero means one per processor).  A column is a sequence of\n" \
+  "strings or an (offsets, data[, encoding]) tuple, where string i is\n" \
+  "data[offsets[i]:offsets[i+1]], the offsets being a buffer of 32 or 64\n" \
+  "bit integers (like in an Arrow string array) and the encoding None\n" \
+  "for bytes or 'utf-8' for text.\n" \
+  "\n" \
+  "Returns an array.array of the scores, integers for distances, floats\n" \
+  "for ratios.  Distances larger than score_cutoff are returned as\n" \
+  "score_cutoff + 1, ratios smaller than score_cutoff as 0.  The\n" \
+  "distances of long strings are looked up in the DistanceCache cache\n" \
+  "first, if given.  The priority is as in token_ratio_batch().\n" \
+  "\n" \
+  "See Levenshtein.paired for a more convenient interface.\n"
+
+#define editop_runs_DESC \
+  "Find edit operations transforming one string to another, as runs.\n" \
+  "\n" \
+  "editop_runs(source_string, destination_string)\n" \
+  "editop_runs(edit_operations, source_length, destination_length)\n" \
+  "\n" \
+  "The result is a list of quadruples (operation, spos, dpos, count),\n" \
+  "each standing for count consecutive editops() of the same operation\n" \
+  "starting at spos, dpos.  Replace runs advance in both strings, insert\n" \
+  "runs only in the destination and delete runs only in the source.\n" \
+  "So a long inserted or deleted block is a single run instead of one\n" \
+  "triple per character.\n" \
+  "\n" \
+  "Examples:\n" \
+  "\n" \
+  ">>> editop_runs('spam', 'park')\n" \
+  "[('delete', 0, 0, 1), ('insert', 3, 2, 1), ('replace', 3, 3, 1)]\n" \
+  ">>> editop_runs('abc', 'abcxyz')\n" \
+  "[('insert', 3, 3, 3)]\n" \
+  "\n" \
+  "The alternate form converts editops, opcodes or runs (you can pass\n" \
+  "strings or their lengths, it doesn't matter).  Opcodes are converted\n" \
+  "block by block, without expanding them to editops.\n"
+
+#define runs_to_editops_DESC \
+  "Expand edit runs to edit operations.\n" \
+  "\n" \
+  "runs_to_editops(edit_runs, source_string, destination_string)\n" \
+  "\n" \
+  "The result is the list of editops() triples the runs stand for.\n"
+
+#define runs_to_opcodes_DESC \
+  "Convert edit runs to difflib-like opcodes.\n" \
+  "\n" \
+  "runs_to_opcodes(edit_runs, source_string, destination_string)\n" \
+  "\n" \
+  "The result is the same as opcodes() of the expanded runs.\n"
+
+#define apply_runs_DESC \
+  "Apply a sequence of edit runs to a string.\n" \
+  "\n" \
+  "apply_runs(edit_runs, source_string, destination_string)\n" \
+  "\n" \
+  "Like apply_edit(), the runs can be any ordered subset of the runs\n" \
+  "transforming source_string to destination_string.  Blocks are copied\n" \
+  "at once.\n" \
+  "\n" \
+  "Examples:\n" \
+  "\n" \
+  ">>> r = editop_runs('man', 'scotsman')\n" \
+  ">>> r\n" \
+  "[('insert', 0, 0, 5)]\n" \
+  ">>> apply_runs(r, 'man', 'scotsman')\n" \
+  "'scotsman'\n"
+
+#define inverse_runs_DESC \
+  "Invert the sense of edit runs.\n" \
+  "\n" \
+  "inverse_runs(edit_runs)\n" \
+  "\n" \
+  "Returns runs transforming the destination string to the source\n" \
+  "string, like inverse() does for editops.\n"
+
+#define runs_matching_blocks_DESC \
+  "Find identical blocks in two strings from edit runs.\n" \
+  "\n" \
+  "runs_matching_blocks(edit_runs, source_string, destination_string)\n" \
+  "\n" \
+  "The result is the same as matching_blocks() of the expanded runs.\n"
+
+#define subtract_runs_DESC \
+  "Subtract an edit run subsequence from a sequence.\n" \
+  "\n" \
+  "subtract_runs(edit_runs, subsequence)\n" \
+  "\n" \
+  "Like subtract_edit(), but the subsequence is also given as runs, it\n" \
+  "can also contain parts of the runs.  The result is the same as\n" \
+  "subtract_edit() of the expanded runs.\n" \
+  "\n" \
+  "Examples:\n" \
+  "\n" \
+  ">>> r = editop_runs('man', 'scotsman')\n" \
+  ">>> subtract_runs(r, [('insert', 0, 0, 3)])\n" \
+  "[('insert', 3, 3, 2)]\n"
+
+#define get_tuning_DESC \
+  "Get the engine tuning parameters.\n" \
+  "\n" \
+  "get_tuning()\n" \
+  "\n" \
+  "Returns a dictionary of the current parameter values.  They are\n" \
+  "loaded from TUNING_FILE at import if it exists, see Levenshtein.tune.\n"
+
+#define set_tuning_DESC \
+  "Set an engine tuning parameter.\n" \
+  "\n" \
+  "set_tuning(name, value)\n" \
+  "\n" \
+  "The value must be positive.  Parameters only affect speed, never\n" \
+  "results.  Do not change them while other threads compute.\n"
+
+#define scheduler_stats_DESC \
+  "Get the statistics of the parallel engines per priority class.\n" \
+  "\n" \
+  "scheduler_stats()\n" \
+  "\n" \
+  "Returns a dictionary mapping 'interactive' and 'batch' to dictionaries\n" \
+  "of the parallel calls made (calls), running now (running), worker\n" \
+  "threads paused now (waiting), pauses so far (pauses) and the total\n" \
+  "and longest pause in seconds (wait, max_wait).  Batch workers pause\n" \
+  "between work chunks while any interactive call runs, so interactive\n" \
+  "latency doesn't suffer from background batches.\n"
+
+#define graphemes_DESC \
+  "Split a string to extended grapheme clusters.\n" \
+  "\n" \
+  "graphemes(string)\n" \
+  "\n" \
+  "Returns a list of the clusters (UAX #29, Unicode 16.0): user perceived\n" \
+  "characters like a letter with its combining marks, an emoji sequence\n" \
+  "or a flag.  They are the symbols of the unit='grapheme' comparisons.\n" \
+  "\n" \
+  "Examples:\n" \
+  "\n" \
+  ">>> len('Cafe\\u0301'), len(graphemes('Cafe\\u0301'))\n" \
+  "(5, 4)\n"
+
+#define grapheme_distance_DESC \
+  "Compute the Levenshtein distance of two strings in grapheme clusters.\n" \
+  "\n" \
+  "grapheme_distance(string1, string2)\n" \
+  "\n" \
+  "Same as distance(string1, string2, unit='grapheme').\n"
+
+#define grapheme_ratio_DESC \
+  "Compute the similarity of two strings in grapheme clusters.\n" \
+  "\n" \
+  "grapheme_ratio(string1, string2)\n" \
+  "\n" \
+  "Same as ratio(string1, string2, unit='grapheme').\n"
+
+#define scan_lines_DESC \
+  "Split a UTF-8 text to distinct normalized lines.\n" \
+  "\n" \
+  "scan_lines(buffer)\n" \
+  "\n" \
+  "The lines of the text (a bytes-like object, e.g. a memory mapped file)\n" \
+  "are normalized like ' '.join(line.split()) of their text, decoded with\n" \
+  "errors='surrogateescape', and identical ones are collapsed.\n" \
+  "\n" \
+  "Returns a tuple (lines, counts, first, offsets, keys): the distinct\n" \
+  "lines in the order of their first lines, the number of lines, the\n" \
+  "number of the first line and its offset in the buffer of each of them,\n" \
+  "and the distinct line of each line.  All but lines are bytes of 64 bit\n" \
+  "integers, for array('q').\n" \
+  "\n" \
+  "Examples:\n" \
+  "\n" \
+  ">>> scan_lines(b'spam  eggs\\n spam eggs\\r\\nham')[0]\n" \
+  "['spam eggs', 'ham']\n"
+
 #define METHODS_ITEM(x) { #x, x##_py, METH_VARARGS, x##_DESC }
+#define METHODS_KWITEM(x) \
+  { #x, (PyCFunction)(void(*)(void))x##_py, METH_VARARGS | METH_KEYWORDS, \
+    x##_DESC }
 static PyMethodDef methods[] = {
   METHODS_ITEM(median),
-  METHODS_ITEM(median_improve),
+  METHODS_KWITEM(median_improve),
   METHODS_ITEM(quickmedian),
   METHODS_ITEM(setmedian),
   METHODS_ITEM(seqratio),
   METHODS_ITEM(setratio),
+  METHODS_ITEM(seq_opcodes),
+  METHODS_ITEM(iter_opcodes),
+  METHODS_ITEM(quick_ratio),
+  METHODS_ITEM(real_quick_ratio),
+  METHODS_ITEM(quick_ratio_batch),
+  METHODS_ITEM(real_quick_ratio_batch),
+  METHODS_ITEM(token_sort_ratio),
+  METHODS_ITEM(token_set_ratio),
+  METHODS_ITEM(token_seqratio),
+  METHODS_KWITEM(token_ratio_batch),
+  METHODS_KWITEM(token_ratio_best),
+  METHODS_ITEM(cgk_sketch),
+  METHODS_KWITEM(cgk_sketches),
+  METHODS_KWITEM(sketch_nearest),
+  METHODS_ITEM(sketch_rerank),
+  METHODS_KWITEM(paired),
+  METHODS_ITEM(editop_runs),
+  METHODS_ITEM(runs_to_editops),
+  METHODS_ITEM(runs_to_opcodes),
+  METHODS_ITEM(apply_runs),
+  METHODS_ITEM(inverse_runs),
+  METHODS_ITEM(runs_matching_blocks),
+  METHODS_ITEM(subtract_runs),
+  METHODS_ITEM(get_tuning),
+  METHODS_ITEM(set_tuning),
+  METHODS_ITEM(scheduler_stats),
+  METHODS_ITEM(graphemes),
+  METHODS_ITEM(grapheme_distance),
+  METHODS_ITEM(grapheme_ratio),
+  METHODS_ITEM(scan_lines),
   { NULL, NULL, 0, NULL },
 };
 
@@ -203,12 +665,16 @@ typedef lev_byte *(*MedianImproveFuncString)(size_t len, const lev_byte *s,
                                              const size_t *lengths,
                                              const lev_byte *strings[],
                                              const double *weights,
+                                             size_t maxpasses,
+                                             size_t nthreads,
                                              size_t *medlength);
 typedef Py_UNICODE *(*MedianImproveFuncUnicode)(size_t len, const Py_UNICODE *s,
                                                 size_t n,
                                                 const size_t *lengths,
                                                 const Py_UNICODE *strings[],
                                                 const double *weights,
+                                                size_t maxpasses,
+                                                size_t nthreads,
                                                 size_t *medlength);
 typedef struct {
   MedianImproveFuncString s;
@@ -233,12 +699,26 @@ typedef struct {
   SetSeqFuncUnicode u;
 } SetSeqFuncs;
 
+/* a list of string arguments, see extract_strings() */
+typedef struct {
+  size_t n;
+  size_t *sizes;
+  void *strings;
+  PyObject *pinned;  /* what the strings point into */
+} StringList;
+
 static int
-extract_stringlist(PyObject *list,
-                   const char *name,
-                   size_t n,
-                   size_t **sizelist,
-                   void *strlist);
+get_string(PyObject *obj, const char *name, PyObject *pinned,
+           size_t *len, const void **str);
+
+static int
+extract_strings(PyObject *obj, const char *name, StringList *sl);
+
+static void
+release_strings(StringList *sl);
+
+static int
+get_priority(const char *priorityname, const char *name, LevPriority *priority);
 
 static double*
 extract_weightlist(PyObject *wlist,
@@ -252,6 +732,7 @@ median_common(PyObject *args,
 
 static PyObject*
 median_improve_common(PyObject *args,
+                      PyObject *kwargs,
                       const char *name,
                       MedianImproveFuncs foo);
 
@@ -261,6 +742,9 @@ setseq_common(PyObject *args,
               SetSeqFuncs foo,
               size_t *lensum);
 
+static PyObject*
+opcodes_to_tuple_list(size_t nb, const LevOpCode *bops);
+
 /* }}} */
 
 /****************************************************************************
@@ -279,11 +763,11 @@ median_py(PyObject *self, PyObject *args)
 }
 
 static PyObject*
-median_improve_py(PyObject *self, PyObject *args)
+median_improve_py(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-  MedianImproveFuncs engines = { lev_median_improve, lev_u_median_improve };
+  MedianImproveFuncs engines = { lev_median_refine, lev_u_median_refine };
   LEV_UNUSED(self);
-  return median_improve_common(args, "median_improve", engines);
+  return median_improve_common(args, kwargs, "median_improve", engines);
 }
 
 static PyObject*
@@ -305,14 +789,14 @@ setmedian_py(PyObject *self, PyObject *args)
 static PyObject*
 median_common(PyObject *args, const char *name, MedianFuncs foo)
 {
-  size_t n, len;
-  void *strings = NULL;
-  size_t *sizes = NULL;
+  size_t len;
+  StringList sl;
   PyObject *strlist = NULL;
   PyObject *wlist = NULL;
-  PyObject *strseq = NULL;
   double *weights;
+  void *medstr;
   int stringtype;
+  LevPriority priority;
   PyObject *result = NULL;
 
   if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 1, 2, &strlist, &wlist))
@@ -323,140 +807,148 @@ median_common(PyObject *args, const char *name, MedianFuncs foo)
                  "%s first argument must be a Sequence", name);
     return NULL;
   }
-  strseq = PySequence_Fast(strlist, name);
-
-  n = (size_t)PySequence_Fast_GET_SIZE(strseq);
-  if (n == 0) {
+  stringtype = extract_strings(strlist, name, &sl);
+  if (stringtype < 0) {
+    release_strings(&sl);
+    return NULL;
+  }
+  if (sl.n == 0) {
+    release_strings(&sl);
     Py_INCREF(Py_None);
-    Py_DECREF(strseq);
     return Py_None;
   }
 
   /* get (optional) weights, use 1 if none specified. */
-  weights = extract_weightlist(wlist, name, n);
+  weights = extract_weightlist(wlist, name, sl.n);
   if (!weights) {
-    Py_DECREF(strseq);
+    release_strings(&sl);
     return NULL;
   }
 
-  stringtype = extract_stringlist(strseq, name, n, &sizes, &strings);
-  Py_DECREF(strseq);
-  if (stringtype < 0) {
-    free(weights);
-    return NULL;
-  }
-
-  if (stringtype == 0) {
-    lev_byte *medstr = foo.s(n, sizes, (const lev_byte**)strings, weights, &len);
-    if (!medstr && len)
-      result = PyErr_NoMemory();
-    else {
+  Py_BEGIN_ALLOW_THREADS
+  priority = lev_sched_begin();
+  if (stringtype == 0)
+    medstr = foo.s(sl.n, sl.sizes, (const lev_byte**)sl.strings,
+                   weights, &len);
+  else
+    medstr = foo.u(sl.n, sl.sizes, (const Py_UNICODE**)sl.strings,
+                   weights, &len);
+  lev_sched_end(priority);
+  Py_END_ALLOW_THREADS
+  if (!medstr && len)
+    result = PyErr_NoMemory();
+  else {
+    if (stringtype == 0)
       result = PyBytes_FromStringAndSize((const char*)medstr, (Py_ssize_t)len);
-      free(medstr);
-    }
-  }
-  else if (stringtype == 1) {
-    Py_UNICODE *medstr = foo.u(n, sizes, (const Py_UNICODE**)strings, weights, &len);
-    if (!medstr && len)
-      result = PyErr_NoMemory();
-    else {
-      result = PyUnicode_FromUnicode(medstr, (Py_ssize_t)len);
-      free(medstr);
-    }
+    else
+      result = PyUnicode_FromUnicode((Py_UNICODE*)medstr, (Py_ssize_t)len);
+    free(medstr);
   }
-  else
-    PyErr_Format(PyExc_SystemError, "%s internal error", name);
 
-  free(strings);
+  release_strings(&sl);
   free(weights);
-  free(sizes);
   return result;
 }
 
 static PyObject*
-median_improve_common(PyObject *args, const char *name, MedianImproveFuncs foo)
+median_improve_common(PyObject *args, PyObject *kwargs, const char *name,
+                      MedianImproveFuncs foo)
 {
-  size_t n, len;
-  void *strings = NULL;
-  size_t *sizes = NULL;
+  static char *kwlist[] = { "string", "string_sequence", "weight_sequence",
+                            "passes", "threads", "priority", NULL };
+  size_t len, l;
+  const void *s;
+  void *medstr;
+  StringList sl;
   PyObject *arg1 = NULL;
   PyObject *strlist = NULL;
   PyObject *wlist = NULL;
-  PyObject *strseq = NULL;
+  Py_ssize_t passes = 1, nthreads = 0;
+  const char *priorityname = NULL;
+  LevPriority priority, oldpriority;
   double *weights;
-  int stringtype;
+  int stringtype, listtype;
   PyObject *result = NULL;
 
-  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 2, 3, &arg1, &strlist, &wlist))
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|Onnz:median_improve",
+                                   kwlist, &arg1, &strlist, &wlist, &passes,
+                                   &nthreads, &priorityname))
     return NULL;
-
-  if (PyObject_TypeCheck(arg1, &PyBytes_Type))
-    stringtype = 0;
-  else if (PyObject_TypeCheck(arg1, &PyUnicode_Type))
-    stringtype = 1;
-  else {
-    PyErr_Format(PyExc_TypeError,
-                 "%s first argument must be a String or Unicode", name);
+  if (wlist == Py_None)
+    wlist = NULL;
+  if (passes < 0) {
+    PyErr_Format(PyExc_ValueError,
+                 "%s passes must be nonnegative", name);
     return NULL;
   }
+  if (nthreads < 0) {
+    PyErr_Format(PyExc_ValueError, "%s threads must not be negative", name);
+    return NULL;
+  }
+  if (get_priority(priorityname, name, &priority) < 0)
+    return NULL;
 
   if (!PySequence_Check(strlist)) {
     PyErr_Format(PyExc_TypeError,
                  "%s second argument must be a Sequence", name);
     return NULL;
   }
-  strseq = PySequence_Fast(strlist, name);
-
-  n = (size_t)PySequence_Fast_GET_SIZE(strseq);
-  if (n == 0) {
+  listtype = extract_strings(strlist, name, &sl);
+  if (listtype < 0) {
+    release_strings(&sl);
+    return NULL;
+  }
+  stringtype = get_string(arg1, name, sl.pinned, &l, &s);
+  if (stringtype < 0) {
+    if (stringtype == -2)
+      PyErr_Format(PyExc_TypeError,
+                   "%s first argument must be a String or Unicode", name);
+    release_strings(&sl);
+    return NULL;
+  }
+  if (sl.n == 0) {
+    release_strings(&sl);
     Py_INCREF(Py_None);
-    Py_DECREF(strseq);
     return Py_None;
   }
-
-  /* get (optional) weights, use 1 if none specified. */
-  weights = extract_weightlist(wlist, name, n);
-  if (!weights) {
-    Py_DECREF(strseq);
+  if (listtype != stringtype) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s argument types don't match", name);
+    release_strings(&sl);
     return NULL;
   }
 
-  if (extract_stringlist(strseq, name, n, &sizes, &strings) != stringtype) {
-    PyErr_Format(PyExc_TypeError,
-                 "%s argument types don't match", name);
-    free(weights);
+  /* get (optional) weights, use 1 if none specified. */
+  weights = extract_weightlist(wlist, name, sl.n);
+  if (!weights) {
+    release_strings(&sl);
     return NULL;
   }
 
-  Py_DECREF(strseq);
-  if (stringtype == 0) {
-    lev_byte *s = (lev_byte*)PyBytes_AS_STRING(arg1);
-    size_t l = (size_t)PyBytes_GET_SIZE(arg1);
-    lev_byte *medstr = foo.s(l, s, n, sizes, (const lev_byte**)strings, weights, &len);
-    if (!medstr && len)
-      result = PyErr_NoMemory();
-    else {
+  Py_BEGIN_ALLOW_THREADS
+  oldpriority = lev_priority_set(priority);
+  if (stringtype == 0)
+    medstr = foo.s(l, (const lev_byte*)s, sl.n, sl.sizes,
+                   (const lev_byte**)sl.strings, weights,
+                   (size_t)passes, (size_t)nthreads, &len);
+  else
+    medstr = foo.u(l, (const Py_UNICODE*)s, sl.n, sl.sizes,
+                   (const Py_UNICODE**)sl.strings, weights,
+                   (size_t)passes, (size_t)nthreads, &len);
+  lev_priority_set(oldpriority);
+  Py_END_ALLOW_THREADS
+  if (!medstr && len)
+    result = PyErr_NoMemory();
+  else {
+    if (stringtype == 0)
       result = PyBytes_FromStringAndSize((const char*)medstr, (Py_ssize_t)len);
-      free(medstr);
-    }
-  }
-  else if (stringtype == 1) {
-    Py_UNICODE *s = PyUnicode_AS_UNICODE(arg1);
-    size_t l = (size_t)PyUnicode_GET_SIZE(arg1);
-    Py_UNICODE *medstr = foo.u(l, s, n, sizes, (const Py_UNICODE**)strings, weights, &len);
-    if (!medstr && len)
-      result = PyErr_NoMemory();
-    else {
-      result = PyUnicode_FromUnicode(medstr, (Py_ssize_t)len);
-      free(medstr);
-    }
+    else
+      result = PyUnicode_FromUnicode((Py_UNICODE*)medstr, (Py_ssize_t)len);
+    free(medstr);
   }
-  else
-    PyErr_Format(PyExc_SystemError, "%s internal error", name);
 
-  free(strings);
+  release_strings(&sl);
   free(weights);
-  free(sizes);
   return result;
 }
 
@@ -474,18 +966,22 @@ extract_weightlist(PyObject *wlist, const char *name, size_t n)
       return NULL;
     }
     seq = PySequence_Fast(wlist, name);
-    if ((size_t)PySequence_Fast_GET_SIZE(wlist) != n) {
+    if (!seq)
+      return NULL;
+    if ((size_t)PySequence_Fast_GET_SIZE(seq) != n) {
       PyErr_Format(PyExc_ValueError,
                    "%s got %i strings but %i weights",
-                   name, n, PyList_GET_SIZE(wlist));
+                   name, n, PySequence_Fast_GET_SIZE(seq));
       Py_DECREF(seq);
       return NULL;
     }
     weights = (double*)safe_malloc(n, sizeof(double));
-    if (!weights)
+    if (!weights) {
+      Py_DECREF(seq);
       return (double*)PyErr_NoMemory();
+    }
     for (i = 0; i < n; i++) {
-      PyObject *item = PySequence_Fast_GET_ITEM(wlist, i);
+      PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
       PyObject *number = PyNumber_Float(item);
 
       if (!number) {
@@ -518,108 +1014,330 @@ extract_weightlist(PyObject *wlist, const char *name, size_t n)
   return weights;
 }
 
-/* extract a list of strings or unicode strings, returns
- * 0 -- strings
- * 1 -- unicode strings
- * <0 -- failure
- */
+/* the struct format of the items of @view past a byte order prefix, NULL
+ * when the byte order isn't native */
+static const char*
+buffer_format(const Py_buffer *view)
+{
+  const char *f = view->format ? view->format : "B";
+
+  if (*f == '@' || *f == '=')
+    return f + 1;
+  if (*f == '<')
+    return PY_LITTLE_ENDIAN ? f + 1 : NULL;
+  if (*f == '>' || *f == '!')
+    return PY_LITTLE_ENDIAN ? NULL : f + 1;
+  return f;
+}
+
+/* whether buffer items of @format and @itemsize are characters */
 static int
-extract_stringlist(PyObject *list, const char *name,
-                   size_t n, size_t **sizelist, void *strlist)
+is_char_format(const char *format, Py_ssize_t itemsize)
 {
+  return format && format[0] && !format[1]
+         && strchr("bBchHiIlLuw", format[0])
+         && (itemsize == 1 || itemsize == 2 || itemsize == 4);
+}
+
+/* point @str at @nchars characters of @size bytes at @buf, returns the
+ * string type like get_string(); characters narrower than Py_UNICODE are
+ * widened to a copy pinned by @pinned */
+static int
+buffer_chars(const void *buf, size_t nchars, size_t size, const char *name,
+             PyObject *pinned, const void **str)
+{
+  PyObject *copy;
+  Py_UNICODE *u;
   size_t i;
-  PyObject *first;
-
-  /* check first object type.  when it's a string then all others must be
-   * strings too; when it's a unicode string then all others must be unicode
-   * strings too. */
-  first = PySequence_Fast_GET_ITEM(list, 0);
-  /* i don't exactly understand why the problem doesn't exhibit itself earlier
-   * but a queer error message is better than a segfault :o) */
-  if (first == (PyObject*)-1) {
+
+  if (size == 1 || size == sizeof(Py_UNICODE)) {
+    *str = buf;
+    return size != 1;
+  }
+  if (size > sizeof(Py_UNICODE)) {
     PyErr_Format(PyExc_TypeError,
-                 "%s undecomposable Sequence???", name);
+                 "%s %zu byte characters are not supported", name, size);
     return -1;
   }
+  if (nchars > (size_t)PY_SSIZE_T_MAX/sizeof(Py_UNICODE) - 1) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  copy = PyBytes_FromStringAndSize(NULL,
+                                   (Py_ssize_t)((nchars + 1)*sizeof(Py_UNICODE)));
+  if (!copy)
+    return -1;
+  if (PyList_Append(pinned, copy) < 0) {
+    Py_DECREF(copy);
+    return -1;
+  }
+  Py_DECREF(copy);
+  u = (Py_UNICODE*)PyBytes_AS_STRING(copy);
+  for (i = 0; i < nchars; i++)
+    u[i] = (Py_UNICODE)((const uint16_t*)buf)[i];
+  *str = u;
+  return 1;
+}
 
-  if (PyObject_TypeCheck(first, &PyBytes_Type)) {
-    lev_byte **strings;
-    size_t *sizes;
-
-    strings = (lev_byte**)safe_malloc(n, sizeof(lev_byte*));
-    if (!strings) {
-      PyErr_Format(PyExc_MemoryError,
-                   "%s cannot allocate memory", name);
-      return -1;
-    }
-    sizes = (size_t*)safe_malloc(n, sizeof(size_t));
-    if (!sizes) {
-      free(strings);
-      PyErr_Format(PyExc_MemoryError,
-                   "%s cannot allocate memory", name);
-      return -1;
-    }
+/* get a string argument: bytes, str, or a contiguous buffer of 1 byte
+ * characters (a string) or 2 or 4 byte characters (a unicode string).
+ * Buffers are pinned by @pinned, a list, and used in place unless their
+ * characters are narrower than Py_UNICODE.  Returns
+ * 0 -- string
+ * 1 -- unicode string
+ * -1 -- failure (an exception is set)
+ * -2 -- not a string (no exception is set)
+ */
+static int
+get_string(PyObject *obj, const char *name, PyObject *pinned,
+           size_t *len, const void **str)
+{
+  const Py_buffer *view;
+  PyObject *mv;
 
-    strings[0] = (lev_byte*)PyBytes_AS_STRING(first);
-    sizes[0] = (size_t)PyBytes_GET_SIZE(first);
-    for (i = 1; i < n; i++) {
-      PyObject *item = PySequence_Fast_GET_ITEM(list, i);
+  if (PyObject_TypeCheck(obj, &PyBytes_Type)) {
+    *len = (size_t)PyBytes_GET_SIZE(obj);
+    *str = PyBytes_AS_STRING(obj);
+    return 0;
+  }
+  if (PyObject_TypeCheck(obj, &PyUnicode_Type)) {
+    *len = (size_t)PyUnicode_GET_SIZE(obj);
+    *str = PyUnicode_AS_UNICODE(obj);
+    return *str ? 1 : -1;
+  }
+  if (!PyObject_CheckBuffer(obj))
+    return -2;
+  /* the memoryview keeps the buffer exported, so e.g. a bytearray can't
+   * be resized while the GIL is released */
+  mv = PyMemoryView_FromObject(obj);
+  if (!mv) {
+    PyErr_Clear();
+    return -2;
+  }
+  view = PyMemoryView_GET_BUFFER(mv);
+  if (view->ndim > 1
+      || !is_char_format(buffer_format(view), view->itemsize)
+      || !PyBuffer_IsContiguous(view, 'C')) {
+    Py_DECREF(mv);
+    return -2;
+  }
+  if (PyList_Append(pinned, mv) < 0) {
+    Py_DECREF(mv);
+    return -1;
+  }
+  Py_DECREF(mv);
+  *len = (size_t)(view->len/view->itemsize);
+  return buffer_chars(view->buf, *len, (size_t)view->itemsize, name,
+                      pinned, str);
+}
 
-      if (!PyObject_TypeCheck(item, &PyBytes_Type)) {
-        free(strings);
-        free(sizes);
-        PyErr_Format(PyExc_TypeError,
-                     "%s item #%i is not a String", name, i);
-        return -1;
-      }
-      strings[i] = (lev_byte*)PyBytes_AS_STRING(item);
-      sizes[i] = (size_t)PyBytes_GET_SIZE(item);
-    }
+/* the type of a string argument like get_string(), or -1 (an exception is
+ * set) */
+static int
+string_type(PyObject *obj, const char *name)
+{
+  PyObject *pinned = PyList_New(0);
+  const void *s;
+  size_t len;
+  int stringtype;
 
-    *(lev_byte***)strlist = strings;
-    *sizelist = sizes;
-    return 0;
+  if (!pinned)
+    return -1;
+  stringtype = get_string(obj, name, pinned, &len, &s);
+  Py_DECREF(pinned);
+  if (stringtype == -2) {
+    PyErr_Format(PyExc_TypeError, "%s expected a String or Unicode", name);
+    return -1;
   }
-  if (PyObject_TypeCheck(first, &PyUnicode_Type)) {
-    Py_UNICODE **strings;
-    size_t *sizes;
+  return stringtype;
+}
 
-    strings = (Py_UNICODE**)safe_malloc(n, sizeof(Py_UNICODE*));
-    if (!strings) {
-      PyErr_NoMemory();
-      return -1;
-    }
-    sizes = (size_t*)safe_malloc(n, sizeof(size_t));
-    if (!sizes) {
-      free(strings);
-      PyErr_NoMemory();
-      return -1;
-    }
+/* get two string arguments of the same type, returns the type or -1 */
+static int
+get_two_strings(PyObject *arg1, PyObject *arg2, const char *name,
+                PyObject *pinned, size_t *len1, const void **str1,
+                size_t *len2, const void **str2)
+{
+  int stringtype1 = get_string(arg1, name, pinned, len1, str1);
+  int stringtype2;
 
-    strings[0] = PyUnicode_AS_UNICODE(first);
-    sizes[0] = (size_t)PyUnicode_GET_SIZE(first);
-    for (i = 1; i < n; i++) {
-      PyObject *item = PySequence_Fast_GET_ITEM(list, i);
+  if (stringtype1 == -1)
+    return -1;
+  stringtype2 = get_string(arg2, name, pinned, len2, str2);
+  if (stringtype2 == -1)
+    return -1;
+  if (stringtype1 < 0 || stringtype1 != stringtype2) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s expected two Strings or two Unicodes", name);
+    return -1;
+  }
+  return stringtype1;
+}
 
-      if (!PyObject_TypeCheck(item, &PyUnicode_Type)) {
-        free(strings);
-        free(sizes);
-        PyErr_Format(PyExc_TypeError,
-                     "%s item #%i is not a Unicode", name, i);
-        return -1;
-      }
-      strings[i] = PyUnicode_AS_UNICODE(item);
-      sizes[i] = (size_t)PyUnicode_GET_SIZE(item);
+/* the number of characters of a NUL padded string */
+static size_t
+unpadded_length(const void *str, size_t width, int stringtype)
+{
+  if (stringtype == 0) {
+    while (width && !((const lev_byte*)str)[width - 1])
+      width--;
+  }
+  else {
+    while (width && !((const Py_UNICODE*)str)[width - 1])
+      width--;
+  }
+  return width;
+}
+
+/* extract a NumPy style fixed width string array: a 1d buffer of 's' or
+ * 'w' items, or a 2d buffer of characters; returns the type like
+ * extract_strings(), or -2 when @obj isn't such an array */
+static int
+extract_fixed_width(PyObject *obj, const char *name, StringList *sl)
+{
+  const Py_buffer *view;
+  const char *f;
+  PyObject *mv;
+  size_t i, n, width, size;
+  const void *chars;
+  int stringtype;
+
+  mv = PyMemoryView_FromObject(obj);
+  if (!mv) {
+    PyErr_Clear();
+    return -2;
+  }
+  view = PyMemoryView_GET_BUFFER(mv);
+  f = buffer_format(view);
+  if (!f || !PyBuffer_IsContiguous(view, 'C')) {
+    Py_DECREF(mv);
+    return -2;
+  }
+  if (view->ndim == 2 && is_char_format(f, view->itemsize)) {
+    n = (size_t)view->shape[0];
+    width = (size_t)view->shape[1];
+    size = (size_t)view->itemsize;
+  }
+  else if (view->ndim == 1) {
+    width = 0;
+    while (*f >= '0' && *f <= '9')
+      width = 10*width + (size_t)(*f++ - '0');
+    if ((f[0] != 's' && f[0] != 'w') || f[1]) {
+      Py_DECREF(mv);
+      return -2;
     }
+    n = (size_t)view->shape[0];
+    size = f[0] == 's' ? 1 : 4;
+    width = (size_t)view->itemsize/size;
+  }
+  else {
+    Py_DECREF(mv);
+    return -2;
+  }
+  if (PyList_Append(sl->pinned, mv) < 0) {
+    Py_DECREF(mv);
+    return -1;
+  }
+  Py_DECREF(mv);
 
-    *(Py_UNICODE***)strlist = strings;
-    *sizelist = sizes;
-    return 1;
+  sl->n = n;
+  stringtype = buffer_chars(view->buf, n*width, size, name, sl->pinned,
+                            &chars);
+  if (stringtype < 0 || !n)
+    return stringtype;
+  sl->sizes = (size_t*)safe_malloc(n, sizeof(size_t));
+  sl->strings = safe_malloc(n, sizeof(void*));
+  if (!sl->sizes || !sl->strings) {
+    PyErr_NoMemory();
+    return -1;
   }
+  size = stringtype ? sizeof(Py_UNICODE) : 1;
+  for (i = 0; i < n; i++) {
+    const void *s = (const char*)chars + i*width*size;
 
-  PyErr_Format(PyExc_TypeError,
-               "%s expected list of Strings or Unicodes", name);
-  return -1;
+    ((const void**)sl->strings)[i] = s;
+    sl->sizes[i] = unpadded_length(s, width, stringtype);
+  }
+  return stringtype;
+}
+
+/* extract a list of strings or unicode strings: a sequence of string
+ * arguments (see get_string()) or a fixed width string array, which is used
+ * in place; returns
+ * 0 -- strings (also for an empty sequence)
+ * 1 -- unicode strings
+ * -1 -- failure
+ * the strings are valid until release_strings(), also without the GIL
+ */
+static int
+extract_strings(PyObject *obj, const char *name, StringList *sl)
+{
+  PyObject *seq;
+  size_t i, n;
+  int stringtype = 0;
+
+  memset(sl, 0, sizeof(StringList));
+  sl->pinned = PyList_New(0);
+  if (!sl->pinned)
+    return -1;
+  if (PyObject_CheckBuffer(obj)) {
+    stringtype = extract_fixed_width(obj, name, sl);
+    if (stringtype != -2)
+      return stringtype;
+    stringtype = 0;
+  }
+
+  /* a copy, a list could change while the GIL is released */
+  seq = PySequence_Tuple(obj);
+  if (!seq)
+    return -1;
+  if (PyList_Append(sl->pinned, seq) < 0) {
+    Py_DECREF(seq);
+    return -1;
+  }
+  Py_DECREF(seq);
+  n = sl->n = (size_t)PyTuple_GET_SIZE(seq);
+  if (!n)
+    return 0;
+  sl->sizes = (size_t*)safe_malloc(n, sizeof(size_t));
+  sl->strings = safe_malloc(n, sizeof(void*));
+  if (!sl->sizes || !sl->strings) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  /* when the first item is a string then all others must be strings too;
+   * when it's a unicode string then all others must be unicode strings
+   * too. */
+  for (i = 0; i < n; i++) {
+    int t = get_string(PyTuple_GET_ITEM(seq, i), name, sl->pinned,
+                       sl->sizes + i, (const void**)sl->strings + i);
+
+    if (t == -1)
+      return -1;
+    if (t == -2 && !i) {
+      PyErr_Format(PyExc_TypeError,
+                   "%s expected list of Strings or Unicodes", name);
+      return -1;
+    }
+    if (!i)
+      stringtype = t;
+    else if (t != stringtype) {
+      PyErr_Format(PyExc_TypeError, "%s item #%zu is not a %s",
+                   name, i, stringtype ? "Unicode" : "String");
+      return -1;
+    }
+  }
+  return stringtype;
+}
+
+static void
+release_strings(StringList *sl)
+{
+  free(sl->sizes);
+  free(sl->strings);
+  Py_XDECREF(sl->pinned);
+  memset(sl, 0, sizeof(StringList));
 }
 
 static PyObject*
@@ -654,16 +1372,11 @@ static double
 setseq_common(PyObject *args, const char *name, SetSeqFuncs foo,
               size_t *lensum)
 {
-  size_t n1, n2;
-  void *strings1 = NULL;
-  void *strings2 = NULL;
-  size_t *sizes1 = NULL;
-  size_t *sizes2 = NULL;
+  StringList sl1, sl2;
   PyObject *strlist1;
   PyObject *strlist2;
-  PyObject *strseq1;
-  PyObject *strseq2;
   int stringtype1, stringtype2;
+  LevPriority priority;
   double r = -1.0;
 
   if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 2, 2, &strlist1, &strlist2))
@@ -680,72 +1393,4512 @@ setseq_common(PyObject *args, const char *name, SetSeqFuncs foo,
     return r;
   }
 
-  strseq1 = PySequence_Fast(strlist1, name);
-  strseq2 = PySequence_Fast(strlist2, name);
-
-  n1 = (size_t)PySequence_Fast_GET_SIZE(strseq1);
-  n2 = (size_t)PySequence_Fast_GET_SIZE(strseq2);
-  *lensum = n1 + n2;
-  if (n1 == 0) {
-    Py_DECREF(strseq1);
-    Py_DECREF(strseq2);
-    return (double)n2;
-  }
-  if (n2 == 0) {
-    Py_DECREF(strseq1);
-    Py_DECREF(strseq2);
-    return (double)n1;
-  }
-
-  stringtype1 = extract_stringlist(strseq1, name, n1, &sizes1, &strings1);
-  Py_DECREF(strseq1);
+  stringtype1 = extract_strings(strlist1, name, &sl1);
   if (stringtype1 < 0) {
-    Py_DECREF(strseq2);
+    release_strings(&sl1);
     return r;
   }
-  stringtype2 = extract_stringlist(strseq2, name, n2, &sizes2, &strings2);
-  Py_DECREF(strseq2);
+  stringtype2 = extract_strings(strlist2, name, &sl2);
   if (stringtype2 < 0) {
-    free(sizes1);
-    free(strings1);
+    release_strings(&sl1);
+    release_strings(&sl2);
     return r;
   }
 
-  if (stringtype1 != stringtype2) {
+  *lensum = sl1.n + sl2.n;
+  if (sl1.n == 0)
+    r = (double)sl2.n;
+  else if (sl2.n == 0)
+    r = (double)sl1.n;
+  else if (stringtype1 != stringtype2) {
     PyErr_Format(PyExc_TypeError,
                   "%s both sequences must consist of items of the same type",
                   name);
   }
-  else if (stringtype1 == 0) {
-    r = foo.s(n1, sizes1, (const lev_byte**)strings1, n2, sizes2, (const lev_byte**)strings2);
+  else {
+    Py_BEGIN_ALLOW_THREADS
+    priority = lev_sched_begin();
+    if (stringtype1 == 0)
+      r = foo.s(sl1.n, sl1.sizes, (const lev_byte**)sl1.strings,
+                sl2.n, sl2.sizes, (const lev_byte**)sl2.strings);
+    else
+      r = foo.u(sl1.n, sl1.sizes, (const Py_UNICODE**)sl1.strings,
+                sl2.n, sl2.sizes, (const Py_UNICODE**)sl2.strings);
+    lev_sched_end(priority);
+    Py_END_ALLOW_THREADS
     if (r < 0.0)
       PyErr_NoMemory();
   }
-  else if (stringtype1 == 1) {
-    r = foo.u(n1, sizes1, (const Py_UNICODE**)strings1, n2, sizes2, (const Py_UNICODE**)strings2);
-    if (r < 0.0)
-      PyErr_NoMemory();
+
+  release_strings(&sl1);
+  release_strings(&sl2);
+  return r;
+}
+
+static PyObject*
+seq_opcodes_py(PyObject *self, PyObject *args)
+{
+  const char *name = "seq_opcodes";
+  size_t n1, n2, nb;
+  StringList sl1, sl2;
+  PyObject *strlist1, *strlist2, *cutoff = NULL;
+  PyObject *result = NULL;
+  LevOpCode *bops = NULL;
+  int stringtype1, stringtype2;
+  double score_cutoff = 0.0, max = HUGE_VAL, dist = 0.0;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 2, 3,
+                         &strlist1, &strlist2, &cutoff))
+    return NULL;
+  if (!PySequence_Check(strlist1) || !PySequence_Check(strlist2)) {
+    PyErr_Format(PyExc_TypeError, "%s expected two Sequences", name);
+    return NULL;
+  }
+  if (cutoff && cutoff != Py_None) {
+    score_cutoff = PyFloat_AsDouble(cutoff);
+    if (score_cutoff == -1.0 && PyErr_Occurred())
+      return NULL;
+  }
+
+  stringtype1 = extract_strings(strlist1, name, &sl1);
+  if (stringtype1 < 0) {
+    release_strings(&sl1);
+    return NULL;
+  }
+  stringtype2 = extract_strings(strlist2, name, &sl2);
+  if (stringtype2 < 0) {
+    release_strings(&sl1);
+    release_strings(&sl2);
+    return NULL;
+  }
+  n1 = sl1.n;
+  n2 = sl2.n;
+  /* the cutoff only prunes, the ratio is checked exactly below; the slack
+   * covers rounding of the distance */
+  if (score_cutoff > 0.0)
+    max = (double)(n1 + n2) * (1.0 - score_cutoff) + 1e-9;
+
+  /* empty sequences carry no type */
+  if (n1 == 0)
+    stringtype1 = stringtype2;
+  if (n2 == 0)
+    stringtype2 = stringtype1;
+  if (stringtype1 != stringtype2) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s both sequences must consist of items of the same type",
+                 name);
+    goto done;
+  }
+  if (stringtype1 == 1)
+    bops = lev_u_edit_seq_opcodes(n1, sl1.sizes,
+                                  (const Py_UNICODE**)sl1.strings,
+                                  n2, sl2.sizes,
+                                  (const Py_UNICODE**)sl2.strings,
+                                  max, &dist, &nb);
+  else
+    bops = lev_edit_seq_opcodes(n1, sl1.sizes, (const lev_byte**)sl1.strings,
+                                n2, sl2.sizes, (const lev_byte**)sl2.strings,
+                                max, &dist, &nb);
+  if (!bops && nb) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  if (n1 + n2 && ((double)(n1 + n2) - dist)/(double)(n1 + n2) < score_cutoff) {
+    Py_INCREF(Py_None);
+    result = Py_None;
   }
   else
-    PyErr_Format(PyExc_SystemError, "%s internal error", name);
+    result = opcodes_to_tuple_list(nb, bops);
 
-  free(strings1);
-  free(strings2);
-  free(sizes1);
-  free(sizes2);
-  return r;
+done:
+  free(bops);
+  release_strings(&sl1);
+  release_strings(&sl2);
+  return result;
 }
 
-static PyModuleDef moduledef = {
-  PyModuleDef_HEAD_INIT,
-  "_levenshtein",
-  Levenshtein_DESC,
-  -1,
-  methods
-};
+/* }}} */
 
-PyMODINIT_FUNC PyInit__levenshtein(void)
+/****************************************************************************
+ *
+ * Quick ratios
+ *
+ ****************************************************************************/
+/* {{{ */
+
+static PyObject*
+quick_ratio_py(PyObject *self, PyObject *args)
+{
+  const char *name = "quick_ratio";
+  PyObject *arg1, *arg2, *pinned;
+  const void *s1, *s2;
+  size_t len1, len2;
+  int stringtype;
+  double r;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 2, 2, &arg1, &arg2))
+    return NULL;
+  pinned = PyList_New(0);
+  if (!pinned)
+    return NULL;
+  stringtype = get_two_strings(arg1, arg2, name, pinned,
+                               &len1, &s1, &len2, &s2);
+  if (stringtype < 0) {
+    Py_DECREF(pinned);
+    return NULL;
+  }
+
+  if (stringtype == 0)
+    r = lev_quick_ratio(len1, (const lev_byte*)s1,
+                        len2, (const lev_byte*)s2);
+  else
+    r = lev_u_quick_ratio(len1, (const Py_UNICODE*)s1,
+                          len2, (const Py_UNICODE*)s2);
+  Py_DECREF(pinned);
+  if (r < 0.0)
+    return PyErr_NoMemory();
+  return PyFloat_FromDouble(r);
+}
+
+static double
+real_quick_ratio_value(size_t len1, size_t len2)
+{
+  if (!len1 && !len2)
+    return 1.0;
+  return 2.0*(double)(len1 < len2 ? len1 : len2)/(double)(len1 + len2);
+}
+
+static PyObject*
+real_quick_ratio_py(PyObject *self, PyObject *args)
+{
+  const char *name = "real_quick_ratio";
+  PyObject *arg1, *arg2;
+  Py_ssize_t len1, len2;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 2, 2, &arg1, &arg2))
+    return NULL;
+  len1 = PyObject_Length(arg1);
+  len2 = PyObject_Length(arg2);
+  if (len1 < 0 || len2 < 0)
+    return NULL;
+  return PyFloat_FromDouble(real_quick_ratio_value((size_t)len1,
+                                                   (size_t)len2));
+}
+
+/* make a list of floats */
+static PyObject*
+ratios_to_list(size_t n, const double *ratios)
+{
+  PyObject *list = PyList_New((Py_ssize_t)n);
+  size_t i;
+
+  if (!list)
+    return NULL;
+  for (i = 0; i < n; i++) {
+    PyObject *item = PyFloat_FromDouble(ratios[i]);
+    if (!item) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, (Py_ssize_t)i, item);
+  }
+  return list;
+}
+
+static PyObject*
+quick_ratio_batch_py(PyObject *self, PyObject *args)
+{
+  const char *name = "quick_ratio_batch";
+  PyObject *arg1, *strlist, *result = NULL;
+  StringList sl;
+  const void *s;
+  double *ratios;
+  size_t len;
+  int stringtype, listtype;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 2, 2, &arg1, &strlist))
+    return NULL;
+  if (!PySequence_Check(strlist)) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s second argument must be a Sequence", name);
+    return NULL;
+  }
+  listtype = extract_strings(strlist, name, &sl);
+  if (listtype < 0) {
+    release_strings(&sl);
+    return NULL;
+  }
+  stringtype = get_string(arg1, name, sl.pinned, &len, &s);
+  if (stringtype < 0) {
+    if (stringtype == -2)
+      PyErr_Format(PyExc_TypeError,
+                   "%s expected two Strings or two Unicodes", name);
+    release_strings(&sl);
+    return NULL;
+  }
+  if (sl.n == 0) {
+    release_strings(&sl);
+    return PyList_New(0);
+  }
+  if (listtype != stringtype) {
+    PyErr_Format(PyExc_TypeError, "%s argument types don't match", name);
+    release_strings(&sl);
+    return NULL;
+  }
+  ratios = (double*)safe_malloc(sl.n, sizeof(double));
+  if (!ratios) {
+    release_strings(&sl);
+    return PyErr_NoMemory();
+  }
+
+  if (stringtype == 0) {
+    lev_quick_ratio_batch(len, (const lev_byte*)s,
+                          sl.n, sl.sizes, (const lev_byte**)sl.strings,
+                          ratios);
+    result = ratios_to_list(sl.n, ratios);
+  }
+  else if (lev_u_quick_ratio_batch(len, (const Py_UNICODE*)s,
+                                   sl.n, sl.sizes,
+                                   (const Py_UNICODE**)sl.strings,
+                                   ratios) < 0)
+    PyErr_NoMemory();
+  else
+    result = ratios_to_list(sl.n, ratios);
+
+  free(ratios);
+  release_strings(&sl);
+  return result;
+}
+
+static PyObject*
+real_quick_ratio_batch_py(PyObject *self, PyObject *args)
+{
+  const char *name = "real_quick_ratio_batch";
+  PyObject *arg1, *strlist, *strseq, *result;
+  Py_ssize_t len, n, i;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 2, 2, &arg1, &strlist))
+    return NULL;
+  len = PyObject_Length(arg1);
+  if (len < 0)
+    return NULL;
+  strseq = PySequence_Fast(strlist, name);
+  if (!strseq)
+    return NULL;
+  n = PySequence_Fast_GET_SIZE(strseq);
+  result = PyList_New(n);
+  if (!result) {
+    Py_DECREF(strseq);
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    Py_ssize_t leni = PyObject_Length(PySequence_Fast_GET_ITEM(strseq, i));
+    PyObject *item;
+
+    if (leni < 0) {
+      Py_DECREF(result);
+      Py_DECREF(strseq);
+      return NULL;
+    }
+    item = PyFloat_FromDouble(real_quick_ratio_value((size_t)len,
+                                                     (size_t)leni));
+    if (!item) {
+      Py_DECREF(result);
+      Py_DECREF(strseq);
+      return NULL;
+    }
+    PyList_SET_ITEM(result, i, item);
+  }
+  Py_DECREF(strseq);
+  return result;
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Token similarities
+ *
+ ****************************************************************************/
+/* {{{ */
+
+static int
+token_scorer(const char *scorername, const char *name, LevTokenScorer *scorer)
+{
+  if (!strcmp(scorername, "sort"))
+    *scorer = LEV_TOKEN_SORT;
+  else if (!strcmp(scorername, "set"))
+    *scorer = LEV_TOKEN_SET;
+  else if (!strcmp(scorername, "seq"))
+    *scorer = LEV_TOKEN_SEQ;
+  else {
+    PyErr_Format(PyExc_ValueError,
+                 "%s scorer must be 'sort', 'set' or 'seq'", name);
+    return -1;
+  }
+  return 0;
+}
+
+/* prepare the query of a token batch and extract the strings, returns the
+ * string type or -1 */
+static int
+token_batch_args(PyObject *arg1, PyObject *strlist, const char *name,
+                 LevTokenScorer scorer, StringList *sl, LevTokenQuery **query)
 {
-  return PyModule_Create(&moduledef);
+  const void *s;
+  size_t len;
+  int stringtype, listtype;
+
+  *query = NULL;
+  listtype = extract_strings(strlist, name, sl);
+  if (listtype < 0)
+    return -1;
+  stringtype = get_string(arg1, name, sl->pinned, &len, &s);
+  if (stringtype < 0) {
+    if (stringtype == -2)
+      PyErr_Format(PyExc_TypeError,
+                   "%s expected two Strings or two Unicodes", name);
+    return -1;
+  }
+  if (sl->n && listtype != stringtype) {
+    PyErr_Format(PyExc_TypeError, "%s argument types don't match", name);
+    return -1;
+  }
+  if (stringtype == 0)
+    *query = lev_token_query_new(len, (const lev_byte*)s, scorer);
+  else
+    *query = lev_u_token_query_new(len, (const Py_UNICODE*)s, scorer);
+  if (!*query) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  return stringtype;
+}
+
+static int
+token_cutoff(PyObject *cutoffobj, const char *name, double *cutoff)
+{
+  *cutoff = 0.0;
+  if (cutoffobj == Py_None)
+    return 0;
+  *cutoff = PyFloat_AsDouble(cutoffobj);
+  if (*cutoff == -1.0 && PyErr_Occurred())
+    return -1;
+  if (!(*cutoff >= 0.0 && *cutoff <= 1.0)) {
+    PyErr_Format(PyExc_ValueError,
+                 "%s score_cutoff must be a ratio between 0 and 1", name);
+    return -1;
+  }
+  return 0;
+}
+
+static PyObject*
+token_ratio_common(PyObject *args, const char *name, LevTokenScorer scorer)
+{
+  PyObject *arg1, *arg2, *pinned;
+  LevTokenQuery *query;
+  const void *s1, *s2;
+  size_t len1, len2;
+  int stringtype, r;
+  double ratio;
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 2, 2, &arg1, &arg2))
+    return NULL;
+  pinned = PyList_New(0);
+  if (!pinned)
+    return NULL;
+  stringtype = get_two_strings(arg1, arg2, name, pinned,
+                               &len1, &s1, &len2, &s2);
+  if (stringtype < 0) {
+    Py_DECREF(pinned);
+    return NULL;
+  }
+  if (stringtype == 0) {
+    query = lev_token_query_new(len1, (const lev_byte*)s1, scorer);
+    r = query ? lev_token_ratio_batch(query, 1, &len2,
+                                      (const lev_byte**)&s2, 0.0, 1, &ratio)
+              : -1;
+  }
+  else {
+    query = lev_u_token_query_new(len1, (const Py_UNICODE*)s1, scorer);
+    r = query ? lev_u_token_ratio_batch(query, 1, &len2,
+                                        (const Py_UNICODE**)&s2,
+                                        0.0, 1, &ratio)
+              : -1;
+  }
+  lev_token_query_free(query);
+  Py_DECREF(pinned);
+  if (r < 0)
+    return PyErr_NoMemory();
+  return PyFloat_FromDouble(ratio);
+}
+
+static PyObject*
+token_sort_ratio_py(PyObject *self, PyObject *args)
+{
+  LEV_UNUSED(self);
+  return token_ratio_common(args, "token_sort_ratio", LEV_TOKEN_SORT);
+}
+
+static PyObject*
+token_set_ratio_py(PyObject *self, PyObject *args)
+{
+  LEV_UNUSED(self);
+  return token_ratio_common(args, "token_set_ratio", LEV_TOKEN_SET);
+}
+
+static PyObject*
+token_seqratio_py(PyObject *self, PyObject *args)
+{
+  LEV_UNUSED(self);
+  return token_ratio_common(args, "token_seqratio", LEV_TOKEN_SEQ);
+}
+
+static PyObject*
+token_ratio_batch_py(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = { "string", "string_sequence", "scorer", "threads",
+                            "score_cutoff", "priority", NULL };
+  const char *name = "token_ratio_batch";
+  PyObject *arg1, *strlist, *cutoffobj = Py_None, *result = NULL;
+  const char *scorername = "sort", *priorityname = NULL;
+  LevPriority priority, oldpriority;
+  LevTokenScorer scorer;
+  LevTokenQuery *query;
+  Py_ssize_t nthreads = 0;
+  StringList sl;
+  double *ratios, cutoff;
+  int stringtype, r;
+  LEV_UNUSED(self);
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|snOz:token_ratio_batch",
+                                   kwlist, &arg1, &strlist, &scorername,
+                                   &nthreads, &cutoffobj, &priorityname))
+    return NULL;
+  if (token_scorer(scorername, name, &scorer) < 0
+      || token_cutoff(cutoffobj, name, &cutoff) < 0
+      || get_priority(priorityname, name, &priority) < 0)
+    return NULL;
+  if (nthreads < 0) {
+    PyErr_Format(PyExc_ValueError, "%s threads must not be negative", name);
+    return NULL;
+  }
+  stringtype = token_batch_args(arg1, strlist, name, scorer, &sl, &query);
+  if (stringtype < 0) {
+    release_strings(&sl);
+    return NULL;
+  }
+  ratios = (double*)safe_malloc(sl.n + 1, sizeof(double));
+  if (!ratios) {
+    lev_token_query_free(query);
+    release_strings(&sl);
+    return PyErr_NoMemory();
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  oldpriority = lev_priority_set(priority);
+  if (stringtype == 0)
+    r = lev_token_ratio_batch(query, sl.n, sl.sizes,
+                              (const lev_byte**)sl.strings,
+                              cutoff, (size_t)nthreads, ratios);
+  else
+    r = lev_u_token_ratio_batch(query, sl.n, sl.sizes,
+                                (const Py_UNICODE**)sl.strings,
+                                cutoff, (size_t)nthreads, ratios);
+  lev_priority_set(oldpriority);
+  Py_END_ALLOW_THREADS
+  if (r < 0)
+    PyErr_NoMemory();
+  else
+    result = ratios_to_list(sl.n, ratios);
+
+  free(ratios);
+  lev_token_query_free(query);
+  release_strings(&sl);
+  return result;
+}
+
+static PyObject*
+token_ratio_best_py(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = { "string", "string_sequence", "count", "scorer",
+                            "threads", "score_cutoff", "priority", NULL };
+  const char *name = "token_ratio_best";
+  PyObject *arg1, *strlist, *cutoffobj = Py_None, *result = NULL;
+  const char *scorername = "sort", *priorityname = NULL;
+  LevPriority priority, oldpriority;
+  LevTokenScorer scorer;
+  LevTokenQuery *query;
+  LevTokenMatch *matches;
+  Py_ssize_t count, nthreads = 0;
+  StringList sl;
+  size_t n, i;
+  double cutoff;
+  int stringtype;
+  LEV_UNUSED(self);
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOn|snOz:token_ratio_best",
+                                   kwlist, &arg1, &strlist, &count,
+                                   &scorername, &nthreads, &cutoffobj,
+                                   &priorityname))
+    return NULL;
+  if (token_scorer(scorername, name, &scorer) < 0
+      || token_cutoff(cutoffobj, name, &cutoff) < 0
+      || get_priority(priorityname, name, &priority) < 0)
+    return NULL;
+  if (count < 0 || nthreads < 0) {
+    PyErr_Format(PyExc_ValueError,
+                 "%s count and threads must not be negative", name);
+    return NULL;
+  }
+  stringtype = token_batch_args(arg1, strlist, name, scorer, &sl, &query);
+  if (stringtype < 0) {
+    release_strings(&sl);
+    return NULL;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  oldpriority = lev_priority_set(priority);
+  if (stringtype == 0)
+    matches = lev_token_ratio_best(query, sl.n, sl.sizes,
+                                   (const lev_byte**)sl.strings, cutoff,
+                                   (size_t)count, (size_t)nthreads, &n);
+  else
+    matches = lev_u_token_ratio_best(query, sl.n, sl.sizes,
+                                     (const Py_UNICODE**)sl.strings, cutoff,
+                                     (size_t)count, (size_t)nthreads, &n);
+  lev_priority_set(oldpriority);
+  Py_END_ALLOW_THREADS
+  lev_token_query_free(query);
+  release_strings(&sl);
+  if (!matches)
+    return PyErr_NoMemory();
+
+  result = PyList_New((Py_ssize_t)n);
+  for (i = 0; result && i < n; i++) {
+    PyObject *item = Py_BuildValue("(nd)", (Py_ssize_t)matches[i].id,
+                                   matches[i].ratio);
+    if (!item)
+      Py_CLEAR(result);
+    else
+      PyList_SET_ITEM(result, (Py_ssize_t)i, item);
+  }
+  free(matches);
+  return result;
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * DistanceCache type
+ *
+ ****************************************************************************/
+/* {{{ */
+
+typedef struct {
+  PyObject_HEAD
+  LevDistanceCache *cache;
+  Py_ssize_t busy;  /* computations using the cache without the GIL */
+} DistanceCacheObject;
+
+static PyTypeObject DistanceCacheType;
+
+static int
+DistanceCache_init(DistanceCacheObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = { "filename", "capacity", NULL };
+  PyObject *filename;
+  Py_ssize_t capacity = 1 << 20;
+  LevDistanceCache *cache;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&|n", kwlist,
+                                   PyUnicode_FSConverter, &filename,
+                                   &capacity))
+    return -1;
+  if (capacity < 0) {
+    PyErr_SetString(PyExc_ValueError,
+                    "DistanceCache capacity must not be negative");
+    Py_DECREF(filename);
+    return -1;
+  }
+  if (self->busy) {
+    PyErr_SetString(PyExc_ValueError, "DistanceCache is in use");
+    Py_DECREF(filename);
+    return -1;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  cache = lev_distance_cache_open(PyBytes_AS_STRING(filename),
+                                  (size_t)capacity);
+  Py_END_ALLOW_THREADS
+  if (!cache) {
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filename);
+    Py_DECREF(filename);
+    return -1;
+  }
+  Py_DECREF(filename);
+  lev_distance_cache_close(self->cache);
+  self->cache = cache;
+  return 0;
+}
+
+static void
+DistanceCache_dealloc(DistanceCacheObject *self)
+{
+  lev_distance_cache_close(self->cache);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int
+DistanceCache_check(DistanceCacheObject *self)
+{
+  if (!self->cache) {
+    PyErr_SetString(PyExc_ValueError, "DistanceCache is closed");
+    return 0;
+  }
+  return 1;
+}
+
+/* get the cache of a cache argument, None gives NULL; the cache is in use
+ * (can't be closed) until distance_cache_release() */
+static int
+distance_cache_acquire(PyObject *obj, const char *name,
+                       DistanceCacheObject **dc)
+{
+  *dc = NULL;
+  if (obj == Py_None)
+    return 0;
+  if (!PyObject_TypeCheck(obj, &DistanceCacheType)) {
+    PyErr_Format(PyExc_TypeError, "%s cache must be a DistanceCache or None",
+                 name);
+    return -1;
+  }
+  if (!DistanceCache_check((DistanceCacheObject*)obj))
+    return -1;
+  *dc = (DistanceCacheObject*)obj;
+  (*dc)->busy++;
+  return 0;
+}
+
+static void
+distance_cache_release(DistanceCacheObject *dc)
+{
+  if (dc)
+    dc->busy--;
+}
+
+#define DISTANCE_CACHE(dc) ((dc) ? (dc)->cache : NULL)
+
+static PyObject*
+DistanceCache_close(DistanceCacheObject *self, PyObject *args)
+{
+  int r;
+  LEV_UNUSED(args);
+
+  if (self->busy) {
+    PyErr_SetString(PyExc_ValueError, "DistanceCache is in use");
+    return NULL;
+  }
+  r = lev_distance_cache_close(self->cache);
+  self->cache = NULL;
+  if (r)
+    return PyErr_SetFromErrno(PyExc_OSError);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+DistanceCache_enter(DistanceCacheObject *self, PyObject *args)
+{
+  LEV_UNUSED(args);
+  if (!DistanceCache_check(self))
+    return NULL;
+  Py_INCREF(self);
+  return (PyObject*)self;
+}
+
+static PyObject*
+DistanceCache_exit(DistanceCacheObject *self, PyObject *args)
+{
+  return DistanceCache_close(self, args);
+}
+
+static Py_ssize_t
+DistanceCache_len(DistanceCacheObject *self)
+{
+  if (!DistanceCache_check(self))
+    return -1;
+  return (Py_ssize_t)lev_distance_cache_count(self->cache);
+}
+
+static PyObject*
+DistanceCache_get_capacity(DistanceCacheObject *self, void *closure)
+{
+  LEV_UNUSED(closure);
+  if (!DistanceCache_check(self))
+    return NULL;
+  return PyLong_FromSize_t(lev_distance_cache_capacity(self->cache));
+}
+
+#define DistanceCache_DESC \
+  "Persistent cache of distances of long strings.\n" \
+  "\n" \
+  "DistanceCache(filename[, capacity=1048576])\n" \
+  "\n" \
+  "A fixed size hash table of distances in a memory mapped file, created\n" \
+  "with room for capacity distances (rounded up to a power of 2) if it\n" \
+  "doesn't exist.  Processes opening the same file share the cache and\n" \
+  "it persists across runs; when it's full, old distances are evicted.\n" \
+  "\n" \
+  "paired(), sketch_rerank() and ScoreMatrix take a cache argument and\n" \
+  "look the distances of long strings up before computing them.  Short\n" \
+  "strings are not cached, their distances are computed faster than\n" \
+  "looked up.\n" \
+  "\n" \
+  "The length of a cache is the number of distances it holds.\n"
+
+#define DistanceCache_close_DESC \
+  "Close the cache.\n" \
+  "\n" \
+  "close()\n"
+
+static PyMethodDef DistanceCache_methods[] = {
+  { "close", (PyCFunction)DistanceCache_close, METH_NOARGS,
+    DistanceCache_close_DESC },
+  { "__enter__", (PyCFunction)DistanceCache_enter, METH_NOARGS, NULL },
+  { "__exit__", (PyCFunction)DistanceCache_exit, METH_VARARGS, NULL },
+  { NULL, NULL, 0, NULL },
+};
+
+static PyGetSetDef DistanceCache_getset[] = {
+  { "capacity", (getter)DistanceCache_get_capacity, NULL,
+    "The number of distances the cache can hold.", NULL },
+  { NULL, NULL, NULL, NULL, NULL },
+};
+
+static PySequenceMethods DistanceCache_as_sequence = {
+  .sq_length = (lenfunc)DistanceCache_len,
+};
+
+static PyTypeObject DistanceCacheType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "Levenshtein._levenshtein.DistanceCache",
+  .tp_basicsize = sizeof(DistanceCacheObject),
+  .tp_dealloc = (destructor)DistanceCache_dealloc,
+  .tp_as_sequence = &DistanceCache_as_sequence,
+  .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_doc = DistanceCache_DESC,
+  .tp_methods = DistanceCache_methods,
+  .tp_getset = DistanceCache_getset,
+  .tp_init = (initproc)DistanceCache_init,
+  .tp_new = PyType_GenericNew,
+};
+/* }}} */
+
+/****************************************************************************
+ *
+ * Sketches
+ *
+ ****************************************************************************/
+/* {{{ */
+
+static PyObject*
+cgk_sketch_py(PyObject *self, PyObject *args)
+{
+  PyObject *arg1, *result, *pinned;
+  Py_ssize_t length, reps = 1;
+  unsigned long long seed = 0;
+  size_t size, len;
+  const void *s;
+  int stringtype;
+  LEV_UNUSED(self);
+
+  if (!PyArg_ParseTuple(args, "On|nK:cgk_sketch", &arg1, &length, &reps, &seed))
+    return NULL;
+  if (length < 0 || reps < 1) {
+    PyErr_SetString(PyExc_ValueError,
+                    "cgk_sketch length must be nonnegative and repetitions positive");
+    return NULL;
+  }
+  size = (size_t)length*(size_t)reps;
+  pinned = PyList_New(0);
+  if (!pinned)
+    return NULL;
+  stringtype = get_string(arg1, "cgk_sketch", pinned, &len, &s);
+  if (stringtype < 0) {
+    if (stringtype == -2)
+      PyErr_Format(PyExc_TypeError,
+                   "cgk_sketch first argument must be a String or Unicode");
+    Py_DECREF(pinned);
+    return NULL;
+  }
+  result = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)size);
+  if (!result) {
+    Py_DECREF(pinned);
+    return NULL;
+  }
+
+  if (stringtype == 0)
+    lev_cgk_sketch(len, (const lev_byte*)s,
+                   (size_t)length, (size_t)reps, (uint64_t)seed,
+                   (lev_byte*)PyBytes_AS_STRING(result));
+  else
+    lev_u_cgk_sketch(len, (const Py_UNICODE*)s,
+                     (size_t)length, (size_t)reps, (uint64_t)seed,
+                     (lev_byte*)PyBytes_AS_STRING(result));
+  Py_DECREF(pinned);
+  return result;
+}
+
+static PyObject*
+cgk_sketches_py(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = { "string_sequence", "length", "repetitions",
+                            "seed", "threads", "priority", NULL };
+  const char *name = "cgk_sketches", *priorityname = NULL;
+  PyObject *strlist, *result;
+  Py_ssize_t length, reps = 1, nthreads = 0;
+  LevPriority priority, oldpriority;
+  unsigned long long seed = 0;
+  size_t n, size;
+  StringList sl;
+  int stringtype;
+  LEV_UNUSED(self);
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "On|nKnz:cgk_sketches",
+                                   kwlist, &strlist, &length, &reps, &seed,
+                                   &nthreads, &priorityname)
+      || get_priority(priorityname, name, &priority) < 0)
+    return NULL;
+  if (length < 0 || reps < 1 || nthreads < 0) {
+    PyErr_Format(PyExc_ValueError,
+                 "%s length and threads must be nonnegative and "
+                 "repetitions positive", name);
+    return NULL;
+  }
+  if (!PySequence_Check(strlist)) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s first argument must be a Sequence", name);
+    return NULL;
+  }
+  stringtype = extract_strings(strlist, name, &sl);
+  if (stringtype < 0) {
+    release_strings(&sl);
+    return NULL;
+  }
+  n = sl.n;
+  size = (size_t)length*(size_t)reps;
+  if (n && size > (size_t)PY_SSIZE_T_MAX/n) {
+    release_strings(&sl);
+    return PyErr_NoMemory();
+  }
+  result = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)(n*size));
+  if (!result || n == 0) {
+    release_strings(&sl);
+    return result;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  oldpriority = lev_priority_set(priority);
+  if (stringtype == 0)
+    lev_cgk_sketch_batch(n, sl.sizes, (const lev_byte**)sl.strings,
+                         (size_t)length, (size_t)reps, (uint64_t)seed,
+                         (size_t)nthreads,
+                         (lev_byte*)PyBytes_AS_STRING(result));
+  else
+    lev_u_cgk_sketch_batch(n, sl.sizes, (const Py_UNICODE**)sl.strings,
+                           (size_t)length, (size_t)reps, (uint64_t)seed,
+                           (size_t)nthreads,
+                           (lev_byte*)PyBytes_AS_STRING(result));
+  lev_priority_set(oldpriority);
+  Py_END_ALLOW_THREADS
+
+  release_strings(&sl);
+  return result;
+}
+
+/* make a list of (index, distance) tuples */
+static PyObject*
+sketch_matches_to_list(size_t n, const LevSketchMatch *matches)
+{
+  PyObject *list = PyList_New((Py_ssize_t)n);
+  size_t i;
+
+  if (!list)
+    return NULL;
+  for (i = 0; i < n; i++) {
+    PyObject *item = Py_BuildValue("(nn)", (Py_ssize_t)matches[i].id,
+                                   (Py_ssize_t)matches[i].distance);
+    if (!item) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, (Py_ssize_t)i, item);
+  }
+  return list;
+}
+
+static PyObject*
+sketch_nearest_py(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = { "sketch", "sketches", "count", "threads",
+                            "priority", NULL };
+  const char *priorityname = NULL;
+  Py_buffer query, sketches;
+  Py_ssize_t count, nthreads = 0;
+  LevPriority priority, oldpriority;
+  LevSketchMatch *matches;
+  size_t n;
+  PyObject *result;
+  LEV_UNUSED(self);
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*y*n|nz:sketch_nearest",
+                                   kwlist, &query, &sketches, &count,
+                                   &nthreads, &priorityname))
+    return NULL;
+  if (get_priority(priorityname, "sketch_nearest", &priority) < 0) {
+    PyBuffer_Release(&query);
+    PyBuffer_Release(&sketches);
+    return NULL;
+  }
+  if (query.len == 0 || sketches.len % query.len || count < 0 || nthreads < 0) {
+    PyErr_SetString(PyExc_ValueError,
+                    "sketch_nearest sketches size must be a multiple of "
+                    "the (nonempty) query sketch size");
+    PyBuffer_Release(&query);
+    PyBuffer_Release(&sketches);
+    return NULL;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  oldpriority = lev_priority_set(priority);
+  matches = lev_sketch_nearest((size_t)query.len, (const lev_byte*)query.buf,
+                               (size_t)(sketches.len/query.len),
+                               (const lev_byte*)sketches.buf,
+                               (size_t)count, (size_t)nthreads, &n);
+  lev_priority_set(oldpriority);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&query);
+  PyBuffer_Release(&sketches);
+  if (!matches)
+    return PyErr_NoMemory();
+
+  result = sketch_matches_to_list(n, matches);
+  free(matches);
+  return result;
+}
+
+static PyObject*
+sketch_rerank_py(PyObject *self, PyObject *args)
+{
+  const char *name = "sketch_rerank";
+  PyObject *arg1, *strlist, *idlist, *idseq, *result = NULL;
+  PyObject *cacheobj = Py_None;
+  DistanceCacheObject *dc;
+  StringList sl;
+  const void *s;
+  size_t n, ncand, len, i;
+  LevSketchMatch *matches;
+  int stringtype, listtype;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 3, 4,
+                         &arg1, &strlist, &idlist, &cacheobj))
+    return NULL;
+  /* the GIL is held all the time, the cache can't be closed meanwhile */
+  if (distance_cache_acquire(cacheobj, name, &dc) < 0)
+    return NULL;
+  distance_cache_release(dc);
+  if (!PySequence_Check(strlist) || !PySequence_Check(idlist)) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s second and third argument must be Sequences", name);
+    return NULL;
+  }
+  listtype = extract_strings(strlist, name, &sl);
+  if (listtype < 0) {
+    release_strings(&sl);
+    return NULL;
+  }
+  idseq = PySequence_Fast(idlist, name);
+  if (!idseq) {
+    release_strings(&sl);
+    return NULL;
+  }
+  n = sl.n;
+  ncand = (size_t)PySequence_Fast_GET_SIZE(idseq);
+  if (n == 0 || ncand == 0) {
+    release_strings(&sl);
+    Py_DECREF(idseq);
+    if (ncand)
+      PyErr_Format(PyExc_IndexError, "%s index out of range", name);
+    return ncand ? NULL : PyList_New(0);
+  }
+
+  matches = (LevSketchMatch*)safe_malloc(ncand, sizeof(LevSketchMatch));
+  if (!matches) {
+    release_strings(&sl);
+    Py_DECREF(idseq);
+    return PyErr_NoMemory();
+  }
+  for (i = 0; i < ncand; i++) {
+    Py_ssize_t id = PyNumber_AsSsize_t(PySequence_Fast_GET_ITEM(idseq, i),
+                                       PyExc_IndexError);
+    if (id < 0 || (size_t)id >= n) {
+      if (!PyErr_Occurred())
+        PyErr_Format(PyExc_IndexError, "%s index out of range", name);
+      free(matches);
+      release_strings(&sl);
+      Py_DECREF(idseq);
+      return NULL;
+    }
+    matches[i].id = (size_t)id;
+    matches[i].distance = 0;
+  }
+  Py_DECREF(idseq);
+
+  stringtype = get_string(arg1, name, sl.pinned, &len, &s);
+  if (stringtype == 0 && listtype == 0) {
+    lev_sketch_rerank(len, (const lev_byte*)s,
+                      sl.sizes, (const lev_byte**)sl.strings, ncand,
+                      DISTANCE_CACHE(dc), matches);
+    result = sketch_matches_to_list(ncand, matches);
+  }
+  else if (stringtype == 1 && listtype == 1) {
+    lev_u_sketch_rerank(len, (const Py_UNICODE*)s,
+                        sl.sizes, (const Py_UNICODE**)sl.strings, ncand,
+                        DISTANCE_CACHE(dc), matches);
+    result = sketch_matches_to_list(ncand, matches);
+  }
+  else if (stringtype != -1)
+    PyErr_Format(PyExc_TypeError, "%s argument types don't match", name);
+
+  release_strings(&sl);
+  free(matches);
+  return result;
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Paired scoring
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/* a column of paired() with the objects it holds */
+typedef struct {
+  LevColumn column;
+  size_t n;
+  int text;  /* 1 -- text, 0 -- bytes, -1 -- unknown (empty) */
+  StringList strings;  /* for sequences of strings */
+  Py_buffer offsets;  /* for offsets, with data */
+  Py_buffer data;
+  int buffers;  /* whether offsets and data are held */
+} PairedColumn;
+
+static void
+paired_column_release(PairedColumn *pc)
+{
+  release_strings(&pc->strings);
+  if (pc->buffers) {
+    PyBuffer_Release(&pc->offsets);
+    PyBuffer_Release(&pc->data);
+  }
+}
+
+/* whether @obj is an (offsets, data[, encoding]) tuple, i.e. its first
+ * item is a buffer of 32 or 64 bit integers */
+static int
+paired_is_offsets(PyObject *obj)
+{
+  Py_buffer view;
+  const char *f;
+  int ok;
+
+  if (!PyTuple_Check(obj) || PyTuple_GET_SIZE(obj) < 2
+      || PyTuple_GET_SIZE(obj) > 3
+      || !PyObject_CheckBuffer(PyTuple_GET_ITEM(obj, 0)))
+    return 0;
+  if (PyObject_GetBuffer(PyTuple_GET_ITEM(obj, 0), &view,
+                         PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0) {
+    PyErr_Clear();
+    return 0;
+  }
+  f = view.format ? view.format : "B";
+  if (*f == '@' || *f == '=' || *f == '<')
+    f++;
+  ok = (view.itemsize == 4 || view.itemsize == 8)
+       && f[0] && strchr("iIlLqQ", f[0]) && !f[1];
+  PyBuffer_Release(&view);
+  return ok;
+}
+
+static int
+paired_extract_offsets(PyObject *obj, const char *name, PairedColumn *pc)
+{
+  PyObject *encoding = Py_None;
+  size_t i, n, prev;
+
+  if (PyTuple_GET_SIZE(obj) == 3)
+    encoding = PyTuple_GET_ITEM(obj, 2);
+  if (encoding == Py_None)
+    pc->text = 0;
+  else if (PyUnicode_Check(encoding)
+           && (!PyUnicode_CompareWithASCIIString(encoding, "utf-8")
+               || !PyUnicode_CompareWithASCIIString(encoding, "utf8")))
+    pc->text = 1;
+  else {
+    PyErr_Format(PyExc_ValueError,
+                 "%s offsets encoding must be None or 'utf-8'", name);
+    return -1;
+  }
+
+  if (PyObject_GetBuffer(PyTuple_GET_ITEM(obj, 0), &pc->offsets,
+                         PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0)
+    return -1;
+  if (PyObject_GetBuffer(PyTuple_GET_ITEM(obj, 1), &pc->data,
+                         PyBUF_C_CONTIGUOUS) < 0) {
+    PyBuffer_Release(&pc->offsets);
+    return -1;
+  }
+  pc->buffers = 1;
+
+  n = (size_t)(pc->offsets.len/pc->offsets.itemsize);
+  if (!n) {
+    PyErr_Format(PyExc_ValueError, "%s offsets must not be empty", name);
+    return -1;
+  }
+  /* the engines trust the offsets */
+  prev = 0;
+  for (i = 0; i < n; i++) {
+    int64_t o = pc->offsets.itemsize == 4
+                ? (int64_t)((const int32_t*)pc->offsets.buf)[i]
+                : ((const int64_t*)pc->offsets.buf)[i];
+
+    if (o < 0 || (size_t)o < prev || (uint64_t)o > (uint64_t)pc->data.len) {
+      PyErr_Format(PyExc_ValueError,
+                   "%s offsets must be nondecreasing and within the data",
+                   name);
+      return -1;
+    }
+    prev = (size_t)o;
+  }
+
+  pc->n = n - 1;
+  pc->column.type = pc->text ? LEV_COLUMN_UTF8 : LEV_COLUMN_OFFSETS;
+  pc->column.offsets = pc->offsets.buf;
+  pc->column.offset_size = (size_t)pc->offsets.itemsize;
+  pc->column.data = (const lev_byte*)pc->data.buf;
+  return 0;
+}
+
+static int
+paired_extract_column(PyObject *obj, const char *name, PairedColumn *pc)
+{
+  int stringtype;
+
+  memset(pc, 0, sizeof(PairedColumn));
+  if (paired_is_offsets(obj))
+    return paired_extract_offsets(obj, name, pc);
+
+  if (!PySequence_Check(obj)) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s arguments must be Sequences or offset buffers", name);
+    return -1;
+  }
+  stringtype = extract_strings(obj, name, &pc->strings);
+  if (stringtype < 0)
+    return -1;
+  pc->n = pc->strings.n;
+  pc->text = -1;
+  if (!pc->n)
+    return 0;
+  pc->text = stringtype;
+  pc->column.type = stringtype ? LEV_COLUMN_WCHAR : LEV_COLUMN_BYTES;
+  pc->column.lengths = pc->strings.sizes;
+  pc->column.strings = (const void**)pc->strings.strings;
+  return 0;
+}
+
+/* the array typecode of size_t items */
+#define SIZE_TYPECODE (sizeof(long) == sizeof(size_t) ? "l" : "q")
+
+/* make an array.array of @n zeroes */
+static PyObject*
+new_typed_array(const char *typecode, size_t n)
+{
+  PyObject *module, *item, *result;
+
+  module = PyImport_ImportModule("array");
+  if (!module)
+    return NULL;
+  item = PyObject_CallMethod(module, "array", "s(i)", typecode, 0);
+  Py_DECREF(module);
+  if (!item)
+    return NULL;
+  result = PySequence_Repeat(item, (Py_ssize_t)n);
+  Py_DECREF(item);
+  return result;
+}
+
+static PyObject*
+paired_py(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = { "strings1", "strings2", "scorer", "threads",
+                            "score_cutoff", "cache", "priority", NULL };
+  const char *name = "paired";
+  static const char *scorers[] = { "distance", "ratio", "hamming" };
+  PyObject *arg1, *arg2, *cutoffobj = Py_None, *cacheobj = Py_None, *result;
+  DistanceCacheObject *dc;
+  PairedColumn pc1, pc2;
+  const char *scorername = "distance", *priorityname = NULL;
+  Py_ssize_t nthreads = 0;
+  LevPriority priority, oldpriority;
+  LevScorer scorer;
+  double cutoff;
+  Py_buffer view;
+  int r;
+  LEV_UNUSED(self);
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|snOOz:paired", kwlist,
+                                   &arg1, &arg2, &scorername, &nthreads,
+                                   &cutoffobj, &cacheobj, &priorityname)
+      || get_priority(priorityname, name, &priority) < 0)
+    return NULL;
+  for (r = 0; r < 3; r++) {
+    if (!strcmp(scorername, scorers[r]))
+      break;
+  }
+  if (r == 3) {
+    PyErr_Format(PyExc_ValueError,
+                 "%s scorer must be 'distance', 'ratio' or 'hamming'", name);
+    return NULL;
+  }
+  scorer = r == 0 ? LEV_SCORER_DISTANCE
+                  : r == 1 ? LEV_SCORER_RATIO : LEV_SCORER_HAMMING;
+  if (nthreads < 0) {
+    PyErr_Format(PyExc_ValueError, "%s threads must not be negative", name);
+    return NULL;
+  }
+  if (cutoffobj == Py_None)
+    cutoff = scorer == LEV_SCORER_RATIO ? 0.0 : HUGE_VAL;
+  else {
+    cutoff = PyFloat_AsDouble(cutoffobj);
+    if (cutoff == -1.0 && PyErr_Occurred())
+      return NULL;
+    if (!(cutoff >= 0.0)
+        || (scorer == LEV_SCORER_RATIO && cutoff > 1.0)) {
+      PyErr_Format(PyExc_ValueError,
+                   "%s score_cutoff must be a nonnegative distance "
+                   "or a ratio between 0 and 1", name);
+      return NULL;
+    }
+  }
+
+  if (paired_extract_column(arg1, name, &pc1) < 0) {
+    paired_column_release(&pc1);
+    return NULL;
+  }
+  if (paired_extract_column(arg2, name, &pc2) < 0) {
+    paired_column_release(&pc1);
+    paired_column_release(&pc2);
+    return NULL;
+  }
+  if (pc1.n != pc2.n) {
+    PyErr_Format(PyExc_ValueError,
+                 "%s columns must have the same length", name);
+    goto fail;
+  }
+  if (pc1.text >= 0 && pc2.text >= 0 && pc1.text != pc2.text) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s columns must be both text or both bytes", name);
+    goto fail;
+  }
+
+  result = new_typed_array(scorer == LEV_SCORER_RATIO
+                           ? "d"
+                           : SIZE_TYPECODE,
+                           pc1.n);
+  if (!result)
+    goto fail;
+  if (!pc1.n) {
+    paired_column_release(&pc1);
+    paired_column_release(&pc2);
+    return result;
+  }
+  if (distance_cache_acquire(cacheobj, name, &dc) < 0) {
+    Py_DECREF(result);
+    goto fail;
+  }
+  if (PyObject_GetBuffer(result, &view, PyBUF_WRITABLE) < 0) {
+    distance_cache_release(dc);
+    Py_DECREF(result);
+    goto fail;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  oldpriority = lev_priority_set(priority);
+  r = lev_paired_scores(pc1.n, &pc1.column, &pc2.column, scorer, cutoff,
+                        DISTANCE_CACHE(dc), (size_t)nthreads, view.buf);
+  lev_priority_set(oldpriority);
+  Py_END_ALLOW_THREADS
+  distance_cache_release(dc);
+
+  if (r > 0) {
+    size_t i;
+
+    for (i = 0; ((size_t*)view.buf)[i] != (size_t)(-1); i++)
+      ;
+    PyErr_Format(PyExc_ValueError,
+                 "%s hamming expected strings of the same length, "
+                 "row %zu differs", name, i);
+  }
+  else if (r < 0)
+    PyErr_NoMemory();
+  PyBuffer_Release(&view);
+  paired_column_release(&pc1);
+  paired_column_release(&pc2);
+  if (r) {
+    Py_DECREF(result);
+    return NULL;
+  }
+  return result;
+
+fail:
+  paired_column_release(&pc1);
+  paired_column_release(&pc2);
+  return NULL;
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Edit runs
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/* the edit operation names, indexed by LevEditType; the Python strings are
+ * created in module init */
+static struct {
+  PyObject *pystring;
+  const char *cstring;
+} opcode_names[] = {
+  { NULL, "equal" },
+  { NULL, "replace" },
+  { NULL, "insert" },
+  { NULL, "delete" },
+};
+
+static LevEditType
+string_to_edittype(PyObject *string)
+{
+  size_t i;
+
+  for (i = 0; i < LEV_EDIT_LAST; i++) {
+    if (string == opcode_names[i].pystring)
+      return (LevEditType)i;
+  }
+  if (!PyUnicode_Check(string))
+    return LEV_EDIT_LAST;
+  for (i = 0; i < LEV_EDIT_LAST; i++) {
+    if (!PyUnicode_CompareWithASCIIString(string, opcode_names[i].cstring))
+      return (LevEditType)i;
+  }
+  return LEV_EDIT_LAST;
+}
+
+/* the length of a string or a length itself, -1 if it's neither */
+static size_t
+get_length_of_anything(PyObject *object)
+{
+  Py_ssize_t len;
+
+  if (PyLong_Check(object)) {
+    len = PyLong_AsSsize_t(object);
+    if (len < 0) {
+      PyErr_Clear();
+      return (size_t)(-1);
+    }
+    return (size_t)len;
+  }
+  if (PySequence_Check(object)) {
+    len = PySequence_Length(object);
+    if (len < 0) {
+      PyErr_Clear();
+      return (size_t)(-1);
+    }
+    return (size_t)len;
+  }
+  return (size_t)(-1);
+}
+
+/* parse an edit operation tuple (name, pos1, ..., posN), where size = N + 1;
+ * returns zero if item isn't such a tuple */
+static int
+parse_edit_tuple(PyObject *item, Py_ssize_t size,
+                 LevEditType *type, size_t *pos)
+{
+  Py_ssize_t i;
+
+  if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != size)
+    return 0;
+  *type = string_to_edittype(PyTuple_GET_ITEM(item, 0));
+  if (*type == LEV_EDIT_LAST)
+    return 0;
+  for (i = 1; i < size; i++) {
+    PyObject *p = PyTuple_GET_ITEM(item, i);
+    Py_ssize_t x;
+
+    if (!PyLong_Check(p))
+      return 0;
+    x = PyLong_AsSsize_t(p);
+    if (x < 0) {
+      PyErr_Clear();
+      return 0;
+    }
+    pos[i - 1] = (size_t)x;
+  }
+  return 1;
+}
+
+/* the following extract_*() return NULL, without an exception set unless
+ * it's a memory error, when list has a different form */
+static LevEditRun*
+extract_runs(PyObject *list)
+{
+  size_t n = (size_t)PyList_GET_SIZE(list), i, pos[3];
+  LevEditRun *runs = (LevEditRun*)safe_malloc(n, sizeof(LevEditRun));
+
+  if (!runs) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    if (!parse_edit_tuple(PyList_GET_ITEM(list, i), 4, &runs[i].type, pos)) {
+      free(runs);
+      return NULL;
+    }
+    runs[i].spos = pos[0];
+    runs[i].dpos = pos[1];
+    runs[i].count = pos[2];
+  }
+  return runs;
+}
+
+static LevEditOp*
+extract_editops(PyObject *list)
+{
+  size_t n = (size_t)PyList_GET_SIZE(list), i, pos[2];
+  LevEditOp *ops = (LevEditOp*)safe_malloc(n, sizeof(LevEditOp));
+
+  if (!ops) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    if (!parse_edit_tuple(PyList_GET_ITEM(list, i), 3, &ops[i].type, pos)) {
+      free(ops);
+      return NULL;
+    }
+    ops[i].spos = pos[0];
+    ops[i].dpos = pos[1];
+  }
+  return ops;
+}
+
+static LevOpCode*
+extract_opcodes(PyObject *list)
+{
+  size_t n = (size_t)PyList_GET_SIZE(list), i, pos[4];
+  LevOpCode *bops = (LevOpCode*)safe_malloc(n, sizeof(LevOpCode));
+
+  if (!bops) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    if (!parse_edit_tuple(PyList_GET_ITEM(list, i), 5, &bops[i].type, pos)) {
+      free(bops);
+      return NULL;
+    }
+    bops[i].sbeg = pos[0];
+    bops[i].send = pos[1];
+    bops[i].dbeg = pos[2];
+    bops[i].dend = pos[3];
+  }
+  return bops;
+}
+
+/* extract a nonempty list of runs, raising an exception on failure */
+static LevEditRun*
+extract_runs_arg(PyObject *list, const char *name, size_t *nr)
+{
+  LevEditRun *runs;
+
+  *nr = 0;
+  if (!PyList_Check(list)) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s first argument must be a List of edit runs", name);
+    return NULL;
+  }
+  *nr = (size_t)PyList_GET_SIZE(list);
+  if (!*nr)
+    return NULL;
+  runs = extract_runs(list);
+  if (!runs && !PyErr_Occurred())
+    PyErr_Format(PyExc_TypeError,
+                 "%s first argument must be a List of edit runs", name);
+  return runs;
+}
+
+/* get the lengths from the second and third argument, checking runs are
+ * applicable to strings of these lengths */
+static int
+check_runs_lengths(PyObject *arg2, PyObject *arg3, const char *name,
+                   size_t nr, const LevEditRun *runs,
+                   size_t *len1, size_t *len2)
+{
+  *len1 = get_length_of_anything(arg2);
+  *len2 = get_length_of_anything(arg3);
+  if (*len1 == (size_t)(-1) || *len2 == (size_t)(-1)) {
+    PyErr_Format(PyExc_ValueError,
+                 "%s second and third argument must specify sizes", name);
+    return 0;
+  }
+  if (lev_runs_check_errors(*len1, *len2, nr, runs)) {
+    PyErr_Format(PyExc_ValueError,
+                 "%s edit run list is invalid", name);
+    return 0;
+  }
+  return 1;
+}
+
+static PyObject*
+runs_to_tuple_list(size_t nr, const LevEditRun *runs)
+{
+  PyObject *list = PyList_New((Py_ssize_t)nr);
+  size_t i;
+
+  if (!list)
+    return NULL;
+  for (i = 0; i < nr; i++) {
+    PyObject *item = Py_BuildValue("(Onnn)",
+                                   opcode_names[runs[i].type].pystring,
+                                   (Py_ssize_t)runs[i].spos,
+                                   (Py_ssize_t)runs[i].dpos,
+                                   (Py_ssize_t)runs[i].count);
+    if (!item) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, (Py_ssize_t)i, item);
+  }
+  return list;
+}
+
+static PyObject*
+editops_to_tuple_list(size_t n, const LevEditOp *ops)
+{
+  PyObject *list = PyList_New((Py_ssize_t)n);
+  size_t i;
+
+  if (!list)
+    return NULL;
+  for (i = 0; i < n; i++) {
+    PyObject *item = Py_BuildValue("(Onn)", opcode_names[ops[i].type].pystring,
+                                   (Py_ssize_t)ops[i].spos,
+                                   (Py_ssize_t)ops[i].dpos);
+    if (!item) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, (Py_ssize_t)i, item);
+  }
+  return list;
+}
+
+static PyObject*
+opcodes_to_tuple_list(size_t nb, const LevOpCode *bops)
+{
+  PyObject *list = PyList_New((Py_ssize_t)nb);
+  size_t i;
+
+  if (!list)
+    return NULL;
+  for (i = 0; i < nb; i++) {
+    PyObject *item = Py_BuildValue("(Onnnn)",
+                                   opcode_names[bops[i].type].pystring,
+                                   (Py_ssize_t)bops[i].sbeg,
+                                   (Py_ssize_t)bops[i].send,
+                                   (Py_ssize_t)bops[i].dbeg,
+                                   (Py_ssize_t)bops[i].dend);
+    if (!item) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, (Py_ssize_t)i, item);
+  }
+  return list;
+}
+
+static PyObject*
+editop_runs_py(PyObject *self, PyObject *args)
+{
+  const char *name = "editop_runs";
+  PyObject *arg1, *arg2, *arg3 = NULL, *result;
+  LevEditRun *runs;
+  size_t n, nr, len1, len2;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 2, 3, &arg1, &arg2, &arg3))
+    return NULL;
+
+  /* convert: we were called (ops, s1, s2) */
+  if (arg3) {
+    LevEditOp *ops;
+    LevOpCode *bops;
+
+    if (!PyList_Check(arg1)) {
+      PyErr_Format(PyExc_TypeError,
+                   "%s first argument must be a List of edit operations",
+                   name);
+      return NULL;
+    }
+    n = (size_t)PyList_GET_SIZE(arg1);
+    if (!n)
+      return PyList_New(0);
+    len1 = get_length_of_anything(arg2);
+    len2 = get_length_of_anything(arg3);
+    if (len1 == (size_t)(-1) || len2 == (size_t)(-1)) {
+      PyErr_Format(PyExc_ValueError,
+                   "%s second and third argument must specify sizes", name);
+      return NULL;
+    }
+
+    if ((runs = extract_runs(arg1)) != NULL) {
+      if (lev_runs_check_errors(len1, len2, n, runs)) {
+        free(runs);
+        PyErr_Format(PyExc_ValueError, "%s edit run list is invalid", name);
+        return NULL;
+      }
+      free(runs);
+      Py_INCREF(arg1);
+      return arg1;
+    }
+    if (!PyErr_Occurred() && (ops = extract_editops(arg1)) != NULL) {
+      if (lev_editops_check_errors(len1, len2, n, ops)) {
+        free(ops);
+        PyErr_Format(PyExc_ValueError,
+                     "%s edit operation list is invalid", name);
+        return NULL;
+      }
+      runs = lev_editops_to_runs(n, ops, &nr);
+      free(ops);
+    }
+    else if (!PyErr_Occurred() && (bops = extract_opcodes(arg1)) != NULL) {
+      if (lev_opcodes_check_errors(len1, len2, n, bops)) {
+        free(bops);
+        PyErr_Format(PyExc_ValueError,
+                     "%s edit operation list is invalid", name);
+        return NULL;
+      }
+      runs = lev_opcodes_to_runs(n, bops, &nr, 0);
+      free(bops);
+    }
+    else {
+      if (!PyErr_Occurred())
+        PyErr_Format(PyExc_TypeError,
+                     "%s first argument must be a List of edit operations",
+                     name);
+      return NULL;
+    }
+  }
+  /* find runs: we were called (s1, s2) */
+  else {
+    PyObject *pinned = PyList_New(0);
+    const void *s1, *s2;
+    LevEditOp *ops;
+    LevPriority priority;
+    int stringtype;
+
+    if (!pinned)
+      return NULL;
+    stringtype = get_two_strings(arg1, arg2, name, pinned,
+                                 &len1, &s1, &len2, &s2);
+    if (stringtype < 0) {
+      Py_DECREF(pinned);
+      return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    priority = lev_sched_begin();
+    if (stringtype == 0)
+      ops = lev_editops_find(len1, (const lev_byte*)s1,
+                             len2, (const lev_byte*)s2, &n);
+    else
+      ops = lev_u_editops_find(len1, (const Py_UNICODE*)s1,
+                               len2, (const Py_UNICODE*)s2, &n);
+    lev_sched_end(priority);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(pinned);
+    if (!ops && n)
+      return PyErr_NoMemory();
+    runs = lev_editops_to_runs(n, ops, &nr);
+    free(ops);
+  }
+
+  if (!runs && nr)
+    return PyErr_NoMemory();
+  result = runs_to_tuple_list(nr, runs);
+  free(runs);
+  return result;
+}
+
+static PyObject*
+runs_to_editops_py(PyObject *self, PyObject *args)
+{
+  const char *name = "runs_to_editops";
+  PyObject *arg1, *arg2, *arg3, *result;
+  LevEditRun *runs;
+  LevEditOp *ops;
+  size_t nr, n, len1, len2;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 3, 3, &arg1, &arg2, &arg3))
+    return NULL;
+  runs = extract_runs_arg(arg1, name, &nr);
+  if (!runs)
+    return PyErr_Occurred() ? NULL : PyList_New(0);
+  if (!check_runs_lengths(arg2, arg3, name, nr, runs, &len1, &len2)) {
+    free(runs);
+    return NULL;
+  }
+
+  ops = lev_runs_to_editops(nr, runs, &n, 1);
+  free(runs);
+  if (!ops && n)
+    return PyErr_NoMemory();
+  result = editops_to_tuple_list(n, ops);
+  free(ops);
+  return result;
+}
+
+static PyObject*
+runs_to_opcodes_py(PyObject *self, PyObject *args)
+{
+  const char *name = "runs_to_opcodes";
+  PyObject *arg1, *arg2, *arg3, *result;
+  LevEditRun *runs;
+  LevOpCode *bops;
+  size_t nr, nb, len1, len2;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 3, 3, &arg1, &arg2, &arg3))
+    return NULL;
+  runs = extract_runs_arg(arg1, name, &nr);
+  if (!runs && PyErr_Occurred())
+    return NULL;
+  if (!check_runs_lengths(arg2, arg3, name, nr, runs, &len1, &len2)) {
+    free(runs);
+    return NULL;
+  }
+
+  bops = lev_runs_to_opcodes(nr, runs, &nb, len1, len2);
+  free(runs);
+  if (!bops && nb)
+    return PyErr_NoMemory();
+  result = opcodes_to_tuple_list(nb, bops);
+  free(bops);
+  return result;
+}
+
+static PyObject*
+apply_runs_py(PyObject *self, PyObject *args)
+{
+  const char *name = "apply_runs";
+  PyObject *arg1, *arg2, *arg3, *result, *pinned;
+  LevEditRun *runs;
+  const void *s1, *s2;
+  size_t nr, len1, len2, len;
+  int stringtype;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 3, 3, &arg1, &arg2, &arg3))
+    return NULL;
+  pinned = PyList_New(0);
+  if (!pinned)
+    return NULL;
+  stringtype = get_two_strings(arg2, arg3, name, pinned,
+                               &len1, &s1, &len2, &s2);
+  if (stringtype < 0) {
+    Py_DECREF(pinned);
+    return NULL;
+  }
+  runs = extract_runs_arg(arg1, name, &nr);
+  if (!runs) {
+    Py_DECREF(pinned);
+    if (PyErr_Occurred())
+      return NULL;
+    Py_INCREF(arg2);
+    return arg2;
+  }
+  if (!check_runs_lengths(arg2, arg3, name, nr, runs, &len1, &len2)) {
+    Py_DECREF(pinned);
+    free(runs);
+    return NULL;
+  }
+
+  if (stringtype == 0) {
+    lev_byte *s = lev_runs_apply(len1, (const lev_byte*)s1,
+                                 len2, (const lev_byte*)s2,
+                                 nr, runs, &len);
+    free(runs);
+    Py_DECREF(pinned);
+    if (!s && len)
+      return PyErr_NoMemory();
+    result = PyBytes_FromStringAndSize((const char*)s, (Py_ssize_t)len);
+    free(s);
+  }
+  else {
+    Py_UNICODE *s = lev_u_runs_apply(len1, (const Py_UNICODE*)s1,
+                                     len2, (const Py_UNICODE*)s2,
+                                     nr, runs, &len);
+    free(runs);
+    Py_DECREF(pinned);
+    if (!s && len)
+      return PyErr_NoMemory();
+    result = PyUnicode_FromUnicode(s, (Py_ssize_t)len);
+    free(s);
+  }
+  return result;
+}
+
+static PyObject*
+inverse_runs_py(PyObject *self, PyObject *args)
+{
+  const char *name = "inverse_runs";
+  PyObject *arg1, *result;
+  LevEditRun *runs;
+  size_t nr;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 1, 1, &arg1))
+    return NULL;
+  runs = extract_runs_arg(arg1, name, &nr);
+  if (!runs)
+    return PyErr_Occurred() ? NULL : PyList_New(0);
+
+  lev_runs_invert(nr, runs);
+  result = runs_to_tuple_list(nr, runs);
+  free(runs);
+  return result;
+}
+
+static PyObject*
+runs_matching_blocks_py(PyObject *self, PyObject *args)
+{
+  const char *name = "runs_matching_blocks";
+  PyObject *arg1, *arg2, *arg3, *result, *item;
+  LevEditRun *runs;
+  LevMatchingBlock *mblocks;
+  size_t nr, nmb, i, len1, len2;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 3, 3, &arg1, &arg2, &arg3))
+    return NULL;
+  runs = extract_runs_arg(arg1, name, &nr);
+  if (!runs && PyErr_Occurred())
+    return NULL;
+  if (!check_runs_lengths(arg2, arg3, name, nr, runs, &len1, &len2)) {
+    free(runs);
+    return NULL;
+  }
+
+  mblocks = lev_runs_matching_blocks(len1, len2, nr, runs, &nmb);
+  free(runs);
+  if (!mblocks && nmb)
+    return PyErr_NoMemory();
+
+  /* difflib always emits a final empty block */
+  result = PyList_New((Py_ssize_t)nmb + 1);
+  if (!result) {
+    free(mblocks);
+    return NULL;
+  }
+  for (i = 0; i < nmb; i++) {
+    item = Py_BuildValue("(nnn)", (Py_ssize_t)mblocks[i].spos,
+                         (Py_ssize_t)mblocks[i].dpos,
+                         (Py_ssize_t)mblocks[i].len);
+    if (!item) {
+      free(mblocks);
+      Py_DECREF(result);
+      return NULL;
+    }
+    PyList_SET_ITEM(result, (Py_ssize_t)i, item);
+  }
+  free(mblocks);
+  item = Py_BuildValue("(nnn)", (Py_ssize_t)len1, (Py_ssize_t)len2,
+                       (Py_ssize_t)0);
+  if (!item) {
+    Py_DECREF(result);
+    return NULL;
+  }
+  PyList_SET_ITEM(result, (Py_ssize_t)nmb, item);
+  return result;
+}
+
+static PyObject*
+subtract_runs_py(PyObject *self, PyObject *args)
+{
+  const char *name = "subtract_runs";
+  PyObject *arg1, *arg2, *result;
+  LevEditRun *runs, *sub, *rem;
+  size_t nr, ns, nrem;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 2, 2, &arg1, &arg2))
+    return NULL;
+  if (!PyList_Check(arg1) || !PyList_Check(arg2)) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s expected two lists of edit runs", name);
+    return NULL;
+  }
+  ns = (size_t)PyList_GET_SIZE(arg2);
+  if (!ns) {
+    Py_INCREF(arg1);
+    return arg1;
+  }
+  nr = (size_t)PyList_GET_SIZE(arg1);
+  if (!nr) {
+    PyErr_Format(PyExc_ValueError,
+                 "%s subsequence is not a subsequence or is invalid", name);
+    return NULL;
+  }
+  runs = extract_runs(arg1);
+  if (!runs) {
+    if (!PyErr_Occurred())
+      PyErr_Format(PyExc_TypeError,
+                   "%s expected two lists of edit runs", name);
+    return NULL;
+  }
+  sub = extract_runs(arg2);
+  if (!sub) {
+    free(runs);
+    if (!PyErr_Occurred())
+      PyErr_Format(PyExc_TypeError,
+                   "%s expected two lists of edit runs", name);
+    return NULL;
+  }
+
+  rem = lev_runs_subtract(nr, runs, ns, sub, &nrem);
+  free(runs);
+  free(sub);
+  if (!rem && nrem == (size_t)(-1)) {
+    PyErr_Format(PyExc_ValueError,
+                 "%s subsequence is not a subsequence or is invalid", name);
+    return NULL;
+  }
+  result = runs_to_tuple_list(nrem, rem);
+  free(rem);
+  return result;
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Tuning
+ *
+ ****************************************************************************/
+/* {{{ */
+
+static PyObject*
+get_tuning_py(PyObject *self, PyObject *args)
+{
+  PyObject *dict;
+  const char *name;
+  size_t i;
+  LEV_UNUSED(self);
+
+  if (!PyArg_ParseTuple(args, ":get_tuning"))
+    return NULL;
+  dict = PyDict_New();
+  if (!dict)
+    return NULL;
+  for (i = 0; (name = lev_tuning_name(i)) != NULL; i++) {
+    PyObject *value = PyLong_FromSize_t(lev_tuning_get(name));
+
+    if (!value || PyDict_SetItemString(dict, name, value) < 0) {
+      Py_XDECREF(value);
+      Py_DECREF(dict);
+      return NULL;
+    }
+    Py_DECREF(value);
+  }
+  return dict;
+}
+
+static PyObject*
+set_tuning_py(PyObject *self, PyObject *args)
+{
+  const char *name;
+  Py_ssize_t value;
+  LEV_UNUSED(self);
+
+  if (!PyArg_ParseTuple(args, "sn:set_tuning", &name, &value))
+    return NULL;
+  if (value <= 0 || lev_tuning_set(name, (size_t)value)) {
+    PyErr_Format(PyExc_ValueError,
+                 "set_tuning unknown parameter %s or nonpositive value", name);
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+/* the tuning file name: $LEVENSHTEIN_TUNING, or levenshtein/tuning.cfg in
+ * the user configuration directory; None if there's no such directory */
+static PyObject*
+tuning_file_name(void)
+{
+  const char *env;
+  PyObject *dir, *filename;
+
+  env = getenv("LEVENSHTEIN_TUNING");
+  if (env && *env)
+    return PyUnicode_DecodeFSDefault(env);
+#ifdef _WIN32
+  env = getenv("APPDATA");
+  if (!env || !*env)
+    Py_RETURN_NONE;
+  dir = PyUnicode_DecodeFSDefault(env);
+  if (!dir)
+    return NULL;
+  filename = PyUnicode_FromFormat("%U\\levenshtein\\tuning.cfg", dir);
+#else
+  env = getenv("XDG_CONFIG_HOME");
+  if (env && *env) {
+    dir = PyUnicode_DecodeFSDefault(env);
+    if (!dir)
+      return NULL;
+    filename = PyUnicode_FromFormat("%U/levenshtein/tuning.cfg", dir);
+  }
+  else {
+    env = getenv("HOME");
+    if (!env || !*env)
+      Py_RETURN_NONE;
+    dir = PyUnicode_DecodeFSDefault(env);
+    if (!dir)
+      return NULL;
+    filename = PyUnicode_FromFormat("%U/.config/levenshtein/tuning.cfg", dir);
+  }
+#endif
+  Py_DECREF(dir);
+  return filename;
+}
+
+/* load the tuning file if it exists, a broken one only gives a warning */
+static int
+load_tuning(PyObject *filename)
+{
+  PyObject *encoded;
+  int bad;
+
+  if (filename == Py_None)
+    return 0;
+  encoded = PyUnicode_EncodeFSDefault(filename);
+  if (!encoded)
+    return -1;
+  bad = lev_tuning_load(PyBytes_AS_STRING(encoded));
+  Py_DECREF(encoded);
+  if (bad > 0)
+    return PyErr_WarnFormat(PyExc_RuntimeWarning, 1,
+                            "invalid tuning parameter at %U line %d",
+                            filename, bad);
+  return 0;
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Scheduling
+ *
+ ****************************************************************************/
+/* {{{ */
+
+static const char *priority_names[LEV_PRIORITY_LAST] = {
+  "interactive", "batch"
+};
+
+/* get the priority class named priorityname, NULL means interactive */
+static int
+get_priority(const char *priorityname, const char *name, LevPriority *priority)
+{
+  size_t i;
+
+  *priority = LEV_PRIORITY_INTERACTIVE;
+  if (!priorityname)
+    return 0;
+  for (i = 0; i < LEV_PRIORITY_LAST; i++) {
+    if (!strcmp(priorityname, priority_names[i])) {
+      *priority = (LevPriority)i;
+      return 0;
+    }
+  }
+  PyErr_Format(PyExc_ValueError,
+               "%s priority must be 'interactive' or 'batch'", name);
+  return -1;
+}
+
+static PyObject*
+sched_stats_to_dict(const LevSchedStats *stats)
+{
+  return Py_BuildValue("{snsnsnsnsdsd}",
+                       "calls", (Py_ssize_t)stats->calls,
+                       "running", (Py_ssize_t)stats->running,
+                       "waiting", (Py_ssize_t)stats->waiting,
+                       "pauses", (Py_ssize_t)stats->pauses,
+                       "wait", stats->wait,
+                       "max_wait", stats->max_wait);
+}
+
+static PyObject*
+scheduler_stats_py(PyObject *self, PyObject *args)
+{
+  PyObject *dict;
+  size_t i;
+  LEV_UNUSED(self);
+
+  if (!PyArg_ParseTuple(args, ":scheduler_stats"))
+    return NULL;
+  dict = PyDict_New();
+  if (!dict)
+    return NULL;
+  for (i = 0; i < LEV_PRIORITY_LAST; i++) {
+    LevSchedStats stats;
+    PyObject *value;
+
+    lev_sched_stats((LevPriority)i, &stats);
+    value = sched_stats_to_dict(&stats);
+    if (!value || PyDict_SetItemString(dict, priority_names[i], value) < 0) {
+      Py_XDECREF(value);
+      Py_DECREF(dict);
+      return NULL;
+    }
+    Py_DECREF(value);
+  }
+  return dict;
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Grapheme clusters
+ *
+ ****************************************************************************/
+/* {{{ */
+
+static PyObject*
+graphemes_py(PyObject *self, PyObject *args)
+{
+  const char *name = "graphemes";
+  PyObject *arg, *pinned, *list = NULL;
+  LevGraphemes clusters;
+  const void *s;
+  size_t len, i;
+  int stringtype;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 1, 1, &arg))
+    return NULL;
+  pinned = PyList_New(0);
+  if (!pinned)
+    return NULL;
+  stringtype = get_string(arg, name, pinned, &len, &s);
+  if (stringtype != 1) {
+    if (stringtype != -1)
+      PyErr_Format(PyExc_TypeError, "%s expected a Unicode", name);
+    Py_DECREF(pinned);
+    return NULL;
+  }
+  if (lev_grapheme_split(1, &len, (const Py_UNICODE**)&s, &clusters) < 0) {
+    Py_DECREF(pinned);
+    return PyErr_NoMemory();
+  }
+  list = PyList_New((Py_ssize_t)clusters.n);
+  for (i = 0; list && i < clusters.n; i++) {
+    PyObject *item
+      = PyUnicode_FromUnicode((const Py_UNICODE*)s + clusters.bounds[i],
+                              (Py_ssize_t)(clusters.bounds[i + 1]
+                                           - clusters.bounds[i]));
+    if (!item)
+      Py_CLEAR(list);
+    else
+      PyList_SET_ITEM(list, (Py_ssize_t)i, item);
+  }
+  lev_grapheme_free(1, &clusters);
+  Py_DECREF(pinned);
+  return list;
+}
+
+/* split two Unicode string arguments to grapheme clusters, returns -1 on
+ * failure (an exception is set) */
+static int
+get_two_graphemes(PyObject *args, const char *name, LevGraphemes *clusters)
+{
+  PyObject *arg1, *arg2, *pinned;
+  const void *strings[2];
+  size_t lengths[2];
+  int stringtype, r;
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 2, 2, &arg1, &arg2))
+    return -1;
+  pinned = PyList_New(0);
+  if (!pinned)
+    return -1;
+  stringtype = get_two_strings(arg1, arg2, name, pinned,
+                               lengths, strings, lengths + 1, strings + 1);
+  if (stringtype != 1) {
+    if (stringtype == 0)
+      PyErr_Format(PyExc_TypeError,
+                   "%s grapheme clusters need two Unicodes", name);
+    Py_DECREF(pinned);
+    return -1;
+  }
+  r = lev_grapheme_split(2, lengths, (const Py_UNICODE**)strings, clusters);
+  Py_DECREF(pinned);
+  if (r < 0)
+    PyErr_NoMemory();
+  return r;
+}
+
+static PyObject*
+grapheme_distance_py(PyObject *self, PyObject *args)
+{
+  LevGraphemes clusters[2];
+  size_t d;
+  LEV_UNUSED(self);
+
+  if (get_two_graphemes(args, "grapheme_distance", clusters) < 0)
+    return NULL;
+  d = lev_u_edit_distance(clusters[0].n, clusters[0].ids,
+                          clusters[1].n, clusters[1].ids, 0);
+  lev_grapheme_free(2, clusters);
+  if (d == (size_t)(-1))
+    return PyErr_NoMemory();
+  return PyLong_FromSize_t(d);
+}
+
+static PyObject*
+grapheme_ratio_py(PyObject *self, PyObject *args)
+{
+  LevGraphemes clusters[2];
+  size_t d, lensum;
+  LEV_UNUSED(self);
+
+  if (get_two_graphemes(args, "grapheme_ratio", clusters) < 0)
+    return NULL;
+  lensum = clusters[0].n + clusters[1].n;
+  d = lev_u_edit_distance(clusters[0].n, clusters[0].ids,
+                          clusters[1].n, clusters[1].ids, 1);
+  lev_grapheme_free(2, clusters);
+  if (d == (size_t)(-1))
+    return PyErr_NoMemory();
+  if (!lensum)
+    return PyFloat_FromDouble(1.0);
+  return PyFloat_FromDouble((double)(lensum - d)/(double)lensum);
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * Line sets
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/* @n size_t values as bytes of 64 bit integers */
+static PyObject*
+size_array_to_bytes(size_t n, const size_t *values)
+{
+  PyObject *result;
+  int64_t *p;
+  size_t i;
+
+  if (n > (size_t)PY_SSIZE_T_MAX/sizeof(int64_t))
+    return PyErr_NoMemory();
+  result = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)(n*sizeof(int64_t)));
+  if (!result)
+    return NULL;
+  p = (int64_t*)PyBytes_AS_STRING(result);
+  for (i = 0; i < n; i++)
+    p[i] = (int64_t)values[i];
+  return result;
+}
+
+static PyObject*
+scan_lines_py(PyObject *self, PyObject *args)
+{
+  PyObject *arg, *lines, *result = NULL;
+  Py_buffer view;
+  LevLineSet set;
+  size_t i;
+  int r;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, "scan_lines", 1, 1, &arg))
+    return NULL;
+  if (PyObject_GetBuffer(arg, &view, PyBUF_SIMPLE) < 0)
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  r = lev_line_set_scan((size_t)view.len, (const char*)view.buf, &set);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&view);
+  if (r < 0)
+    return PyErr_NoMemory();
+
+  lines = PyList_New((Py_ssize_t)set.n);
+  for (i = 0; lines && i < set.n; i++) {
+    PyObject *line
+      = PyUnicode_DecodeUTF8(set.lines + set.bounds[i],
+                             (Py_ssize_t)(set.bounds[i + 1] - set.bounds[i]),
+                             "surrogateescape");
+    if (!line)
+      Py_CLEAR(lines);
+    else
+      PyList_SET_ITEM(lines, (Py_ssize_t)i, line);
+  }
+  if (lines)
+    result = Py_BuildValue("(NNNNN)", lines,
+                           size_array_to_bytes(set.n, set.counts),
+                           size_array_to_bytes(set.n, set.first),
+                           size_array_to_bytes(set.n, set.offsets),
+                           size_array_to_bytes(set.nlines, set.keys));
+  lev_line_set_free(&set);
+  return result;
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * DeleteIndex type
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/* the tag of an index tells which string type it was built from */
+#define DELETE_INDEX_UNICODE 0
+#define DELETE_INDEX_BYTES 1
+
+typedef struct {
+  PyObject_HEAD
+  LevDeleteIndex *index;
+} DeleteIndexObject;
+
+static PyTypeObject DeleteIndexType;
+
+/* get @obj as a lev_wchar string; bytes are widened to a newly allocated
+ * buffer that is stored to @buf (and must be freed), @buf is set to NULL
+ * otherwise.  @stringtype is the type the string must have. */
+static const lev_wchar*
+delete_index_string(PyObject *obj, const char *name, int stringtype,
+                    size_t *len, lev_wchar **buf)
+{
+  int want = stringtype == DELETE_INDEX_BYTES ? 0 : 1;
+  PyObject *pinned;
+  const void *s;
+  size_t i;
+  int t;
+
+  *buf = NULL;
+  if (want && PyObject_TypeCheck(obj, &PyUnicode_Type)) {
+    *len = (size_t)PyUnicode_GET_SIZE(obj);
+    return PyUnicode_AS_UNICODE(obj);
+  }
+  /* anything else is copied, words are short */
+  pinned = PyList_New(0);
+  if (!pinned)
+    return NULL;
+  t = get_string(obj, name, pinned, len, &s);
+  if (t != want) {
+    Py_DECREF(pinned);
+    if (t != -1)
+      PyErr_Format(PyExc_TypeError, "%s expected a %s", name,
+                   want ? "Unicode" : "String");
+    return NULL;
+  }
+  *buf = (lev_wchar*)safe_malloc(*len + 1, sizeof(lev_wchar));
+  for (i = 0; *buf && i < *len; i++)
+    (*buf)[i] = t ? (lev_wchar)((const Py_UNICODE*)s)[i]
+                  : (lev_wchar)((const lev_byte*)s)[i];
+  Py_DECREF(pinned);
+  if (!*buf)
+    return (const lev_wchar*)PyErr_NoMemory();
+  return *buf;
+}
+
+static int
+DeleteIndex_init(DeleteIndexObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = { "words", "max_k", "freqs", "threads", "priority",
+                            NULL };
+  const char *name = "DeleteIndex", *priorityname = NULL;
+  PyObject *wordlist, *flist = NULL;
+  Py_ssize_t max_k = 2, nthreads = 0;
+  LevPriority priority, oldpriority;
+  size_t n, i, j;
+  StringList sl;
+  lev_wchar **wide = NULL;
+  double *freqs;
+  int stringtype;
+  LevDeleteIndex *index;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|nOnz", kwlist,
+                                   &wordlist, &max_k, &flist, &nthreads,
+                                   &priorityname)
+      || get_priority(priorityname, name, &priority) < 0)
+    return -1;
+  if (max_k < 0 || nthreads < 0) {
+    PyErr_Format(PyExc_ValueError,
+                 "%s max_k and threads must not be negative", name);
+    return -1;
+  }
+  if (flist == Py_None)
+    flist = NULL;
+  if (!PySequence_Check(wordlist)) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s first argument must be a Sequence", name);
+    return -1;
+  }
+  stringtype = extract_strings(wordlist, name, &sl);
+  if (stringtype < 0) {
+    release_strings(&sl);
+    return -1;
+  }
+  n = sl.n;
+  if (n == 0) {
+    release_strings(&sl);
+    PyErr_Format(PyExc_ValueError, "%s needs at least one word", name);
+    return -1;
+  }
+  freqs = extract_weightlist(flist, name, n);
+  if (!freqs) {
+    release_strings(&sl);
+    return -1;
+  }
+
+  /* the index works with lev_wchar symbols only */
+  if (stringtype == 0) {
+    wide = (lev_wchar**)calloc(n, sizeof(lev_wchar*));
+    for (i = 0; wide && i < n; i++) {
+      wide[i] = (lev_wchar*)safe_malloc(sl.sizes[i] + 1, sizeof(lev_wchar));
+      if (!wide[i])
+        break;
+      for (j = 0; j < sl.sizes[i]; j++)
+        wide[i][j] = (lev_wchar)((lev_byte**)sl.strings)[i][j];
+    }
+    if (!wide || i < n) {
+      for (j = 0; wide && j < n; j++)
+        free(wide[j]);
+      free(wide);
+      release_strings(&sl);
+      free(freqs);
+      PyErr_NoMemory();
+      return -1;
+    }
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  oldpriority = lev_priority_set(priority);
+  index = lev_delete_index_new(n, sl.sizes,
+                               wide ? (const lev_wchar**)wide
+                                    : (const lev_wchar**)sl.strings,
+                               freqs, (size_t)max_k, (size_t)nthreads,
+                               stringtype == 0 ? DELETE_INDEX_BYTES
+                                               : DELETE_INDEX_UNICODE);
+  lev_priority_set(oldpriority);
+  Py_END_ALLOW_THREADS
+
+  if (wide) {
+    for (i = 0; i < n; i++)
+      free(wide[i]);
+    free(wide);
+  }
+  release_strings(&sl);
+  free(freqs);
+  if (!index) {
+    PyErr_Format(PyExc_MemoryError, "%s cannot allocate the index", name);
+    return -1;
+  }
+  lev_delete_index_free(self->index);
+  self->index = index;
+  return 0;
+}
+
+static void
+DeleteIndex_dealloc(DeleteIndexObject *self)
+{
+  lev_delete_index_free(self->index);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int
+DeleteIndex_check(DeleteIndexObject *self)
+{
+  if (!self->index) {
+    PyErr_SetString(PyExc_ValueError, "DeleteIndex is not initialized");
+    return 0;
+  }
+  return 1;
+}
+
+/* make a string of the type @stringtype of index symbols */
+static PyObject*
+symbols_to_string(int stringtype, size_t len, const uint32_t *w)
+{
+  PyObject *result;
+  size_t i;
+
+  if (stringtype == DELETE_INDEX_BYTES) {
+    lev_byte *s = (lev_byte*)safe_malloc(len + 1, sizeof(lev_byte));
+    if (!s)
+      return PyErr_NoMemory();
+    for (i = 0; i < len; i++)
+      s[i] = (lev_byte)w[i];
+    result = PyBytes_FromStringAndSize((const char*)s, (Py_ssize_t)len);
+    free(s);
+  }
+  else {
+    Py_UNICODE *s = (Py_UNICODE*)safe_malloc(len + 1, sizeof(Py_UNICODE));
+    if (!s)
+      return PyErr_NoMemory();
+    for (i = 0; i < len; i++)
+      s[i] = (Py_UNICODE)w[i];
+    result = PyUnicode_FromUnicode(s, (Py_ssize_t)len);
+    free(s);
+  }
+  return result;
+}
+
+static PyObject*
+DeleteIndex_word(DeleteIndexObject *self, size_t id, double *freq)
+{
+  size_t len;
+  const uint32_t *w = lev_delete_index_word(self->index, id, &len, freq);
+
+  return symbols_to_string((int)lev_delete_index_tag(self->index), len, w);
+}
+
+static PyObject*
+DeleteIndex_lookup(DeleteIndexObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = { "word", "max_k", NULL };
+  const char *name = "lookup";
+  PyObject *word, *maxobj = Py_None;
+  PyObject *result;
+  size_t max_k, len, n, i;
+  const lev_wchar *s;
+  lev_wchar *buf;
+  LevDeleteMatch *matches;
+  LevPriority priority;
+
+  if (!DeleteIndex_check(self))
+    return NULL;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", kwlist,
+                                   &word, &maxobj))
+    return NULL;
+  max_k = lev_delete_index_max_k(self->index);
+  if (maxobj != Py_None) {
+    Py_ssize_t k = PyNumber_AsSsize_t(maxobj, PyExc_OverflowError);
+    if (k == -1 && PyErr_Occurred())
+      return NULL;
+    if (k < 0 || (size_t)k > max_k) {
+      PyErr_Format(PyExc_ValueError,
+                   "%s max_k must be between 0 and %zu", name, max_k);
+      return NULL;
+    }
+    max_k = (size_t)k;
+  }
+  s = delete_index_string(word, name, (int)lev_delete_index_tag(self->index),
+                          &len, &buf);
+  if (!s)
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  priority = lev_sched_begin();
+  matches = lev_delete_index_lookup(self->index, len, s, max_k, &n);
+  lev_sched_end(priority);
+  Py_END_ALLOW_THREADS
+  free(buf);
+  if (!matches && n)
+    return PyErr_NoMemory();
+
+  result = PyList_New((Py_ssize_t)n);
+  if (!result) {
+    free(matches);
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    double freq;
+    PyObject *w = DeleteIndex_word(self, matches[i].id, &freq);
+    PyObject *item;
+
+    if (!w) {
+      Py_DECREF(result);
+      free(matches);
+      return NULL;
+    }
+    item = Py_BuildValue("(Nnd)", w, (Py_ssize_t)matches[i].distance, freq);
+    if (!item) {
+      Py_DECREF(result);
+      free(matches);
+      return NULL;
+    }
+    PyList_SET_ITEM(result, (Py_ssize_t)i, item);
+  }
+  free(matches);
+  return result;
+}
+
+static PyObject*
+DeleteIndex_clusters(DeleteIndexObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = { "max_k", "threads", "priority", NULL };
+  const char *name = "clusters", *priorityname = NULL;
+  PyObject *maxobj = Py_None;
+  PyObject *result;
+  Py_ssize_t nthreads = 0;
+  LevPriority priority, oldpriority;
+  size_t max_k, n, i;
+  size_t *clusters;
+  int r;
+
+  if (!DeleteIndex_check(self))
+    return NULL;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Onz", kwlist,
+                                   &maxobj, &nthreads, &priorityname)
+      || get_priority(priorityname, name, &priority) < 0)
+    return NULL;
+  max_k = lev_delete_index_max_k(self->index);
+  if (maxobj != Py_None) {
+    Py_ssize_t k = PyNumber_AsSsize_t(maxobj, PyExc_OverflowError);
+    if (k == -1 && PyErr_Occurred())
+      return NULL;
+    if (k < 0 || (size_t)k > max_k) {
+      PyErr_Format(PyExc_ValueError,
+                   "%s max_k must be between 0 and %zu", name, max_k);
+      return NULL;
+    }
+    max_k = (size_t)k;
+  }
+  if (nthreads < 0) {
+    PyErr_Format(PyExc_ValueError, "%s threads must be nonnegative", name);
+    return NULL;
+  }
+
+  n = lev_delete_index_size(self->index);
+  clusters = (size_t*)safe_malloc(n + 1, sizeof(size_t));
+  if (!clusters)
+    return PyErr_NoMemory();
+  Py_BEGIN_ALLOW_THREADS
+  oldpriority = lev_priority_set(priority);
+  r = lev_delete_index_clusters(self->index, max_k, (size_t)nthreads,
+                                clusters);
+  lev_priority_set(oldpriority);
+  Py_END_ALLOW_THREADS
+  if (r) {
+    free(clusters);
+    return PyErr_NoMemory();
+  }
+
+  result = PyList_New((Py_ssize_t)n);
+  if (!result) {
+    free(clusters);
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    PyObject *item = PyLong_FromSize_t(clusters[i]);
+    if (!item) {
+      Py_DECREF(result);
+      free(clusters);
+      return NULL;
+    }
+    PyList_SET_ITEM(result, (Py_ssize_t)i, item);
+  }
+  free(clusters);
+  return result;
+}
+
+static PyObject*
+DeleteIndex_save(DeleteIndexObject *self, PyObject *args)
+{
+  PyObject *filename;
+  int r;
+
+  if (!DeleteIndex_check(self))
+    return NULL;
+  if (!PyArg_ParseTuple(args, "O&", PyUnicode_FSConverter, &filename))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  r = lev_delete_index_save(self->index, PyBytes_AS_STRING(filename));
+  Py_END_ALLOW_THREADS
+  if (r) {
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filename);
+    Py_DECREF(filename);
+    return NULL;
+  }
+  Py_DECREF(filename);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+DeleteIndex_load(PyObject *cls, PyObject *args)
+{
+  PyObject *filename;
+  DeleteIndexObject *self;
+  LevDeleteIndex *index;
+
+  if (!PyArg_ParseTuple(args, "O&", PyUnicode_FSConverter, &filename))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  index = lev_delete_index_load(PyBytes_AS_STRING(filename));
+  Py_END_ALLOW_THREADS
+  if (!index) {
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filename);
+    Py_DECREF(filename);
+    return NULL;
+  }
+  Py_DECREF(filename);
+
+  self = (DeleteIndexObject*)((PyTypeObject*)cls)->tp_alloc((PyTypeObject*)cls, 0);
+  if (!self) {
+    lev_delete_index_free(index);
+    return NULL;
+  }
+  self->index = index;
+  return (PyObject*)self;
+}
+
+static Py_ssize_t
+DeleteIndex_len(DeleteIndexObject *self)
+{
+  if (!DeleteIndex_check(self))
+    return -1;
+  return (Py_ssize_t)lev_delete_index_size(self->index);
+}
+
+static PyObject*
+DeleteIndex_get_max_k(DeleteIndexObject *self, void *closure)
+{
+  LEV_UNUSED(closure);
+  if (!DeleteIndex_check(self))
+    return NULL;
+  return PyLong_FromSize_t(lev_delete_index_max_k(self->index));
+}
+
+#define DeleteIndex_DESC \
+  "Symmetric delete index for fast spelling correction.\n" \
+  "\n" \
+  "DeleteIndex(words[, max_k=2, freqs=None, threads=0,\n" \
+  "            priority='interactive'])\n" \
+  "\n" \
+  "Indexes all strings obtainable by deleting at most max_k characters\n" \
+  "from the words, so lookups of words within edit distance max_k are\n" \
+  "mostly hash lookups instead of distance computations.  The index size\n" \
+  "grows quickly with max_k, it's meant for small max_k (1-3).\n" \
+  "\n" \
+  "The optional freqs are used to order words at the same distance, more\n" \
+  "frequent first.  The index is built using the given number of threads,\n" \
+  "zero means one per processor, and the priority (see\n" \
+  "token_ratio_batch()).  Words can be strings or bytes, the queries have\n" \
+  "to be of the same type.\n" \
+  "\n" \
+  "Examples:\n" \
+  "\n" \
+  ">>> index = DeleteIndex(['spam', 'spar', 'park', 'eggs'], 2, [5, 9, 1, 1])\n" \
+  ">>> index.lookup('spak')\n" \
+  "[('spar', 1, 9.0), ('spam', 1, 5.0), ('park', 2, 1.0)]\n"
+
+#define DeleteIndex_lookup_DESC \
+  "Find words within Levenshtein distance max_k from a word.\n" \
+  "\n" \
+  "lookup(word[, max_k])\n" \
+  "\n" \
+  "Returns a list of (word, distance, frequency) tuples sorted by the\n" \
+  "distance and then by frequency, most frequent first.  The max_k\n" \
+  "defaults to (and can't exceed) the max_k of the index.\n"
+
+#define DeleteIndex_clusters_DESC \
+  "Cluster the indexed words by edit distance.\n" \
+  "\n" \
+  "clusters([max_k, threads=0, priority='interactive'])\n" \
+  "\n" \
+  "Words are in the same cluster when a chain of words, each within\n" \
+  "Levenshtein distance max_k from the next, connects them.  Returns a\n" \
+  "list with the cluster of each word, identified by the index of its\n" \
+  "first word.  The max_k defaults to (and can't exceed) the max_k of\n" \
+  "the index.\n" \
+  "\n" \
+  ">>> DeleteIndex(['spam', 'eggs', 'spar', 'park', 'egg']).clusters(1)\n" \
+  "[0, 1, 0, 3, 1]\n"
+
+#define DeleteIndex_save_DESC \
+  "Save the index to a file.\n" \
+  "\n" \
+  "save(filename)\n" \
+  "\n" \
+  "The file is in the native byte order and can be loaded with load().\n"
+
+#define DeleteIndex_load_DESC \
+  "Load an index saved with save().\n" \
+  "\n" \
+  "DeleteIndex.load(filename)\n" \
+  "\n" \
+  "The file is memory mapped, so loading is cheap and processes using\n" \
+  "the same index file share its memory.\n"
+
+static PyMethodDef DeleteIndex_methods[] = {
+  { "lookup", (PyCFunction)(void(*)(void))DeleteIndex_lookup,
+    METH_VARARGS | METH_KEYWORDS, DeleteIndex_lookup_DESC },
+  { "clusters", (PyCFunction)(void(*)(void))DeleteIndex_clusters,
+    METH_VARARGS | METH_KEYWORDS, DeleteIndex_clusters_DESC },
+  { "save", (PyCFunction)DeleteIndex_save, METH_VARARGS,
+    DeleteIndex_save_DESC },
+  { "load", (PyCFunction)DeleteIndex_load, METH_VARARGS | METH_CLASS,
+    DeleteIndex_load_DESC },
+  { NULL, NULL, 0, NULL },
+};
+
+static PyGetSetDef DeleteIndex_getset[] = {
+  { "max_k", (getter)DeleteIndex_get_max_k, NULL,
+    "The maximum distance the index can be queried for.", NULL },
+  { NULL, NULL, NULL, NULL, NULL },
+};
+
+static PySequenceMethods DeleteIndex_as_sequence = {
+  .sq_length = (lenfunc)DeleteIndex_len,
+};
+
+static PyTypeObject DeleteIndexType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "Levenshtein._levenshtein.DeleteIndex",
+  .tp_basicsize = sizeof(DeleteIndexObject),
+  .tp_dealloc = (destructor)DeleteIndex_dealloc,
+  .tp_as_sequence = &DeleteIndex_as_sequence,
+  .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_doc = DeleteIndex_DESC,
+  .tp_methods = DeleteIndex_methods,
+  .tp_getset = DeleteIndex_getset,
+  .tp_init = (initproc)DeleteIndex_init,
+  .tp_new = PyType_GenericNew,
+};
+/* }}} */
+
+/****************************************************************************
+ *
+ * DynamicIndex type
+ *
+ ****************************************************************************/
+/* {{{ */
+
+typedef struct {
+  PyObject_HEAD
+  LevDynamicIndex *index;
+  int stringtype;  /* of the words, -1 until the first insert */
+} DynamicIndexObject;
+
+typedef struct {
+  PyObject_HEAD
+  DynamicIndexObject *owner;
+  LevDynamicSnapshot *snap;
+} DynamicSnapshotObject;
+
+static PyTypeObject DynamicIndexType;
+static PyTypeObject DynamicSnapshotType;
+
+static int
+DynamicIndex_check(DynamicIndexObject *self)
+{
+  if (!self->index) {
+    PyErr_SetString(PyExc_ValueError, "DynamicIndex is not initialized");
+    return 0;
+  }
+  return 1;
+}
+
+static PyObject*
+DynamicIndex_insert(DynamicIndexObject *self, PyObject *args)
+{
+  const char *name = "insert";
+  PyObject *word;
+  const lev_wchar *s;
+  lev_wchar *buf;
+  size_t len, id;
+  int stringtype, r;
+
+  if (!DynamicIndex_check(self))
+    return NULL;
+  if (!PyArg_ParseTuple(args, "O:insert", &word))
+    return NULL;
+  stringtype = self->stringtype;
+  if (stringtype < 0) {
+    stringtype = string_type(word, name);
+    if (stringtype < 0)
+      return NULL;
+    stringtype = stringtype ? DELETE_INDEX_UNICODE : DELETE_INDEX_BYTES;
+  }
+  s = delete_index_string(word, name, stringtype, &len, &buf);
+  if (!s)
+    return NULL;
+  self->stringtype = stringtype;
+
+  Py_BEGIN_ALLOW_THREADS
+  r = lev_dynamic_index_insert(self->index, len, s, &id);
+  Py_END_ALLOW_THREADS
+  free(buf);
+  if (r)
+    return PyErr_NoMemory();
+  return PyLong_FromSize_t(id);
+}
+
+static PyObject*
+DynamicIndex_delete(DynamicIndexObject *self, PyObject *args)
+{
+  Py_ssize_t id;
+  int r;
+
+  if (!DynamicIndex_check(self))
+    return NULL;
+  if (!PyArg_ParseTuple(args, "n:delete", &id))
+    return NULL;
+  if (id < 0) {
+    PyErr_Format(PyExc_KeyError, "%zd", id);
+    return NULL;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  r = lev_dynamic_index_delete(self->index, (size_t)id);
+  Py_END_ALLOW_THREADS
+  if (r < 0)
+    return PyErr_NoMemory();
+  if (r > 0) {
+    PyErr_Format(PyExc_KeyError, "%zd", id);
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+DynamicIndex_compact(DynamicIndexObject *self, PyObject *args,
+                     PyObject *kwargs)
+{
+  static char *kwlist[] = { "full", "threads", "priority", NULL };
+  const char *priorityname = NULL;
+  LevPriority priority, oldpriority;
+  int full = 0, r;
+  Py_ssize_t nthreads = 0;
+
+  if (!DynamicIndex_check(self))
+    return NULL;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|pnz:compact", kwlist,
+                                   &full, &nthreads, &priorityname)
+      || get_priority(priorityname, "compact", &priority) < 0)
+    return NULL;
+  if (nthreads < 0) {
+    PyErr_SetString(PyExc_ValueError,
+                    "compact threads must not be negative");
+    return NULL;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  oldpriority = lev_priority_set(priority);
+  r = lev_dynamic_index_compact(self->index, full, (size_t)nthreads);
+  lev_priority_set(oldpriority);
+  Py_END_ALLOW_THREADS
+  if (r)
+    return PyErr_NoMemory();
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+DynamicIndex_snapshot(DynamicIndexObject *self, PyObject *args)
+{
+  DynamicSnapshotObject *snap;
+  LEV_UNUSED(args);
+
+  if (!DynamicIndex_check(self))
+    return NULL;
+  snap = PyObject_New(DynamicSnapshotObject, &DynamicSnapshotType);
+  if (!snap)
+    return NULL;
+  Py_INCREF(self);
+  snap->owner = self;
+  snap->snap = lev_dynamic_index_snapshot(self->index);
+  return (PyObject*)snap;
+}
+
+/* look @args up in @snap of @owner's index */
+static PyObject*
+dynamic_lookup(DynamicIndexObject *owner, LevDynamicSnapshot *snap,
+               PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = { "word", "max_k", NULL };
+  const char *name = "lookup";
+  PyObject *word, *maxobj = Py_None;
+  PyObject *result;
+  size_t max_k, len, n, i;
+  const lev_wchar *s;
+  lev_wchar *buf;
+  LevDeleteMatch *matches;
+  LevPriority priority;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", kwlist,
+                                   &word, &maxobj))
+    return NULL;
+  max_k = lev_dynamic_index_max_k(owner->index);
+  if (maxobj != Py_None) {
+    Py_ssize_t k = PyNumber_AsSsize_t(maxobj, PyExc_OverflowError);
+    if (k == -1 && PyErr_Occurred())
+      return NULL;
+    if (k < 0 || (size_t)k > max_k) {
+      PyErr_Format(PyExc_ValueError,
+                   "%s max_k must be between 0 and %zu", name, max_k);
+      return NULL;
+    }
+    max_k = (size_t)k;
+  }
+  if (owner->stringtype < 0)
+    return string_type(word, name) < 0 ? NULL : PyList_New(0);
+  s = delete_index_string(word, name, owner->stringtype, &len, &buf);
+  if (!s)
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  priority = lev_sched_begin();
+  matches = lev_dynamic_snapshot_lookup(snap, len, s, max_k, &n);
+  lev_sched_end(priority);
+  Py_END_ALLOW_THREADS
+  free(buf);
+  if (!matches)
+    return PyErr_NoMemory();
+
+  result = PyList_New((Py_ssize_t)n);
+  if (!result) {
+    free(matches);
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    const uint32_t *w = lev_dynamic_snapshot_word(snap, matches[i].id, &len);
+    PyObject *word = symbols_to_string(owner->stringtype, len, w);
+    PyObject *item;
+
+    if (!word) {
+      Py_DECREF(result);
+      free(matches);
+      return NULL;
+    }
+    item = Py_BuildValue("(Nnn)", word, (Py_ssize_t)matches[i].distance,
+                         (Py_ssize_t)matches[i].id);
+    if (!item) {
+      Py_DECREF(result);
+      free(matches);
+      return NULL;
+    }
+    PyList_SET_ITEM(result, (Py_ssize_t)i, item);
+  }
+  free(matches);
+  return result;
+}
+
+static PyObject*
+DynamicIndex_lookup(DynamicIndexObject *self, PyObject *args,
+                    PyObject *kwargs)
+{
+  LevDynamicSnapshot *snap;
+  PyObject *result;
+
+  if (!DynamicIndex_check(self))
+    return NULL;
+  snap = lev_dynamic_index_snapshot(self->index);
+  result = dynamic_lookup(self, snap, args, kwargs);
+  lev_dynamic_snapshot_release(snap);
+  return result;
+}
+
+static int
+DynamicIndex_init(DynamicIndexObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = { "words", "max_k", NULL };
+  PyObject *words = Py_None, *iter, *item;
+  Py_ssize_t max_k = 2;
+  LevDynamicIndex *index;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|On", kwlist,
+                                   &words, &max_k))
+    return -1;
+  if (max_k < 0) {
+    PyErr_SetString(PyExc_ValueError,
+                    "DynamicIndex max_k must not be negative");
+    return -1;
+  }
+  if (self->index) {
+    PyErr_SetString(PyExc_ValueError, "DynamicIndex is initialized");
+    return -1;
+  }
+  index = lev_dynamic_index_new((size_t)max_k);
+  if (!index) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  self->index = index;
+  self->stringtype = -1;
+  if (words == Py_None)
+    return 0;
+
+  iter = PyObject_GetIter(words);
+  if (!iter)
+    return -1;
+  while ((item = PyIter_Next(iter))) {
+    PyObject *id = PyObject_CallMethod((PyObject*)self, "insert", "O", item);
+
+    Py_DECREF(item);
+    if (!id) {
+      Py_DECREF(iter);
+      return -1;
+    }
+    Py_DECREF(id);
+  }
+  Py_DECREF(iter);
+  return PyErr_Occurred() ? -1 : 0;
+}
+
+static void
+DynamicIndex_dealloc(DynamicIndexObject *self)
+{
+  lev_dynamic_index_free(self->index);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static Py_ssize_t
+DynamicIndex_len(DynamicIndexObject *self)
+{
+  LevDynamicSnapshot *snap;
+  size_t n;
+
+  if (!DynamicIndex_check(self))
+    return -1;
+  snap = lev_dynamic_index_snapshot(self->index);
+  n = lev_dynamic_snapshot_size(snap);
+  lev_dynamic_snapshot_release(snap);
+  return (Py_ssize_t)n;
+}
+
+static PyObject*
+DynamicIndex_get_max_k(DynamicIndexObject *self, void *closure)
+{
+  LEV_UNUSED(closure);
+  if (!DynamicIndex_check(self))
+    return NULL;
+  return PyLong_FromSize_t(lev_dynamic_index_max_k(self->index));
+}
+
+static void
+DynamicSnapshot_dealloc(DynamicSnapshotObject *self)
+{
+  lev_dynamic_snapshot_release(self->snap);
+  Py_DECREF(self->owner);
+  PyObject_Del(self);
+}
+
+static PyObject*
+DynamicSnapshot_lookup(DynamicSnapshotObject *self, PyObject *args,
+                       PyObject *kwargs)
+{
+  return dynamic_lookup(self->owner, self->snap, args, kwargs);
+}
+
+static Py_ssize_t
+DynamicSnapshot_len(DynamicSnapshotObject *self)
+{
+  return (Py_ssize_t)lev_dynamic_snapshot_size(self->snap);
+}
+
+static PyObject*
+DynamicSnapshot_getitem(DynamicSnapshotObject *self, PyObject *key)
+{
+  Py_ssize_t id = PyNumber_AsSsize_t(key, PyExc_OverflowError);
+  const uint32_t *w = NULL;
+  size_t len;
+
+  if (id == -1 && PyErr_Occurred())
+    return NULL;
+  if (id >= 0)
+    w = lev_dynamic_snapshot_word(self->snap, (size_t)id, &len);
+  if (!w) {
+    PyErr_SetObject(PyExc_KeyError, key);
+    return NULL;
+  }
+  return symbols_to_string(self->owner->stringtype, len, w);
+}
+
+static PyObject*
+DynamicSnapshot_get_segments(DynamicSnapshotObject *self, void *closure)
+{
+  LEV_UNUSED(closure);
+  return PyLong_FromSize_t(lev_dynamic_snapshot_segments(self->snap));
+}
+
+#define DynamicIndex_DESC \
+  "Delete index taking inserts and deletes while being queried.\n" \
+  "\n" \
+  "DynamicIndex([words, max_k=2])\n" \
+  "\n" \
+  "Like DeleteIndex, finds words within a small edit distance max_k,\n" \
+  "but words can be inserted and deleted at any time, also from other\n" \
+  "threads than the ones looking words up.  Lookups see a snapshot, the\n" \
+  "words the index had when they started.  Words can be strings or\n" \
+  "bytes, the first inserted word decides.\n" \
+  "\n" \
+  "New words are kept in small segments, and deleted words remain in\n" \
+  "the segments until compact() merges them, which should be called\n" \
+  "from time to time, e.g. by Levenshtein.dynamic.Compactor.\n" \
+  "\n" \
+  ">>> index = DynamicIndex(['spam', 'eggs'])\n" \
+  ">>> index.insert('spar')\n" \
+  "2\n" \
+  ">>> index.delete(0)\n" \
+  ">>> index.lookup('spak', 1)\n" \
+  "[('spar', 1, 2)]\n"
+
+#define DynamicIndex_insert_DESC \
+  "Insert a word.\n" \
+  "\n" \
+  "insert(word)\n" \
+  "\n" \
+  "Returns the id of the word.  Ids are never reused.\n"
+
+#define DynamicIndex_delete_DESC \
+  "Delete the word of an id.\n" \
+  "\n" \
+  "delete(id)\n" \
+  "\n" \
+  "Raises KeyError when there's no such word.\n"
+
+#define DynamicIndex_lookup_DESC \
+  "Find words within Levenshtein distance max_k from a word.\n" \
+  "\n" \
+  "lookup(word[, max_k])\n" \
+  "\n" \
+  "Returns a list of (word, distance, id) tuples sorted by the distance\n" \
+  "and id.  The max_k defaults to (and can't exceed) the max_k of the\n" \
+  "index.\n"
+
+#define DynamicIndex_compact_DESC \
+  "Merge segments and drop the deleted words.\n" \
+  "\n" \
+  "compact([full=False, threads=0, priority='interactive'])\n" \
+  "\n" \
+  "Merges the newest segments while they are not much smaller than the\n" \
+  "merged ones, and segments with many deleted words; everything when\n" \
+  "full.  Other threads can insert, delete and look up meanwhile.\n" \
+  "Zero threads means one per processor.  Background compactions should\n" \
+  "use the 'batch' priority, see token_ratio_batch().\n"
+
+#define DynamicIndex_snapshot_DESC \
+  "Take a snapshot of the index.\n" \
+  "\n" \
+  "snapshot()\n" \
+  "\n" \
+  "The snapshot has the words the index has now, later changes don't\n" \
+  "affect it.  It has lookup(), len() and word access by id.  Nothing\n" \
+  "is copied, but memory of words deleted meanwhile is kept while the\n" \
+  "snapshot exists.\n"
+
+static PyMethodDef DynamicIndex_methods[] = {
+  { "insert", (PyCFunction)DynamicIndex_insert, METH_VARARGS,
+    DynamicIndex_insert_DESC },
+  { "delete", (PyCFunction)DynamicIndex_delete, METH_VARARGS,
+    DynamicIndex_delete_DESC },
+  { "lookup", (PyCFunction)(void(*)(void))DynamicIndex_lookup,
+    METH_VARARGS | METH_KEYWORDS, DynamicIndex_lookup_DESC },
+  { "compact", (PyCFunction)(void(*)(void))DynamicIndex_compact,
+    METH_VARARGS | METH_KEYWORDS, DynamicIndex_compact_DESC },
+  { "snapshot", (PyCFunction)DynamicIndex_snapshot, METH_NOARGS,
+    DynamicIndex_snapshot_DESC },
+  { NULL, NULL, 0, NULL },
+};
+
+static PyGetSetDef DynamicIndex_getset[] = {
+  { "max_k", (getter)DynamicIndex_get_max_k, NULL,
+    "The maximum distance the index can be queried for.", NULL },
+  { NULL, NULL, NULL, NULL, NULL },
+};
+
+static PySequenceMethods DynamicIndex_as_sequence = {
+  .sq_length = (lenfunc)DynamicIndex_len,
+};
+
+static PyTypeObject DynamicIndexType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "Levenshtein._levenshtein.DynamicIndex",
+  .tp_basicsize = sizeof(DynamicIndexObject),
+  .tp_dealloc = (destructor)DynamicIndex_dealloc,
+  .tp_as_sequence = &DynamicIndex_as_sequence,
+  .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_doc = DynamicIndex_DESC,
+  .tp_methods = DynamicIndex_methods,
+  .tp_getset = DynamicIndex_getset,
+  .tp_init = (initproc)DynamicIndex_init,
+  .tp_new = PyType_GenericNew,
+};
+
+#define DynamicSnapshot_DESC \
+  "Snapshot of a DynamicIndex, see DynamicIndex.snapshot().\n"
+
+static PyMethodDef DynamicSnapshot_methods[] = {
+  { "lookup", (PyCFunction)(void(*)(void))DynamicSnapshot_lookup,
+    METH_VARARGS | METH_KEYWORDS, DynamicIndex_lookup_DESC },
+  { NULL, NULL, 0, NULL },
+};
+
+static PyGetSetDef DynamicSnapshot_getset[] = {
+  { "segments", (getter)DynamicSnapshot_get_segments, NULL,
+    "The number of segments of the snapshot.", NULL },
+  { NULL, NULL, NULL, NULL, NULL },
+};
+
+static PyMappingMethods DynamicSnapshot_as_mapping = {
+  .mp_length = (lenfunc)DynamicSnapshot_len,
+  .mp_subscript = (binaryfunc)DynamicSnapshot_getitem,
+};
+
+static PyTypeObject DynamicSnapshotType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "Levenshtein._levenshtein.DynamicSnapshot",
+  .tp_basicsize = sizeof(DynamicSnapshotObject),
+  .tp_dealloc = (destructor)DynamicSnapshot_dealloc,
+  .tp_as_mapping = &DynamicSnapshot_as_mapping,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = DynamicSnapshot_DESC,
+  .tp_methods = DynamicSnapshot_methods,
+  .tp_getset = DynamicSnapshot_getset,
+};
+/* }}} */
+
+/****************************************************************************
+ *
+ * OpcodeIterator type
+ *
+ ****************************************************************************/
+/* {{{ */
+
+typedef struct {
+  PyObject_HEAD
+  LevOpcodeIter *it;
+  PyObject *pinned;  /* keeps the strings alive */
+  int busy;  /* next() runs without the GIL */
+} OpcodeIteratorObject;
+
+static void
+OpcodeIterator_dealloc(OpcodeIteratorObject *self)
+{
+  lev_opcode_iter_free(self->it);
+  Py_XDECREF(self->pinned);
+  PyObject_Del(self);
+}
+
+static PyObject*
+OpcodeIterator_next(OpcodeIteratorObject *self)
+{
+  LevOpCode bop;
+  LevPriority priority;
+  int r;
+
+  if (!self->it)
+    return NULL;
+  if (self->busy) {
+    PyErr_SetString(PyExc_ValueError, "iter_opcodes already executing");
+    return NULL;
+  }
+  self->busy = 1;
+  Py_BEGIN_ALLOW_THREADS
+  priority = lev_sched_begin();
+  r = lev_opcode_iter_next(self->it, &bop);
+  lev_sched_end(priority);
+  Py_END_ALLOW_THREADS
+  self->busy = 0;
+  if (r <= 0) {
+    /* the matrix rows aren't needed anymore */
+    lev_opcode_iter_free(self->it);
+    self->it = NULL;
+    Py_CLEAR(self->pinned);
+    return r < 0 ? PyErr_NoMemory() : NULL;
+  }
+  return Py_BuildValue("(Onnnn)", opcode_names[bop.type].pystring,
+                       (Py_ssize_t)bop.sbeg, (Py_ssize_t)bop.send,
+                       (Py_ssize_t)bop.dbeg, (Py_ssize_t)bop.dend);
+}
+
+#define OpcodeIterator_DESC \
+  "Iterator over the opcodes of two strings, see iter_opcodes().\n"
+
+static PyTypeObject OpcodeIteratorType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "Levenshtein._levenshtein.OpcodeIterator",
+  .tp_basicsize = sizeof(OpcodeIteratorObject),
+  .tp_dealloc = (destructor)OpcodeIterator_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = OpcodeIterator_DESC,
+  .tp_iter = PyObject_SelfIter,
+  .tp_iternext = (iternextfunc)OpcodeIterator_next,
+};
+
+static PyObject*
+iter_opcodes_py(PyObject *self, PyObject *args)
+{
+  const char *name = "iter_opcodes";
+  PyObject *arg1, *arg2, *pinned;
+  OpcodeIteratorObject *iter;
+  const void *s1, *s2;
+  size_t len1, len2;
+  int stringtype;
+  LEV_UNUSED(self);
+
+  if (!PyArg_UnpackTuple(args, PYARGCFIX(name), 2, 2, &arg1, &arg2))
+    return NULL;
+  pinned = Py_BuildValue("[OO]", arg1, arg2);
+  if (!pinned)
+    return NULL;
+  stringtype = get_two_strings(arg1, arg2, name, pinned,
+                               &len1, &s1, &len2, &s2);
+  if (stringtype < 0) {
+    Py_DECREF(pinned);
+    return NULL;
+  }
+  iter = PyObject_New(OpcodeIteratorObject, &OpcodeIteratorType);
+  if (!iter) {
+    Py_DECREF(pinned);
+    return NULL;
+  }
+  iter->pinned = pinned;
+  iter->busy = 0;
+  if (stringtype == 0)
+    iter->it = lev_opcode_iter_new(len1, (const lev_byte*)s1,
+                                   len2, (const lev_byte*)s2);
+  else
+    iter->it = lev_u_opcode_iter_new(len1, (const Py_UNICODE*)s1,
+                                     len2, (const Py_UNICODE*)s2);
+  if (!iter->it) {
+    Py_DECREF(iter);
+    return PyErr_NoMemory();
+  }
+  return (PyObject*)iter;
+}
+/* }}} */
+
+/****************************************************************************
+ *
+ * ScoreMatrix type
+ *
+ ****************************************************************************/
+/* {{{ */
+
+typedef struct {
+  PyObject_HEAD
+  PairedColumn rows;
+  PairedColumn cols;
+  int same;  /* whether the columns are the rows, cols is unused then */
+  int ready;
+  PyObject *cache;  /* a DistanceCache or None */
+  LevScorer scorer;
+  LevTileFormat format;
+  const char *typecode;
+  size_t itemsize;
+} ScoreMatrixObject;
+
+static void
+ScoreMatrix_release(ScoreMatrixObject *self)
+{
+  if (!self->ready)
+    return;
+  paired_column_release(&self->rows);
+  if (!self->same)
+    paired_column_release(&self->cols);
+  Py_CLEAR(self->cache);
+  self->ready = 0;
+}
+
+static int
+ScoreMatrix_init(ScoreMatrixObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = { "strings1", "strings2", "scorer", "dtype",
+                            "cache", NULL };
+  const char *name = "ScoreMatrix";
+  PyObject *arg1, *arg2 = Py_None, *cacheobj = Py_None;
+  const char *scorername = "ratio", *dtype = NULL;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OszO", kwlist,
+                                   &arg1, &arg2, &scorername, &dtype,
+                                   &cacheobj))
+    return -1;
+  if (cacheobj != Py_None
+      && !PyObject_TypeCheck(cacheobj, &DistanceCacheType)) {
+    PyErr_Format(PyExc_TypeError, "%s cache must be a DistanceCache or None",
+                 name);
+    return -1;
+  }
+  ScoreMatrix_release(self);
+
+  if (!strcmp(scorername, "ratio")) {
+    self->scorer = LEV_SCORER_RATIO;
+    if (!dtype || !strcmp(dtype, "d")) {
+      self->format = LEV_TILE_DOUBLE;
+      self->typecode = "d";
+      self->itemsize = sizeof(double);
+    }
+    else if (!strcmp(dtype, "B")) {
+      self->format = LEV_TILE_UINT8;
+      self->typecode = "B";
+      self->itemsize = 1;
+    }
+    else {
+      PyErr_Format(PyExc_ValueError,
+                   "%s ratio dtype must be 'd' or 'B'", name);
+      return -1;
+    }
+  }
+  else if (!strcmp(scorername, "distance")) {
+    self->scorer = LEV_SCORER_DISTANCE;
+    if (!dtype || !strcmp(dtype, SIZE_TYPECODE)) {
+      self->format = LEV_TILE_SIZE;
+      self->typecode = SIZE_TYPECODE;
+      self->itemsize = sizeof(size_t);
+    }
+    else if (!strcmp(dtype, "H")) {
+      self->format = LEV_TILE_UINT16;
+      self->typecode = "H";
+      self->itemsize = sizeof(uint16_t);
+    }
+    else {
+      PyErr_Format(PyExc_ValueError,
+                   "%s distance dtype must be '%s' or 'H'", name,
+                   SIZE_TYPECODE);
+      return -1;
+    }
+  }
+  else {
+    PyErr_Format(PyExc_ValueError,
+                 "%s scorer must be 'distance' or 'ratio'", name);
+    return -1;
+  }
+
+  if (paired_extract_column(arg1, name, &self->rows) < 0) {
+    paired_column_release(&self->rows);
+    return -1;
+  }
+  self->same = (arg2 == Py_None);
+  if (!self->same) {
+    if (paired_extract_column(arg2, name, &self->cols) < 0) {
+      paired_column_release(&self->rows);
+      paired_column_release(&self->cols);
+      return -1;
+    }
+    if (self->rows.text >= 0 && self->cols.text >= 0
+        && self->rows.text != self->cols.text) {
+      PyErr_Format(PyExc_TypeError,
+                   "%s columns must be both text or both bytes", name);
+      paired_column_release(&self->rows);
+      paired_column_release(&self->cols);
+      return -1;
+    }
+  }
+  Py_INCREF(cacheobj);
+  self->cache = cacheobj;
+  self->ready = 1;
+  return 0;
+}
+
+static void
+ScoreMatrix_dealloc(ScoreMatrixObject *self)
+{
+  ScoreMatrix_release(self);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int
+ScoreMatrix_check(ScoreMatrixObject *self)
+{
+  if (!self->ready) {
+    PyErr_SetString(PyExc_ValueError, "ScoreMatrix is not initialized");
+    return 0;
+  }
+  return 1;
+}
+
+static PyObject*
+ScoreMatrix_tile(ScoreMatrixObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = { "row_start", "row_stop", "col_start", "col_stop",
+                            "out", "stride", "threads", "priority", NULL };
+  const char *name = "tile", *priorityname = NULL;
+  const PairedColumn *cols;
+  DistanceCacheObject *dc;
+  Py_ssize_t r0, r1, c0, c1, stride = 0, nthreads = 0;
+  LevPriority priority, oldpriority;
+  PyObject *out = Py_None, *result;
+  size_t height, width, need;
+  Py_buffer view;
+  int r;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "nnnn|Onnz", kwlist,
+                                   &r0, &r1, &c0, &c1,
+                                   &out, &stride, &nthreads, &priorityname)
+      || get_priority(priorityname, name, &priority) < 0)
+    return NULL;
+  if (!ScoreMatrix_check(self))
+    return NULL;
+  cols = self->same ? &self->rows : &self->cols;
+  if (r0 < 0 || r1 < r0 || (size_t)r1 > self->rows.n
+      || c0 < 0 || c1 < c0 || (size_t)c1 > cols->n) {
+    PyErr_Format(PyExc_IndexError, "%s range out of the matrix", name);
+    return NULL;
+  }
+  height = (size_t)(r1 - r0);
+  width = (size_t)(c1 - c0);
+  if (!stride)
+    stride = (Py_ssize_t)width;
+  if (stride < (Py_ssize_t)width || nthreads < 0) {
+    PyErr_Format(PyExc_ValueError,
+                 "%s stride must be at least the tile width and threads "
+                 "nonnegative", name);
+    return NULL;
+  }
+
+  if (out == Py_None) {
+    if (width && height > (size_t)PY_SSIZE_T_MAX/width)
+      return PyErr_NoMemory();
+    result = new_typed_array(self->typecode, height*width);
+    if (!result)
+      return NULL;
+    if (!height || !width)
+      return result;
+    if (PyObject_GetBuffer(result, &view, PyBUF_WRITABLE) < 0) {
+      Py_DECREF(result);
+      return NULL;
+    }
+  }
+  else {
+    if (PyObject_GetBuffer(out, &view,
+                           PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0)
+      return NULL;
+    need = height && width ? ((height - 1)*(size_t)stride + width) : 0;
+    if ((size_t)view.len/self->itemsize < need
+        || (uintptr_t)view.buf % self->itemsize) {
+      PyBuffer_Release(&view);
+      PyErr_Format(PyExc_ValueError,
+                   "%s out is too small or misaligned", name);
+      return NULL;
+    }
+    result = Py_None;
+    Py_INCREF(result);
+  }
+  if (distance_cache_acquire(self->cache, name, &dc) < 0) {
+    PyBuffer_Release(&view);
+    Py_DECREF(result);
+    return NULL;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  oldpriority = lev_priority_set(priority);
+  r = lev_score_tile(&self->rows.column, (size_t)r0, (size_t)r1,
+                     &cols->column, (size_t)c0, (size_t)c1,
+                     self->scorer, self->format, DISTANCE_CACHE(dc),
+                     (size_t)nthreads, view.buf, (size_t)stride);
+  lev_priority_set(oldpriority);
+  Py_END_ALLOW_THREADS
+  distance_cache_release(dc);
+  PyBuffer_Release(&view);
+  if (r < 0) {
+    Py_DECREF(result);
+    return PyErr_NoMemory();
+  }
+  return result;
+}
+
+static PyObject*
+ScoreMatrix_get_shape(ScoreMatrixObject *self, void *closure)
+{
+  LEV_UNUSED(closure);
+  if (!ScoreMatrix_check(self))
+    return NULL;
+  return Py_BuildValue("(nn)", (Py_ssize_t)self->rows.n,
+                       (Py_ssize_t)(self->same ? self->rows.n
+                                               : self->cols.n));
+}
+
+static PyObject*
+ScoreMatrix_get_dtype(ScoreMatrixObject *self, void *closure)
+{
+  LEV_UNUSED(closure);
+  if (!ScoreMatrix_check(self))
+    return NULL;
+  return PyUnicode_FromString(self->typecode);
+}
+
+#define ScoreMatrix_DESC \
+  "Score matrix of two string columns, computed by tiles.\n" \
+  "\n" \
+  "ScoreMatrix(strings1[, strings2=None, scorer='ratio', dtype=None,\n" \
+  "            cache=None])\n" \
+  "\n" \
+  "The matrix of the scorer ('ratio' or 'distance') of each string of\n" \
+  "strings1 and each string of strings2 (of strings1 again if None).\n" \
+  "Columns are the same as for paired().  It's never computed as a whole,\n" \
+  "only by tiles.  The dtype is the array typecode of the scores: 'd'\n" \
+  "(default) or 'B' for ratios quantized to floor(255*ratio + 0.5), the\n" \
+  "size_t sized 'l' or 'q' (default) or 'H' for distances saturated at\n" \
+  "65535.  The distances of long strings are looked up in the\n" \
+  "DistanceCache cache first, if given.\n" \
+  "\n" \
+  "See Levenshtein.matrix for a more convenient interface.\n"
+
+#define ScoreMatrix_tile_DESC \
+  "Compute a tile of the matrix.\n" \
+  "\n" \
+  "tile(row_start, row_stop, col_start, col_stop[, out, stride, threads,\n" \
+  "     priority])\n" \
+  "\n" \
+  "Without out returns the tile as an array of the dtype, by rows.\n" \
+  "Otherwise the scores are stored into out, any writable buffer, and\n" \
+  "the tile rows are stride items apart (by default the tile width), so\n" \
+  "a tile can be written to its place in a whole (memory mapped) matrix.\n" \
+  "Zero threads means one per processor, the priority is as in\n" \
+  "token_ratio_batch().\n"
+
+static PyMethodDef ScoreMatrix_methods[] = {
+  { "tile", (PyCFunction)(void(*)(void))ScoreMatrix_tile,
+    METH_VARARGS | METH_KEYWORDS, ScoreMatrix_tile_DESC },
+  { NULL, NULL, 0, NULL },
+};
+
+static PyGetSetDef ScoreMatrix_getset[] = {
+  { "shape", (getter)ScoreMatrix_get_shape, NULL,
+    "The numbers of rows and columns.", NULL },
+  { "dtype", (getter)ScoreMatrix_get_dtype, NULL,
+    "The array typecode of the scores.", NULL },
+  { NULL, NULL, NULL, NULL, NULL },
+};
+
+static PyTypeObject ScoreMatrixType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "Levenshtein._levenshtein.ScoreMatrix",
+  .tp_basicsize = sizeof(ScoreMatrixObject),
+  .tp_dealloc = (destructor)ScoreMatrix_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_doc = ScoreMatrix_DESC,
+  .tp_methods = ScoreMatrix_methods,
+  .tp_getset = ScoreMatrix_getset,
+  .tp_init = (initproc)ScoreMatrix_init,
+  .tp_new = PyType_GenericNew,
+};
+/* }}} */
+
+/****************************************************************************
+ *
+ * AioBatch type
+ *
+ ****************************************************************************/
+/* {{{ */
+
+/* A batch of computations run on a native thread while the interpreter goes
+ * on, for Levenshtein.aio.  The arguments are extracted when the batch is
+ * created; they (and copies of the argument sequences) stay referenced by
+ * the batch, so the strings the engines read can't go away.  Finished
+ * batches write a byte to the notification file descriptor, a nonblocking
+ * pipe watched by the event loop.  The distance and ratio tasks of a batch
+ * are scored together, as the rows of one lev_paired_scores() call per
+ * string type, the other tasks run in parallel with lev_run_tasks(). */
+
+typedef enum {
+  AIO_DISTANCE,
+  AIO_RATIO,
+  AIO_EDITOPS,
+  AIO_SETRATIO,
+  AIO_SEQRATIO,
+  AIO_MEDIAN,
+  AIO_LAST
+} AioKind;
+
+static const char *aio_kind_names[AIO_LAST] = {
+  "distance", "ratio", "editops", "setratio", "seqratio", "median"
+};
+
+typedef struct {
+  AioKind kind;
+  int stringtype;
+  PyObject *error;  /* exception raised by extracting the arguments */
+  /* strings */
+  size_t len1;
+  size_t len2;
+  const void *string1;
+  const void *string2;
+  /* sequences */
+  size_t n1;
+  size_t n2;
+  size_t *sizes1;
+  size_t *sizes2;
+  void *strings1;
+  void *strings2;
+  double *weights;
+  /* results */
+  int failed;  /* out of memory */
+  size_t distance;
+  double ratio;
+  size_t nops;
+  LevEditOp *ops;
+  void *median;
+  size_t medlen;
+} AioTask;
+
+typedef struct {
+  PyObject_HEAD
+  size_t n;
+  AioTask *tasks;
+  size_t nrest;
+  size_t *rest;  /* the tasks not scored by lev_paired_scores() */
+  PyObject *pinned;  /* the task tuples and the sequences, as tuples */
+  size_t nthreads;
+  LevPriority priority;
+  int fd;  /* a duplicate of the wake fd, owned by the batch thread */
+  PyThread_type_lock done;  /* held while the batch runs */
+} AioBatchObject;
+
+static PyTypeObject AioBatchType;
+
+/* extract a string argument, returns its type or -1 */
+static int
+aio_string(AioBatchObject *self, PyObject *obj, const char *name,
+           size_t *len, const void **string)
+{
+  int stringtype = get_string(obj, name, self->pinned, len, string);
+
+  if (stringtype == -2) {
+    PyErr_Format(PyExc_TypeError,
+                 "%s expected two Strings or two Unicodes", name);
+    return -1;
+  }
+  return stringtype;
+}
+
+/* extract a sequence argument, returns its type, -1 on failure or -2 for
+ * an empty sequence */
+static int
+aio_sequence(AioBatchObject *self, PyObject *obj, const char *name,
+             size_t *n, size_t **sizes, void **strings)
+{
+  StringList sl;
+  int stringtype;
+
+  *n = 0;
+  if (!PySequence_Check(obj)) {
+    PyErr_Format(PyExc_TypeError, "%s expected a Sequence", name);
+    return -1;
+  }
+  stringtype = extract_strings(obj, name, &sl);
+  if (stringtype >= 0 && PyList_Append(self->pinned, sl.pinned) < 0)
+    stringtype = -1;
+  if (stringtype < 0 || !sl.n) {
+    release_strings(&sl);
+    return stringtype < 0 ? -1 : -2;
+  }
+  /* the task owns the arrays now */
+  *n = sl.n;
+  *sizes = sl.sizes;
+  *strings = sl.strings;
+  Py_DECREF(sl.pinned);
+  return stringtype;
+}
+
+static int
+aio_task_init(AioBatchObject *self, AioTask *task, PyObject *spec)
+{
+  const char *name;
+  Py_ssize_t nargs;
+  int t1, t2;
+  size_t i;
+
+  if (!PyTuple_Check(spec) || PyTuple_GET_SIZE(spec) < 2
+      || !PyUnicode_Check(PyTuple_GET_ITEM(spec, 0))) {
+    PyErr_SetString(PyExc_TypeError,
+                    "AioBatch task must be a tuple (name, arguments...)");
+    return -1;
+  }
+  if (PyList_Append(self->pinned, spec) < 0)
+    return -1;
+  name = PyUnicode_AsUTF8(PyTuple_GET_ITEM(spec, 0));
+  if (!name)
+    return -1;
+  for (i = 0; i < AIO_LAST; i++) {
+    if (strcmp(name, aio_kind_names[i]) == 0)
+      break;
+  }
+  if (i == AIO_LAST) {
+    PyErr_Format(PyExc_ValueError, "AioBatch unknown task %s", name);
+    return -1;
+  }
+  task->kind = (AioKind)i;
+  nargs = PyTuple_GET_SIZE(spec) - 1;
+  if (nargs != 2 && !(task->kind == AIO_MEDIAN && nargs == 1)) {
+    PyErr_Format(PyExc_TypeError, "%s got %zd arguments", name, nargs);
+    return -1;
+  }
+
+  switch (task->kind) {
+    case AIO_DISTANCE:
+    case AIO_RATIO:
+    case AIO_EDITOPS:
+    t1 = aio_string(self, PyTuple_GET_ITEM(spec, 1), name,
+                    &task->len1, &task->string1);
+    if (t1 < 0)
+      return -1;
+    t2 = aio_string(self, PyTuple_GET_ITEM(spec, 2), name,
+                    &task->len2, &task->string2);
+    if (t2 < 0)
+      return -1;
+    if (t1 != t2) {
+      PyErr_Format(PyExc_TypeError,
+                   "%s expected two Strings or two Unicodes", name);
+      return -1;
+    }
+    task->stringtype = t1;
+    break;
+
+    case AIO_SETRATIO:
+    case AIO_SEQRATIO:
+    t1 = aio_sequence(self, PyTuple_GET_ITEM(spec, 1), name,
+                      &task->n1, &task->sizes1, &task->strings1);
+    if (t1 == -1)
+      return -1;
+    t2 = aio_sequence(self, PyTuple_GET_ITEM(spec, 2), name,
+                      &task->n2, &task->sizes2, &task->strings2);
+    if (t2 == -1)
+      return -1;
+    if (t1 >= 0 && t2 >= 0 && t1 != t2) {
+      PyErr_Format(PyExc_TypeError,
+                   "%s both sequences must consist of items of the same type",
+                   name);
+      return -1;
+    }
+    task->stringtype = t1 >= 0 ? t1 : t2;
+    break;
+
+    case AIO_MEDIAN:
+    t1 = aio_sequence(self, PyTuple_GET_ITEM(spec, 1), name,
+                      &task->n1, &task->sizes1, &task->strings1);
+    if (t1 == -1)
+      return -1;
+    task->stringtype = t1;
+    if (t1 >= 0) {
+      task->weights = extract_weightlist(nargs == 2 ? PyTuple_GET_ITEM(spec, 2)
+                                                    : NULL,
+                                         name, task->n1);
+      if (!task->weights)
+        return -1;
+    }
+    break;
+
+    default:
+    break;
+  }
+  return 0;
+}
+
+/* score the distance or ratio (@kind) tasks of @stringtype as the rows of
+ * one lev_paired_scores() call */
+static void
+aio_batch_paired(AioBatchObject *self, AioKind kind, int stringtype)
+{
+  size_t n = 0, i, k;
+  size_t *lengths;
+  const void **strings;
+  void *scores;
+  LevColumn column1, column2;
+  int r = -1;
+
+  for (i = 0; i < self->n; i++) {
+    AioTask *task = self->tasks + i;
+    n += !task->error && task->kind == kind && task->stringtype == stringtype;
+  }
+  if (!n)
+    return;
+  lengths = (size_t*)safe_malloc(2*n, sizeof(size_t));
+  strings = (const void**)safe_malloc(2*n, sizeof(void*));
+  scores = safe_malloc(n, kind == AIO_RATIO ? sizeof(double)
+                                            : sizeof(size_t));
+  if (lengths && strings && scores) {
+    for (i = k = 0; i < self->n; i++) {
+      AioTask *task = self->tasks + i;
+      if (task->error || task->kind != kind || task->stringtype != stringtype)
+        continue;
+      lengths[k] = task->len1;
+      strings[k] = task->string1;
+      lengths[n + k] = task->len2;
+      strings[n + k] = task->string2;
+      k++;
+    }
+    memset(&column1, 0, sizeof(LevColumn));
+    column1.type = stringtype ? LEV_COLUMN_WCHAR : LEV_COLUMN_BYTES;
+    column2 = column1;
+    column1.lengths = lengths;
+    column1.strings = strings;
+    column2.lengths = lengths + n;
+    column2.strings = strings + n;
+    r = lev_paired_scores(n, &column1, &column2,
+                          kind == AIO_RATIO ? LEV_SCORER_RATIO
+                                            : LEV_SCORER_DISTANCE,
+                          kind == AIO_RATIO ? 0.0 : HUGE_VAL, NULL,
+                          self->nthreads, scores);
+  }
+  for (i = k = 0; i < self->n; i++) {
+    AioTask *task = self->tasks + i;
+    if (task->error || task->kind != kind || task->stringtype != stringtype)
+      continue;
+    if (r < 0)
+      task->failed = 1;
+    else if (kind == AIO_RATIO)
+      task->ratio = ((double*)scores)[k];
+    else
+      task->distance = ((size_t*)scores)[k];
+    k++;
+  }
+  free(lengths);
+  free(strings);
+  free(scores);
+}
+
+static void
+aio_task_run(void *data, size_t i)
+{
+  AioBatchObject *self = (AioBatchObject*)data;
+  AioTask *task = self->tasks + self->rest[i];
+  double r;
+
+  if (task->error)
+    return;
+  switch (task->kind) {
+    case AIO_EDITOPS:
+    if (task->stringtype == 0)
+      task->ops = lev_editops_find(task->len1, task->string1,
+                                   task->len2, task->string2, &task->nops);
+    else
+      task->ops = lev_u_editops_find(task->len1, task->string1,
+                                     task->len2, task->string2, &task->nops);
+    task->failed = !task->ops && task->nops;
+    break;
+
+    case AIO_SETRATIO:
+    case AIO_SEQRATIO:
+    if (!task->n1 || !task->n2)
+      r = (double)(task->n1 + task->n2);
+    else if (task->stringtype == 0)
+      r = (task->kind == AIO_SETRATIO ? lev_set_distance
+                                      : lev_edit_seq_distance)
+          (task->n1, task->sizes1, (const lev_byte**)task->strings1,
+           task->n2, task->sizes2, (const lev_byte**)task->strings2);
+    else
+      r = (task->kind == AIO_SETRATIO ? lev_u_set_distance
+                                      : lev_u_edit_seq_distance)
+          (task->n1, task->sizes1, (const lev_wchar**)task->strings1,
+           task->n2, task->sizes2, (const lev_wchar**)task->strings2);
+    if (r < 0.0)
+      task->failed = 1;
+    else if (task->n1 + task->n2 == 0)
+      task->ratio = 1.0;
+    else
+      task->ratio = ((double)(task->n1 + task->n2) - r)
+                    / (double)(task->n1 + task->n2);
+    break;
+
+    case AIO_MEDIAN:
+    if (!task->n1)
+      break;
+    if (task->stringtype == 0)
+      task->median = lev_greedy_median(task->n1, task->sizes1,
+                                       (const lev_byte**)task->strings1,
+                                       task->weights, &task->medlen);
+    else
+      task->median = lev_u_greedy_median(task->n1, task->sizes1,
+                                         (const lev_wchar**)task->strings1,
+                                         task->weights, &task->medlen);
+    task->failed = !task->median && task->medlen;
+    break;
+
+    default:
+    break;
+  }
+}
+
+static void
+aio_batch_run(void *data)
+{
+  AioBatchObject *self = (AioBatchObject*)data;
+  int fd = self->fd;
+  LevPriority oldpriority = lev_priority_set(self->priority);
+
+  aio_batch_paired(self, AIO_DISTANCE, 0);
+  aio_batch_paired(self, AIO_DISTANCE, 1);
+  aio_batch_paired(self, AIO_RATIO, 0);
+  aio_batch_paired(self, AIO_RATIO, 1);
+  lev_run_tasks(self->nrest, aio_task_run, self, self->nthreads);
+  lev_priority_set(oldpriority);
+  /* the batch may be gone as soon as it's released; the fd is our own
+   * duplicate, so it stays valid even if the caller has closed the pipe */
+  PyThread_release_lock(self->done);
+#ifndef _WIN32
+  if (fd >= 0) {
+    char c = 0;
+    if (write(fd, &c, 1) < 0) {
+      /* a full pipe wakes the loop up anyway */
+    }
+    close(fd);
+  }
+#endif
+}
+
+static PyObject*
+aio_task_result(const AioTask *task)
+{
+  if (task->error) {
+    Py_INCREF(task->error);
+    return task->error;
+  }
+  if (task->failed)
+    return PyObject_CallObject(PyExc_MemoryError, NULL);
+  switch (task->kind) {
+    case AIO_DISTANCE:
+    return PyLong_FromSize_t(task->distance);
+
+    case AIO_EDITOPS:
+    return editops_to_tuple_list(task->nops, task->ops);
+
+    case AIO_MEDIAN:
+    if (!task->n1)
+      Py_RETURN_NONE;
+    if (task->stringtype == 0)
+      return PyBytes_FromStringAndSize((const char*)task->median,
+                                       (Py_ssize_t)task->medlen);
+    return PyUnicode_FromUnicode((const Py_UNICODE*)task->median,
+                                 (Py_ssize_t)task->medlen);
+
+    default:
+    return PyFloat_FromDouble(task->ratio);
+  }
+}
+
+static int
+AioBatch_init(AioBatchObject *self, PyObject *args, PyObject *kwargs)
+{
+  static char *kwlist[] = { "tasks", "fd", "threads", "priority", NULL };
+  PyObject *tasklist, *taskseq;
+  const char *priorityname = NULL;
+  LevPriority priority;
+  Py_ssize_t nthreads = 0;
+  int fd = -1;
+  size_t i;
+
+  if (self->tasks) {
+    PyErr_SetString(PyExc_RuntimeError, "AioBatch cannot be reused");
+    return -1;
+  }
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|inz", kwlist,
+                                   &tasklist, &fd, &nthreads, &priorityname)
+      || get_priority(priorityname, "AioBatch", &priority) < 0)
+    return -1;
+  if (nthreads < 0) {
+    PyErr_SetString(PyExc_ValueError, "AioBatch threads must not be negative");
+    return -1;
+  }
+  taskseq = PySequence_Fast(tasklist, "AioBatch expected a Sequence");
+  if (!taskseq)
+    return -1;
+  self->n = (size_t)PySequence_Fast_GET_SIZE(taskseq);
+  self->tasks = (AioTask*)calloc(self->n + 1, sizeof(AioTask));
+  self->rest = (size_t*)safe_malloc(self->n + 1, sizeof(size_t));
+  self->pinned = PyList_New(0);
+  self->done = PyThread_allocate_lock();
+  if (!self->tasks || !self->rest || !self->pinned || !self->done) {
+    Py_DECREF(taskseq);
+    PyErr_NoMemory();
+    return -1;
+  }
+  self->fd = -1;
+#ifndef _WIN32
+  if (fd >= 0) {
+    self->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (self->fd < 0) {
+      Py_DECREF(taskseq);
+      PyErr_SetFromErrno(PyExc_OSError);
+      return -1;
+    }
+  }
+#endif
+  self->nthreads = (size_t)nthreads;
+  self->priority = priority;
+
+  /* errors belong to the tasks, the others still run */
+  for (i = 0; i < self->n; i++) {
+    AioTask *task = self->tasks + i;
+
+    if (aio_task_init(self, task, PySequence_Fast_GET_ITEM(taskseq, i)) < 0) {
+      PyObject *type, *value, *traceback;
+
+      PyErr_Fetch(&type, &value, &traceback);
+      PyErr_NormalizeException(&type, &value, &traceback);
+      Py_XDECREF(type);
+      Py_XDECREF(traceback);
+      if (!value) {
+        Py_INCREF(Py_None);
+        value = Py_None;
+      }
+      task->error = value;
+    }
+    else if (task->kind != AIO_DISTANCE && task->kind != AIO_RATIO)
+      self->rest[self->nrest++] = i;
+  }
+  Py_DECREF(taskseq);
+
+  PyThread_acquire_lock(self->done, NOWAIT_LOCK);
+  if ((long)PyThread_start_new_thread(aio_batch_run, self) == -1L) {
+    Py_BEGIN_ALLOW_THREADS
+    aio_batch_run(self);
+    Py_END_ALLOW_THREADS
+  }
+  return 0;
+}
+
+static int
+AioBatch_running(AioBatchObject *self)
+{
+  if (!self->done)
+    return 0;
+  if (!PyThread_acquire_lock(self->done, NOWAIT_LOCK))
+    return 1;
+  PyThread_release_lock(self->done);
+  return 0;
+}
+
+static void
+AioBatch_wait_done(AioBatchObject *self)
+{
+  if (!self->done)
+    return;
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(self->done, WAIT_LOCK);
+  PyThread_release_lock(self->done);
+  Py_END_ALLOW_THREADS
+}
+
+static void
+AioBatch_dealloc(AioBatchObject *self)
+{
+  size_t i;
+
+  AioBatch_wait_done(self);
+  for (i = 0; self->tasks && i < self->n; i++) {
+    AioTask *task = self->tasks + i;
+
+    Py_XDECREF(task->error);
+    free(task->sizes1);
+    free(task->sizes2);
+    free(task->strings1);
+    free(task->strings2);
+    free(task->weights);
+    free(task->ops);
+    free(task->median);
+  }
+  free(self->tasks);
+  free(self->rest);
+  Py_XDECREF(self->pinned);
+  if (self->done)
+    PyThread_free_lock(self->done);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject*
+AioBatch_done(AioBatchObject *self, PyObject *args)
+{
+  LEV_UNUSED(args);
+  return PyBool_FromLong(!AioBatch_running(self));
+}
+
+static PyObject*
+AioBatch_wait(AioBatchObject *self, PyObject *args)
+{
+  LEV_UNUSED(args);
+  AioBatch_wait_done(self);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+AioBatch_results(AioBatchObject *self, PyObject *args)
+{
+  PyObject *result;
+  size_t i;
+  LEV_UNUSED(args);
+
+  if (AioBatch_running(self)) {
+    PyErr_SetString(PyExc_RuntimeError, "AioBatch is still running");
+    return NULL;
+  }
+  result = PyList_New((Py_ssize_t)self->n);
+  if (!result)
+    return NULL;
+  for (i = 0; i < self->n; i++) {
+    PyObject *item = aio_task_result(self->tasks + i);
+    if (!item) {
+      Py_DECREF(result);
+      return NULL;
+    }
+    PyList_SET_ITEM(result, (Py_ssize_t)i, item);
+  }
+  return result;
+}
+
+#define AioBatch_DESC \
+  "A batch of computations running on a native thread.\n" \
+  "\n" \
+  "AioBatch(tasks[, fd=-1, threads=0, priority='interactive'])\n" \
+  "\n" \
+  "Each task is a tuple of a function name (distance, ratio, editops,\n" \
+  "setratio, seqratio or median) and its arguments.  The distances and\n" \
+  "ratios are scored together, like paired() rows, the other tasks run\n" \
+  "in parallel, on the given number of threads (zero means one per\n" \
+  "processor) with the given priority (see token_ratio_batch()), and\n" \
+  "when all are finished a byte is written to the file descriptor fd\n" \
+  "(if nonnegative), through a duplicate taken at creation, so fd may be\n" \
+  "closed while the batch runs.  This is the engine of\n" \
+  "Levenshtein.aio, use that instead.\n"
+
+#define AioBatch_done_DESC \
+  "Whether the batch has finished.\n"
+
+#define AioBatch_wait_DESC \
+  "Wait until the batch finishes.\n"
+
+#define AioBatch_results_DESC \
+  "Return the results of the finished batch, a list with the result of\n" \
+  "each task, or the exception it raised.\n"
+
+static PyMethodDef AioBatch_methods[] = {
+  { "done", (PyCFunction)AioBatch_done, METH_NOARGS, AioBatch_done_DESC },
+  { "wait", (PyCFunction)AioBatch_wait, METH_NOARGS, AioBatch_wait_DESC },
+  { "results", (PyCFunction)AioBatch_results, METH_NOARGS,
+    AioBatch_results_DESC },
+  { NULL, NULL, 0, NULL },
+};
+
+static PyTypeObject AioBatchType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "Levenshtein._levenshtein.AioBatch",
+  .tp_basicsize = sizeof(AioBatchObject),
+  .tp_dealloc = (destructor)AioBatch_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = AioBatch_DESC,
+  .tp_methods = AioBatch_methods,
+  .tp_init = (initproc)AioBatch_init,
+  .tp_new = PyType_GenericNew,
+};
+/* }}} */
+
+/****************************************************************************
+ *
+ * Module
+ *
+ ****************************************************************************/
+/* {{{ */
+
+static PyModuleDef moduledef = {
+  PyModuleDef_HEAD_INIT,
+  "_levenshtein",
+  Levenshtein_DESC,
+  -1,
+  methods
+};
+
+/* the scheduler of this module, for c_levenshtein to count its calls in */
+static LevSchedApi sched_api = { lev_sched_begin, lev_sched_end };
+
+PyMODINIT_FUNC PyInit__levenshtein(void)
+{
+  PyObject *module, *sched, *tuning;
+  size_t i;
+
+  for (i = 0; i < LEV_EDIT_LAST; i++) {
+    if (!opcode_names[i].pystring) {
+      opcode_names[i].pystring
+        = PyUnicode_InternFromString(opcode_names[i].cstring);
+      if (!opcode_names[i].pystring)
+        return NULL;
+    }
+  }
+  if (PyType_Ready(&DeleteIndexType) < 0
+      || PyType_Ready(&DynamicIndexType) < 0
+      || PyType_Ready(&DynamicSnapshotType) < 0
+      || PyType_Ready(&DistanceCacheType) < 0
+      || PyType_Ready(&OpcodeIteratorType) < 0
+      || PyType_Ready(&ScoreMatrixType) < 0
+      || PyType_Ready(&AioBatchType) < 0)
+    return NULL;
+  module = PyModule_Create(&moduledef);
+  if (!module)
+    return NULL;
+  Py_INCREF(&DeleteIndexType);
+  if (PyModule_AddObject(module, "DeleteIndex",
+                         (PyObject*)&DeleteIndexType) < 0) {
+    Py_DECREF(&DeleteIndexType);
+    Py_DECREF(module);
+    return NULL;
+  }
+  Py_INCREF(&DynamicIndexType);
+  if (PyModule_AddObject(module, "DynamicIndex",
+                         (PyObject*)&DynamicIndexType) < 0) {
+    Py_DECREF(&DynamicIndexType);
+    Py_DECREF(module);
+    return NULL;
+  }
+  Py_INCREF(&DistanceCacheType);
+  if (PyModule_AddObject(module, "DistanceCache",
+                         (PyObject*)&DistanceCacheType) < 0) {
+    Py_DECREF(&DistanceCacheType);
+    Py_DECREF(module);
+    return NULL;
+  }
+  Py_INCREF(&ScoreMatrixType);
+  if (PyModule_AddObject(module, "ScoreMatrix",
+                         (PyObject*)&ScoreMatrixType) < 0) {
+    Py_DECREF(&ScoreMatrixType);
+    Py_DECREF(module);
+    return NULL;
+  }
+  Py_INCREF(&AioBatchType);
+  if (PyModule_AddObject(module, "AioBatch",
+                         (PyObject*)&AioBatchType) < 0) {
+    Py_DECREF(&AioBatchType);
+    Py_DECREF(module);
+    return NULL;
+  }
+  sched = PyCapsule_New(&sched_api, "Levenshtein._levenshtein._sched_api",
+                        NULL);
+  if (!sched || PyModule_AddObject(module, "_sched_api", sched) < 0) {
+    Py_XDECREF(sched);
+    Py_DECREF(module);
+    return NULL;
+  }
+  tuning = tuning_file_name();
+  if (!tuning || load_tuning(tuning) < 0
+      || PyModule_AddObject(module, "TUNING_FILE", tuning) < 0) {
+    Py_XDECREF(tuning);
+    Py_DECREF(module);
+    return NULL;
+  }
+  return module;
 }
 /* }}} */
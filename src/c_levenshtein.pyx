@@ -3,7 +3,7 @@
 # cython: binding=True
 
 from libc.stdlib cimport free
-from libc.string cimport strlen
+from libc.string cimport strlen, strchr
 from cpython.list cimport PyList_New, PyList_SET_ITEM
 from cpython.object cimport PyObject
 from cpython.ref cimport Py_INCREF
@@ -11,11 +11,17 @@ from cpython.unicode cimport (
     PyUnicode_CompareWithASCIIString, PyUnicode_AS_UNICODE
 )
 from cpython.bytes cimport PyBytes_AS_STRING, PyBytes_FromStringAndSize
+from cpython.pycapsule cimport PyCapsule_Import
 from cpython.sequence cimport PySequence_Check, PySequence_Length
+from cpython.buffer cimport (
+    PyObject_CheckBuffer, PyObject_GetBuffer, PyBuffer_Release,
+    PyBUF_FORMAT, PyBUF_C_CONTIGUOUS
+)
 from libc.stddef cimport wchar_t
 
 cdef extern from *:
     object PyUnicode_FromWideChar(const wchar_t *w, Py_ssize_t size)
+    int PY_LITTLE_ENDIAN
 
 cdef extern from "_levenshtein.h":
     ctypedef unsigned char lev_byte
@@ -52,8 +58,8 @@ cdef extern from "_levenshtein.h":
     int lev_editops_check_errors(size_t len1, size_t len2, size_t n, const LevEditOp *ops)
     int lev_opcodes_check_errors(size_t len1, size_t len2, size_t nb, const LevOpCode *bops)
 
-    LevEditOp* lev_editops_find(size_t len1, const lev_byte *string1, size_t len2, const lev_byte *string2, size_t *n)
-    LevEditOp* lev_u_editops_find(size_t len1, const wchar_t *string1, size_t len2, const wchar_t *string2, size_t *n)
+    LevEditOp* lev_editops_find(size_t len1, const lev_byte *string1, size_t len2, const lev_byte *string2, size_t *n) nogil
+    LevEditOp* lev_u_editops_find(size_t len1, const wchar_t *string1, size_t len2, const wchar_t *string2, size_t *n) nogil
 
     LevEditOp* lev_opcodes_to_editops(size_t nb, const LevOpCode *bops, size_t *n, int keepkeep)
     LevOpCode* lev_editops_to_opcodes(size_t n, const LevEditOp *ops, size_t *nb, size_t len1, size_t len2)
@@ -69,6 +75,20 @@ cdef extern from "_levenshtein.h":
 
     LevEditOp* lev_editops_subtract(size_t n, const LevEditOp *ops, size_t ns, const LevEditOp *sub, size_t *nrem)
 
+    ctypedef struct LevGraphemes:
+        size_t n
+        wchar_t *ids
+        size_t *bounds
+
+    ctypedef int LevPriority
+    ctypedef struct LevSchedApi:
+        LevPriority (*begin)() noexcept nogil
+        void (*end)(LevPriority priority) noexcept nogil
+
+    int lev_grapheme_split(size_t n, const size_t *lengths, const wchar_t **strings, LevGraphemes *clusters)
+    void lev_grapheme_free(size_t n, LevGraphemes *clusters)
+    LevOpCode* lev_grapheme_map_opcodes(size_t nb, const LevOpCode *bops, const LevGraphemes *clusters1, const LevGraphemes *clusters2, size_t *nmapped)
+
 ctypedef struct OpcodeName:
     PyObject* pystring
     const char *cstring
@@ -81,7 +101,7 @@ opcode_names[2] = OpcodeName(<PyObject*>"insert",  "insert",  strlen("insert"))
 opcode_names[3] = OpcodeName(<PyObject*>"delete",  "delete",  strlen("delete"))
 cdef size_t N_OPCODE_NAMES = 4
 
-cdef size_t get_length_of_anything(o):
+cdef size_t get_length_of_anything(o) except? <size_t>-1:
     cdef Py_ssize_t length
     if isinstance(o, int):
         length = <Py_ssize_t>o
@@ -94,6 +114,153 @@ cdef size_t get_length_of_anything(o):
     
     return <size_t>-1
 
+cdef class _StringArg:
+    """
+    A string argument, see string_arg().
+    """
+    cdef Py_buffer view
+    cdef bint has_view
+    cdef wchar_t *copy
+    cdef int kind   # 0 -- bytes, 1 -- wchar_t, -1 -- not a string
+    cdef const void *data
+    cdef size_t length
+
+    def __dealloc__(self):
+        if self.has_view:
+            PyBuffer_Release(&self.view)
+        free(self.copy)
+
+cdef bint is_char_format(const char *f, Py_ssize_t itemsize):
+    if f == NULL:
+        return itemsize == 1
+    if f[0] == b'@' or f[0] == b'=' or f[0] == (b'<' if PY_LITTLE_ENDIAN else b'>'):
+        f += 1
+    return (f[0] != 0 and f[1] == 0 and strchr("bBchHiIlLuw", f[0]) != NULL
+            and (itemsize == 1 or itemsize == 2 or itemsize == 4))
+
+cdef _StringArg string_arg(obj):
+    """
+    Get a string argument: bytes, str, or a contiguous buffer of 1 byte
+    characters (like bytes) or 2 or 4 byte characters (like str).  Buffers
+    are used in place unless their characters are narrower than wchar_t.
+    """
+    cdef _StringArg arg = _StringArg.__new__(_StringArg)
+    cdef size_t i
+
+    arg.kind = -1
+    if isinstance(obj, bytes):
+        arg.kind = 0
+        arg.data = PyBytes_AS_STRING(obj)
+        arg.length = <size_t>len(<bytes>obj)
+        return arg
+    if isinstance(obj, str):
+        arg.kind = 1
+        arg.data = PyUnicode_AS_UNICODE(obj)
+        arg.length = <size_t>len(<str>obj)
+        return arg
+    if not PyObject_CheckBuffer(obj):
+        return arg
+    try:
+        PyObject_GetBuffer(obj, &arg.view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS)
+    except (BufferError, TypeError, ValueError):
+        return arg
+    arg.has_view = True
+    if arg.view.ndim > 1 or not is_char_format(arg.view.format, arg.view.itemsize):
+        return arg
+
+    arg.length = <size_t>(arg.view.len // arg.view.itemsize)
+    arg.data = arg.view.buf
+    if arg.view.itemsize == 1:
+        arg.kind = 0
+    elif <size_t>arg.view.itemsize == sizeof(wchar_t):
+        arg.kind = 1
+    elif <size_t>arg.view.itemsize < sizeof(wchar_t):
+        arg.copy = <wchar_t*>safe_malloc(arg.length + 1, sizeof(wchar_t))
+        if not arg.copy:
+            raise MemoryError
+        for i in range(arg.length):
+            arg.copy[i] = <wchar_t>(<const unsigned short*>arg.view.buf)[i]
+        arg.data = arg.copy
+        arg.kind = 1
+    return arg
+
+cdef bint grapheme_unit(unit, name) except -1:
+    """
+    Whether unit asks for grapheme clusters, 'codepoint' or 'grapheme'.
+    """
+    if unit == 'codepoint':
+        return False
+    if unit == 'grapheme':
+        return True
+    raise ValueError("%s unit must be 'codepoint' or 'grapheme'" % name)
+
+# this module links its own copy of the library; count its calls in the
+# scheduler of _levenshtein, where the priority classes and batch workers are
+cdef LevSchedApi *sched_api = <LevSchedApi*>PyCapsule_Import(
+    "Levenshtein._levenshtein._sched_api", 0)
+
+cdef LevEditOp* find_editops(_StringArg a1, _StringArg a2, size_t *n):
+    """
+    Find the edit operations between two strings of the same kind, without
+    the GIL and counted in the scheduler class of the calling thread.
+    """
+    cdef LevEditOp *ops
+    cdef LevPriority priority
+
+    with nogil:
+        priority = sched_api.begin()
+        if a1.kind == 0:
+            ops = lev_editops_find(
+                a1.length, <const lev_byte*>a1.data,
+                a2.length, <const lev_byte*>a2.data,
+                n)
+        else:
+            ops = lev_u_editops_find(
+                a1.length, <const wchar_t*>a1.data,
+                a2.length, <const wchar_t*>a2.data,
+                n)
+        sched_api.end(priority)
+    return ops
+
+cdef LevOpCode* grapheme_opcodes(_StringArg a1, _StringArg a2, name, size_t *nb) except? NULL:
+    """
+    Find the opcodes between the grapheme clusters of two strings, with
+    positions in the strings themselves.
+    """
+    cdef LevGraphemes clusters[2]
+    cdef size_t lengths[2]
+    cdef const wchar_t *strings[2]
+    cdef size_t n, nc
+    cdef LevEditOp *ops
+    cdef LevOpCode *bops
+    cdef LevOpCode *mapped
+
+    if a1.kind != 1:
+        raise TypeError("%s grapheme clusters need two Unicodes" % name)
+    lengths[0] = a1.length
+    lengths[1] = a2.length
+    strings[0] = <const wchar_t*>a1.data
+    strings[1] = <const wchar_t*>a2.data
+    if lev_grapheme_split(2, lengths, strings, clusters) < 0:
+        raise MemoryError
+
+    ops = lev_u_editops_find(clusters[0].n, clusters[0].ids,
+                             clusters[1].n, clusters[1].ids, &n)
+    if not ops and n:
+        lev_grapheme_free(2, clusters)
+        raise MemoryError
+    bops = lev_editops_to_opcodes(n, ops, &nc, clusters[0].n, clusters[1].n)
+    free(ops)
+    if not bops and nc:
+        lev_grapheme_free(2, clusters)
+        raise MemoryError
+    mapped = lev_grapheme_map_opcodes(nc, bops, &clusters[0], &clusters[1], nb)
+    free(bops)
+    lev_grapheme_free(2, clusters)
+    if not mapped and nb[0]:
+        raise MemoryError
+    return mapped
+
 cdef LevEditType string_to_edittype(string):
     for i in range(N_OPCODE_NAMES):
         if <PyObject*>string == opcode_names[i].pystring:
@@ -265,11 +432,11 @@ def inverse(edit_operations):
     raise TypeError("inverse expected a list of edit operations")
 
 
-def editops(*args):
+def editops(*args, unit='codepoint'):
     """
     Find sequence of edit operations transforming one string to another.
     
-    editops(source_string, destination_string)
+    editops(source_string, destination_string[, unit])
     editops(edit_operations, source_length, destination_length)
     
     The result is a list of triples (operation, spos, dpos), where
@@ -279,6 +446,10 @@ def editops(*args):
     characters.  In fact the returned list doesn't contain the 'equal',
     but all the related functions accept both lists with and without
     'equal's.
+
+    With unit='grapheme' the strings are compared as sequences of
+    extended grapheme clusters (see graphemes()) and the operations found
+    between them are given for the characters they consist of.
     
     Examples
     --------
@@ -289,12 +460,16 @@ def editops(*args):
     can be used for conversion from opcodes (5-tuples) to editops (you can
     pass strings or their lengths, it doesn't matter).
     """
-    cdef size_t n, len1, len2
+    cdef size_t n, nb, len1, len2
     cdef LevEditOp* ops
     cdef LevOpCode* bops
+    cdef _StringArg a1, a2
+    cdef bint graphemes = grapheme_unit(unit, "editops")
 
     # convert: we were called (bops, s1, s2)
     if len(args) == 3:
+        if graphemes:
+            raise ValueError("editops unit only applies to strings")
         arg1, arg2, arg3 = args
 
         if not isinstance(arg1, list):
@@ -338,26 +513,19 @@ def editops(*args):
 
     # find editops: we were called (s1, s2)
     arg1, arg2 = args
-    if isinstance(arg1, bytes) and isinstance(arg2, bytes):
-        len1 = len(<bytes>arg1)
-        len2 = len(<bytes>arg2)
-
-        ops = lev_editops_find(
-            len1, <lev_byte*>PyBytes_AS_STRING(arg1),
-            len2, <lev_byte*>PyBytes_AS_STRING(arg2),
-            &n)
-
-    elif isinstance(arg1, str) and isinstance(arg2, str):
-        len1 = len(<str>arg1)
-        len2 = len(<str>arg2)
-
-        ops = lev_u_editops_find(
-            len1, <wchar_t*>PyUnicode_AS_UNICODE(arg1),
-            len2, <wchar_t*>PyUnicode_AS_UNICODE(arg2),
-            &n)
+    a1 = string_arg(arg1)
+    a2 = string_arg(arg2)
+    if a1.kind < 0 or a1.kind != a2.kind:
+        raise TypeError("editops expected two Strings or two Unicodes")
 
+    len1 = a1.length
+    len2 = a2.length
+    if graphemes:
+        bops = grapheme_opcodes(a1, a2, "editops", &nb)
+        ops = lev_opcodes_to_editops(nb, bops, &n, 0)
+        free(bops)
     else:
-        raise TypeError("editops expected two Strings or two Unicodes")
+        ops = find_editops(a1, a2, &n)
 
     if not ops and n:
         raise MemoryError
@@ -367,17 +535,21 @@ def editops(*args):
     return oplist
 
 
-def opcodes(*args):
+def opcodes(*args, unit='codepoint'):
     """
     Find sequence of edit operations transforming one string to another.
     
-    opcodes(source_string, destination_string)
+    opcodes(source_string, destination_string[, unit])
     opcodes(edit_operations, source_length, destination_length)
     
     The result is a list of 5-tuples with the same meaning as in
     SequenceMatcher's get_opcodes() output.  But since the algorithms
     differ, the actual sequences from Levenshtein and SequenceMatcher
     may differ too.
+
+    With unit='grapheme' the strings are compared as sequences of
+    extended grapheme clusters (see graphemes()), the blocks still give
+    positions in the strings and never split a cluster.
     
     Examples
     --------
@@ -396,9 +568,13 @@ def opcodes(*args):
     cdef size_t n, nb, len1, len2
     cdef LevEditOp* ops
     cdef LevOpCode* bops
+    cdef _StringArg a1, a2
+    cdef bint graphemes = grapheme_unit(unit, "opcodes")
 
     # convert: we were called (ops, s1, s2)
     if len(args) == 3:
+        if graphemes:
+            raise ValueError("opcodes unit only applies to strings")
         arg1, arg2, arg3 = args
 
         if not isinstance(arg1, list):
@@ -439,26 +615,20 @@ def opcodes(*args):
 
     # find editops: we were called (s1, s2)
     arg1, arg2 = args
-    if isinstance(arg1, bytes) and isinstance(arg2, bytes):
-        len1 = len(<bytes>arg1)
-        len2 = len(<bytes>arg2)
-
-        ops = lev_editops_find(
-            len1, <lev_byte*>PyBytes_AS_STRING(arg1),
-            len2, <lev_byte*>PyBytes_AS_STRING(arg2),
-            &n)
-
-    elif isinstance(arg1, str) and isinstance(arg2, str):
-        len1 = len(<str>arg1)
-        len2 = len(<str>arg2)
+    a1 = string_arg(arg1)
+    a2 = string_arg(arg2)
+    if a1.kind < 0 or a1.kind != a2.kind:
+        raise TypeError("opcodes expected two Strings or two Unicodes")
 
-        ops = lev_u_editops_find(
-            len1, <wchar_t*>PyUnicode_AS_UNICODE(arg1),
-            len2, <wchar_t*>PyUnicode_AS_UNICODE(arg2),
-            &n)
+    if graphemes:
+        bops = grapheme_opcodes(a1, a2, "opcodes", &nb)
+        oplist = opcodes_to_tuple_list(nb, bops)
+        free(bops)
+        return oplist
 
-    else:
-        raise TypeError("opcodes expected two Strings or two Unicodes")
+    len1 = a1.length
+    len2 = a2.length
+    ops = find_editops(a1, a2, &n)
 
     if not ops and n:
         raise MemoryError
@@ -663,98 +833,60 @@ def apply_edit(edit_operations, source_string, destination_string):
     cdef size_t n, len1, len2, len3
     cdef LevEditOp *ops
     cdef LevOpCode *bops
+    cdef void *s
+    cdef _StringArg a1, a2
 
     if not isinstance(edit_operations, list):
         raise TypeError("apply_edit first argument must be a List of edit operations")
 
     n = <size_t>len(<list>edit_operations)
 
-    if isinstance(source_string, bytes) and isinstance(destination_string, bytes):
-        if not n:
-            return source_string
-        
-        len1 = <size_t>len(<bytes>source_string)
-        len2 = <size_t>len(<bytes>destination_string)
+    a1 = string_arg(source_string)
+    a2 = string_arg(destination_string)
+    if a1.kind < 0 or a1.kind != a2.kind:
+        raise TypeError("apply_edit expected two Strings or two Unicodes")
 
-        string1 = PyBytes_AS_STRING(source_string)
-        string2 = PyBytes_AS_STRING(destination_string)
+    if not n:
+        return source_string
 
-        ops = extract_editops(edit_operations)
-        if ops:
-            if lev_editops_check_errors(len1, len2, n, ops):
-                free(ops)
-                raise ValueError("apply_edit edit operations are invalid or inapplicable")
+    len1 = a1.length
+    len2 = a2.length
 
-            s = lev_editops_apply(len1, <const lev_byte*>string1, len2, <const lev_byte*>string2,
-                            n, ops, &len3)
+    ops = extract_editops(edit_operations)
+    if ops:
+        if lev_editops_check_errors(len1, len2, n, ops):
             free(ops)
-            if not s and len3:
-                raise MemoryError
-            
-            result = PyBytes_FromStringAndSize(<const char*>s, <Py_ssize_t>len3)
-            free(s)
-            return result
+            raise ValueError("apply_edit edit operations are invalid or inapplicable")
 
+        if a1.kind == 0:
+            s = lev_editops_apply(len1, <const lev_byte*>a1.data, len2, <const lev_byte*>a2.data,
+                            n, ops, &len3)
+        else:
+            s = lev_u_editops_apply(len1, <const wchar_t*>a1.data, len2, <const wchar_t*>a2.data,
+                            n, ops, &len3)
+        free(ops)
+    else:
         bops = extract_opcodes(edit_operations)
-        if bops:
-            if lev_opcodes_check_errors(len1, len2, n, bops):
-                free(bops)
-                raise ValueError("apply_edit edit operations are invalid or inapplicable")
-            
-            s = lev_opcodes_apply(len1, <const lev_byte*>string1, len2, <const lev_byte*>string2,
-                            n, bops, &len3)
+        if not bops:
+            raise TypeError("apply_edit first argument must be a list of edit operations")
+        if lev_opcodes_check_errors(len1, len2, n, bops):
             free(bops)
-            if not s and len3:
-                raise MemoryError
-
-            result = PyBytes_FromStringAndSize(<const char*>s, <Py_ssize_t>len3)
-            free(s)
-            return result
-        
-        raise TypeError("apply_edit first argument must be a list of edit operations")
-
-    if isinstance(source_string, str) and isinstance(destination_string, str):
-        if not n:
-            return source_string
-        
-        len1 = <size_t>len(<str>source_string)
-        len2 = <size_t>len(<str>destination_string)
-
-        string1 = PyUnicode_AS_UNICODE(source_string)
-        string2 = PyUnicode_AS_UNICODE(destination_string)
+            raise ValueError("apply_edit edit operations are invalid or inapplicable")
 
-        ops = extract_editops(edit_operations)
-        if ops:
-            if lev_editops_check_errors(len1, len2, n, ops):
-                free(ops)
-                raise ValueError("apply_edit edit operations are invalid or inapplicable")
-
-            s = lev_u_editops_apply(len1, <const wchar_t*>string1, len2, <const wchar_t*>string2,
-                            n, ops, &len3)
-            free(ops)
-            if not s and len3:
-                raise MemoryError
-            
-            result = PyUnicode_FromWideChar(<const wchar_t*>s, <Py_ssize_t>len3)
-            free(s)
-            return result
-
-        bops = extract_opcodes(edit_operations)
-        if bops:
-            if lev_opcodes_check_errors(len1, len2, n, bops):
-                free(bops)
-                raise ValueError("apply_edit edit operations are invalid or inapplicable")
-            
-            s = lev_u_opcodes_apply(len1, <const wchar_t*>string1, len2, <const wchar_t*>string2,
+        if a1.kind == 0:
+            s = lev_opcodes_apply(len1, <const lev_byte*>a1.data, len2, <const lev_byte*>a2.data,
                             n, bops, &len3)
-            free(bops)
-            if not s and len3:
-                raise MemoryError
+        else:
+            s = lev_u_opcodes_apply(len1, <const wchar_t*>a1.data, len2, <const wchar_t*>a2.data,
+                            n, bops, &len3)
+        free(bops)
 
-            result = PyUnicode_FromWideChar(<const wchar_t*>s, <Py_ssize_t>len3)
-            free(s)
-            return result
-        
-        raise TypeError("apply_edit first argument must be a list of edit operations")
-    
-    raise TypeError("apply_edit expected two Strings or two Unicodes")
+    if not s and len3:
+        raise MemoryError
+
+    if a1.kind == 0:
+        result = PyBytes_FromStringAndSize(<const char*>s, <Py_ssize_t>len3)
+    else:
+        result = PyUnicode_FromWideChar(<const wchar_t*>s, <Py_ssize_t>len3)
+    free(s)
+    return result
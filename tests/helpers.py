@@ -0,0 +1,13 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+"""
+Helpers shared by the tests.
+"""
+
+def random_strings(rnd, n, alphabet='abcd', lo=1, hi=8):
+    """
+    n random strings of the alphabet with lengths from lo to hi, drawn from
+    the random.Random rnd
+    """
+    return [''.join(rnd.choice(alphabet) for _ in range(rnd.randint(lo, hi)))
+            for _ in range(n)]
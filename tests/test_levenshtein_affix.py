@@ -0,0 +1,49 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import random
+import pytest
+import Levenshtein
+
+def test_long_common_affixes():
+    """
+    a difference anywhere in long strings with common prefix and suffix is
+    found, also when the symbols differ in their high bytes only, by the
+    pair, index and median engines as well
+    """
+    rnd = random.Random(4)
+    for alphabet, other in (('ab', 'c'), (u'abĀ', u'Ȁ'),
+                            (u'ab\U00010041', u'\U00020041')):
+        for length in (0, 1, 7, 8, 15, 16, 17, 31, 33, 100):
+            s = ''.join(rnd.choice(alphabet) for _ in range(length))
+            index = Levenshtein.DeleteIndex([s], 1)
+            assert index.lookup(s) == [(s, 0, 1.0)]
+            for i in sorted({0, length // 3, length // 2, length - 1}):
+                if i < 0 or i >= length:
+                    continue
+                t = s[:i] + other + s[i + 1:]
+                assert Levenshtein.distance(s, t) == 1
+                assert list(Levenshtein.paired([s, t], [t, s])) == [1, 1]
+                assert list(Levenshtein.paired([s], [t], 'hamming')) == [1]
+                assert (list(Levenshtein.paired([s], [t], 'ratio'))
+                        == [pytest.approx((length - 1) / length)])
+                assert index.lookup(t) == [(s, 1, 1.0)]
+                assert Levenshtein.median([s, t, s]) == s
+                assert Levenshtein.median_improve(t, [s, t, s]) == s
+                assert Levenshtein.editops(s, t) == [('replace', i, i)]
+                assert Levenshtein.seqratio([s, t, 'x'], [s, t, 'x']) == 1.0
+                u = s[:i] + s[i + 1:]
+                assert Levenshtein.distance(s, u) == 1
+                ops = Levenshtein.editops(s, u)
+                assert len(ops) == 1 and ops[0][0] == 'delete'
+                assert Levenshtein.apply_edit(ops, s, u) == u
+                assert (Levenshtein.ratio(s, u)
+                        == pytest.approx((2 * length - 2) / (2 * length - 1)))
+                assert list(Levenshtein.paired([s, u], [u, s])) == [1, 1]
+                assert (list(Levenshtein.paired([s], [u], 'ratio'))
+                        == [pytest.approx((2 * length - 2) / (2 * length - 1))])
+                assert index.lookup(u) == [(s, 1, 1.0)]
+                assert Levenshtein.median([s, u, s]) == s
+            assert Levenshtein.distance(s, s) == 0
+            b = s.encode('utf-8')
+            assert Levenshtein.distance(b, b + b'z') == 1
@@ -0,0 +1,122 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import asyncio
+import os
+import pytest
+import Levenshtein
+from Levenshtein import aio
+
+def run(coroutine):
+    loop = asyncio.new_event_loop()
+    try:
+        return loop.run_until_complete(coroutine)
+    finally:
+        loop.close()
+
+def test_results():
+    """
+    the coroutines compute what the functions do
+    """
+    a = ['newspaper', 'litter bin', 'tinny', 'antelope']
+    b = ['caribou', 'sausage', 'gorn', 'woody']
+
+    async def main():
+        return await asyncio.gather(
+            aio.distance('spam', 'park'),
+            aio.ratio(b'spam', b'park'),
+            aio.editops('spam', 'park'),
+            aio.setratio(a, b),
+            aio.seqratio(a, b),
+            aio.median(['SpSm', 'mpamm', 'Spam', 'Spa', 'Sua', 'hSam']),
+            aio.median([b'spam', b'spa', b'sam'], [1, 2, 3]),
+            aio.setratio([], b))
+
+    assert run(main()) == [
+        Levenshtein.distance('spam', 'park'),
+        Levenshtein.ratio(b'spam', b'park'),
+        Levenshtein.editops('spam', 'park'),
+        Levenshtein.setratio(a, b),
+        Levenshtein.seqratio(a, b),
+        Levenshtein.median(['SpSm', 'mpamm', 'Spam', 'Spa', 'Sua', 'hSam']),
+        Levenshtein.median([b'spam', b'spa', b'sam'], [1, 2, 3]),
+        Levenshtein.setratio([], b)]
+
+def test_many_requests():
+    """
+    concurrent requests are coalesced, each still gets its own result
+    """
+    words = ['w%d' % i for i in range(500)]
+
+    async def main():
+        return await asyncio.gather(*[aio.distance(w, 'w0') for w in words])
+
+    assert run(main()) == [Levenshtein.distance(w, 'w0') for w in words]
+
+def test_errors():
+    """
+    bad arguments fail their own request only
+    """
+    async def main():
+        good = aio.distance('spam', 'park')
+        with pytest.raises(TypeError):
+            await aio.distance('spam', b'park')
+        with pytest.raises(TypeError):
+            await aio.setratio(['spam'], [b'park'])
+        return await good
+
+    assert run(main()) == 3
+
+@pytest.mark.skipif(os.name == 'nt', reason="wake fds are Unix only")
+def test_closed_wake_fd():
+    """
+    a batch whose wake pipe is closed while it runs doesn't write into
+    whatever reuses the fd number
+    """
+    from Levenshtein._levenshtein import AioBatch
+    long1 = 'ab' * 3000
+    long2 = 'ba' * 3000
+    rfd, wfd = os.pipe()
+    batch = AioBatch([('distance', long1, long2)], wfd)
+    os.close(rfd)
+    os.close(wfd)
+    rfd, wfd = os.pipe()
+    try:
+        batch.wait()
+        assert batch.results() == [Levenshtein.distance(long1, long2)]
+        os.set_blocking(rfd, False)
+        with pytest.raises(BlockingIOError):
+            os.read(rfd, 1)
+    finally:
+        os.close(rfd)
+        os.close(wfd)
+
+def test_bounded_batches(monkeypatch):
+    """
+    requests coming in over many loop iterations wait for a free batch
+    instead of each starting its own thread
+    """
+    monkeypatch.setattr(aio, 'max_batches', 2)
+    monkeypatch.setattr(aio, 'threads', 1)
+    strings = ['spam' * 300, 'spma' * 300, 'sapm' * 300]
+    tasks_dir = '/proc/self/task'
+
+    async def main():
+        loop = asyncio.get_running_loop()
+        base = len(os.listdir(tasks_dir)) if os.path.isdir(tasks_dir) else 0
+        requests, most, live = [], 0, 0
+        for _ in range(40):
+            requests.append(asyncio.ensure_future(aio.median(strings)))
+            await asyncio.sleep(0)
+            dispatcher = aio._dispatchers.get(loop)
+            if dispatcher is not None:
+                most = max(most, len(dispatcher.running))
+            if base:
+                live = max(live, len(os.listdir(tasks_dir)) - base)
+        results = await asyncio.gather(*requests)
+        return results, most, live
+
+    results, most, live = run(main())
+    assert results == [Levenshtein.median(strings)] * 40
+    assert 1 <= most <= 2
+    assert live <= 2
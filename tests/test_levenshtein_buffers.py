@@ -0,0 +1,64 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import array
+import mmap
+import pytest
+import Levenshtein
+from Levenshtein._levenshtein import cgk_sketch
+
+def test_single_strings():
+    """
+    buffers of 1 byte characters act as bytes, wider ones as str
+    """
+    assert Levenshtein.editops(bytearray(b'spam'), memoryview(b'park')) \
+        == Levenshtein.editops('spam', 'park')
+    assert Levenshtein.opcodes(array.array('u', 'spam'), 'park') \
+        == Levenshtein.opcodes('spam', 'park')
+    e = Levenshtein.editops('man', 'scotsman')
+    assert Levenshtein.apply_edit(e, bytearray(b'man'), b'scotsman') \
+        == b'scotsman'
+    assert Levenshtein.apply_edit(e, array.array('H', map(ord, 'man')),
+                                  'scotsman') == 'scotsman'
+    assert Levenshtein.quick_ratio(bytearray(b'abc'), b'abd') \
+        == Levenshtein.quick_ratio(b'abc', b'abd')
+    assert cgk_sketch(memoryview(b'abc'), 8) == cgk_sketch(b'abc', 8)
+    with mmap.mmap(-1, 5) as m:
+        m.write(b'hello')
+        assert Levenshtein.median_improve(m, [b'hallo', b'hello']) == b'hello'
+    with pytest.raises(TypeError):
+        Levenshtein.editops(array.array('d', [1.0]), b'a')
+    with pytest.raises(TypeError):
+        Levenshtein.quick_ratio(bytearray(b'a'), 'a')
+
+def test_string_lists():
+    strings = ['spam', 'spar', 'sbam', 'park']
+    expected = Levenshtein.median(strings)
+    assert Levenshtein.median([bytearray(s.encode()) for s in strings]) \
+        == expected.encode()
+    assert Levenshtein.median([array.array('H', map(ord, s))
+                               for s in strings]) == expected
+    assert Levenshtein.setratio([memoryview(b'ab')], [b'ab']) == 1.0
+    with pytest.raises(TypeError):
+        Levenshtein.median([b'a', bytearray(b'b'), 'c'])
+
+def test_fixed_width_rows():
+    """
+    a 2d buffer is a list of NUL padded strings
+    """
+    rows = memoryview(bytearray(b'ab\0\0abc\0abcd')).cast('B', shape=[3, 4])
+    assert list(Levenshtein.paired(rows, [b'ab', b'ab', b'ab'])) == [0, 1, 2]
+    assert Levenshtein.seqratio(rows, [b'ab', b'abc', b'abcd']) == 1.0
+    index = Levenshtein.DeleteIndex(rows, 1)
+    assert index.lookup(b'abx') == [(b'ab', 1, 1.0), (b'abc', 1, 1.0)]
+    wide = array.array('I', map(ord, 'ab\0abc')).tobytes()
+    rows = memoryview(wide).cast('I', shape=[2, 3])
+    assert Levenshtein.setratio(rows, ['ab', 'abc']) == 1.0
+
+def test_numpy():
+    np = pytest.importorskip('numpy')
+    words = ['spam', 'spar', 'sbam', u'pärk', '']
+    for a in [np.array(words), np.array([w.encode() for w in words[:3]])]:
+        strings = a.tolist()
+        assert Levenshtein.median(a) == Levenshtein.median(strings)
+        assert list(Levenshtein.paired(a, strings)) == [0]*len(strings)
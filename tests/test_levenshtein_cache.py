@@ -0,0 +1,139 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import os
+import random
+import pytest
+import Levenshtein
+from Levenshtein import DistanceCache
+from Levenshtein.matrix import tiles
+from Levenshtein._levenshtein import sketch_rerank
+from helpers import random_strings
+
+def test_persistence(tmp_path):
+    """
+    cached scores are the computed ones, also after reopening the file
+    """
+    rnd = random.Random(1)
+    a = random_strings(rnd, 50, 'abc', 60, 200)
+    b = random_strings(rnd, 50, 'abc', 60, 200)
+    filename = str(tmp_path / 'distances')
+    dists = list(Levenshtein.paired(a, b))
+    ratios = list(Levenshtein.paired(a, b, 'ratio'))
+    with DistanceCache(filename, 1000) as cache:
+        assert cache.capacity == 1024
+        for _ in range(2):
+            assert list(Levenshtein.paired(a, b, cache=cache)) == dists
+            assert list(Levenshtein.paired(a, b, 'ratio',
+                                           cache=cache)) == ratios
+        count = len(cache)
+        assert count > 0
+    cache = DistanceCache(filename, 10)
+    assert cache.capacity == 1024
+    assert len(cache) == count
+    assert list(Levenshtein.paired(a, b, cache=cache)) == dists
+    assert list(Levenshtein.paired(b, a, 'ratio', cache=cache)) == ratios
+    # bytes and text of the same code points share the distances
+    assert list(Levenshtein.paired([s.encode() for s in a],
+                                   [s.encode() for s in b],
+                                   cache=cache)) == dists
+    assert len(cache) == count
+    cache.close()
+
+def test_shared(tmp_path):
+    """
+    caches open on the same file see each other's distances at once, and
+    closing one doesn't overwrite what the other added
+    """
+    rnd = random.Random(4)
+    a = random_strings(rnd, 40, 'abc', 60, 200)
+    b = random_strings(rnd, 40, 'abc', 60, 200)
+    filename = str(tmp_path / 'distances')
+    first = DistanceCache(filename, 1000)
+    second = DistanceCache(filename)
+    Levenshtein.paired(a[:20], b[:20], cache=first)
+    count = len(first)
+    assert count > 0 and len(second) == count
+    Levenshtein.paired(a[20:], b[20:], cache=second)
+    assert len(first) == len(second) > count
+    count = len(second)
+    second.close()
+    first.close()
+    with DistanceCache(filename) as cache:
+        assert len(cache) == count
+
+def test_eviction(tmp_path):
+    """
+    a full cache stays within its capacity and correct
+    """
+    rnd = random.Random(2)
+    a = random_strings(rnd, 500, 'ab', 70, 120)
+    b = random_strings(rnd, 500, 'ab', 70, 120)
+    with DistanceCache(str(tmp_path / 'distances'), 1) as cache:
+        for _ in range(2):
+            assert (list(Levenshtein.paired(a, b, cache=cache, workers=3))
+                    == [Levenshtein.distance(x, y) for x, y in zip(a, b)])
+        assert 0 < len(cache) <= cache.capacity < 500
+
+def test_matrix_and_rerank(tmp_path):
+    """
+    score matrices and sketch re-ranking use the cache too
+    """
+    rnd = random.Random(3)
+    a = random_strings(rnd, 20, 'aé€𝄞', 50, 150)
+    with DistanceCache(str(tmp_path / 'distances')) as cache:
+        for scorer in ['ratio', 'distance']:
+            expected = list(tiles(a, scorer=scorer, tile_size=6))
+            for _ in range(2):
+                assert list(tiles(a, scorer=scorer, tile_size=6,
+                                  cache=cache)) == expected
+        expected = sketch_rerank(a[0], a, range(20))
+        assert sketch_rerank(a[0], a, range(20), cache) == expected
+        assert sketch_rerank(a[0], a, range(20), cache) == expected
+
+def _open_and_fill(filename, a, b, start, results):
+    start.wait()
+    with DistanceCache(filename, 1 << 16) as cache:
+        results.put((list(Levenshtein.paired(a, b, cache=cache)),
+                     cache.capacity))
+
+@pytest.mark.skipif(os.name == 'nt', reason="needs fork")
+def test_concurrent_create(tmp_path):
+    """
+    processes creating the same cache at once all get the one complete file
+    """
+    import multiprocessing
+    rnd = random.Random(4)
+    a = random_strings(rnd, 20, 'ab', 60, 100)
+    b = random_strings(rnd, 20, 'ab', 60, 100)
+    filename = str(tmp_path / 'distances')
+    context = multiprocessing.get_context('fork')
+    start = context.Event()
+    results = context.Queue()
+    processes = [context.Process(target=_open_and_fill,
+                                 args=(filename, a, b, start, results))
+                 for _ in range(8)]
+    for p in processes:
+        p.start()
+    start.set()
+    dists = list(Levenshtein.paired(a, b))
+    for _ in processes:
+        assert results.get(timeout=60) == (dists, 1 << 16)
+    for p in processes:
+        p.join()
+        assert p.exitcode == 0
+    assert os.listdir(str(tmp_path)) == ['distances']
+    with DistanceCache(filename) as cache:
+        assert cache.capacity == 1 << 16
+
+def test_errors(tmp_path):
+    filename = tmp_path / 'distances'
+    filename.write_bytes(b'not a cache')
+    with pytest.raises(OSError):
+        DistanceCache(str(filename))
+    cache = DistanceCache(str(tmp_path / 'other'))
+    cache.close()
+    with pytest.raises(ValueError):
+        Levenshtein.paired(['a'], ['b'], cache=cache)
+    with pytest.raises(TypeError):
+        Levenshtein.paired(['a'], ['b'], cache=str(filename))
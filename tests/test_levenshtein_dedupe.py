@@ -0,0 +1,67 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import io
+import Levenshtein
+from Levenshtein.dedupe import Clusters, dedupe
+from Levenshtein._levenshtein import scan_lines
+
+def test_clusters():
+    """
+    clusters are the connected components of words within the distance
+    """
+    index = Levenshtein.DeleteIndex(['spam', 'eggs', 'spar', 'park', 'egg'])
+    assert index.clusters(1) == [0, 1, 0, 3, 1]
+    assert index.clusters(2) == [0, 1, 0, 0, 1]
+    assert index.clusters(0) == [0, 1, 2, 3, 4]
+    words = ['w%03d' % i for i in range(300)]
+    assert Levenshtein.DeleteIndex(words, 1).clusters(threads=3) == [0] * 300
+
+def test_normalization():
+    """
+    lines differing only in whitespace (and case) are identical
+    """
+    c = Clusters(['Spam  eggs', ' spam eggs ', 'ham'], 0, casefold=True)
+    assert c.words == ['spam eggs', 'ham']
+    assert [c.line_cluster(i) for i in range(3)] == [0, 0, 2]
+    lines = ['Spam  eggs', ' spam eggs ', 'ham']
+    c = Clusters(lines, 0, casefold=True, keep_lines=False)
+    assert c.line_words is None and len(c) == 3
+    assert [c.cluster(line)[0] for line in lines] == [0, 0, 2]
+
+def test_dedupe(tmp_path):
+    """
+    the representatives and the cluster ids written by the CLI pipeline
+    """
+    path = tmp_path / 'lines.txt'
+    path.write_text('spam\neggs\nspma\nbacon\nspan\neggs\n')
+    out = io.StringIO()
+    dedupe(str(path), out, 1, output='ids')
+    assert out.getvalue() == '0\n1\n2\n3\n0\n1\n'
+    out = io.StringIO()
+    dedupe(str(path), out, 2)
+    assert out.getvalue() == 'spam\neggs\nbacon\n'
+    out = io.StringIO()
+    dedupe(str(path), out, 2, use_median=True)
+    assert out.getvalue().split('\n')[1:] == ['eggs', 'bacon', '']
+
+def test_scan_lines():
+    """
+    lines scanned in C are normalized and numbered like the Python ones,
+    also with Unicode whitespace, invalid UTF-8 and CR LF
+    """
+    text = ('Spam  eggs\r\n\nspam eggs\n　ham \x1f\n'
+            'Ham\xe9\n').encode() + b'\xe2\x80 \xff\xc2\xa0x\r\n\r\nspam eggs'
+    lines = [line.rstrip(b'\r\n').decode('utf-8', 'surrogateescape')
+             for line in io.BytesIO(text)]
+    for casefold in (False, True):
+        expected = Clusters(lines, 1, casefold=casefold)
+        c = Clusters.from_buffer(text, 1, casefold=casefold)
+        assert c.words == expected.words
+        assert list(c.counts) == list(expected.counts)
+        assert list(c.first) == list(expected.first)
+        assert len(c) == len(lines) == 8
+        assert ([c.line_cluster(i) for i in range(len(c))]
+                == [expected.line_cluster(i) for i in range(len(c))])
+    assert scan_lines(b'') == ([], b'', b'', b'', b'')
+    assert scan_lines(b'\n')[0] == ['']
@@ -0,0 +1,67 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import random
+import Levenshtein
+
+def test_lookup():
+    """
+    words are ranked by distance and then by frequency
+    """
+    index = Levenshtein.DeleteIndex(['spam', 'spar', 'park', 'eggs'], 2, [5, 9, 1, 1])
+    assert len(index) == 4
+    assert index.max_k == 2
+    assert index.lookup('spak') == [('spar', 1, 9.0), ('spam', 1, 5.0), ('park', 2, 1.0)]
+    assert index.lookup('spak', 1) == [('spar', 1, 9.0), ('spam', 1, 5.0)]
+    assert index.lookup('ham') == [('spam', 2, 5.0)]
+
+def test_lookup_matches_distance():
+    """
+    lookup finds exactly the words within the distance
+    """
+    words = ['', 'a', 'ab', 'abba', 'baba', 'aaaa', 'abcd', u'ábcd', 'dcba']
+    index = Levenshtein.DeleteIndex(words, 2)
+    for query in ['', 'ab', 'bab', 'abcde', u'ábc', 'xyzw']:
+        found = sorted(w for w, d, f in index.lookup(query))
+        assert found == sorted(w for w in words
+                               if Levenshtein.distance(query, w) <= 2)
+
+def test_lookup_long_words():
+    """
+    queries up to a machine word and longer ones, with symbols of any size,
+    find exactly the words within the distance
+    """
+    rnd = random.Random(4)
+    def mutate(w):
+        w = list(w)
+        for _ in range(rnd.randint(0, 3)):
+            i = rnd.randint(0, len(w))
+            op = rnd.choice('ids')
+            if op == 'i':
+                w.insert(i, rnd.choice(u'ab\u0100\u4e00'))
+            elif i < len(w):
+                if op == 'd':
+                    del w[i]
+                else:
+                    w[i] = rnd.choice(u'ab\u0100\u4e00')
+        return ''.join(w)
+    words = [''.join(rnd.choice(u'ab\u0100\u4e00')
+                     for _ in range(rnd.randint(60, 70))) for _ in range(20)]
+    words += [mutate(w) for w in words]
+    index = Levenshtein.DeleteIndex(words, 2)
+    for query in [mutate(w) for w in words] + [w[1:] for w in words]:
+        found = sorted((w, d) for w, d, f in index.lookup(query))
+        assert found == sorted((w, Levenshtein.distance(query, w))
+                               for w in words
+                               if Levenshtein.distance(query, w) <= 2)
+
+def test_save_load(tmp_path):
+    """
+    a loaded index gives the same results
+    """
+    index = Levenshtein.DeleteIndex([b'spam', b'spar', b'eggs'], 1)
+    filename = str(tmp_path / 'words.idx')
+    index.save(filename)
+    loaded = Levenshtein.DeleteIndex.load(filename)
+    assert len(loaded) == 3
+    assert loaded.lookup(b'spa') == index.lookup(b'spa')
@@ -0,0 +1,133 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import random
+import threading
+import pytest
+import Levenshtein
+from Levenshtein import DynamicIndex
+from Levenshtein.dynamic import Compactor
+from helpers import random_strings
+
+def brute_force(words, query, max_k):
+    found = [(w, Levenshtein.distance(query, w), i) for i, w in words.items()]
+    return sorted([m for m in found if m[1] <= max_k],
+                  key=lambda m: (m[1], m[2]))
+
+def test_lookup():
+    index = DynamicIndex(['spam', 'eggs'])
+    assert index.max_k == 2
+    assert index.insert('spar') == 2
+    index.delete(0)
+    assert len(index) == 2
+    assert index.lookup('spak', 1) == [('spar', 1, 2)]
+    assert index.lookup('spak') == [('spar', 1, 2)]
+    with pytest.raises(KeyError):
+        index.delete(0)
+    with pytest.raises(ValueError):
+        index.lookup('spak', 3)
+    with pytest.raises(TypeError):
+        index.insert(b'ham')
+    assert DynamicIndex().lookup('spam') == []
+
+def test_inserts_deletes_compaction():
+    """
+    lookups find exactly the live words, across segments and compactions
+    """
+    rnd = random.Random(1)
+    index = DynamicIndex(max_k=2)
+    words = {}
+    for step in range(3000):
+        if words and rnd.random() < 0.3:
+            i = rnd.choice(list(words))
+            index.delete(i)
+            del words[i]
+        else:
+            w = random_strings(rnd, 1)[0]
+            words[index.insert(w)] = w
+        if step % 500 == 499:
+            index.compact(full=step % 1000 == 999)
+        if step % 100 == 0:
+            query = random_strings(rnd, 1)[0]
+            k = rnd.randint(0, 2)
+            assert index.lookup(query, k) == brute_force(words, query, k)
+    assert len(index) == len(words)
+    index.compact(full=True)
+    assert index.snapshot().segments <= 2
+    for query in random_strings(rnd, 20):
+        assert index.lookup(query) == brute_force(words, query, 2)
+
+def test_long_words():
+    """
+    the words not indexed yet are verified right on both sides of a machine
+    word
+    """
+    rnd = random.Random(3)
+    words = dict(enumerate(random_strings(rnd, 60, u'ab\u0100', 60, 68)))
+    index = DynamicIndex(words.values())
+    for query in random_strings(rnd, 10, u'ab\u0100', 60, 68) + [
+            words[i][:-1] for i in range(0, 60, 6)]:
+        assert index.lookup(query) == brute_force(words, query, 2)
+
+def test_snapshot():
+    """
+    a snapshot doesn't see later writes
+    """
+    index = DynamicIndex([b'spam', b'eggs'] * 100, 1)
+    snap = index.snapshot()
+    index.delete(0)
+    index.insert(b'spa')
+    index.compact(full=True)
+    assert len(snap) == 200
+    assert snap[0] == b'spam'
+    with pytest.raises(KeyError):
+        snap[200]
+    assert len(snap.lookup(b'spa')) == 100
+    assert len(index.lookup(b'spa')) == 100
+    assert index.snapshot()[200] == b'spa'
+    del index
+    assert snap.lookup(b'egg')[0] == (b'eggs', 1, 1)
+
+def test_concurrent_writers():
+    """
+    writers, readers and the compactor run at the same time
+    """
+    rnd = random.Random(2)
+    index = DynamicIndex(max_k=1)
+    batches = [random_strings(rnd, 500, 'abc', 5, 12) for _ in range(4)]
+    errors = []
+
+    def write(batch):
+        ids = [index.insert(w) for w in batch]
+        for i in ids[::2]:
+            index.delete(i)
+
+    def read():
+        try:
+            for w in batches[0][:200]:
+                for found, d, i in index.lookup(w):
+                    assert Levenshtein.distance(found, w) == d <= 1
+        except AssertionError as e:
+            errors.append(e)
+
+    with Compactor(index, interval=0.001):
+        threads = [threading.Thread(target=write, args=(b,)) for b in batches]
+        threads += [threading.Thread(target=read) for _ in range(2)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+    assert not errors
+    assert len(index) == 1000
+    snap = index.snapshot()
+    live = {i: snap[i] for i in range(2000) if _has(snap, i)}
+    assert len(live) == 1000
+    for w in batches[1][:50]:
+        assert index.lookup(w) == brute_force(live, w, 1)
+
+def _has(snap, i):
+    try:
+        snap[i]
+    except KeyError:
+        return False
+    return True
@@ -0,0 +1,67 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import pytest
+import Levenshtein
+
+FAMILY = u'\U0001F468\u200d\U0001F469\u200d\U0001F467'
+FLAG_AT = u'\U0001F1E6\U0001F1F9'
+FLAG_DE = u'\U0001F1E9\U0001F1EA'
+
+def test_graphemes():
+    assert Levenshtein.graphemes(u'') == []
+    assert Levenshtein.graphemes(u'cafe\u0301') == [
+        u'c', u'a', u'f', u'e\u0301']
+    assert Levenshtein.graphemes(FAMILY + u'!') == [FAMILY, u'!']
+    assert Levenshtein.graphemes(FLAG_AT + FLAG_DE) == [FLAG_AT, FLAG_DE]
+    assert Levenshtein.graphemes(u'a\r\nb') == [u'a', u'\r\n', u'b']
+    # Hangul jamo L V T make one syllable
+    assert Levenshtein.graphemes(u'\u1100\u1161\u11a8\uac00') == [
+        u'\u1100\u1161\u11a8', u'\uac00']
+    # Devanagari conjunct: consonant, virama, consonant (GB9c)
+    assert Levenshtein.graphemes(u'\u0915\u094d\u0937\u093f') == [
+        u'\u0915\u094d\u0937\u093f']
+    with pytest.raises(TypeError):
+        Levenshtein.graphemes(b'abc')
+
+def test_grapheme_distance():
+    assert Levenshtein.distance(FAMILY, u'\U0001F468') == 4
+    assert Levenshtein.distance(FAMILY, u'\U0001F468', unit='grapheme') == 1
+    assert Levenshtein.distance(FLAG_AT, FLAG_DE, unit='grapheme') == 1
+    # precomposed and decomposed e acute are different clusters
+    assert Levenshtein.distance(u'caf\xe9', u'cafe\u0301') == 2
+    assert Levenshtein.distance(u'caf\xe9', u'cafe\u0301',
+                                unit='grapheme') == 1
+    assert Levenshtein.distance(u'', u'', unit='grapheme') == 0
+    assert Levenshtein.ratio(u'a' + FAMILY, u'a', unit='grapheme') == (
+        pytest.approx(2.0 / 3.0))
+    assert Levenshtein.ratio(u'', u'', unit='grapheme') == 1.0
+    with pytest.raises(TypeError):
+        Levenshtein.distance(b'ab', b'ac', unit='grapheme')
+    with pytest.raises(ValueError):
+        Levenshtein.ratio(u'ab', u'ac', unit='byte')
+
+def test_grapheme_opcodes():
+    """
+    blocks never split a cluster and are given in code point offsets
+    """
+    s1 = u'x' + FAMILY + u'z'
+    s2 = u'xyz'
+    ops = Levenshtein.opcodes(s1, s2, unit='grapheme')
+    assert ops == [('equal', 0, 1, 0, 1), ('replace', 1, 2, 1, 2),
+                   ('delete', 2, 6, 2, 2), ('equal', 6, 7, 2, 3)]
+    assert Levenshtein.opcodes(s2, s1, unit='grapheme') == [
+        ('equal', 0, 1, 0, 1), ('replace', 1, 2, 1, 2),
+        ('insert', 2, 2, 2, 6), ('equal', 2, 3, 6, 7)]
+    assert Levenshtein.apply_edit(ops, s1, s2) == s2
+    editops = Levenshtein.editops(s1, s2, unit='grapheme')
+    assert Levenshtein.apply_edit(editops, s1, s2) == s2
+    assert Levenshtein.opcodes(editops, s1, s2) == ops
+    with pytest.raises(ValueError):
+        Levenshtein.editops(editops, s1, s2, unit='grapheme')
+
+    s1 = u'ab' + FLAG_AT + u'y\u0301c\r\n'
+    s2 = u'a' + FLAG_DE + u'yc\r'
+    for ops in (Levenshtein.opcodes(s1, s2, unit='grapheme'),
+                Levenshtein.editops(s1, s2, unit='grapheme')):
+        assert Levenshtein.apply_edit(ops, s1, s2) == s2
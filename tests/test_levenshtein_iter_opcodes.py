@@ -0,0 +1,61 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import random
+import Levenshtein
+
+def random_pair(rnd, alphabet, n):
+    a = ''.join(rnd.choice(alphabet) for _ in range(rnd.randint(0, n)))
+    b = list(a)
+    for _ in range(rnd.randint(0, n // 4 + 1)):
+        if b and rnd.random() < 0.5:
+            del b[rnd.randrange(len(b))]
+        else:
+            b.insert(rnd.randint(0, len(b)), rnd.choice(alphabet))
+    return a, ''.join(b)
+
+def test_same_as_opcodes():
+    """
+    the iterated opcodes are exactly the opcodes
+    """
+    rnd = random.Random(1)
+    pairs = [('spam', 'park'), ('', ''), ('abc', 'abc'), ('', 'abc'),
+             ('abc', ''), ('man', 'scotsman'), (u'Levenšhtein', u'Lenvinšten')]
+    pairs += [random_pair(rnd, alphabet, 30)
+              for alphabet in ['ab', 'abcdef', u'aé€𝄞'] for _ in range(300)]
+    for a, b in pairs:
+        assert list(Levenshtein.iter_opcodes(a, b)) == Levenshtein.opcodes(a, b)
+        a, b = a.encode(), b.encode()
+        assert list(Levenshtein.iter_opcodes(a, b)) == Levenshtein.opcodes(a, b)
+
+def test_many_blocks():
+    """
+    long strings are resolved in many blocks, still giving the opcodes
+    """
+    rnd = random.Random(2)
+    for n1, n2 in [(2000, 2000), (3000, 40), (40, 3000), (1500, 0)]:
+        a = ''.join(rnd.choice('abcd') for _ in range(n1))
+        b = ''.join(rnd.choice('abcd') for _ in range(n2))
+        assert list(Levenshtein.iter_opcodes(a, b)) == Levenshtein.opcodes(a, b)
+    a, b = random_pair(rnd, 'abcd', 3000)
+    it = Levenshtein.iter_opcodes(bytearray(a.encode()), b.encode())
+    first = next(it)
+    assert [first] + list(it) == Levenshtein.opcodes(a, b)
+
+def test_bit_vector_rows():
+    """
+    the bit vector rows give the opcodes across word boundaries, for bytes,
+    for Unicode strings remapped to bytes and for ones that can't be
+    """
+    rnd = random.Random(3)
+    many = u''.join(chr(0x4e00 + i) for i in range(300))
+    for alphabet in ['ab', 'abcdefghijklmnopqrstuvwxyz', u'αβγ€𝄞', many]:
+        for n in (1, 63, 64, 65, 129, 700):
+            a = ''.join(rnd.choice(alphabet) for _ in range(n))
+            b = list(a)
+            for _ in range(n // 4 + 1):
+                b[rnd.randrange(n)] = rnd.choice(alphabet)
+            b = ''.join(b[rnd.randint(0, 3):])
+            for x, y in [(a, b), (b, a)]:
+                assert list(Levenshtein.iter_opcodes(x, y)) == \
+                    Levenshtein.opcodes(x, y)
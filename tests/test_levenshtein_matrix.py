@@ -0,0 +1,69 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import random
+from array import array
+import pytest
+import Levenshtein
+from Levenshtein.matrix import tiles, write_matrix
+from helpers import random_strings
+
+def assemble(shape, tile_iter):
+    matrix = [[None] * shape[1] for _ in range(shape[0])]
+    for rows, cols, tile in tile_iter:
+        for i, r in enumerate(rows):
+            for j, c in enumerate(cols):
+                matrix[r][c] = tile[i * len(cols) + j]
+    return matrix
+
+def test_tiles():
+    """
+    the tiles cover the matrix, short and long strings, both scorers
+    """
+    rnd = random.Random(2)
+    for alphabet in ['ab', 'aé€𝄞']:
+        a = random_strings(rnd, 40, alphabet, 0, 90)
+        b = random_strings(rnd, 30, alphabet, 0, 90)
+        ratios = assemble((40, 30), tiles(a, b, tile_size=7, workers=2))
+        assert ratios == [[pytest.approx(Levenshtein.ratio(x, y)) for y in b]
+                          for x in a]
+        dists = assemble((40, 30), tiles(a, b, 'distance', 'H', 16))
+        assert dists == [[Levenshtein.distance(x, y) for y in b] for x in a]
+
+def test_quantized():
+    a = ['spam', 'park', 'eggs', '']
+    q = assemble((4, 4), tiles(a, dtype='B'))
+    assert q == [[int(255 * Levenshtein.ratio(x, y) + 0.5 + 1e-9) for y in a]
+                 for x in a]
+
+def test_write_matrix(tmp_path):
+    """
+    whole matrices written to a file and to a buffer
+    """
+    rnd = random.Random(3)
+    a = random_strings(rnd, 50, 'abc', 2, 10)
+    b = random_strings(rnd, 20, 'abc', 2, 10)
+    path = tmp_path / 'matrix.u16'
+    assert write_matrix(str(path), a, b, 'distance', 'H', 8) == (50, 20)
+    m = array('H', path.read_bytes())
+    assert list(m) == [Levenshtein.distance(x, y) for x in a for y in b]
+    m = array('d', [0.0]) * (50 * 20)
+    write_matrix(m, a, b, tile_size=16)
+    assert list(m) == pytest.approx([Levenshtein.ratio(x, y)
+                                     for x in a for y in b])
+    with pytest.raises(ValueError):
+        write_matrix(bytearray(10), a, b)
+
+def test_tuned_tile_size():
+    """
+    the default tile size is the tuning parameter
+    """
+    a = random_strings(random.Random(4), 20, 'abc', 2, 10)
+    saved = Levenshtein.get_tuning()['tile_size']
+    try:
+        Levenshtein.set_tuning('tile_size', 7)
+        assert [len(rows) for rows, cols, tile in tiles(a)
+                if cols.start == 0] == [7, 7, 6]
+    finally:
+        Levenshtein.set_tuning('tile_size', saved)
+    assert saved == 1024
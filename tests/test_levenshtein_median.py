@@ -0,0 +1,87 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import random
+import pytest
+import Levenshtein
+
+def test_unicode_matches_bytes():
+    """
+    unicode medians of strings with a small alphabet give the same result
+    as the byte medians of the same strings
+    """
+    strings = ['SpSm', 'mpamm', 'Spam', 'Spa', 'Sua', 'hSam']
+    weights = [1, 2, 1, 1, 1, 0.5]
+    for f in (Levenshtein.median, Levenshtein.quickmedian):
+        expected = f([s.encode('latin1') for s in strings], weights)
+        assert f(strings, weights).encode('latin1') == expected
+    expected = Levenshtein.median_improve(
+        b'spam', [s.encode('latin1') for s in strings], weights)
+    assert Levenshtein.median_improve(
+        u'spam', strings, weights).encode('latin1') == expected
+
+def test_quickmedian_empty_strings():
+    """
+    empty strings don't vote in quickmedian
+    """
+    assert Levenshtein.quickmedian(['', 'abc', 'abd']) == 'ab'
+    assert Levenshtein.quickmedian([u'', u'ábc', u'ábd']) == u'áb'
+    assert Levenshtein.quickmedian([u'', u'']) == u''
+
+def test_median_improve_threads():
+    """
+    median_improve gives the same result however many threads evaluate
+    the perturbations
+    """
+    strings = ['spamalot', 'spamlot', 'smalot', 'spamalto', 'spameggs',
+               'pamalot', 'spmaalot']
+    weights = [1, 2, 1, 1, 0.5, 1, 3]
+    saved = Levenshtein.get_tuning()
+    try:
+        expected = [Levenshtein.median_improve(s, strings, weights)
+                    for s in ('', 'spam', 'eggsandspam')]
+        Levenshtein.set_tuning('improve_cells', 1)
+        assert [Levenshtein.median_improve(s, strings, weights)
+                for s in ('', 'spam', 'eggsandspam')] == expected
+        for threads in (1, 4):
+            before = Levenshtein.scheduler_stats()['batch']['calls']
+            assert [Levenshtein.median_improve(s, strings, weights, 0,
+                                               threads=threads,
+                                               priority='batch')
+                    for s in ('', 'spam', 'eggsandspam')] == [
+                Levenshtein.median_improve(s, strings, weights, 0)
+                for s in ('', 'spam', 'eggsandspam')]
+            after = Levenshtein.scheduler_stats()['batch']
+            assert after['calls'] == before + 3
+            assert after['running'] == 0
+    finally:
+        Levenshtein.set_tuning('improve_cells', saved['improve_cells'])
+    with pytest.raises(ValueError):
+        Levenshtein.median_improve('a', ['a'], threads=-1)
+    with pytest.raises(ValueError):
+        Levenshtein.median_improve('a', ['a'], priority='urgent')
+
+def test_median_improve_passes():
+    """
+    passes=0 gives the same median as calling median_improve() on its
+    result until it stops changing, passes=n as calling it n times
+    """
+    rnd = random.Random(11)
+    for alphabet in ('acgt', u'αβγδε'):
+        base = ''.join(rnd.choice(alphabet) for _ in range(40))
+        strings = []
+        for _ in range(12):
+            s = list(base)
+            for _ in range(8):
+                s[rnd.randrange(len(s))] = rnd.choice(alphabet)
+            del s[rnd.randrange(len(s))]
+            strings.append(''.join(s))
+        steps = [strings[0][::-1]]
+        while len(steps) < 2 or steps[-1] != steps[-2]:
+            steps.append(Levenshtein.median_improve(steps[-1], strings))
+        assert Levenshtein.median_improve(steps[0], strings, None, 0) == steps[-1]
+        for n in range(1, len(steps)):
+            assert (Levenshtein.median_improve(steps[0], strings, None, n)
+                    == steps[n])
+    with pytest.raises(ValueError):
+        Levenshtein.median_improve('a', ['a'], None, -1)
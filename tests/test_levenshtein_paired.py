@@ -0,0 +1,90 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import random
+from array import array
+import pytest
+import Levenshtein
+from helpers import random_strings
+
+def offsets(strings, typecode='i'):
+    data = ''.join(strings).encode('utf-8', 'surrogateescape')
+    o = array(typecode, [0])
+    for s in strings:
+        o.append(o[-1] + len(s.encode('utf-8', 'surrogateescape')))
+    return o, data
+
+class ArrowLike:
+    """
+    the parts of a pyarrow string array paired() uses
+    """
+    def __init__(self, strings, large=False, offset=0):
+        o, data = offsets(strings, 'q' if large else 'i')
+        self.type = 'large_string' if large else 'string'
+        self.null_count = 0
+        self.offset = offset
+        self._buffers = [None, o.tobytes(), data]
+        self._len = len(strings) - offset
+
+    def buffers(self):
+        return self._buffers
+
+    def __len__(self):
+        return self._len
+
+def test_scorers():
+    """
+    the rows are scored like the corresponding functions would, both the
+    short and the long ones
+    """
+    rnd = random.Random(1)
+    for alphabet in ['ab', 'abcdef', 'aé€b', 'αβ日本𝄞']:
+        for lo, hi in [(0, 10), (50, 120)]:
+            a = random_strings(rnd, 200, alphabet, lo, hi)
+            b = random_strings(rnd, 200, alphabet, lo, hi)
+            d = Levenshtein.paired(a, b, workers=3)
+            assert d.typecode in 'lq'
+            assert list(d) == [Levenshtein.distance(x, y) for x, y in zip(a, b)]
+            r = Levenshtein.paired(a, b, 'ratio')
+            assert r.typecode == 'd'
+            assert r.tolist() == pytest.approx(
+                [Levenshtein.ratio(x, y) for x, y in zip(a, b)])
+            h = [x[::-1] for x in a]
+            assert list(Levenshtein.paired(a, h, 'hamming')) == \
+                [Levenshtein.hamming(x, y) for x, y in zip(a, h)]
+
+def test_cutoff():
+    a = ['spam', 'park', 'spam', '']
+    b = ['spa', 'spam', 'spam', 'eggs']
+    assert list(Levenshtein.paired(a, b, score_cutoff=2)) == [1, 3, 0, 3]
+    assert Levenshtein.paired(a, b, 'ratio', score_cutoff=0.6).tolist() == \
+        pytest.approx([0.857142857, 0, 1, 0])
+
+def test_offsets():
+    """
+    offset buffers and Arrow arrays give the same scores as lists
+    """
+    a = ['spam', 'ëggs', 'x𝄞y', '', 'bacon \udcff']
+    b = ['park', 'eggs', 'xy', 'ham', 'bacon \udcfe']
+    expected = list(Levenshtein.paired(a, b))
+    assert list(Levenshtein.paired(offsets(a) + ('utf-8',), b)) == expected
+    assert list(Levenshtein.paired(offsets(a, 'q') + ('utf-8',),
+                                   offsets(b) + ('utf-8',))) == expected
+    assert list(Levenshtein.paired(ArrowLike(a), b)) == expected
+    assert list(Levenshtein.paired(ArrowLike(a, True, 1), b[1:])) == expected[1:]
+    # without encoding the data are bytes
+    ab = [s.encode('utf-8', 'surrogateescape') for s in a]
+    bb = [s.encode('utf-8', 'surrogateescape') for s in b]
+    assert list(Levenshtein.paired(offsets(a), bb)) == \
+        [Levenshtein.distance(x, y) for x, y in zip(ab, bb)]
+
+def test_errors():
+    assert len(Levenshtein.paired([], [])) == 0
+    with pytest.raises(ValueError):
+        Levenshtein.paired(['a'], ['a', 'b'])
+    with pytest.raises(TypeError):
+        Levenshtein.paired(['a'], [b'a'])
+    with pytest.raises(ValueError):
+        Levenshtein.paired(['a', 'ab'], ['b', 'a'], 'hamming')
+    with pytest.raises(ValueError):
+        Levenshtein.paired((array('i', [0, 5]), b'ab'), [b'a'])
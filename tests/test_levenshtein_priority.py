@@ -0,0 +1,89 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import random
+import threading
+import pytest
+import Levenshtein
+from Levenshtein import DeleteIndex, scheduler_stats, token_ratio_batch
+from helpers import random_strings
+
+def test_batch_priority_results():
+    """
+    batch calls running next to interactive ones give the same results and
+    are counted in their own class
+    """
+    rnd = random.Random(3)
+    rows1 = random_strings(rnd, 20000, 'abcdef', 5, 40)
+    rows2 = random_strings(rnd, 20000, 'abcdef', 5, 40)
+    expected = list(Levenshtein.paired(rows1, rows2, workers=4))
+    before = scheduler_stats()
+
+    batch = []
+    worker = threading.Thread(target=lambda: batch.extend(
+        Levenshtein.paired(rows1, rows2, workers=4, priority='batch')
+        for _ in range(5)))
+    worker.start()
+    for _ in range(5):
+        assert list(Levenshtein.paired(rows1, rows2, workers=4)) == expected
+    worker.join()
+    assert all(list(scores) == expected for scores in batch)
+
+    after = scheduler_stats()
+    assert after['batch']['calls'] >= before['batch']['calls'] + 5
+    assert after['interactive']['calls'] >= before['interactive']['calls'] + 5
+    for name in ('interactive', 'batch'):
+        assert after[name]['running'] == 0
+        assert after[name]['waiting'] == 0
+        assert after[name]['max_wait'] >= 0.0
+    assert after['interactive']['pauses'] == before['interactive']['pauses']
+
+    words = random_strings(rnd, 2000, 'abcdef', 3, 8)
+    index = DeleteIndex(words, 1, priority='batch')
+    assert index.clusters(priority='batch') == DeleteIndex(words, 1).clusters()
+    assert (token_ratio_batch('a b', ['b a', 'c'], priority='batch')
+            == token_ratio_batch('a b', ['b a', 'c']))
+
+def test_invalid_priority():
+    with pytest.raises(ValueError):
+        Levenshtein.paired(['a'], ['b'], priority='urgent')
+    with pytest.raises(ValueError):
+        DeleteIndex(['a'], priority='low')
+
+def test_single_calls_pause_batch():
+    """
+    single-thread calls count as interactive and pause batch workers
+    while they run
+    """
+    rnd = random.Random(5)
+    rows1 = random_strings(rnd, 20000, 'abcdef', 5, 40)
+    rows2 = random_strings(rnd, 20000, 'abcdef', 5, 40)
+    long1, long2 = random_strings(rnd, 2, 'abcdef', 2000, 2000)
+    words = random_strings(rnd, 2000, 'abcdef', 3, 8)
+    index = DeleteIndex(words, 1)
+    before = scheduler_stats()
+
+    done = threading.Event()
+    def batch():
+        while not done.is_set():
+            Levenshtein.paired(rows1, rows2, workers=4, priority='batch')
+    worker = threading.Thread(target=batch)
+    worker.start()
+    try:
+        for _ in range(20):
+            Levenshtein.editops(long1, long2)
+            Levenshtein.setratio(words[:200], words[200:400])
+            Levenshtein.median(words[:20])
+            index.lookup(long1[:6])
+            if scheduler_stats()['batch']['pauses'] > before['batch']['pauses']:
+                break
+    finally:
+        done.set()
+        worker.join()
+
+    after = scheduler_stats()
+    assert after['batch']['pauses'] > before['batch']['pauses']
+    assert after['interactive']['calls'] > before['interactive']['calls']
+    for name in ('interactive', 'batch'):
+        assert after[name]['running'] == 0
+        assert after[name]['waiting'] == 0
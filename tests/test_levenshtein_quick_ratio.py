@@ -0,0 +1,28 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import difflib
+import Levenshtein
+from Levenshtein.StringMatcher import StringMatcher
+
+def test_difflib_compatible():
+    """
+    the quick ratios are the same as the difflib ones
+    """
+    pairs = [('Brian', 'Jesus'), ('Thorkel', 'Thorgier'), ('', 'spam'),
+             (u'Levenšhtein', u'Lenvinšten'), ('', '')]
+    for s1, s2 in pairs:
+        sm = difflib.SequenceMatcher(None, s1, s2)
+        assert Levenshtein.quick_ratio(s1, s2) == sm.quick_ratio()
+        assert Levenshtein.real_quick_ratio(s1, s2) == sm.real_quick_ratio()
+        assert StringMatcher(None, s1, s2).quick_ratio() == sm.quick_ratio()
+
+def test_batch():
+    """
+    batch versions give the same results as the single ones
+    """
+    strings = [b'Jesus', b'Brain', b'', b'Brian']
+    assert Levenshtein.quick_ratio_batch(b'Brian', strings) == \
+        [Levenshtein.quick_ratio(b'Brian', s) for s in strings]
+    assert Levenshtein.real_quick_ratio_batch(b'Brian', strings) == \
+        [Levenshtein.real_quick_ratio(b'Brian', s) for s in strings]
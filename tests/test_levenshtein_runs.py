@@ -0,0 +1,50 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import Levenshtein
+
+def expand(runs):
+    return [(op, spos + k * (op != 'insert'), dpos + k * (op != 'delete'))
+            for op, spos, dpos, count in runs for k in range(count)]
+
+def test_same_as_editops():
+    """
+    runs are the editops, compressed
+    """
+    pairs = [('spam', 'park'), ('man', 'scotsman'), ('', 'abc'), ('abc', ''),
+             (u'Levenšhtein', u'Lenvinšten'), (b'spam and eggs', b'foo and bar')]
+    for a, b in pairs:
+        e = Levenshtein.editops(a, b)
+        r = Levenshtein.editop_runs(a, b)
+        assert expand(r) == e
+        assert Levenshtein.runs_to_editops(r, a, b) == e
+        assert Levenshtein.editop_runs(e, a, b) == r
+        assert Levenshtein.editop_runs(Levenshtein.opcodes(a, b), a, b) == r
+        assert Levenshtein.runs_to_opcodes(r, a, b) == Levenshtein.opcodes(a, b)
+        assert Levenshtein.runs_matching_blocks(r, a, b) == \
+            Levenshtein.matching_blocks(e, a, b)
+        assert expand(Levenshtein.inverse_runs(r)) == Levenshtein.inverse(e)
+        assert Levenshtein.apply_runs(r, a, b) == b
+
+def test_partial():
+    """
+    partial runs apply and subtract like editops
+    """
+    a, b = 'man', 'scotsman'
+    r = Levenshtein.editop_runs(a, b)
+    assert r == [('insert', 0, 0, 5)]
+    part = [('insert', 0, 0, 3)]
+    bastard = Levenshtein.apply_runs(part, a, b)
+    assert bastard == Levenshtein.apply_edit(expand(part), a, b)
+    rem = Levenshtein.subtract_runs(r, part)
+    assert expand(rem) == Levenshtein.subtract_edit(expand(r), expand(part))
+    assert Levenshtein.apply_runs(rem, bastard, b) == b
+
+def test_long_block():
+    """
+    a long block is one run
+    """
+    b = 'x' * 100000
+    r = Levenshtein.editop_runs(Levenshtein.opcodes('', b), '', b)
+    assert r == [('insert', 0, 0, 100000)]
+    assert Levenshtein.apply_runs(r, '', b) == b
@@ -0,0 +1,100 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import os
+import socket
+import threading
+import pytest
+import Levenshtein
+from Levenshtein.server import Server, Client, _encode, _decode
+
+pytestmark = pytest.mark.skipif(not hasattr(socket, 'AF_UNIX'),
+                                reason="needs Unix domain sockets")
+
+WORDS = ['spam', 'spar', 'park', 'eggs', 'legs', 'bacon']
+
+@pytest.fixture
+def server(tmp_path):
+    server = Server(str(tmp_path / 'lev.sock'), {'words': WORDS}, 2, 2, 4)
+    thread = threading.Thread(target=server.serve_forever)
+    thread.start()
+    assert server.ready.wait(10)
+    yield server
+    server.shutdown()
+    thread.join()
+    assert not os.path.exists(server.path)
+
+def test_encoding():
+    values = [None, True, 3, -2**63, 0.5, 'ž\udc80', b'\0x', [], ['a', 'é'],
+              [b'a', b''], [1, ('x', 2.0), ['y', b'z']]]
+    out = bytearray()
+    _encode(values, out)
+    assert _decode(out) == (values, len(out))
+
+def test_requests(server):
+    """
+    the server computes what the functions do, also for many concurrent
+    clients whose requests are coalesced
+    """
+    a = ['spam', 'litter bin', 'tinny'] * 20
+    b = ['park', 'sausage', 'gorn'] * 20
+    with Client(server.path) as client:
+        assert client.corpora() == {'words': 6}
+        index = Levenshtein.DeleteIndex(WORDS, 2)
+        assert client.extract('words', ['spak', 'xxxxxx'], limit=2) == [
+            index.lookup('spak')[:2], []]
+        assert client.extract('words', ['legs eggs'], scorer='token_set',
+                              limit=1) == [
+            [(WORDS[i], score) for i, score in
+             Levenshtein.token_ratio_best('legs eggs', WORDS, 1, 'set')]]
+        assert client.median(['SpSm', 'mpamm', 'Spam', 'Spa', 'Sua']) == \
+            Levenshtein.median(['SpSm', 'mpamm', 'Spam', 'Spa', 'Sua'])
+
+    results = [None] * 16
+    def worker(i):
+        with Client(server.path) as client:
+            results[i] = (client.distance(a[i:], b[i:]),
+                          client.ratio(a[i:], b[i:]))
+    threads = [threading.Thread(target=worker, args=(i,)) for i in range(16)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    for i in range(16):
+        assert results[i] == (list(Levenshtein.paired(a[i:], b[i:])),
+                              list(Levenshtein.paired(a[i:], b[i:], 'ratio')))
+
+def test_errors(server):
+    with Client(server.path) as client:
+        with pytest.raises(KeyError):
+            client.extract('nothing', ['spam'])
+        with pytest.raises(ValueError):
+            client.distance(['a', 'b'], ['a'])
+        with pytest.raises(ValueError):
+            client.call('frobnicate')
+        # the connection survives errors
+        assert client.distance(['spam'], ['park']) == [3]
+
+def test_idle_connections(tmp_path):
+    """
+    idle connections don't take the in-flight slots of active ones
+    """
+    server = Server(str(tmp_path / 'lev.sock'), {'words': WORDS}, 2, 2, 2)
+    thread = threading.Thread(target=server.serve_forever)
+    thread.start()
+    assert server.ready.wait(10)
+    try:
+        idle = []
+        for _ in range(4):
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            sock.connect(server.path)
+            idle.append(sock)
+        with Client(server.path, timeout=10) as client:
+            for _ in range(5):
+                assert client.distance(['spam'], ['park']) == [3]
+            assert client.call('ping') is None
+        for sock in idle:
+            sock.close()
+    finally:
+        server.shutdown()
+        thread.join()
@@ -0,0 +1,108 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import random
+
+import Levenshtein
+
+def test_documented_examples():
+    """
+    the examples from the docstrings
+    """
+    a = ['newspaper', 'litter bin', 'tinny', 'antelope']
+    b = ['caribou', 'sausage', 'gorn', 'woody']
+    assert abs(Levenshtein.seqratio(a, b) - 0.21517857142857144) < 1e-12
+    assert abs(Levenshtein.setratio(a, b) - 0.2818452380952381) < 1e-12
+
+def test_single_item_matches_ratio():
+    """
+    a one item set/sequence is compared exactly like ratio(), this covers
+    strings of both short and long (multiple machine words) patterns
+    """
+    pairs = [
+        ("spam", "park"),
+        ("a" * 70 + "spam" + "b" * 70, "b" * 71 + "park" + "a" * 69),
+        (u"ÁÄ" * 50 + u"Levenshtein", u"Lenvinsten" + u"ÄÁ€" * 40),
+    ]
+    for s1, s2 in pairs:
+        r = Levenshtein.ratio(s1, s2)
+        assert abs(Levenshtein.setratio([s1], [s2]) - r) < 1e-12
+        assert abs(Levenshtein.seqratio([s1], [s2]) - r) < 1e-12
+        b1, b2 = s1.encode("utf8"), s2.encode("utf8")
+        r = Levenshtein.ratio(b1, b2)
+        assert abs(Levenshtein.setratio([b1], [b2]) - r) < 1e-12
+
+def test_empty_strings():
+    """
+    empty strings are perfect matches of each other and don't shift the
+    remaining items
+    """
+    assert Levenshtein.seqratio(['', 'spam'], ['', 'spam']) == 1.0
+    assert Levenshtein.setratio(['', 'spam'], ['spam', '']) == 1.0
+    assert Levenshtein.seqratio(['', 'ab'], ['', 'ab', 'cd']) == 0.8
+
+def test_repeated_strings():
+    """
+    sets with repeated strings give the optimal assignment
+    """
+    import itertools
+
+    def brute_force(a, b):
+        if len(a) > len(b):
+            a, b = b, a
+        best = min(sum(2.0 * (1.0 - Levenshtein.ratio(x, b[i]))
+                       for x, i in zip(a, perm))
+                   for perm in itertools.permutations(range(len(b)), len(a)))
+        n = len(a) + len(b)
+        return (n - best - (len(b) - len(a))) / n
+
+    cases = [
+        (['red', 'red', 'red', 'shirt'], ['shirt', 'red', 'reed', 'rod']),
+        (['x', 'x', 'y'], ['y', 'y', 'x', 'x', 'z']),
+        (['ab', 'ab', 'ab'], ['ba', 'ab']),
+        (['', '', 'ab'], ['', 'ab', 'ab']),
+    ]
+    for a, b in cases:
+        assert abs(Levenshtein.setratio(a, b) - brute_force(a, b)) < 1e-12
+
+    # the same assignment and the same sum as without repeated strings,
+    # to the last bit
+    a = [b't', b'g', b'a', b'g', b'g']
+    b = [b'g', b'tta', b'c', b'g', b'c', b'gg']
+    assert Levenshtein.setratio(a, b) == 0.5757575757575758
+    assert Levenshtein.setratio([s.decode() for s in a],
+                                [s.decode() for s in b]) == 0.5757575757575758
+
+def test_seq_opcodes():
+    """
+    the alignment costs exactly what seqratio() computes and transforms
+    the first sequence to the second one
+    """
+    rnd = random.Random(7)
+    words = ['spam', 'eggs', 'ham', 'bacon', 'spma', '', 'sausage', 'egg']
+    for _ in range(300):
+        a = [rnd.choice(words) for _ in range(rnd.randint(0, 12))]
+        b = [rnd.choice(words) for _ in range(rnd.randint(0, 12))]
+        ops = Levenshtein.seq_opcodes(a, b)
+        result, cost = [], 0.0
+        for op, i1, i2, j1, j2 in ops:
+            result += b[j1:j2]
+            if op == 'equal':
+                assert a[i1:i2] == b[j1:j2]
+            elif op == 'replace':
+                assert i2 - i1 == j2 - j1
+                cost += sum(2 * (1 - Levenshtein.ratio(x, y))
+                            for x, y in zip(a[i1:i2], b[j1:j2]))
+            else:
+                cost += i2 - i1 + j2 - j1
+        assert result == b
+        lensum = len(a) + len(b)
+        expected = lensum * (1 - Levenshtein.seqratio(a, b)) if lensum else 0
+        assert abs(cost - expected) < 1e-9
+        assert Levenshtein.seq_opcodes([s.encode() for s in a],
+                                       [s.encode() for s in b]) == ops
+        r = Levenshtein.seqratio(a, b)
+        if r > 0.05:
+            assert Levenshtein.seq_opcodes(a, b, r - 0.01) == ops
+        if r < 0.95:
+            assert Levenshtein.seq_opcodes(a, b, r + 0.01) is None
@@ -0,0 +1,24 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import Levenshtein
+from Levenshtein.sketch import SketchIndex, cgk_sketch
+
+def test_sketch():
+    """
+    sketches have the requested size and equal strings equal sketches
+    """
+    assert len(cgk_sketch('Levenshtein', 33, 4)) == 132
+    assert cgk_sketch(u'Levenšhtein', 33, 4) == cgk_sketch(u'Levenšhtein', 33, 4)
+    assert cgk_sketch('Levenshtein', 33, 4, 1) != cgk_sketch('Levenshtein', 33, 4, 2)
+
+def test_search():
+    """
+    the re-ranked results carry exact distances, ties keep the index order
+    """
+    strings = ['Levenshtein', 'Lenvinsten', 'Levensthein', 'spam', 'eggs']
+    index = SketchIndex(strings)
+    assert index.search('Levenshtein', 1) == [('Levenshtein', 0)]
+    found = index.search('Levenshten', 3, candidates=len(strings))
+    assert found == [(s, Levenshtein.distance('Levenshten', s))
+                     for s in ['Levenshtein', 'Lenvinsten', 'Levensthein']]
@@ -0,0 +1,55 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import random
+import Levenshtein
+
+# characters above 0xff keep the strings on the generic engines
+WIDE = {c: chr(0x100 + i) for i, c in enumerate('ACGTNRYKMSWBDHVX')}
+
+def widen(s):
+    return ''.join(WIDE[c] for c in s)
+
+def mutate(rnd, s, alphabet, k):
+    s = list(s)
+    for _ in range(k):
+        p = rnd.randrange(len(s) + 1)
+        if p == len(s) or rnd.random() < 0.3:
+            s.insert(p, rnd.choice(alphabet))
+        elif rnd.random() < 0.5:
+            del s[p]
+        else:
+            s[p] = rnd.choice(alphabet)
+    return ''.join(s)
+
+def test_packed_engines():
+    """
+    strings over 2 to 16 different characters give exactly the edit
+    sequences and set medians of the generic engines
+    """
+    rnd = random.Random(7)
+    for alphabet in ['AC', 'ACGT', 'ACGTN', 'ACGTNRYKMSWBDHVX']:
+        for length in [1, 5, 63, 64, 65, 200]:
+            a = ''.join(rnd.choice(alphabet) for _ in range(length))
+            b = mutate(rnd, a, alphabet, rnd.randint(0, length))
+            ops = Levenshtein.editops(a, b)
+            assert ops == Levenshtein.editops(widen(a), widen(b))
+            assert ops == Levenshtein.editops(a.encode(), b.encode())
+            assert len(ops) == Levenshtein.distance(a, b)
+            strings = [mutate(rnd, a, alphabet, 3) for _ in range(5)]
+            assert (widen(Levenshtein.setmedian(strings))
+                    == Levenshtein.setmedian([widen(s) for s in strings]))
+
+def test_quickmedian_votes():
+    """
+    the small vote table elects the same symbols as the full one, strings of
+    zero weight only widen the alphabet
+    """
+    rnd = random.Random(8)
+    for alphabet in ['ACGT', 'ACGTN']:
+        a = ''.join(rnd.choice(alphabet) for _ in range(80))
+        strings = [mutate(rnd, a, alphabet, 10) for _ in range(7)]
+        weights = [rnd.random() for _ in strings]
+        assert (Levenshtein.quickmedian(strings, weights)
+                == Levenshtein.quickmedian(strings + ['0123456789!#$%&()*+'],
+                                           weights + [0.0]))
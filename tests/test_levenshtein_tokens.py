@@ -0,0 +1,60 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import random
+import Levenshtein
+
+def random_phrase(rnd, alphabet):
+    words = [''.join(rnd.choice(alphabet) for _ in range(rnd.randint(1, 5)))
+             for _ in range(rnd.randint(0, 6))]
+    return ''.join(w + rnd.choice([' ', '  ', '\t', '\n', u'\xa0', u'　'])
+                   for w in words)
+
+def test_same_as_split():
+    """
+    token ratios are the plain ones of the split strings
+    """
+    rnd = random.Random(1)
+    for _ in range(500):
+        alphabet = rnd.choice(['abc', u'aé€𝄞'])
+        a = random_phrase(rnd, alphabet)
+        b = random_phrase(rnd, alphabet)
+        for x, y in [(a, b), (a.encode(), b.encode())]:
+            sx, sy = x.split(), y.split()
+            space = b' ' if isinstance(x, bytes) else ' '
+            joined = [space.join(sorted(sx)), space.join(sorted(sy))]
+            assert (Levenshtein.token_sort_ratio(x, y)
+                    == Levenshtein.paired(joined[:1], joined[1:], 'ratio')[0])
+            assert (Levenshtein.token_set_ratio(x, y)
+                    == Levenshtein.setratio(sorted(set(sx)), sorted(set(sy))))
+            assert (Levenshtein.token_seqratio(x, y)
+                    == Levenshtein.seqratio(sx, sy))
+    assert Levenshtein.token_sort_ratio('new york mets', 'mets new york') == 1.0
+    assert Levenshtein.token_set_ratio('', ' ') == 1.0
+
+def test_batch_and_best():
+    """
+    batches and the best matches agree with the pairwise ratios
+    """
+    rnd = random.Random(2)
+    query = random_phrase(rnd, 'abcdef')
+    choices = [random_phrase(rnd, 'abcdef') for _ in range(2000)]
+    for scorer, func in [('sort', Levenshtein.token_sort_ratio),
+                         ('set', Levenshtein.token_set_ratio),
+                         ('seq', Levenshtein.token_seqratio)]:
+        expected = [func(query, c) for c in choices]
+        ranked = sorted(range(len(choices)), key=lambda i: (-expected[i], i))
+        for threads in (1, 3):
+            assert (Levenshtein.token_ratio_batch(query, choices, scorer,
+                                                  threads) == expected)
+            assert (Levenshtein.token_ratio_batch(query, choices, scorer,
+                                                  threads, 0.5)
+                    == [r if r >= 0.5 else 0.0 for r in expected])
+            assert (Levenshtein.token_ratio_best(query, choices, 7, scorer,
+                                                 threads)
+                    == [(i, expected[i]) for i in ranked[:7]])
+            assert (Levenshtein.token_ratio_best(query, choices, 5000, scorer,
+                                                 threads, 0.6)
+                    == [(i, expected[i]) for i in ranked if expected[i] >= 0.6])
+    assert Levenshtein.token_ratio_batch(query, []) == []
+    assert Levenshtein.token_ratio_best(query, [], 3) == []
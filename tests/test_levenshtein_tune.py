@@ -0,0 +1,31 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+import pytest
+import Levenshtein
+
+def test_results_unchanged():
+    """
+    tuning parameters only change speed
+    """
+    a = ['ab' * 150 + 'c', 'ba' * 170, 'abc' * 90]
+    b = ['ba' * 150, 'abc' * 100 + 'a', 'cab' * 70]
+    saved = Levenshtein.get_tuning()
+    expected = Levenshtein.setratio(a, b)
+    try:
+        for interval in (1, 7, 1000):
+            Levenshtein.set_tuning('lcs_cutoff_interval', interval)
+            assert Levenshtein.setratio(a, b) == expected
+    finally:
+        Levenshtein.set_tuning('lcs_cutoff_interval',
+                               saved['lcs_cutoff_interval'])
+    assert Levenshtein.get_tuning() == saved
+
+def test_invalid():
+    """
+    unknown parameters and zero values are rejected
+    """
+    with pytest.raises(ValueError):
+        Levenshtein.set_tuning('no_such_parameter', 1)
+    with pytest.raises(ValueError):
+        Levenshtein.set_tuning('sketch_chunk', 0)